@@ -0,0 +1,777 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Throughput benchmark of bsdiff, bspatch, merkle tree generation and
+ * payload verification. Every measurement runs in a child process so that
+ * the reported peak RSS belongs to that measurement alone. The results are
+ * written as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <bpak/bpak.h>
+#include <bpak/id.h>
+#include <bpak/bsdiff.h>
+#include <bpak/bspatch.h>
+#include <bpak/merkle.h>
+#include <bpak/verify.h>
+#include <bpak/version.h>
+
+#define BENCH_CHUNK_LENGTH (64 * 1024)
+
+struct bench_corpus {
+    const char *name;
+    uint8_t *origin;
+    size_t origin_length;
+    uint8_t *target;
+    size_t target_length;
+};
+
+struct bench_result {
+    int rc;
+    double seconds;
+    size_t output_length; /*!< Patch length of an encode */
+};
+
+/* Patch stream of an encode, in memory that is shared with the child */
+struct bench_patch {
+    uint8_t *data;
+    size_t capacity;
+    size_t length;
+};
+
+static const struct {
+    const char *name;
+    enum bpak_compression compression;
+} bench_compressions[] = {
+    { "none", BPAK_COMPRESSION_NONE },
+    { "heatshrink", BPAK_COMPRESSION_HS },
+#if BPAK_CONFIG_LZMA == 1
+    { "lzma", BPAK_COMPRESSION_LZMA },
+#endif
+};
+
+static FILE *json;
+static bool first_result = true;
+static unsigned int bench_jobs = 1;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/* Compressible data from a small alphabet with repeated 'words', roughly
+ * like code and tables in a firmware image */
+static void fill_synthetic(uint8_t *buf, size_t length, uint64_t seed)
+{
+    uint64_t state = seed;
+    size_t pos = 0;
+
+    while (pos < length) {
+        uint64_t r = xorshift(&state);
+        size_t word = 4 + (r & 15);
+
+        for (size_t i = 0; (i < word) && (pos < length); i++)
+            buf[pos++] = 0x20 + ((r >> (8 + (i % 8) * 4)) & 0x1f);
+    }
+}
+
+/* The target is the origin with changed, inserted and removed bytes */
+static size_t make_synthetic_target(const uint8_t *origin, size_t length,
+                                    uint8_t *target)
+{
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t in = 0;
+    size_t out = 0;
+
+    while ((in < length) && (out < length)) {
+        size_t run = 32768 + (xorshift(&state) & 0x7fff);
+        uint64_t edit = xorshift(&state) % 3;
+
+        run = BPAK_MIN(run, BPAK_MIN(length - in, length - out));
+        memcpy(&target[out], &origin[in], run);
+        in += run;
+        out += run;
+
+        if (edit == 0) {
+            /* Changed bytes */
+            for (size_t i = 0; (i < 64) && (out + i < length); i++)
+                target[out + i] ^= xorshift(&state) & 0xff;
+        } else if (edit == 1) {
+            /* Inserted bytes */
+            size_t n = BPAK_MIN(100, length - out);
+
+            fill_synthetic(&target[out], n, xorshift(&state));
+            out += n;
+        } else {
+            /* Removed bytes */
+            in += 50;
+        }
+    }
+
+    return out;
+}
+
+static int load_file(const char *dir, const char *name, uint8_t **data,
+                     size_t *length)
+{
+    char path[1024];
+    FILE *fp;
+    long size;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Could not open '%s'\n", path);
+        return -BPAK_FILE_NOT_FOUND;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    *data = malloc(size);
+
+    if ((*data == NULL) || (fread(*data, 1, size, fp) != (size_t)size)) {
+        free(*data);
+        fclose(fp);
+        return -BPAK_READ_ERROR;
+    }
+
+    *length = size;
+    fclose(fp);
+    return BPAK_OK;
+}
+
+/* Repeat 'src' up to 'length' bytes, each copy has one byte changed so
+ * that the copies are not identical */
+static uint8_t *tile(const uint8_t *src, size_t src_length, size_t length)
+{
+    uint8_t *buf = malloc(length);
+
+    if (buf == NULL)
+        return NULL;
+
+    for (size_t pos = 0, n = 0; pos < length; pos += src_length, n++) {
+        size_t count = BPAK_MIN(src_length, length - pos);
+
+        memcpy(&buf[pos], src, count);
+        buf[pos + (n * 7919) % count] ^= n & 0xff;
+    }
+
+    return buf;
+}
+
+static int corpus_synthetic(struct bench_corpus *corpus, size_t length)
+{
+    corpus->name = "synthetic";
+    corpus->origin = malloc(length);
+    corpus->target = malloc(length);
+
+    if ((corpus->origin == NULL) || (corpus->target == NULL))
+        return -BPAK_FAILED;
+
+    fill_synthetic(corpus->origin, length, 0x2545f4914f6cdd1dULL);
+    corpus->origin_length = length;
+    corpus->target_length =
+        make_synthetic_target(corpus->origin, length, corpus->target);
+    return BPAK_OK;
+}
+
+static int corpus_tiled(struct bench_corpus *corpus, const char *dir,
+                        const char *name, size_t length)
+{
+    int rc;
+    char fn[64];
+    uint8_t *origin = NULL;
+    uint8_t *target = NULL;
+    size_t origin_length;
+    size_t target_length;
+
+    snprintf(fn, sizeof(fn), "%s_origin.bin", name);
+    rc = load_file(dir, fn, &origin, &origin_length);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    snprintf(fn, sizeof(fn), "%s_target.bin", name);
+    rc = load_file(dir, fn, &target, &target_length);
+
+    if (rc != BPAK_OK) {
+        free(origin);
+        return rc;
+    }
+
+    corpus->name = name;
+    corpus->origin = tile(origin, origin_length, length);
+    corpus->origin_length = length;
+    corpus->target = tile(target, target_length, length);
+    corpus->target_length = length;
+
+    free(origin);
+    free(target);
+
+    if ((corpus->origin == NULL) || (corpus->target == NULL))
+        return -BPAK_FAILED;
+
+    return BPAK_OK;
+}
+
+static void corpus_free(struct bench_corpus *corpus)
+{
+    free(corpus->origin);
+    free(corpus->target);
+    memset(corpus, 0, sizeof(*corpus));
+}
+
+/* Run 'fn' in a child process and collect its result and peak RSS */
+static int run_isolated(int (*fn)(struct bench_corpus *, int, void *,
+                                  struct bench_result *),
+                        struct bench_corpus *corpus, int compression,
+                        void *arg, struct bench_result *result,
+                        long *peak_rss_kib)
+{
+    int fds[2];
+    int status;
+    pid_t pid;
+    struct rusage usage;
+
+    if (pipe(fds) != 0)
+        return -BPAK_FAILED;
+
+    pid = fork();
+
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -BPAK_FAILED;
+    }
+
+    if (pid == 0) {
+        struct bench_result r;
+
+        close(fds[0]);
+        memset(&r, 0, sizeof(r));
+        r.rc = fn(corpus, compression, arg, &r);
+
+        if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+            _exit(1);
+
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    if (read(fds[0], result, sizeof(*result)) != sizeof(*result))
+        result->rc = -BPAK_FAILED;
+
+    close(fds[0]);
+
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR)
+            return -BPAK_FAILED;
+    }
+
+    *peak_rss_kib = usage.ru_maxrss;
+    return result->rc;
+}
+
+static ssize_t patch_write(off_t offset, uint8_t *buffer, size_t length,
+                           void *user)
+{
+    struct bench_patch *patch = (struct bench_patch *)user;
+
+    if ((offset < 0) || ((size_t)offset + length > patch->capacity))
+        return -BPAK_WRITE_ERROR;
+
+    memcpy(&patch->data[offset], buffer, length);
+
+    if ((size_t)offset + length > patch->length)
+        patch->length = offset + length;
+
+    return length;
+}
+
+static int bench_bsdiff(struct bench_corpus *corpus, int compression,
+                        void *arg, struct bench_result *result)
+{
+    int rc;
+    ssize_t patch_length;
+    double start;
+    struct bpak_bsdiff_context ctx;
+    struct bench_patch *patch = (struct bench_patch *)arg;
+    struct bpak_bsdiff_options options = {
+        .jobs = bench_jobs,
+    };
+
+    start = now();
+    patch->length = 0;
+
+    rc = bpak_bsdiff_init_opts(&ctx,
+                               corpus->origin,
+                               corpus->origin_length,
+                               corpus->target,
+                               corpus->target_length,
+                               patch_write,
+                               0,
+                               compression,
+                               &options,
+                               patch);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    patch_length = bpak_bsdiff(&ctx);
+    bpak_bsdiff_free(&ctx);
+
+    if (patch_length < 0)
+        return (int)patch_length;
+
+    result->seconds = now() - start;
+    result->output_length = patch_length;
+    patch->length = patch_length;
+    return BPAK_OK;
+}
+
+static int bench_bspatch(struct bench_corpus *corpus, int compression,
+                         void *arg, struct bench_result *result)
+{
+    int rc;
+    ssize_t output_length;
+    double start;
+    struct bpak_bspatch_context ctx;
+    struct bench_patch *patch = (struct bench_patch *)arg;
+    uint8_t *buffer = malloc(BENCH_CHUNK_LENGTH);
+    uint8_t *output = malloc(corpus->target_length);
+
+    if ((buffer == NULL) || (output == NULL)) {
+        rc = -BPAK_FAILED;
+        goto err_free_out;
+    }
+
+    start = now();
+
+    rc = bpak_bspatch_init_mapped(&ctx,
+                                  buffer,
+                                  BENCH_CHUNK_LENGTH,
+                                  patch->length,
+                                  corpus->origin,
+                                  corpus->origin_length,
+                                  output,
+                                  corpus->target_length,
+                                  compression);
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    for (size_t pos = 0; pos < patch->length; pos += BENCH_CHUNK_LENGTH) {
+        rc = bpak_bspatch_write(&ctx,
+                                &patch->data[pos],
+                                BPAK_MIN(BENCH_CHUNK_LENGTH,
+                                         patch->length - pos));
+
+        if (rc != BPAK_OK)
+            break;
+    }
+
+    output_length = bpak_bspatch_final(&ctx);
+    bpak_bspatch_free(&ctx);
+    result->seconds = now() - start;
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    if ((output_length != (ssize_t)corpus->target_length) ||
+        (memcmp(output, corpus->target, corpus->target_length) != 0)) {
+        fprintf(stderr, "Error: %s patch output differs\n", corpus->name);
+        rc = -BPAK_PATCH_WRITE_ERROR;
+    }
+
+err_free_out:
+    free(output);
+    free(buffer);
+    return rc;
+}
+
+struct bench_memory {
+    uint8_t *data;
+    size_t length;
+};
+
+static ssize_t memory_write(off_t offset, uint8_t *buffer, size_t length,
+                            void *user)
+{
+    struct bench_memory *mem = (struct bench_memory *)user;
+
+    if ((offset < 0) || ((size_t)offset + length > mem->length))
+        return -BPAK_WRITE_ERROR;
+
+    memcpy(&mem->data[offset], buffer, length);
+    return length;
+}
+
+static ssize_t memory_read(off_t offset, uint8_t *buffer, size_t length,
+                           void *user)
+{
+    struct bench_memory *mem = (struct bench_memory *)user;
+
+    if ((offset < 0) || ((size_t)offset + length > mem->length))
+        return -BPAK_READ_ERROR;
+
+    memcpy(buffer, &mem->data[offset], length);
+    return length;
+}
+
+static int bench_merkle(struct bench_corpus *corpus, int compression,
+                        void *arg, struct bench_result *result)
+{
+    int rc;
+    double start;
+    struct bpak_merkle_context ctx;
+    bpak_merkle_hash_t salt;
+    bpak_merkle_hash_t root;
+    struct bench_memory tree;
+    /* The tree covers whole blocks */
+    size_t length = corpus->target_length & ~(BPAK_MERKLE_BLOCK_SZ - 1);
+    ssize_t tree_size = bpak_merkle_compute_size(length);
+
+    (void)compression;
+    (void)arg;
+
+    if (tree_size < 0)
+        return (int)tree_size;
+
+    memset(salt, 0xa5, sizeof(salt));
+    tree.length = tree_size;
+    tree.data = calloc(1, tree.length);
+
+    if (tree.data == NULL)
+        return -BPAK_FAILED;
+
+    start = now();
+
+    rc = bpak_merkle_init(&ctx,
+                          length,
+                          salt,
+                          sizeof(salt),
+                          memory_write,
+                          memory_read,
+                          0,
+                          true,
+                          &tree);
+
+    if (rc == BPAK_OK)
+        rc = bpak_merkle_set_jobs(&ctx, bench_jobs);
+
+    for (size_t pos = 0; (rc == BPAK_OK) && (pos < length);
+         pos += BENCH_CHUNK_LENGTH) {
+        rc = bpak_merkle_write_chunk(&ctx,
+                                     &corpus->target[pos],
+                                     BPAK_MIN(BENCH_CHUNK_LENGTH,
+                                              length - pos));
+    }
+
+    if (rc == BPAK_OK)
+        rc = bpak_merkle_finish(&ctx, root);
+
+    result->seconds = now() - start;
+    free(tree.data);
+    return rc;
+}
+
+static int bench_verify(struct bench_corpus *corpus, int compression,
+                        void *arg, struct bench_result *result)
+{
+    int rc;
+    double start;
+    struct bpak_header header;
+    struct bpak_part_header *part = NULL;
+    struct bench_memory payload;
+    size_t hash_length = sizeof(header.payload_hash);
+
+    (void)compression;
+    (void)arg;
+
+    payload.data = corpus->target;
+    payload.length = corpus->target_length;
+
+    bpak_init_header(&header);
+    header.hash_kind = BPAK_HASH_SHA256;
+
+    rc = bpak_add_part(&header, bpak_id("bench"), &part);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    part->size = corpus->target_length;
+    part->offset = sizeof(header);
+
+    rc = bpak_verify_compute_payload_hash(&header,
+                                          memory_read,
+                                          0,
+                                          &payload,
+                                          header.payload_hash,
+                                          &hash_length);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    start = now();
+    rc = bpak_verify_payload_parallel(&header,
+                                      memory_read,
+                                      0,
+                                      &payload,
+                                      bench_jobs);
+    result->seconds = now() - start;
+    return rc;
+}
+
+static void report(const struct bench_corpus *corpus, const char *bench,
+                   const char *compression, size_t input_length,
+                   const struct bench_result *result, long peak_rss_kib)
+{
+    double mbps = 0.0;
+
+    if (result->seconds > 0.0)
+        mbps = input_length / result->seconds / (1024.0 * 1024.0);
+
+    fprintf(json,
+            "%s\n    {\"corpus\": \"%s\", \"size\": %zu, \"bench\": \"%s\", "
+            "\"compression\": \"%s\", \"seconds\": %.6f, \"mbps\": %.2f, "
+            "\"peak_rss_kib\": %ld",
+            first_result ? "" : ",",
+            corpus->name,
+            corpus->target_length,
+            bench,
+            compression,
+            result->seconds,
+            mbps,
+            peak_rss_kib);
+
+    if (result->output_length > 0) {
+        fprintf(json,
+                ", \"patch_size\": %zu, \"patch_ratio\": %.6f",
+                result->output_length,
+                (double)result->output_length / corpus->target_length);
+    }
+
+    fprintf(json, "}");
+    first_result = false;
+
+    fprintf(stderr,
+            "%-10s %10zu %-8s %-10s %8.2f MB/s %8ld KiB\n",
+            corpus->name,
+            corpus->target_length,
+            bench,
+            compression,
+            mbps,
+            peak_rss_kib);
+}
+
+static int bench_corpus(struct bench_corpus *corpus)
+{
+    int rc;
+    long rss;
+    struct bench_result result;
+    struct bench_patch *patch;
+    size_t capacity = 2 * corpus->target_length + 1024 * 1024;
+
+    /* The patch is written by the encode child and read by the decode
+     * child, it lives in a shared mapping */
+    patch = mmap(NULL,
+                 sizeof(*patch) + capacity,
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS,
+                 -1,
+                 0);
+
+    if (patch == MAP_FAILED)
+        return -BPAK_FAILED;
+
+    patch->data = (uint8_t *)&patch[1];
+    patch->capacity = capacity;
+
+    for (size_t i = 0;
+         i < sizeof(bench_compressions) / sizeof(bench_compressions[0]);
+         i++) {
+        const char *name = bench_compressions[i].name;
+        int compression = bench_compressions[i].compression;
+
+        memset(&result, 0, sizeof(result));
+        rc = run_isolated(bench_bsdiff, corpus, compression, patch, &result,
+                          &rss);
+
+        if (rc != BPAK_OK)
+            goto err_unmap_out;
+
+        report(corpus, "bsdiff", name, corpus->target_length, &result, rss);
+
+        memset(&result, 0, sizeof(result));
+        rc = run_isolated(bench_bspatch, corpus, compression, patch, &result,
+                          &rss);
+
+        if (rc != BPAK_OK)
+            goto err_unmap_out;
+
+        report(corpus, "bspatch", name, corpus->target_length, &result, rss);
+    }
+
+    memset(&result, 0, sizeof(result));
+    rc = run_isolated(bench_merkle, corpus, 0, NULL, &result, &rss);
+
+    if (rc != BPAK_OK)
+        goto err_unmap_out;
+
+    report(corpus, "merkle", "none", corpus->target_length, &result, rss);
+
+    memset(&result, 0, sizeof(result));
+    rc = run_isolated(bench_verify, corpus, 0, NULL, &result, &rss);
+
+    if (rc != BPAK_OK)
+        goto err_unmap_out;
+
+    report(corpus, "verify", "none", corpus->target_length, &result, rss);
+
+err_unmap_out:
+    munmap(patch, sizeof(*patch) + capacity);
+    return rc;
+}
+
+static void print_usage(void)
+{
+    printf("bpak_bench [options]\n");
+    printf("\n");
+    printf("    -c, --corpus-dir <dir>   Directory with diffN_origin.bin and\n"
+           "                             diffN_target.bin, the test folder\n");
+    printf("    -s, --sizes <list>       Comma separated sizes in KiB, "
+           "default 1024,16384\n");
+    printf("    -o, --output <file>      JSON output, default stdout\n");
+    printf("    -j, --jobs <n>           Threads for bsdiff, merkle and "
+           "verify\n");
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int rc = BPAK_OK;
+    int long_index = 0;
+    const char *corpus_dir = NULL;
+    const char *output = NULL;
+    char sizes_default[] = "1024,16384";
+    char *sizes = sizes_default;
+    const char *tiled[] = { "diff2", "diff3", "diff4" };
+
+    struct option long_options[] = {
+        { "help", no_argument, 0, 'h' },
+        { "corpus-dir", required_argument, 0, 'c' },
+        { "sizes", required_argument, 0, 's' },
+        { "output", required_argument, 0, 'o' },
+        { "jobs", required_argument, 0, 'j' },
+        { 0, 0, 0, 0 },
+    };
+
+    while ((opt = getopt_long(argc, argv, "hc:s:o:j:", long_options,
+                              &long_index)) != -1) {
+        switch (opt) {
+        case 'h':
+            print_usage();
+            return 0;
+        case 'c':
+            corpus_dir = optarg;
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'j':
+            bench_jobs = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            print_usage();
+            return -1;
+        }
+    }
+
+    json = (output != NULL) ? fopen(output, "w") : stdout;
+
+    if (json == NULL) {
+        fprintf(stderr, "Error: Could not open '%s'\n", output);
+        return -1;
+    }
+
+    fprintf(json,
+            "{\n  \"version\": \"%s\",\n  \"jobs\": %u,\n  \"results\": [",
+            BPAK_VERSION_STRING,
+            bench_jobs);
+
+    for (char *s = strtok(sizes, ","); (s != NULL) && (rc == BPAK_OK);
+         s = strtok(NULL, ",")) {
+        size_t length = strtoul(s, NULL, 0) * 1024;
+        struct bench_corpus corpus;
+
+        if (length == 0)
+            continue;
+
+        memset(&corpus, 0, sizeof(corpus));
+        rc = corpus_synthetic(&corpus, length);
+
+        if (rc == BPAK_OK)
+            rc = bench_corpus(&corpus);
+
+        corpus_free(&corpus);
+
+        for (size_t i = 0; (corpus_dir != NULL) && (rc == BPAK_OK) &&
+                           (i < sizeof(tiled) / sizeof(tiled[0]));
+             i++) {
+            rc = corpus_tiled(&corpus, corpus_dir, tiled[i], length);
+
+            if (rc == BPAK_OK)
+                rc = bench_corpus(&corpus);
+
+            corpus_free(&corpus);
+        }
+    }
+
+    fprintf(json, "\n  ]\n}\n");
+
+    if (json != stdout)
+        fclose(json);
+
+    if (rc != BPAK_OK) {
+        fprintf(stderr, "Error: Benchmark failed (%i, %s)\n", rc,
+                bpak_error_string(rc));
+        return -1;
+    }
+
+    return 0;
+}
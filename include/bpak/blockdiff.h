@@ -0,0 +1,64 @@
+/**
+ * \file blockdiff.h
+ *
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef BPAK_BLOCKDIFF_H
+#define BPAK_BLOCKDIFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <bpak/bpak.h>
+
+/* Size of the blocks that are matched against the origin */
+#ifndef BPAK_BLOCKDIFF_BLOCK_SIZE
+#define BPAK_BLOCKDIFF_BLOCK_SIZE 4096
+#endif
+
+/* Every operation in a blockdiff stream starts with a header of
+ *  uint32 op, uint64 length, uint64 origin offset, all little endian. */
+#define BPAK_BLOCKDIFF_OP_LENGTH 20
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum bpak_blockdiff_op {
+    BPAK_BLOCKDIFF_OP_LITERAL = 1, /*!< 'length' bytes of data follow */
+    BPAK_BLOCKDIFF_OP_COPY = 2, /*!< Copy 'length' bytes from the origin */
+};
+
+/**
+ * Encode 'new_data' as a sequence of block copies from the origin and
+ * literal data. Blocks that only moved between the origin and the target
+ * cost one operation header, everything else is stored as is.
+ *
+ * Memory usage is linear in the number of origin blocks.
+ *
+ * @param[in] origin_data pointer to origin/source data
+ * @param[in] origin_length Length of origin data
+ * @param[in] new_data New, or target data
+ * @param[in] new_length Length of target data
+ * @param[in] write_output I/O callback for writing output data
+ * @param[in] output_offset Offset added to all output writes
+ * @param[in] user_priv Priv context for i/o callback
+ *
+ * @return size of the output stream on success or a negative number
+ */
+ssize_t bpak_blockdiff(uint8_t *origin_data, size_t origin_length,
+                       uint8_t *new_data, size_t new_length,
+                       bpak_io_t write_output, off_t output_offset,
+                       void *user_priv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
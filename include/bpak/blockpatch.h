@@ -0,0 +1,83 @@
+/**
+ * \file blockpatch.h
+ *
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef BPAK_BLOCKPATCH_H
+#define BPAK_BLOCKPATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <bpak/bpak.h>
+#include <bpak/blockdiff.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bpak_blockpatch_context {
+    uint8_t *buffer;        /*!< Work buffer for origin copies */
+    size_t buffer_length;   /*!< Length of work buffer */
+    bpak_io_t read_origin;  /*!< Callback for reading origin data */
+    off_t origin_offset;    /*!< Origin stream offset */
+    bpak_io_t write_output; /*!< Callback for writing output data */
+    off_t output_offset;    /*!< Output stream offset */
+    off_t output_position;  /*!< Current position in output data */
+    uint8_t op_buf[BPAK_BLOCKDIFF_OP_LENGTH]; /*!< Current operation header */
+    uint8_t op_buf_count; /*!< Fill status of operation header */
+    uint64_t literal_count; /*!< Literal bytes left of current operation */
+    void *user_priv;
+};
+
+/**
+ *  Initialize the BPAK blockpatch context
+ *
+ *  @param[in] ctx           Pointer to the context
+ *  @param[in] buffer        Work buffer used when copying origin blocks
+ *  @param[in] buffer_length Size of work buffer in bytes
+ *  @param[in] read_origin   Callback for reading origin data
+ *  @param[in] origin_offset Offset added to all origin reads
+ *  @param[in] write_output  Callback for writing output data
+ *  @param[in] output_offset Offset added to all output writes
+ *  @param[in] user_priv     User context sent to call backs
+ *
+ *  @return BPAK_OK on success or a negative number
+ */
+int bpak_blockpatch_init(struct bpak_blockpatch_context *ctx, uint8_t *buffer,
+                         size_t buffer_length, bpak_io_t read_origin,
+                         off_t origin_offset, bpak_io_t write_output,
+                         off_t output_offset, void *user_priv);
+
+/**
+ * Feed blockpatch with input data
+ *
+ * @param[in] ctx      Pointer to blockpatch context
+ * @param[in] buffer   Input buffer
+ * @param[in] length   Bytes available in input buffer
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_blockpatch_write(struct bpak_blockpatch_context *ctx,
+                          uint8_t *buffer, size_t length);
+
+/**
+ * Call bpak_blockpatch_final when there is no more input.
+ *
+ * @param[in] ctx Pointer to blockpatch context
+ *
+ * @return the output size or a negative number on error
+ */
+ssize_t bpak_blockpatch_final(struct bpak_blockpatch_context *ctx);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
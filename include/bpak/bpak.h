@@ -34,6 +34,15 @@ extern "C" {
  * \def BPAK_HEADER_MAGIC
  * Magic number for BPAK header identification
  *
+ * \def BPAK_HEADER_MAGIC_EXT
+ * Magic number of a header that is followed by continuation tables
+ *
+ * \def BPAK_TABLE_MAGIC
+ * Magic number of a continuation table
+ *
+ * \def BPAK_MAX_TABLES
+ * Maximum number of continuation tables after the header
+ *
  * \def BPAK_MAX_PARTS
  * Maximum number of data parts a package can have
  *
@@ -52,6 +61,9 @@ extern "C" {
  **/
 
 #define BPAK_HEADER_MAGIC        0x42504132
+#define BPAK_HEADER_MAGIC_EXT    0x42504133
+#define BPAK_TABLE_MAGIC         0x42505442
+#define BPAK_MAX_TABLES          64
 #define BPAK_MAX_PARTS           32
 #define BPAK_MAX_META            32
 #define BPAK_METADATA_BYTES      1920
@@ -64,6 +76,16 @@ extern "C" {
 #define BPAK_CHUNK_BUFFER_LENGTH 4096
 #endif
 
+/* zstd window used by bsdiff, as log2 of the size in bytes. bspatch
+ * rejects streams with larger windows, which bounds its memory use. */
+#ifndef BPAK_ZSTD_WINDOW_LOG
+#define BPAK_ZSTD_WINDOW_LOG 20
+#endif
+
+#ifndef BPAK_ZSTD_LEVEL
+#define BPAK_ZSTD_LEVEL 19
+#endif
+
 /*! \public
  *
  * BPAK Hash identifier
@@ -133,6 +155,7 @@ enum bpak_compression {
     BPAK_COMPRESSION_NONE,
     BPAK_COMPRESSION_HS,
     BPAK_COMPRESSION_LZMA,
+    BPAK_COMPRESSION_ZSTD,
 };
 
 /*! \public
@@ -168,7 +191,41 @@ enum bpak_key_kind {
  */
 #define BPAK_FLAG_TRANSPORT (1 << 1)
 
-/* Bits 2 - 7 are reserved */
+/*
+ * \def BPAK_FLAG_SPARSE
+ * All-zero blocks of the part data are not stored in the package. The part
+ *  size is the size of the stored data. When this bit is set the following
+ *  metadata must be included:
+ *
+ * bpak-sparse-map (struct bpak_sparse_extent array)
+ *
+ */
+#define BPAK_FLAG_SPARSE (1 << 2)
+
+/*
+ * \def BPAK_FLAG_REUSE_ORIGIN
+ * Set by the transport encoder together with BPAK_FLAG_TRANSPORT when the
+ *  part is identical to its origin part. No data is stored, the decoder
+ *  copies the origin part or keeps it where it is.
+ *
+ */
+#define BPAK_FLAG_REUSE_ORIGIN (1 << 3)
+
+/*
+ * \def BPAK_FLAG_AUTO_MASK
+ * Set by the transport encoder together with BPAK_FLAG_TRANSPORT on parts
+ *  with the 'auto' encoder, the enum bpak_transport_auto_decoder that the
+ *  part was encoded for. The transport meta data keeps the 'auto' ids since
+ *  it is covered by the signature, see bpak_transport_decoder_id.
+ *
+ */
+#define BPAK_FLAG_AUTO_SHIFT 4
+#define BPAK_FLAG_AUTO_MASK (0x7 << BPAK_FLAG_AUTO_SHIFT)
+
+/* Bit 7 is reserved */
+
+/* Block size of sparse parts */
+#define BPAK_SPARSE_BLOCK_SZ 4096
 
 /**
  * Numerical ID representing different types of objects
@@ -188,13 +245,147 @@ struct bpak_transport_meta {
     uint8_t data[24];       /*!< Algorithm specific data */
 } __attribute__((packed));
 
+/**
+ * BCJ filters that can be applied before LZMA compression
+ */
+enum bpak_lzma_bcj {
+    BPAK_LZMA_BCJ_X86 = 0, /*!< Default to stay compatible with older streams */
+    BPAK_LZMA_BCJ_NONE,
+    BPAK_LZMA_BCJ_ARM,
+    BPAK_LZMA_BCJ_ARMTHUMB,
+    BPAK_LZMA_BCJ_ARM64,
+};
+
+/**
+ * Encoder parameters for bsdiff-lzma, stored in the 'data' field of the
+ * parts bpak_transport_meta. A zero field means that the default is used.
+ *
+ * Size: 8 bytes
+ **/
+struct bpak_transport_lzma_params {
+    uint8_t preset;     /*!< LZMA preset level + 1, 0 = LZMA_PRESET_DEFAULT */
+    uint8_t bcj_filter; /*!< BCJ filter, see enum bpak_lzma_bcj */
+    /*! log2 of the xz block size, 0 = a single block stream. Blocks are
+     *  compressed in parallel by the encode jobs, the stream only depends
+     *  on the block size and not on the number of threads. */
+    uint8_t block_bits;
+    uint8_t reserved;
+    uint32_t dict_size; /*!< Dictionary size in bytes, 0 = preset default */
+} __attribute__((packed));
+
+/* Limits of bpak_transport_lzma_params.block_bits */
+#define BPAK_LZMA_BLOCK_BITS_MIN 16
+#define BPAK_LZMA_BLOCK_BITS_MAX 31
+
+/**
+ * Heatshrink parameters for bsdiff, stored in the 'data' field of the parts
+ * bpak_transport_meta. The decoder is built for one window and lookahead
+ * size, see BPAK_HS_WINDOW_BITS and BPAK_HS_LOOKAHEAD_BITS, and rejects
+ * streams that were encoded with other sizes. A zero field means that the
+ * build default is used.
+ *
+ * Size: 4 bytes
+ **/
+struct bpak_transport_heatshrink_params {
+    uint8_t window_bits;    /*!< log2 of the window size */
+    uint8_t lookahead_bits; /*!< log2 of the lookahead size */
+    uint8_t reserved[2];
+} __attribute__((packed));
+
+/**
+ * Revision of the bsdiff patch stream, stored at byte
+ * BPAK_BSDIFF_REVISION_OFFSET of the 'data' field of the parts
+ * bpak_transport_meta, after the compressor parameters.
+ *
+ * From BPAK_BSDIFF_REVISION_COPY a control tuple with a negative diff
+ * length copies that many origin bytes unchanged, without diff bytes in the
+ * stream. Decoders before this revision do not check the field and can't
+ * apply such streams.
+ **/
+#define BPAK_BSDIFF_REVISION_OFFSET 8
+
+enum bpak_bsdiff_revision {
+    BPAK_BSDIFF_REVISION_ORIGINAL = 0, /*!< Diff, extra and adjust tuples */
+    BPAK_BSDIFF_REVISION_COPY,         /*!< Adds origin copy tuples */
+};
+
+/**
+ * Id of the origin part that a part is diffed against, a little endian
+ * bpak_id_t at byte BPAK_TRANSPORT_ORIGIN_ID_OFFSET of the 'data' field of
+ * the parts bpak_transport_meta. Zero selects the origin part with the same
+ * id, a different id lets two parts share the data of one origin part.
+ **/
+#define BPAK_TRANSPORT_ORIGIN_ID_OFFSET 12
+
+/**
+ * Scratch size of in place decoding, a little endian uint32_t at byte
+ * BPAK_TRANSPORT_IN_PLACE_OFFSET of the 'data' field of the parts
+ * bpak_transport_meta. Zero means that the output and the origin part are
+ * kept apart. Otherwise bsdiff only reads origin bytes that are at most
+ * half the scratch size behind the output position of the part. A decoder
+ * that keeps the last half of that in a scratch buffer can write the
+ * output over the origin part, see bpak_transport_decode_set_in_place.
+ * The stream is a normal bsdiff stream otherwise.
+ **/
+#define BPAK_TRANSPORT_IN_PLACE_OFFSET 16
+
+/**
+ * Run of all-zero blocks of a sparse part, the bpak-sparse-map meta data is
+ * an array of these. Blocks are counted in the expanded part data, extents
+ * are sorted and do not overlap. The last block of a part is always stored.
+ *
+ * Size: 8 bytes
+ **/
+struct bpak_sparse_extent {
+    uint32_t block; /*!< First zero block */
+    uint32_t count; /*!< Number of zero blocks */
+} __attribute__((packed));
+
+/**
+ * Zero blocks of a part, see bpak_tables_get_sparse_map. A part without
+ * BPAK_FLAG_SPARSE has no extents and the same stored and expanded size.
+ **/
+struct bpak_sparse_map {
+    const struct bpak_sparse_extent *extents;
+    size_t count;         /*!< Number of extents */
+    uint64_t stored_size; /*!< Part data in the package, without padding */
+    uint64_t size;        /*!< Expanded part data, without padding */
+};
+
 typedef ssize_t (*bpak_io_t)(off_t offset, uint8_t *buffer, size_t length,
                              void *user);
 
+/* Hint that 'length' bytes at 'offset' will be read soon, must not block */
+typedef void (*bpak_prefetch_t)(off_t offset, size_t length, void *user);
+
 typedef void *(*bpak_calloc_t)(size_t, size_t);
 
 typedef void (*bpak_free_t)(void *);
 
+/**
+ * Allocator of a library context, see bpak_bspatch_set_allocator and
+ * bpak_merkle_set_allocator. The functions are called with 'user' and
+ * 'calloc_func' must return zeroed memory, aligned as malloc does.
+ **/
+struct bpak_allocator {
+    void *(*calloc_func)(void *user, size_t nmemb, size_t size);
+    void (*free_func)(void *user, void *ptr);
+    void *user;
+};
+
+/**
+ * Fixed size bump allocator, see bpak_arena_init
+ **/
+struct bpak_arena {
+    uint8_t *buffer;
+    size_t size;  /*!< Usable bytes of buffer */
+    size_t used;  /*!< Bytes allocated, including freed blocks below the
+                       most recent allocation */
+    size_t peak;  /*!< Highest 'used' since bpak_arena_init */
+    void *top;    /*!< Most recent block that is not freed */
+    size_t count; /*!< Allocations that are not freed */
+};
+
 /**
  * BPAK part header
  *
@@ -228,12 +419,19 @@ struct bpak_meta_header {
 /**
  * BPAK Header
  *
+ * A header with magic BPAK_HEADER_MAGIC_EXT is followed by 'table_count'
+ * continuation tables before the payload. A table has the layout of a
+ * header, with magic BPAK_TABLE_MAGIC, and only its meta, parts and
+ * metadata arrays are used. The parts of the tables follow the parts of
+ * the header in the payload, and the tables are covered by the payload
+ * hash before the part data.
  *
  * Size: 4 kBytes
  **/
 struct bpak_header {
     uint32_t magic;                              /*!< BPAK Magic number*/
-    uint8_t pad0[4];                             /*!< Pad 1*/
+    uint16_t table_count; /*!< Continuation tables, BPAK_HEADER_MAGIC_EXT */
+    uint8_t pad0[2];                             /*!< Pad 1*/
     struct bpak_meta_header meta[BPAK_MAX_META]; /*!< Meta data header array */
     struct bpak_part_header parts[BPAK_MAX_PARTS]; /*!< Part header array */
     uint8_t metadata[BPAK_METADATA_BYTES];         /*!< Meta data byte array */
@@ -385,6 +583,232 @@ int bpak_add_part(struct bpak_header *hdr, bpak_id_t id,
 void bpak_del_part(struct bpak_header *hdr,
                    struct bpak_part_header *part);
 
+/**
+ * Sorted lookup index over the meta data and part arrays of a header. It
+ * is built once with bpak_header_index_init and finds entries with a
+ * binary search instead of scanning the arrays. The index refers to the
+ * header and must be built again after meta data or parts are added or
+ * removed. The header itself is not changed.
+ */
+struct bpak_header_index {
+    struct bpak_header *header; /*!< Indexed header */
+    uint8_t meta_count;         /*!< Number of indexed meta data headers */
+    uint8_t part_count;         /*!< Number of indexed parts */
+    /*! Meta data positions sorted by id, part reference and position */
+    uint8_t meta_order[BPAK_MAX_META];
+    /*! Part positions sorted by id and position */
+    uint8_t part_order[BPAK_MAX_PARTS];
+    /*! Offset of every part by position, as bpak_part_offset */
+    uint64_t part_offset[BPAK_MAX_PARTS];
+};
+
+/**
+ * Build a lookup index for 'hdr'. Entries with a zero id are not indexed.
+ *
+ * @param[out] index Index
+ * @param[in] hdr BPAK Header
+ *
+ * @return BPAK_OK on success
+ *
+ **/
+int bpak_header_index_init(struct bpak_header_index *index,
+                           struct bpak_header *hdr);
+
+/**
+ * Indexed version of bpak_get_meta
+ *
+ * @param[in] index Index built by bpak_header_index_init
+ * @param[in] id Meta data identifier
+ * @param[in] part_id_ref Part reference id
+ * @param[out] meta Pointer to the metadata header
+ *
+ * @return BPAK_OK on success -BPAK_NOT_FOUND if the metadata is missing
+ *
+ **/
+int bpak_header_index_get_meta(const struct bpak_header_index *index,
+                               bpak_id_t id, bpak_id_t part_id_ref,
+                               struct bpak_meta_header **meta);
+
+/**
+ * Indexed version of bpak_get_meta_anyref
+ *
+ * @param[in] index Index built by bpak_header_index_init
+ * @param[in] id Meta data identifier
+ * @param[out] meta Pointer to the metadata header
+ *
+ * @return BPAK_OK on success -BPAK_NOT_FOUND if the metadata is missing
+ *
+ **/
+int bpak_header_index_get_meta_anyref(const struct bpak_header_index *index,
+                                      bpak_id_t id,
+                                      struct bpak_meta_header **meta);
+
+/**
+ * Indexed version of bpak_get_part
+ *
+ * @param[in] index Index built by bpak_header_index_init
+ * @param[in] id ID of part
+ * @param[out] part Pointer to the part header
+ *
+ * @return BPAK_OK on success, -BPAK_NOT_FOUND if the part is missing
+ *
+ **/
+int bpak_header_index_get_part(const struct bpak_header_index *index,
+                               bpak_id_t id, struct bpak_part_header **part);
+
+/**
+ * Indexed version of bpak_part_offset
+ *
+ * @param[in] index Index built by bpak_header_index_init
+ * @param[in] part Part header in the indexed header
+ *
+ * @return Offset of the part from the start of the package
+ *
+ **/
+off_t bpak_header_index_part_offset(const struct bpak_header_index *index,
+                                    const struct bpak_part_header *part);
+
+/**
+ * \def bpak_foreach_table
+ *
+ * Helper macro to iterate over a header and its continuation tables
+ */
+#define bpak_foreach_table(_hdr, _tables, _count, _var)                      \
+    for (struct bpak_header *_var = (_hdr); _var != NULL;                    \
+         _var = bpak_next_table((_hdr), (_tables), (_count), _var))
+
+/**
+ * Get the table after 'table', see bpak_foreach_table
+ *
+ * @param[in] hdr BPAK Header
+ * @param[in] tables Continuation tables of 'hdr'
+ * @param[in] count Number of tables
+ * @param[in] table 'hdr' or one of the tables
+ *
+ * @return Next table or NULL after the last one
+ *
+ **/
+struct bpak_header *bpak_next_table(struct bpak_header *hdr,
+                                    struct bpak_header *tables,
+                                    unsigned int count,
+                                    struct bpak_header *table);
+
+/**
+ * Initialize an empty continuation table
+ *
+ * @param[out] table Table
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_init_table(struct bpak_header *table);
+
+/**
+ * Check the magic number, part alignment and meta data bounds of a
+ * continuation table
+ *
+ * @param[in] table Table
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_valid_table(struct bpak_header *table);
+
+/**
+ * Size of the header and its continuation tables, this is the offset of
+ * the first part in the package
+ *
+ * @param[in] hdr BPAK Header
+ *
+ * @return Size in bytes
+ */
+size_t bpak_header_size(struct bpak_header *hdr);
+
+/**
+ * Copy the continuation tables of 'hdr' from 'buffer' and check them with
+ * bpak_valid_table. Headers without tables need nothing more than
+ * bpak_header_parse.
+ *
+ * @param[in] hdr     Header parsed from the same buffer
+ * @param[out] tables Room for hdr->table_count tables
+ * @param[in] buffer  Start of the package
+ * @param[in] length  Bytes available in 'buffer', at least
+ *                    bpak_header_size(hdr)
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_tables_parse(struct bpak_header *hdr, struct bpak_header *tables,
+                      const void *buffer, size_t length);
+
+/**
+ * Look up a part in a header and its continuation tables
+ *
+ * @param[in] hdr BPAK Header
+ * @param[in] tables Continuation tables of 'hdr'
+ * @param[in] count Number of tables
+ * @param[in] id ID of part
+ * @param[out] part Pointer to the part header
+ *
+ * @return BPAK_OK on success, -BPAK_NOT_FOUND if the part is missing
+ *
+ **/
+int bpak_tables_get_part(struct bpak_header *hdr, struct bpak_header *tables,
+                         unsigned int count, bpak_id_t id,
+                         struct bpak_part_header **part);
+
+/**
+ * Look up meta data in a header and its continuation tables
+ *
+ * @param[in] hdr BPAK Header
+ * @param[in] tables Continuation tables of 'hdr'
+ * @param[in] count Number of tables
+ * @param[in] id Meta data identifier
+ * @param[in] part_id_ref Part reference identifier, or 0 for no reference
+ * @param[out] meta Pointer to the metadata header
+ * @param[out] table Table that holds the meta data, for bpak_get_meta_ptr.
+ *                   May be NULL.
+ *
+ * @return BPAK_OK on success -BPAK_NOT_FOUND if the metadata is missing
+ *
+ **/
+int bpak_tables_get_meta(struct bpak_header *hdr, struct bpak_header *tables,
+                         unsigned int count, bpak_id_t id,
+                         bpak_id_t part_id_ref,
+                         struct bpak_meta_header **meta,
+                         struct bpak_header **table);
+
+/**
+ * Look up and check the sparse map of 'part' in a header and its
+ * continuation tables
+ *
+ * @param[in] hdr BPAK Header
+ * @param[in] tables Continuation tables of 'hdr'
+ * @param[in] count Number of tables
+ * @param[in] part Part
+ * @param[out] map Sparse map, it points into the meta data of the header
+ *
+ * @return BPAK_OK on success, -BPAK_MISSING_META_DATA if a sparse part has
+ *         no map or -BPAK_SIZE_ERROR if the map does not fit the part
+ *
+ **/
+int bpak_tables_get_sparse_map(struct bpak_header *hdr,
+                               struct bpak_header *tables, unsigned int count,
+                               struct bpak_part_header *part,
+                               struct bpak_sparse_map *map);
+
+/**
+ * Get data offset of 'part' in a package with continuation tables, see
+ * bpak_part_offset
+ *
+ * @param[in] hdr BPAK Header
+ * @param[in] tables Continuation tables of 'hdr'
+ * @param[in] count Number of tables
+ * @param[in] part Part in 'hdr' or one of the tables
+ *
+ * @return Offset in bytes
+ */
+off_t bpak_tables_part_offset(struct bpak_header *hdr,
+                              struct bpak_header *tables, unsigned int count,
+                              struct bpak_part_header *part);
+
 /**
  * Check magic numbers in the header and check that all parts have the correct
  *  alignment.
@@ -396,6 +820,21 @@ void bpak_del_part(struct bpak_header *hdr,
 
 int bpak_valid_header(struct bpak_header *hdr);
 
+/**
+ * Copy a header from 'buffer' and check it with bpak_valid_header. The
+ * buffer can be the first 4 KiB of a package that was read with one pread,
+ * or a mapping of the package, it does not have to be aligned.
+ *
+ * @param[out] hdr   BPAK Header
+ * @param[in] buffer Start of the package
+ * @param[in] length Bytes available in 'buffer'
+ *
+ * @return BPAK_OK on success, -BPAK_SIZE_ERROR when 'length' is less than
+ *         a header or a bpak_valid_header error
+ */
+int bpak_header_parse(struct bpak_header *hdr, const void *buffer,
+                      size_t length);
+
 /**
  * Copy the signature to '*signature' and zero out the signature area in the
  *  header.
@@ -423,7 +862,7 @@ int bpak_init_header(struct bpak_header *hdr);
 
 /**
  * Get data offset of 'part' within the BPAK stream. This includes
- * the header (4kByte).
+ * the header (4kByte) and its continuation tables.
  *
  * @param[in] part BPAK Part pointer
  *
@@ -523,6 +962,124 @@ int bpak_set_keystore_id(struct bpak_header *hdr, uint32_t keystore_id);
  */
 int bpak_add_transport_meta(struct bpak_header *header, bpak_id_t part_id,
                             uint32_t encoder_id, uint32_t decoder_id);
+
+/**
+ * Id of the origin part that part 'part_id' is encoded against, see
+ * BPAK_TRANSPORT_ORIGIN_ID_OFFSET
+ *
+ * @param[in] tm Transport meta data of the part, or NULL
+ * @param[in] part_id Id of part
+ *
+ * @return Id of the origin part
+ */
+bpak_id_t bpak_transport_origin_id(const struct bpak_transport_meta *tm,
+                                   bpak_id_t part_id);
+
+/**
+ * Decoders of the 'auto' encoder, stored in the BPAK_FLAG_AUTO_MASK bits of
+ * the part flags
+ */
+enum bpak_transport_auto_decoder {
+    BPAK_TRANSPORT_AUTO_UNSET = 0, /*!< The part is not encoded yet */
+    BPAK_TRANSPORT_AUTO_BSPATCH_NO_COMP,
+    BPAK_TRANSPORT_AUTO_BSPATCH,
+    BPAK_TRANSPORT_AUTO_BSPATCH_LZMA,
+    BPAK_TRANSPORT_AUTO_BSPATCH_ZSTD,
+    BPAK_TRANSPORT_AUTO_DECOMPRESS_HS,
+    BPAK_TRANSPORT_AUTO_DECOMPRESS_LZMA,
+    BPAK_TRANSPORT_AUTO_DECOMPRESS_ZSTD,
+};
+
+/**
+ * Decoder of an encoded part. For the 'auto' decoder this is the decoder
+ * that the encoder picked, from the BPAK_FLAG_AUTO_MASK bits of the part.
+ *
+ * @param[in] tm Transport meta data of the part, or NULL
+ * @param[in] part Part header
+ *
+ * @return Decoder id, 0 when there is no transport meta data or the
+ *         'auto' part has no decoder
+ */
+uint32_t bpak_transport_decoder_id(const struct bpak_transport_meta *tm,
+                                   const struct bpak_part_header *part);
+
+/**
+ * Select the origin part that part 'part_id' is encoded against
+ *
+ * @param[in] header BPAK Header with transport meta data for the part
+ * @param[in] part_id Id of part
+ * @param[in] origin_id Id of the origin part, 0 = same as 'part_id'
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_set_transport_origin(struct bpak_header *header, bpak_id_t part_id,
+                              bpak_id_t origin_id);
+
+/**
+ * Scratch size that a part is encoded for, see
+ * BPAK_TRANSPORT_IN_PLACE_OFFSET
+ *
+ * @param[in] tm Transport meta data of the part, or NULL
+ *
+ * @return Scratch size in bytes, 0 = not encoded for in place decoding
+ */
+uint32_t bpak_transport_in_place_scratch(const struct bpak_transport_meta *tm);
+
+/**
+ * Encode part 'part_id' so that it can be decoded in place, over its
+ * origin part, with a scratch buffer of 'scratch_size' bytes. Only the
+ * bsdiff encoders support this.
+ *
+ * @param[in] header BPAK Header with transport meta data for the part
+ * @param[in] part_id Id of part
+ * @param[in] scratch_size Scratch size in bytes, 0 = separate origin and
+ *                         output
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_set_transport_in_place(struct bpak_header *header, bpak_id_t part_id,
+                                uint32_t scratch_size);
+
+/** Most origin parts of the virtual origin of one part */
+#define BPAK_TRANSPORT_MAX_ORIGIN_PARTS 16
+
+/**
+ * Select several origin parts that part 'part_id' is encoded against. The
+ * diff runs against one virtual origin, the data of the origin parts
+ * concatenated in the order of 'origin_ids', so data that moved between
+ * parts is found. The ids are stored in the bpak-origin-parts meta data of
+ * the part and the first one is selected as with bpak_set_transport_origin.
+ * Only the bsdiff encoders support more than one origin part.
+ *
+ * @param[in] header BPAK Header with transport meta data for the part
+ * @param[in] part_id Id of part
+ * @param[in] origin_ids Ids of the origin parts
+ * @param[in] count Number of origin parts, at most
+ *                  BPAK_TRANSPORT_MAX_ORIGIN_PARTS
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_set_transport_origin_parts(struct bpak_header *header,
+                                    bpak_id_t part_id,
+                                    const bpak_id_t *origin_ids, size_t count);
+
+/**
+ * Get the origin parts that part 'part_id' is encoded against, see
+ * bpak_set_transport_origin_parts
+ *
+ * @param[in] header BPAK Header
+ * @param[in] part_id Id of part
+ * @param[out] origin_ids Ids of the origin parts, in the header
+ * @param[out] count Number of origin parts
+ *
+ * @return BPAK_OK on success, -BPAK_NOT_FOUND when the part is encoded
+ *         against one origin part or a negative number
+ */
+int bpak_get_transport_origin_parts(struct bpak_header *header,
+                                    bpak_id_t part_id,
+                                    const bpak_id_t **origin_ids,
+                                    size_t *count);
+
 /**
  * Library version
  *
@@ -550,6 +1107,58 @@ void *bpak_calloc(size_t nmemb, size_t size);
  */
 void bpak_free(void *ptr);
 
+/**
+ * Allocate from 'allocator', or with bpak_calloc when it is NULL
+ */
+void *bpak_allocator_calloc(const struct bpak_allocator *allocator,
+                            size_t nmemb, size_t size);
+
+/**
+ * Free memory from bpak_allocator_calloc with the same 'allocator'
+ */
+void bpak_allocator_free(const struct bpak_allocator *allocator, void *ptr);
+
+/**
+ * Initialize an arena that allocates from 'buffer'
+ *
+ * Allocations are taken from the start of the buffer in order and fail,
+ * without touching the heap, when the buffer is full. Freeing the most
+ * recent allocation returns its space, other blocks are returned when
+ * every block above them is freed and the whole arena is reset when the
+ * last block is freed. This suits the decoder contexts, which allocate
+ * their state when a stream is started and free it in reverse order.
+ *
+ * The arena is not thread safe.
+ *
+ * @param[in] arena Arena
+ * @param[in] buffer Backing memory
+ * @param[in] size Size of buffer in bytes
+ *
+ * @return BPAK_OK on success or -BPAK_SIZE_ERROR if the buffer is too small
+ */
+int bpak_arena_init(struct bpak_arena *arena, void *buffer, size_t size);
+
+/**
+ * Allocate zeroed memory from an arena
+ *
+ * @return Pointer to the memory or NULL if the arena is full
+ */
+void *bpak_arena_calloc(struct bpak_arena *arena, size_t nmemb, size_t size);
+
+/**
+ * Free memory from bpak_arena_calloc, NULL is ignored
+ */
+void bpak_arena_free(struct bpak_arena *arena, void *ptr);
+
+/**
+ * Fill in an allocator that allocates from 'arena'
+ *
+ * @param[in] arena Initialized arena
+ * @param[out] allocator Allocator for the library contexts
+ */
+void bpak_arena_allocator(struct bpak_arena *arena,
+                          struct bpak_allocator *allocator);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -17,10 +17,113 @@
 #include <unistd.h>
 #include <bpak/bpak.h>
 
+/* Smallest origin window of the windowed diff */
+#ifndef BPAK_BSDIFF_MIN_WINDOW_SIZE
+#define BPAK_BSDIFF_MIN_WINDOW_SIZE (1024 * 1024)
+#endif
+
+/* Forward origin jumps up to this many bytes are not counted as seeks,
+ * the read ahead of the target covers them */
+#ifndef BPAK_BSDIFF_SEEK_NEAR
+#define BPAK_BSDIFF_SEEK_NEAR (64 * 1024)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Memory that the suffix array is allocated in. Searches hit the suffix
+ * array at random, on large origins most of them miss the TLB with 4 KiB
+ * pages.
+ */
+enum bpak_bsdiff_pages {
+    BPAK_BSDIFF_PAGES_DEFAULT = 0, /*!< bpak_calloc */
+    /*! An anonymous mapping aligned to BPAK_BSDIFF_HUGE_PAGE_SIZE with
+     *  madvise(MADV_HUGEPAGE), for transparent huge pages */
+    BPAK_BSDIFF_PAGES_TRANSPARENT,
+    /*! MAP_HUGETLB from the reserved huge page pool, transparent huge pages
+     *  when the pool is too small */
+    BPAK_BSDIFF_PAGES_HUGETLB,
+};
+
+/** Huge page size that the suffix array mappings are aligned to */
+#define BPAK_BSDIFF_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Optional bsdiff settings, all zero gives the same behaviour as
+ * bpak_bsdiff_init with one job.
+ */
+struct bpak_bsdiff_options {
+    /*! Number of threads to use for the diff. With more than one job the
+     *  target is split into contiguous segments that are diffed in
+     *  parallel and buffered in memory before they are compressed, in
+     *  order, into one patch stream. 0 or 1 keeps the single threaded
+     *  behaviour. */
+    unsigned int jobs;
+    const char *cache_filename; /*!< Suffix array cache file or NULL */
+    const struct bpak_transport_lzma_params *lzma_params; /*!< NULL = default */
+    /*! Heatshrink window and lookahead, NULL = build default */
+    const struct bpak_transport_heatshrink_params *heatshrink_params;
+    /*! Patch stream revision, see enum bpak_bsdiff_revision */
+    enum bpak_bsdiff_revision revision;
+    /*! Diff against origin windows of this many bytes instead of the whole
+     *  origin, see bpak_bsdiff_window_size. 0 = no windows */
+    size_t window_size;
+    /*! Patch bytes that one origin seek is worth on the target, 0 = pick
+     *  matches by length only. A match that makes the decoder read the
+     *  origin backwards, or more than BPAK_BSDIFF_SEEK_NEAR bytes ahead,
+     *  has to save this many bytes more than a match that continues the
+     *  current origin read. */
+    size_t seek_cost;
+    /*! Scratch size of in place decoding, see
+     *  BPAK_TRANSPORT_IN_PLACE_OFFSET. The origin is only read at most half
+     *  of this behind the target position. An in place diff runs on one
+     *  thread and without origin windows. 0 = origin and output are
+     *  separate. */
+    size_t in_place_scratch;
+    /*! Memory of the suffix arrays, see enum bpak_bsdiff_pages */
+    enum bpak_bsdiff_pages pages;
+};
+
+/**
+ * Profiling counters, see bpak_bsdiff_get_stats. With more than one job
+ * the counters and the search time of the segments are summed.
+ */
+struct bpak_bsdiff_stats {
+    uint64_t ctrl_blocks;        /*!< Control tuples written */
+    uint64_t diff_bytes;         /*!< Diff bytes written */
+    uint64_t extra_bytes;        /*!< Extra bytes written */
+    uint64_t copy_bytes;         /*!< Target bytes written as origin copies */
+    uint64_t searches;           /*!< Suffix array searches */
+    uint64_t write_output_calls; /*!< Calls to 'write_output' */
+    uint64_t suffix_sort_ns;     /*!< Time building or loading the suffix
+                                      array */
+    uint64_t search_ns;          /*!< Time spent in suffix array searches */
+    uint64_t scan_ns;            /*!< Time spent in bpak_bsdiff */
+    uint64_t compress_ns;        /*!< Time spent in the compressor,
+                                      including 'write_output' */
+    uint64_t write_output_ns;    /*!< Time spent in 'write_output' */
+};
+
+/**
+ * Suffix array index of an origin, see bpak_bsdiff_origin_init. It is only
+ * read by the diffs that use it, any number of contexts on any threads can
+ * share one origin.
+ */
+struct bpak_bsdiff_origin {
+    uint8_t *data;
+    size_t length;
+    void *suffix_array; /*!< int32_t or int64_t suffix array of origin data */
+    size_t suffix_array_size;  /*!< Size of suffix array in bytes */
+    size_t suffix_array_width; /*!< Size of one suffix array entry */
+    void *suffix_array_map; /*!< Mapped suffix array cache file or NULL */
+    size_t suffix_array_map_size; /*!< Size of the mapped cache file */
+    /*! Size of the anonymous mapping of the suffix array, 0 = bpak_calloc */
+    size_t suffix_array_mem_size;
+    int64_t *prefix_index; /*!< Suffix array ranges by two byte prefix */
+};
+
 struct bpak_bsdiff_context {
     int origin_fd;
     uint8_t *origin_data;
@@ -28,8 +131,17 @@ struct bpak_bsdiff_context {
     int new_fd;
     uint8_t *new_data;
     size_t new_length;
-    int64_t *suffix_array;
-    size_t suffix_array_size;
+    void *suffix_array; /*!< int32_t or int64_t suffix array of origin data */
+    size_t suffix_array_size;  /*!< Size of suffix array in bytes */
+    size_t suffix_array_width; /*!< Size of one suffix array entry */
+    void *suffix_array_map; /*!< Mapped suffix array cache file or NULL */
+    size_t suffix_array_map_size; /*!< Size of the mapped cache file */
+    /*! Size of the anonymous mapping of the suffix array, 0 = bpak_calloc */
+    size_t suffix_array_mem_size;
+    enum bpak_bsdiff_pages pages; /*!< See struct bpak_bsdiff_options */
+    int64_t *prefix_index; /*!< Suffix array ranges by two byte prefix */
+    /*! Shared origin index of bpak_bsdiff_init_origin or NULL */
+    const struct bpak_bsdiff_origin *origin;
     int64_t scan;
     int64_t len;
     int64_t pos;
@@ -40,8 +152,28 @@ struct bpak_bsdiff_context {
     bpak_io_t write_output;
     off_t output_offset;
     size_t output_pos;
+    size_t ctrl_pos; /*!< Output position of the last control tuple */
     enum bpak_compression compression;
     void *compressor_priv;
+    unsigned int jobs; /*!< Number of worker threads used by bpak_bsdiff
+                            and the LZMA block encoder */
+    struct bpak_transport_lzma_params lzma_params; /*!< LZMA encoder setup */
+    struct bpak_transport_heatshrink_params heatshrink_params;
+    enum bpak_bsdiff_revision revision; /*!< Patch stream revision */
+    size_t window_size; /*!< Origin window length, 0 = the whole origin */
+    void *window_index; /*!< Origin chunk anchors of the windowed diff */
+    size_t window_index_count; /*!< Number of anchors */
+    size_t seek_cost; /*!< See struct bpak_bsdiff_options */
+    size_t in_place_scratch; /*!< See struct bpak_bsdiff_options */
+    /*! Control tuples that make the decoder seek in the origin, the moves
+     *  between the segments of a parallel or windowed diff are not
+     *  counted */
+    uint64_t origin_seeks;
+    uint64_t origin_backward_seeks; /*!< Seeks towards the origin start */
+    uint64_t origin_seek_bytes;     /*!< Sum of the seek distances */
+#if BPAK_CONFIG_STATS == 1
+    struct bpak_bsdiff_stats stats;
+#endif
     void *user_priv;
 };
 
@@ -54,6 +186,8 @@ struct bpak_bsdiff_context {
  * @param[in] new_data New, or target data
  * @param[in] new_length Length of target data
  * @param[in] write_output I/O callback for writing output data
+ * @param[in] output_offset Offset added to all output writes
+ * @param[in] compression Compression of the output stream
  * @param[in] user_priv Priv context for i/o callback
  *
  * @return BPAK_OK on success or a negative number
@@ -64,6 +198,135 @@ int bpak_bsdiff_init(struct bpak_bsdiff_context *ctx, uint8_t *origin_data,
                      bpak_io_t write_output, off_t output_offset,
                      enum bpak_compression compression, void *user_priv);
 
+/**
+ * Initialize a bsdiff context with optional settings
+ *
+ * Building the suffix array of the origin is the most expensive part of
+ * the init. When 'options->cache_filename' refers to a valid cache for an
+ * origin of the same length it is mapped read-only instead of being
+ * computed. When the file is missing or does not match, the suffix array
+ * is computed and written to the cache file for the next encode.
+ *
+ * The caller is responsible for picking a cache file name that is unique
+ * for the origin data, for example derived from a hash of the origin.
+ *
+ * 'options->lzma_params' selects preset, dictionary size, BCJ filter and
+ * xz block size when 'compression' is BPAK_COMPRESSION_LZMA. With a block
+ * size the blocks are compressed on 'options->jobs' threads.
+ * 'options->heatshrink_params' selects the window and lookahead size when
+ * 'compression' is BPAK_COMPRESSION_HS, the decoder must be built for the
+ * same sizes.
+ *
+ * With 'options->revision' BPAK_BSDIFF_REVISION_COPY, unchanged runs of
+ * the diff are written as origin copy tuples instead of zero diff bytes.
+ *
+ * With 'options->window_size' smaller than the origin, no suffix array of
+ * the whole origin is built. The origin is split into content-defined
+ * chunks instead, and the target is diffed in segments of half the window
+ * size. Each segment is diffed against the window of the origin that
+ * holds most of its chunks, with a suffix array of that window only. The
+ * windows of neighbouring segments may overlap. Target data that is
+ * outside of the window of its segment is written as extra data, so the
+ * patch gets somewhat larger. The suffix array cache is not used and the
+ * segments are diffed one at a time, 'options->jobs' only applies to the
+ * LZMA block encoder.
+ *
+ * @param[in] options Settings, or NULL for the defaults
+ *
+ * See bpak_bsdiff_init for the other parameters.
+ *
+ * @return BPAK_OK on success or a negative number
+ *
+ **/
+int bpak_bsdiff_init_opts(struct bpak_bsdiff_context *ctx,
+                          uint8_t *origin_data, size_t origin_length,
+                          uint8_t *new_data, size_t new_length,
+                          bpak_io_t write_output, off_t output_offset,
+                          enum bpak_compression compression,
+                          const struct bpak_bsdiff_options *options,
+                          void *user_priv);
+
+/**
+ * Build the suffix array index of an origin once for several diffs
+ *
+ * bpak_bsdiff_init_opts builds the index of its origin every time. A
+ * service that diffs many targets against the same origin prepares the
+ * origin once with this function and starts each diff with
+ * bpak_bsdiff_init_origin, which only sets up the compressor.
+ *
+ * @param[out] origin The origin index
+ * @param[in] origin_data Origin data, it must stay valid until
+ *                        bpak_bsdiff_origin_free
+ * @param[in] origin_length Length of origin data
+ * @param[in] cache_filename Suffix array cache file or NULL, see
+ *                           bpak_bsdiff_init_opts
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bsdiff_origin_init(struct bpak_bsdiff_origin *origin,
+                            uint8_t *origin_data, size_t origin_length,
+                            const char *cache_filename);
+
+/**
+ * bpak_bsdiff_origin_init with optional settings. Only
+ * 'options->cache_filename' and 'options->pages' are used.
+ *
+ * @param[in] options Settings, or NULL for the defaults
+ *
+ * See bpak_bsdiff_origin_init for the other parameters.
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bsdiff_origin_init_opts(struct bpak_bsdiff_origin *origin,
+                                 uint8_t *origin_data, size_t origin_length,
+                                 const struct bpak_bsdiff_options *options);
+
+/**
+ * Free an origin index. No context may use it any more.
+ *
+ * @param[in] origin The origin index
+ */
+void bpak_bsdiff_origin_free(struct bpak_bsdiff_origin *origin);
+
+/**
+ * Initialize a bsdiff context with a prepared origin index
+ *
+ * Same as bpak_bsdiff_init_opts, except that the suffix array of 'origin'
+ * is used as it is. 'options->cache_filename' and 'options->window_size'
+ * are not used. 'origin' must stay valid until bpak_bsdiff_free.
+ *
+ * @param[in] ctx The bsdiff context
+ * @param[in] origin Origin index of bpak_bsdiff_origin_init
+ *
+ * See bpak_bsdiff_init_opts for the other parameters.
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bsdiff_init_origin(struct bpak_bsdiff_context *ctx,
+                            const struct bpak_bsdiff_origin *origin,
+                            uint8_t *new_data, size_t new_length,
+                            bpak_io_t write_output, off_t output_offset,
+                            enum bpak_compression compression,
+                            const struct bpak_bsdiff_options *options,
+                            void *user_priv);
+
+/**
+ * Pick the origin window for a heap budget
+ *
+ * The windowed diff needs a suffix array and a buffered patch of half of
+ * the window at a time, and the chunk anchors of the whole origin. The
+ * origin and target data are only read and are not counted, they are
+ * expected to be file mappings.
+ *
+ * @param[in] origin_length Length of origin data
+ * @param[in] memory_budget Heap budget in bytes
+ *
+ * @return a window size for bpak_bsdiff_options, 0 when the suffix array
+ *         of the whole origin fits in the budget. The window is never
+ *         smaller than BPAK_BSDIFF_MIN_WINDOW_SIZE.
+ */
+size_t bpak_bsdiff_window_size(size_t origin_length, size_t memory_budget);
+
 /**
  * Perform the diff process
  *
@@ -73,6 +336,41 @@ int bpak_bsdiff_init(struct bpak_bsdiff_context *ctx, uint8_t *origin_data,
  */
 ssize_t bpak_bsdiff(struct bpak_bsdiff_context *ctx);
 
+/**
+ * Compress 'data' with the patch stream compressor, without an origin and
+ * without control tuples. The stream is decoded by a bspatch context in
+ * raw mode, see bpak_bspatch_set_raw.
+ *
+ * @param[in] data Data to compress
+ * @param[in] length Length of data
+ * @param[in] write_output I/O callback for writing output data
+ * @param[in] output_offset Offset added to all output writes
+ * @param[in] compression Compression of the output stream
+ * @param[in] options Compressor parameters and jobs, or NULL for the
+ *                    defaults. The suffix array cache and the revision are
+ *                    not used.
+ * @param[in] user_priv Priv context for i/o callback
+ *
+ * @return size of the output stream on success or a negative number
+ */
+ssize_t bpak_bsdiff_compress(uint8_t *data, size_t length,
+                             bpak_io_t write_output, off_t output_offset,
+                             enum bpak_compression compression,
+                             const struct bpak_bsdiff_options *options,
+                             void *user_priv);
+
+/**
+ * Read the profiling counters of the diff
+ *
+ * @param[in] ctx The bsdiff context
+ * @param[out] stats Counters
+ *
+ * @return BPAK_OK on success or -BPAK_NOT_SUPPORTED when the library is
+ *         built without BPAK_STATS
+ */
+int bpak_bsdiff_get_stats(const struct bpak_bsdiff_context *ctx,
+                          struct bpak_bsdiff_stats *stats);
+
 /**
  * Free the diff context
  *
@@ -21,12 +21,35 @@
 #include <lzma.h>
 #endif
 
+#if BPAK_CONFIG_ZSTD == 1
+#include <zstd.h>
+#endif
+
 #define BPAK_BSPATCH_CTRL_BUFFER_LENGTH 24
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * \typedef bpak_bspatch_unchanged_t
+ * Called with output ranges that are copies of the origin, see
+ * bpak_bspatch_set_unchanged_hook
+ */
+typedef void (*bpak_bspatch_unchanged_t)(off_t output_position,
+                                         off_t origin_position, size_t length,
+                                         void *user);
+
+/**
+ * \typedef bpak_bspatch_ctrl_t
+ * Called with every control tuple of the patch stream, see
+ * bpak_bspatch_set_ctrl_hook
+ */
+typedef void (*bpak_bspatch_ctrl_t)(off_t output_position,
+                                    off_t origin_position, int64_t diff_count,
+                                    int64_t extra_count, int64_t adjust,
+                                    void *user);
+
 enum bpak_bspatch_state {
     BPAK_PATCH_STATE_FILL_CTRL_BUF,
     BPAK_PATCH_STATE_READ_CTRL,
@@ -36,6 +59,25 @@ enum bpak_bspatch_state {
     BPAK_PATCH_STATE_ERROR,
 };
 
+/**
+ * Profiling counters, see bpak_bspatch_get_stats
+ */
+struct bpak_bspatch_stats {
+    uint64_t ctrl_blocks;        /*!< Control tuples processed */
+    uint64_t diff_bytes;         /*!< Diff bytes added to the origin */
+    uint64_t extra_bytes;        /*!< Extra bytes copied to the output */
+    uint64_t copy_bytes;         /*!< Origin bytes of copy tuples */
+    uint64_t read_origin_calls;  /*!< Calls to 'read_origin' */
+    uint64_t write_output_calls; /*!< Calls to 'write_output' */
+    uint64_t read_origin_ns;     /*!< Time spent in 'read_origin' */
+    uint64_t write_output_ns;    /*!< Time spent in 'write_output' */
+    /*! Time spent in the patch state machine, including the callbacks */
+    uint64_t patch_ns;
+    /*! Time spent in bpak_bspatch_write and bpak_bspatch_final, the
+     *  decompressor time is 'total_ns' - 'patch_ns' */
+    uint64_t total_ns;
+};
+
 struct bpak_bspatch_context {
     off_t origin_position;         /*!< Current position in origin data */
     off_t origin_offset;           /*!< Origin stream offset */
@@ -50,6 +92,17 @@ struct bpak_bspatch_context {
     size_t input_position;
     bpak_io_t read_origin;  /*!< Callback for reading origin data */
     bpak_io_t write_output; /*!< Callback for writing output data */
+    bpak_prefetch_t prefetch_origin; /*!< Optional origin read-ahead hint */
+    bpak_bspatch_unchanged_t unchanged; /*!< Optional unchanged run hook */
+    bpak_bspatch_ctrl_t ctrl; /*!< Optional control tuple hook */
+    bool raw; /*!< The stream is compressed output, see bpak_bspatch_set_raw */
+    unsigned int threads; /*!< LZMA decoder threads, 0 or 1 = one thread */
+    /*! Decompressor allocator, NULL = bpak_calloc */
+    const struct bpak_allocator *allocator;
+    const uint8_t *origin_data; /*!< Mapped origin, replaces read_origin */
+    size_t origin_length;       /*!< Length of mapped origin */
+    uint8_t *output_data;       /*!< Mapped output, replaces write_output */
+    size_t output_length;       /*!< Length of mapped output */
     uint8_t ctrl_buf[BPAK_BSPATCH_CTRL_BUFFER_LENGTH];
     /*!< Hold the current control header */
     uint8_t ctrl_buf_count; /*!< Fill status of control buffer */
@@ -60,12 +113,40 @@ struct bpak_bspatch_context {
     union {
 #if BPAK_CONFIG_LZMA == 1
         lzma_stream lzma_stream;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+        struct {
+            ZSTD_DCtx *dctx;
+            size_t hint; /*!< Last decoder result, zero at end of frame */
+        } zstd;
 #endif
         heatshrink_decoder hsd;
     } decompressor;
+#if BPAK_CONFIG_LZMA == 1
+    lzma_allocator lzma_allocator; /*!< Routes liblzma to 'allocator' */
+#endif
+#if BPAK_CONFIG_STATS == 1
+    struct bpak_bspatch_stats stats;
+#endif
     void *user_priv;
 };
 
+/**
+ * Serializable bspatch state, see bpak_bspatch_save
+ */
+struct bpak_bspatch_checkpoint {
+    int64_t origin_position;
+    int64_t output_position;
+    uint64_t input_position;
+    int64_t diff_count;
+    int64_t extra_count;
+    int64_t adjust;
+    uint32_t state;
+    uint8_t ctrl_buf[BPAK_BSPATCH_CTRL_BUFFER_LENGTH];
+    uint8_t ctrl_buf_count;
+    heatshrink_decoder hsd; /*!< Decoder state for BPAK_COMPRESSION_HS */
+};
+
 /**
  *  Initialize the BPAK bspatch context
  *
@@ -84,6 +165,200 @@ int bpak_bspatch_init(struct bpak_bspatch_context *ctx, uint8_t *buffer,
                       bpak_io_t write_output, off_t output_offset,
                       enum bpak_compression compression, void *user_priv);
 
+/**
+ *  Initialize the BPAK bspatch context for mapped origin and output
+ *
+ *  Diff bytes are added directly from 'origin' into 'output' and extra
+ *  bytes are copied straight into 'output', without any intermediate
+ *  buffer or i/o callbacks. This suits origins and outputs that are
+ *  mmap'd files or block devices. The whole work buffer is used by the
+ *  decompressor.
+ *
+ *  @param[in] ctx           Pointer to the context
+ *  @param[in] buffer        Work buffer for the decompressor
+ *  @param[in] buffer_length Size of the work buffer in bytes
+ *  @param[in] input_length  Length of the patch stream
+ *  @param[in] origin        Origin data
+ *  @param[in] origin_length Length of origin data
+ *  @param[in] output        Output data
+ *  @param[in] output_length Length of the output, patches that would
+ *                           write beyond it fail
+ *  @param[in] compression   Compression of the patch stream
+ *
+ *  @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_init_mapped(struct bpak_bspatch_context *ctx,
+                             uint8_t *buffer, size_t buffer_length,
+                             size_t input_length, const uint8_t *origin,
+                             size_t origin_length, uint8_t *output,
+                             size_t output_length,
+                             enum bpak_compression compression);
+
+/**
+ * Install an origin prefetch hook
+ *
+ * When a control block is decoded bspatch knows the full origin range
+ * that its diff bytes will be added to. The hook is called with that
+ * range, relative to the same offsets as 'read_origin', before the first
+ * read so that the integrator can start asynchronous i/o, for example
+ * posix_fadvise or io_uring, that overlaps decompression and output
+ * writes.
+ *
+ * @param[in] ctx             Pointer to an initialized bspatch context
+ * @param[in] prefetch_origin Prefetch hook or NULL to disable
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_set_prefetch(struct bpak_bspatch_context *ctx,
+                              bpak_prefetch_t prefetch_origin);
+
+/**
+ * Install a hook for unchanged data
+ *
+ * Runs of zero diff bytes copy the origin unchanged. The hook is called
+ * with such runs, as positions within the output and the origin, before
+ * the output is written. A run may be reported in several calls with
+ * adjacent ranges, short runs inside a diff chunk are not reported.
+ *
+ * @param[in] ctx       Pointer to an initialized bspatch context
+ * @param[in] unchanged Hook or NULL to disable, called with 'user_priv'
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_set_unchanged_hook(struct bpak_bspatch_context *ctx,
+                                    bpak_bspatch_unchanged_t unchanged);
+
+/**
+ * Install a hook for control tuples
+ *
+ * The hook is called with every control tuple when it has been read, and
+ * before any of its data is applied, together with the output and origin
+ * positions where it starts. A negative 'diff_count' is an origin copy of
+ * -diff_count bytes. This lets tools analyze a patch stream, for example
+ * with i/o callbacks that discard the output.
+ *
+ * @param[in] ctx  Pointer to an initialized bspatch context
+ * @param[in] ctrl Hook or NULL to disable, called with 'user_priv'
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_set_ctrl_hook(struct bpak_bspatch_context *ctx,
+                               bpak_bspatch_ctrl_t ctrl);
+
+/**
+ * Decode a raw stream
+ *
+ * The decompressed stream is the output itself, without control tuples
+ * and without origin reads, as written by bpak_bsdiff_compress. The origin
+ * callbacks may be NULL. Must be called before any input is written.
+ *
+ * @param[in] ctx Pointer to an initialized bspatch context
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_set_raw(struct bpak_bspatch_context *ctx);
+
+/**
+ * Decompress LZMA blocks on several threads
+ *
+ * A stream that was compressed in blocks, see
+ * bpak_transport_lzma_params.block_bits, has the compressed size of each
+ * block in its header and an index of all blocks at the end. The blocks
+ * are then decoded in parallel and the output is still written in order.
+ * Other streams are decoded on one thread. Every thread holds a block of
+ * input and output on top of its dictionary, so more memory is used than
+ * bpak_bspatch_heap_size reports, and the allocator must be thread safe.
+ * Must be called before any input is written.
+ *
+ * @param[in] ctx     Pointer to an initialized bspatch context
+ * @param[in] threads Number of decoder threads, 0 or 1 = one thread
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_set_threads(struct bpak_bspatch_context *ctx,
+                             unsigned int threads);
+
+/**
+ * Allocate the decompressor state from 'allocator'
+ *
+ * The LZMA dictionary and the zstd window are allocated on the heap when
+ * the stream is started. With an allocator over a fixed buffer, for
+ * example a struct bpak_arena, a stream that needs more memory than the
+ * buffer holds fails early instead of allocating from the heap. Use
+ * bpak_bspatch_heap_size to size the buffer. Must be called before any
+ * input is written.
+ *
+ * @param[in] ctx       Pointer to an initialized bspatch context
+ * @param[in] allocator Allocator or NULL for bpak_calloc, it must stay
+ *                      valid until bpak_bspatch_free
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_set_allocator(struct bpak_bspatch_context *ctx,
+                               const struct bpak_allocator *allocator);
+
+/**
+ * Predict the peak heap use of the decompressor
+ *
+ * The prediction is an upper bound for the allocations of a bspatch
+ * context, including the block overhead of struct bpak_arena. The patch
+ * buffers are passed to bpak_bspatch_init and are not included.
+ *
+ * @param[in] compression    Compression of the patch stream
+ * @param[in] lzma_dict_size LZMA dictionary size of the stream, 0 = the
+ *                           size of LZMA_PRESET_DEFAULT
+ * @param[out] heap_size     Bytes needed
+ *
+ * @return BPAK_OK on success or -BPAK_UNSUPPORTED_COMPRESSION
+ */
+int bpak_bspatch_heap_size(enum bpak_compression compression,
+                           uint32_t lzma_dict_size, size_t *heap_size);
+
+/**
+ * Check that a heatshrink patch stream was encoded with the window and
+ * lookahead sizes that the decoder is built for. The parameters are
+ * normally taken from the parts transport meta data. Streams with other
+ * compressions are always accepted.
+ *
+ * @param[in] ctx    Pointer to an initialized bspatch context
+ * @param[in] params Heatshrink parameters of the stream
+ *
+ * @return BPAK_OK if the stream can be decoded or
+ *         -BPAK_UNSUPPORTED_COMPRESSION
+ */
+int bpak_bspatch_check_heatshrink_params(
+    struct bpak_bspatch_context *ctx,
+    const struct bpak_transport_heatshrink_params *params);
+
+/**
+ * Save the patch state so that decoding can be resumed later, for example
+ * after a power loss. All output up to the save point has been passed to
+ * 'write_output' when bpak_bspatch_write returns.
+ *
+ * Only uncompressed and heatshrink streams can be saved, the LZMA and
+ * zstd decoder states are not serializable.
+ *
+ * @param[in] ctx Pointer to bspatch context
+ * @param[out] checkpoint Saved state
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_save(struct bpak_bspatch_context *ctx,
+                      struct bpak_bspatch_checkpoint *checkpoint);
+
+/**
+ * Restore a state saved by bpak_bspatch_save into a context that was
+ * initialized with the same parameters. The caller continues by feeding
+ * the patch stream from the input position it had at the save point.
+ *
+ * @param[in] ctx Pointer to an initialized bspatch context
+ * @param[in] checkpoint Saved state
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_bspatch_restore(struct bpak_bspatch_context *ctx,
+                         const struct bpak_bspatch_checkpoint *checkpoint);
+
 /**
  * Feed bspatch with input data
  *
@@ -105,6 +380,18 @@ int bpak_bspatch_write(struct bpak_bspatch_context *ctx, uint8_t *buffer,
  */
 ssize_t bpak_bspatch_final(struct bpak_bspatch_context *ctx);
 
+/**
+ * Read the profiling counters of the patch so far
+ *
+ * @param[in] ctx Pointer to bspatch context
+ * @param[out] stats Counters
+ *
+ * @return BPAK_OK on success or -BPAK_NOT_SUPPORTED when the library is
+ *         built without BPAK_STATS
+ */
+int bpak_bspatch_get_stats(const struct bpak_bspatch_context *ctx,
+                           struct bpak_bspatch_stats *stats);
+
 /**
  * Free the bspatch context
  *
@@ -0,0 +1,79 @@
+/**
+ * \file chunkdiff.h
+ *
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef BPAK_CHUNKDIFF_H
+#define BPAK_CHUNKDIFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <bpak/bpak.h>
+
+/* Content-defined chunk sizes of the encoder. The decoder takes the sizes
+ * from the stream header, the origin is split the same way as the target
+ * was. */
+#ifndef BPAK_CHUNKDIFF_MIN_SIZE
+#define BPAK_CHUNKDIFF_MIN_SIZE (2 * 1024)
+#endif
+
+/* log2 of the average chunk size */
+#ifndef BPAK_CHUNKDIFF_AVG_BITS
+#define BPAK_CHUNKDIFF_AVG_BITS 13
+#endif
+
+#ifndef BPAK_CHUNKDIFF_MAX_SIZE
+#define BPAK_CHUNKDIFF_MAX_SIZE (64 * 1024)
+#endif
+
+#define BPAK_CHUNKDIFF_MAGIC 0x4b435042 /* 'BPCK' */
+
+/* A chunkdiff stream starts with a header of
+ *  uint32 magic, uint32 chunk count, uint64 target length,
+ *  uint32 min size, uint32 max size, uint8 avg bits, uint8 reserved[7]
+ * followed by one index entry per target chunk, in target order, of
+ *  uint64 store offset, uint32 length, uint8 sha256[32]
+ * and the chunk store. The store holds every distinct chunk once, in the
+ * order that they first appear in the target. Store offsets start from
+ * the end of the index. Everything is little endian. */
+#define BPAK_CHUNKDIFF_HEADER_LENGTH 32
+#define BPAK_CHUNKDIFF_ENTRY_LENGTH 44
+#define BPAK_CHUNKDIFF_DIGEST_LENGTH 32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Split 'new_data' into content-defined chunks and write the chunk index
+ * and store. The stream does not depend on any origin, one encoded
+ * package serves every origin version and can be cached as is. The
+ * decoder only needs the store ranges of the chunks that its origin does
+ * not have, see bpak_chunkpatch_next_input.
+ *
+ * Memory usage is linear in the number of chunks.
+ *
+ * @param[in] new_data New, or target data
+ * @param[in] new_length Length of target data
+ * @param[in] write_output I/O callback for writing output data
+ * @param[in] output_offset Offset added to all output writes
+ * @param[in] user_priv Priv context for i/o callback
+ *
+ * @return size of the output stream on success or a negative number
+ */
+ssize_t bpak_chunkdiff(const uint8_t *new_data, size_t new_length,
+                       bpak_io_t write_output, off_t output_offset,
+                       void *user_priv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
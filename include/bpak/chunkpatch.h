@@ -0,0 +1,173 @@
+/**
+ * \file chunkpatch.h
+ *
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef BPAK_CHUNKPATCH_H
+#define BPAK_CHUNKPATCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <bpak/bpak.h>
+#include <bpak/chunkdiff.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Where the data of a target chunk comes from */
+enum bpak_chunkpatch_source {
+    BPAK_CHUNKPATCH_STORE = 0, /*!< The chunk store of the input stream */
+    BPAK_CHUNKPATCH_ORIGIN,    /*!< A chunk of the origin with the digest */
+    BPAK_CHUNKPATCH_OUTPUT,    /*!< An earlier chunk of the output */
+};
+
+/** Index entry of one target chunk */
+struct bpak_chunkpatch_entry {
+    uint64_t store_offset; /*!< Offset in the chunk store */
+    uint64_t source_offset; /*!< Origin or output position of the data */
+    uint32_t length;
+    uint8_t source; /*!< enum bpak_chunkpatch_source */
+    uint8_t digest[BPAK_CHUNKDIFF_DIGEST_LENGTH];
+};
+
+struct bpak_chunkpatch_context {
+    uint8_t *buffer;        /*!< Work buffer for origin and output copies */
+    size_t buffer_length;   /*!< Length of work buffer */
+    size_t input_length;    /*!< Length of the chunkdiff stream */
+    uint64_t input_position; /*!< Stream bytes consumed or skipped */
+    bpak_io_t read_origin;  /*!< Callback for reading origin data or NULL */
+    off_t origin_offset;    /*!< Origin stream offset */
+    size_t origin_length;   /*!< Origin data that is searched for chunks */
+    bpak_io_t write_output; /*!< Callback for writing output data */
+    bpak_io_t read_output;  /*!< Callback for reading output data */
+    off_t output_offset;    /*!< Output stream offset */
+    uint64_t output_position; /*!< Current position in output data */
+    const struct bpak_allocator *allocator;
+    uint8_t header[BPAK_CHUNKDIFF_HEADER_LENGTH]; /*!< Stream header */
+    uint8_t entry_buf[BPAK_CHUNKDIFF_ENTRY_LENGTH]; /*!< Partial entry */
+    uint32_t count;         /*!< Number of target chunks */
+    uint32_t entries_read;  /*!< Index entries received */
+    uint64_t store_start;   /*!< Stream offset of the chunk store */
+    struct bpak_chunkpatch_entry *entries;
+    bool ready;             /*!< The index is read and matched */
+    uint32_t current;       /*!< Next entry to write */
+    uint32_t current_done;  /*!< Bytes of the current entry written */
+    uint64_t origin_chunk_bytes; /*!< Output taken from origin chunks */
+    uint64_t store_bytes;   /*!< Output taken from the chunk store */
+    void *user_priv;
+};
+
+/**
+ *  Initialize the BPAK chunkpatch context
+ *
+ *  The origin is split into chunks the same way as the target was once
+ *  the index has been received, and every target chunk that is found in
+ *  the origin is copied from there instead of the chunk store.
+ *
+ *  @param[in] ctx           Pointer to the context
+ *  @param[in] buffer        Work buffer used when copying chunks
+ *  @param[in] buffer_length Size of work buffer in bytes
+ *  @param[in] input_length  Length of the chunkdiff stream
+ *  @param[in] read_origin   Callback for reading origin data, or NULL to
+ *                           take every chunk from the store
+ *  @param[in] origin_offset Offset added to all origin reads
+ *  @param[in] origin_length Length of the origin data
+ *  @param[in] write_output  Callback for writing output data
+ *  @param[in] read_output   Callback for reading output data, chunks that
+ *                           repeat in the target are copied from their
+ *                           first position
+ *  @param[in] output_offset Offset added to all output reads and writes
+ *  @param[in] user_priv     User context sent to call backs
+ *
+ *  @return BPAK_OK on success or a negative number
+ */
+int bpak_chunkpatch_init(struct bpak_chunkpatch_context *ctx,
+                         uint8_t *buffer, size_t buffer_length,
+                         size_t input_length, bpak_io_t read_origin,
+                         off_t origin_offset, size_t origin_length,
+                         bpak_io_t write_output, bpak_io_t read_output,
+                         off_t output_offset, void *user_priv);
+
+/**
+ * Allocate the chunk index from 'allocator'. Must be called before any
+ * input is written.
+ *
+ * @param[in] ctx       Pointer to an initialized chunkpatch context
+ * @param[in] allocator Allocator or NULL for bpak_calloc, it must stay
+ *                      valid until bpak_chunkpatch_free
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_chunkpatch_set_allocator(struct bpak_chunkpatch_context *ctx,
+                                  const struct bpak_allocator *allocator);
+
+/**
+ * Peak heap use of the decoder for a stream of 'chunk_count' chunks,
+ * including the block overhead of struct bpak_arena
+ *
+ * @param[in] chunk_count Chunk count of the stream header
+ *
+ * @return Bytes needed
+ */
+size_t bpak_chunkpatch_heap_size(uint32_t chunk_count);
+
+/**
+ * Feed chunkpatch with input data, from the current input position on.
+ * Store data of chunks that are not needed is skipped.
+ *
+ * @param[in] ctx      Pointer to chunkpatch context
+ * @param[in] buffer   Input buffer
+ * @param[in] length   Bytes available in input buffer
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_chunkpatch_write(struct bpak_chunkpatch_context *ctx,
+                          uint8_t *buffer, size_t length);
+
+/**
+ * Get the next range of the input stream that the decoder needs. Input
+ * before 'offset' is skipped, the next write continues at 'offset'. Once
+ * the index is read the ranges only cover store chunks that are not in
+ * the origin, so a client can fetch them with range requests instead of
+ * downloading the whole stream. 'length' is zero when no more input is
+ * needed.
+ *
+ * @param[in] ctx     Pointer to chunkpatch context
+ * @param[out] offset Stream offset of the range
+ * @param[out] length Length of the range
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_chunkpatch_next_input(struct bpak_chunkpatch_context *ctx,
+                               uint64_t *offset, uint64_t *length);
+
+/**
+ * Call bpak_chunkpatch_final when there is no more input.
+ *
+ * @param[in] ctx Pointer to chunkpatch context
+ *
+ * @return the output size or a negative number on error
+ */
+ssize_t bpak_chunkpatch_final(struct bpak_chunkpatch_context *ctx);
+
+/**
+ * Free the chunk index
+ *
+ * @param[in] ctx Pointer to chunkpatch context
+ */
+void bpak_chunkpatch_free(struct bpak_chunkpatch_context *ctx);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -2,13 +2,40 @@
 #define INCLUDE_PBAK_CRC_H_
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Update a CRC-32 (zlib polynomial) with 'size' bytes. The CRC is not
+ * inverted before or after the update.
+ */
 uint32_t bpak_crc32(uint32_t crc, const uint8_t *buf, uint32_t size);
 
+/**
+ * Same as bpak_crc32 for inputs of any length. It uses the carry-less
+ * multiply instructions on x86 and the ARMv8 crc32 instructions when the
+ * CPU has them, and slice-by-8 tables otherwise.
+ *
+ * @param[in] crc CRC of the data before 'buf'
+ * @param[in] buf Input data
+ * @param[in] length Bytes in 'buf'
+ *
+ * @return Updated CRC
+ */
+uint32_t bpak_crc32_update(uint32_t crc, const uint8_t *buf, size_t length);
+
+/**
+ * Enable or disable the CPU CRC-32 kernels, they are enabled by default.
+ * Meant for testing that they match the portable code.
+ *
+ * @param[in] enable true to use the CPU kernels when they are available
+ */
+void bpak_crc32_set_acceleration(bool enable);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
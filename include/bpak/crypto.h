@@ -15,6 +15,21 @@
 extern "C" {
 #endif
 
+#if BPAK_CONFIG_SHA == 1
+/**
+ * State of the built-in SHA-2 backend
+ */
+struct bpak_sha_context {
+    union {
+        uint32_t s256[8];
+        uint64_t s512[8];
+    } state;
+    uint64_t length;    /*!< Total number of bytes hashed */
+    uint8_t block[128]; /*!< Partial input block */
+    size_t block_fill;  /*!< Bytes used in 'block' */
+};
+#endif
+
 struct bpak_hash_context {
     enum bpak_hash_kind kind;
     union {
@@ -22,6 +37,9 @@ struct bpak_hash_context {
 #if BPAK_CONFIG_MBEDTLS == 1
         mbedtls_sha256_context mbed_sha256;
         mbedtls_sha512_context mbed_sha512;
+#endif
+#if BPAK_CONFIG_SHA == 1
+        struct bpak_sha_context sha;
 #endif
     } backend;
 };
@@ -37,6 +55,9 @@ typedef int (*bpak_hash_final_func_t)(struct bpak_hash_context *ctx,
 
 typedef void (*bpak_hash_free_func_t)(struct bpak_hash_context *ctx);
 
+typedef int (*bpak_hash_clone_func_t)(struct bpak_hash_context *dst,
+                                      const struct bpak_hash_context *src);
+
 typedef int (*bpak_crypto_verify_func_t)(const uint8_t *signature,
                                          size_t signature_length,
                                          const uint8_t *hash,
@@ -44,11 +65,28 @@ typedef int (*bpak_crypto_verify_func_t)(const uint8_t *signature,
                                          enum bpak_hash_kind kind,
                                          struct bpak_key *key, bool *verified);
 
+typedef int (*bpak_crypto_prepare_key_func_t)(struct bpak_key *key,
+                                              void **prepared);
+
+typedef int (*bpak_crypto_verify_prepared_func_t)(
+    const uint8_t *signature, size_t signature_length, const uint8_t *hash,
+    size_t hash_length, enum bpak_hash_kind kind, void *prepared,
+    bool *verified);
+
+typedef void (*bpak_crypto_free_key_func_t)(void *prepared);
+
 typedef int (*bpak_crypto_sign_func_t)(const uint8_t *hash, size_t hash_length,
                                        enum bpak_hash_kind kind,
                                        struct bpak_key *key, uint8_t *signature,
                                        size_t *signature_length);
 
+typedef int (*bpak_crypto_sign_prepared_func_t)(const uint8_t *hash,
+                                                size_t hash_length,
+                                                enum bpak_hash_kind kind,
+                                                void *prepared,
+                                                uint8_t *signature,
+                                                size_t *signature_length);
+
 typedef int (*bpak_crypto_load_key_func_t)(const char *filename,
                                            struct bpak_key **output);
 
@@ -71,6 +109,58 @@ void bpak_hash_setup(bpak_hash_init_func_t init_func,
                      bpak_hash_final_func_t final_func,
                      bpak_hash_free_func_t free_func);
 
+/**
+ * Copy the state of a hash context that has been initialized and possibly
+ * updated. Both contexts must be released with bpak_hash_free.
+ *
+ * @param[out] dst Destination context
+ * @param[in] src Source context
+ *
+ * @return BPAK_OK on success, -BPAK_NOT_SUPPORTED if the hash backend has no
+ *         clone function or a negative number on other errors
+ */
+int bpak_hash_clone(struct bpak_hash_context *dst,
+                    const struct bpak_hash_context *src);
+
+/**
+ * Install the clone function of the hash backend. bpak_hash_setup removes
+ * the clone function, so this is called after it.
+ *
+ * @param[in] clone_func Clone function or NULL
+ */
+void bpak_hash_clone_setup(bpak_hash_clone_func_t clone_func);
+
+#if BPAK_CONFIG_SHA == 1
+/**
+ * Built-in SHA-256/384/512 backend, the default hash backend when bpak is
+ * built with BPAK_SHA. The functions can be passed to bpak_hash_setup to
+ * restore the built-in backend after another one has been installed.
+ *
+ * SHA-256 uses the x86 SHA extensions or the ARMv8 crypto extensions when
+ * the CPU supports them.
+ */
+int bpak_sha_hash_init(struct bpak_hash_context *ctx);
+
+int bpak_sha_hash_update(struct bpak_hash_context *ctx, const uint8_t *buffer,
+                         size_t length);
+
+int bpak_sha_hash_final(struct bpak_hash_context *ctx, uint8_t *buffer,
+                        size_t buffer_length, size_t *result_length);
+
+void bpak_sha_hash_free(struct bpak_hash_context *ctx);
+
+int bpak_sha_hash_clone(struct bpak_hash_context *dst,
+                        const struct bpak_hash_context *src);
+
+/**
+ * Enable or disable the CPU accelerated code paths of the built-in SHA
+ * backend. Acceleration is enabled by default when the CPU supports it.
+ *
+ * @param[in] enable false forces the portable implementation
+ */
+void bpak_sha_set_acceleration(bool enable);
+#endif
+
 int bpak_crypto_verify(const uint8_t *signature, size_t signature_length,
                        const uint8_t *hash, size_t hash_length,
                        enum bpak_hash_kind kind, struct bpak_key *key,
@@ -80,6 +170,68 @@ int bpak_crypto_sign(const uint8_t *hash, size_t hash_length,
                      enum bpak_hash_kind kind, struct bpak_key *key,
                      uint8_t *signature, size_t *signature_length);
 
+/**
+ * Key that the crypto backend has parsed once, for verifying or making
+ * many signatures with the same key
+ */
+struct bpak_prepared_key {
+    struct bpak_key *key; /*!< The key, must outlive the prepared key */
+    void *backend;        /*!< Backend key, NULL if it has no prepare */
+};
+
+/**
+ * Prepare 'key' for bpak_crypto_verify_prepared. Backends without a
+ * prepare function verify with the key as bpak_crypto_verify does.
+ *
+ * A prepared key may cache state of the backend while it is used, it must
+ * not be used by several threads at once.
+ *
+ * @param[out] prepared Prepared key, released with
+ *                      bpak_crypto_free_prepared_key
+ * @param[in] key Public key
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_crypto_prepare_key(struct bpak_prepared_key *prepared,
+                            struct bpak_key *key);
+
+/**
+ * Verify a signature like bpak_crypto_verify, with a prepared key
+ */
+int bpak_crypto_verify_prepared(const uint8_t *signature,
+                                size_t signature_length, const uint8_t *hash,
+                                size_t hash_length, enum bpak_hash_kind kind,
+                                struct bpak_prepared_key *prepared,
+                                bool *verified);
+
+/**
+ * Prepare the private 'key' for bpak_crypto_sign_prepared. The mbedtls
+ * backend parses the key and seeds its random generator once. A backend
+ * that signs with an HSM can open its session here.
+ *
+ * Like for verification, a prepared key must not be used by several
+ * threads at once.
+ *
+ * @param[out] prepared Prepared key, released with
+ *                      bpak_crypto_free_prepared_key
+ * @param[in] key Private key
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_crypto_prepare_sign_key(struct bpak_prepared_key *prepared,
+                                 struct bpak_key *key);
+
+/**
+ * Sign a hash like bpak_crypto_sign, with a key from
+ * bpak_crypto_prepare_sign_key
+ */
+int bpak_crypto_sign_prepared(const uint8_t *hash, size_t hash_length,
+                              enum bpak_hash_kind kind,
+                              struct bpak_prepared_key *prepared,
+                              uint8_t *signature, size_t *signature_length);
+
+void bpak_crypto_free_prepared_key(struct bpak_prepared_key *prepared);
+
 int bpak_crypto_load_public_key(const char *filename, struct bpak_key **output);
 int bpak_crypto_load_private_key(const char *filename,
                                  struct bpak_key **output);
@@ -92,6 +244,30 @@ void bpak_crypto_setup(bpak_crypto_verify_func_t verify_func,
                        bpak_crypto_load_key_func_t load_pri_key_func,
                        bpak_crypto_parse_key_func_t parse_pub_key_func);
 
+/**
+ * Install the prepared key functions of the crypto backend.
+ * bpak_crypto_setup removes them, so this is called after it.
+ *
+ * @param[in] prepare_func Parses a public key, or NULL
+ * @param[in] verify_func Verifies with a parsed key
+ * @param[in] free_func Releases a parsed key
+ */
+void bpak_crypto_prepared_setup(bpak_crypto_prepare_key_func_t prepare_func,
+                                bpak_crypto_verify_prepared_func_t verify_func,
+                                bpak_crypto_free_key_func_t free_func);
+
+/**
+ * Install the prepared signing functions of the crypto backend, the keys
+ * are released with the free function of bpak_crypto_prepared_setup.
+ * bpak_crypto_setup removes them, so this is called after it.
+ *
+ * @param[in] prepare_func Parses a private key, or NULL
+ * @param[in] sign_func Signs with a parsed key
+ */
+void bpak_crypto_prepared_sign_setup(
+    bpak_crypto_prepare_key_func_t prepare_func,
+    bpak_crypto_sign_prepared_func_t sign_func);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <bpak/build_config.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,13 +22,26 @@ extern "C" {
 #define HEATSHRINK_LITERAL_MARKER 0x01
 #define HEATSHRINK_BACKREF_MARKER 0x00
 
-/* Required parameters for static configuration */
-#define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE 256
-#define HEATSHRINK_STATIC_WINDOW_BITS       8
-#define HEATSHRINK_STATIC_LOOKAHEAD_BITS    7
+/* Required parameters for static configuration, set through build_config.
+ * The window and lookahead must be the same in the encoder and decoder */
+#define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE BPAK_CONFIG_HS_INPUT_BUFFER_SIZE
+#define HEATSHRINK_STATIC_WINDOW_BITS       BPAK_CONFIG_HS_WINDOW_BITS
+#define HEATSHRINK_STATIC_LOOKAHEAD_BITS    BPAK_CONFIG_HS_LOOKAHEAD_BITS
 
-/* Use indexing for faster compression. (This requires additional space.) */
-#define HEATSHRINK_USE_INDEX 0
+#if (HEATSHRINK_STATIC_WINDOW_BITS < HEATSHRINK_MIN_WINDOW_BITS) ||            \
+    (HEATSHRINK_STATIC_WINDOW_BITS > HEATSHRINK_MAX_WINDOW_BITS)
+#error "Unsupported heatshrink window size"
+#endif
+
+#if (HEATSHRINK_STATIC_LOOKAHEAD_BITS < HEATSHRINK_MIN_LOOKAHEAD_BITS) ||      \
+    (HEATSHRINK_STATIC_LOOKAHEAD_BITS >= HEATSHRINK_STATIC_WINDOW_BITS)
+#error "Unsupported heatshrink lookahead size"
+#endif
+
+#if (HEATSHRINK_STATIC_INPUT_BUFFER_SIZE < 1) ||                               \
+    (HEATSHRINK_STATIC_INPUT_BUFFER_SIZE > 32768)
+#error "Unsupported heatshrink input buffer size"
+#endif
 
 typedef enum {
     HSDR_SINK_OK,              /* data sunk, ready to poll */
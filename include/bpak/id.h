@@ -25,16 +25,34 @@
 #define BPAK_ID_BPAK_PACKAGE         (0xfb2f1f3f)
 #define BPAK_ID_BPAK_KEY_ID          (0x7da19399)
 #define BPAK_ID_BPAK_KEY_STORE       (0x106c13a7)
+#define BPAK_ID_PART_DIGEST          (0x24f210c9)
+#define BPAK_ID_SPARSE_MAP           (0xafc1514b)
+#define BPAK_ID_ORIGIN_PARTS         (0x5dc8642b)
+#define BPAK_ID_MERKLE_BLOCK_SIZE    (0x77fa6cd1)
 
 /* Algorithm ID's */
+#define BPAK_ID_AUTO            (0x47fefae6)
+#define BPAK_ID_BLOCKDIFF       (0x8c9983c5)
+#define BPAK_ID_BLOCKPATCH      (0x9aeadc20)
 #define BPAK_ID_BSDIFF          (0x9f7aacf9)
 #define BPAK_ID_BSDIFF_LZMA     (0x1607e56e)
 #define BPAK_ID_BSDIFF_NO_COMP  (0x0a878e3e)
+#define BPAK_ID_BSDIFF_ZSTD     (0x87ce8b35)
 #define BPAK_ID_BSPATCH         (0xb5964388)
 #define BPAK_ID_BSPATCH_LZMA    (0x933a9893)
 #define BPAK_ID_BSPATCH_NO_COMP (0x75622592)
+#define BPAK_ID_BSPATCH_ZSTD    (0x02f3f6c8)
+#define BPAK_ID_CHUNKDIFF       (0x60984922)
+#define BPAK_ID_CHUNKPATCH      (0xa468aa31)
+#define BPAK_ID_COMPRESS_HS     (0x8b6dcd9f)
+#define BPAK_ID_COMPRESS_LZMA   (0x69bfe1b7)
+#define BPAK_ID_COMPRESS_ZSTD   (0xf8768fec)
+#define BPAK_ID_DECOMPRESS_HS   (0xfe33810f)
+#define BPAK_ID_DECOMPRESS_LZMA (0xa9832073)
+#define BPAK_ID_DECOMPRESS_ZSTD (0x384a4e28)
 #define BPAK_ID_MERKLE_GENERATE (0xb5bcc58f)
 #define BPAK_ID_REMOVE_DATA     (0x57004cd0)
+#define BPAK_ID_REUSE_ORIGIN    (0x69ee95e3)
 
 #ifdef __cplusplus
 extern "C" {
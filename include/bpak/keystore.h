@@ -12,11 +12,21 @@ typedef int (*bpak_check_header_t)(struct bpak_header *header, void *user);
 
 struct bpak_keystore {
     uint32_t id;
-    uint8_t no_of_keys;
+    uint16_t no_of_keys;
     bool verified;
+    bool sorted; /*!< 'keys' are in ascending id order */
     struct bpak_key *keys[];
 };
 
+/**
+ * Get key 'id' from a verified keystore
+ *
+ * A keystore from 'bpak generate keystore' has its keys sorted by id and
+ * is searched in O(log n). Other keystores, with 'sorted' false, are
+ * searched linearly.
+ *
+ * Returns BPAK_OK on success or a negative number.
+ */
 int bpak_keystore_get(struct bpak_keystore *ks, uint32_t id,
                       struct bpak_key **k);
 /**
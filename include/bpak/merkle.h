@@ -22,11 +22,25 @@
 extern "C" {
 #endif
 
+/* Default block size, the same as dm-verity */
 #define BPAK_MERKLE_BLOCK_SZ 4096
-/* Maximum input data length is 1 TiB with four hash levels */
-#define BPAK_MERKLE_MAX_LEVELS 4
+/* Block sizes that bpak_merkle_options accepts, powers of two in between */
+#define BPAK_MERKLE_MIN_BLOCK_SZ 1024
+#ifndef BPAK_MERKLE_MAX_BLOCK_SZ
+#define BPAK_MERKLE_MAX_BLOCK_SZ (64 * 1024)
+#endif
+/* Maximum input data length is 1 TiB with four hash levels of 4 KiB
+ * blocks, every extra level multiplies it by 128 */
+#define BPAK_MERKLE_MAX_LEVELS 8
 #define BPAK_MERKLE_BLOCK_BITS 12
 #define BPAK_MERKLE_HASH_BYTES 32
+/* Leaves hashed by each thread per batch in bpak_merkle_write_leaves, with
+ * other block sizes it is the same number of bytes */
+#define BPAK_MERKLE_JOB_LEAVES 256
+#define BPAK_MERKLE_MAX_JOBS   64
+/* Verified tree blocks kept by bpak_merkle_verify_block, at least one per
+ * level */
+#define BPAK_MERKLE_CACHE_BLOCKS 8
 
 /**
  * \typedef bpak_merkle_hash_t
@@ -34,9 +48,28 @@ extern "C" {
  */
 typedef unsigned char bpak_merkle_hash_t[BPAK_MERKLE_HASH_BYTES];
 
+/**
+ * Tree layout settings. The block size is both the leaf size and the size
+ * of the tree blocks, larger blocks give a smaller and shallower tree for
+ * large images at the cost of reading more data per verified block.
+ */
+struct bpak_merkle_options {
+    /*! Block size in bytes, 0 for BPAK_MERKLE_BLOCK_SZ */
+    size_t block_size;
+    /*! Maximum number of hash levels, 0 for BPAK_MERKLE_MAX_LEVELS */
+    unsigned int max_levels;
+};
+
 struct bpak_merkle_context {
     struct bpak_hash_context running_hash;
+    /*! Hash of the salt, copied to start each leaf and node hash */
+    struct bpak_hash_context salted_hash;
+    bool salted_hash_valid;
     uint8_t buffer[BPAK_MERKLE_HASH_BYTES];
+    /*! Level 0 hashes that are not written yet, work buffer in finish */
+    uint8_t block[BPAK_MERKLE_BLOCK_SZ];
+    size_t block_fill; /*!< Bytes used in block */
+    size_t block_size; /*!< Leaf and tree block size */
     size_t level_length[BPAK_MERKLE_MAX_LEVELS];
     off_t level_offset[BPAK_MERKLE_MAX_LEVELS];
     unsigned int no_of_levels;
@@ -51,11 +84,71 @@ struct bpak_merkle_context {
     bpak_io_t wr;     /*!< Function to write to the hash tree */
     bpak_io_t rd;     /*!< Function to read from the hash tree */
     off_t offset;
+    unsigned int jobs; /*!< Leaf hashing threads, see bpak_merkle_set_jobs */
+    /*! Work buffer allocator, see bpak_merkle_set_allocator */
+    const struct bpak_allocator *allocator;
     void *priv; /*!< Externalt context variable */
 };
 
+/*! Tree block cache entry of struct bpak_merkle_verify_context */
+struct bpak_merkle_cache_block {
+    off_t offset;   /*!< Offset of the block within the hash tree */
+    uint64_t stamp; /*!< Last use, the lowest stamp is evicted first */
+    enum {
+        BPAK_MERKLE_CACHE_UNUSED,
+        BPAK_MERKLE_CACHE_PENDING, /*!< Read, not yet verified */
+        BPAK_MERKLE_CACHE_VERIFIED,
+    } state;
+    uint8_t *data; /*!< One tree block */
+};
+
+struct bpak_merkle_verify_context {
+    struct bpak_merkle_context tree; /*!< Tree layout and salted hash */
+    bpak_merkle_hash_t roothash;     /*!< Trusted root hash */
+    uint64_t stamp;
+    struct bpak_merkle_cache_block cache[BPAK_MERKLE_CACHE_BLOCKS];
+    /*! Cache data up to the default block size, larger blocks are
+     * allocated */
+    uint8_t cache_data[BPAK_MERKLE_CACHE_BLOCKS][BPAK_MERKLE_BLOCK_SZ];
+    uint8_t *cache_heap;
+};
+
+/**
+ * Returns the size in bytes of the hash tree of 'input_data_length' bytes
+ * with the default block size
+ *
+ * @param[in] input_data_length Size of filesystem in bytes
+ *
+ * @return Size in bytes, -BPAK_BAD_ALIGNMENT when the length is not a
+ *         multiple of the block size or -BPAK_NO_SPACE_LEFT when the tree
+ *         needs more levels than allowed
+ */
 ssize_t bpak_merkle_compute_size(size_t input_data_length);
 
+/**
+ * bpak_merkle_compute_size with tree layout settings
+ *
+ * @param[in] input_data_length Size of filesystem in bytes
+ * @param[in] options Settings, or NULL for the defaults
+ *
+ * @return Size in bytes or a negative number, -BPAK_NOT_SUPPORTED when
+ *         the block size is not a power of two between
+ *         BPAK_MERKLE_MIN_BLOCK_SZ and BPAK_MERKLE_MAX_BLOCK_SZ
+ */
+ssize_t
+bpak_merkle_compute_tree_size(size_t input_data_length,
+                              const struct bpak_merkle_options *options);
+
+/**
+ * Load the settings of a 'merkle-block-size' meta
+ *
+ * @param[in] block_size_meta Meta data, a 32 or 64 bit little endian
+ *                            integer, or NULL when the part has none
+ * @param[out] options Settings
+ */
+void bpak_merkle_options_from_meta(const uint8_t *block_size_meta,
+                                   struct bpak_merkle_options *options);
+
 /**
  * Returns the total size in bytes of the hash tree
  *
@@ -85,6 +178,22 @@ int bpak_merkle_init(struct bpak_merkle_context *ctx, size_t input_data_length,
                      bpak_io_t rd, off_t offset, bool zero_fill_output,
                      void *priv);
 
+/**
+ * Initializes the merkle algorithm with tree layout settings
+ *
+ * @param[in] options Settings, or NULL for the defaults
+ *
+ * See bpak_merkle_init for the other parameters.
+ *
+ * @return BPAK_OK on success and non zero number on error
+ */
+int bpak_merkle_init_opts(struct bpak_merkle_context *ctx,
+                          size_t input_data_length, const uint8_t *salt,
+                          size_t salt_length, bpak_io_t wr, bpak_io_t rd,
+                          off_t offset, bool zero_fill_output,
+                          const struct bpak_merkle_options *options,
+                          void *priv);
+
 /**
  * Process input data stream. This function can also be called with no buffer
  * and \ref sz set to zero to complete the hash tree computation.
@@ -99,7 +208,133 @@ int bpak_merkle_write_chunk(struct bpak_merkle_context *ctx, uint8_t *buffer,
                             size_t length);
 
 /**
- * Outputs the root hash when the tree is computed
+ * Set the number of threads used to hash leaves. bpak_merkle_init resets it
+ * to one, which hashes the leaves one after another in the calling thread.
+ *
+ * @param[in] ctx Context
+ * @param[in] jobs Number of threads, 0 uses one per online CPU
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_merkle_set_jobs(struct bpak_merkle_context *ctx, unsigned int jobs);
+
+/**
+ * Allocate the work buffers of bpak_merkle_write_leaves and
+ * bpak_merkle_finish from 'allocator'. bpak_merkle_init resets it to NULL,
+ * which uses bpak_calloc. The buffers are freed before the functions
+ * return, so one arena of bpak_merkle_heap_size bytes is enough.
+ *
+ * @param[in] ctx Context
+ * @param[in] allocator Allocator or NULL
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_merkle_set_allocator(struct bpak_merkle_context *ctx,
+                              const struct bpak_allocator *allocator);
+
+/**
+ * Peak heap use of the context with its current number of jobs, including
+ * the block overhead of struct bpak_arena
+ *
+ * @param[in] ctx Context
+ *
+ * @return Bytes needed
+ */
+size_t bpak_merkle_heap_size(const struct bpak_merkle_context *ctx);
+
+/**
+ * Hash 'count' complete leaves of one block each. The leaves are
+ * independent and split over the threads set by bpak_merkle_set_jobs,
+ * their hashes are then written to the tree in order. The result is the same
+ * as passing the data to bpak_merkle_write_chunk, which uses this function
+ * for all complete leaves in its input.
+ *
+ * @param[in] ctx Context
+ * @param[in] buffer Leaf data, count blocks
+ * @param[in] count Number of leaves
+ *
+ * @return BPAK_OK on success, -BPAK_BAD_ALIGNMENT if a previous call to
+ *         bpak_merkle_write_chunk ended in the middle of a leaf
+ */
+int bpak_merkle_write_leaves(struct bpak_merkle_context *ctx,
+                             const uint8_t *buffer, size_t count);
+
+/**
+ * Add 'count' leaf hashes that are already known, in place of the leaf
+ * data. The hashes must have been computed with the same salt, for example
+ * taken from the tree of an earlier version of the same data.
+ *
+ * @param[in] ctx Context
+ * @param[in] hashes Leaf hashes, count * BPAK_MERKLE_HASH_BYTES bytes
+ * @param[in] count Number of leaves
+ *
+ * @return BPAK_OK on success, -BPAK_BAD_ALIGNMENT if a previous call to
+ *         bpak_merkle_write_chunk ended in the middle of a leaf
+ */
+int bpak_merkle_write_hashes(struct bpak_merkle_context *ctx,
+                             const uint8_t *hashes, size_t count);
+
+/**
+ * Add 'count' leaves of zero bytes. The zero leaf is hashed once and its
+ * hash is added with bpak_merkle_write_hashes.
+ *
+ * @param[in] ctx Context
+ * @param[in] count Number of zero leaves
+ *
+ * @return BPAK_OK on success, -BPAK_BAD_ALIGNMENT if a previous call to
+ *         bpak_merkle_write_chunk ended in the middle of a leaf
+ */
+int bpak_merkle_write_zero_leaves(struct bpak_merkle_context *ctx,
+                                  size_t count);
+
+/**
+ * Process stored data of a sparse part. The tree is built over the
+ * expanded data, the zero blocks of 'map' are added as zero leaves where
+ * they belong. Bytes after the stored data, like the part padding, are
+ * ignored. The context must be initialized with the expanded size.
+ *
+ * @param[in] ctx Context
+ * @param[in] map Sparse map of the part
+ * @param[in] position Offset of 'buffer' in the stored part data, input is
+ *                     passed in order
+ * @param[in] buffer Input data buffer
+ * @param[in] length Available bytes in buffer
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_merkle_write_sparse(struct bpak_merkle_context *ctx,
+                             const struct bpak_sparse_map *map,
+                             uint64_t position, uint8_t *buffer,
+                             size_t length);
+
+/**
+ * Offset of the hash of leaf 'index' within the hash tree of
+ * 'input_data_length' bytes of data
+ *
+ * @param[in] input_data_length Size of filesystem in bytes
+ * @param[in] index Index of the data block
+ *
+ * @return Offset on success, or a negative number when the length is
+ *         invalid or the index is outside of the data
+ */
+off_t bpak_merkle_leaf_offset(size_t input_data_length, size_t index);
+
+/**
+ * bpak_merkle_leaf_offset with tree layout settings
+ *
+ * @param[in] input_data_length Size of filesystem in bytes
+ * @param[in] options Settings, or NULL for the defaults
+ * @param[in] index Index of the data block
+ *
+ * @return Offset on success or a negative number
+ */
+off_t bpak_merkle_tree_leaf_offset(size_t input_data_length,
+                                   const struct bpak_merkle_options *options,
+                                   size_t index);
+
+/**
+ * Outputs the root hash when the tree is computed and releases the hash
+ * state that bpak_merkle_init allocated
  *
  * @param[in] ctx Context
  * @param[out] roothash Root hash output
@@ -109,6 +344,69 @@ int bpak_merkle_write_chunk(struct bpak_merkle_context *ctx, uint8_t *buffer,
 int bpak_merkle_finish(struct bpak_merkle_context *ctx,
                        bpak_merkle_hash_t roothash);
 
+/**
+ * Initialize on-demand verification of single data blocks against a hash
+ * tree, in the style of dm-verity. No tree data is read here, each call to
+ * bpak_merkle_verify_block reads and checks the path from one leaf to the
+ * trusted root hash. Verified tree blocks are kept in a small LRU cache,
+ * which ends the walk early when a block on the path is already verified.
+ *
+ * @param[in] ctx Context
+ * @param[in] input_data_length Size of filesystem in bytes
+ * @param[in] salt Salt used when the tree was computed
+ * @param[in] salt_length Length of salt in bytes
+ * @param[in] roothash Trusted root hash, for example from a signed header
+ * @param[in] rd Read callback function for the hash tree
+ * @param[in] offset Offset where hash tree data starts
+ * @param[in] priv Optional private context
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_merkle_verify_init(struct bpak_merkle_verify_context *ctx,
+                            size_t input_data_length, const uint8_t *salt,
+                            size_t salt_length,
+                            const bpak_merkle_hash_t roothash, bpak_io_t rd,
+                            off_t offset, void *priv);
+
+/**
+ * Initialize on-demand verification with tree layout settings, which must
+ * be the same as when the tree was computed
+ *
+ * @param[in] options Settings, or NULL for the defaults
+ *
+ * See bpak_merkle_verify_init for the other parameters.
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_merkle_verify_init_opts(struct bpak_merkle_verify_context *ctx,
+                                 size_t input_data_length,
+                                 const uint8_t *salt, size_t salt_length,
+                                 const bpak_merkle_hash_t roothash,
+                                 bpak_io_t rd, off_t offset,
+                                 const struct bpak_merkle_options *options,
+                                 void *priv);
+
+/**
+ * Verify one data block
+ *
+ * @param[in] ctx Context
+ * @param[in] block_index Index of the data block
+ * @param[in] data One block of data
+ *
+ * @return BPAK_OK when the block is valid, -BPAK_BAD_ROOT_HASH when the
+ *         block or the tree does not match the root hash or
+ *         -BPAK_SIZE_ERROR if the index is outside of the data
+ */
+int bpak_merkle_verify_block(struct bpak_merkle_verify_context *ctx,
+                             size_t block_index, const uint8_t *data);
+
+/**
+ * Release the resources of a verify context
+ *
+ * @param[in] ctx Context
+ */
+void bpak_merkle_verify_free(struct bpak_merkle_verify_context *ctx);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -15,19 +15,57 @@
 #include <stdio.h>
 #include <bpak/bpak.h>
 #include <bpak/key.h>
+#include <bpak/crypto.h>
+#include <bpak/transport.h>
+#include <bpak/verify.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Package I/O backend
+ *
+ * All callbacks get the 'io_priv' pointer of the package as their last
+ * argument. read_at and write_at return the number of bytes transferred,
+ * which may be less than requested, or a negative number on error.
+ */
+struct bpak_pkg_io {
+    bpak_io_t read_at;  /*!< Read at an offset */
+    bpak_io_t write_at; /*!< Write at an offset, NULL for read-only */
+    ssize_t (*size)(void *priv); /*!< Current size in bytes */
+    int (*sync)(void *priv); /*!< Make written data durable, optional */
+    /*! Optional read-only mapping of the whole package, returns NULL when
+     *  the package can't be mapped. The backend owns the mapping. */
+    const uint8_t *(*map)(size_t *size, void *priv);
+};
+
 /**
  * BPAK Package
  *
  */
 struct bpak_package {
     FILE *fp;                  /*!< I/O Stream  for package */
+    const struct bpak_pkg_io *io; /*!< I/O backend, stdio for bpak_pkg_open */
+    void *io_priv;             /*!< Backend context */
     const char *filename;      /*!< Filename */
     struct bpak_header header; /*!< BPAK Header */
+    void *hash_state; /*!< Payload hash state, see bpak_pkg_set_hash_cache */
+    const uint8_t *map; /*!< Read-only mapping, see bpak_pkg_open_mmap */
+    size_t map_size;    /*!< Size of the mapping in bytes */
+    /*! Continuation tables after the header, see bpak_pkg_table_count */
+    struct bpak_header *tables;
+};
+
+/**
+ * Single pass package builder, see bpak_pkg_builder_init
+ */
+struct bpak_pkg_builder {
+    struct bpak_package pkg;              /*!< Output package */
+    struct bpak_hash_context payload_hash; /*!< Hash of the parts so far */
+    bool payload_hash_valid;
+    bool part_digests; /*!< Add a 'part-digest' meta for each hashed part */
+    uint64_t offset;   /*!< Offset of the next part */
 };
 
 /**
@@ -42,6 +80,86 @@ struct bpak_package {
 int bpak_pkg_open(struct bpak_package *pkg, const char *filename,
                   const char *mode);
 
+/**
+ * Open a package on a custom I/O backend
+ *
+ * The header is read through 'io', and written when the package is empty
+ * and 'io->write_at' is set. Creating, signing and verifying packages and
+ * extracting parts work on any backend. Deleting parts and transport
+ * coding need a stdio package and return -BPAK_NOT_SUPPORTED otherwise.
+ * bpak_pkg_verify_jobs with more than one job calls 'io->read_at' from
+ * several threads at once. Hashing reads ahead from a helper thread, one
+ * read at a time, while the calling thread hashes.
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] io I/O backend, must outlive the package
+ * @param[in] priv Backend context passed to the callbacks
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_open_io(struct bpak_package *pkg, const struct bpak_pkg_io *io,
+                     void *priv);
+
+/**
+ * Read from the package
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] offset Offset in the package
+ * @param[out] buf Output buffer
+ * @param[in] size Number of bytes to read
+ *
+ * @return BPAK_OK when all of \ref size bytes were read
+ */
+int bpak_pkg_read_at(struct bpak_package *pkg, off_t offset, uint8_t *buf,
+                     size_t size);
+
+/**
+ * Write to the package
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] offset Offset in the package
+ * @param[in] buf Data to write
+ * @param[in] size Number of bytes to write
+ *
+ * @return BPAK_OK when all of \ref size bytes were written
+ */
+int bpak_pkg_write_at(struct bpak_package *pkg, off_t offset,
+                      const uint8_t *buf, size_t size);
+
+/**
+ * Open a package read-only and map the whole file into memory
+ *
+ * The stream is kept open and every read-only operation works as on a
+ * package from bpak_pkg_open. Verification, extraction and the diff
+ * encoders read from the mapping instead of the stream, and
+ * bpak_pkg_part_view gives direct access to the part data. The mapping is
+ * removed by bpak_pkg_close.
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] filename Filename
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_open_mmap(struct bpak_package *pkg, const char *filename);
+
+/**
+ * Get a pointer to the data of a part in a mapped package
+ *
+ * The view is the stored data without the zero padding, or the transport
+ * encoded data for a part that is encoded for transport. It is valid until
+ * the package is closed.
+ *
+ * @param[in] pkg Package opened with bpak_pkg_open_mmap
+ * @param[in] part_id Id of the part
+ * @param[out] data Pointer to the part data
+ * @param[out] size Size of the part data in bytes
+ *
+ * @return BPAK_OK on success, -BPAK_NOT_SUPPORTED when the package is not
+ *         mapped or -BPAK_SIZE_ERROR if the part is outside of the file
+ */
+int bpak_pkg_part_view(struct bpak_package *pkg, bpak_id_t part_id,
+                       const uint8_t **data, size_t *size);
+
 /**
  * Close a package
  *
@@ -51,9 +169,43 @@ int bpak_pkg_open(struct bpak_package *pkg, const char *filename,
  */
 int bpak_pkg_close(struct bpak_package *pkg);
 
+/**
+ * Keep the payload hash state in 'filename' between sessions
+ *
+ * bpak_pkg_update_hash keeps the payload hash state at the end of the
+ * payload. When the next update only finds parts appended after it, the
+ * hash continues from that state instead of hashing every part again.
+ * With a cache file the state is also saved by bpak_pkg_close and loaded by
+ * this function, call it before the package is modified. This makes a
+ * sequence of 'bpak add' calls linear in the package size. The file is
+ * ignored when the package was changed after it was saved, the payload hash
+ * is then computed from the start.
+ *
+ * This needs the built-in SHA backend, the state of other hash backends can
+ * not be saved.
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] filename Cache file name, or NULL to disable the cache file
+ *
+ * @return BPAK_OK on success or -BPAK_NOT_SUPPORTED
+ */
+int bpak_pkg_set_hash_cache(struct bpak_package *pkg, const char *filename);
+
+/**
+ * Add a 'part-digest' meta data to every part that is covered by the
+ * payload hash and compute the digests. The digests are signed through the
+ * header hash, which lets a verifier check single parts, see
+ * bpak_verify_part_digest. The header is not written to the file.
+ *
+ * @param[in] pkg Package pointer
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_add_part_digests(struct bpak_package *pkg);
+
 /**
  * Computes the package header hash. This function also updates the payload
- * hash in the header
+ * hash and any part digests in the header
  *
  * @param[in] pkg Package pointer
  * @param[out] out Optional header output hash
@@ -64,6 +216,36 @@ int bpak_pkg_close(struct bpak_package *pkg);
  */
 int bpak_pkg_update_hash(struct bpak_package *pkg, char *output, size_t *size);
 
+/**
+ * Start an edit session. The functions that add or delete parts, and
+ * bpak_pkg_add_part_digests, then only update and write the header and
+ * record which parts they changed, the payload is not read until
+ * bpak_pkg_commit. Several edits cost one pass over the payload instead of
+ * one pass each.
+ *
+ * The header in the file has stale hashes until the session is committed,
+ * bpak_pkg_close does not commit it.
+ *
+ * @param[in] pkg Package pointer
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_defer_hash(struct bpak_package *pkg);
+
+/**
+ * Update the part digests and the payload hash, write the header and end
+ * the edit session of bpak_pkg_defer_hash
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] reuse_digests Only compute the digests of the parts that were
+ *                          added in the session, the other digests are
+ *                          trusted as they are in the header. Otherwise,
+ *                          or without a session, every digest is computed.
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_commit(struct bpak_package *pkg, bool reuse_digests);
+
 /**
  * Computes the package size after transport decoding
  *
@@ -91,6 +273,95 @@ size_t bpak_pkg_size(struct bpak_package *pkg);
  */
 struct bpak_header *bpak_pkg_header(struct bpak_package *pkg);
 
+/**
+ * Number of continuation tables after the header. A package gets its
+ * first table when bpak_pkg_add_part or bpak_pkg_add_meta runs out of
+ * space in the header.
+ *
+ * @param[in] pkg Package pointer
+ *
+ * @return Number of tables in pkg->tables
+ */
+unsigned int bpak_pkg_table_count(struct bpak_package *pkg);
+
+/**
+ * Look up a part in the header and the continuation tables
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] id ID of part
+ * @param[out] part Pointer to the part header
+ *
+ * @return BPAK_OK on success, -BPAK_NOT_FOUND if the part is missing
+ */
+int bpak_pkg_get_part(struct bpak_package *pkg, bpak_id_t id,
+                      struct bpak_part_header **part);
+
+/**
+ * Look up meta data in the header and the continuation tables
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] id Meta data identifier
+ * @param[in] part_id_ref Part reference identifier, or 0 for no reference
+ * @param[out] meta Pointer to the metadata header
+ * @param[out] table Header or table that holds the meta data, for
+ *                   bpak_get_meta_ptr. May be NULL.
+ *
+ * @return BPAK_OK on success -BPAK_NOT_FOUND if the metadata is missing
+ */
+int bpak_pkg_get_meta(struct bpak_package *pkg, bpak_id_t id,
+                      bpak_id_t part_id_ref, struct bpak_meta_header **meta,
+                      struct bpak_header **table);
+
+/**
+ * Get the data offset of a part in the header or the continuation tables,
+ * see bpak_part_offset
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] part Part header
+ *
+ * @return Offset in bytes
+ */
+off_t bpak_pkg_part_offset(struct bpak_package *pkg,
+                           struct bpak_part_header *part);
+
+/**
+ * Add a part to the header, or to a continuation table when the header is
+ * full. Adding a table moves the payload by one table size and changes
+ * the magic of the header to BPAK_HEADER_MAGIC_EXT, which older readers
+ * reject.
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] id ID of new part
+ * @param[out] part Output pointer to new part
+ *
+ * @return BPAK_OK on success,
+ *         -BPAK_NO_SPACE if BPAK_MAX_TABLES are full
+ *         -BPAK_EXISTS if a part with the same 'id' already exists
+ */
+int bpak_pkg_add_part(struct bpak_package *pkg, bpak_id_t id,
+                      struct bpak_part_header **part);
+
+/**
+ * Add meta data to the header, or to a continuation table when the header
+ * is full. See bpak_pkg_add_part.
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] id ID of new metadata
+ * @param[in] part_ref_id Optional part reference to use for new metadata
+ * @param[in] size Size in bytes of new metadata
+ * @param[out] meta Pointer to the metadata header
+ * @param[out] table Header or table that holds the meta data, for
+ *                   bpak_get_meta_ptr. May be NULL.
+ *
+ * @return BPAK_OK on success,
+ *         -BPAK_NO_SPACE if BPAK_MAX_TABLES are full
+ *         -BPAK_EXISTS if the meta data already exists
+ */
+int bpak_pkg_add_meta(struct bpak_package *pkg, bpak_id_t id,
+                      bpak_id_t part_ref_id, uint16_t size,
+                      struct bpak_meta_header **meta,
+                      struct bpak_header **table);
+
 /**
  * Populate the signature data array
  *
@@ -113,6 +384,44 @@ int bpak_pkg_write_raw_signature(struct bpak_package *pkg,
  */
 int bpak_pkg_sign(struct bpak_package *pkg, const char *key_filename);
 
+/**
+ * Sign the package like bpak_pkg_sign, with a key that is already loaded
+ * and prepared with bpak_crypto_prepare_sign_key
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] key Prepared private key
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_sign_prepared(struct bpak_package *pkg,
+                           struct bpak_prepared_key *key);
+
+/**
+ * One package of bpak_pkg_sign_batch
+ */
+struct bpak_sign_batch_item {
+    struct bpak_package *pkg; /*!< Package to sign, opened for writing */
+    int rc;                   /*!< Result, as from bpak_pkg_sign */
+};
+
+/**
+ * Sign several packages with the same private key on up to 'jobs'
+ * threads. Every thread prepares the key once and then computes the
+ * header hash of, and signs, one package at a time.
+ *
+ * The packages must be distinct, a package is only used by one thread.
+ *
+ * @param[in,out] items Packages, 'rc' is set for every item
+ * @param[in] count Number of items
+ * @param[in] key Private key, see bpak_crypto_load_private_key
+ * @param[in] jobs Number of threads, 0 uses one per online CPU
+ *
+ * @return BPAK_OK when every package was signed, otherwise the result of
+ *         the first item that failed
+ */
+int bpak_pkg_sign_batch(struct bpak_sign_batch_item *items, size_t count,
+                        struct bpak_key *key, unsigned int jobs);
+
 /**
  * Verify the package
  *
@@ -123,6 +432,66 @@ int bpak_pkg_sign(struct bpak_package *pkg, const char *key_filename);
  */
 int bpak_pkg_verify(struct bpak_package *pkg, struct bpak_key *key);
 
+/**
+ * Verify a package like bpak_pkg_verify, with the payload hash and the
+ * merkle trees of the parts checked on up to 'jobs' threads, see
+ * bpak_verify_payload_parallel.
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] key Public key used for verification
+ * @param[in] jobs Number of threads, 0 uses one per online CPU
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_verify_jobs(struct bpak_package *pkg, struct bpak_key *key,
+                         unsigned int jobs);
+
+/**
+ * Verify the header signature of 'pkg' with 'key' and then the installed
+ * parts in 'locations' with bpak_verify_installed. Only the header of the
+ * package is used, it may be a package without payload.
+ *
+ * @param[in] pkg Package pointer
+ * @param[in] key Public key used for verification
+ * @param[in] locations Installed parts
+ * @param[in] count Number of locations
+ * @param[in] jobs Number of threads, 0 runs every check at once
+ *
+ * @return BPAK_OK on success, -BPAK_NOT_SUPPORTED for a package with
+ *         continuation tables
+ */
+int bpak_pkg_verify_installed(struct bpak_package *pkg, struct bpak_key *key,
+                              const struct bpak_verify_location *locations,
+                              size_t count, unsigned int jobs);
+
+/**
+ * One package of bpak_pkg_verify_batch
+ */
+struct bpak_verify_batch_item {
+    struct bpak_package *pkg; /*!< Package to verify */
+    struct bpak_key *key;     /*!< Public key of the package */
+    int rc;                   /*!< Result, as from bpak_pkg_verify */
+};
+
+/**
+ * Verify several packages on up to 'jobs' threads, one package per thread
+ * at a time. Each thread parses a key once and keeps it for the following
+ * packages that use the same key, so a batch signed with a few keys pays
+ * for the key decoding a few times instead of once per package. Items that
+ * share a key should point to the same struct bpak_key.
+ *
+ * The packages must be distinct, a package is only read by one thread.
+ *
+ * @param[in,out] items Packages and keys, 'rc' is set for every item
+ * @param[in] count Number of items
+ * @param[in] jobs Number of threads, 0 uses one per online CPU
+ *
+ * @return BPAK_OK when every package verified, otherwise the result of the
+ *         first item that failed
+ */
+int bpak_pkg_verify_batch(struct bpak_verify_batch_item *items,
+                          size_t count, unsigned int jobs);
+
 /**
  * Compute sha256 hash of part data
  *
@@ -151,6 +520,39 @@ int bpak_pkg_transport_encode(struct bpak_package *input,
                               struct bpak_package *output,
                               struct bpak_package *origin);
 
+/**
+ * Transport encode package with encoder options
+ *
+ * @param[in] input BPAK Package input stream
+ * @param[in] output BPAK Package output, the result
+ * @param[in] origin BPAK Package origin data
+ * @param[in] options Encoder options, or NULL to use the defaults
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_transport_encode_opts(
+    struct bpak_package *input, struct bpak_package *output,
+    struct bpak_package *origin,
+    const struct bpak_transport_encode_options *options);
+
+/**
+ * Transport encode package to a stream
+ *
+ * Same as bpak_pkg_transport_encode_opts with 'options->stream' set. The
+ * encoded package is written front to back to 'output_fp', which may be a
+ * pipe or a socket.
+ *
+ * @param[in] input BPAK Package input stream
+ * @param[in] output_fp Output stream
+ * @param[in] origin BPAK Package origin data
+ * @param[in] options Encoder options, or NULL to use the defaults
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_transport_encode_stream(
+    struct bpak_package *input, FILE *output_fp, struct bpak_package *origin,
+    const struct bpak_transport_encode_options *options);
+
 /**
  * Transport decode package
  *
@@ -165,7 +567,133 @@ int bpak_pkg_transport_decode(struct bpak_package *input,
                               struct bpak_package *origin);
 
 /**
- * Writes current header to file
+ * Transport decode package with decoder options
+ *
+ * @param[in] input BPAK Package input stream
+ * @param[in] output BPAK Package output, the result
+ * @param[in] origin BPAK Package origin data
+ * @param[in] options Decoder options, or NULL to use the defaults
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_transport_decode_opts(
+    struct bpak_package *input, struct bpak_package *output,
+    struct bpak_package *origin,
+    const struct bpak_transport_decode_options *options);
+
+/**
+ * One package of bpak_pkg_transport_decode_multi
+ */
+struct bpak_pkg_install {
+    struct bpak_package *input;  /*!< Transport encoded package */
+    struct bpak_package *output; /*!< Decoded package, the result */
+    struct bpak_package *origin; /*!< Origin data of 'input' or NULL */
+    int rc; /*!< BPAK_OK when the package is decoded and its header is
+                 written, -BPAK_FAILED when the install stopped before it */
+};
+
+/**
+ * Transport decode several packages through one decode pipeline
+ *
+ * The parts of all packages are queued for the same 'options->jobs'
+ * workers, which keep their decode buffers from one part to the next, so
+ * that parts of one package are decoded while the origin of another is
+ * read. The output header of a package is written once, when its last
+ * part is done. The install stops at the first error, packages that were
+ * done before it keep their decoded output.
+ *
+ * The output buffer and in place decoding are not supported.
+ *
+ * @param[in,out] packages Packages to install, in priority order
+ * @param[in] count Number of packages
+ * @param[in] options Decoder options for every package, or NULL to use
+ *                    the defaults
+ *
+ * @return BPAK_OK when every package was decoded, otherwise the first error
+ */
+int bpak_pkg_transport_decode_multi(
+    struct bpak_pkg_install *packages, size_t count,
+    const struct bpak_transport_decode_options *options);
+
+/**
+ * Estimate the resources that transport decoding a package takes, see
+ * bpak_transport_decode_estimate. The LZMA dictionary sizes are read from
+ * the patch streams.
+ *
+ * @param[in] pkg Transport encoded package
+ * @param[out] estimate Estimated resources
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_transport_estimate(struct bpak_package *pkg,
+                                struct bpak_transport_estimate *estimate);
+
+/**
+ * Streaming transport decoder, see bpak_pkg_transport_decode_stream_init
+ */
+struct bpak_pkg_decode_stream {
+    struct bpak_header header; /*!< Patch header, received first */
+    size_t header_length;      /*!< Header bytes received so far */
+    struct bpak_part_header *part; /*!< Part being decoded, NULL when done */
+    uint64_t part_remaining;   /*!< Input bytes left of 'part' */
+    int rc;                    /*!< First error, the stream stops at it */
+    void *priv;
+};
+
+/**
+ * Initialize a transport decoder that is fed with the patch package as it
+ * is received, for example from a network connection
+ *
+ * The patch is pushed with bpak_pkg_transport_decode_stream_write in any
+ * chunk sizes. Only the header is buffered, the part data is passed to the
+ * part decoders as it arrives. Parts are decoded one at a time, so
+ * 'options->jobs' must be 0 or 1.
+ *
+ * @param[out] stream Stream decoder
+ * @param[in] output BPAK Package output, the result
+ * @param[in] origin BPAK Package origin data
+ * @param[in] options Decoder options, or NULL to use the defaults
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_transport_decode_stream_init(
+    struct bpak_pkg_decode_stream *stream, struct bpak_package *output,
+    struct bpak_package *origin,
+    const struct bpak_transport_decode_options *options);
+
+/**
+ * Push the next bytes of the patch package to the stream decoder
+ *
+ * @param[in] stream Stream decoder
+ * @param[in] buffer Patch data
+ * @param[in] length Length of 'buffer'
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_pkg_transport_decode_stream_write(
+    struct bpak_pkg_decode_stream *stream, uint8_t *buffer, size_t length);
+
+/**
+ * Complete the stream decoder after the last byte of the patch
+ *
+ * @param[in] stream Stream decoder
+ *
+ * @return BPAK_OK when every part was decoded, -BPAK_SIZE_ERROR when the
+ *         patch was incomplete
+ */
+int bpak_pkg_transport_decode_stream_finish(
+    struct bpak_pkg_decode_stream *stream);
+
+/**
+ * Free the stream decoder
+ *
+ * @param[in] stream Stream decoder
+ */
+void bpak_pkg_transport_decode_stream_free(
+    struct bpak_pkg_decode_stream *stream);
+
+/**
+ * Writes current header and continuation tables to file
  *
  * @param[in] hdr BPAK Header
  *
@@ -192,6 +720,10 @@ int bpak_pkg_add_file(struct bpak_package *pkg, const char *filename,
  *
  * The hash tree part name will be bpak_id('part_name'-hash-tree')
  *
+ * A random salt is added as 'merkle-salt' meta data, unless the package
+ * already has a 32 byte salt for the part. Keeping the salt of the previous
+ * version lets a transport decode reuse the origin leaf hashes.
+ *
  * @param[in] pkg Pointer to a bpak package
  * @param[in] filename Full path to the file that should be added to the archive
  * @param[in] part_name Name of part to be created
@@ -251,6 +783,99 @@ int bpak_pkg_delete_part(struct bpak_package *pkg, bpak_id_t part_id,
  */
 int bpak_pkg_delete_all_parts(struct bpak_package *pkg, bool remove_meta);
 
+/**
+ * Start building a new package in one pass
+ *
+ * 'bpak create' followed by a number of 'bpak add' rewrites the header and
+ * hashes the payload again for every step. The builder instead keeps the
+ * header in memory, streams each part once into the output while the
+ * payload hash, and merkle tree when requested, are computed on the same
+ * data. The header is written once by bpak_pkg_builder_finish.
+ *
+ * The parts and the merkle trees end up exactly as with bpak_pkg_add_file
+ * and bpak_pkg_add_file_with_merkle_tree.
+ *
+ * @param[in] builder Builder context
+ * @param[in] filename Output file, it is truncated
+ * @param[in] hash_kind Payload and header hash kind
+ * @param[in] signature_kind Signature kind
+ * @param[in] part_digests Add a 'part-digest' meta for every hashed part
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_pkg_builder_init(struct bpak_pkg_builder *builder,
+                          const char *filename, enum bpak_hash_kind hash_kind,
+                          enum bpak_signature_kind signature_kind,
+                          bool part_digests);
+
+/**
+ * Add meta data
+ *
+ * @param[in] builder Builder context
+ * @param[in] id Meta data id
+ * @param[in] part_ref_id Part reference or zero
+ * @param[in] data Meta data
+ * @param[in] size Size of the meta data in bytes
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_pkg_builder_add_meta(struct bpak_pkg_builder *builder, bpak_id_t id,
+                              bpak_id_t part_ref_id, const void *data,
+                              size_t size);
+
+/**
+ * Stream a file into a new part
+ *
+ * @param[in] builder Builder context
+ * @param[in] filename File to add
+ * @param[in] part_name Name of the part
+ * @param[in] flags Part flags
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_pkg_builder_add_file(struct bpak_pkg_builder *builder,
+                              const char *filename, const char *part_name,
+                              uint8_t flags);
+
+/**
+ * Stream a file into a new part and add a part with its merkle hash tree.
+ * The tree is computed while the file is copied.
+ *
+ * See bpak_pkg_add_file_with_merkle_tree for the names of the parts and the
+ * meta data.
+ *
+ * @param[in] builder Builder context
+ * @param[in] filename File to add
+ * @param[in] part_name Name of the part
+ * @param[in] flags Flags of both parts
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_pkg_builder_add_file_with_merkle_tree(struct bpak_pkg_builder *builder,
+                                               const char *filename,
+                                               const char *part_name,
+                                               uint8_t flags);
+
+/**
+ * Complete the payload hash, optionally sign the package and write the
+ * header
+ *
+ * @param[in] builder Builder context
+ * @param[in] key_filename Private key to sign with, or NULL for no signature
+ *
+ * @return BPAK_OK on success or a negative number
+ */
+int bpak_pkg_builder_finish(struct bpak_pkg_builder *builder,
+                            const char *key_filename);
+
+/**
+ * Close the output and release the builder. A package that was not
+ * finished is left without a valid header.
+ *
+ * @param[in] builder Builder context
+ */
+void bpak_pkg_builder_free(struct bpak_pkg_builder *builder);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
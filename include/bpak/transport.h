@@ -19,12 +19,58 @@
 #include <unistd.h>
 #include <bpak/bpak.h>
 #include <bpak/merkle.h>
+#include <bpak/bsdiff.h>
 #include <bpak/bspatch.h>
+#include <bpak/blockpatch.h>
+#include <bpak/chunkpatch.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** Progress events, see bpak_transport_progress_t */
+enum bpak_transport_event {
+    BPAK_TRANSPORT_PART_START,  /*!< A part is started */
+    BPAK_TRANSPORT_PART_UPDATE, /*!< More of the part has been processed */
+    BPAK_TRANSPORT_PART_DONE,   /*!< The part is complete */
+};
+
+/** Stages that the time spent on a part is split into */
+enum bpak_transport_stage {
+    BPAK_TRANSPORT_STAGE_CODEC,  /*!< Encoding or decoding, excluding io */
+    BPAK_TRANSPORT_STAGE_INPUT,  /*!< Waiting for or mapping input */
+    BPAK_TRANSPORT_STAGE_OUTPUT, /*!< Writing output */
+    BPAK_TRANSPORT_STAGE_ORIGIN, /*!< Reading or mapping origin data */
+    BPAK_TRANSPORT_STAGES,
+};
+
+/**
+ * Statistics of the part that is being encoded or decoded. All counters
+ * start from zero when a part is started.
+ */
+struct bpak_transport_progress {
+    enum bpak_transport_event event;
+    bpak_id_t part_id;     /*!< Part that is being processed */
+    uint64_t bytes_in;     /*!< Input bytes of the part consumed */
+    uint64_t bytes_out;    /*!< Output bytes of the part written */
+    uint64_t origin_bytes; /*!< Origin bytes read for the part */
+    /*! Output bytes that were already in place and not written, see
+     *  bpak_transport_decode_set_skip_unchanged */
+    uint64_t bytes_unchanged;
+    uint64_t elapsed_ns;   /*!< Time since the part was started */
+    /*! Time of 'elapsed_ns' spent in each enum bpak_transport_stage */
+    uint64_t stage_ns[BPAK_TRANSPORT_STAGES];
+};
+
+/**
+ * Progress callback of the transport encoder and decoder
+ *
+ * @param[in] progress Statistics of the current part
+ * @param[in] user User context given with the callback
+ */
+typedef void (*bpak_transport_progress_t)(
+    const struct bpak_transport_progress *progress, void *user);
+
 struct bpak_transport_decode {
     uint8_t *buffer;
     size_t buffer_length;
@@ -34,20 +80,290 @@ struct bpak_transport_decode {
     bpak_io_t write_output;
     bpak_io_t read_output;
     bpak_io_t read_origin;
+    bpak_prefetch_t prefetch_origin;
     bpak_io_t write_output_header;
     uint32_t decoder_id;
     off_t copy_offset;
+    size_t input_position; /*!< Input bytes of the current part consumed */
     off_t output_offset;
     off_t origin_offset;
+    /*! Origin stream offsets and lengths of the origin parts that make up
+     *  the virtual origin of the current part, see
+     *  bpak_set_transport_origin_parts */
+    off_t origin_part_offsets[BPAK_TRANSPORT_MAX_ORIGIN_PARTS];
+    size_t origin_part_lengths[BPAK_TRANSPORT_MAX_ORIGIN_PARTS];
+    size_t origin_part_count; /*!< 0 for a single origin part */
     union {
 #if BPAK_CONFIG_MERKLE == 1
         struct bpak_merkle_context merkle;
 #endif
         struct bpak_bspatch_context bspatch;
+        struct bpak_blockpatch_context blockpatch;
+        struct bpak_chunkpatch_context chunkpatch;
     } decoders;
+#if BPAK_CONFIG_MERKLE == 1
+    struct bpak_merkle_context merkle_tee; /*!< Hashes output as written */
+    bpak_id_t merkle_tee_id;      /*!< Hash tree fed by the tee, 0 = none */
+    off_t merkle_tee_offset;      /*!< Next expected output offset */
+    bpak_id_t merkle_generated_id; /*!< Hash tree that is already built */
+    size_t merkle_generated_length;
+    off_t merkle_tee_start;       /*!< Output offset of the hashed part */
+    /*! Origin offset of the origin leaf hashes, -1 when they can't be used
+     *  for the hash tree fed by the tee */
+    off_t merkle_reuse_tree;
+    off_t merkle_reuse_part; /*!< Origin offset of the origin data */
+    size_t merkle_reuse_leaves; /*!< Number of leaves in the origin tree */
+    size_t merkle_reused;       /*!< Leaves taken from the origin tree */
+    off_t merkle_run_output;   /*!< Last unchanged run reported by bspatch */
+    off_t merkle_run_origin;
+    size_t merkle_run_length;
+    size_t merkle_skipped;     /*!< Unchanged bytes of the leaf, not hashed */
+    off_t merkle_skipped_origin; /*!< Origin position of the skipped bytes */
+    size_t merkle_cache_first; /*!< First leaf in 'merkle_cache' */
+    size_t merkle_cache_count;
+    uint8_t merkle_cache[BPAK_MERKLE_BLOCK_SZ]; /*!< Origin leaf hashes */
+    /*! Checks the origin reads of the current part, NULL = they are not
+     *  checked. See bpak_transport_decode_set_verify_origin */
+    struct bpak_merkle_verify_context *origin_verify;
+    off_t origin_verify_offset;     /*!< Origin offset of the checked data */
+    uint64_t origin_verify_length;  /*!< Length of the checked data */
+    uint8_t *origin_verify_block;   /*!< The last verified origin block */
+    size_t origin_verify_index;     /*!< Index of 'origin_verify_block' */
+    bool origin_verify_cached;      /*!< 'origin_verify_block' is valid */
+#endif
+    bool verify_origin; /*!< See bpak_transport_decode_set_verify_origin */
+    bpak_transport_progress_t progress; /*!< Progress callback or NULL */
+    void *progress_user;
+    /*! Allocator of the bspatch and merkle decoders or NULL */
+    const struct bpak_allocator *allocator;
+    unsigned int threads; /*!< LZMA decoder threads of a part */
+    /*! Parts that are identical to the origin are not copied, see
+     *  bpak_transport_decode_set_keep_reused */
+    bool keep_reused;
+    /*! Output write buffer, see bpak_transport_decode_set_write_buffer */
+    uint8_t *write_buffer;
+    size_t write_buffer_length;
+    /*! The buffer holds the output range [write_base + write_start,
+     *  write_base + write_end), 'write_base' is aligned to the length */
+    off_t write_base;
+    size_t write_start;
+    size_t write_end;
+    /*! Scratch ring of in place decoding, see
+     *  bpak_transport_decode_set_in_place */
+    uint8_t *in_place_buffer;
+    size_t in_place_length;
+    bool in_place_active; /*!< The current part is written through it */
+    off_t in_place_base;  /*!< Output offset of the current part */
+    uint64_t in_place_written; /*!< Part bytes passed on from the ring */
+    uint64_t in_place_end;     /*!< Part bytes received by the ring */
+    /*! Output compare buffer, see bpak_transport_decode_set_skip_unchanged */
+    uint8_t *compare_buffer;
+    size_t compare_buffer_length;
+    struct bpak_transport_progress stats; /*!< Counters of the part */
+    uint64_t progress_start_ns; /*!< Clock when the part was started */
+    uint64_t progress_busy_ns;  /*!< Time spent in the decoder calls */
     void *user;
 };
 
+#define BPAK_TRANSPORT_CHECKPOINT_MAGIC 0x50434b42 /* 'BKCP' */
+
+/**
+ * Saved decoder state of one part, see bpak_transport_decode_checkpoint
+ */
+struct bpak_transport_checkpoint {
+    uint32_t magic;
+    uint32_t crc; /*!< crc32 of the checkpoint with this field set to zero */
+    bpak_id_t part_id;
+    uint32_t decoder_id;
+    uint64_t input_position; /*!< Part input bytes consumed at the save */
+    uint64_t copy_offset;
+    struct bpak_bspatch_checkpoint bspatch;
+};
+
+/** Origin indexes kept between encodes, see
+ *  bpak_transport_encode_session_create */
+struct bpak_transport_encode_session;
+
+/* Decoder speeds of a low end target in bytes per second, used by the
+ * 'auto' encoder when struct bpak_transport_auto has no numbers */
+#define BPAK_TRANSPORT_AUTO_RATE_NONE (64 * 1024 * 1024)
+#define BPAK_TRANSPORT_AUTO_RATE_HS   (8 * 1024 * 1024)
+#define BPAK_TRANSPORT_AUTO_RATE_LZMA (2 * 1024 * 1024)
+#define BPAK_TRANSPORT_AUTO_RATE_ZSTD (32 * 1024 * 1024)
+#define BPAK_TRANSPORT_AUTO_RATE_OUTPUT (32 * 1024 * 1024)
+
+/**
+ * Target device of the parts that use the 'auto' encoder
+ *
+ * Such a part is encoded with every bsdiff compression, or with every
+ * compressor when there is no origin, at the default parameters and at
+ * the same time. The decode time of each result is estimated from the
+ * rates below and the smallest one that fits in the limits is kept, the
+ * part meta data of the output gets its encoder and decoder. The rates
+ * can be measured on the target with the progress statistics of
+ * 'bpak transport --decode --progress'.
+ */
+struct bpak_transport_auto {
+    /*! Patch input that the target decompresses per second, by enum
+     *  bpak_compression, 0 = BPAK_TRANSPORT_AUTO_RATE_* */
+    uint64_t input_rate[BPAK_COMPRESSION_ZSTD + 1];
+    /*! Output that the target patches and writes per second, 0 =
+     *  BPAK_TRANSPORT_AUTO_RATE_OUTPUT */
+    uint64_t output_rate;
+    uint64_t decode_time_us; /*!< Decode time limit of a part, 0 = none */
+    /*! Decoder heap limit, see bpak_bspatch_heap_size, 0 = none */
+    size_t heap_size;
+};
+
+/**
+ * Optional settings for the transport encoder
+ */
+struct bpak_transport_encode_options {
+    unsigned int jobs; /*!< Number of threads used by bsdiff, 0 = one thread */
+    const char *cache_dir; /*!< Directory for suffix array caches or NULL */
+    /*! Mapping of the whole input file, NULL = map it for every diff */
+    const uint8_t *input_map;
+    size_t input_map_size; /*!< Size of 'input_map' in bytes */
+    /*! Mapping of the whole origin file, NULL = map it for every diff */
+    const uint8_t *origin_map;
+    size_t origin_map_size; /*!< Size of 'origin_map' in bytes */
+    /*! Parts encoded concurrently, 0 or 1 = one at a time. Each part is
+     *  encoded into a temporary file and copied into place once the sizes
+     *  of the parts before it are known. */
+    unsigned int part_jobs;
+    /*! Limit for the suffix arrays of the parts that are diffed at the same
+     *  time in bytes, 0 = no limit. A part that needs more than the limit
+     *  is diffed on its own, in origin windows that fit in the limit, see
+     *  bpak_bsdiff_window_size. */
+    size_t memory_budget;
+    /*! Write the output front to back, header first, without seeking, so
+     *  that the output may be a pipe or a socket. The encoded parts are
+     *  kept in temporary files until their sizes are known. */
+    bool stream;
+    /*! Called when a part is started, for every output write of a diff and
+     *  when a part is done, NULL = no progress. With 'part_jobs' > 1 it is
+     *  called from the encoder threads, for several parts at once. */
+    bpak_transport_progress_t progress;
+    void *progress_user; /*!< User context of 'progress' */
+    /*! Keep the bsdiff origin indexes in this session for the next encodes,
+     *  NULL = build them for every encode. Origins that are diffed in
+     *  windows are not kept. */
+    struct bpak_transport_encode_session *session;
+    /*! Directory for encoded parts or NULL. A part is encoded once for the
+     *  same encoder, parameters, target and origin data, later encodes copy
+     *  it from the cache. */
+    const char *patch_cache_dir;
+    /*! Target of the parts with the 'auto' encoder, zero = default rates
+     *  and no limits */
+    struct bpak_transport_auto auto_select;
+    /*! Patch bytes that one origin seek is worth on the target, for
+     *  origins on slow seeking media, see struct bpak_bsdiff_options.
+     *  0 = pick matches by length only. */
+    size_t seek_cost;
+    /*! Memory of the bsdiff suffix arrays, see enum bpak_bsdiff_pages */
+    enum bpak_bsdiff_pages pages;
+    /*! Fault in the origin and target data of a diff before it starts,
+     *  instead of one page at a time during the suffix sort and the
+     *  scan */
+    bool populate;
+};
+
+/** Alignment of O_DIRECT writes and of the decoder output buffer */
+#define BPAK_DECODE_OUTPUT_ALIGN 4096
+
+/**
+ * Optional settings for bpak_pkg_transport_decode_opts
+ */
+struct bpak_transport_decode_options {
+    size_t buffer_length;    /*!< Size of the input and decoder buffers,
+                                  0 = BPAK_CHUNK_BUFFER_LENGTH */
+    bpak_calloc_t calloc_func; /*!< Buffer allocator, NULL = bpak_calloc */
+    bpak_free_t free_func;     /*!< Buffer free, NULL = bpak_free */
+    bool positional_io; /*!< Use pread/pwrite instead of FILE seeks */
+    unsigned int jobs;  /*!< Parts decoded concurrently, 0 or 1 = one at a
+                             time. More than one implies positional_io */
+    /*! Collect output writes in an aligned buffer of this size before they
+     *  are written, a multiple of BPAK_DECODE_OUTPUT_ALIGN. 0 = write each
+     *  decoder output directly, or 1 MiB with direct_io or drop_cache.
+     *  Implies positional_io and needs jobs <= 1. */
+    size_t output_buffer_length;
+    /*! Write the aligned parts of the output buffer with O_DIRECT. Falls
+     *  back to normal writes if the output does not support it. */
+    bool direct_io;
+    /*! Drop written output from the page cache */
+    bool drop_cache;
+    /*! Progress callback, see bpak_transport_decode_set_progress. With
+     *  'jobs' > 1 it is called from the decoder threads, for several parts
+     *  at once. NULL = no progress. */
+    bpak_transport_progress_t progress;
+    void *progress_user; /*!< User context of 'progress' */
+    /*! Decoder state allocator, see bpak_transport_decode_set_allocator.
+     *  It must be thread safe when 'jobs' > 1, struct bpak_arena is not.
+     *  NULL = bpak_calloc. */
+    const struct bpak_allocator *allocator;
+    /*! LZMA decoder threads of each part, see
+     *  bpak_transport_decode_set_threads. 0 or 1 = one thread */
+    unsigned int threads;
+    /*! Write the output of each decoder in aligned blocks of this many
+     *  bytes, see bpak_transport_decode_set_write_buffer. 0 = write each
+     *  decoder output as it is. */
+    size_t write_block_length;
+    /*! Decode a patch into the partition that holds its origin, with a
+     *  scratch buffer of this many bytes, see
+     *  bpak_transport_decode_set_in_place. The output is the origin, the
+     *  parts must be laid out no later than their origin parts and it
+     *  needs jobs <= 1. 0 = the output and the origin are separate. */
+    size_t in_place_scratch;
+    /*! Read the output before it is written and skip the blocks that hold
+     *  the data already, see bpak_transport_decode_set_skip_unchanged. The
+     *  blocks are 'write_block_length' or BPAK_DECODE_OUTPUT_ALIGN bytes. */
+    bool skip_unchanged;
+    /*! Check the origin data as it is read against the hash trees of the
+     *  origin, see bpak_transport_decode_set_verify_origin. Needs
+     *  in_place_scratch = 0. */
+    bool verify_origin;
+};
+
+/**
+ * Resources that decoding a patch takes, see bpak_transport_decode_estimate
+ */
+struct bpak_transport_estimate {
+    /*! Peak heap of the decompressors and hash tree work buffers, see
+     *  bpak_transport_decode_set_allocator. The work buffer passed to
+     *  bpak_transport_decode_init is not included. */
+    size_t heap_size;
+    uint32_t lzma_dict_size; /*!< Largest LZMA dictionary, 0 = none */
+    uint8_t hs_window_bits;  /*!< Largest heatshrink window, 0 = none */
+    uint64_t input_bytes;    /*!< Patch data that is read */
+    /*! Upper bound of the origin data that is read, the output size of the
+     *  parts that are patched */
+    uint64_t origin_bytes;
+    uint64_t output_bytes; /*!< Output that is written, including the
+                                header and the hash trees */
+    uint64_t merkle_bytes; /*!< Data that is hashed to build hash trees */
+};
+
+/**
+ * Estimate the resources needed to decode a patch before it is applied
+ *
+ * Everything is taken from the patch header and the transport meta data
+ * of its parts. The LZMA dictionary size is known from the meta data when
+ * the encoder stored its settings. With 'read_input' the block header of
+ * each LZMA stream is read instead, which gives the dictionary that the
+ * stream was really encoded with.
+ *
+ * @param[in] patch_header Patch BPAK header
+ * @param[in] read_input Optional callback that reads the patch data, at
+ *                       offsets like the decoder input, or NULL
+ * @param[in] user User pointer of 'read_input'
+ * @param[out] estimate Estimated resources
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_estimate(struct bpak_header *patch_header,
+                                   bpak_io_t read_input, void *user,
+                                   struct bpak_transport_estimate *estimate);
+
 /**
  * Initalizes the transport decode context for a BPAK package
  *
@@ -90,6 +406,166 @@ int bpak_transport_decode_set_origin(struct bpak_transport_decode *ctx,
                                      struct bpak_header *origin_header,
                                      bpak_io_t read_origin,
                                      off_t origin_offset);
+/**
+ * Provide an optional origin prefetch hook. Patch decoders call it with
+ * origin ranges, in 'read_origin' offsets, before they are read so that
+ * origin i/o can overlap decompression and output writes.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] prefetch_origin Prefetch hook or NULL
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_set_origin_prefetch(struct bpak_transport_decode *ctx,
+                                              bpak_prefetch_t prefetch_origin);
+/**
+ * Provide an optional progress callback. It is called when a part is
+ * started, after every write chunk call and when a part is done.
+ *
+ * Time outside of the decoder calls is counted as
+ * BPAK_TRANSPORT_STAGE_INPUT, and 'bytes_out' of the done event is the
+ * decoded size of the part.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] progress Progress callback or NULL
+ * @param[in] user User context of the callback
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_set_progress(struct bpak_transport_decode *ctx,
+                                       bpak_transport_progress_t progress,
+                                       void *user);
+
+/**
+ * Allocate the state of the bspatch decompressors and the merkle work
+ * buffers from 'allocator', see bpak_bspatch_set_allocator. The
+ * allocator must outlive the context. Output hashing runs along with the
+ * patch, so one arena of the bpak_bspatch_heap_size of the patch plus the
+ * bpak_merkle_heap_size is enough. The state of a part is freed before the
+ * next part is started.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] allocator Allocator or NULL for bpak_calloc
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_set_allocator(struct bpak_transport_decode *ctx,
+                                        const struct bpak_allocator *allocator);
+
+/**
+ * Decompress the blocks of LZMA compressed parts on 'threads' threads, see
+ * bpak_bspatch_set_threads. Only parts that were encoded with an LZMA
+ * block size are decoded in parallel. The allocator must be thread safe
+ * when 'threads' > 1.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] threads Number of decoder threads, 0 or 1 = one thread
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_set_threads(struct bpak_transport_decode *ctx,
+                                      unsigned int threads);
+
+/**
+ * Parts that the encoder found to be identical to their origin part carry
+ * BPAK_FLAG_REUSE_ORIGIN and no data. They are normally copied from the
+ * origin. With 'keep' set nothing is written for them, for A/B layouts
+ * where the origin slot of the part is used as it is. The caller must then
+ * also take the hash trees of these parts from the origin.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] keep Keep reused parts in the origin instead of copying them
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_set_keep_reused(struct bpak_transport_decode *ctx,
+                                          bool keep);
+
+/**
+ * Collect the output of the decoders in 'buffer' and write it with one
+ * 'write_output' call per 'length' bytes, at offsets that are multiples of
+ * 'length'. With the erase block size of a flash target every block is
+ * written once and in one piece. Output that is not contiguous with the
+ * buffered range, reads of buffered output, checkpoints and
+ * bpak_transport_decode_finish write the buffer out first.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] buffer Write buffer, it must stay valid until
+ *                   bpak_transport_decode_free. NULL = every decoder
+ *                   output is written as it is.
+ * @param[in] length Size of 'buffer' in bytes
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_set_write_buffer(struct bpak_transport_decode *ctx,
+                                           uint8_t *buffer, size_t length);
+
+/**
+ * Decode into the storage that the origin is read from. Patched output is
+ * held back in 'buffer' and only written once it is half of 'buffer'
+ * behind the output position, so that the origin data that the patch
+ * still reads is not overwritten. The part must be encoded for it, see
+ * bpak_set_transport_in_place, with a scratch size of at most 'length'.
+ * Parts that are patched from several origin parts, blockpatch and
+ * chunkpatch parts and checkpoints are not supported while it is set.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] buffer Scratch buffer, it must stay valid until
+ *                   bpak_transport_decode_free. NULL = the origin and the
+ *                   output are separate.
+ * @param[in] length Size of 'buffer' in bytes
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_set_in_place(struct bpak_transport_decode *ctx,
+                                       uint8_t *buffer, size_t length);
+
+/**
+ * Read the output before writing it and skip the writes of data that the
+ * output already holds, for example when an interrupted install is
+ * applied again or a part is decoded in place. The output is compared in
+ * blocks of 'length' bytes at offsets that are multiples of it, only the
+ * blocks that differ are written. With a write buffer of the same length
+ * every erase block is read once and written at most once. The skipped
+ * bytes are counted in struct bpak_transport_progress.
+ *
+ * @param[in] ctx Pointer to a transport decode context with a
+ *                'read_output' callback
+ * @param[in] buffer Compare buffer, it must stay valid until
+ *                   bpak_transport_decode_free. NULL = every block is
+ *                   written.
+ * @param[in] length Size of 'buffer' in bytes
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int
+bpak_transport_decode_set_skip_unchanged(struct bpak_transport_decode *ctx,
+                                         uint8_t *buffer, size_t length);
+
+/**
+ * Check every origin read against the hash tree of the origin part, in
+ * blocks of the tree, before the decoder sees the data. This replaces a
+ * full bpak_verify_payload pass over the origin before a patch is applied,
+ * only the origin blocks that are read are hashed and a corrupt block is
+ * reported when it is reached. The root hashes come from the merkle meta
+ * data of the origin header, which is trusted once the origin header hash
+ * has been verified against its signature.
+ *
+ * Parts that read the origin fail with -BPAK_NOT_SUPPORTED when their
+ * origin part has no hash tree, is patched against several origin parts
+ * or is decoded in place. Reads past the end of the origin part are short
+ * and a block that does not match the tree fails the read with
+ * -BPAK_BAD_ROOT_HASH. Parts kept with
+ * bpak_transport_decode_set_keep_reused are not read and not checked.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] verify true to check the origin reads
+ *
+ * @return BPAK_OK on success or -BPAK_NOT_SUPPORTED when the library is
+ *         built without BPAK_MERKLE
+ */
+int bpak_transport_decode_set_verify_origin(struct bpak_transport_decode *ctx,
+                                            bool verify);
 /**
  * Starts the decoding process. Some parts are re-created, for example
  * merkle hash tress, and therefore the input size is zero. In this case the
@@ -118,6 +594,63 @@ int bpak_transport_decode_start(struct bpak_transport_decode *ctx,
 int bpak_transport_decode_write_chunk(struct bpak_transport_decode *ctx,
                                       uint8_t *buffer, size_t length);
 
+/**
+ * Get the next range of the current part input that the decoder needs,
+ * as an offset within the part. Input before 'offset' is skipped and the
+ * next write chunk call continues at 'offset'. Decoders that read all of
+ * their input return the rest of the part, chunkpatch returns the chunk
+ * index and then only the store chunks that are not in the origin, which
+ * lets a client fetch them with range requests. 'length' is zero when no
+ * more input is needed.
+ *
+ * Calling this is optional, a decoder can also be given all of its input.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[out] offset Input offset within the part
+ * @param[out] length Length of the range
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_next_input(struct bpak_transport_decode *ctx,
+                                     uint64_t *offset, uint64_t *length);
+
+/**
+ * Save the decoder state of the current part, typically to persistent
+ * storage after a write chunk call. Every output byte up to the
+ * checkpoint has been written when this is called, so decoding can resume
+ * from it after a power loss instead of starting the part over.
+ *
+ * Copy, uncompressed bspatch and heatshrink bspatch parts can be saved,
+ * other decoders return -BPAK_NOT_SUPPORTED.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[out] checkpoint Caller provided checkpoint buffer
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_checkpoint(
+    struct bpak_transport_decode *ctx,
+    struct bpak_transport_checkpoint *checkpoint);
+
+/**
+ * Starts decoding 'part' from a checkpoint, instead of
+ * 'bpak_transport_decode_start'. The caller continues with
+ * 'bpak_transport_decode_write_chunk' from input offset
+ * 'checkpoint->input_position' within the part.
+ *
+ * A hash tree that would otherwise be built while this part is written is
+ * generated from the written data instead.
+ *
+ * @param[in] ctx Pointer to a transport decode context
+ * @param[in] part Pointer to the BPAK part that should be processed
+ * @param[in] checkpoint Checkpoint saved for this part
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_decode_resume(
+    struct bpak_transport_decode *ctx, struct bpak_part_header *part,
+    const struct bpak_transport_checkpoint *checkpoint);
+
 /**
  * Should be called when no more data should be written to the
  * decoder
@@ -158,6 +691,48 @@ int bpak_transport_encode(FILE *input_fp, struct bpak_header *input_header,
                           FILE *output_fp, struct bpak_header *output_header,
                           FILE *origin_fp, struct bpak_header *origin_header);
 
+/**
+ * bpak_transport_encode with encoder options
+ *
+ * @param[in] options Encoder options, or NULL to use the defaults
+ *
+ * See bpak_transport_encode for the other parameters.
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_encode_opts(
+    FILE *input_fp, struct bpak_header *input_header, FILE *output_fp,
+    struct bpak_header *output_header, FILE *origin_fp,
+    struct bpak_header *origin_header,
+    const struct bpak_transport_encode_options *options);
+
+/**
+ * Create an encode session
+ *
+ * The suffix array of an origin part is built the first time that a part
+ * is diffed against it in the session, and is then kept with a mapping of
+ * the origin data until the session is freed. Later encodes against the
+ * same origin data, from any origin package and on any thread, start the
+ * diff at once. Origins are found by the sha256 of their data.
+ *
+ * Nothing is ever dropped from a session, the memory use grows with the
+ * number of distinct origins.
+ *
+ * @param[out] session The new session
+ *
+ * @return BPAK_OK on success or a negative number on failure
+ */
+int bpak_transport_encode_session_create(
+    struct bpak_transport_encode_session **session);
+
+/**
+ * Free an encode session. No encode may use it any more.
+ *
+ * @param[in] session The session or NULL
+ */
+void bpak_transport_encode_session_free(
+    struct bpak_transport_encode_session *session);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -52,6 +52,60 @@ int bpak_verify_compute_payload_hash(struct bpak_header *header,
                                      void *user, uint8_t *output_hash_buffer,
                                      size_t *output_hash_buffer_length);
 
+/**
+ * Compute the digest of one part, with the hash kind of the package. The
+ * digest covers the same bytes as the payload hash does for the part.
+ *
+ * @param[in] header Pointer to a bpak header
+ * @param[in] part Part to hash
+ * @param[in] read_payload Read callback for reading payload data
+ * @param[in] data_offset Payload data offset
+ * @param[in] user User pointer for io callback
+ * @param[out] output Output hash buffer
+ * @param[in,out] size Length of hash buffer / result bytes
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_verify_compute_part_digest(struct bpak_header *header,
+                                    struct bpak_part_header *part,
+                                    bpak_io_t read_payload, off_t data_offset,
+                                    void *user, uint8_t *output, size_t *size);
+
+/**
+ * Compute the digest of one part in a package with continuation tables,
+ * see bpak_verify_compute_part_digest.
+ *
+ * @param[in] tables Continuation tables of 'header'
+ * @param[in] count Number of tables
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_verify_compute_part_digest_tables(struct bpak_header *header,
+                                           struct bpak_header *tables,
+                                           unsigned int count,
+                                           struct bpak_part_header *part,
+                                           bpak_io_t read_payload,
+                                           off_t data_offset, void *user,
+                                           uint8_t *output, size_t *size);
+
+/**
+ * Verify one part against its 'part-digest' meta data. The digest is part
+ * of the signed header, so a part can be verified on its own once the
+ * header signature has been checked.
+ *
+ * @param[in] header Pointer to a bpak header
+ * @param[in] part_id Id of the part to verify
+ * @param[in] read_payload Read callback for reading payload data
+ * @param[in] data_offset Payload data offset
+ * @param[in] user User pointer for io callback
+ *
+ * @return BPAK_OK if the part matches, -BPAK_MISSING_META_DATA if it has no
+ *         digest or -BPAK_BAD_PAYLOAD_HASH on mismatch
+ */
+int bpak_verify_part_digest(struct bpak_header *header, bpak_id_t part_id,
+                            bpak_io_t read_payload, off_t data_offset,
+                            void *user);
+
 /**
  * Verify an existing merkle hash tree. This function will re-generate all
  * hashes and compare the result with what's accesible with the 'read_payload'
@@ -74,7 +128,11 @@ int bpak_verify_merkle_tree(bpak_io_t read_payload, off_t data_offset,
 /**
  * Verify the payload data. It will compute the payload hash for parts that
  * should be hashed. It also verifies generated merkle hash trees and
- * root hashes.
+ * root hashes. The payload is read once, parts with a hash tree feed both
+ * the payload hash and their merkle tree.
+ *
+ * A header with continuation tables is verified with
+ * bpak_verify_payload_tables.
  *
  * @param[in] header Pointer to a bpak header
  * @param[in] read I/O callback for reading payload data
@@ -86,6 +144,91 @@ int bpak_verify_merkle_tree(bpak_io_t read_payload, off_t data_offset,
 int bpak_verify_payload(struct bpak_header *header, bpak_io_t read_payload,
                         off_t data_offset, void *user);
 
+/**
+ * Verify the payload of a package with continuation tables in one pass,
+ * like bpak_verify_payload. The tables are covered by the payload hash,
+ * 'tables' must hold the 'table_count' tables that follow the header.
+ * 'data_offset' is the offset of the first table, that is the end of the
+ * fixed header.
+ *
+ * @param[in] header Pointer to a bpak header
+ * @param[in] tables Continuation tables, may be NULL when 'count' is 0
+ * @param[in] count Number of tables
+ * @param[in] read I/O callback for reading payload data
+ * @param[in] data_offset Payload data offset
+ * @param[in] user User pointer for io callback
+ *
+ * @return BPAK_OK on success, -BPAK_NOT_SUPPORTED if 'count' does not match
+ *         the header
+ */
+int bpak_verify_payload_tables(struct bpak_header *header,
+                               struct bpak_header *tables, unsigned int count,
+                               bpak_io_t read_payload, off_t data_offset,
+                               void *user);
+
+/**
+ * Verify the payload data like bpak_verify_payload, with the payload hash
+ * and the merkle tree of each part computed concurrently. Parts with a hash
+ * tree are read twice, once for the payload hash and once for the tree.
+ *
+ * When every part that is covered by the payload hash has a part digest,
+ * the parts are checked against their digests in parallel instead of
+ * computing the payload hash.
+ *
+ * 'read_payload' is called from several threads at once and must not
+ * depend on a shared file position, use positional reads such as pread.
+ *
+ * @param[in] header Pointer to a bpak header
+ * @param[in] read I/O callback for reading payload data
+ * @param[in] data_offset Payload data offset
+ * @param[in] user User pointer for io callback
+ * @param[in] jobs Number of threads, 0 uses one per online CPU and 1 is the
+ *                 same as bpak_verify_payload. A header with continuation
+ *                 tables is not supported.
+ *
+ * @return BPAK_OK on success
+ */
+int bpak_verify_payload_parallel(struct bpak_header *header,
+                                 bpak_io_t read_payload, off_t data_offset,
+                                 void *user, unsigned int jobs);
+
+/**
+ * Where an installed part is found, see bpak_verify_installed
+ */
+struct bpak_verify_location {
+    bpak_id_t part_id;      /*!< Id of the installed part */
+    bpak_io_t read_payload; /*!< Reads the device or file of the part */
+    off_t offset;           /*!< Offset of the part data for 'read_payload' */
+    void *user;             /*!< User pointer for 'read_payload' */
+};
+
+/**
+ * Verify installed parts where they are, against a verified header
+ *
+ * Each location holds the data of one part as it is stored in the
+ * package, that is bpak_part_size bytes. A part is checked against its
+ * part digest, and its merkle tree is verified when the hash tree part
+ * has a location as well, the data and the tree may be on different
+ * devices. Hash tree parts are checked with their data part. The payload
+ * hash is not computed.
+ *
+ * The checks run concurrently, each reads its own location. The
+ * callbacks must be positional and may be called from several threads at
+ * once.
+ *
+ * @param[in] header Pointer to a bpak header without continuation tables
+ * @param[in] locations Installed parts
+ * @param[in] count Number of locations, at most BPAK_MAX_PARTS
+ * @param[in] jobs Number of threads, 0 runs every check at once
+ *
+ * @return BPAK_OK when every part is correct, -BPAK_MISSING_META_DATA when
+ *         a part has neither a digest nor a hash tree with a location, or
+ *         the error of the first part that failed in 'locations' order
+ */
+int bpak_verify_installed(struct bpak_header *header,
+                          const struct bpak_verify_location *locations,
+                          size_t count, unsigned int jobs);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,79 @@
+/**
+ * \file verify_boot.h
+ *
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Package verification for bootloaders. Every buffer is owned by the
+ * caller, nothing is allocated and no chunk buffer is put on the stack.
+ *
+ * verify_boot.c is part of the minimal library. It only needs
+ * bpak_hash_init, bpak_hash_update, bpak_hash_final, bpak_hash_free and
+ * bpak_crypto_verify, which are provided by crypto.c in a full build and
+ * by the integrator, for example as direct calls into a hardware hash
+ * engine, in a minimal build.
+ */
+
+#ifndef INCLUDE_BPAK_VERIFY_BOOT_H
+#define INCLUDE_BPAK_VERIFY_BOOT_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <bpak/bpak.h>
+#include <bpak/crypto.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Caller owned state of bpak_verify_boot
+ */
+struct bpak_verify_boot_ctx {
+    struct bpak_hash_context hash;        /*!< Header and payload hash */
+    uint8_t digest[BPAK_HASH_MAX_LENGTH]; /*!< Computed hash */
+    /*! Payload read buffer, for example a DMA buffer. Larger chunks give
+     *  fewer read_payload and bpak_hash_update calls. */
+    uint8_t *chunk;
+    size_t chunk_size; /*!< Size of 'chunk' in bytes */
+};
+
+/**
+ * RAM used by bpak_verify_boot besides the chunk buffer and the stack.
+ * The stack frames of the library are listed in .su files when it is
+ * built with BPAK_STACK_USAGE. bpak_verify_boot keeps no buffers on the
+ * stack, the stack of the hash and signature backend comes on top.
+ */
+#define BPAK_VERIFY_BOOT_RAM_SIZE (sizeof(struct bpak_verify_boot_ctx))
+
+/**
+ * Verify the header signature and the payload hash of a package
+ *
+ * The header is hashed in two updates, with the signature zeroed in
+ * 'ctx->chunk'. The payload is read in chunks of 'ctx->chunk_size' bytes,
+ * each chunk is hashed with one update. Merkle trees are not checked,
+ * they protect the parts at runtime. A header with continuation tables is
+ * not supported.
+ *
+ * @param[in] ctx State and chunk buffer, see struct bpak_verify_boot_ctx
+ * @param[in] header Pointer to a bpak header
+ * @param[in] key Public key that the header is signed with
+ * @param[in] read_payload I/O callback for reading payload data
+ * @param[in] data_offset Offset of the payload for 'read_payload'
+ * @param[in] user User pointer for 'read_payload'
+ *
+ * @return BPAK_OK on success, -BPAK_VERIFY_FAIL for a bad signature,
+ *         -BPAK_BAD_PAYLOAD_HASH for a bad payload or a negative number
+ */
+int bpak_verify_boot(struct bpak_verify_boot_ctx *ctx,
+                     struct bpak_header *header, struct bpak_key *key,
+                     bpak_io_t read_payload, off_t data_offset, void *user);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // INCLUDE_BPAK_VERIFY_BOOT_H
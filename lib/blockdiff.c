@@ -0,0 +1,260 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/blockdiff.h>
+
+struct block_entry {
+    uint64_t hash;
+    uint64_t offset;
+};
+
+struct blockdiff_op {
+    uint32_t op;
+    uint64_t length;
+    uint64_t origin_offset;
+    uint64_t new_offset;
+};
+
+/* The hash only needs to spread blocks in the lookup table, candidates are
+ * always compared with memcmp before they are used */
+static uint64_t block_hash(const uint8_t *data, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t word;
+
+    for (size_t i = 0; i + 8 <= length; i += 8) {
+        memcpy(&word, &data[i], 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+static int block_entry_compare(const void *a_p, const void *b_p)
+{
+    const struct block_entry *a = a_p;
+    const struct block_entry *b = b_p;
+
+    if (a->hash != b->hash)
+        return (a->hash < b->hash) ? -1 : 1;
+    if (a->offset != b->offset)
+        return (a->offset < b->offset) ? -1 : 1;
+    return 0;
+}
+
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        buf[i] = (value >> (i * 8)) & 0xff;
+}
+
+static void put_u64(uint8_t *buf, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        buf[i] = (value >> (i * 8)) & 0xff;
+}
+
+static int write_all(bpak_io_t write_output, off_t offset, uint8_t *buffer,
+                     size_t length, void *user_priv)
+{
+    ssize_t bytes_written = write_output(offset, buffer, length, user_priv);
+
+    if (bytes_written < 0)
+        return bytes_written;
+    if (bytes_written != (ssize_t)length)
+        return -BPAK_WRITE_ERROR;
+
+    return BPAK_OK;
+}
+
+static ssize_t flush_op(struct blockdiff_op *op, uint8_t *new_data,
+                        bpak_io_t write_output, off_t output_offset,
+                        size_t *output_pos, void *user_priv)
+{
+    int rc;
+    uint8_t header[BPAK_BLOCKDIFF_OP_LENGTH];
+
+    if (op->length == 0)
+        return BPAK_OK;
+
+    bpak_printf(2,
+                "blockdiff: %s %10lu %10lu\n",
+                (op->op == BPAK_BLOCKDIFF_OP_COPY) ? "copy" : "literal",
+                op->length,
+                op->origin_offset);
+
+    put_u32(&header[0], op->op);
+    put_u64(&header[4], op->length);
+    put_u64(&header[12], op->origin_offset);
+
+    rc = write_all(write_output,
+                   output_offset + *output_pos,
+                   header,
+                   sizeof(header),
+                   user_priv);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    *output_pos += sizeof(header);
+
+    if (op->op == BPAK_BLOCKDIFF_OP_LITERAL) {
+        rc = write_all(write_output,
+                       output_offset + *output_pos,
+                       &new_data[op->new_offset],
+                       op->length,
+                       user_priv);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        *output_pos += op->length;
+    }
+
+    op->length = 0;
+    return BPAK_OK;
+}
+
+/* Returns the origin offset of a block equal to 'block' or -1 */
+static int64_t find_block(const struct block_entry *entries,
+                          size_t no_of_entries, const uint8_t *origin_data,
+                          const uint8_t *block)
+{
+    uint64_t hash = block_hash(block, BPAK_BLOCKDIFF_BLOCK_SIZE);
+    size_t lo = 0;
+    size_t hi = no_of_entries;
+
+    /* Lower bound of 'hash' */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (entries[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; (lo < no_of_entries) && (entries[lo].hash == hash); lo++) {
+        if (memcmp(&origin_data[entries[lo].offset],
+                   block,
+                   BPAK_BLOCKDIFF_BLOCK_SIZE) == 0) {
+            return entries[lo].offset;
+        }
+    }
+
+    return -1;
+}
+
+BPAK_EXPORT ssize_t bpak_blockdiff(uint8_t *origin_data, size_t origin_length,
+                                   uint8_t *new_data, size_t new_length,
+                                   bpak_io_t write_output, off_t output_offset,
+                                   void *user_priv)
+{
+    ssize_t rc = BPAK_OK;
+    size_t no_of_entries = origin_length / BPAK_BLOCKDIFF_BLOCK_SIZE;
+    struct block_entry *entries = NULL;
+    struct blockdiff_op op;
+    size_t output_pos = 0;
+    size_t copied = 0;
+
+    bpak_printf(2,
+                "blockdiff: origin_length = %zu, target_length = %zu\n",
+                origin_length,
+                new_length);
+
+    if (no_of_entries > 0) {
+        entries = bpak_calloc(no_of_entries, sizeof(*entries));
+
+        if (entries == NULL)
+            return -BPAK_FAILED;
+    }
+
+    for (size_t i = 0; i < no_of_entries; i++) {
+        entries[i].offset = i * BPAK_BLOCKDIFF_BLOCK_SIZE;
+        entries[i].hash = block_hash(&origin_data[entries[i].offset],
+                                     BPAK_BLOCKDIFF_BLOCK_SIZE);
+    }
+
+    if (no_of_entries > 0)
+        qsort(entries, no_of_entries, sizeof(*entries), block_entry_compare);
+
+    memset(&op, 0, sizeof(op));
+
+    for (size_t pos = 0; pos < new_length; pos += BPAK_BLOCKDIFF_BLOCK_SIZE) {
+        size_t length = BPAK_MIN(BPAK_BLOCKDIFF_BLOCK_SIZE, new_length - pos);
+        int64_t origin_pos = -1;
+
+        if (length == BPAK_BLOCKDIFF_BLOCK_SIZE) {
+            uint64_t next = op.origin_offset + op.length;
+
+            /* Try to continue the current copy before doing a lookup */
+            if ((op.op == BPAK_BLOCKDIFF_OP_COPY) && (op.length > 0) &&
+                (next + length <= origin_length) &&
+                (memcmp(&origin_data[next], &new_data[pos], length) == 0)) {
+                origin_pos = next;
+            } else {
+                origin_pos = find_block(entries,
+                                        no_of_entries,
+                                        origin_data,
+                                        &new_data[pos]);
+            }
+        }
+
+        uint32_t wanted_op = (origin_pos >= 0) ? BPAK_BLOCKDIFF_OP_COPY
+                                               : BPAK_BLOCKDIFF_OP_LITERAL;
+
+        if ((op.length > 0) && (op.op == wanted_op) &&
+            ((wanted_op == BPAK_BLOCKDIFF_OP_LITERAL) ||
+             ((uint64_t)origin_pos == op.origin_offset + op.length))) {
+            op.length += length;
+        } else {
+            rc = flush_op(&op,
+                          new_data,
+                          write_output,
+                          output_offset,
+                          &output_pos,
+                          user_priv);
+
+            if (rc != BPAK_OK)
+                goto err_free_out;
+
+            op.op = wanted_op;
+            op.length = length;
+            op.origin_offset = (origin_pos >= 0) ? (uint64_t)origin_pos : 0;
+            op.new_offset = pos;
+        }
+
+        if (origin_pos >= 0)
+            copied += length;
+    }
+
+    rc = flush_op(&op,
+                  new_data,
+                  write_output,
+                  output_offset,
+                  &output_pos,
+                  user_priv);
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    bpak_printf(1,
+                "blockdiff: %zu of %zu bytes copied from origin\n",
+                copied,
+                new_length);
+
+    rc = output_pos;
+err_free_out:
+    bpak_free(entries);
+    return rc;
+}
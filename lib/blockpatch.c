@@ -0,0 +1,166 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/blockpatch.h>
+
+static uint64_t get_le(const uint8_t *buf, int length)
+{
+    uint64_t value = 0;
+
+    for (int i = length - 1; i >= 0; i--)
+        value = (value << 8) | buf[i];
+
+    return value;
+}
+
+static int write_output(struct bpak_blockpatch_context *ctx, uint8_t *buffer,
+                        size_t length)
+{
+    ssize_t bytes_written = ctx->write_output(ctx->output_offset +
+                                                  ctx->output_position,
+                                              buffer,
+                                              length,
+                                              ctx->user_priv);
+
+    if (bytes_written < 0)
+        return bytes_written;
+    if (bytes_written != (ssize_t)length)
+        return -BPAK_PATCH_WRITE_ERROR;
+
+    ctx->output_position += length;
+    return BPAK_OK;
+}
+
+static int copy_origin(struct bpak_blockpatch_context *ctx,
+                       uint64_t origin_position, uint64_t length)
+{
+    int rc;
+
+    while (length > 0) {
+        size_t chunk_length = BPAK_MIN(length, ctx->buffer_length);
+        ssize_t bytes_read = ctx->read_origin(ctx->origin_offset +
+                                                  origin_position,
+                                              ctx->buffer,
+                                              chunk_length,
+                                              ctx->user_priv);
+
+        if (bytes_read != (ssize_t)chunk_length) {
+            bpak_printf(0,
+                        "Error: Could not read origin at %lu\n",
+                        origin_position);
+            return -BPAK_PATCH_READ_ORIGIN_ERROR;
+        }
+
+        rc = write_output(ctx, ctx->buffer, chunk_length);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        origin_position += chunk_length;
+        length -= chunk_length;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_blockpatch_init(struct bpak_blockpatch_context *ctx,
+                                     uint8_t *buffer, size_t buffer_length,
+                                     bpak_io_t read_origin,
+                                     off_t origin_offset,
+                                     bpak_io_t write_output,
+                                     off_t output_offset, void *user_priv)
+{
+    if ((buffer == NULL) || (buffer_length == 0))
+        return -BPAK_BUFFER_TOO_SMALL;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->buffer = buffer;
+    ctx->buffer_length = buffer_length;
+    ctx->read_origin = read_origin;
+    ctx->origin_offset = origin_offset;
+    ctx->write_output = write_output;
+    ctx->output_offset = output_offset;
+    ctx->user_priv = user_priv;
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_blockpatch_write(struct bpak_blockpatch_context *ctx,
+                                      uint8_t *buffer, size_t length)
+{
+    int rc;
+
+    while (length > 0) {
+        if (ctx->literal_count > 0) {
+            size_t chunk_length = BPAK_MIN(length, ctx->literal_count);
+
+            rc = write_output(ctx, buffer, chunk_length);
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            ctx->literal_count -= chunk_length;
+            buffer += chunk_length;
+            length -= chunk_length;
+            continue;
+        }
+
+        size_t header_bytes =
+            BPAK_MIN(length, sizeof(ctx->op_buf) - ctx->op_buf_count);
+
+        memcpy(&ctx->op_buf[ctx->op_buf_count], buffer, header_bytes);
+        ctx->op_buf_count += header_bytes;
+        buffer += header_bytes;
+        length -= header_bytes;
+
+        if (ctx->op_buf_count < sizeof(ctx->op_buf))
+            break;
+
+        uint32_t op = get_le(&ctx->op_buf[0], 4);
+        uint64_t op_length = get_le(&ctx->op_buf[4], 8);
+        uint64_t origin_position = get_le(&ctx->op_buf[12], 8);
+
+        bpak_printf(2,
+                    "Blockpatch: %u %10lu %10lu\n",
+                    op,
+                    op_length,
+                    origin_position);
+
+        ctx->op_buf_count = 0;
+
+        switch (op) {
+        case BPAK_BLOCKDIFF_OP_LITERAL:
+            ctx->literal_count = op_length;
+            break;
+        case BPAK_BLOCKDIFF_OP_COPY:
+            rc = copy_origin(ctx, origin_position, op_length);
+
+            if (rc != BPAK_OK)
+                return rc;
+            break;
+        default:
+            bpak_printf(0, "Error: Unknown blockpatch operation %u\n", op);
+            return -BPAK_NOT_SUPPORTED;
+        }
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT ssize_t bpak_blockpatch_final(struct bpak_blockpatch_context *ctx)
+{
+    if ((ctx->op_buf_count != 0) || (ctx->literal_count != 0)) {
+        bpak_printf(0, "Error: Blockpatch input ended inside an operation\n");
+        return -BPAK_SIZE_ERROR;
+    }
+
+    return ctx->output_position;
+}
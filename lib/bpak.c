@@ -9,6 +9,7 @@
 
 #include <string.h>
 #include <bpak/bpak.h>
+#include <bpak/id.h>
 
 /* BPAK_META_ALIGN is a power-of-2 */
 #define BPAK_META_ALIGN_SIZE(_x) \
@@ -56,12 +57,14 @@ BPAK_EXPORT int bpak_add_meta(struct bpak_header *hdr, bpak_id_t id,
 
     bpak_foreach_meta (hdr, m) {
         if (!m->id) {
+            /* Leave the entry unused when the data does not fit */
+            if ((new_offset + size) > BPAK_METADATA_BYTES)
+                return -BPAK_NO_SPACE_LEFT;
+
             m->id = id;
             m->offset = new_offset;
             m->size = size;
             m->part_id_ref = part_ref_id;
-            if ((m->offset + m->size) > BPAK_METADATA_BYTES)
-                return -BPAK_NO_SPACE_LEFT;
 
             *meta = m;
             return BPAK_OK;
@@ -150,6 +153,185 @@ BPAK_EXPORT void bpak_del_part(struct bpak_header *hdr,
     memset(part, 0, sizeof(*part));
 }
 
+/* Order of meta data entries in the index, by id, part reference and
+ * position so that the first entry in the header is found first */
+static int index_meta_cmp(const struct bpak_header *hdr, uint8_t a,
+                          bpak_id_t id, bpak_id_t part_id_ref, uint8_t b)
+{
+    const struct bpak_meta_header *m = &hdr->meta[a];
+
+    if (m->id != id)
+        return (m->id < id) ? -1 : 1;
+    if (m->part_id_ref != part_id_ref)
+        return (m->part_id_ref < part_id_ref) ? -1 : 1;
+    if (a != b)
+        return (a < b) ? -1 : 1;
+
+    return 0;
+}
+
+BPAK_EXPORT int bpak_header_index_init(struct bpak_header_index *index,
+                                       struct bpak_header *hdr)
+{
+    uint64_t offset = bpak_header_size(hdr);
+    bool end_of_parts = false;
+
+    memset(index, 0, sizeof(*index));
+    index->header = hdr;
+
+    /* Insertion sort, the arrays are short */
+    for (uint8_t i = 0; i < BPAK_MAX_META; i++) {
+        const struct bpak_meta_header *m = &hdr->meta[i];
+        uint8_t n = index->meta_count;
+
+        if (!m->id)
+            continue;
+
+        while ((n > 0) && (index_meta_cmp(hdr,
+                                          index->meta_order[n - 1],
+                                          m->id,
+                                          m->part_id_ref,
+                                          i) > 0)) {
+            index->meta_order[n] = index->meta_order[n - 1];
+            n--;
+        }
+
+        index->meta_order[n] = i;
+        index->meta_count++;
+    }
+
+    for (uint8_t i = 0; i < BPAK_MAX_PARTS; i++) {
+        struct bpak_part_header *p = &hdr->parts[i];
+        uint8_t n = index->part_count;
+
+        /* Same offsets as bpak_part_offset, which stops at the first
+         * empty entry */
+        index->part_offset[i] = offset;
+
+        if (!p->id) {
+            end_of_parts = true;
+            continue;
+        }
+
+        if (!end_of_parts)
+            offset += bpak_part_size(p);
+
+        while ((n > 0) && (hdr->parts[index->part_order[n - 1]].id > p->id)) {
+            index->part_order[n] = index->part_order[n - 1];
+            n--;
+        }
+
+        index->part_order[n] = i;
+        index->part_count++;
+    }
+
+    return BPAK_OK;
+}
+
+/* First position in the sorted meta data that is not before (id, ref) */
+static uint8_t index_meta_lower_bound(const struct bpak_header_index *index,
+                                      bpak_id_t id, bpak_id_t part_id_ref)
+{
+    uint8_t low = 0;
+    uint8_t high = index->meta_count;
+
+    while (low < high) {
+        uint8_t mid = (low + high) / 2;
+
+        if (index_meta_cmp(index->header,
+                           index->meta_order[mid],
+                           id,
+                           part_id_ref,
+                           0) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+BPAK_EXPORT int
+bpak_header_index_get_meta(const struct bpak_header_index *index,
+                           bpak_id_t id, bpak_id_t part_id_ref,
+                           struct bpak_meta_header **meta)
+{
+    uint8_t n = index_meta_lower_bound(index, id, part_id_ref);
+
+    if (n < index->meta_count) {
+        struct bpak_meta_header *m =
+            &index->header->meta[index->meta_order[n]];
+
+        if ((m->id == id) && (m->part_id_ref == part_id_ref)) {
+            *meta = m;
+            return BPAK_OK;
+        }
+    }
+
+    *meta = NULL;
+    return -BPAK_NOT_FOUND;
+}
+
+BPAK_EXPORT int
+bpak_header_index_get_meta_anyref(const struct bpak_header_index *index,
+                                  bpak_id_t id, struct bpak_meta_header **meta)
+{
+    uint8_t n = index_meta_lower_bound(index, id, 0);
+    int first = -1;
+
+    /* Entries with this id are sorted by reference, the first one in the
+     * header is the one bpak_get_meta_anyref returns */
+    for (; n < index->meta_count; n++) {
+        uint8_t pos = index->meta_order[n];
+
+        if (index->header->meta[pos].id != id)
+            break;
+
+        if ((first < 0) || (pos < first))
+            first = pos;
+    }
+
+    if (first < 0) {
+        *meta = NULL;
+        return -BPAK_NOT_FOUND;
+    }
+
+    *meta = &index->header->meta[first];
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_header_index_get_part(const struct bpak_header_index *index,
+                           bpak_id_t id, struct bpak_part_header **part)
+{
+    uint8_t low = 0;
+    uint8_t high = index->part_count;
+
+    while (low < high) {
+        uint8_t mid = (low + high) / 2;
+
+        if (index->header->parts[index->part_order[mid]].id < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if ((low < index->part_count) &&
+        (index->header->parts[index->part_order[low]].id == id)) {
+        *part = &index->header->parts[index->part_order[low]];
+        return BPAK_OK;
+    }
+
+    return -BPAK_NOT_FOUND;
+}
+
+BPAK_EXPORT off_t
+bpak_header_index_part_offset(const struct bpak_header_index *index,
+                              const struct bpak_part_header *part)
+{
+    return index->part_offset[part - index->header->parts];
+}
+
 BPAK_EXPORT int bpak_init_header(struct bpak_header *hdr)
 {
     memset(hdr, 0, sizeof(*hdr));
@@ -230,11 +412,9 @@ BPAK_EXPORT const char *bpak_error_string(int code)
     }
 }
 
-BPAK_EXPORT int bpak_valid_header(struct bpak_header *hdr)
+/* Part alignment and meta data bounds, shared by headers and tables */
+static int bpak_valid_arrays(struct bpak_header *hdr)
 {
-    if (hdr->magic != BPAK_HEADER_MAGIC)
-        return -BPAK_BAD_MAGIC;
-
     /* Check alignment of part data blocks */
     bpak_foreach_part (hdr, p) {
         if (!p->id)
@@ -254,16 +434,213 @@ BPAK_EXPORT int bpak_valid_header(struct bpak_header *hdr)
         }
     }
 
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_valid_header(struct bpak_header *hdr)
+{
+    int rc;
+
+    if (hdr->magic == BPAK_HEADER_MAGIC_EXT) {
+        if ((hdr->table_count == 0) || (hdr->table_count > BPAK_MAX_TABLES))
+            return -BPAK_SIZE_ERROR;
+    } else if (hdr->magic != BPAK_HEADER_MAGIC) {
+        return -BPAK_BAD_MAGIC;
+    }
+
+    rc = bpak_valid_arrays(hdr);
+
+    if (rc != BPAK_OK)
+        return rc;
+
     if (!hdr->hash_kind)
         return -BPAK_NOT_SUPPORTED;
 
     return BPAK_OK;
 }
 
+BPAK_EXPORT int bpak_header_parse(struct bpak_header *hdr, const void *buffer,
+                                  size_t length)
+{
+    if (length < sizeof(*hdr))
+        return -BPAK_SIZE_ERROR;
+
+    memcpy(hdr, buffer, sizeof(*hdr));
+    return bpak_valid_header(hdr);
+}
+
+BPAK_EXPORT int bpak_init_table(struct bpak_header *table)
+{
+    memset(table, 0, sizeof(*table));
+    table->magic = BPAK_TABLE_MAGIC;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_valid_table(struct bpak_header *table)
+{
+    if (table->magic != BPAK_TABLE_MAGIC)
+        return -BPAK_BAD_MAGIC;
+
+    return bpak_valid_arrays(table);
+}
+
+BPAK_EXPORT size_t bpak_header_size(struct bpak_header *hdr)
+{
+    if (hdr->magic != BPAK_HEADER_MAGIC_EXT)
+        return sizeof(*hdr);
+
+    return sizeof(*hdr) * (1 + (size_t)hdr->table_count);
+}
+
+BPAK_EXPORT int bpak_tables_parse(struct bpak_header *hdr,
+                                  struct bpak_header *tables,
+                                  const void *buffer, size_t length)
+{
+    int rc;
+    const uint8_t *p = (const uint8_t *)buffer + sizeof(*hdr);
+
+    if (hdr->magic != BPAK_HEADER_MAGIC_EXT)
+        return BPAK_OK;
+
+    if (length < bpak_header_size(hdr))
+        return -BPAK_SIZE_ERROR;
+
+    for (unsigned int i = 0; i < hdr->table_count; i++) {
+        memcpy(&tables[i], &p[i * sizeof(*tables)], sizeof(*tables));
+        rc = bpak_valid_table(&tables[i]);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT struct bpak_header *bpak_next_table(struct bpak_header *hdr,
+                                                struct bpak_header *tables,
+                                                unsigned int count,
+                                                struct bpak_header *table)
+{
+    if (table == hdr)
+        return (count > 0) ? tables : NULL;
+
+    if (table + 1 < tables + count)
+        return table + 1;
+
+    return NULL;
+}
+
+BPAK_EXPORT int bpak_tables_get_part(struct bpak_header *hdr,
+                                     struct bpak_header *tables,
+                                     unsigned int count, bpak_id_t id,
+                                     struct bpak_part_header **part)
+{
+    bpak_foreach_table (hdr, tables, count, t) {
+        if (bpak_get_part(t, id, part) == BPAK_OK)
+            return BPAK_OK;
+    }
+
+    return -BPAK_NOT_FOUND;
+}
+
+BPAK_EXPORT int bpak_tables_get_meta(struct bpak_header *hdr,
+                                     struct bpak_header *tables,
+                                     unsigned int count, bpak_id_t id,
+                                     bpak_id_t part_id_ref,
+                                     struct bpak_meta_header **meta,
+                                     struct bpak_header **table)
+{
+    bpak_foreach_table (hdr, tables, count, t) {
+        if (bpak_get_meta(t, id, part_id_ref, meta) == BPAK_OK) {
+            if (table != NULL)
+                (*table) = t;
+            return BPAK_OK;
+        }
+    }
+
+    return -BPAK_NOT_FOUND;
+}
+
+BPAK_EXPORT int bpak_tables_get_sparse_map(struct bpak_header *hdr,
+                                           struct bpak_header *tables,
+                                           unsigned int count,
+                                           struct bpak_part_header *part,
+                                           struct bpak_sparse_map *map)
+{
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_header *table = NULL;
+    uint64_t end = 0;
+    uint64_t zeros = 0;
+
+    map->extents = NULL;
+    map->count = 0;
+    map->stored_size = part->size;
+    map->size = part->size;
+
+    if (!(part->flags & BPAK_FLAG_SPARSE))
+        return BPAK_OK;
+
+    /* id("bpak-sparse-map") = 0xafc1514b */
+    if (bpak_tables_get_meta(hdr,
+                             tables,
+                             count,
+                             0xafc1514b,
+                             part->id,
+                             &meta,
+                             &table) != BPAK_OK)
+        return -BPAK_MISSING_META_DATA;
+
+    if ((meta->size == 0) ||
+        (meta->size % sizeof(struct bpak_sparse_extent)))
+        return -BPAK_SIZE_ERROR;
+
+    map->extents =
+        bpak_get_meta_ptr(table, meta, const struct bpak_sparse_extent);
+    map->count = meta->size / sizeof(struct bpak_sparse_extent);
+
+    /* Every extent must be followed by stored data */
+    for (size_t i = 0; i < map->count; i++) {
+        uint64_t start = (uint64_t)map->extents[i].block *
+                         BPAK_SPARSE_BLOCK_SZ;
+        uint64_t length = (uint64_t)map->extents[i].count *
+                          BPAK_SPARSE_BLOCK_SZ;
+
+        if ((length == 0) || (start < end) || (start - zeros >= part->size))
+            return -BPAK_SIZE_ERROR;
+
+        end = start + length;
+        zeros += length;
+    }
+
+    map->size = part->size + zeros;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT off_t bpak_tables_part_offset(struct bpak_header *hdr,
+                                          struct bpak_header *tables,
+                                          unsigned int count,
+                                          struct bpak_part_header *part)
+{
+    off_t offset = bpak_header_size(hdr);
+
+    bpak_foreach_table (hdr, tables, count, t) {
+        bpak_foreach_part (t, p) {
+            if (!p->id)
+                break;
+            if (p == part)
+                return offset;
+
+            offset += bpak_part_size(p);
+        }
+    }
+
+    return offset;
+}
+
 BPAK_EXPORT off_t bpak_part_offset(struct bpak_header *h,
                                    struct bpak_part_header *part)
 {
-    off_t offset = sizeof(*h);
+    off_t offset = bpak_header_size(h);
 
     bpak_foreach_part (h, p) {
         if (!p->id)
@@ -389,4 +766,165 @@ BPAK_EXPORT int bpak_add_transport_meta(struct bpak_header *header,
     return BPAK_OK;
 }
 
+BPAK_EXPORT bpak_id_t
+bpak_transport_origin_id(const struct bpak_transport_meta *tm,
+                         bpak_id_t part_id)
+{
+    bpak_id_t origin_id = 0;
+
+    if (tm != NULL) {
+        const uint8_t *p = &tm->data[BPAK_TRANSPORT_ORIGIN_ID_OFFSET];
+        origin_id = p[0] | (p[1] << 8) | (p[2] << 16) | ((bpak_id_t)p[3] << 24);
+    }
+
+    return origin_id ? origin_id : part_id;
+}
+
+BPAK_EXPORT uint32_t
+bpak_transport_decoder_id(const struct bpak_transport_meta *tm,
+                          const struct bpak_part_header *part)
+{
+    static const uint32_t auto_decoders[] = {
+        [BPAK_TRANSPORT_AUTO_UNSET] = 0,
+        [BPAK_TRANSPORT_AUTO_BSPATCH_NO_COMP] = BPAK_ID_BSPATCH_NO_COMP,
+        [BPAK_TRANSPORT_AUTO_BSPATCH] = BPAK_ID_BSPATCH,
+        [BPAK_TRANSPORT_AUTO_BSPATCH_LZMA] = BPAK_ID_BSPATCH_LZMA,
+        [BPAK_TRANSPORT_AUTO_BSPATCH_ZSTD] = BPAK_ID_BSPATCH_ZSTD,
+        [BPAK_TRANSPORT_AUTO_DECOMPRESS_HS] = BPAK_ID_DECOMPRESS_HS,
+        [BPAK_TRANSPORT_AUTO_DECOMPRESS_LZMA] = BPAK_ID_DECOMPRESS_LZMA,
+        [BPAK_TRANSPORT_AUTO_DECOMPRESS_ZSTD] = BPAK_ID_DECOMPRESS_ZSTD,
+    };
+
+    if (tm == NULL)
+        return 0;
+
+    if (tm->alg_id_decode != BPAK_ID_AUTO)
+        return tm->alg_id_decode;
+
+    return auto_decoders[(part->flags & BPAK_FLAG_AUTO_MASK) >>
+                         BPAK_FLAG_AUTO_SHIFT];
+}
+
+BPAK_EXPORT int bpak_set_transport_origin(struct bpak_header *header,
+                                          bpak_id_t part_id,
+                                          bpak_id_t origin_id)
+{
+    int rc;
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_transport_meta *tm;
+
+    /* id("bpak-transport") = 0x2d44bbfb */
+    rc = bpak_get_meta(header, 0x2d44bbfb, part_id, &meta);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    tm = bpak_get_meta_ptr(header, meta, struct bpak_transport_meta);
+
+    if (origin_id == part_id)
+        origin_id = 0;
+
+    for (int i = 0; i < 4; i++)
+        tm->data[BPAK_TRANSPORT_ORIGIN_ID_OFFSET + i] = origin_id >> (i * 8);
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT uint32_t
+bpak_transport_in_place_scratch(const struct bpak_transport_meta *tm)
+{
+    const uint8_t *p;
+
+    if (tm == NULL)
+        return 0;
+
+    p = &tm->data[BPAK_TRANSPORT_IN_PLACE_OFFSET];
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+BPAK_EXPORT int bpak_set_transport_in_place(struct bpak_header *header,
+                                            bpak_id_t part_id,
+                                            uint32_t scratch_size)
+{
+    int rc;
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_transport_meta *tm;
+
+    rc = bpak_get_meta(header, BPAK_ID_BPAK_TRANSPORT, part_id, &meta);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    tm = bpak_get_meta_ptr(header, meta, struct bpak_transport_meta);
+
+    for (int i = 0; i < 4; i++)
+        tm->data[BPAK_TRANSPORT_IN_PLACE_OFFSET + i] = scratch_size >> (i * 8);
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_set_transport_origin_parts(struct bpak_header *header,
+                                                bpak_id_t part_id,
+                                                const bpak_id_t *origin_ids,
+                                                size_t count)
+{
+    int rc;
+    struct bpak_meta_header *meta = NULL;
+
+    if ((count == 0) || (count > BPAK_TRANSPORT_MAX_ORIGIN_PARTS))
+        return -BPAK_SIZE_ERROR;
+
+    rc = bpak_set_transport_origin(header, part_id, origin_ids[0]);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    /* id("bpak-origin-parts") = 0x5dc8642b */
+    rc = bpak_get_meta(header, 0x5dc8642b, part_id, &meta);
+
+    if ((rc == BPAK_OK) && (meta->size != count * sizeof(bpak_id_t))) {
+        bpak_del_meta(header, meta);
+        rc = -BPAK_NOT_FOUND;
+    }
+
+    if (rc != BPAK_OK) {
+        rc = bpak_add_meta(header,
+                           0x5dc8642b,
+                           part_id,
+                           count * sizeof(bpak_id_t),
+                           &meta);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    memcpy(bpak_get_meta_ptr(header, meta, bpak_id_t),
+           origin_ids,
+           count * sizeof(bpak_id_t));
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_get_transport_origin_parts(struct bpak_header *header,
+                                                bpak_id_t part_id,
+                                                const bpak_id_t **origin_ids,
+                                                size_t *count)
+{
+    int rc;
+    struct bpak_meta_header *meta = NULL;
+
+    /* id("bpak-origin-parts") = 0x5dc8642b */
+    rc = bpak_get_meta(header, 0x5dc8642b, part_id, &meta);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if ((meta->size == 0) || (meta->size % sizeof(bpak_id_t)) ||
+        (meta->size > BPAK_TRANSPORT_MAX_ORIGIN_PARTS * sizeof(bpak_id_t)))
+        return -BPAK_SIZE_ERROR;
+
+    *origin_ids = bpak_get_meta_ptr(header, meta, const bpak_id_t);
+    *count = meta->size / sizeof(bpak_id_t);
+    return BPAK_OK;
+}
+
 BPAK_EXPORT const char *bpak_version(void) { return BPAK_VERSION_STRING; }
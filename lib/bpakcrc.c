@@ -45,8 +45,25 @@
  *
  * CRC32 code derived from work by Gary S. Brown.
  */
+#include <stdbool.h>
 #include <bpak/bpak.h>
 #include <bpak/crc.h>
+#include "crc32_tables.h"
+
+/* The CPU kernels are picked at runtime, which needs pthread_once. The
+ * minimal build, which has no threads, uses slice-by-8 only. */
+#if BPAK_CONFIG_SIMD == 1
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#define CRC_ARM64
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
 
 /*
  * A function that calculates the CRC-32 based on the table above is
@@ -142,12 +159,236 @@ static const uint32_t crc32Table[256] = {
     0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
     0x2d02ef8dL};
 
-BPAK_EXPORT uint32_t bpak_crc32(uint32_t crc, const uint8_t *buf, uint32_t size)
+typedef uint32_t (*crc32_func_t)(uint32_t crc, const uint8_t *buf,
+                                 size_t length);
+
+static inline uint32_t crc32_load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+/* Eight bytes per step with one table per byte position */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, size_t length)
+{
+    const uint32_t(*t)[256] = crc32_slice_table;
+
+    while (length >= 8) {
+        uint32_t lo = crc32_load32(buf) ^ crc;
+        uint32_t hi = crc32_load32(buf + 4);
+
+        crc = t[6][lo & 0xff] ^ t[5][(lo >> 8) & 0xff] ^
+              t[4][(lo >> 16) & 0xff] ^ t[3][lo >> 24] ^ t[2][hi & 0xff] ^
+              t[1][(hi >> 8) & 0xff] ^ t[0][(hi >> 16) & 0xff] ^
+              crc32Table[hi >> 24];
+        buf += 8;
+        length -= 8;
+    }
+
+    while (length--)
+        crc = crc32Table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#ifdef CRC_X86
+/* Shortest input that the folding kernel takes */
+#define CRC32_PCLMUL_MIN_LENGTH 64
+
+/* Folds 64 bytes per step with carry-less multiplies, then Barrett reduces
+ * to 32 bits. The constants are the bit reflected x^n mod P(x) values from
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction", Intel 2009. The SSE4.2 crc32 instruction computes CRC-32C,
+ * a different polynomial, and can't be used. */
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t length)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = {
+        0x0154442bd4, 0x01c6e41596
+    };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = {
+        0x01751997d0, 0x00ccaa009e
+    };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = {
+        0x0163cd6124, 0x0000000000
+    };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = {
+        0x01db710641, 0x01f7011641
+    };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    size_t tail = length % 16;
+
+    if (length < CRC32_PCLMUL_MIN_LENGTH)
+        return crc32_slice8(crc, buf, length);
+
+    length -= tail;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    length -= 64;
+
+    /* Four independent 128 bit lanes */
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+        buf += 64;
+        length -= 64;
+    }
+
+    /* Fold the lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (length >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        length -= 16;
+    }
+
+    /* 128 to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = (uint32_t)_mm_extract_epi32(x1, 1);
+    return crc32_slice8(crc, buf, tail);
+}
+#endif
+
+#ifdef CRC_ARM64
+#if defined(__clang__)
+#define CRC_ARM64_TARGET __attribute__((target("crc")))
+#else
+#define CRC_ARM64_TARGET __attribute__((target("+crc")))
+#endif
+
+/* The ARMv8 crc32 instructions use the same polynomial and bit order */
+CRC_ARM64_TARGET static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf,
+                                             size_t length)
 {
-    const uint8_t *p = buf;
+    while ((length > 0) && (((uintptr_t)buf % 8) != 0)) {
+        crc = __crc32b(crc, *buf++);
+        length--;
+    }
 
-    while (size--)
-        crc = crc32Table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    while (length >= 32) {
+        crc = __crc32d(crc, *(const uint64_t *)(buf + 0));
+        crc = __crc32d(crc, *(const uint64_t *)(buf + 8));
+        crc = __crc32d(crc, *(const uint64_t *)(buf + 16));
+        crc = __crc32d(crc, *(const uint64_t *)(buf + 24));
+        buf += 32;
+        length -= 32;
+    }
+
+    while (length >= 8) {
+        crc = __crc32d(crc, *(const uint64_t *)buf);
+        buf += 8;
+        length -= 8;
+    }
+
+    while (length--)
+        crc = __crc32b(crc, *buf++);
 
     return crc;
 }
+#endif
+
+#if BPAK_CONFIG_SIMD == 1
+static crc32_func_t crc32_update = crc32_slice8;
+static pthread_once_t crc32_init_once = PTHREAD_ONCE_INIT;
+
+static crc32_func_t crc32_detect(void)
+{
+#if defined(CRC_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        return crc32_pclmul;
+#elif defined(CRC_ARM64)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        return crc32_armv8;
+#endif
+    return crc32_slice8;
+}
+
+static void crc32_select(void)
+{
+    crc32_update = crc32_detect();
+}
+#endif
+
+BPAK_EXPORT void bpak_crc32_set_acceleration(bool enable)
+{
+#if BPAK_CONFIG_SIMD == 1
+    pthread_once(&crc32_init_once, crc32_select);
+    crc32_update = enable ? crc32_detect() : crc32_slice8;
+#else
+    (void)enable;
+#endif
+}
+
+BPAK_EXPORT uint32_t bpak_crc32_update(uint32_t crc, const uint8_t *buf,
+                                       size_t length)
+{
+#if BPAK_CONFIG_SIMD == 1
+    pthread_once(&crc32_init_once, crc32_select);
+    return crc32_update(crc, buf, length);
+#else
+    return crc32_slice8(crc, buf, length);
+#endif
+}
+
+BPAK_EXPORT uint32_t bpak_crc32(uint32_t crc, const uint8_t *buf, uint32_t size)
+{
+    return bpak_crc32_update(crc, buf, size);
+}
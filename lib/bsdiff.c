@@ -7,12 +7,26 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <bpak/bpak.h>
 #include <bpak/bsdiff.h>
 
 #include "sais.h"
+#include "stats.h"
+#include "trace.h"
+#include "bsdiff_simd.h"
+#include "chunker.h"
 #include "heatshrink/heatshrink_encoder.h"
 
+/* Targets are not split into segments smaller than this */
+#ifndef BPAK_BSDIFF_MIN_SEGMENT_LENGTH
+#define BPAK_BSDIFF_MIN_SEGMENT_LENGTH (1024 * 1024)
+#endif
+
+#if BPAK_CONFIG_ZSTD == 1
+#include <zstd.h>
+#endif
+
 #if BPAK_CONFIG_LZMA == 1
 #include <lzma.h>
 static void *lzma_alloc_wrap(void *opaque, size_t nmemb, size_t size)
@@ -33,71 +47,222 @@ static const lzma_allocator lzma_alloc = {
 };
 #endif
 
-static int32_t matchlen(uint8_t *from_p, int64_t from_size, uint8_t *to_p,
-                        int64_t to_size)
-{
-    int64_t i;
+/* Runs of at least this many bytes that are unchanged at the current
+ * origin offset are used without searching the suffix array */
+#ifndef BPAK_BSDIFF_FAST_PATH_MIN_LENGTH
+#define BPAK_BSDIFF_FAST_PATH_MIN_LENGTH 128
+#endif
 
-    for (i = 0; i < BPAK_MIN(from_size, to_size); i++) {
-        if (from_p[i] != to_p[i]) {
-            break;
-        }
-    }
+/* Shortest unchanged run that is written as an origin copy tuple, shorter
+ * runs cost less as zero diff bytes */
+#ifndef BPAK_BSDIFF_COPY_MIN_LENGTH
+#define BPAK_BSDIFF_COPY_MIN_LENGTH 256
+#endif
+
+/* Origins shorter than this are searched without the prefix index */
+#ifndef BPAK_BSDIFF_PREFIX_INDEX_MIN_LENGTH
+#define BPAK_BSDIFF_PREFIX_INDEX_MIN_LENGTH (64 * 1024)
+#endif
+
+/* Suffix array neighbours on each side of a match that are tried for an
+ * equally long match closer to the current origin position */
+#ifndef BPAK_BSDIFF_SEEK_CANDIDATES
+#define BPAK_BSDIFF_SEEK_CANDIDATES 32
+#endif
+
+/* The prefix index has one bucket per two byte prefix. Within each leading
+ * byte the one byte suffix, at the very end of the origin, sorts first. */
+#define PREFIX_INDEX_BUCKETS (256 * 257)
+#define PREFIX_INDEX_KEY(_p, _len)                                            \
+    ((_p)[0] * 257 + (((_len) > 1) ? ((_p)[1] + 1) : 0))
 
-    return (i);
+static inline int64_t sa_entry(const struct bpak_bsdiff_context *ctx,
+                               int64_t i)
+{
+    if (ctx->suffix_array_width == sizeof(int32_t))
+        return ((const int32_t *)ctx->suffix_array)[i];
+    else
+        return ((const int64_t *)ctx->suffix_array)[i];
 }
 
-static int64_t search(int64_t *sa_p, uint8_t *from_p, int64_t from_size,
-                      uint8_t *to_p, int64_t to_size, int64_t from_begin,
-                      int64_t from_end, int64_t *pos_p)
+static int prefix_index_init(struct bpak_bsdiff_context *ctx)
 {
-    int64_t x;
-    int64_t y;
+    int64_t *index;
+    int64_t pos = 0;
 
-    if (from_end - from_begin < 2) {
-        x = matchlen(from_p + sa_p[from_begin],
-                     from_size - sa_p[from_begin],
-                     to_p,
-                     to_size);
+    if (ctx->origin_length < BPAK_BSDIFF_PREFIX_INDEX_MIN_LENGTH)
+        return BPAK_OK;
 
-        y = matchlen(from_p + sa_p[from_end],
-                     from_size - sa_p[from_end],
-                     to_p,
-                     to_size);
+    /* Entry 'k' holds the first suffix array index of bucket 'k' */
+    index = bpak_calloc(PREFIX_INDEX_BUCKETS + 1, sizeof(int64_t));
 
-        if (x > y) {
-            *pos_p = sa_p[from_begin];
+    if (index == NULL)
+        return -BPAK_FAILED;
 
-            return (x);
-        } else {
-            *pos_p = sa_p[from_end];
+    for (size_t i = 0; i < ctx->origin_length; i++) {
+        index[PREFIX_INDEX_KEY(&ctx->origin_data[i],
+                               ctx->origin_length - i) + 1]++;
+    }
+
+    for (size_t k = 0; k <= PREFIX_INDEX_BUCKETS; k++) {
+        pos += index[k];
+        index[k] = pos;
+    }
+
+    ctx->prefix_index = index;
+    return BPAK_OK;
+}
 
-            return (y);
+/* Find the longest match of 'to_p' in the origin. This is a binary search
+ * over the suffix array that keeps track of how much of 'to_p' matches at
+ * the lower and upper bounds. Every suffix in between is known to share the
+ * shorter of the two, so that part is never compared again. */
+static int64_t search(const struct bpak_bsdiff_context *ctx,
+                      const uint8_t *to_p, int64_t to_size, int64_t *pos_p,
+                      int64_t *index_p)
+{
+    const uint8_t *from_p = ctx->origin_data;
+    int64_t from_size = (int64_t)ctx->origin_length;
+    int64_t lo = 0;
+    int64_t hi = from_size - 1;
+    int64_t lo_lcp;
+    int64_t hi_lcp;
+    int64_t lo_pos;
+    int64_t hi_pos;
+
+    if ((ctx->prefix_index != NULL) && (to_size > 1)) {
+        int key = PREFIX_INDEX_KEY(to_p, to_size);
+        const int64_t *index = ctx->prefix_index;
+
+        /* Suffixes matching two or more bytes are all in this bucket */
+        if (index[key + 1] > index[key]) {
+            lo = index[key];
+            hi = index[key + 1] - 1;
         }
     }
 
-    x = (from_begin + (from_end - from_begin) / 2);
+    lo_pos = sa_entry(ctx, lo);
+    hi_pos = sa_entry(ctx, hi);
+    lo_lcp = bsdiff_matchlen(from_p + lo_pos,
+                             to_p,
+                             BPAK_MIN(from_size - lo_pos, to_size));
+    hi_lcp = bsdiff_matchlen(from_p + hi_pos,
+                             to_p,
+                             BPAK_MIN(from_size - hi_pos, to_size));
+
+    while (hi - lo >= 2) {
+        int64_t x = lo + (hi - lo) / 2;
+        int64_t x_pos = sa_entry(ctx, x);
+        int64_t cmp_len = BPAK_MIN(from_size - x_pos, to_size);
+        int64_t skip = BPAK_MIN(lo_lcp, hi_lcp);
+        int64_t lcp;
+
+        lcp = skip + bsdiff_matchlen(from_p + x_pos + skip,
+                                     to_p + skip,
+                                     cmp_len - skip);
+
+        if ((lcp < cmp_len) && (from_p[x_pos + lcp] < to_p[lcp])) {
+            lo = x;
+            lo_pos = x_pos;
+            lo_lcp = lcp;
+        } else {
+            hi = x;
+            hi_pos = x_pos;
+            hi_lcp = lcp;
+        }
+    }
 
-    if (memcmp(from_p + sa_p[x], to_p, BPAK_MIN(from_size - sa_p[x], to_size)) <
-        0) {
-        return search(sa_p,
-                      from_p,
-                      from_size,
-                      to_p,
-                      to_size,
-                      x,
-                      from_end,
-                      pos_p);
+    if (lo_lcp > hi_lcp) {
+        *pos_p = lo_pos;
+        *index_p = lo;
+        return lo_lcp;
     } else {
-        return search(sa_p,
-                      from_p,
-                      from_size,
-                      to_p,
-                      to_size,
-                      from_begin,
-                      x,
-                      pos_p);
+        *pos_p = hi_pos;
+        *index_p = hi;
+        return hi_lcp;
+    }
+}
+
+/* True when reading the origin at 'pos' after 'from' is a seek */
+static inline bool is_seek(int64_t from, int64_t pos)
+{
+    return (pos < from) || (pos - from > BPAK_BSDIFF_SEEK_NEAR);
+}
+
+/* Extra bytes that a match at origin 'pos' has to save, the current origin
+ * read continues at 'scan' plus the last offset */
+static int64_t seek_penalty(const struct bpak_bsdiff_context *ctx,
+                            int64_t pos)
+{
+    if ((ctx->seek_cost == 0) ||
+        !is_seek(ctx->scan + ctx->last_offset, pos))
+        return 0;
+
+    return (int64_t)ctx->seek_cost;
+}
+
+/* An in place patch overwrites the origin as the output is written, the
+ * decoder only keeps the last half of its scratch buffer unwritten */
+static inline bool in_place_readable(const struct bpak_bsdiff_context *ctx,
+                                     int64_t pos)
+{
+    return (ctx->in_place_scratch == 0) ||
+           (pos >= ctx->scan - (int64_t)(ctx->in_place_scratch / 2));
+}
+
+/* Cost of a match at origin 'pos', -1 when it can't be used */
+static int64_t match_cost(const struct bpak_bsdiff_context *ctx, int64_t pos)
+{
+    if (!in_place_readable(ctx, pos))
+        return -1;
+
+    return seek_penalty(ctx, pos);
+}
+
+/* Suffixes that share at least 'len' bytes with 'to_p' are next to the
+ * match at 'index' in the suffix array. Returns the position of the one
+ * of them with the lowest match_cost, or -1 if none of them can be used. */
+static int64_t search_near(const struct bpak_bsdiff_context *ctx,
+                           const uint8_t *to_p, int64_t len, int64_t index,
+                           int64_t pos)
+{
+    int64_t from_size = (int64_t)ctx->origin_length;
+    int64_t best_cost = match_cost(ctx, pos);
+
+    if ((len == 0) || (best_cost == 0))
+        return pos;
+
+    if (best_cost < 0)
+        pos = -1;
+
+    for (int dir = -1; dir <= 1; dir += 2) {
+        for (int64_t i = 1; i <= BPAK_BSDIFF_SEEK_CANDIDATES; i++) {
+            int64_t x = index + dir * i;
+            int64_t x_pos;
+            int64_t cost;
+
+            if ((x < 0) || (x >= from_size))
+                break;
+
+            x_pos = sa_entry(ctx, x);
+
+            if ((from_size - x_pos < len) ||
+                (memcmp(ctx->origin_data + x_pos, to_p, len) != 0))
+                break;
+
+            cost = match_cost(ctx, x_pos);
+
+            if (cost == 0)
+                return x_pos;
+
+            if ((cost > 0) && ((best_cost < 0) || (cost < best_cost))) {
+                best_cost = cost;
+                pos = x_pos;
+            }
+        }
     }
+
+    return pos;
 }
 
 static void offtout(int64_t x, uint8_t *buf)
@@ -136,7 +301,67 @@ static void offtout(int64_t x, uint8_t *buf)
         buf[7] |= 0x80;
 }
 
+static int64_t offtin(uint8_t *buf)
+{
+    int64_t y;
+
+    y = buf[7] & 0x7F;
+    y = y * 256;
+    y += buf[6];
+    y = y * 256;
+    y += buf[5];
+    y = y * 256;
+    y += buf[4];
+    y = y * 256;
+    y += buf[3];
+    y = y * 256;
+    y += buf[2];
+    y = y * 256;
+    y += buf[1];
+    y = y * 256;
+    y += buf[0];
+
+    if (buf[7] & 0x80)
+        y = -y;
+
+    return y;
+}
+
+/* All patch output goes through here */
+static ssize_t bsdiff_write_output(struct bpak_bsdiff_context *ctx,
+                                   uint8_t *buffer, size_t length)
+{
+    BPAK_STATS_CLOCK(start);
+    ssize_t bytes_written = ctx->write_output(ctx->output_offset +
+                                                  ctx->output_pos,
+                                              buffer,
+                                              length,
+                                              ctx->user_priv);
+
+    BPAK_STATS_TIME(write_output_ns, start);
+    BPAK_STATS_ADD(write_output_calls, 1);
+    return bytes_written;
+}
+
 #if BPAK_CONFIG_LZMA == 1
+static lzma_vli lzma_bcj_filter_id(uint8_t bcj_filter)
+{
+    switch (bcj_filter) {
+    case BPAK_LZMA_BCJ_X86:
+        return LZMA_FILTER_X86;
+    case BPAK_LZMA_BCJ_ARM:
+        return LZMA_FILTER_ARM;
+    case BPAK_LZMA_BCJ_ARMTHUMB:
+        return LZMA_FILTER_ARMTHUMB;
+#ifdef LZMA_FILTER_ARM64
+    case BPAK_LZMA_BCJ_ARM64:
+        return LZMA_FILTER_ARM64;
+#endif
+    default:
+        return LZMA_VLI_UNKNOWN;
+    }
+}
+
 static int lzma_compressor_write(struct bpak_bsdiff_context *ctx,
                                  uint8_t *buffer, size_t length)
 {
@@ -160,11 +385,7 @@ static int lzma_compressor_write(struct bpak_bsdiff_context *ctx,
         }
 
         if (write_size > 0) {
-            ssize_t n_written =
-                ctx->write_output(ctx->output_offset + ctx->output_pos,
-                                  outbuf,
-                                  write_size,
-                                  ctx->user_priv);
+            ssize_t n_written = bsdiff_write_output(ctx, outbuf, write_size);
 
             if (n_written < 0)
                 return n_written;
@@ -203,11 +424,7 @@ static int lzma_compressor_final(struct bpak_bsdiff_context *ctx)
         ssize_t write_size = sizeof(outbuf) - strm->avail_out;
 
         if (write_size > 0) {
-            ssize_t n_written =
-                ctx->write_output(ctx->output_offset + ctx->output_pos,
-                                  outbuf,
-                                  write_size,
-                                  ctx->user_priv);
+            ssize_t n_written = bsdiff_write_output(ctx, outbuf, write_size);
 
             if (n_written < 0)
                 return n_written;
@@ -228,6 +445,43 @@ static int lzma_compressor_final(struct bpak_bsdiff_context *ctx)
 
 #endif // BPAK_CONFIG_LZMA
 
+#if BPAK_CONFIG_ZSTD == 1
+static int zstd_compressor_stream(struct bpak_bsdiff_context *ctx,
+                                  uint8_t *buffer, size_t length,
+                                  ZSTD_EndDirective mode)
+{
+    ZSTD_CCtx *cctx = (ZSTD_CCtx *)ctx->compressor_priv;
+    ZSTD_inBuffer in = { .src = buffer, .size = length, .pos = 0 };
+    uint8_t outbuf[BPAK_CHUNK_BUFFER_LENGTH];
+    size_t remaining;
+
+    do {
+        ZSTD_outBuffer out = { .dst = outbuf, .size = sizeof(outbuf), .pos = 0 };
+
+        remaining = ZSTD_compressStream2(cctx, &out, &in, mode);
+
+        if (ZSTD_isError(remaining)) {
+            bpak_printf(0, "zstd error %s\n", ZSTD_getErrorName(remaining));
+            return -BPAK_COMPRESSOR_ERROR;
+        }
+
+        if (out.pos > 0) {
+            ssize_t n_written = bsdiff_write_output(ctx, outbuf, out.pos);
+
+            if (n_written < 0)
+                return n_written;
+            if (n_written != (ssize_t)out.pos)
+                return -BPAK_WRITE_ERROR;
+
+            ctx->output_pos += n_written;
+        }
+        /* With ZSTD_e_end, 'remaining' is non zero until the frame is done */
+    } while ((in.pos < in.size) || ((mode == ZSTD_e_end) && (remaining != 0)));
+
+    return BPAK_OK;
+}
+#endif // BPAK_CONFIG_ZSTD
+
 static int hs_compressor_write(struct bpak_bsdiff_context *ctx, uint8_t *buffer,
                                size_t length)
 {
@@ -264,11 +518,7 @@ static int hs_compressor_write(struct bpak_bsdiff_context *ctx, uint8_t *buffer,
                 return -BPAK_COMPRESSOR_ERROR;
 
             if (poll_sz > 0) {
-                n_written =
-                    ctx->write_output(ctx->output_offset + ctx->output_pos,
-                                      output_buffer,
-                                      poll_sz,
-                                      ctx->user_priv);
+                n_written = bsdiff_write_output(ctx, output_buffer, poll_sz);
                 if (n_written < 0)
                     return n_written;
                 if (n_written != (ssize_t)poll_sz)
@@ -307,11 +557,7 @@ static int hs_compressor_final(struct bpak_bsdiff_context *ctx)
                 return -BPAK_COMPRESSOR_ERROR;
 
             if (poll_sz > 0) {
-                n_written =
-                    ctx->write_output(ctx->output_offset + ctx->output_pos,
-                                      output_buffer,
-                                      poll_sz,
-                                      ctx->user_priv);
+                n_written = bsdiff_write_output(ctx, output_buffer, poll_sz);
 
                 if (n_written < 0)
                     return n_written;
@@ -331,42 +577,151 @@ static int compressor_init(struct bpak_bsdiff_context *ctx)
     switch (ctx->compression) {
     case BPAK_COMPRESSION_NONE:
         break;
-    case BPAK_COMPRESSION_HS:
+    case BPAK_COMPRESSION_HS: {
+        const struct bpak_transport_heatshrink_params *params =
+            &ctx->heatshrink_params;
+        uint8_t window_bits = HEATSHRINK_STATIC_WINDOW_BITS;
+        uint8_t lookahead_bits = HEATSHRINK_STATIC_LOOKAHEAD_BITS;
+
+        if (params->window_bits != 0)
+            window_bits = params->window_bits;
+        if (params->lookahead_bits != 0)
+            lookahead_bits = params->lookahead_bits;
+
         ctx->compressor_priv = bpak_calloc(sizeof(heatshrink_encoder), 1);
 
         if (ctx->compressor_priv == NULL)
             return -BPAK_FAILED;
 
-        heatshrink_encoder_reset((heatshrink_encoder *)ctx->compressor_priv);
-        break;
+        if (heatshrink_encoder_reset_dynamic(
+                (heatshrink_encoder *)ctx->compressor_priv,
+                window_bits,
+                lookahead_bits) != 0) {
+            bpak_free(ctx->compressor_priv);
+            ctx->compressor_priv = NULL;
+            bpak_printf(0,
+                        "Error: Invalid heatshrink window %u/lookahead %u\n",
+                        window_bits,
+                        lookahead_bits);
+            return -BPAK_NOT_SUPPORTED;
+        }
+
+        bpak_printf(2,
+                    "heatshrink window %u, lookahead %u\n",
+                    window_bits,
+                    lookahead_bits);
+    } break;
 #if BPAK_CONFIG_LZMA == 1
     case BPAK_COMPRESSION_LZMA: {
+        const struct bpak_transport_lzma_params *params = &ctx->lzma_params;
         lzma_stream *stream;
-        stream = bpak_calloc(sizeof(lzma_stream), 1);
-        ctx->compressor_priv = stream;
-
+        lzma_filter filters[3];
         lzma_options_lzma opt_lzma2;
-        if (lzma_lzma_preset(&opt_lzma2, LZMA_PRESET_DEFAULT)) {
-            bpak_free(stream);
+        uint32_t preset = LZMA_PRESET_DEFAULT;
+        int n = 0;
+
+        if (params->preset > 0)
+            preset = params->preset - 1;
+
+        if (lzma_lzma_preset(&opt_lzma2, preset))
             return -BPAK_COMPRESSOR_ERROR;
+
+        if (params->dict_size > 0) {
+            if (params->dict_size < LZMA_DICT_SIZE_MIN)
+                return -BPAK_COMPRESSOR_ERROR;
+            opt_lzma2.dict_size = params->dict_size;
         }
 
-        lzma_filter filters[] = {
-            {.id = LZMA_FILTER_X86, .options = NULL},
-            {.id = LZMA_FILTER_LZMA2, .options = &opt_lzma2},
-            {.id = LZMA_VLI_UNKNOWN, .options = NULL},
-        };
+        if (params->bcj_filter != BPAK_LZMA_BCJ_NONE) {
+            filters[n].id = lzma_bcj_filter_id(params->bcj_filter);
+            filters[n++].options = NULL;
 
-        lzma_ret ret = lzma_stream_encoder(stream, filters, LZMA_CHECK_CRC64);
+            if (filters[0].id == LZMA_VLI_UNKNOWN) {
+                bpak_printf(0,
+                            "Error: Unsupported BCJ filter %u\n",
+                            params->bcj_filter);
+                return -BPAK_UNSUPPORTED_COMPRESSION;
+            }
+        }
 
-        if (ret != LZMA_OK)
-            return -BPAK_COMPRESSOR_ERROR;
+        filters[n].id = LZMA_FILTER_LZMA2;
+        filters[n++].options = &opt_lzma2;
+        filters[n].id = LZMA_VLI_UNKNOWN;
+        filters[n].options = NULL;
+
+        bpak_printf(2,
+                    "lzma: preset %u, dict size %u, bcj %u\n",
+                    preset,
+                    opt_lzma2.dict_size,
+                    params->bcj_filter);
+
+        stream = bpak_calloc(sizeof(lzma_stream), 1);
 
         if (stream == NULL)
             return -BPAK_FAILED;
 
+        ctx->compressor_priv = stream;
+
+        lzma_ret ret;
+
+        if (params->block_bits != 0) {
+            lzma_mt mt;
+
+            if ((params->block_bits < BPAK_LZMA_BLOCK_BITS_MIN) ||
+                (params->block_bits > BPAK_LZMA_BLOCK_BITS_MAX)) {
+                bpak_free(stream);
+                ctx->compressor_priv = NULL;
+                return -BPAK_COMPRESSOR_ERROR;
+            }
+
+            /* Multi-block stream, lzma_stream_decoder reads it as is */
+            memset(&mt, 0, sizeof(mt));
+            mt.threads = ctx->jobs;
+            mt.block_size = (uint64_t)1 << params->block_bits;
+            mt.filters = filters;
+            mt.check = LZMA_CHECK_CRC64;
+
+            bpak_printf(2,
+                        "lzma: %u threads, block size %llu\n",
+                        mt.threads,
+                        (unsigned long long)mt.block_size);
+
+            ret = lzma_stream_encoder_mt(stream, &mt);
+        } else {
+            ret = lzma_stream_encoder(stream, filters, LZMA_CHECK_CRC64);
+        }
+
+        if (ret != LZMA_OK) {
+            bpak_free(stream);
+            ctx->compressor_priv = NULL;
+            return -BPAK_COMPRESSOR_ERROR;
+        }
+
         stream->allocator = &lzma_alloc;
     } break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD: {
+        ZSTD_CCtx *cctx = ZSTD_createCCtx();
+
+        if (cctx == NULL)
+            return -BPAK_FAILED;
+
+        ctx->compressor_priv = cctx;
+
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx,
+                                                ZSTD_c_compressionLevel,
+                                                BPAK_ZSTD_LEVEL)) ||
+            ZSTD_isError(ZSTD_CCtx_setParameter(cctx,
+                                                ZSTD_c_windowLog,
+                                                BPAK_ZSTD_WINDOW_LOG)) ||
+            ZSTD_isError(
+                ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1))) {
+            ZSTD_freeCCtx(cctx);
+            ctx->compressor_priv = NULL;
+            return -BPAK_COMPRESSOR_ERROR;
+        }
+    } break;
 #endif
     default:
         return -BPAK_UNSUPPORTED_COMPRESSION;
@@ -375,16 +730,12 @@ static int compressor_init(struct bpak_bsdiff_context *ctx)
     return BPAK_OK;
 }
 
-static int compressor_write(struct bpak_bsdiff_context *ctx, uint8_t *buffer,
-                            size_t length)
+static int compressor_encode(struct bpak_bsdiff_context *ctx, uint8_t *buffer,
+                             size_t length)
 {
     switch (ctx->compression) {
     case BPAK_COMPRESSION_NONE: {
-        ssize_t bytes_written =
-            ctx->write_output(ctx->output_offset + ctx->output_pos,
-                              buffer,
-                              length,
-                              ctx->user_priv);
+        ssize_t bytes_written = bsdiff_write_output(ctx, buffer, length);
 
         if (bytes_written < 0)
             return bytes_written;
@@ -406,6 +757,11 @@ static int compressor_write(struct bpak_bsdiff_context *ctx, uint8_t *buffer,
     case BPAK_COMPRESSION_LZMA:
         return lzma_compressor_write(ctx, buffer, length);
         break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD:
+        return zstd_compressor_stream(ctx, buffer, length, ZSTD_e_continue);
+        break;
 #endif
     default:
         return -BPAK_UNSUPPORTED_COMPRESSION;
@@ -414,6 +770,16 @@ static int compressor_write(struct bpak_bsdiff_context *ctx, uint8_t *buffer,
     return BPAK_OK;
 }
 
+static int compressor_write(struct bpak_bsdiff_context *ctx, uint8_t *buffer,
+                            size_t length)
+{
+    BPAK_STATS_CLOCK(start);
+    int rc = compressor_encode(ctx, buffer, length);
+
+    BPAK_STATS_TIME(compress_ns, start);
+    return rc;
+}
+
 static int compressor_final(struct bpak_bsdiff_context *ctx)
 {
     switch (ctx->compression) {
@@ -426,6 +792,11 @@ static int compressor_final(struct bpak_bsdiff_context *ctx)
     case BPAK_COMPRESSION_LZMA:
         return lzma_compressor_final(ctx);
         break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD:
+        return zstd_compressor_stream(ctx, NULL, 0, ZSTD_e_end);
+        break;
 #endif
     default:
         return -BPAK_UNSUPPORTED_COMPRESSION;
@@ -447,6 +818,11 @@ static void compressor_free(struct bpak_bsdiff_context *ctx)
         lzma_end((lzma_stream *)ctx->compressor_priv);
         bpak_free(ctx->compressor_priv);
         break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD:
+        ZSTD_freeCCtx((ZSTD_CCtx *)ctx->compressor_priv);
+        break;
 #endif
     default:
         break;
@@ -455,6 +831,128 @@ static void compressor_free(struct bpak_bsdiff_context *ctx)
     ctx->compressor_priv = NULL;
 }
 
+static int write_ctrl(struct bpak_bsdiff_context *ctx, int64_t diff_size,
+                      int64_t extra_size, int64_t adjust)
+{
+    uint8_t buffer[24];
+
+    bpak_printf(2, "diff: %10li %10li %10li\n", diff_size, extra_size, adjust);
+
+    offtout(diff_size, &buffer[0]);
+    offtout(extra_size, &buffer[8]);
+    offtout(adjust, &buffer[16]);
+
+    BPAK_STATS_ADD(ctrl_blocks, 1);
+    BPAK_STATS_ADD(extra_bytes, extra_size);
+
+    if (is_seek(0, adjust)) {
+        ctx->origin_seeks++;
+        ctx->origin_seek_bytes += (adjust < 0) ? -adjust : adjust;
+
+        if (adjust < 0)
+            ctx->origin_backward_seeks++;
+    }
+
+    if (diff_size < 0)
+        BPAK_STATS_ADD(copy_bytes, -diff_size);
+    else
+        BPAK_STATS_ADD(diff_bytes, diff_size);
+
+    ctx->ctrl_pos = ctx->output_pos;
+    return compressor_write(ctx, buffer, sizeof(buffer));
+}
+
+/* Write 'length' diff bytes of the target at 'new_pos' against the origin
+ * at 'origin_pos' */
+static int write_diff(struct bpak_bsdiff_context *ctx, int64_t new_pos,
+                      int64_t origin_pos, int64_t length)
+{
+    int rc;
+    uint8_t buffer[BPAK_CHUNK_BUFFER_LENGTH];
+
+    while (length > 0) {
+        size_t chunk_len = BPAK_MIN((size_t)length, sizeof(buffer));
+
+        bsdiff_diff_bytes(buffer,
+                          &ctx->new_data[new_pos],
+                          &ctx->origin_data[origin_pos],
+                          chunk_len);
+
+        rc = compressor_write(ctx, buffer, chunk_len);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        new_pos += chunk_len;
+        origin_pos += chunk_len;
+        length -= chunk_len;
+    }
+
+    return BPAK_OK;
+}
+
+/* Split the diff into diff tuples and origin copy tuples, for runs that are
+ * unchanged. Only the last tuple has the extra data and the adjustment. */
+static int write_diff_with_copies(struct bpak_bsdiff_context *ctx,
+                                  int64_t new_pos, int64_t origin_pos,
+                                  int64_t diff_size, int64_t extra_size,
+                                  int64_t adjust)
+{
+    int rc;
+    int64_t start = 0; /* First diff byte that is not written */
+    int64_t i = 0;
+
+    while (i < diff_size) {
+        if (ctx->new_data[new_pos + i] != ctx->origin_data[origin_pos + i]) {
+            i++;
+            continue;
+        }
+
+        int64_t run = bsdiff_matchlen(&ctx->origin_data[origin_pos + i],
+                                      &ctx->new_data[new_pos + i],
+                                      diff_size - i);
+
+        if (run < BPAK_BSDIFF_COPY_MIN_LENGTH) {
+            i += run;
+            continue;
+        }
+
+        if (i > start) {
+            rc = write_ctrl(ctx, i - start, 0, 0);
+
+            if (rc == BPAK_OK)
+                rc = write_diff(ctx,
+                                new_pos + start,
+                                origin_pos + start,
+                                i - start);
+
+            if (rc != BPAK_OK)
+                return rc;
+        }
+
+        i += run;
+        start = i;
+
+        if (i == diff_size)
+            return write_ctrl(ctx, -run, extra_size, adjust);
+
+        rc = write_ctrl(ctx, -run, 0, 0);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    rc = write_ctrl(ctx, diff_size - start, extra_size, adjust);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    return write_diff(ctx,
+                      new_pos + start,
+                      origin_pos + start,
+                      diff_size - start);
+}
+
 static int write_diff_extra_and_adjustment(struct bpak_bsdiff_context *ctx)
 {
     int64_t s;
@@ -470,9 +968,8 @@ static int write_diff_extra_and_adjustment(struct bpak_bsdiff_context *ctx)
     int64_t i;
     int64_t last_scan;
     int64_t last_pos;
-    uint64_t chunk_len = 0;
+    int64_t adjust;
     int rc;
-    uint8_t buffer[BPAK_CHUNK_BUFFER_LENGTH];
 
     last_scan = ctx->last_scan;
     last_pos = ctx->last_pos;
@@ -543,44 +1040,25 @@ static int write_diff_extra_and_adjustment(struct bpak_bsdiff_context *ctx)
 
     extra_pos = (last_scan + diff_size);
     extra_size = (ctx->scan - lenb - extra_pos);
+    adjust = (ctx->pos - lenb) - (last_pos + diff_size);
+
+    if (ctx->revision >= BPAK_BSDIFF_REVISION_COPY) {
+        rc = write_diff_with_copies(ctx,
+                                    last_scan,
+                                    last_pos,
+                                    diff_size,
+                                    extra_size,
+                                    adjust);
+    } else {
+        rc = write_ctrl(ctx, diff_size, extra_size, adjust);
 
-    /* Write control data*/
-    bpak_printf(2,
-                "diff: %10li %10li %10li\n",
-                diff_size,
-                extra_size,
-                (ctx->pos - lenb) - (last_pos + diff_size));
-
-    offtout(diff_size, &buffer[0]);
-    offtout(extra_size, &buffer[8]);
-    offtout((ctx->pos - lenb) - (last_pos + diff_size), &buffer[16]);
-
-    rc = compressor_write(ctx, buffer, 24);
+        if (rc == BPAK_OK)
+            rc = write_diff(ctx, last_scan, last_pos, diff_size);
+    }
 
     if (rc != BPAK_OK)
         return rc;
 
-    /* Write diff data */
-    uint64_t data_to_write = diff_size;
-
-    i = 0;
-
-    while (data_to_write) {
-        chunk_len = BPAK_MIN(data_to_write, sizeof(buffer));
-
-        for (uint64_t n = 0; n < chunk_len; n++) {
-            buffer[n] =
-                (ctx->new_data[last_scan + i] - ctx->origin_data[last_pos + i]);
-            i++;
-        }
-
-        rc = compressor_write(ctx, buffer, chunk_len);
-
-        if (rc != BPAK_OK)
-            return rc;
-        data_to_write -= chunk_len;
-    }
-
     /* Extra data. */
     if (extra_size) {
         rc = compressor_write(ctx, &ctx->new_data[extra_pos], extra_size);
@@ -596,68 +1074,834 @@ static int write_diff_extra_and_adjustment(struct bpak_bsdiff_context *ctx)
     return BPAK_OK;
 }
 
-BPAK_EXPORT int bpak_bsdiff_init(struct bpak_bsdiff_context *ctx,
-                                 uint8_t *origin_data, size_t origin_length,
-                                 uint8_t *new_data, size_t new_length,
-                                 bpak_io_t write_output, off_t output_offset,
-                                 enum bpak_compression compression,
-                                 void *user_priv)
+/* On-disk suffix array cache, the header is followed by the suffix array */
+#define BSDIFF_SA_CACHE_MAGIC   0x41535042 /* 'BPSA' */
+#define BSDIFF_SA_CACHE_VERSION 1
+
+struct bsdiff_sa_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t origin_length;
+    uint32_t width;
+    uint8_t pad[44];
+} __attribute__((packed));
+
+static int suffix_array_load(struct bpak_bsdiff_context *ctx,
+                             const char *filename)
 {
-    int rc;
+    int rc = -BPAK_FAILED;
+    struct stat statbuf;
+    struct bsdiff_sa_cache_header *hdr;
+    uint8_t *map;
+    size_t map_size = sizeof(*hdr) + ctx->suffix_array_size;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return -BPAK_FILE_NOT_FOUND;
+
+    if (fstat(fd, &statbuf) != 0)
+        goto err_close_out;
+
+    if ((size_t)statbuf.st_size != map_size) {
+        bpak_printf(1, "Suffix array cache '%s' has wrong size\n", filename);
+        goto err_close_out;
+    }
 
-    memset(ctx, 0, sizeof(*ctx));
-    bpak_printf(2,
-                "bsdiff init: origin_length = %zu, target_length = %zu\n",
-                origin_length,
-                new_length);
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
 
-    ctx->write_output = write_output;
-    ctx->output_offset = output_offset;
-    ctx->user_priv = user_priv;
-    ctx->origin_length = origin_length;
-    ctx->origin_data = origin_data;
-    ctx->new_length = new_length;
-    ctx->new_data = new_data;
-    ctx->compression = compression;
+    if (((intptr_t)map) == -1) {
+        bpak_printf(0,
+                    "Error: Could not mmap suffix array cache (%s)\n",
+                    strerror(errno));
+        goto err_close_out;
+    }
 
-    rc = compressor_init(ctx);
+    hdr = (struct bsdiff_sa_cache_header *)map;
 
-    if (rc != BPAK_OK)
-        return rc;
+    if ((hdr->magic != BSDIFF_SA_CACHE_MAGIC) ||
+        (hdr->version != BSDIFF_SA_CACHE_VERSION) ||
+        (hdr->origin_length != ctx->origin_length) ||
+        (hdr->width != ctx->suffix_array_width)) {
+        bpak_printf(1, "Suffix array cache '%s' does not match\n", filename);
+        munmap(map, map_size);
+        goto err_close_out;
+    }
 
-    ctx->suffix_array = bpak_calloc(origin_length, sizeof(int64_t));
+    /* Every page of the cache is checked and searched, read it ahead */
+    (void)madvise(map, map_size, MADV_WILLNEED);
 
-    if (!ctx->suffix_array) {
-        rc = -BPAK_FAILED;
-        goto err_free_compressor_out;
+    /* The entries are used as origin offsets without further checks, a
+     * damaged cache is rebuilt instead */
+    ctx->suffix_array = map + sizeof(*hdr);
+
+    for (size_t i = 0; i < ctx->origin_length; i++) {
+        int64_t entry = sa_entry(ctx, i);
+
+        if ((entry < 0) || ((uint64_t)entry >= ctx->origin_length)) {
+            bpak_printf(1,
+                        "Suffix array cache '%s' is damaged\n",
+                        filename);
+            ctx->suffix_array = NULL;
+            munmap(map, map_size);
+            goto err_close_out;
+        }
+    }
+
+    ctx->suffix_array_map = map;
+    ctx->suffix_array_map_size = map_size;
+    rc = BPAK_OK;
+err_close_out:
+    close(fd);
+    return rc;
+}
+
+static int suffix_array_store(struct bpak_bsdiff_context *ctx,
+                              const char *filename)
+{
+    int rc = BPAK_OK;
+    struct bsdiff_sa_cache_header hdr;
+    char tmp_filename[1024];
+    FILE *fp;
+    static unsigned int tmp_counter;
+
+    /* Write to a temporary file and rename it so that a concurrent encoder
+     * never sees a partially written cache. The counter separates threads
+     * of the same process that store a cache for the same origin. */
+    if (snprintf(tmp_filename,
+                 sizeof(tmp_filename),
+                 "%s.%i.%u.tmp",
+                 filename,
+                 (int)getpid(),
+                 __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED)) >=
+        (int)sizeof(tmp_filename)) {
+        return -BPAK_SIZE_ERROR;
+    }
+
+    fp = fopen(tmp_filename, "wb");
+
+    if (fp == NULL) {
+        bpak_printf(0,
+                    "Error: Could not create '%s' (%s)\n",
+                    tmp_filename,
+                    strerror(errno));
+        return -BPAK_WRITE_ERROR;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = BSDIFF_SA_CACHE_MAGIC;
+    hdr.version = BSDIFF_SA_CACHE_VERSION;
+    hdr.origin_length = ctx->origin_length;
+    hdr.width = ctx->suffix_array_width;
+
+    if ((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ||
+        (fwrite(ctx->suffix_array, 1, ctx->suffix_array_size, fp) !=
+         ctx->suffix_array_size)) {
+        rc = -BPAK_WRITE_ERROR;
+    }
+
+    if (fclose(fp) != 0)
+        rc = -BPAK_WRITE_ERROR;
+
+    if ((rc == BPAK_OK) && (rename(tmp_filename, filename) != 0))
+        rc = -BPAK_WRITE_ERROR;
+
+    if (rc != BPAK_OK) {
+        bpak_printf(0, "Error: Could not write '%s'\n", filename);
+        unlink(tmp_filename);
+    }
+
+    return rc;
+}
+
+/* Anonymous mapping of 'length' bytes aligned to a huge page, the slack
+ * around the aligned range is unmapped again */
+static void *huge_page_map(size_t length, int flags)
+{
+    size_t align = BPAK_BSDIFF_HUGE_PAGE_SIZE;
+    uint8_t *map = mmap(NULL,
+                        length + align,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | flags,
+                        -1,
+                        0);
+    uint8_t *aligned;
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    aligned = (uint8_t *)(((uintptr_t)map + align - 1) & ~(align - 1));
+
+    if (aligned != map)
+        munmap(map, aligned - map);
+
+    munmap(aligned + length, (map + align) - aligned);
+
+    return aligned;
+}
+
+/* Zeroed memory for the suffix array of 'ctx', in huge pages when they are
+ * asked for */
+static void *suffix_array_alloc(struct bpak_bsdiff_context *ctx)
+{
+    size_t align = BPAK_BSDIFF_HUGE_PAGE_SIZE;
+    size_t length = (ctx->suffix_array_size + align - 1) & ~(align - 1);
+    void *mem = NULL;
+
+    ctx->suffix_array_mem_size = 0;
+
+#ifdef MAP_HUGETLB
+    /* The pool pages are mapped at once, the length must be a multiple of
+     * the huge page size */
+    if (ctx->pages == BPAK_BSDIFF_PAGES_HUGETLB) {
+        mem = mmap(NULL,
+                   length,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                   -1,
+                   0);
+
+        if (mem == MAP_FAILED) {
+            bpak_printf(1,
+                        "No huge pages for the suffix array (%s), using "
+                        "transparent huge pages\n",
+                        strerror(errno));
+            mem = NULL;
+        }
+    }
+#endif
+
+    if ((mem == NULL) && (ctx->pages != BPAK_BSDIFF_PAGES_DEFAULT)) {
+        mem = huge_page_map(length, 0);
+#ifdef MADV_HUGEPAGE
+        if ((mem != NULL) && (madvise(mem, length, MADV_HUGEPAGE) != 0))
+            bpak_printf(1,
+                        "No transparent huge pages for the suffix array "
+                        "(%s)\n",
+                        strerror(errno));
+#endif
+    }
+
+    if (mem != NULL) {
+        ctx->suffix_array_mem_size = length;
+        return mem;
     }
 
+    return bpak_calloc(ctx->origin_length, ctx->suffix_array_width);
+}
+
+static void suffix_array_release(void *suffix_array, size_t mem_size)
+{
+    if (mem_size > 0)
+        munmap(suffix_array, mem_size);
+    else
+        bpak_free(suffix_array);
+}
+
+static int suffix_array_build(struct bpak_bsdiff_context *ctx)
+{
+    int rc;
+
+    ctx->suffix_array = suffix_array_alloc(ctx);
+
+    if (!ctx->suffix_array)
+        return -BPAK_FAILED;
+
     bpak_printf(2,
-                "Initializing sais array: %p %p %zu\n",
+                "Initializing sais array: %p %p %zu (%zu-bit)\n",
                 ctx->origin_data,
                 ctx->suffix_array,
-                origin_length);
+                ctx->origin_length,
+                ctx->suffix_array_width * 8);
+
+    BPAK_TRACE2(sais__start, ctx->origin_length, ctx->suffix_array_width);
+
+    if (ctx->suffix_array_width == sizeof(int32_t))
+        rc = sais32(ctx->origin_data, ctx->suffix_array, ctx->origin_length);
+    else
+        rc = sais(ctx->origin_data, ctx->suffix_array, ctx->origin_length);
 
-    rc = sais(ctx->origin_data, ctx->suffix_array, origin_length);
+    BPAK_TRACE2(sais__done, ctx->origin_length, rc);
 
     if (rc != 0) {
         bpak_printf(0, "SAIS computation failed (%i)\n", rc);
-        rc = -BPAK_FAILED;
-        goto err_free_suffix_array_out;
+        suffix_array_release(ctx->suffix_array, ctx->suffix_array_mem_size);
+        ctx->suffix_array = NULL;
+        return -BPAK_FAILED;
     }
 
-    bpak_printf(2, "Init done\n");
     return BPAK_OK;
+}
+
+static void suffix_array_free(struct bpak_bsdiff_context *ctx)
+{
+    /* A shared origin index belongs to its struct bpak_bsdiff_origin */
+    if (ctx->origin != NULL) {
+        ctx->suffix_array = NULL;
+        ctx->prefix_index = NULL;
+        return;
+    }
+
+    if (ctx->suffix_array_map != NULL) {
+        munmap(ctx->suffix_array_map, ctx->suffix_array_map_size);
+        ctx->suffix_array_map = NULL;
+    } else if (ctx->suffix_array != NULL) {
+        suffix_array_release(ctx->suffix_array, ctx->suffix_array_mem_size);
+    }
 
-err_free_suffix_array_out:
-    bpak_free(ctx->suffix_array);
     ctx->suffix_array = NULL;
+    ctx->suffix_array_mem_size = 0;
+
+    if (ctx->prefix_index != NULL) {
+        bpak_free(ctx->prefix_index);
+        ctx->prefix_index = NULL;
+    }
+}
+
+/* Content-defined chunks of the origin anchor the windows of the windowed
+ * diff, each target segment gets the window that holds most of its
+ * chunks */
+#define BSDIFF_ANCHOR_MIN_SIZE 1024
+#define BSDIFF_ANCHOR_AVG_BITS 12
+#define BSDIFF_ANCHOR_MAX_SIZE (32 * 1024)
+
+/* Heap per window byte, the 32-bit suffix array and the buffered patch of
+ * a segment of half the window, which grows by doubling */
+#define BSDIFF_WINDOW_COST (sizeof(int32_t) + 2)
+
+struct bsdiff_anchor {
+    uint64_t key;
+    uint64_t pos;    /* Origin offset, or target offset of a segment hit */
+    uint64_t length; /* Chunk length */
+};
+
+static int anchor_compare(const void *a_p, const void *b_p)
+{
+    const struct bsdiff_anchor *a = (const struct bsdiff_anchor *)a_p;
+    const struct bsdiff_anchor *b = (const struct bsdiff_anchor *)b_p;
+
+    if (a->key != b->key)
+        return (a->key < b->key) ? -1 : 1;
+
+    return (a->pos < b->pos) ? -1 : (a->pos > b->pos);
+}
+
+static int anchor_pos_compare(const void *a_p, const void *b_p)
+{
+    const struct bsdiff_anchor *a = (const struct bsdiff_anchor *)a_p;
+    const struct bsdiff_anchor *b = (const struct bsdiff_anchor *)b_p;
+
+    return (a->pos < b->pos) ? -1 : (a->pos > b->pos);
+}
+
+/* FNV-1a of the chunk */
+static uint64_t anchor_key(const uint8_t *data, size_t length)
+{
+    uint64_t key = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < length; i++) {
+        key ^= data[i];
+        key *= 0x100000001b3ULL;
+    }
+
+    return key;
+}
+
+/* Split 'data' into anchor chunks, '*anchors' grows by doubling. Returns
+ * the number of chunks or a negative number. */
+static ssize_t anchor_split(const uint8_t *data, size_t length,
+                            struct bsdiff_anchor **anchors,
+                            size_t *capacity)
+{
+    int rc;
+    struct chunker chunker;
+    size_t count = 0;
+    size_t pos = 0;
+
+    rc = chunker_init(&chunker,
+                      BSDIFF_ANCHOR_MIN_SIZE,
+                      BSDIFF_ANCHOR_AVG_BITS,
+                      BSDIFF_ANCHOR_MAX_SIZE);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    while (pos < length) {
+        size_t start = pos;
+        bool cut = false;
+
+        while (!cut && (pos < length))
+            pos += chunker_scan(&chunker, &data[pos], length - pos, &cut);
+
+        if (count == *capacity) {
+            size_t new_capacity = *capacity ? (*capacity * 2) : 1024;
+            struct bsdiff_anchor *new_anchors =
+                bpak_calloc(new_capacity, sizeof(*new_anchors));
+
+            if (new_anchors == NULL)
+                return -BPAK_FAILED;
+
+            if (*anchors != NULL) {
+                memcpy(new_anchors, *anchors, count * sizeof(*new_anchors));
+                bpak_free(*anchors);
+            }
+
+            *anchors = new_anchors;
+            *capacity = new_capacity;
+        }
+
+        (*anchors)[count].key = anchor_key(&data[start], pos - start);
+        (*anchors)[count].pos = start;
+        (*anchors)[count].length = pos - start;
+        count++;
+    }
+
+    return count;
+}
+
+static int window_index_init(struct bpak_bsdiff_context *ctx)
+{
+    struct bsdiff_anchor *anchors = NULL;
+    size_t capacity = 0;
+    ssize_t count;
+
+    count = anchor_split(ctx->origin_data,
+                         ctx->origin_length,
+                         &anchors,
+                         &capacity);
+
+    if (count < 0) {
+        bpak_free(anchors);
+        return count;
+    }
+
+    qsort(anchors, count, sizeof(*anchors), anchor_compare);
+
+    ctx->window_index = anchors;
+    ctx->window_index_count = count;
+    return BPAK_OK;
+}
+
+/* First origin chunk with the same content as the target chunk, or NULL */
+static const struct bsdiff_anchor *
+window_index_find(const struct bpak_bsdiff_context *ctx,
+                  const struct bsdiff_anchor *chunk, const uint8_t *data)
+{
+    const struct bsdiff_anchor *anchors = ctx->window_index;
+    size_t lo = 0;
+    size_t hi = ctx->window_index_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (anchors[mid].key < chunk->key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; (lo < ctx->window_index_count) && (anchors[lo].key == chunk->key);
+         lo++) {
+        if ((anchors[lo].length == chunk->length) &&
+            (memcmp(&ctx->origin_data[anchors[lo].pos],
+                    data,
+                    chunk->length) == 0))
+            return &anchors[lo];
+    }
+
+    return NULL;
+}
+
+/* Origin offset of the window for the target segment at 'start'. The
+ * window covers the largest amount of segment chunks that are found in
+ * the origin, segments without any are placed at the same relative
+ * position in the origin. */
+static int window_pick(const struct bpak_bsdiff_context *ctx, size_t start,
+                       size_t length, size_t *window_start)
+{
+    struct bsdiff_anchor *hits = NULL;
+    size_t capacity = 0;
+    size_t no_of_hits = 0;
+    uint64_t best_weight = 0;
+    uint64_t best_start = 0;
+    uint64_t best_end = 0;
+    uint64_t weight = 0;
+    uint64_t max_start = ctx->origin_length - ctx->window_size;
+    ssize_t count;
+
+    count = anchor_split(&ctx->new_data[start], length, &hits, &capacity);
+
+    if (count < 0) {
+        bpak_free(hits);
+        return count;
+    }
+
+    /* Keep the hits, with their origin offset */
+    for (ssize_t i = 0; i < count; i++) {
+        const uint8_t *data = &ctx->new_data[start + hits[i].pos];
+        const struct bsdiff_anchor *anchor =
+            window_index_find(ctx, &hits[i], data);
+
+        if (anchor != NULL)
+            hits[no_of_hits++] = *anchor;
+    }
+
+    qsort(hits, no_of_hits, sizeof(*hits), anchor_pos_compare);
+
+    for (size_t first = 0, last = 0; last < no_of_hits; last++) {
+        weight += hits[last].length;
+
+        while (hits[last].pos + hits[last].length >
+               hits[first].pos + ctx->window_size) {
+            weight -= hits[first].length;
+            first++;
+        }
+
+        if (weight > best_weight) {
+            best_weight = weight;
+            best_start = hits[first].pos;
+            best_end = hits[last].pos + hits[last].length;
+        }
+    }
+
+    bpak_free(hits);
+
+    if (best_weight > 0) {
+        /* Center the hits in the window */
+        uint64_t slack = ctx->window_size - (best_end - best_start);
+
+        best_start -= BPAK_MIN(best_start, slack / 2);
+    } else {
+        double center = (start + length / 2.0) * ctx->origin_length /
+                        ctx->new_length;
+
+        best_start = (uint64_t)center;
+        best_start -= BPAK_MIN(best_start, ctx->window_size / 2);
+    }
+
+    *window_start = BPAK_MIN(best_start, max_start);
+
+    bpak_printf(2,
+                "bsdiff: segment at %zu, %zu of %zu chunks, window at "
+                "%zu\n",
+                start,
+                no_of_hits,
+                (size_t)count,
+                *window_start);
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT size_t bpak_bsdiff_window_size(size_t origin_length,
+                                           size_t memory_budget)
+{
+    size_t width = (origin_length < INT32_MAX) ? sizeof(int32_t) :
+                                                 sizeof(int64_t);
+    size_t index_size = (origin_length >> BSDIFF_ANCHOR_AVG_BITS) * 2 *
+                        sizeof(struct bsdiff_anchor);
+    size_t window_size = BPAK_BSDIFF_MIN_WINDOW_SIZE;
+
+    if (origin_length <= memory_budget / width)
+        return 0;
+
+    if ((memory_budget > index_size) &&
+        ((memory_budget - index_size) / BSDIFF_WINDOW_COST > window_size))
+        window_size = (memory_budget - index_size) / BSDIFF_WINDOW_COST;
+
+    if (window_size >= origin_length)
+        return 0;
+
+    return window_size;
+}
+
+/* Build the suffix array and prefix index of the origin of 'ctx', or load
+ * the suffix array from 'cache_filename' */
+static int suffix_array_prepare(struct bpak_bsdiff_context *ctx,
+                                const char *cache_filename)
+{
+    int rc;
+
+    /* A 32-bit suffix array halves the memory needed for the index and is
+     * used whenever all origin offsets fit */
+    if (ctx->origin_length < INT32_MAX)
+        ctx->suffix_array_width = sizeof(int32_t);
+    else
+        ctx->suffix_array_width = sizeof(int64_t);
+
+    ctx->suffix_array_size = ctx->origin_length * ctx->suffix_array_width;
+    BPAK_STATS_CLOCK(sort_start);
+
+    if ((cache_filename != NULL) &&
+        (suffix_array_load(ctx, cache_filename) == BPAK_OK)) {
+        bpak_printf(1, "Using suffix array cache '%s'\n", cache_filename);
+    } else {
+        rc = suffix_array_build(ctx);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        /* The cache only saves time, the diff can proceed without it */
+        if (cache_filename != NULL)
+            (void)suffix_array_store(ctx, cache_filename);
+    }
+
+    BPAK_STATS_TIME(suffix_sort_ns, sort_start);
+
+    rc = prefix_index_init(ctx);
+
+    if (rc != BPAK_OK)
+        suffix_array_free(ctx);
+
+    return rc;
+}
+
+/* Everything of the init except for the origin index */
+static int bsdiff_setup(struct bpak_bsdiff_context *ctx, uint8_t *origin_data,
+                        size_t origin_length, uint8_t *new_data,
+                        size_t new_length, bpak_io_t write_output,
+                        off_t output_offset, enum bpak_compression compression,
+                        const struct bpak_bsdiff_options *options,
+                        void *user_priv)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    bpak_printf(2,
+                "bsdiff init: origin_length = %zu, target_length = %zu\n",
+                origin_length,
+                new_length);
+
+    ctx->write_output = write_output;
+    ctx->output_offset = output_offset;
+    ctx->user_priv = user_priv;
+    ctx->origin_length = origin_length;
+    ctx->origin_data = origin_data;
+    ctx->new_length = new_length;
+    ctx->new_data = new_data;
+    ctx->compression = compression;
+    ctx->jobs = 1;
+
+    if (options != NULL) {
+        if (options->jobs > 0)
+            ctx->jobs = options->jobs;
+        if (options->lzma_params != NULL)
+            ctx->lzma_params = *options->lzma_params;
+        if (options->heatshrink_params != NULL)
+            ctx->heatshrink_params = *options->heatshrink_params;
+        ctx->revision = options->revision;
+        ctx->window_size = options->window_size;
+        ctx->seek_cost = options->seek_cost;
+        ctx->in_place_scratch = options->in_place_scratch;
+        ctx->pages = options->pages;
+    }
+
+    if (ctx->window_size >= origin_length)
+        ctx->window_size = 0;
+
+    /* Window positions are not the positions of the output */
+    if ((ctx->in_place_scratch != 0) && (ctx->window_size != 0))
+        return -BPAK_NOT_SUPPORTED;
+
+    if ((ctx->window_size != 0) &&
+        (ctx->window_size < BPAK_BSDIFF_MIN_WINDOW_SIZE))
+        return -BPAK_SIZE_ERROR;
+
+    bsdiff_simd_init();
+
+    return compressor_init(ctx);
+}
+
+BPAK_EXPORT int
+bpak_bsdiff_init_opts(struct bpak_bsdiff_context *ctx, uint8_t *origin_data,
+                      size_t origin_length, uint8_t *new_data,
+                      size_t new_length, bpak_io_t write_output,
+                      off_t output_offset, enum bpak_compression compression,
+                      const struct bpak_bsdiff_options *options,
+                      void *user_priv)
+{
+    int rc;
+
+    rc = bsdiff_setup(ctx,
+                      origin_data,
+                      origin_length,
+                      new_data,
+                      new_length,
+                      write_output,
+                      output_offset,
+                      compression,
+                      options,
+                      user_priv);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    /* The suffix arrays of the windows are built by bpak_bsdiff */
+    if (ctx->window_size != 0) {
+        rc = window_index_init(ctx);
+
+        if (rc != BPAK_OK)
+            goto err_free_compressor_out;
+
+        bpak_printf(1,
+                    "bsdiff: %zu origin chunks, windows of %zu bytes\n",
+                    ctx->window_index_count,
+                    ctx->window_size);
+        return BPAK_OK;
+    }
+
+    rc = suffix_array_prepare(ctx,
+                              (options != NULL) ? options->cache_filename
+                                                : NULL);
+
+    if (rc != BPAK_OK)
+        goto err_free_compressor_out;
+
+    bpak_printf(2, "Init done\n");
+    return BPAK_OK;
+
 err_free_compressor_out:
     compressor_free(ctx);
     return rc;
 }
 
-BPAK_EXPORT ssize_t bpak_bsdiff(struct bpak_bsdiff_context *ctx)
+BPAK_EXPORT int bpak_bsdiff_origin_init(struct bpak_bsdiff_origin *origin,
+                                        uint8_t *origin_data,
+                                        size_t origin_length,
+                                        const char *cache_filename)
+{
+    struct bpak_bsdiff_options options = {
+        .cache_filename = cache_filename,
+    };
+
+    return bpak_bsdiff_origin_init_opts(origin,
+                                        origin_data,
+                                        origin_length,
+                                        &options);
+}
+
+BPAK_EXPORT int
+bpak_bsdiff_origin_init_opts(struct bpak_bsdiff_origin *origin,
+                             uint8_t *origin_data, size_t origin_length,
+                             const struct bpak_bsdiff_options *options)
+{
+    int rc;
+    struct bpak_bsdiff_context ctx;
+
+    memset(origin, 0, sizeof(*origin));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.origin_data = origin_data;
+    ctx.origin_length = origin_length;
+
+    if (options != NULL)
+        ctx.pages = options->pages;
+
+    rc = suffix_array_prepare(&ctx,
+                              (options != NULL) ? options->cache_filename
+                                                : NULL);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    origin->data = origin_data;
+    origin->length = origin_length;
+    origin->suffix_array = ctx.suffix_array;
+    origin->suffix_array_size = ctx.suffix_array_size;
+    origin->suffix_array_width = ctx.suffix_array_width;
+    origin->suffix_array_map = ctx.suffix_array_map;
+    origin->suffix_array_map_size = ctx.suffix_array_map_size;
+    origin->suffix_array_mem_size = ctx.suffix_array_mem_size;
+    origin->prefix_index = ctx.prefix_index;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT void bpak_bsdiff_origin_free(struct bpak_bsdiff_origin *origin)
+{
+    struct bpak_bsdiff_context ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.suffix_array = origin->suffix_array;
+    ctx.suffix_array_map = origin->suffix_array_map;
+    ctx.suffix_array_map_size = origin->suffix_array_map_size;
+    ctx.suffix_array_mem_size = origin->suffix_array_mem_size;
+    ctx.prefix_index = origin->prefix_index;
+    suffix_array_free(&ctx);
+    memset(origin, 0, sizeof(*origin));
+}
+
+BPAK_EXPORT int
+bpak_bsdiff_init_origin(struct bpak_bsdiff_context *ctx,
+                        const struct bpak_bsdiff_origin *origin,
+                        uint8_t *new_data, size_t new_length,
+                        bpak_io_t write_output, off_t output_offset,
+                        enum bpak_compression compression,
+                        const struct bpak_bsdiff_options *options,
+                        void *user_priv)
+{
+    int rc;
+    struct bpak_bsdiff_options opts;
+
+    /* The index of the whole origin is already there */
+    if (options != NULL)
+        opts = *options;
+    else
+        memset(&opts, 0, sizeof(opts));
+
+    opts.window_size = 0;
+
+    rc = bsdiff_setup(ctx,
+                      origin->data,
+                      origin->length,
+                      new_data,
+                      new_length,
+                      write_output,
+                      output_offset,
+                      compression,
+                      &opts,
+                      user_priv);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    ctx->origin = origin;
+    ctx->suffix_array = origin->suffix_array;
+    ctx->suffix_array_size = origin->suffix_array_size;
+    ctx->suffix_array_width = origin->suffix_array_width;
+    ctx->prefix_index = origin->prefix_index;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_bsdiff_init(struct bpak_bsdiff_context *ctx,
+                                 uint8_t *origin_data, size_t origin_length,
+                                 uint8_t *new_data, size_t new_length,
+                                 bpak_io_t write_output, off_t output_offset,
+                                 enum bpak_compression compression,
+                                 void *user_priv)
+{
+    return bpak_bsdiff_init_opts(ctx,
+                                 origin_data,
+                                 origin_length,
+                                 new_data,
+                                 new_length,
+                                 write_output,
+                                 output_offset,
+                                 compression,
+                                 NULL,
+                                 user_priv);
+}
+
+/* Number of bytes at 'scan' that are equal to the origin at the offset of
+ * the last match */
+static int64_t fast_path_run(const struct bpak_bsdiff_context *ctx)
+{
+    int64_t origin_pos = ctx->scan + ctx->last_offset;
+
+    if ((origin_pos < 0) || (origin_pos >= (int64_t)ctx->origin_length))
+        return 0;
+
+    return bsdiff_matchlen(ctx->origin_data + origin_pos,
+                           ctx->new_data + ctx->scan,
+                           BPAK_MIN((int64_t)ctx->origin_length - origin_pos,
+                                    (int64_t)ctx->new_length - ctx->scan));
+}
+
+static int bsdiff_scan(struct bpak_bsdiff_context *ctx)
 {
     int rc;
 
@@ -669,14 +1913,37 @@ BPAK_EXPORT ssize_t bpak_bsdiff(struct bpak_bsdiff_context *ctx)
         for (int64_t scsc = ctx->scan; ctx->scan < (int64_t)ctx->new_length;
              ctx->scan++) {
 
-            ctx->len = search(ctx->suffix_array,
-                              ctx->origin_data,
-                              ctx->origin_length,
-                              ctx->new_data + ctx->scan,
-                              ctx->new_length - ctx->scan,
-                              0,
-                              ctx->origin_length,
-                              &(ctx->pos));
+            int64_t run = fast_path_run(ctx);
+
+            /* Long runs that match at the current offset are taken as they
+             * are, only changed regions go through the suffix search */
+            if (run >= BPAK_BSDIFF_FAST_PATH_MIN_LENGTH) {
+                ctx->len = run;
+                ctx->pos = ctx->scan + ctx->last_offset;
+            } else {
+                int64_t index;
+
+                BPAK_STATS_CLOCK(search_start);
+                ctx->len = search(ctx,
+                                  ctx->new_data + ctx->scan,
+                                  ctx->new_length - ctx->scan,
+                                  &(ctx->pos),
+                                  &index);
+                ctx->pos = search_near(ctx,
+                                       ctx->new_data + ctx->scan,
+                                       ctx->len,
+                                       index,
+                                       ctx->pos);
+
+                /* No match that an in place patch may read, diff against
+                 * the current offset */
+                if (ctx->pos < 0) {
+                    ctx->len = 0;
+                    ctx->pos = ctx->scan + ctx->last_offset;
+                }
+                BPAK_STATS_TIME(search_ns, search_start);
+                BPAK_STATS_ADD(searches, 1);
+            }
 
             for (; scsc < ctx->scan + ctx->len; scsc++) {
                 if ((scsc + ctx->last_offset < (int64_t)ctx->origin_length) &&
@@ -686,8 +1953,9 @@ BPAK_EXPORT ssize_t bpak_bsdiff(struct bpak_bsdiff_context *ctx)
                 }
             }
 
+            /* A match that seeks in the origin has to be worth it */
             if (((ctx->len == from_score) && (ctx->len != 0)) ||
-                (ctx->len > from_score + 8)) {
+                (ctx->len > from_score + 8 + seek_penalty(ctx, ctx->pos))) {
                 break;
             }
 
@@ -708,7 +1976,312 @@ BPAK_EXPORT ssize_t bpak_bsdiff(struct bpak_bsdiff_context *ctx)
         }
     }
 
+    return BPAK_OK;
+}
+
+/* One contiguous range of the target, diffed by a worker thread into an
+ * uncompressed patch stream in memory */
+struct bsdiff_segment {
+    struct bpak_bsdiff_context ctx;
+    pthread_t thread;
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    int rc;
+};
+
+static ssize_t segment_write_output(off_t offset, uint8_t *buffer,
+                                    size_t length, void *user_priv)
+{
+    struct bsdiff_segment *seg = (struct bsdiff_segment *)user_priv;
+
+    if ((offset + length) > seg->capacity) {
+        size_t new_capacity = seg->capacity ? seg->capacity : 64 * 1024;
+
+        while (new_capacity < (offset + length))
+            new_capacity *= 2;
+
+        uint8_t *new_data = bpak_calloc(new_capacity, 1);
+
+        if (new_data == NULL)
+            return -BPAK_FAILED;
+
+        if (seg->data != NULL) {
+            memcpy(new_data, seg->data, seg->length);
+            bpak_free(seg->data);
+        }
+
+        seg->data = new_data;
+        seg->capacity = new_capacity;
+    }
+
+    memcpy(&seg->data[offset], buffer, length);
+
+    if ((offset + length) > seg->length)
+        seg->length = offset + length;
+
+    return length;
+}
+
+static void *segment_worker(void *arg)
+{
+    struct bsdiff_segment *seg = (struct bsdiff_segment *)arg;
+
+    seg->rc = bsdiff_scan(&seg->ctx);
+
+    return NULL;
+}
+
+static int bsdiff_parallel(struct bpak_bsdiff_context *ctx)
+{
+    int rc = BPAK_OK;
+    struct bsdiff_segment *segments;
+    size_t no_of_segments = ctx->jobs;
+    size_t segment_length;
+    unsigned int started = 0;
+
+    if (ctx->new_length / no_of_segments < BPAK_BSDIFF_MIN_SEGMENT_LENGTH)
+        no_of_segments = ctx->new_length / BPAK_BSDIFF_MIN_SEGMENT_LENGTH;
+
+    if (no_of_segments <= 1)
+        return bsdiff_scan(ctx);
+
+    segment_length = (ctx->new_length + no_of_segments - 1) / no_of_segments;
+    segments = bpak_calloc(no_of_segments, sizeof(*segments));
+
+    if (segments == NULL)
+        return -BPAK_FAILED;
+
+    bpak_printf(1,
+                "bsdiff: %zu segments of %zu bytes\n",
+                no_of_segments,
+                segment_length);
+
+    /* Every segment is diffed as if it was a separate target, starting at
+     * origin position zero. The segment streams are stitched together by
+     * adjusting the last control tuple of each segment so that the origin
+     * position is rewound to zero before the next segment starts. */
+    for (size_t i = 0; i < no_of_segments; i++) {
+        struct bsdiff_segment *seg = &segments[i];
+        size_t start = i * segment_length;
+
+        seg->ctx.origin_data = ctx->origin_data;
+        seg->ctx.origin_length = ctx->origin_length;
+        seg->ctx.suffix_array = ctx->suffix_array;
+        seg->ctx.suffix_array_size = ctx->suffix_array_size;
+        seg->ctx.suffix_array_width = ctx->suffix_array_width;
+        seg->ctx.prefix_index = ctx->prefix_index;
+        seg->ctx.new_data = ctx->new_data + start;
+        seg->ctx.new_length = BPAK_MIN(segment_length, ctx->new_length - start);
+        seg->ctx.write_output = segment_write_output;
+        seg->ctx.compression = BPAK_COMPRESSION_NONE;
+        seg->ctx.revision = ctx->revision;
+        seg->ctx.seek_cost = ctx->seek_cost;
+        seg->ctx.jobs = 1;
+        seg->ctx.user_priv = seg;
+
+        if (pthread_create(&seg->thread, NULL, segment_worker, seg) != 0) {
+            bpak_printf(0, "Error: Could not create bsdiff thread\n");
+            rc = -BPAK_FAILED;
+            break;
+        }
+
+        started++;
+    }
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(segments[i].thread, NULL);
+
+        if ((rc == BPAK_OK) && (segments[i].rc != BPAK_OK))
+            rc = segments[i].rc;
+    }
+
+    if (rc != BPAK_OK)
+        goto err_free_segments_out;
+
+    for (size_t i = 0; i < no_of_segments; i++) {
+        struct bsdiff_segment *seg = &segments[i];
+
+#if BPAK_CONFIG_STATS == 1
+        /* The segment output is only buffered, it is compressed here */
+        ctx->stats.ctrl_blocks += seg->ctx.stats.ctrl_blocks;
+        ctx->stats.diff_bytes += seg->ctx.stats.diff_bytes;
+        ctx->stats.extra_bytes += seg->ctx.stats.extra_bytes;
+        ctx->stats.copy_bytes += seg->ctx.stats.copy_bytes;
+        ctx->stats.searches += seg->ctx.stats.searches;
+        ctx->stats.search_ns += seg->ctx.stats.search_ns;
+#endif
+        ctx->origin_seeks += seg->ctx.origin_seeks;
+        ctx->origin_backward_seeks += seg->ctx.origin_backward_seeks;
+        ctx->origin_seek_bytes += seg->ctx.origin_seek_bytes;
+
+        if (i < (no_of_segments - 1)) {
+            uint8_t *adjust = &seg->data[seg->ctx.ctrl_pos + 16];
+            offtout(offtin(adjust) - seg->ctx.last_pos, adjust);
+        }
+
+        rc = compressor_write(ctx, seg->data, seg->length);
+
+        if (rc != BPAK_OK)
+            goto err_free_segments_out;
+
+        bpak_free(seg->data);
+        seg->data = NULL;
+    }
+
+    ctx->scan = ctx->new_length;
+
+err_free_segments_out:
+    for (size_t i = 0; i < no_of_segments; i++) {
+        if (segments[i].data != NULL)
+            bpak_free(segments[i].data);
+    }
+
+    bpak_free(segments);
+    return rc;
+}
+
+/* Diff target segments of half the window size one at a time, each against
+ * its own origin window. The segments are stitched like the parallel ones,
+ * but the last control tuple of a segment moves the origin position to the
+ * window of the next segment. */
+static int bsdiff_windowed(struct bpak_bsdiff_context *ctx)
+{
+    int rc = BPAK_OK;
+    size_t segment_length = ctx->window_size / 2;
+    size_t no_of_segments =
+        (ctx->new_length + segment_length - 1) / segment_length;
+    size_t *windows = bpak_calloc(no_of_segments + 1, sizeof(*windows));
+    struct bsdiff_segment seg;
+
+    if (windows == NULL)
+        return -BPAK_FAILED;
+
+    memset(&seg, 0, sizeof(seg));
+
+    bpak_printf(1,
+                "bsdiff: %zu segments of %zu bytes, origin windows of %zu "
+                "bytes\n",
+                no_of_segments,
+                segment_length,
+                ctx->window_size);
+
+    for (size_t i = 0; i < no_of_segments; i++) {
+        size_t start = i * segment_length;
+
+        rc = window_pick(ctx,
+                         start,
+                         BPAK_MIN(segment_length, ctx->new_length - start),
+                         &windows[i]);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+    }
+
+    /* The patch stream starts at origin position zero */
+    if (windows[0] != 0) {
+        rc = write_ctrl(ctx, 0, 0, windows[0]);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+    }
+
+    for (size_t i = 0; i < no_of_segments; i++) {
+        struct bpak_bsdiff_context *seg_ctx = &seg.ctx;
+        size_t start = i * segment_length;
+
+        memset(seg_ctx, 0, sizeof(*seg_ctx));
+        seg.length = 0;
+
+        seg_ctx->origin_data = ctx->origin_data + windows[i];
+        seg_ctx->origin_length = ctx->window_size;
+        seg_ctx->suffix_array_width = (ctx->window_size < INT32_MAX) ?
+                                          sizeof(int32_t) :
+                                          sizeof(int64_t);
+        seg_ctx->suffix_array_size =
+            ctx->window_size * seg_ctx->suffix_array_width;
+        seg_ctx->new_data = ctx->new_data + start;
+        seg_ctx->new_length = BPAK_MIN(segment_length, ctx->new_length - start);
+        seg_ctx->write_output = segment_write_output;
+        seg_ctx->compression = BPAK_COMPRESSION_NONE;
+        seg_ctx->revision = ctx->revision;
+        seg_ctx->seek_cost = ctx->seek_cost;
+        seg_ctx->pages = ctx->pages;
+        seg_ctx->jobs = 1;
+        seg_ctx->user_priv = &seg;
+
+        BPAK_STATS_CLOCK(sort_start);
+        rc = suffix_array_build(seg_ctx);
+
+        if (rc == BPAK_OK)
+            rc = prefix_index_init(seg_ctx);
+
+        BPAK_STATS_TIME(suffix_sort_ns, sort_start);
+
+        if (rc == BPAK_OK)
+            rc = bsdiff_scan(seg_ctx);
+
+        suffix_array_free(seg_ctx);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+
+#if BPAK_CONFIG_STATS == 1
+        ctx->stats.ctrl_blocks += seg_ctx->stats.ctrl_blocks;
+        ctx->stats.diff_bytes += seg_ctx->stats.diff_bytes;
+        ctx->stats.extra_bytes += seg_ctx->stats.extra_bytes;
+        ctx->stats.copy_bytes += seg_ctx->stats.copy_bytes;
+        ctx->stats.searches += seg_ctx->stats.searches;
+        ctx->stats.search_ns += seg_ctx->stats.search_ns;
+#endif
+        ctx->origin_seeks += seg_ctx->origin_seeks;
+        ctx->origin_backward_seeks += seg_ctx->origin_backward_seeks;
+        ctx->origin_seek_bytes += seg_ctx->origin_seek_bytes;
+
+        if (i < (no_of_segments - 1)) {
+            uint8_t *adjust = &seg.data[seg_ctx->ctrl_pos + 16];
+            int64_t move = (int64_t)windows[i + 1] - (int64_t)windows[i] -
+                           seg_ctx->last_pos;
+
+            offtout(offtin(adjust) + move, adjust);
+        }
+
+        rc = compressor_write(ctx, seg.data, seg.length);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+    }
+
+    ctx->scan = ctx->new_length;
+
+err_free_out:
+    if (seg.data != NULL)
+        bpak_free(seg.data);
+    bpak_free(windows);
+    return rc;
+}
+
+BPAK_EXPORT ssize_t bpak_bsdiff(struct bpak_bsdiff_context *ctx)
+{
+    int rc;
+    BPAK_STATS_CLOCK(start);
+
+    /* Segments start at origin position zero, which an in place patch
+     * can't read after the first segment */
+    if (ctx->window_size != 0)
+        rc = bsdiff_windowed(ctx);
+    else if ((ctx->jobs > 1) && (ctx->in_place_scratch == 0))
+        rc = bsdiff_parallel(ctx);
+    else
+        rc = bsdiff_scan(ctx);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    BPAK_STATS_CLOCK(final_start);
     rc = compressor_final(ctx);
+    BPAK_STATS_TIME(compress_ns, final_start);
+    BPAK_STATS_TIME(scan_ns, start);
 
     if (rc != BPAK_OK)
         return rc;
@@ -716,11 +2289,68 @@ BPAK_EXPORT ssize_t bpak_bsdiff(struct bpak_bsdiff_context *ctx)
     return ctx->output_pos;
 }
 
+BPAK_EXPORT ssize_t
+bpak_bsdiff_compress(uint8_t *data, size_t length, bpak_io_t write_output,
+                     off_t output_offset, enum bpak_compression compression,
+                     const struct bpak_bsdiff_options *options,
+                     void *user_priv)
+{
+    ssize_t rc;
+    struct bpak_bsdiff_context ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.write_output = write_output;
+    ctx.output_offset = output_offset;
+    ctx.user_priv = user_priv;
+    ctx.compression = compression;
+    ctx.jobs = 1;
+
+    if (options != NULL) {
+        if (options->jobs > 0)
+            ctx.jobs = options->jobs;
+        if (options->lzma_params != NULL)
+            ctx.lzma_params = *options->lzma_params;
+        if (options->heatshrink_params != NULL)
+            ctx.heatshrink_params = *options->heatshrink_params;
+    }
+
+    rc = compressor_init(&ctx);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = compressor_write(&ctx, data, length);
+
+    if (rc == BPAK_OK)
+        rc = compressor_final(&ctx);
+
+    if (rc == BPAK_OK)
+        rc = ctx.output_pos;
+
+    compressor_free(&ctx);
+    return rc;
+}
+
+BPAK_EXPORT int bpak_bsdiff_get_stats(const struct bpak_bsdiff_context *ctx,
+                                      struct bpak_bsdiff_stats *stats)
+{
+#if BPAK_CONFIG_STATS == 1
+    *stats = ctx->stats;
+    return BPAK_OK;
+#else
+    (void)ctx;
+    memset(stats, 0, sizeof(*stats));
+    return -BPAK_NOT_SUPPORTED;
+#endif
+}
+
 BPAK_EXPORT void bpak_bsdiff_free(struct bpak_bsdiff_context *ctx)
 {
-    if (ctx->suffix_array != NULL) {
-        bpak_free(ctx->suffix_array);
-        ctx->suffix_array = NULL;
+    suffix_array_free(ctx);
+
+    if (ctx->window_index != NULL) {
+        bpak_free(ctx->window_index);
+        ctx->window_index = NULL;
     }
 
     compressor_free(ctx);
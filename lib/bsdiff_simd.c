@@ -0,0 +1,187 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <bpak/bpak.h>
+#include "bsdiff_simd.h"
+
+#if BPAK_CONFIG_SIMD == 1
+#if defined(__x86_64__) || defined(__i386__)
+#define BSDIFF_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define BSDIFF_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+typedef int64_t (*matchlen_func_t)(const uint8_t *a, const uint8_t *b,
+                                   int64_t length);
+typedef void (*diff_bytes_func_t)(uint8_t *output, const uint8_t *new_p,
+                                  const uint8_t *origin_p, size_t length);
+
+static int64_t matchlen_scalar(const uint8_t *a, const uint8_t *b,
+                               int64_t length)
+{
+    int64_t i;
+
+    for (i = 0; i < length; i++) {
+        if (a[i] != b[i])
+            break;
+    }
+
+    return i;
+}
+
+static void diff_bytes_scalar(uint8_t *output, const uint8_t *new_p,
+                              const uint8_t *origin_p, size_t length)
+{
+    for (size_t n = 0; n < length; n++)
+        output[n] = new_p[n] - origin_p[n];
+}
+
+#ifdef BSDIFF_SIMD_X86
+__attribute__((target("sse2"))) static int64_t
+matchlen_sse2(const uint8_t *a, const uint8_t *b, int64_t length)
+{
+    int64_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+
+    return i + matchlen_scalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("sse2"))) static void
+diff_bytes_sse2(uint8_t *output, const uint8_t *new_p, const uint8_t *origin_p,
+                size_t length)
+{
+    size_t n = 0;
+
+    for (; n + 16 <= length; n += 16) {
+        __m128i vn = _mm_loadu_si128((const __m128i *)(new_p + n));
+        __m128i vo = _mm_loadu_si128((const __m128i *)(origin_p + n));
+        _mm_storeu_si128((__m128i *)(output + n), _mm_sub_epi8(vn, vo));
+    }
+
+    diff_bytes_scalar(output + n, new_p + n, origin_p + n, length - n);
+}
+
+__attribute__((target("avx2"))) static int64_t
+matchlen_avx2(const uint8_t *a, const uint8_t *b, int64_t length)
+{
+    int64_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+        if (mask != 0xffffffff)
+            return i + __builtin_ctz(~mask);
+    }
+
+    return i + matchlen_sse2(a + i, b + i, length - i);
+}
+
+__attribute__((target("avx2"))) static void
+diff_bytes_avx2(uint8_t *output, const uint8_t *new_p, const uint8_t *origin_p,
+                size_t length)
+{
+    size_t n = 0;
+
+    for (; n + 32 <= length; n += 32) {
+        __m256i vn = _mm256_loadu_si256((const __m256i *)(new_p + n));
+        __m256i vo = _mm256_loadu_si256((const __m256i *)(origin_p + n));
+        _mm256_storeu_si256((__m256i *)(output + n), _mm256_sub_epi8(vn, vo));
+    }
+
+    diff_bytes_sse2(output + n, new_p + n, origin_p + n, length - n);
+}
+#endif
+
+#ifdef BSDIFF_SIMD_NEON
+static int64_t matchlen_neon(const uint8_t *a, const uint8_t *b,
+                             int64_t length)
+{
+    int64_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+
+        /* The mismatch is somewhere in this block */
+        if (vminvq_u8(eq) != 0xff)
+            return i + matchlen_scalar(a + i, b + i, 16);
+    }
+
+    return i + matchlen_scalar(a + i, b + i, length - i);
+}
+
+static void diff_bytes_neon(uint8_t *output, const uint8_t *new_p,
+                            const uint8_t *origin_p, size_t length)
+{
+    size_t n = 0;
+
+    for (; n + 16 <= length; n += 16)
+        vst1q_u8(output + n, vsubq_u8(vld1q_u8(new_p + n),
+                                      vld1q_u8(origin_p + n)));
+
+    diff_bytes_scalar(output + n, new_p + n, origin_p + n, length - n);
+}
+#endif
+
+static matchlen_func_t matchlen_func = matchlen_scalar;
+static diff_bytes_func_t diff_bytes_func = diff_bytes_scalar;
+static pthread_once_t simd_init_once = PTHREAD_ONCE_INIT;
+
+static void simd_select(void)
+{
+#if defined(BSDIFF_SIMD_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        matchlen_func = matchlen_avx2;
+        diff_bytes_func = diff_bytes_avx2;
+        bpak_printf(2, "bsdiff: using avx2 kernels\n");
+    } else if (__builtin_cpu_supports("sse2")) {
+        matchlen_func = matchlen_sse2;
+        diff_bytes_func = diff_bytes_sse2;
+        bpak_printf(2, "bsdiff: using sse2 kernels\n");
+    }
+#elif defined(BSDIFF_SIMD_NEON)
+    /* Advanced SIMD is mandatory on aarch64 */
+    matchlen_func = matchlen_neon;
+    diff_bytes_func = diff_bytes_neon;
+    bpak_printf(2, "bsdiff: using neon kernels\n");
+#endif
+}
+
+void bsdiff_simd_init(void)
+{
+    pthread_once(&simd_init_once, simd_select);
+}
+
+int64_t bsdiff_matchlen(const uint8_t *a, const uint8_t *b, int64_t length)
+{
+    return matchlen_func(a, b, length);
+}
+
+void bsdiff_diff_bytes(uint8_t *output, const uint8_t *new_p,
+                       const uint8_t *origin_p, size_t length)
+{
+    diff_bytes_func(output, new_p, origin_p, length);
+}
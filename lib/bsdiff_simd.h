@@ -0,0 +1,19 @@
+#ifndef LIB_BSDIFF_SIMD_H_
+#define LIB_BSDIFF_SIMD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <bpak/bpak.h>
+
+/* Selects the fastest kernels supported by the CPU, safe to call from
+ * several threads */
+void bsdiff_simd_init(void);
+
+/* Number of leading bytes that are equal in 'a' and 'b' */
+int64_t bsdiff_matchlen(const uint8_t *a, const uint8_t *b, int64_t length);
+
+/* output[n] = new_p[n] - origin_p[n] */
+void bsdiff_diff_bytes(uint8_t *output, const uint8_t *new_p,
+                       const uint8_t *origin_p, size_t length);
+
+#endif
@@ -1,28 +1,54 @@
+/* ZSTD_createDCtx_advanced and ZSTD_estimateDStreamSize */
+#define ZSTD_STATIC_LINKING_ONLY
+
 #include <stdio.h>
 #include <string.h>
 #include <bpak/bpak.h>
 #include <bpak/bspatch.h>
 #include <bpak/heatshrink_decoder.h>
 
+#include "stats.h"
+#include "trace.h"
+
+#if BPAK_CONFIG_SIMD == 1
+#if defined(__ARM_NEON)
+#define BSPATCH_SIMD_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define BSPATCH_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
 #if BPAK_CONFIG_LZMA == 1
 #include <lzma.h>
 
+/* liblzma allocates through the context allocator, 'opaque' is the ctx */
 static void *lzma_alloc_wrap(void *opaque, size_t nmemb, size_t size)
 {
-    (void)opaque;
-    return bpak_calloc(nmemb, size);
+    struct bpak_bspatch_context *ctx = (struct bpak_bspatch_context *)opaque;
+    return bpak_allocator_calloc(ctx->allocator, nmemb, size);
 }
 
 static void lzma_free_wrap(void *opaque, void *ptr)
 {
-    (void)opaque;
-    bpak_free(ptr);
+    struct bpak_bspatch_context *ctx = (struct bpak_bspatch_context *)opaque;
+    bpak_allocator_free(ctx->allocator, ptr);
 }
+#endif
 
-static const lzma_allocator lzma_alloc = {
-    .alloc = lzma_alloc_wrap,
-    .free = lzma_free_wrap,
-};
+#if BPAK_CONFIG_ZSTD == 1
+static void *zstd_alloc_wrap(void *opaque, size_t size)
+{
+    struct bpak_bspatch_context *ctx = (struct bpak_bspatch_context *)opaque;
+    return bpak_allocator_calloc(ctx->allocator, 1, size);
+}
+
+static void zstd_free_wrap(void *opaque, void *ptr)
+{
+    struct bpak_bspatch_context *ctx = (struct bpak_bspatch_context *)opaque;
+    bpak_allocator_free(ctx->allocator, ptr);
+}
 #endif
 
 static int64_t offtin(uint8_t *buf)
@@ -51,7 +77,270 @@ static int64_t offtin(uint8_t *buf)
     return y;
 }
 
-static int bspatch_write(struct bpak_bspatch_context *ctx, uint8_t *buffer,
+/* output[n] = origin[n] + diff[n], 'output' may alias 'origin'. The kernel
+ * is picked at compile time so that the patcher has no runtime CPU
+ * detection. */
+static void bspatch_add_bytes(uint8_t *output, const uint8_t *origin,
+                              const uint8_t *diff, size_t length)
+{
+    size_t n = 0;
+
+#if defined(BSPATCH_SIMD_NEON)
+    for (; n + 16 <= length; n += 16) {
+        uint8x16_t vo = vld1q_u8(origin + n);
+        uint8x16_t vd = vld1q_u8(diff + n);
+        vst1q_u8(output + n, vaddq_u8(vo, vd));
+    }
+#elif defined(BSPATCH_SIMD_SSE2)
+    for (; n + 16 <= length; n += 16) {
+        __m128i vo = _mm_loadu_si128((const __m128i *)(origin + n));
+        __m128i vd = _mm_loadu_si128((const __m128i *)(diff + n));
+        _mm_storeu_si128((__m128i *)(output + n), _mm_add_epi8(vo, vd));
+    }
+#endif
+
+    for (; n < length; n++)
+        output[n] = origin[n] + diff[n];
+}
+
+/* Shortest run inside a diff chunk that is reported, one merkle leaf */
+#define BSPATCH_UNCHANGED_MIN_RUN 4096
+
+/* Report the runs of zero diff bytes in 'pp' to the unchanged hook. Runs
+ * inside the chunk that are shorter than a merkle leaf are skipped, runs
+ * at the chunk ends may continue in the next or previous chunk. */
+static void bspatch_unchanged_runs(struct bpak_bspatch_context *ctx,
+                                   const uint8_t *pp, size_t length)
+{
+    size_t n = 0;
+
+    while (n < length) {
+        size_t start;
+        uint64_t word;
+
+        while ((n < length) && (pp[n] != 0))
+            n++;
+
+        start = n;
+
+        for (; n + sizeof(word) <= length; n += sizeof(word)) {
+            memcpy(&word, &pp[n], sizeof(word));
+
+            if (word != 0)
+                break;
+        }
+
+        while ((n < length) && (pp[n] == 0))
+            n++;
+
+        if ((n > start) &&
+            ((start == 0) || (n == length) ||
+             (n - start >= BSPATCH_UNCHANGED_MIN_RUN))) {
+            ctx->unchanged(ctx->output_position + start,
+                           ctx->origin_position + start,
+                           n - start,
+                           ctx->user_priv);
+        }
+    }
+}
+
+static ssize_t bspatch_read_origin(struct bpak_bspatch_context *ctx,
+                                   uint8_t *buffer, size_t length)
+{
+    BPAK_STATS_CLOCK(start);
+    ssize_t nread = ctx->read_origin(ctx->origin_offset + ctx->origin_position,
+                                     buffer,
+                                     length,
+                                     ctx->user_priv);
+
+    BPAK_STATS_TIME(read_origin_ns, start);
+    BPAK_STATS_ADD(read_origin_calls, 1);
+    return nread;
+}
+
+static ssize_t bspatch_write_output(struct bpak_bspatch_context *ctx,
+                                    uint8_t *buffer, size_t length)
+{
+    BPAK_STATS_CLOCK(start);
+    ssize_t nwritten =
+        ctx->write_output(ctx->output_offset + ctx->output_position,
+                          buffer,
+                          length,
+                          ctx->user_priv);
+
+    BPAK_STATS_TIME(write_output_ns, start);
+    BPAK_STATS_ADD(write_output_calls, 1);
+    return nwritten;
+}
+
+/* Add diff bytes to origin data through the i/o callbacks */
+static int bspatch_diff_io(struct bpak_bspatch_context *ctx, uint8_t *pp,
+                           size_t length)
+{
+    ssize_t nread = bspatch_read_origin(ctx, ctx->patch_buffer, length);
+
+    if (nread != (ssize_t)length) {
+        bpak_printf(0, "Could not read %zu bytes from origin\n", length);
+
+        if (nread < 0)
+            return nread;
+        else
+            return -BPAK_PATCH_READ_ORIGIN_ERROR;
+    }
+
+    if (ctx->unchanged != NULL)
+        bspatch_unchanged_runs(ctx, pp, length);
+
+    ctx->origin_position += nread;
+
+    bspatch_add_bytes(ctx->patch_buffer, ctx->patch_buffer, pp, length);
+
+    ssize_t nwritten = bspatch_write_output(ctx, ctx->patch_buffer, length);
+
+    if (nwritten != (ssize_t)length) {
+        bpak_printf(0, "Could not write to output file\n");
+
+        if (nwritten < 0)
+            return nwritten;
+        else
+            return -BPAK_PATCH_WRITE_ERROR;
+    }
+
+    ctx->output_position += nwritten;
+    return BPAK_OK;
+}
+
+/* Add diff bytes from mapped origin directly into the mapped output */
+static int bspatch_diff_mapped(struct bpak_bspatch_context *ctx, uint8_t *pp,
+                               size_t length)
+{
+    if ((ctx->origin_position < 0) ||
+        ((size_t)ctx->origin_position > ctx->origin_length) ||
+        (length > ctx->origin_length - ctx->origin_position)) {
+        bpak_printf(0,
+                    "Could not read %zu bytes from origin at %li\n",
+                    length,
+                    (long)ctx->origin_position);
+        return -BPAK_PATCH_READ_ORIGIN_ERROR;
+    }
+
+    if (length > ctx->output_length - ctx->output_position) {
+        bpak_printf(0, "Patch output exceeds %zu bytes\n", ctx->output_length);
+        return -BPAK_PATCH_WRITE_ERROR;
+    }
+
+    bspatch_add_bytes(&ctx->output_data[ctx->output_position],
+                      &ctx->origin_data[ctx->origin_position],
+                      pp,
+                      length);
+
+    ctx->origin_position += length;
+    ctx->output_position += length;
+    return BPAK_OK;
+}
+
+/* Copy 'length' origin bytes unchanged, for copy tuples of
+ * BPAK_BSDIFF_REVISION_COPY streams. No patch input is consumed. */
+static int bspatch_copy(struct bpak_bspatch_context *ctx, size_t length)
+{
+    if (ctx->output_data != NULL) {
+        if ((ctx->origin_position < 0) ||
+            ((size_t)ctx->origin_position > ctx->origin_length) ||
+            (length > ctx->origin_length - ctx->origin_position)) {
+            bpak_printf(0,
+                        "Could not read %zu bytes from origin at %li\n",
+                        length,
+                        (long)ctx->origin_position);
+            return -BPAK_PATCH_READ_ORIGIN_ERROR;
+        }
+
+        if (length > ctx->output_length - ctx->output_position) {
+            bpak_printf(0,
+                        "Patch output exceeds %zu bytes\n",
+                        ctx->output_length);
+            return -BPAK_PATCH_WRITE_ERROR;
+        }
+
+        memmove(&ctx->output_data[ctx->output_position],
+                &ctx->origin_data[ctx->origin_position],
+                length);
+        ctx->origin_position += length;
+        ctx->output_position += length;
+        return BPAK_OK;
+    }
+
+    while (length > 0) {
+        size_t chunk = BPAK_MIN(length, ctx->patch_buffer_length);
+        ssize_t nread = bspatch_read_origin(ctx, ctx->patch_buffer, chunk);
+
+        if (nread != (ssize_t)chunk) {
+            bpak_printf(0, "Could not read %zu bytes from origin\n", chunk);
+
+            if (nread < 0)
+                return nread;
+            else
+                return -BPAK_PATCH_READ_ORIGIN_ERROR;
+        }
+
+        if (ctx->unchanged != NULL) {
+            ctx->unchanged(ctx->output_position,
+                           ctx->origin_position,
+                           chunk,
+                           ctx->user_priv);
+        }
+
+        ctx->origin_position += chunk;
+
+        ssize_t nwritten = bspatch_write_output(ctx, ctx->patch_buffer, chunk);
+
+        if (nwritten != (ssize_t)chunk) {
+            bpak_printf(0, "Could not write to output file\n");
+
+            if (nwritten < 0)
+                return nwritten;
+            else
+                return -BPAK_PATCH_WRITE_ERROR;
+        }
+
+        ctx->output_position += nwritten;
+        length -= chunk;
+    }
+
+    return BPAK_OK;
+}
+
+static int bspatch_extra(struct bpak_bspatch_context *ctx, uint8_t *pp,
+                         size_t length)
+{
+    if (ctx->output_data != NULL) {
+        if (length > ctx->output_length - ctx->output_position) {
+            bpak_printf(0,
+                        "Patch output exceeds %zu bytes\n",
+                        ctx->output_length);
+            return -BPAK_PATCH_WRITE_ERROR;
+        }
+
+        memcpy(&ctx->output_data[ctx->output_position], pp, length);
+        ctx->output_position += length;
+        return BPAK_OK;
+    }
+
+    ssize_t nwritten = bspatch_write_output(ctx, pp, length);
+
+    if (nwritten != (ssize_t)length) {
+        bpak_printf(0, "Could not write to output file\n");
+
+        if (nwritten < 0)
+            return nwritten;
+        else
+            return -BPAK_PATCH_WRITE_ERROR;
+    }
+
+    ctx->output_position += nwritten;
+    return BPAK_OK;
+}
+
+static int bspatch_apply(struct bpak_bspatch_context *ctx, uint8_t *buffer,
                          size_t length)
 {
     uint8_t *pp = buffer; // Patch pointer within the current chunk
@@ -81,6 +370,12 @@ process_more:
         ctx->diff_count = offtin(&ctx->ctrl_buf[0]);
         ctx->extra_count = offtin(&ctx->ctrl_buf[8]);
         ctx->adjust = offtin(&ctx->ctrl_buf[16]);
+        BPAK_STATS_ADD(ctrl_blocks, 1);
+        BPAK_TRACE4(bspatch__ctrl,
+                    ctx->output_position,
+                    ctx->diff_count,
+                    ctx->extra_count,
+                    ctx->adjust);
 
         bpak_printf(2,
                     "Patch: %10li %10li %10li %li\n",
@@ -89,64 +384,80 @@ process_more:
                     ctx->adjust,
                     bytes_available);
 
-        ctx->state = BPAK_PATCH_STATE_APPLY_DIFF;
+        if (ctx->extra_count < 0) {
+            bpak_printf(0, "Invalid extra length in patch\n");
+            ctx->state = BPAK_PATCH_STATE_ERROR;
+            rc = -BPAK_FAILED;
+            break;
+        }
 
-        if (bytes_available)
-            goto process_more;
-    } break;
-    case BPAK_PATCH_STATE_APPLY_DIFF: {
-        ssize_t data_to_process = BPAK_MIN(
-            BPAK_MIN((ssize_t)bytes_available, (ssize_t)ctx->diff_count),
-            (ssize_t)ctx->patch_buffer_length);
+        if (ctx->ctrl != NULL) {
+            ctx->ctrl(ctx->output_position,
+                      ctx->origin_position,
+                      ctx->diff_count,
+                      ctx->extra_count,
+                      ctx->adjust,
+                      ctx->user_priv);
+        }
 
-        ctx->diff_count -= data_to_process;
-        bytes_available -= data_to_process;
+        /* A negative diff length is an origin copy, that is applied here
+         * since it has no patch data */
+        if (ctx->diff_count < 0) {
+            BPAK_STATS_ADD(copy_bytes, -ctx->diff_count);
+            rc = bspatch_copy(ctx, -ctx->diff_count);
 
-        ssize_t nread =
-            ctx->read_origin(ctx->origin_offset + ctx->origin_position,
-                             ctx->patch_buffer,
-                             data_to_process,
-                             ctx->user_priv);
+            if (rc != BPAK_OK) {
+                ctx->state = BPAK_PATCH_STATE_ERROR;
+                break;
+            }
 
-        if (nread != data_to_process) {
-            bpak_printf(0,
-                        "Could not read %li bytes from origin\n",
-                        data_to_process);
-            ctx->state = BPAK_PATCH_STATE_ERROR;
-            if (nread < 0)
-                rc = nread;
-            else
-                rc = -BPAK_PATCH_READ_ORIGIN_ERROR;
+            ctx->diff_count = 0;
+
+            if (ctx->extra_count > 0) {
+                ctx->state = BPAK_PATCH_STATE_APPLY_EXTRA;
+            } else {
+                ctx->origin_position += ctx->adjust;
+                ctx->state = BPAK_PATCH_STATE_FILL_CTRL_BUF;
+                ctx->ctrl_buf_count = 0;
+            }
 
+            if (bytes_available)
+                goto process_more;
             break;
         }
 
-        ctx->origin_position += nread;
-
-        for (int i = 0; i < data_to_process; i++) {
-            ctx->patch_buffer[i] += pp[i];
+        if ((ctx->prefetch_origin != NULL) && (ctx->diff_count > 0)) {
+            ctx->prefetch_origin(ctx->origin_offset + ctx->origin_position,
+                                 ctx->diff_count,
+                                 ctx->user_priv);
         }
 
-        pp += data_to_process;
+        ctx->state = BPAK_PATCH_STATE_APPLY_DIFF;
 
-        ssize_t nwritten =
-            ctx->write_output(ctx->output_offset + ctx->output_position,
-                              ctx->patch_buffer,
-                              data_to_process,
-                              ctx->user_priv);
+        if (bytes_available)
+            goto process_more;
+    } break;
+    case BPAK_PATCH_STATE_APPLY_DIFF: {
+        ssize_t data_to_process =
+            BPAK_MIN((ssize_t)bytes_available, (ssize_t)ctx->diff_count);
+
+        if (ctx->output_data != NULL) {
+            rc = bspatch_diff_mapped(ctx, pp, data_to_process);
+        } else {
+            data_to_process = BPAK_MIN(data_to_process,
+                                       (ssize_t)ctx->patch_buffer_length);
+            rc = bspatch_diff_io(ctx, pp, data_to_process);
+        }
 
-        if (nwritten != data_to_process) {
-            bpak_printf(0, "Could not write to output file\n");
+        if (rc != BPAK_OK) {
             ctx->state = BPAK_PATCH_STATE_ERROR;
-
-            if (nwritten < 0)
-                rc = nwritten;
-            else
-                rc = -BPAK_PATCH_WRITE_ERROR;
             break;
         }
 
-        ctx->output_position += nwritten;
+        ctx->diff_count -= data_to_process;
+        bytes_available -= data_to_process;
+        BPAK_STATS_ADD(diff_bytes, data_to_process);
+        pp += data_to_process;
 
         if (ctx->diff_count == 0) {
             if (ctx->extra_count > 0) {
@@ -167,24 +478,15 @@ process_more:
             BPAK_MIN((ssize_t)bytes_available, (ssize_t)ctx->extra_count);
         ctx->extra_count -= data_to_process;
         bytes_available -= data_to_process;
+        BPAK_STATS_ADD(extra_bytes, data_to_process);
 
-        ssize_t nwritten =
-            ctx->write_output(ctx->output_offset + ctx->output_position,
-                              pp,
-                              data_to_process,
-                              ctx->user_priv);
+        rc = bspatch_extra(ctx, pp, data_to_process);
 
-        if (nwritten != data_to_process) {
-            bpak_printf(0, "Could not write to output file\n");
+        if (rc != BPAK_OK) {
             ctx->state = BPAK_PATCH_STATE_ERROR;
-            if (nwritten < 0)
-                rc = nwritten;
-            else
-                rc = -BPAK_PATCH_WRITE_ERROR;
             break;
         }
 
-        ctx->output_position += nwritten;
         pp += data_to_process;
 
         if (ctx->extra_count == 0) {
@@ -208,6 +510,22 @@ process_more:
     return rc;
 }
 
+/* The decompressors feed the patch state machine through this */
+static int bspatch_write(struct bpak_bspatch_context *ctx, uint8_t *buffer,
+                         size_t length)
+{
+    BPAK_STATS_CLOCK(start);
+    int rc;
+
+    if (ctx->raw)
+        rc = bspatch_extra(ctx, buffer, length);
+    else
+        rc = bspatch_apply(ctx, buffer, length);
+
+    BPAK_STATS_TIME(patch_ns, start);
+    return rc;
+}
+
 static int decompressor_init(struct bpak_bspatch_context *ctx)
 {
     switch (ctx->compression) {
@@ -219,15 +537,66 @@ static int decompressor_init(struct bpak_bspatch_context *ctx)
 #if BPAK_CONFIG_LZMA == 1
     case BPAK_COMPRESSION_LZMA: {
         lzma_stream *strm = &ctx->decompressor.lzma_stream;
-
-        lzma_ret ret = lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED);
+        lzma_stream strm_init = LZMA_STREAM_INIT;
+
+        /* The allocator must be set before the decoder allocates */
+        ctx->lzma_allocator.alloc = lzma_alloc_wrap;
+        ctx->lzma_allocator.free = lzma_free_wrap;
+        ctx->lzma_allocator.opaque = ctx;
+        *strm = strm_init;
+        strm->allocator = &ctx->lzma_allocator;
+
+        lzma_ret ret;
+
+#if LZMA_VERSION >= 50040002
+        if (ctx->threads > 1) {
+            /* Blocks with sizes in their headers are decoded in parallel,
+             * never fall back to one thread because of memory use */
+            lzma_mt mt = {
+                .flags = LZMA_CONCATENATED,
+                .threads = ctx->threads,
+                .memlimit_threading = UINT64_MAX,
+                .memlimit_stop = UINT64_MAX,
+            };
+
+            ret = lzma_stream_decoder_mt(strm, &mt);
+        } else
+#endif
+        {
+            ret = lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED);
+        }
 
         if (ret != LZMA_OK) {
             bpak_printf(0, "lzma init error (%u)\n", ret);
             return -BPAK_DECOMPRESSOR_ERROR;
         }
+    } break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD: {
+        ZSTD_customMem mem = {
+            .customAlloc = zstd_alloc_wrap,
+            .customFree = zstd_free_wrap,
+            .opaque = ctx,
+        };
+        ZSTD_DCtx *dctx = ZSTD_createDCtx_advanced(mem);
+
+        if (dctx == NULL)
+            return -BPAK_DECOMPRESSOR_ERROR;
+
+        /* Refuse streams that need a larger window than we budget for */
+        size_t ret = ZSTD_DCtx_setParameter(dctx,
+                                            ZSTD_d_windowLogMax,
+                                            BPAK_ZSTD_WINDOW_LOG);
+
+        if (ZSTD_isError(ret)) {
+            bpak_printf(0, "zstd init error (%s)\n", ZSTD_getErrorName(ret));
+            ZSTD_freeDCtx(dctx);
+            return -BPAK_DECOMPRESSOR_ERROR;
+        }
 
-        strm->allocator = &lzma_alloc;
+        ctx->decompressor.zstd.dctx = dctx;
+        ctx->decompressor.zstd.hint = 1;
     } break;
 #endif
     default:
@@ -249,6 +618,12 @@ static void decompressor_free(struct bpak_bspatch_context *ctx)
     case BPAK_COMPRESSION_LZMA:
         lzma_end(&ctx->decompressor.lzma_stream);
         break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD:
+        ZSTD_freeDCtx(ctx->decompressor.zstd.dctx);
+        ctx->decompressor.zstd.dctx = NULL;
+        break;
 #endif
     default:
         return;
@@ -312,6 +687,48 @@ static int bspatch_lzma_write(struct bpak_bspatch_context *ctx, uint8_t *buffer,
 }
 #endif
 
+#if BPAK_CONFIG_ZSTD == 1
+/* Decompresses into the input half of the work buffer, no other buffers
+ * than the zstd window are needed */
+static int bspatch_zstd_write(struct bpak_bspatch_context *ctx,
+                              uint8_t *buffer, size_t length)
+{
+    int rc;
+    ZSTD_inBuffer in = { .src = buffer, .size = length, .pos = 0 };
+    ZSTD_outBuffer out;
+
+    do {
+        out.dst = ctx->input_buffer;
+        out.size = ctx->input_buffer_length;
+        out.pos = 0;
+
+        size_t ret =
+            ZSTD_decompressStream(ctx->decompressor.zstd.dctx, &out, &in);
+
+        if (ZSTD_isError(ret)) {
+            bpak_printf(0, "zstd: Decoder error: %s\n", ZSTD_getErrorName(ret));
+            return -BPAK_DECOMPRESSOR_ERROR;
+        }
+
+        ctx->decompressor.zstd.hint = ret;
+
+        if (out.pos > 0) {
+            rc = bspatch_write(ctx, ctx->input_buffer, out.pos);
+
+            if (rc != BPAK_OK) {
+                bpak_printf(0, "bspatch failed (%i)\n", rc);
+                return rc;
+            }
+        }
+        /* A full output buffer means the decoder might hold more data */
+    } while ((in.pos < in.size) || (out.pos == out.size));
+
+    ctx->input_position += length;
+
+    return BPAK_OK;
+}
+#endif
+
 static int bspatch_hs_write(struct bpak_bspatch_context *ctx, uint8_t *buffer,
                             size_t length)
 {
@@ -324,6 +741,8 @@ static int bspatch_hs_write(struct bpak_bspatch_context *ctx, uint8_t *buffer,
     HSD_finish_res fres = 0;
     heatshrink_decoder *hsd = &ctx->decompressor.hsd;
 
+    size_t filled = 0; /* Decoded bytes waiting in input_buffer */
+
     if (ctx->input_position >= ctx->input_length) {
         bpak_printf(0,
                     "Error: Tried to write %lu extra bytes, ignoring\n",
@@ -331,6 +750,8 @@ static int bspatch_hs_write(struct bpak_bspatch_context *ctx, uint8_t *buffer,
         return -1;
     }
 
+    /* Decoded data is collected until the output span is full so that the
+     * patch state machine runs once per span instead of once per poll */
     do {
         sres = heatshrink_decoder_sink(hsd,
                                        &buffer[sunk],
@@ -346,20 +767,25 @@ static int bspatch_hs_write(struct bpak_bspatch_context *ctx, uint8_t *buffer,
         do {
 poll_more:
             pres = heatshrink_decoder_poll(hsd,
-                                           ctx->input_buffer,
-                                           ctx->input_buffer_length,
+                                           &ctx->input_buffer[filled],
+                                           ctx->input_buffer_length - filled,
                                            &poll_sz);
 
             if (pres < 0)
                 return -BPAK_DECOMPRESSOR_ERROR;
 
-            rc = bspatch_write(ctx, ctx->input_buffer, poll_sz);
+            filled += poll_sz;
 
-            if (rc != BPAK_OK) {
-                bpak_printf(0, "bspatch failed (%i)\n", rc);
-                return rc;
-            }
+            if (filled == ctx->input_buffer_length) {
+                rc = bspatch_write(ctx, ctx->input_buffer, filled);
+
+                if (rc != BPAK_OK) {
+                    bpak_printf(0, "bspatch failed (%i)\n", rc);
+                    return rc;
+                }
 
+                filled = 0;
+            }
         } while (pres == HSDR_POLL_MORE);
 
         if (ctx->input_position == ctx->input_length) {
@@ -372,6 +798,16 @@ poll_more:
         }
     } while (sunk < length);
 
+    /* Everything sunk so far is written out before returning */
+    if (filled > 0) {
+        rc = bspatch_write(ctx, ctx->input_buffer, filled);
+
+        if (rc != BPAK_OK) {
+            bpak_printf(0, "bspatch failed (%i)\n", rc);
+            return rc;
+        }
+    }
+
     return BPAK_OK;
 }
 
@@ -412,28 +848,276 @@ BPAK_EXPORT int bpak_bspatch_init(struct bpak_bspatch_context *ctx,
     return BPAK_OK;
 }
 
+BPAK_EXPORT int
+bpak_bspatch_init_mapped(struct bpak_bspatch_context *ctx, uint8_t *buffer,
+                         size_t buffer_length, size_t input_length,
+                         const uint8_t *origin, size_t origin_length,
+                         uint8_t *output, size_t output_length,
+                         enum bpak_compression compression)
+{
+    memset(ctx, 0, sizeof(*ctx));
+
+    if ((origin == NULL) || (output == NULL))
+        return -BPAK_FAILED;
+
+    /* No patch buffer is needed, the decompressor gets all of it */
+    ctx->input_buffer = buffer;
+    ctx->input_buffer_length = buffer_length;
+
+    ctx->origin_data = origin;
+    ctx->origin_length = origin_length;
+    ctx->output_data = output;
+    ctx->output_length = output_length;
+    ctx->compression = compression;
+    ctx->input_length = input_length;
+
+    return decompressor_init(ctx);
+}
+
+BPAK_EXPORT int bpak_bspatch_set_prefetch(struct bpak_bspatch_context *ctx,
+                                          bpak_prefetch_t prefetch_origin)
+{
+    /* The mapped mode never reads through the callbacks */
+    if (ctx->output_data != NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    ctx->prefetch_origin = prefetch_origin;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_bspatch_set_unchanged_hook(struct bpak_bspatch_context *ctx,
+                                bpak_bspatch_unchanged_t unchanged)
+{
+    /* The mapped mode has no user context for the hook */
+    if (ctx->output_data != NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    ctx->unchanged = unchanged;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_bspatch_set_ctrl_hook(struct bpak_bspatch_context *ctx,
+                                           bpak_bspatch_ctrl_t ctrl)
+{
+    if (ctx->output_data != NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    ctx->ctrl = ctrl;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_bspatch_set_raw(struct bpak_bspatch_context *ctx)
+{
+    if ((ctx->input_position != 0) || (ctx->output_position != 0))
+        return -BPAK_FAILED;
+
+    ctx->raw = true;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_bspatch_set_threads(struct bpak_bspatch_context *ctx,
+                                         unsigned int threads)
+{
+    if ((ctx->input_position != 0) || (ctx->output_position != 0))
+        return -BPAK_FAILED;
+
+    if (ctx->compression != BPAK_COMPRESSION_LZMA) {
+        ctx->threads = threads;
+        return BPAK_OK;
+    }
+
+    decompressor_free(ctx);
+    ctx->threads = threads;
+    return decompressor_init(ctx);
+}
+
+BPAK_EXPORT int
+bpak_bspatch_set_allocator(struct bpak_bspatch_context *ctx,
+                           const struct bpak_allocator *allocator)
+{
+    /* The decompressor is set up again, which would lose buffered input */
+    if ((ctx->input_position != 0) || (ctx->output_position != 0))
+        return -BPAK_FAILED;
+
+    decompressor_free(ctx);
+    ctx->allocator = allocator;
+    return decompressor_init(ctx);
+}
+
+/* Room for the block headers of the few allocations that the
+ * decompressors make, on top of the estimates of the libraries */
+#define BSPATCH_HEAP_MARGIN 1024
+
+BPAK_EXPORT int bpak_bspatch_heap_size(enum bpak_compression compression,
+                                       uint32_t lzma_dict_size,
+                                       size_t *heap_size)
+{
+    switch (compression) {
+    case BPAK_COMPRESSION_NONE:
+    case BPAK_COMPRESSION_HS:
+        /* The heatshrink window is part of the context */
+        *heap_size = 0;
+        break;
+#if BPAK_CONFIG_LZMA == 1
+    case BPAK_COMPRESSION_LZMA: {
+        lzma_options_lzma opt_lzma2;
+
+        if (lzma_lzma_preset(&opt_lzma2, LZMA_PRESET_DEFAULT))
+            return -BPAK_UNSUPPORTED_COMPRESSION;
+
+        if (lzma_dict_size != 0)
+            opt_lzma2.dict_size = lzma_dict_size;
+
+        /* A BCJ filter is assumed, it is the default of the encoder */
+        lzma_filter filters[] = {
+            { .id = LZMA_FILTER_X86, .options = NULL },
+            { .id = LZMA_FILTER_LZMA2, .options = &opt_lzma2 },
+            { .id = LZMA_VLI_UNKNOWN, .options = NULL },
+        };
+        uint64_t usage = lzma_raw_decoder_memusage(filters);
+
+        if (usage == UINT64_MAX)
+            return -BPAK_UNSUPPORTED_COMPRESSION;
+
+        *heap_size = usage + BSPATCH_HEAP_MARGIN;
+    } break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD:
+        *heap_size = ZSTD_estimateDStreamSize((size_t)1
+                                              << BPAK_ZSTD_WINDOW_LOG) +
+                     BSPATCH_HEAP_MARGIN;
+        break;
+#endif
+    default:
+        return -BPAK_UNSUPPORTED_COMPRESSION;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_bspatch_check_heatshrink_params(
+    struct bpak_bspatch_context *ctx,
+    const struct bpak_transport_heatshrink_params *params)
+{
+    uint8_t window_bits = BPAK_CONFIG_HS_WINDOW_BITS;
+    uint8_t lookahead_bits = BPAK_CONFIG_HS_LOOKAHEAD_BITS;
+
+    if (ctx->compression != BPAK_COMPRESSION_HS)
+        return BPAK_OK;
+
+    if (params->window_bits != 0)
+        window_bits = params->window_bits;
+    if (params->lookahead_bits != 0)
+        lookahead_bits = params->lookahead_bits;
+
+    if ((window_bits != BPAK_CONFIG_HS_WINDOW_BITS) ||
+        (lookahead_bits != BPAK_CONFIG_HS_LOOKAHEAD_BITS)) {
+        bpak_printf(0,
+                    "Error: Patch uses heatshrink window %u/lookahead %u, "
+                    "decoder is built for %u/%u\n",
+                    window_bits,
+                    lookahead_bits,
+                    BPAK_CONFIG_HS_WINDOW_BITS,
+                    BPAK_CONFIG_HS_LOOKAHEAD_BITS);
+        return -BPAK_UNSUPPORTED_COMPRESSION;
+    }
+
+    return BPAK_OK;
+}
+
+static bool bspatch_can_checkpoint(struct bpak_bspatch_context *ctx)
+{
+    switch (ctx->compression) {
+    case BPAK_COMPRESSION_NONE:
+    case BPAK_COMPRESSION_HS:
+        return (ctx->state != BPAK_PATCH_STATE_ERROR);
+    default:
+        return false;
+    }
+}
+
+BPAK_EXPORT int bpak_bspatch_save(struct bpak_bspatch_context *ctx,
+                                  struct bpak_bspatch_checkpoint *checkpoint)
+{
+    if (!bspatch_can_checkpoint(ctx))
+        return -BPAK_NOT_SUPPORTED;
+
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->origin_position = ctx->origin_position;
+    checkpoint->output_position = ctx->output_position;
+    checkpoint->input_position = ctx->input_position;
+    checkpoint->diff_count = ctx->diff_count;
+    checkpoint->extra_count = ctx->extra_count;
+    checkpoint->adjust = ctx->adjust;
+    checkpoint->state = ctx->state;
+    memcpy(checkpoint->ctrl_buf, ctx->ctrl_buf, sizeof(ctx->ctrl_buf));
+    checkpoint->ctrl_buf_count = ctx->ctrl_buf_count;
+
+    if (ctx->compression == BPAK_COMPRESSION_HS)
+        checkpoint->hsd = ctx->decompressor.hsd;
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_bspatch_restore(struct bpak_bspatch_context *ctx,
+                     const struct bpak_bspatch_checkpoint *checkpoint)
+{
+    if (!bspatch_can_checkpoint(ctx))
+        return -BPAK_NOT_SUPPORTED;
+
+    if ((checkpoint->state > BPAK_PATCH_STATE_FINISH) ||
+        (checkpoint->ctrl_buf_count > BPAK_BSPATCH_CTRL_BUFFER_LENGTH) ||
+        (checkpoint->input_position > ctx->input_length))
+        return -BPAK_FAILED;
+
+    ctx->origin_position = checkpoint->origin_position;
+    ctx->output_position = checkpoint->output_position;
+    ctx->input_position = checkpoint->input_position;
+    ctx->diff_count = checkpoint->diff_count;
+    ctx->extra_count = checkpoint->extra_count;
+    ctx->adjust = checkpoint->adjust;
+    ctx->state = checkpoint->state;
+    memcpy(ctx->ctrl_buf, checkpoint->ctrl_buf, sizeof(ctx->ctrl_buf));
+    ctx->ctrl_buf_count = checkpoint->ctrl_buf_count;
+
+    if (ctx->compression == BPAK_COMPRESSION_HS)
+        ctx->decompressor.hsd = checkpoint->hsd;
+
+    return BPAK_OK;
+}
+
 BPAK_EXPORT int bpak_bspatch_write(struct bpak_bspatch_context *ctx,
                                    uint8_t *buffer, size_t length)
 {
     int rc;
+    BPAK_STATS_CLOCK(start);
+
     switch (ctx->compression) {
     case BPAK_COMPRESSION_NONE:
         rc = bspatch_write(ctx, buffer, length);
-        return rc;
         break;
     case BPAK_COMPRESSION_HS:
-        return bspatch_hs_write(ctx, buffer, length);
+        rc = bspatch_hs_write(ctx, buffer, length);
         break;
 #if BPAK_CONFIG_LZMA == 1
     case BPAK_COMPRESSION_LZMA:
-        return bspatch_lzma_write(ctx, buffer, length);
+        rc = bspatch_lzma_write(ctx, buffer, length);
+        break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD:
+        rc = bspatch_zstd_write(ctx, buffer, length);
         break;
 #endif
     default:
         return -BPAK_NOT_SUPPORTED;
     }
 
-    return BPAK_OK;
+    BPAK_STATS_TIME(total_ns, start);
+    return rc;
 }
 
 BPAK_EXPORT ssize_t bpak_bspatch_final(struct bpak_bspatch_context *ctx)
@@ -449,11 +1133,22 @@ BPAK_EXPORT ssize_t bpak_bspatch_final(struct bpak_bspatch_context *ctx)
         break;
 #if BPAK_CONFIG_LZMA == 1
     case BPAK_COMPRESSION_LZMA: {
+        BPAK_STATS_CLOCK(start);
         int rc = bspatch_lzma_write(ctx, NULL, 0);
 
+        BPAK_STATS_TIME(total_ns, start);
+
         if (rc != BPAK_OK)
             return rc;
     } break;
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    case BPAK_COMPRESSION_ZSTD:
+        if (ctx->decompressor.zstd.hint != 0) {
+            bpak_printf(0, "zstd: Truncated stream\n");
+            return -BPAK_DECOMPRESSOR_ERROR;
+        }
+        break;
 #endif
     default:
         return -BPAK_NOT_SUPPORTED;
@@ -462,6 +1157,19 @@ BPAK_EXPORT ssize_t bpak_bspatch_final(struct bpak_bspatch_context *ctx)
     return ctx->output_position;
 }
 
+BPAK_EXPORT int bpak_bspatch_get_stats(const struct bpak_bspatch_context *ctx,
+                                       struct bpak_bspatch_stats *stats)
+{
+#if BPAK_CONFIG_STATS == 1
+    *stats = ctx->stats;
+    return BPAK_OK;
+#else
+    (void)ctx;
+    memset(stats, 0, sizeof(*stats));
+    return -BPAK_NOT_SUPPORTED;
+#endif
+}
+
 BPAK_EXPORT void bpak_bspatch_free(struct bpak_bspatch_context *ctx)
 {
     decompressor_free(ctx);
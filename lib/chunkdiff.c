@@ -0,0 +1,278 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/crypto.h>
+#include <bpak/chunkdiff.h>
+#include "chunker.h"
+
+/* Index entries are written this many at a time */
+#define CHUNKDIFF_ENTRIES_PER_WRITE 64
+
+struct chunk {
+    const uint8_t *data;
+    uint64_t store_offset;
+    uint32_t length;
+    uint32_t first; /* First chunk with the same content */
+    uint8_t digest[BPAK_CHUNKDIFF_DIGEST_LENGTH];
+};
+
+static int chunk_compare(const void *a_p, const void *b_p)
+{
+    const struct chunk *a = *(const struct chunk *const *)a_p;
+    const struct chunk *b = *(const struct chunk *const *)b_p;
+    int rc = memcmp(a->digest, b->digest, sizeof(a->digest));
+
+    if (rc != 0)
+        return rc;
+
+    /* Chunks with the same digest stay in target order */
+    return (a->data < b->data) ? -1 : (a->data > b->data);
+}
+
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        buf[i] = (value >> (i * 8)) & 0xff;
+}
+
+static void put_u64(uint8_t *buf, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        buf[i] = (value >> (i * 8)) & 0xff;
+}
+
+static int write_all(bpak_io_t write_output, off_t offset,
+                     const uint8_t *buffer, size_t length, void *user_priv)
+{
+    ssize_t bytes_written =
+        write_output(offset, (uint8_t *)buffer, length, user_priv);
+
+    if (bytes_written < 0)
+        return bytes_written;
+    if (bytes_written != (ssize_t)length)
+        return -BPAK_WRITE_ERROR;
+
+    return BPAK_OK;
+}
+
+static int chunk_digest(struct chunk *chunk)
+{
+    int rc;
+    struct bpak_hash_context hash;
+
+    rc = bpak_hash_init(&hash, BPAK_HASH_SHA256);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_hash_update(&hash, chunk->data, chunk->length);
+
+    if (rc == BPAK_OK) {
+        rc = bpak_hash_final(&hash,
+                             chunk->digest,
+                             sizeof(chunk->digest),
+                             NULL);
+    }
+
+    bpak_hash_free(&hash);
+    return rc;
+}
+
+/* Split the target and hash every chunk, returns the number of chunks or
+ * a negative number */
+static ssize_t split_chunks(const uint8_t *new_data, size_t new_length,
+                            struct chunk *chunks)
+{
+    int rc;
+    struct chunker chunker;
+    size_t count = 0;
+    size_t pos = 0;
+
+    rc = chunker_init(&chunker,
+                      BPAK_CHUNKDIFF_MIN_SIZE,
+                      BPAK_CHUNKDIFF_AVG_BITS,
+                      BPAK_CHUNKDIFF_MAX_SIZE);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    while (pos < new_length) {
+        size_t start = pos;
+        bool cut = false;
+
+        while (!cut && (pos < new_length))
+            pos += chunker_scan(&chunker,
+                                &new_data[pos],
+                                new_length - pos,
+                                &cut);
+
+        chunks[count].data = &new_data[start];
+        chunks[count].length = pos - start;
+        chunks[count].first = count;
+
+        rc = chunk_digest(&chunks[count]);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        count++;
+    }
+
+    return count;
+}
+
+/* Every chunk refers to the first chunk with the same content, digest
+ * hits are confirmed with memcmp. The store gets the first chunks in
+ * target order. */
+static int dedup_chunks(struct chunk *chunks, size_t count,
+                        uint64_t *store_length)
+{
+    struct chunk **order = bpak_calloc(count, sizeof(*order));
+    size_t group = 0;
+
+    if ((order == NULL) && (count > 0))
+        return -BPAK_FAILED;
+
+    for (size_t i = 0; i < count; i++)
+        order[i] = &chunks[i];
+
+    qsort(order, count, sizeof(*order), chunk_compare);
+
+    for (size_t i = 1; i < count; i++) {
+        struct chunk *first = order[group];
+
+        if (memcmp(order[i]->digest, first->digest, sizeof(first->digest))) {
+            group = i;
+        } else if ((order[i]->length == first->length) &&
+                   (memcmp(order[i]->data, first->data, first->length) ==
+                    0)) {
+            order[i]->first = first->first;
+        }
+    }
+
+    bpak_free(order);
+
+    *store_length = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (chunks[i].first == i) {
+            chunks[i].store_offset = *store_length;
+            *store_length += chunks[i].length;
+        } else {
+            chunks[i].store_offset = chunks[chunks[i].first].store_offset;
+        }
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT ssize_t bpak_chunkdiff(const uint8_t *new_data,
+                                   size_t new_length,
+                                   bpak_io_t write_output,
+                                   off_t output_offset, void *user_priv)
+{
+    ssize_t rc;
+    uint8_t header[BPAK_CHUNKDIFF_HEADER_LENGTH];
+    uint8_t entries[CHUNKDIFF_ENTRIES_PER_WRITE * BPAK_CHUNKDIFF_ENTRY_LENGTH];
+    size_t max_chunks = new_length / BPAK_CHUNKDIFF_MIN_SIZE + 1;
+    struct chunk *chunks = bpak_calloc(max_chunks, sizeof(*chunks));
+    uint64_t store_length;
+    off_t offset = output_offset;
+    size_t count;
+
+    if (chunks == NULL)
+        return -BPAK_FAILED;
+
+    rc = split_chunks(new_data, new_length, chunks);
+
+    if (rc < 0)
+        goto err_free_out;
+
+    count = rc;
+
+    if (count > UINT32_MAX) {
+        rc = -BPAK_SIZE_ERROR;
+        goto err_free_out;
+    }
+
+    rc = dedup_chunks(chunks, count, &store_length);
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    memset(header, 0, sizeof(header));
+    put_u32(&header[0], BPAK_CHUNKDIFF_MAGIC);
+    put_u32(&header[4], count);
+    put_u64(&header[8], new_length);
+    put_u32(&header[16], BPAK_CHUNKDIFF_MIN_SIZE);
+    put_u32(&header[20], BPAK_CHUNKDIFF_MAX_SIZE);
+    header[24] = BPAK_CHUNKDIFF_AVG_BITS;
+
+    rc = write_all(write_output, offset, header, sizeof(header), user_priv);
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    offset += sizeof(header);
+
+    for (size_t i = 0; i < count; i += CHUNKDIFF_ENTRIES_PER_WRITE) {
+        size_t n = BPAK_MIN(count - i, CHUNKDIFF_ENTRIES_PER_WRITE);
+
+        for (size_t k = 0; k < n; k++) {
+            uint8_t *entry = &entries[k * BPAK_CHUNKDIFF_ENTRY_LENGTH];
+
+            put_u64(&entry[0], chunks[i + k].store_offset);
+            put_u32(&entry[8], chunks[i + k].length);
+            memcpy(&entry[12],
+                   chunks[i + k].digest,
+                   BPAK_CHUNKDIFF_DIGEST_LENGTH);
+        }
+
+        rc = write_all(write_output,
+                       offset,
+                       entries,
+                       n * BPAK_CHUNKDIFF_ENTRY_LENGTH,
+                       user_priv);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+
+        offset += n * BPAK_CHUNKDIFF_ENTRY_LENGTH;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (chunks[i].first != i)
+            continue;
+
+        rc = write_all(write_output,
+                       offset,
+                       chunks[i].data,
+                       chunks[i].length,
+                       user_priv);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+
+        offset += chunks[i].length;
+    }
+
+    bpak_printf(1,
+                "chunkdiff: %zu chunks, %llu bytes in the store\n",
+                count,
+                (unsigned long long)store_length);
+
+    rc = offset - output_offset;
+
+err_free_out:
+    bpak_free(chunks);
+    return rc;
+}
@@ -0,0 +1,179 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <string.h>
+#include <bpak/bpak.h>
+#include "chunker.h"
+
+/* Random 64-bit value per byte, splitmix64 seeded with "bpak-cdc". The
+ * table is part of the chunkdiff stream format, chunk boundaries change
+ * if it does. */
+static const uint64_t gear[256] = {
+    0x8a14c818b7072ec7ULL, 0xfe3d4ba4177eaf85ULL, 0x034574f942c68d17ULL,
+    0x7eff0e050486f88bULL, 0xa3c2863aabcfd1a4ULL, 0x338dd5b1f5d38331ULL,
+    0xbc03326603c37a0cULL, 0x36e03380abc161bfULL, 0x2e34506c9841c33dULL,
+    0xb00d98e16721b5b5ULL, 0xc480fc98d9909625ULL, 0x0ec5ebba6a2aac08ULL,
+    0x7da8d1884e2d9364ULL, 0xdd3389a62f4b4511ULL, 0x80f5e38419e539c9ULL,
+    0x4d11b1cad2158a86ULL, 0x8cfbb44e652578eeULL, 0xa3218157fcefba9eULL,
+    0x9e3fc84dfebbd727ULL, 0xc1cd251a5b08cedbULL, 0xf0fde0822f307d19ULL,
+    0xdb67aa716cb2277eULL, 0xe5f50b317f242f69ULL, 0xe585373418565138ULL,
+    0xa0e930a5d0f20c91ULL, 0xc6ce1ce502249fe9ULL, 0x0016c4b8a30b83b4ULL,
+    0xd9b08c47a4c0b308ULL, 0xcdf43a08c7315cf7ULL, 0x10ac1502e883e871ULL,
+    0x75930f291bcc7be0ULL, 0x345c976b0ccc3432ULL, 0xf04e51dba0181854ULL,
+    0xa303f3074364e9b4ULL, 0x27ff4a964f0c5bd6ULL, 0xa662ea1e38e4ad55ULL,
+    0xa20576375a41afdcULL, 0xcddda9da84811332ULL, 0x21ce3f883df03daeULL,
+    0x0f11afb3fee30223ULL, 0xe93bd4f7e50c20e1ULL, 0x390b949276160f92ULL,
+    0x67384a873892178aULL, 0x07f70c21f58651eaULL, 0x076f3741af979d3fULL,
+    0x7e027836af8fe22cULL, 0xeab6f3616a542bf1ULL, 0xad64de964d1f96c2ULL,
+    0xdb7a4d7832bc9836ULL, 0xdabae3f4ef795ce4ULL, 0x8ae8c10fec12211bULL,
+    0xe1a48958e0f72887ULL, 0xfcd8b6722ae1cd47ULL, 0x0b0616d234f13950ULL,
+    0x649460343e2c3800ULL, 0x45c513144e9d3241ULL, 0xc1f368263797983fULL,
+    0x51f218a00197edbdULL, 0xea5940d4741d78b9ULL, 0x539bdbd87c4f5410ULL,
+    0x3be7f8b9acb7fa3bULL, 0x334b18b8c3ef72e8ULL, 0xd1fb010db70eb91fULL,
+    0xee1ca0e5bdf75d7eULL, 0x946d9f42820976b6ULL, 0x9e0702693516a7a8ULL,
+    0x6966dfcf1a1cdc2cULL, 0xa94333861682aa33ULL, 0x457fb129147700cbULL,
+    0x84830a986f3eabb9ULL, 0x959670eaa3a3b773ULL, 0x5b60def34936a116ULL,
+    0xd0c065a844cb2853ULL, 0xe95d03e7a48dcf2aULL, 0x88b43899e342a29aULL,
+    0x42e4efd1103facd3ULL, 0x52dbd396315cb853ULL, 0xc0989845ecba36f1ULL,
+    0x0a9f7416d05b6d28ULL, 0x027a6eca60099ebcULL, 0x9cf2154df278e9e2ULL,
+    0x1f4377da7bba8a0fULL, 0x8bb1e3a408d26fabULL, 0x6252b23e40808773ULL,
+    0x61ac9f09bddf7d60ULL, 0x5a76bd8b9c3f5babULL, 0x2b2198d798611333ULL,
+    0xce27a15e769407c7ULL, 0x5e7d9dffef0e1799ULL, 0x4d1649c87d86f4cbULL,
+    0x0e3e41d9892a1804ULL, 0xeceede0c1628bb72ULL, 0x7d1dd6b40bc946d2ULL,
+    0x5a392e57aa4652a2ULL, 0x37d0648b7065f301ULL, 0xccd2e78615d9259fULL,
+    0x0161ea35491204b8ULL, 0xab77cde68979b8b5ULL, 0xf05b1ac9cfcc8b57ULL,
+    0xc40a796f07025017ULL, 0x3ddf45303d0ca126ULL, 0x35311cbacc55e127ULL,
+    0xfbca2b3519cc072eULL, 0x4e27e24bef85f05bULL, 0x2d783c46679e1dd4ULL,
+    0x17fbcbd01e655b03ULL, 0x7276b3fa335eed9eULL, 0x5f5632730ecef06dULL,
+    0xa349c9ecdbca6500ULL, 0xbbb54db5121eff35ULL, 0x6d545f231e15b4eaULL,
+    0x20e736e9f345aabcULL, 0xd7e9ffeeb855d728ULL, 0x445a177d53889fc5ULL,
+    0xe6492c107a5806c9ULL, 0xe1a8dd627bdea569ULL, 0x667d9e0bbfc9be37ULL,
+    0xb83d87b976fe3d5eULL, 0x48ae3c886e90c065ULL, 0x746962a9f756d3aaULL,
+    0xaa2476ca4b8a9a19ULL, 0xbf745cf34880d98aULL, 0x0342e4f6eac0c23aULL,
+    0xf1b2355437651d94ULL, 0x01064b3ecc41d880ULL, 0xdc6af193aef5943aULL,
+    0x7166641dd1827803ULL, 0x8bf665946206d3a8ULL, 0xee91959ddd8aa54dULL,
+    0xe78d29839563b481ULL, 0xf12ec753d70d608eULL, 0x7166d7329dbcc4e9ULL,
+    0x5dede349d3fe5087ULL, 0x252408c712e4bea4ULL, 0x1e7f0f51596ac406ULL,
+    0xdf7b55873975075aULL, 0xe8390bf2b2824124ULL, 0xca9f5fde7d0a974dULL,
+    0x17c6baf35dee95f1ULL, 0x5d015d1d157207b4ULL, 0x31d9776e616a8710ULL,
+    0x6d0d2b665258cc62ULL, 0x445d9b066c1a31e7ULL, 0x2da933f411c4c3d2ULL,
+    0x095d495f00aa2afeULL, 0xa96dc73164156d91ULL, 0x1e4c9d984eabbf9bULL,
+    0xdda5e037e11e7064ULL, 0x6a278c710f94d489ULL, 0x46b5a0fdd016734eULL,
+    0x8294a828af93188dULL, 0xc8c7d34314bab888ULL, 0x9a375d4904d1b7eeULL,
+    0x7c73ddb1894baca2ULL, 0x99cd10dca905452bULL, 0xb230c2b2c5767a29ULL,
+    0xcf4063196aa1a81bULL, 0xd888c7cb944ed50dULL, 0xfcbf5cb3193ed51aULL,
+    0xc69cfff5f31720f5ULL, 0x839bedbc5b9ffc94ULL, 0xcc9025fcc35b7563ULL,
+    0xf830f0aebc43ed39ULL, 0x16f872f628cec322ULL, 0x3a15747cb16d11a6ULL,
+    0x8df5899d115de669ULL, 0x91b28f464b1f76a4ULL, 0xff0b40f84358e2beULL,
+    0x4da70db604f5e10bULL, 0x6fba5ca3026ab401ULL, 0xd8c4a18d334aca76ULL,
+    0xdfbfcf465c53b8efULL, 0xccb37711725a9b39ULL, 0xb24964b303cd3a08ULL,
+    0x6905ff3d9d4eb959ULL, 0x91c7498dd573e5e1ULL, 0xbe1e8c7c26e6b5c9ULL,
+    0xb9aa228253cc5467ULL, 0xcf338e47c31ab957ULL, 0x00fa2fc541f5079eULL,
+    0xc2935806af2d55dbULL, 0x8cdee8e26785000aULL, 0x6ce0f9f467da0bdeULL,
+    0xdb8584cbcc7fc7cbULL, 0x2fe890617c6086f0ULL, 0xc12ed921738dd1c9ULL,
+    0x8db009a702ca0e0fULL, 0x7125d42e97a34205ULL, 0xcb41902530d7000aULL,
+    0x5ebc9954c59642d7ULL, 0xee2006fb63d7c75bULL, 0x991fde5e7483a8fbULL,
+    0xaf7b14772d68829fULL, 0xb251b48472040491ULL, 0x92da83b892875836ULL,
+    0xb9c3b88b51ef60d0ULL, 0xfe16c7aadd5b44d0ULL, 0x0370d19ce3b39877ULL,
+    0x8c7c88dc654f8082ULL, 0x5fbbfca2c1788c49ULL, 0xa85370a26bb88519ULL,
+    0xb90c70602871a78fULL, 0x831cf96c100d7922ULL, 0x41a21fe97f9111bdULL,
+    0xce4bc77bcc518791ULL, 0xa467027576ff458aULL, 0x70f6450ccf3769e1ULL,
+    0x99ed4f26f25e440fULL, 0xc13c0310050c4284ULL, 0x68ef9ad18a34cc08ULL,
+    0x4889d034ac87faf3ULL, 0x14afd62d58f94cbdULL, 0xe7ecd042c30b89baULL,
+    0xa0c166426a350c85ULL, 0x921e06b21577aca1ULL, 0x89c603085a8ee38dULL,
+    0x779cb07b8e2fe280ULL, 0x57a701db7c4707a0ULL, 0xcdb73540272bf4f9ULL,
+    0x70a9cab9e34c5984ULL, 0x5ca1293f8f17da88ULL, 0x929a9d7e51a75457ULL,
+    0x718a850337ecec3eULL, 0xae850acd319ee333ULL, 0x492f370a853d3d76ULL,
+    0xca7d9c2824d30fd1ULL, 0x4debe633d2e5f1ddULL, 0x68be018a80861ce3ULL,
+    0x246ff8fa01398a2eULL, 0x1547d34d83402cb5ULL, 0x6bbe40a866084e48ULL,
+    0x8e90fcdcda4dca8cULL, 0x0fb6c039ab52e7edULL, 0x68f996acf7f98444ULL,
+    0xb6e7b271b45bc488ULL, 0x481165a27a9b1ee8ULL, 0xc470587668489fedULL,
+    0x7b40ee2b8517e6c5ULL, 0x3a417be03666b099ULL, 0x765eae3c46fdde34ULL,
+    0x04e14614c7d91bb3ULL, 0x77474d8314491844ULL, 0xd0cf8afd94fcfd93ULL,
+    0x0c793a81493131acULL, 0x1e34174b03eb416eULL, 0x703bda11952090c3ULL,
+    0x07a62fa54f447b2aULL, 0xa740e30ceeb8e985ULL, 0x6d8c9f75f41ef17eULL,
+    0xa9cc9125af4787e0ULL, 0xfd6dee86657b9eb3ULL, 0x373991ebbc7ca410ULL,
+    0x58bc9066906a1df0ULL, 0xead4452a7071140fULL, 0x1aa613fd847d46c1ULL,
+    0x79fe16eec253f4c3ULL,
+};
+
+/* 'bits' zero bits at the top of the hash, where the gear hash depends on
+ * the most bytes */
+static uint64_t top_mask(unsigned int bits)
+{
+    return ~0ULL << (64 - bits);
+}
+
+int chunker_init(struct chunker *chunker, size_t min_size,
+                 unsigned int avg_bits, size_t max_size)
+{
+    if ((avg_bits < 8) || (avg_bits > 24))
+        return -BPAK_NOT_SUPPORTED;
+
+    memset(chunker, 0, sizeof(*chunker));
+    chunker->min_size = min_size;
+    chunker->avg_size = (size_t)1 << avg_bits;
+    chunker->max_size = max_size;
+    chunker->mask_small = top_mask(avg_bits + 2);
+    chunker->mask_large = top_mask(avg_bits - 2);
+
+    /* The boundaries only depend on the content after 64 bytes */
+    if ((min_size < 64) || (min_size >= chunker->avg_size) ||
+        (max_size <= chunker->avg_size))
+        return -BPAK_NOT_SUPPORTED;
+
+    return BPAK_OK;
+}
+
+size_t chunker_scan(struct chunker *chunker, const uint8_t *data,
+                    size_t length, bool *cut)
+{
+    uint64_t hash = chunker->hash;
+    size_t pos = 0;
+    size_t n;
+
+    *cut = false;
+
+    /* Nothing can be cut before the minimum size, only the last 64 bytes
+     * of it go into the hash */
+    if (chunker->length < chunker->min_size) {
+        n = BPAK_MIN(length, chunker->min_size - chunker->length);
+
+        for (size_t i = (n > 64) ? (n - 64) : 0; i < n; i++)
+            hash = (hash << 1) + gear[data[i]];
+
+        pos = n;
+        chunker->length += n;
+    }
+
+    while ((pos < length) && (chunker->length < chunker->max_size)) {
+        uint64_t mask = (chunker->length < chunker->avg_size) ?
+                            chunker->mask_small :
+                            chunker->mask_large;
+
+        hash = (hash << 1) + gear[data[pos++]];
+        chunker->length++;
+
+        if ((hash & mask) == 0) {
+            *cut = true;
+            break;
+        }
+    }
+
+    if (chunker->length == chunker->max_size)
+        *cut = true;
+
+    if (*cut) {
+        chunker->length = 0;
+        hash = 0;
+    }
+
+    chunker->hash = hash;
+    return pos;
+}
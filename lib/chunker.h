@@ -0,0 +1,33 @@
+#ifndef LIB_CHUNKER_H_
+#define LIB_CHUNKER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Content-defined chunking with a gear rolling hash, as in FastCDC. A cut
+ * only depends on the last 64 bytes once a chunk is longer than that, so
+ * an insert or a removal moves the boundaries close to it and the rest of
+ * the data is split the same way as before. Before the average size is
+ * reached a cut needs two more zero bits, after it two less, which keeps
+ * the chunk sizes close to the average. */
+struct chunker {
+    uint64_t hash;
+    uint64_t mask_small; /* Cut mask below the average size */
+    uint64_t mask_large; /* Cut mask from the average size on */
+    size_t length;       /* Bytes in the current chunk */
+    size_t min_size;
+    size_t avg_size;
+    size_t max_size;
+};
+
+/* Returns BPAK_OK or -BPAK_NOT_SUPPORTED for sizes that can't be used */
+int chunker_init(struct chunker *chunker, size_t min_size,
+                 unsigned int avg_bits, size_t max_size);
+
+/* Returns how many bytes of 'data' belong to the current chunk, sets *cut
+ * when the chunk ends after them. The next call starts a new chunk. */
+size_t chunker_scan(struct chunker *chunker, const uint8_t *data,
+                    size_t length, bool *cut);
+
+#endif
@@ -0,0 +1,584 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/crypto.h>
+#include <bpak/chunkpatch.h>
+#include "chunker.h"
+
+/* Block overhead of the two allocations in a struct bpak_arena */
+#define CHUNKPATCH_HEAP_MARGIN 128
+
+static uint64_t get_le(const uint8_t *buf, int length)
+{
+    uint64_t value = 0;
+
+    for (int i = length - 1; i >= 0; i--)
+        value = (value << 8) | buf[i];
+
+    return value;
+}
+
+static int entry_compare(const void *a_p, const void *b_p)
+{
+    const struct bpak_chunkpatch_entry *a =
+        *(const struct bpak_chunkpatch_entry *const *)a_p;
+    const struct bpak_chunkpatch_entry *b =
+        *(const struct bpak_chunkpatch_entry *const *)b_p;
+
+    return memcmp(a->digest, b->digest, sizeof(a->digest));
+}
+
+static int digest_compare(const void *key, const void *elem)
+{
+    const struct bpak_chunkpatch_entry *e =
+        *(const struct bpak_chunkpatch_entry *const *)elem;
+
+    return memcmp(key, e->digest, sizeof(e->digest));
+}
+
+static int store_offset_compare(const void *key, const void *elem)
+{
+    uint64_t store_offset = *(const uint64_t *)key;
+    const struct bpak_chunkpatch_entry *e =
+        *(const struct bpak_chunkpatch_entry *const *)elem;
+
+    if (store_offset != e->store_offset)
+        return (store_offset < e->store_offset) ? -1 : 1;
+    return 0;
+}
+
+static int init_chunker(struct bpak_chunkpatch_context *ctx,
+                        struct chunker *chunker)
+{
+    return chunker_init(chunker,
+                        get_le(&ctx->header[16], 4),
+                        ctx->header[24],
+                        get_le(&ctx->header[20], 4));
+}
+
+static int write_output(struct bpak_chunkpatch_context *ctx,
+                        uint8_t *buffer, size_t length)
+{
+    ssize_t bytes_written = ctx->write_output(ctx->output_offset +
+                                                  ctx->output_position,
+                                              buffer,
+                                              length,
+                                              ctx->user_priv);
+
+    if (bytes_written < 0)
+        return bytes_written;
+    if (bytes_written != (ssize_t)length)
+        return -BPAK_PATCH_WRITE_ERROR;
+
+    ctx->output_position += length;
+    return BPAK_OK;
+}
+
+static int copy_data(struct bpak_chunkpatch_context *ctx, bpak_io_t read,
+                     off_t offset, uint64_t length)
+{
+    int rc;
+
+    while (length > 0) {
+        size_t chunk_length = BPAK_MIN(length, ctx->buffer_length);
+        ssize_t bytes_read =
+            read(offset, ctx->buffer, chunk_length, ctx->user_priv);
+
+        if (bytes_read != (ssize_t)chunk_length) {
+            bpak_printf(0,
+                        "Error: Could not read chunk data at %lli\n",
+                        (long long)offset);
+            return -BPAK_PATCH_READ_ORIGIN_ERROR;
+        }
+
+        rc = write_output(ctx, ctx->buffer, chunk_length);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        offset += chunk_length;
+        length -= chunk_length;
+    }
+
+    return BPAK_OK;
+}
+
+/* Write the entries that don't need store data, up to the next one that
+ * does */
+static int advance(struct bpak_chunkpatch_context *ctx)
+{
+    int rc;
+
+    while (ctx->current < ctx->count) {
+        struct bpak_chunkpatch_entry *e = &ctx->entries[ctx->current];
+
+        if (e->source == BPAK_CHUNKPATCH_STORE)
+            return BPAK_OK;
+
+        if (e->source == BPAK_CHUNKPATCH_ORIGIN) {
+            rc = copy_data(ctx,
+                           ctx->read_origin,
+                           ctx->origin_offset + e->source_offset,
+                           e->length);
+            ctx->origin_chunk_bytes += e->length;
+        } else {
+            rc = copy_data(ctx,
+                           ctx->read_output,
+                           ctx->output_offset + e->source_offset,
+                           e->length);
+        }
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        ctx->current++;
+    }
+
+    return BPAK_OK;
+}
+
+/* Entries with the same digest as the origin chunk at 'position' are
+ * copied from the origin */
+static void match_chunk(struct bpak_chunkpatch_entry **order, size_t count,
+                        const uint8_t *digest, uint64_t position,
+                        uint64_t length)
+{
+    struct bpak_chunkpatch_entry **hit =
+        bsearch(digest, order, count, sizeof(*order), digest_compare);
+
+    if (hit == NULL)
+        return;
+
+    while ((hit > order) && (digest_compare(digest, hit - 1) == 0))
+        hit--;
+
+    for (; (hit < &order[count]) && (digest_compare(digest, hit) == 0);
+         hit++) {
+        struct bpak_chunkpatch_entry *e = *hit;
+
+        if ((e->length != length) || (e->source == BPAK_CHUNKPATCH_ORIGIN))
+            continue;
+
+        e->source = BPAK_CHUNKPATCH_ORIGIN;
+        e->source_offset = position;
+    }
+}
+
+/* Split the origin the same way as the target was and look up every
+ * origin chunk in 'order', which is sorted by digest */
+static int match_origin(struct bpak_chunkpatch_context *ctx,
+                        struct bpak_chunkpatch_entry **order)
+{
+    int rc;
+    struct chunker chunker;
+    struct bpak_hash_context hash;
+    uint8_t digest[BPAK_CHUNKDIFF_DIGEST_LENGTH];
+    bool hashing = false;
+    uint64_t chunk_start = 0;
+    uint64_t pos = 0;
+
+    rc = init_chunker(ctx, &chunker);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    while (pos < ctx->origin_length) {
+        size_t n = BPAK_MIN(ctx->buffer_length, ctx->origin_length - pos);
+        ssize_t bytes_read = ctx->read_origin(ctx->origin_offset + pos,
+                                              ctx->buffer,
+                                              n,
+                                              ctx->user_priv);
+
+        if (bytes_read != (ssize_t)n) {
+            rc = -BPAK_PATCH_READ_ORIGIN_ERROR;
+            goto err_out;
+        }
+
+        for (size_t p = 0; p < n;) {
+            bool cut;
+
+            if (!hashing) {
+                rc = bpak_hash_init(&hash, BPAK_HASH_SHA256);
+
+                if (rc != BPAK_OK)
+                    return rc;
+
+                hashing = true;
+            }
+
+            size_t k = chunker_scan(&chunker, &ctx->buffer[p], n - p, &cut);
+
+            rc = bpak_hash_update(&hash, &ctx->buffer[p], k);
+
+            if (rc != BPAK_OK)
+                goto err_out;
+
+            p += k;
+
+            if (!cut)
+                continue;
+
+            rc = bpak_hash_final(&hash, digest, sizeof(digest), NULL);
+            bpak_hash_free(&hash);
+            hashing = false;
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            match_chunk(order,
+                        ctx->count,
+                        digest,
+                        chunk_start,
+                        pos + p - chunk_start);
+            chunk_start = pos + p;
+        }
+
+        pos += n;
+    }
+
+    if (hashing) {
+        rc = bpak_hash_final(&hash, digest, sizeof(digest), NULL);
+
+        if (rc == BPAK_OK)
+            match_chunk(order,
+                        ctx->count,
+                        digest,
+                        chunk_start,
+                        pos - chunk_start);
+    }
+
+err_out:
+    if (hashing)
+        bpak_hash_free(&hash);
+    return rc;
+}
+
+/* Check the index and decide where the data of every chunk comes from.
+ * Chunks that start a new store range are taken from the store, repeated
+ * chunks from their first position in the output, unless the origin has
+ * a chunk with the same digest. */
+static int prepare(struct bpak_chunkpatch_context *ctx)
+{
+    int rc = BPAK_OK;
+    uint64_t store_end = 0;
+    uint64_t output_end = 0;
+    size_t first_count = 0;
+    struct bpak_chunkpatch_entry **order = NULL;
+
+    if (ctx->count > 0) {
+        order = bpak_allocator_calloc(ctx->allocator,
+                                      ctx->count,
+                                      sizeof(*order));
+
+        if (order == NULL)
+            return -BPAK_FAILED;
+    }
+
+    for (uint32_t i = 0; i < ctx->count; i++) {
+        struct bpak_chunkpatch_entry *e = &ctx->entries[i];
+
+        if ((e->length == 0) || (e->length > get_le(&ctx->header[20], 4)))
+            goto err_invalid;
+
+        if (e->store_offset == store_end) {
+            e->source = BPAK_CHUNKPATCH_STORE;
+            e->source_offset = output_end;
+            store_end += e->length;
+            order[first_count++] = e;
+        } else {
+            struct bpak_chunkpatch_entry **first;
+
+            first = bsearch(&e->store_offset,
+                            order,
+                            first_count,
+                            sizeof(*order),
+                            store_offset_compare);
+
+            if ((first == NULL) || ((*first)->length != e->length) ||
+                memcmp((*first)->digest, e->digest, sizeof(e->digest)))
+                goto err_invalid;
+
+            e->source = BPAK_CHUNKPATCH_OUTPUT;
+            e->source_offset = (*first)->source_offset;
+        }
+
+        output_end += e->length;
+    }
+
+    if ((output_end != get_le(&ctx->header[8], 8)) ||
+        (store_end > ctx->input_length - ctx->store_start))
+        goto err_invalid;
+
+    if ((ctx->read_origin != NULL) && (ctx->origin_length > 0) &&
+        (ctx->count > 0)) {
+        for (uint32_t i = 0; i < ctx->count; i++)
+            order[i] = &ctx->entries[i];
+
+        qsort(order, ctx->count, sizeof(*order), entry_compare);
+        rc = match_origin(ctx, order);
+    }
+
+    for (uint32_t i = 0; (rc == BPAK_OK) && (i < ctx->count); i++) {
+        if ((ctx->entries[i].source == BPAK_CHUNKPATCH_OUTPUT) &&
+            (ctx->read_output == NULL)) {
+            bpak_printf(0, "Error: Repeated chunks need read_output\n");
+            rc = -BPAK_NOT_SUPPORTED;
+        }
+    }
+
+    bpak_allocator_free(ctx->allocator, order);
+
+    if (rc == BPAK_OK) {
+        ctx->ready = true;
+        rc = advance(ctx);
+    }
+
+    return rc;
+
+err_invalid:
+    bpak_printf(0, "Error: Invalid chunk index\n");
+    bpak_allocator_free(ctx->allocator, order);
+    return -BPAK_SIZE_ERROR;
+}
+
+static int parse_header(struct bpak_chunkpatch_context *ctx)
+{
+    struct chunker chunker;
+
+    if (get_le(&ctx->header[0], 4) != BPAK_CHUNKDIFF_MAGIC) {
+        bpak_printf(0, "Error: Bad chunkdiff magic\n");
+        return -BPAK_BAD_MAGIC;
+    }
+
+    ctx->count = get_le(&ctx->header[4], 4);
+    ctx->store_start = BPAK_CHUNKDIFF_HEADER_LENGTH +
+                       (uint64_t)ctx->count * BPAK_CHUNKDIFF_ENTRY_LENGTH;
+
+    if (ctx->store_start > ctx->input_length) {
+        bpak_printf(0, "Error: The chunk index is truncated\n");
+        return -BPAK_SIZE_ERROR;
+    }
+
+    if (init_chunker(ctx, &chunker) != BPAK_OK) {
+        bpak_printf(0, "Error: Unsupported chunk sizes\n");
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    if (ctx->count == 0)
+        return prepare(ctx);
+
+    ctx->entries = bpak_allocator_calloc(ctx->allocator,
+                                         ctx->count,
+                                         sizeof(*ctx->entries));
+
+    if (ctx->entries == NULL)
+        return -BPAK_FAILED;
+
+    return BPAK_OK;
+}
+
+static int parse_entry(struct bpak_chunkpatch_context *ctx)
+{
+    struct bpak_chunkpatch_entry *e = &ctx->entries[ctx->entries_read++];
+
+    e->store_offset = get_le(&ctx->entry_buf[0], 8);
+    e->length = get_le(&ctx->entry_buf[8], 4);
+    memcpy(e->digest, &ctx->entry_buf[12], sizeof(e->digest));
+
+    if (ctx->entries_read == ctx->count)
+        return prepare(ctx);
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_chunkpatch_init(struct bpak_chunkpatch_context *ctx,
+                                     uint8_t *buffer, size_t buffer_length,
+                                     size_t input_length,
+                                     bpak_io_t read_origin,
+                                     off_t origin_offset,
+                                     size_t origin_length,
+                                     bpak_io_t write_output,
+                                     bpak_io_t read_output,
+                                     off_t output_offset, void *user_priv)
+{
+    if ((buffer == NULL) || (buffer_length == 0))
+        return -BPAK_BUFFER_TOO_SMALL;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->buffer = buffer;
+    ctx->buffer_length = buffer_length;
+    ctx->input_length = input_length;
+    ctx->read_origin = read_origin;
+    ctx->origin_offset = origin_offset;
+    ctx->origin_length = origin_length;
+    ctx->write_output = write_output;
+    ctx->read_output = read_output;
+    ctx->output_offset = output_offset;
+    ctx->user_priv = user_priv;
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_chunkpatch_set_allocator(struct bpak_chunkpatch_context *ctx,
+                              const struct bpak_allocator *allocator)
+{
+    if (ctx->input_position > 0)
+        return -BPAK_FAILED;
+
+    ctx->allocator = allocator;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT size_t bpak_chunkpatch_heap_size(uint32_t chunk_count)
+{
+    return (size_t)chunk_count * (sizeof(struct bpak_chunkpatch_entry) +
+                                  sizeof(struct bpak_chunkpatch_entry *)) +
+           CHUNKPATCH_HEAP_MARGIN;
+}
+
+BPAK_EXPORT int bpak_chunkpatch_write(struct bpak_chunkpatch_context *ctx,
+                                      uint8_t *buffer, size_t length)
+{
+    int rc = BPAK_OK;
+
+    while ((length > 0) && (rc == BPAK_OK)) {
+        size_t n;
+
+        if (ctx->input_position < BPAK_CHUNKDIFF_HEADER_LENGTH) {
+            n = BPAK_MIN(length,
+                         BPAK_CHUNKDIFF_HEADER_LENGTH - ctx->input_position);
+            memcpy(&ctx->header[ctx->input_position], buffer, n);
+
+            if (ctx->input_position + n == BPAK_CHUNKDIFF_HEADER_LENGTH)
+                rc = parse_header(ctx);
+        } else if (!ctx->ready) {
+            size_t in_entry = (ctx->input_position -
+                               BPAK_CHUNKDIFF_HEADER_LENGTH) %
+                              BPAK_CHUNKDIFF_ENTRY_LENGTH;
+
+            n = BPAK_MIN(length, BPAK_CHUNKDIFF_ENTRY_LENGTH - in_entry);
+            memcpy(&ctx->entry_buf[in_entry], buffer, n);
+
+            if (in_entry + n == BPAK_CHUNKDIFF_ENTRY_LENGTH)
+                rc = parse_entry(ctx);
+        } else if (ctx->current == ctx->count) {
+            /* Store chunks after the last needed one */
+            n = length;
+        } else {
+            struct bpak_chunkpatch_entry *e = &ctx->entries[ctx->current];
+            uint64_t want =
+                ctx->store_start + e->store_offset + ctx->current_done;
+
+            if (ctx->input_position > want) {
+                bpak_printf(0, "Error: Chunk store data was skipped\n");
+                return -BPAK_SIZE_ERROR;
+            }
+
+            if (ctx->input_position < want) {
+                /* This store chunk is in the origin */
+                n = BPAK_MIN(length, want - ctx->input_position);
+            } else {
+                n = BPAK_MIN(length, e->length - ctx->current_done);
+                rc = write_output(ctx, buffer, n);
+                ctx->current_done += n;
+                ctx->store_bytes += n;
+
+                if ((rc == BPAK_OK) && (ctx->current_done == e->length)) {
+                    ctx->current++;
+                    ctx->current_done = 0;
+                    rc = advance(ctx);
+                }
+            }
+        }
+
+        ctx->input_position += n;
+        buffer += n;
+        length -= n;
+    }
+
+    return rc;
+}
+
+BPAK_EXPORT int bpak_chunkpatch_next_input(struct bpak_chunkpatch_context *ctx,
+                                           uint64_t *offset, uint64_t *length)
+{
+    struct bpak_chunkpatch_entry *e;
+    uint64_t end;
+
+    if (ctx->input_position < BPAK_CHUNKDIFF_HEADER_LENGTH) {
+        *offset = ctx->input_position;
+        *length = BPAK_CHUNKDIFF_HEADER_LENGTH - ctx->input_position;
+        return BPAK_OK;
+    }
+
+    if (!ctx->ready) {
+        *offset = ctx->input_position;
+        *length = ctx->store_start - ctx->input_position;
+        return BPAK_OK;
+    }
+
+    if (ctx->current == ctx->count) {
+        if (ctx->input_position < ctx->input_length)
+            ctx->input_position = ctx->input_length;
+
+        *offset = ctx->input_position;
+        *length = 0;
+        return BPAK_OK;
+    }
+
+    e = &ctx->entries[ctx->current];
+    *offset = ctx->store_start + e->store_offset + ctx->current_done;
+    end = ctx->store_start + e->store_offset + e->length;
+
+    if (*offset < ctx->input_position)
+        return -BPAK_SIZE_ERROR;
+
+    /* Store chunks that follow each other are fetched as one range */
+    for (uint32_t i = ctx->current + 1; i < ctx->count; i++) {
+        e = &ctx->entries[i];
+
+        if (e->source != BPAK_CHUNKPATCH_STORE)
+            continue;
+        if (ctx->store_start + e->store_offset != end)
+            break;
+
+        end += e->length;
+    }
+
+    ctx->input_position = *offset;
+    *length = end - *offset;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT ssize_t bpak_chunkpatch_final(struct bpak_chunkpatch_context *ctx)
+{
+    if (!ctx->ready || (ctx->current != ctx->count)) {
+        bpak_printf(0, "Error: Chunkpatch input ended before the output\n");
+        return -BPAK_SIZE_ERROR;
+    }
+
+    bpak_printf(1,
+                "chunkpatch: %u chunks, %llu bytes from the origin, "
+                "%llu bytes from the store\n",
+                ctx->count,
+                (unsigned long long)ctx->origin_chunk_bytes,
+                (unsigned long long)ctx->store_bytes);
+
+    return ctx->output_position;
+}
+
+BPAK_EXPORT void bpak_chunkpatch_free(struct bpak_chunkpatch_context *ctx)
+{
+    bpak_allocator_free(ctx->allocator, ctx->entries);
+    ctx->entries = NULL;
+}
@@ -4,10 +4,32 @@
 
 #if BPAK_CONFIG_MBEDTLS == 1
 #include "mbedtls_wrapper.h"
+#endif
+#if BPAK_CONFIG_SHA == 1
+#include "sha.h"
+#endif
+
+#if BPAK_CONFIG_SHA == 1
+static bpak_hash_init_func_t _hash_init = bpak_sha_hash_init;
+static bpak_hash_update_func_t _hash_update = bpak_sha_hash_update;
+static bpak_hash_final_func_t _hash_final = bpak_sha_hash_final;
+static bpak_hash_free_func_t _hash_free = bpak_sha_hash_free;
+static bpak_hash_clone_func_t _hash_clone = bpak_sha_hash_clone;
+#elif BPAK_CONFIG_MBEDTLS == 1
 static bpak_hash_init_func_t _hash_init = bpak_mbed_hash_init;
 static bpak_hash_update_func_t _hash_update = bpak_mbed_hash_update;
 static bpak_hash_final_func_t _hash_final = bpak_mbed_hash_final;
 static bpak_hash_free_func_t _hash_free = bpak_mbed_hash_free;
+static bpak_hash_clone_func_t _hash_clone = bpak_mbed_hash_clone;
+#else
+static bpak_hash_init_func_t _hash_init = NULL;
+static bpak_hash_update_func_t _hash_update = NULL;
+static bpak_hash_final_func_t _hash_final = NULL;
+static bpak_hash_free_func_t _hash_free = NULL;
+static bpak_hash_clone_func_t _hash_clone = NULL;
+#endif
+
+#if BPAK_CONFIG_MBEDTLS == 1
 static bpak_crypto_verify_func_t _crypto_verify = bpak_mbed_verify;
 static bpak_crypto_sign_func_t _crypto_sign = bpak_mbed_sign;
 static bpak_crypto_load_key_func_t _crypto_load_public_key =
@@ -16,16 +38,26 @@ static bpak_crypto_load_key_func_t _crypto_load_private_key =
     bpak_mbed_load_private_key;
 static bpak_crypto_parse_key_func_t _crypto_parse_public_key =
     bpak_mbed_parse_public_key;
+static bpak_crypto_prepare_key_func_t _crypto_prepare_key =
+    bpak_mbed_prepare_key;
+static bpak_crypto_verify_prepared_func_t _crypto_verify_prepared =
+    bpak_mbed_verify_prepared;
+static bpak_crypto_free_key_func_t _crypto_free_key = bpak_mbed_free_key;
+static bpak_crypto_prepare_key_func_t _crypto_prepare_sign_key =
+    bpak_mbed_prepare_sign_key;
+static bpak_crypto_sign_prepared_func_t _crypto_sign_prepared =
+    bpak_mbed_sign_prepared;
 #else
-static bpak_hash_init_func_t _hash_init = NULL;
-static bpak_hash_update_func_t _hash_update = NULL;
-static bpak_hash_final_func_t _hash_final = NULL;
-static bpak_hash_free_func_t _hash_free = NULL;
 static bpak_crypto_verify_func_t _crypto_verify = NULL;
 static bpak_crypto_sign_func_t _crypto_sign = NULL;
 static bpak_crypto_load_key_func_t _crypto_load_public_key = NULL;
 static bpak_crypto_load_key_func_t _crypto_load_private_key = NULL;
 static bpak_crypto_parse_key_func_t _crypto_parse_public_key = NULL;
+static bpak_crypto_prepare_key_func_t _crypto_prepare_key = NULL;
+static bpak_crypto_verify_prepared_func_t _crypto_verify_prepared = NULL;
+static bpak_crypto_free_key_func_t _crypto_free_key = NULL;
+static bpak_crypto_prepare_key_func_t _crypto_prepare_sign_key = NULL;
+static bpak_crypto_sign_prepared_func_t _crypto_sign_prepared = NULL;
 #endif
 
 BPAK_EXPORT int bpak_hash_init(struct bpak_hash_context *ctx,
@@ -69,8 +101,33 @@ BPAK_EXPORT void bpak_hash_setup(bpak_hash_init_func_t init_func,
     _hash_update = update_func;
     _hash_final = final_func;
     _hash_free = free_func;
+    _hash_clone = NULL;
 }
 
+BPAK_EXPORT int bpak_hash_clone(struct bpak_hash_context *dst,
+                                const struct bpak_hash_context *src)
+{
+    if (_hash_clone == NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    dst->kind = src->kind;
+    return _hash_clone(dst, src);
+}
+
+BPAK_EXPORT void bpak_hash_clone_setup(bpak_hash_clone_func_t clone_func)
+{
+    _hash_clone = clone_func;
+}
+
+#if BPAK_CONFIG_SHA == 1
+bool bpak_hash_is_builtin(void)
+{
+    return (_hash_init == bpak_sha_hash_init) &&
+           (_hash_update == bpak_sha_hash_update) &&
+           (_hash_final == bpak_sha_hash_final);
+}
+#endif
+
 BPAK_EXPORT int bpak_crypto_verify(const uint8_t *signature,
                                    size_t signature_length, const uint8_t *hash,
                                    size_t hash_length, enum bpak_hash_kind kind,
@@ -87,6 +144,90 @@ BPAK_EXPORT int bpak_crypto_verify(const uint8_t *signature,
                           verified);
 }
 
+BPAK_EXPORT int bpak_crypto_prepare_key(struct bpak_prepared_key *prepared,
+                                        struct bpak_key *key)
+{
+    prepared->key = key;
+    prepared->backend = NULL;
+
+    if (_crypto_prepare_key == NULL)
+        return BPAK_OK;
+
+    return _crypto_prepare_key(key, &prepared->backend);
+}
+
+BPAK_EXPORT int
+bpak_crypto_verify_prepared(const uint8_t *signature, size_t signature_length,
+                            const uint8_t *hash, size_t hash_length,
+                            enum bpak_hash_kind kind,
+                            struct bpak_prepared_key *prepared, bool *verified)
+{
+    if (prepared->backend == NULL) {
+        return bpak_crypto_verify(signature,
+                                  signature_length,
+                                  hash,
+                                  hash_length,
+                                  kind,
+                                  prepared->key,
+                                  verified);
+    }
+
+    (*verified) = false;
+    return _crypto_verify_prepared(signature,
+                                   signature_length,
+                                   hash,
+                                   hash_length,
+                                   kind,
+                                   prepared->backend,
+                                   verified);
+}
+
+BPAK_EXPORT int
+bpak_crypto_prepare_sign_key(struct bpak_prepared_key *prepared,
+                             struct bpak_key *key)
+{
+    prepared->key = key;
+    prepared->backend = NULL;
+
+    if (_crypto_prepare_sign_key == NULL)
+        return BPAK_OK;
+
+    return _crypto_prepare_sign_key(key, &prepared->backend);
+}
+
+BPAK_EXPORT int bpak_crypto_sign_prepared(const uint8_t *hash,
+                                          size_t hash_length,
+                                          enum bpak_hash_kind kind,
+                                          struct bpak_prepared_key *prepared,
+                                          uint8_t *signature,
+                                          size_t *signature_length)
+{
+    if (prepared->backend == NULL) {
+        return bpak_crypto_sign(hash,
+                                hash_length,
+                                kind,
+                                prepared->key,
+                                signature,
+                                signature_length);
+    }
+
+    return _crypto_sign_prepared(hash,
+                                 hash_length,
+                                 kind,
+                                 prepared->backend,
+                                 signature,
+                                 signature_length);
+}
+
+BPAK_EXPORT void
+bpak_crypto_free_prepared_key(struct bpak_prepared_key *prepared)
+{
+    if ((prepared->backend != NULL) && (_crypto_free_key != NULL))
+        _crypto_free_key(prepared->backend);
+
+    prepared->backend = NULL;
+}
+
 BPAK_EXPORT int bpak_crypto_sign(const uint8_t *hash, size_t hash_length,
                                  enum bpak_hash_kind kind, struct bpak_key *key,
                                  uint8_t *signature, size_t *signature_length)
@@ -138,4 +279,27 @@ bpak_crypto_setup(bpak_crypto_verify_func_t verify_func,
     _crypto_load_public_key = load_pub_key_func;
     _crypto_load_private_key = load_pri_key_func;
     _crypto_parse_public_key = parse_pub_key_func;
+    _crypto_prepare_key = NULL;
+    _crypto_verify_prepared = NULL;
+    _crypto_free_key = NULL;
+    _crypto_prepare_sign_key = NULL;
+    _crypto_sign_prepared = NULL;
+}
+
+BPAK_EXPORT void
+bpak_crypto_prepared_setup(bpak_crypto_prepare_key_func_t prepare_func,
+                           bpak_crypto_verify_prepared_func_t verify_func,
+                           bpak_crypto_free_key_func_t free_func)
+{
+    _crypto_prepare_key = prepare_func;
+    _crypto_verify_prepared = verify_func;
+    _crypto_free_key = free_func;
+}
+
+BPAK_EXPORT void bpak_crypto_prepared_sign_setup(
+    bpak_crypto_prepare_key_func_t prepare_func,
+    bpak_crypto_sign_prepared_func_t sign_func)
+{
+    _crypto_prepare_sign_key = prepare_func;
+    _crypto_sign_prepared = sign_func;
 }
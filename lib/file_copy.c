@@ -0,0 +1,366 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/* copy_file_range, fallocate and loff_t */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <bpak/bpak.h>
+#include "file_copy.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#define FILE_COPY_SENDFILE 1
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 27))
+#define FILE_COPY_RANGE 1
+#endif
+#endif
+
+/* Buffer size of the stdio fallback */
+#define FILE_COPY_BUFFER_LENGTH (1024 * 1024)
+
+/* Limit each kernel copy call, some kernels return EINVAL above 2 GiB */
+#define FILE_COPY_MAX_CHUNK (1024 * 1024 * 1024)
+
+struct file_copy {
+    int in_fd;
+    int out_fd;
+    off_t in_offset;
+    off_t out_offset; /* Negative when the output position is used */
+    uint64_t length;  /* Bytes left to copy */
+};
+
+#if defined(FILE_COPY_RANGE)
+static int file_copy_range(struct file_copy *c)
+{
+    while (c->length > 0) {
+        size_t chunk = BPAK_MIN(c->length, (uint64_t)FILE_COPY_MAX_CHUNK);
+        loff_t in_offset = c->in_offset;
+        loff_t out_offset = c->out_offset;
+        ssize_t n = copy_file_range(c->in_fd,
+                                    &in_offset,
+                                    c->out_fd,
+                                    (c->out_offset < 0) ? NULL : &out_offset,
+                                    chunk,
+                                    0);
+
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n < 0)
+            return -BPAK_NOT_SUPPORTED;
+        if (n == 0)
+            return -BPAK_READ_ERROR;
+
+        c->in_offset += n;
+        if (c->out_offset >= 0)
+            c->out_offset += n;
+        c->length -= n;
+    }
+
+    return BPAK_OK;
+}
+#endif
+
+#if defined(FILE_COPY_SENDFILE)
+static int file_copy_sendfile(struct file_copy *c)
+{
+    /* sendfile writes at the output file position */
+    if ((c->out_offset >= 0) &&
+        (lseek(c->out_fd, c->out_offset, SEEK_SET) != c->out_offset)) {
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    while (c->length > 0) {
+        size_t chunk = BPAK_MIN(c->length, (uint64_t)FILE_COPY_MAX_CHUNK);
+        off_t in_offset = c->in_offset;
+        ssize_t n = sendfile(c->out_fd, c->in_fd, &in_offset, chunk);
+
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n < 0)
+            return -BPAK_NOT_SUPPORTED;
+        if (n == 0)
+            return -BPAK_READ_ERROR;
+
+        c->in_offset += n;
+        if (c->out_offset >= 0)
+            c->out_offset += n;
+        c->length -= n;
+    }
+
+    return BPAK_OK;
+}
+#endif
+
+static int file_copy_buffered(FILE *in, FILE *out, struct file_copy *c)
+{
+    int rc = BPAK_OK;
+    uint8_t chunk_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    uint8_t *buf = bpak_calloc(1, FILE_COPY_BUFFER_LENGTH);
+    size_t buf_length = FILE_COPY_BUFFER_LENGTH;
+
+    if (buf == NULL) {
+        buf = chunk_buffer;
+        buf_length = sizeof(chunk_buffer);
+    }
+
+    if (fseek(in, c->in_offset, SEEK_SET) != 0) {
+        rc = -BPAK_SEEK_ERROR;
+        goto err_free_out;
+    }
+
+    if ((c->out_offset >= 0) && (fseek(out, c->out_offset, SEEK_SET) != 0)) {
+        rc = -BPAK_SEEK_ERROR;
+        goto err_free_out;
+    }
+
+    while (c->length > 0) {
+        size_t chunk = BPAK_MIN(c->length, (uint64_t)buf_length);
+
+        if (fread(buf, 1, chunk, in) != chunk) {
+            bpak_printf(0, "Error: Could not read chunk\n");
+            rc = -BPAK_READ_ERROR;
+            goto err_free_out;
+        }
+
+        if (fwrite(buf, 1, chunk, out) != chunk) {
+            bpak_printf(0, "Error: Could not write chunk\n");
+            rc = -BPAK_WRITE_ERROR;
+            goto err_free_out;
+        }
+
+        c->length -= chunk;
+    }
+
+err_free_out:
+    if (buf != chunk_buffer)
+        bpak_free(buf);
+    return rc;
+}
+
+int bpak_file_copy(FILE *in, off_t in_offset, FILE *out, off_t out_offset,
+                   uint64_t length)
+{
+    int rc = -BPAK_NOT_SUPPORTED;
+    const char *method = NULL;
+    struct file_copy c = {
+        .in_fd = fileno(in),
+        .out_fd = fileno(out),
+        .in_offset = in_offset,
+        .out_offset = out_offset,
+        .length = length,
+    };
+
+    /* The kernel copies operate on the descriptors */
+    if ((fflush(in) != 0) || (fflush(out) != 0))
+        return -BPAK_WRITE_ERROR;
+
+#if defined(FILE_COPY_RANGE)
+    rc = file_copy_range(&c);
+    method = "copy_file_range";
+#endif
+#if defined(FILE_COPY_SENDFILE)
+    if (rc == -BPAK_NOT_SUPPORTED) {
+        rc = file_copy_sendfile(&c);
+        method = "sendfile";
+    }
+#endif
+
+    if (rc == -BPAK_NOT_SUPPORTED) {
+        /* Continue where the kernel copy stopped */
+        bpak_printf(2, "%s: buffered copy\n", __func__);
+        return file_copy_buffered(in, out, &c);
+    }
+
+    bpak_printf(2, "%s: %s copy of %llu bytes\n", __func__, method,
+                (unsigned long long)length);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    /* Leave the streams where a buffered copy would have left them */
+    if (fseek(in, c.in_offset, SEEK_SET) != 0)
+        return -BPAK_SEEK_ERROR;
+
+    if ((c.out_offset >= 0) && (fseek(out, c.out_offset, SEEK_SET) != 0))
+        return -BPAK_SEEK_ERROR;
+
+    return BPAK_OK;
+}
+
+static int file_collapse_range(int fd, off_t offset, uint64_t length)
+{
+#if defined(FALLOC_FL_COLLAPSE_RANGE)
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+        return -BPAK_NOT_SUPPORTED;
+
+    /* The range must be block aligned and must not reach the end of the
+     * file */
+    if ((st.st_blksize <= 0) || ((offset % st.st_blksize) != 0) ||
+        ((length % st.st_blksize) != 0) ||
+        ((offset + (off_t)length) >= st.st_size)) {
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    if (fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, offset, length) != 0)
+        return -BPAK_NOT_SUPPORTED;
+
+    return BPAK_OK;
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+    return -BPAK_NOT_SUPPORTED;
+#endif
+}
+
+int bpak_file_collapse(FILE *fp, off_t offset, uint64_t length,
+                       uint64_t tail_length)
+{
+    int rc = BPAK_OK;
+    int fd = fileno(fp);
+    off_t read_offset = offset + length;
+    off_t write_offset = offset;
+    uint8_t *buf;
+
+    if ((length == 0) || (tail_length == 0))
+        return BPAK_OK;
+
+    if (fflush(fp) != 0)
+        return -BPAK_WRITE_ERROR;
+
+    if (file_collapse_range(fd, offset, length) == BPAK_OK) {
+        bpak_printf(2, "%s: collapsed %llu bytes\n", __func__,
+                    (unsigned long long)length);
+        return BPAK_OK;
+    }
+
+    buf = bpak_calloc(1, FILE_COPY_BUFFER_LENGTH);
+
+    if (buf == NULL)
+        return -BPAK_FAILED;
+
+    /* The destination is below the source, copying forward is safe */
+    while (tail_length > 0) {
+        size_t chunk = BPAK_MIN(tail_length,
+                                (uint64_t)FILE_COPY_BUFFER_LENGTH);
+        ssize_t n = pread(fd, buf, chunk, read_offset);
+
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0) {
+            rc = -BPAK_READ_ERROR;
+            goto err_free_out;
+        }
+
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = pwrite(fd, &buf[written], n - written,
+                               write_offset + written);
+
+            if ((w < 0) && (errno == EINTR))
+                continue;
+            if (w <= 0) {
+                rc = -BPAK_WRITE_ERROR;
+                goto err_free_out;
+            }
+
+            written += w;
+        }
+
+        read_offset += n;
+        write_offset += n;
+        tail_length -= n;
+    }
+
+err_free_out:
+    bpak_free(buf);
+    return rc;
+}
+
+/* Zero the range in place, without writing the data */
+static int file_zero_range(int fd, const struct stat *st, off_t offset,
+                           uint64_t length)
+{
+#if defined(__linux__)
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (S_ISREG(st->st_mode) &&
+        (fallocate(fd,
+                   FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   offset,
+                   length) == 0))
+        return BPAK_OK;
+#endif
+
+    if (S_ISBLK(st->st_mode)) {
+        uint64_t range[2] = { offset, length };
+
+        if (ioctl(fd, BLKZEROOUT, range) == 0)
+            return BPAK_OK;
+    }
+#else
+    (void)fd;
+    (void)st;
+    (void)offset;
+    (void)length;
+#endif
+    return -BPAK_NOT_SUPPORTED;
+}
+
+int bpak_file_zero(FILE *out, uint64_t length)
+{
+    int rc = BPAK_OK;
+    int fd = fileno(out);
+    struct stat st;
+    off_t offset;
+    uint8_t zero[4096];
+
+    if (length == 0)
+        return BPAK_OK;
+
+    if (fflush(out) != 0)
+        return -BPAK_WRITE_ERROR;
+
+    offset = ftello(out);
+
+    if ((offset >= 0) && (fstat(fd, &st) == 0) && !S_ISFIFO(st.st_mode) &&
+        !S_ISCHR(st.st_mode)) {
+        /* Past the end of a regular file the range is already a hole */
+        if ((S_ISREG(st.st_mode) && (offset >= st.st_size)) ||
+            (file_zero_range(fd, &st, offset, length) == BPAK_OK)) {
+            bpak_printf(2, "%s: skipped %llu bytes\n", __func__,
+                        (unsigned long long)length);
+
+            if (fseeko(out, offset + length, SEEK_SET) != 0)
+                return -BPAK_SEEK_ERROR;
+
+            return BPAK_OK;
+        }
+    }
+
+    memset(zero, 0, sizeof(zero));
+
+    while ((rc == BPAK_OK) && (length > 0)) {
+        size_t chunk = BPAK_MIN(length, sizeof(zero));
+
+        if (fwrite(zero, 1, chunk, out) != chunk)
+            rc = -BPAK_WRITE_ERROR;
+
+        length -= chunk;
+    }
+
+    return rc;
+}
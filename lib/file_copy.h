@@ -0,0 +1,37 @@
+#ifndef BPAK_FILE_COPY_H
+#define BPAK_FILE_COPY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Copy 'length' bytes from 'in_offset' of 'in' to 'out_offset' of 'out'.
+ * A negative 'out_offset' writes at the current position of 'out', which
+ * may then be a pipe. Both streams are flushed first and are left
+ * positioned after the copied data.
+ *
+ * On Linux the data is moved in the kernel with copy_file_range, which
+ * reflinks on file systems that support it, or sendfile. Otherwise, or
+ * when the kernel refuses, a large buffer is copied through stdio. */
+int bpak_file_copy(FILE *in, off_t in_offset, FILE *out, off_t out_offset,
+                   uint64_t length);
+
+/* Move the 'tail_length' bytes that follow the range [offset,
+ * offset + length) of 'fp' down to 'offset'. The file may or may not shrink,
+ * the caller truncates it to the new size.
+ *
+ * On Linux the range is first removed with FALLOC_FL_COLLAPSE_RANGE, which
+ * only updates the extent tree, when the file system supports it and the
+ * range is aligned to its block size. Otherwise the tail is moved through
+ * a large buffer. */
+int bpak_file_collapse(FILE *fp, off_t offset, uint64_t length,
+                       uint64_t tail_length);
+
+/* Write 'length' zero bytes at the current position of 'out' and leave it
+ * positioned after them. Ranges past the end of a regular file are skipped
+ * and left as a hole. On Linux other ranges of a regular file are punched
+ * out, and block devices are zeroed with BLKZEROOUT, which lets the device
+ * discard the blocks. Pipes, and files where that fails, get the zeros
+ * written. */
+int bpak_file_zero(FILE *out, uint64_t length);
+#endif
@@ -0,0 +1,221 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <bpak/bpak.h>
+#include <bpak/crypto.h>
+#include "hash_pipeline.h"
+
+struct hash_pipeline {
+    const struct bpak_hash_range *ranges;
+    size_t count;
+    bpak_io_t read_payload;
+    void *user;
+    uint8_t *buffers;
+    size_t lengths[BPAK_HASH_PIPELINE_DEPTH];
+    size_t filled;   /* Buffers read so far */
+    size_t consumed; /* Buffers hashed so far */
+    bool done;       /* The reader has stopped */
+    bool stop;       /* The hash failed, the reader must stop */
+    int rc;          /* Result of the reader */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+void bpak_hash_range_add(struct bpak_hash_range *ranges, size_t *count,
+                         off_t offset, uint64_t length)
+{
+    if (length == 0)
+        return;
+
+    if ((*count > 0) &&
+        ((ranges[*count - 1].offset + (off_t)ranges[*count - 1].length) ==
+         offset)) {
+        ranges[*count - 1].length += length;
+        return;
+    }
+
+    ranges[*count].offset = offset;
+    ranges[*count].length = length;
+    (*count)++;
+}
+
+static int hash_ranges(struct bpak_hash_context *hash,
+                       const struct bpak_hash_range *ranges, size_t count,
+                       bpak_io_t read_payload, void *user, uint8_t *buffer,
+                       size_t buffer_length)
+{
+    int rc;
+
+    for (size_t i = 0; i < count; i++) {
+        off_t offset = ranges[i].offset;
+        uint64_t bytes_to_read = ranges[i].length;
+
+        while (bytes_to_read > 0) {
+            size_t chunk = BPAK_MIN(bytes_to_read, buffer_length);
+
+            if (read_payload(offset, buffer, chunk, user) != (ssize_t)chunk)
+                return -BPAK_READ_ERROR;
+
+            rc = bpak_hash_update(hash, buffer, chunk);
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            bytes_to_read -= chunk;
+            offset += chunk;
+        }
+    }
+
+    return BPAK_OK;
+}
+
+static void *hash_pipeline_reader(void *arg)
+{
+    struct hash_pipeline *p = (struct hash_pipeline *)arg;
+    int rc = BPAK_OK;
+
+    for (size_t i = 0; (i < p->count) && (rc == BPAK_OK); i++) {
+        off_t offset = p->ranges[i].offset;
+        uint64_t bytes_to_read = p->ranges[i].length;
+
+        while (bytes_to_read > 0) {
+            size_t chunk = BPAK_MIN(bytes_to_read,
+                                    BPAK_HASH_PIPELINE_BUFFER_LENGTH);
+            size_t slot;
+
+            /* Wait for a buffer that has been hashed */
+            pthread_mutex_lock(&p->lock);
+            while (((p->filled - p->consumed) == BPAK_HASH_PIPELINE_DEPTH) &&
+                   !p->stop)
+                pthread_cond_wait(&p->cond, &p->lock);
+
+            if (p->stop) {
+                pthread_mutex_unlock(&p->lock);
+                goto out;
+            }
+
+            slot = p->filled % BPAK_HASH_PIPELINE_DEPTH;
+            pthread_mutex_unlock(&p->lock);
+
+            if (p->read_payload(offset,
+                                &p->buffers[slot *
+                                            BPAK_HASH_PIPELINE_BUFFER_LENGTH],
+                                chunk,
+                                p->user) != (ssize_t)chunk) {
+                rc = -BPAK_READ_ERROR;
+                break;
+            }
+
+            pthread_mutex_lock(&p->lock);
+            p->lengths[slot] = chunk;
+            p->filled++;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->lock);
+
+            bytes_to_read -= chunk;
+            offset += chunk;
+        }
+    }
+
+out:
+    pthread_mutex_lock(&p->lock);
+    p->rc = rc;
+    p->done = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+int bpak_hash_pipeline(struct bpak_hash_context *hash,
+                       const struct bpak_hash_range *ranges, size_t count,
+                       bpak_io_t read_payload, void *user)
+{
+    int rc = BPAK_OK;
+    uint64_t total = 0;
+    uint8_t chunk_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    struct hash_pipeline p;
+    pthread_t reader;
+
+    for (size_t i = 0; i < count; i++)
+        total += ranges[i].length;
+
+    /* Nothing to overlap within a single buffer */
+    if (total <= BPAK_HASH_PIPELINE_BUFFER_LENGTH) {
+        return hash_ranges(hash, ranges, count, read_payload, user,
+                           chunk_buffer, sizeof(chunk_buffer));
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.ranges = ranges;
+    p.count = count;
+    p.read_payload = read_payload;
+    p.user = user;
+    p.buffers = bpak_calloc(BPAK_HASH_PIPELINE_DEPTH,
+                            BPAK_HASH_PIPELINE_BUFFER_LENGTH);
+
+    if (p.buffers == NULL) {
+        return hash_ranges(hash, ranges, count, read_payload, user,
+                           chunk_buffer, sizeof(chunk_buffer));
+    }
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    if (pthread_create(&reader, NULL, hash_pipeline_reader, &p) != 0) {
+        rc = hash_ranges(hash, ranges, count, read_payload, user,
+                         p.buffers,
+                         BPAK_HASH_PIPELINE_DEPTH *
+                             BPAK_HASH_PIPELINE_BUFFER_LENGTH);
+        goto err_free_out;
+    }
+
+    while (true) {
+        size_t slot;
+
+        pthread_mutex_lock(&p.lock);
+        while ((p.consumed == p.filled) && !p.done)
+            pthread_cond_wait(&p.cond, &p.lock);
+
+        /* A read error is reported without hashing what is left */
+        if ((p.rc != BPAK_OK) || (p.consumed == p.filled)) {
+            rc = p.rc;
+            pthread_mutex_unlock(&p.lock);
+            break;
+        }
+
+        slot = p.consumed % BPAK_HASH_PIPELINE_DEPTH;
+        pthread_mutex_unlock(&p.lock);
+
+        rc = bpak_hash_update(hash,
+                              &p.buffers[slot *
+                                         BPAK_HASH_PIPELINE_BUFFER_LENGTH],
+                              p.lengths[slot]);
+
+        pthread_mutex_lock(&p.lock);
+        p.consumed++;
+        if (rc != BPAK_OK)
+            p.stop = true;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+
+        if (rc != BPAK_OK)
+            break;
+    }
+
+    pthread_join(reader, NULL);
+
+err_free_out:
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    bpak_free(p.buffers);
+    return rc;
+}
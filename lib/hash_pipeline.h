@@ -0,0 +1,39 @@
+#ifndef BPAK_HASH_PIPELINE_H
+#define BPAK_HASH_PIPELINE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <bpak/bpak.h>
+#include <bpak/crypto.h>
+
+/* Size and number of the read-ahead buffers */
+#ifndef BPAK_HASH_PIPELINE_BUFFER_LENGTH
+#define BPAK_HASH_PIPELINE_BUFFER_LENGTH (256 * 1024)
+#endif
+
+#ifndef BPAK_HASH_PIPELINE_DEPTH
+#define BPAK_HASH_PIPELINE_DEPTH 3
+#endif
+
+/* A range of the payload that is hashed */
+struct bpak_hash_range {
+    off_t offset;
+    uint64_t length;
+};
+
+/* Append a range to 'ranges', a range that starts where the last one ends
+ * extends it instead. Empty ranges are dropped. */
+void bpak_hash_range_add(struct bpak_hash_range *ranges, size_t *count,
+                         off_t offset, uint64_t length);
+
+/* Update 'hash' with the 'count' ranges read with 'read_payload', in
+ * order. When there is more than one buffer of data a reader thread fills
+ * the read-ahead buffers while this thread hashes the previous one, so
+ * the time is that of the slower of the reads and the hash rather than
+ * the sum. 'read_payload' is only called from one thread at a time.
+ * Without memory for the buffers, or if no thread can be started, the
+ * ranges are read and hashed here. */
+int bpak_hash_pipeline(struct bpak_hash_context *hash,
+                       const struct bpak_hash_range *ranges, size_t count,
+                       bpak_io_t read_payload, void *user);
+#endif
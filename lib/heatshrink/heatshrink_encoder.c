@@ -69,6 +69,25 @@ static void push_literal_byte(heatshrink_encoder *hse, output_info *oi);
 
 void heatshrink_encoder_reset(heatshrink_encoder *hse)
 {
+    (void)heatshrink_encoder_reset_dynamic(hse,
+                                           HEATSHRINK_STATIC_WINDOW_BITS,
+                                           HEATSHRINK_STATIC_LOOKAHEAD_BITS);
+}
+
+int heatshrink_encoder_reset_dynamic(heatshrink_encoder *hse,
+                                     uint8_t window_sz2,
+                                     uint8_t lookahead_sz2)
+{
+    if ((window_sz2 < HEATSHRINK_MIN_WINDOW_BITS) ||
+        (window_sz2 > HEATSHRINK_MAX_WINDOW_BITS) ||
+        (lookahead_sz2 < HEATSHRINK_MIN_LOOKAHEAD_BITS) ||
+        (lookahead_sz2 >= window_sz2)) {
+        return -1;
+    }
+
+    hse->window_sz2 = window_sz2;
+    hse->lookahead_sz2 = lookahead_sz2;
+
     size_t buf_sz = (2 << HEATSHRINK_ENCODER_WINDOW_BITS(hse));
     memset(hse->buffer, 0, buf_sz);
     hse->input_size = 0;
@@ -85,6 +104,7 @@ void heatshrink_encoder_reset(heatshrink_encoder *hse)
 #ifdef LOOP_DETECT
     hse->loop_detect = (uint32_t)-1;
 #endif
+    return 0;
 }
 
 HSE_sink_res heatshrink_encoder_sink(heatshrink_encoder *hse, uint8_t *in_buf,
@@ -377,16 +397,42 @@ static uint16_t get_input_offset(heatshrink_encoder *hse)
 static uint16_t get_input_buffer_size(heatshrink_encoder *hse)
 {
     return (1 << HEATSHRINK_ENCODER_WINDOW_BITS(hse));
-    (void)hse;
 }
 
 static uint16_t get_lookahead_size(heatshrink_encoder *hse)
 {
     return (1 << HEATSHRINK_ENCODER_LOOKAHEAD_BITS(hse));
-    (void)hse;
 }
 
-static void do_indexing(heatshrink_encoder *hse) { (void)hse; }
+static void do_indexing(heatshrink_encoder *hse)
+{
+#if HEATSHRINK_USE_INDEX
+    /* Build an index array I that contains flattened linked lists
+     * for the previous instances of every byte in the buffer.
+     *
+     * For example, if buf[200] == 'x', then index[200] will either
+     * be an offset i such that buf[i] == 'x', or a negative offset
+     * to indicate end-of-list. This significantly speeds up matching,
+     * while only using sizeof(int32_t) * sizeof(buffer) bytes of RAM. */
+    struct hs_index *hsi = HEATSHRINK_ENCODER_INDEX(hse);
+    int32_t last[256];
+    memset(last, 0xFF, sizeof(last));
+
+    uint8_t *const data = hse->buffer;
+    int32_t *const index = hsi->index;
+
+    const size_t input_offset = get_input_offset(hse);
+    const size_t end = input_offset + hse->input_size;
+
+    for (size_t i = 0; i < end; i++) {
+        uint8_t v = data[i];
+        index[i] = last[v];
+        last[v] = (int32_t)i;
+    }
+#else
+    (void)hse;
+#endif
+}
 
 static int is_finishing(heatshrink_encoder *hse)
 {
@@ -418,6 +464,36 @@ static uint16_t find_longest_match(heatshrink_encoder *hse, uint16_t start,
     uint16_t len = 0;
     uint8_t *const needlepoint = &buf[end];
 
+#if HEATSHRINK_USE_INDEX
+    /* Only positions that start with the same byte as the needle are
+     * visited, newest first, which gives the same match as the scan. */
+    const int32_t *const index = HEATSHRINK_ENCODER_INDEX(hse)->index;
+    int32_t pos = index[end];
+
+    while (pos >= (int32_t)start) {
+        uint8_t *const pospoint = &buf[pos];
+
+        /* Only check matches that can beat the current longest one */
+        if (pospoint[match_maxlen] == needlepoint[match_maxlen]) {
+            for (len = 1; len < maxlen; len++) {
+                if (pospoint[len] != needlepoint[len]) {
+                    break;
+                }
+            }
+
+            if (len > match_maxlen) {
+                match_maxlen = len;
+                match_index = pos;
+
+                if (len == maxlen) {
+                    break;
+                } /* don't keep searching */
+            }
+        }
+
+        pos = index[pos];
+    }
+#else
     for (int16_t pos = end - 1; pos - (int16_t)start >= 0; pos--) {
         uint8_t *const pospoint = &buf[pos];
 
@@ -439,6 +515,7 @@ static uint16_t find_longest_match(heatshrink_encoder *hse, uint16_t start,
             }
         }
     }
+#endif
 
     const size_t break_even_point = (1 + HEATSHRINK_ENCODER_WINDOW_BITS(hse) +
                                      HEATSHRINK_ENCODER_LOOKAHEAD_BITS(hse));
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <bpak/build_config.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,13 +22,31 @@ extern "C" {
 #define HEATSHRINK_LITERAL_MARKER 0x01
 #define HEATSHRINK_BACKREF_MARKER 0x00
 
-/* Required parameters for static configuration */
-#define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE 256
-#define HEATSHRINK_STATIC_WINDOW_BITS       8
-#define HEATSHRINK_STATIC_LOOKAHEAD_BITS    7
+/* Required parameters for static configuration, set through build_config.
+ * The window and lookahead must be the same in the encoder and decoder */
+#define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE BPAK_CONFIG_HS_INPUT_BUFFER_SIZE
+#define HEATSHRINK_STATIC_WINDOW_BITS       BPAK_CONFIG_HS_WINDOW_BITS
+#define HEATSHRINK_STATIC_LOOKAHEAD_BITS    BPAK_CONFIG_HS_LOOKAHEAD_BITS
 
-/* Use indexing for faster compression. (This requires additional space.) */
-#define HEATSHRINK_USE_INDEX 0
+#if (HEATSHRINK_STATIC_WINDOW_BITS < HEATSHRINK_MIN_WINDOW_BITS) ||            \
+    (HEATSHRINK_STATIC_WINDOW_BITS > HEATSHRINK_MAX_WINDOW_BITS)
+#error "Unsupported heatshrink window size"
+#endif
+
+#if (HEATSHRINK_STATIC_LOOKAHEAD_BITS < HEATSHRINK_MIN_LOOKAHEAD_BITS) ||      \
+    (HEATSHRINK_STATIC_LOOKAHEAD_BITS >= HEATSHRINK_STATIC_WINDOW_BITS)
+#error "Unsupported heatshrink lookahead size"
+#endif
+
+#if (HEATSHRINK_STATIC_INPUT_BUFFER_SIZE < 1) ||                               \
+    (HEATSHRINK_STATIC_INPUT_BUFFER_SIZE > 32768)
+#error "Unsupported heatshrink input buffer size"
+#endif
+
+/* Use indexing for faster compression. (This requires additional space.)
+ * The encoder only runs on the host when patches are prepared, so the index
+ * is always enabled. The decoder does not use it. */
+#define HEATSHRINK_USE_INDEX 1
 
 typedef enum {
     HSER_SINK_OK,                /* data sunk into input buffer */
@@ -48,13 +67,19 @@ typedef enum {
     HSER_FINISH_ERROR_NULL = -1, /* NULL argument */
 } HSE_finish_res;
 
-#define HEATSHRINK_ENCODER_WINDOW_BITS(_)    (HEATSHRINK_STATIC_WINDOW_BITS)
-#define HEATSHRINK_ENCODER_LOOKAHEAD_BITS(_) (HEATSHRINK_STATIC_LOOKAHEAD_BITS)
-#define HEATSHRINK_ENCODER_INDEX(HSE)        (&(HSE)->search_index)
+/* The window and lookahead are set at runtime so that the host can encode
+ * for decoders that are built with other sizes, the buffers are sized for
+ * the largest window. */
+#define HEATSHRINK_ENCODER_WINDOW_BITS(HSE)    ((HSE)->window_sz2)
+#define HEATSHRINK_ENCODER_LOOKAHEAD_BITS(HSE) ((HSE)->lookahead_sz2)
+#define HEATSHRINK_ENCODER_INDEX(HSE)          (&(HSE)->search_index)
+#if HEATSHRINK_USE_INDEX
+/* Previous position of the same byte value for every position in the
+ * buffer, or -1. int32_t so the largest window does not overflow. */
 struct hs_index {
-    uint16_t size;
-    int16_t index[2 << HEATSHRINK_STATIC_WINDOW_BITS];
+    int32_t index[2 << HEATSHRINK_MAX_WINDOW_BITS];
 };
+#endif
 
 typedef struct {
     uint16_t input_size; /* bytes in input buffer */
@@ -67,13 +92,24 @@ typedef struct {
     uint8_t state;        /* current state machine node */
     uint8_t current_byte; /* current byte of output */
     uint8_t bit_index;    /* current bit index */
+    uint8_t window_sz2;   /* log2 of the window size */
+    uint8_t lookahead_sz2; /* log2 of the lookahead size */
     /* input buffer and / sliding window for expansion */
-    uint8_t buffer[2 << HEATSHRINK_ENCODER_WINDOW_BITS(_)];
+    uint8_t buffer[2 << HEATSHRINK_MAX_WINDOW_BITS];
+#if HEATSHRINK_USE_INDEX
+    struct hs_index search_index;
+#endif
 } heatshrink_encoder;
 
-/* Reset an encoder. */
+/* Reset an encoder, using the static window and lookahead sizes. */
 void heatshrink_encoder_reset(heatshrink_encoder *hse);
 
+/* Reset an encoder with a window of 2^WINDOW_SZ2 and a lookahead of
+ * 2^LOOKAHEAD_SZ2 bytes. Returns -1 if the sizes are out of range. */
+int heatshrink_encoder_reset_dynamic(heatshrink_encoder *hse,
+                                     uint8_t window_sz2,
+                                     uint8_t lookahead_sz2);
+
 /* Sink up to SIZE bytes from IN_BUF into the encoder.
  * INPUT_SIZE is set to the number of bytes actually sunk (in case a
  * buffer was filled.). */
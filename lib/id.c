@@ -34,6 +34,14 @@ BPAK_EXPORT const char *bpak_id_to_string(uint32_t id)
         return "bpak-version";
     case BPAK_ID_KEYSTORE_PROVIDER_ID:
         return "keystore-provider-id";
+    case BPAK_ID_PART_DIGEST:
+        return "part-digest";
+    case BPAK_ID_SPARSE_MAP:
+        return "bpak-sparse-map";
+    case BPAK_ID_ORIGIN_PARTS:
+        return "bpak-origin-parts";
+    case BPAK_ID_MERKLE_BLOCK_SIZE:
+        return "merkle-block-size";
     default:
         return "";
     }
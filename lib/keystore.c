@@ -18,6 +18,28 @@ BPAK_EXPORT int bpak_keystore_get(struct bpak_keystore *ks, uint32_t id,
     if (!ks->verified)
         return -BPAK_FAILED;
 
+    if (ks->sorted) {
+        unsigned int low = 0;
+        unsigned int high = ks->no_of_keys;
+
+        while (low < high) {
+            unsigned int mid = low + (high - low) / 2;
+            uint32_t mid_id = ks->keys[mid]->id;
+
+            if (mid_id == id) {
+                *k = ks->keys[mid];
+                return BPAK_OK;
+            }
+
+            if (mid_id < id)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        return -BPAK_KEY_NOT_FOUND;
+    }
+
     for (unsigned int i = 0; i < ks->no_of_keys; i++) {
         if (ks->keys[i]->id == id) {
             *k = ks->keys[i];
@@ -139,6 +139,28 @@ void bpak_mbed_hash_free(struct bpak_hash_context *ctx)
     }
 }
 
+int bpak_mbed_hash_clone(struct bpak_hash_context *dst,
+                         const struct bpak_hash_context *src)
+{
+    switch (src->kind) {
+    case BPAK_HASH_SHA256:
+        mbedtls_sha256_init(&dst->backend.mbed_sha256);
+        mbedtls_sha256_clone(&dst->backend.mbed_sha256,
+                             &src->backend.mbed_sha256);
+        break;
+    case BPAK_HASH_SHA384:
+    case BPAK_HASH_SHA512:
+        mbedtls_sha512_init(&dst->backend.mbed_sha512);
+        mbedtls_sha512_clone(&dst->backend.mbed_sha512,
+                             &src->backend.mbed_sha512);
+        break;
+    default:
+        return -BPAK_UNSUPPORTED_HASH_ALG;
+    }
+
+    return BPAK_OK;
+}
+
 static int hash_kind(int bpak_hash_kind)
 {
     int hash_kind = 0;
@@ -160,6 +182,21 @@ static int hash_kind(int bpak_hash_kind)
     return hash_kind;
 }
 
+static void pk_verify(mbedtls_pk_context *ctx, const uint8_t *signature,
+                      size_t signature_length, const uint8_t *hash,
+                      size_t hash_length, enum bpak_hash_kind kind,
+                      bool *verified)
+{
+    int rc = mbedtls_pk_verify(ctx,
+                               hash_kind(kind),
+                               (unsigned char *)hash,
+                               hash_length,
+                               (unsigned char *)signature,
+                               signature_length);
+
+    (*verified) = (rc == 0);
+}
+
 int bpak_mbed_verify(const uint8_t *signature, size_t signature_length,
                      const uint8_t *hash, size_t hash_length,
                      enum bpak_hash_kind kind, struct bpak_key *key,
@@ -175,72 +212,87 @@ int bpak_mbed_verify(const uint8_t *signature, size_t signature_length,
     rc = mbedtls_pk_parse_public_key(&ctx, key->data, key->size);
 
     if (rc != 0) {
+        mbedtls_pk_free(&ctx);
         return -BPAK_KEY_DECODE;
     }
 
-    rc = mbedtls_pk_verify(&ctx,
-                           hash_kind(kind),
-                           (unsigned char *)hash,
-                           hash_length,
-                           (unsigned char *)signature,
-                           signature_length);
-
-    if (rc == 0) {
-        rc = BPAK_OK;
-        (*verified) = true;
-    } else {
-        rc = -BPAK_VERIFY_FAIL;
-    }
+    pk_verify(&ctx,
+              signature,
+              signature_length,
+              hash,
+              hash_length,
+              kind,
+              verified);
 
     mbedtls_pk_free(&ctx);
     return BPAK_OK;
 }
 
-int bpak_mbed_sign(const uint8_t *hash, size_t hash_length,
-                   enum bpak_hash_kind kind, struct bpak_key *key,
-                   uint8_t *signature, size_t *signature_length)
+/* A parsed key, the random generator is only set up for private keys */
+struct mbed_key {
+    mbedtls_pk_context pk;
+    bool has_rng;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+};
+
+static void mbed_key_free(struct mbed_key *k)
+{
+    if (k->has_rng) {
+        mbedtls_entropy_free(&k->entropy);
+        mbedtls_ctr_drbg_free(&k->ctr_drbg);
+    }
+
+    mbedtls_pk_free(&k->pk);
+}
+
+static int mbed_key_parse_private(struct mbed_key *k, struct bpak_key *key)
 {
     int rc;
     const char *pers = "mbedtls_pk_sign";
-    mbedtls_pk_context ctx;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
 
-    mbedtls_entropy_init(&entropy);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
-    mbedtls_pk_init(&ctx);
+    mbedtls_entropy_init(&k->entropy);
+    mbedtls_ctr_drbg_init(&k->ctr_drbg);
+    mbedtls_pk_init(&k->pk);
+    k->has_rng = true;
 
-    rc = mbedtls_ctr_drbg_seed(&ctr_drbg,
+    rc = mbedtls_ctr_drbg_seed(&k->ctr_drbg,
                                mbedtls_entropy_func,
-                               &entropy,
+                               &k->entropy,
                                (const unsigned char *)pers,
                                strlen(pers));
 
-    if (rc != 0) {
-        rc = -BPAK_FAILED;
-        goto err_free_crypto_ctx_out;
-    }
+    if (rc != 0)
+        return -BPAK_FAILED;
 
 #if MBEDTLS_VERSION_MAJOR >= 3
-    rc = mbedtls_pk_parse_key(&ctx,
+    rc = mbedtls_pk_parse_key(&k->pk,
                               key->data,
                               key->size,
                               NULL,
                               0,
                               mbedtls_ctr_drbg_random,
-                              &ctr_drbg);
+                              &k->ctr_drbg);
 #else
-    rc = mbedtls_pk_parse_key(&ctx, key->data, key->size, NULL, 0);
+    rc = mbedtls_pk_parse_key(&k->pk, key->data, key->size, NULL, 0);
 #endif
 
     if (rc != 0) {
         bpak_printf(0, "Error: Key parse (mbedtls: %i)\n", rc);
-        rc = -BPAK_KEY_DECODE;
-        goto err_free_crypto_ctx_out;
+        return -BPAK_KEY_DECODE;
     }
 
+    return BPAK_OK;
+}
+
+static int mbed_key_sign(struct mbed_key *k, const uint8_t *hash,
+                         size_t hash_length, enum bpak_hash_kind kind,
+                         uint8_t *signature, size_t *signature_length)
+{
+    int rc;
+
 #if MBEDTLS_VERSION_MAJOR >= 3
-    rc = mbedtls_pk_sign(&ctx,
+    rc = mbedtls_pk_sign(&k->pk,
                          hash_kind(kind),
                          hash,
                          hash_length,
@@ -248,28 +300,122 @@ int bpak_mbed_sign(const uint8_t *hash, size_t hash_length,
                          *signature_length,
                          signature_length,
                          mbedtls_ctr_drbg_random,
-                         &ctr_drbg);
+                         &k->ctr_drbg);
 #else
-    rc = mbedtls_pk_sign(&ctx,
+    rc = mbedtls_pk_sign(&k->pk,
                          hash_kind(kind),
                          hash,
                          hash_length,
                          signature,
                          signature_length,
                          mbedtls_ctr_drbg_random,
-                         &ctr_drbg);
+                         &k->ctr_drbg);
 #endif
 
     if (rc != 0) {
         bpak_printf(0, "Error: Signing failed (mbedtls: %i)\n", rc);
-        rc = -BPAK_SIGN_FAIL;
-        goto err_free_crypto_ctx_out;
+        return -BPAK_SIGN_FAIL;
     }
 
-err_free_crypto_ctx_out:
-    mbedtls_entropy_free(&entropy);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_pk_free(&ctx);
+    return BPAK_OK;
+}
+
+int bpak_mbed_prepare_key(struct bpak_key *key, void **prepared)
+{
+    struct mbed_key *k = bpak_calloc(1, sizeof(*k));
+
+    if (k == NULL)
+        return -BPAK_FAILED;
+
+    mbedtls_pk_init(&k->pk);
+
+    if (mbedtls_pk_parse_public_key(&k->pk, key->data, key->size) != 0) {
+        mbed_key_free(k);
+        bpak_free(k);
+        return -BPAK_KEY_DECODE;
+    }
+
+    (*prepared) = k;
+    return BPAK_OK;
+}
+
+int bpak_mbed_verify_prepared(const uint8_t *signature,
+                              size_t signature_length, const uint8_t *hash,
+                              size_t hash_length, enum bpak_hash_kind kind,
+                              void *prepared, bool *verified)
+{
+    pk_verify(&((struct mbed_key *)prepared)->pk,
+              signature,
+              signature_length,
+              hash,
+              hash_length,
+              kind,
+              verified);
+    return BPAK_OK;
+}
+
+int bpak_mbed_prepare_sign_key(struct bpak_key *key, void **prepared)
+{
+    int rc;
+    struct mbed_key *k = bpak_calloc(1, sizeof(*k));
+
+    if (k == NULL)
+        return -BPAK_FAILED;
+
+    rc = mbed_key_parse_private(k, key);
+
+    if (rc != BPAK_OK) {
+        mbed_key_free(k);
+        bpak_free(k);
+        return rc;
+    }
+
+    (*prepared) = k;
+    return BPAK_OK;
+}
+
+int bpak_mbed_sign_prepared(const uint8_t *hash, size_t hash_length,
+                            enum bpak_hash_kind kind, void *prepared,
+                            uint8_t *signature, size_t *signature_length)
+{
+    struct mbed_key *k = (struct mbed_key *)prepared;
+
+    if (!k->has_rng)
+        return -BPAK_UNSUPPORTED_KEY;
+
+    return mbed_key_sign(k,
+                         hash,
+                         hash_length,
+                         kind,
+                         signature,
+                         signature_length);
+}
+
+void bpak_mbed_free_key(void *prepared)
+{
+    mbed_key_free((struct mbed_key *)prepared);
+    bpak_free(prepared);
+}
+
+int bpak_mbed_sign(const uint8_t *hash, size_t hash_length,
+                   enum bpak_hash_kind kind, struct bpak_key *key,
+                   uint8_t *signature, size_t *signature_length)
+{
+    int rc;
+    struct mbed_key k;
+
+    rc = mbed_key_parse_private(&k, key);
+
+    if (rc == BPAK_OK) {
+        rc = mbed_key_sign(&k,
+                           hash,
+                           hash_length,
+                           kind,
+                           signature,
+                           signature_length);
+    }
+
+    mbed_key_free(&k);
     return rc;
 }
 
@@ -320,6 +466,7 @@ int bpak_mbed_load_public_key(const char *filename, struct bpak_key **output)
 
     memcpy(key->data, &tmp[sizeof(tmp) - len], len);
     (*output) = key;
+    mbedtls_pk_free(&ctx);
     return BPAK_OK;
 
 err_free_key_out:
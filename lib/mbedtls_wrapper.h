@@ -11,11 +11,29 @@ int bpak_mbed_hash_final(struct bpak_hash_context *ctx, uint8_t *buffer,
 
 void bpak_mbed_hash_free(struct bpak_hash_context *ctx);
 
+int bpak_mbed_hash_clone(struct bpak_hash_context *dst,
+                         const struct bpak_hash_context *src);
+
 int bpak_mbed_verify(const uint8_t *signature, size_t signature_length,
                      const uint8_t *hash, size_t hash_length,
                      enum bpak_hash_kind kind, struct bpak_key *key,
                      bool *verified);
 
+int bpak_mbed_prepare_key(struct bpak_key *key, void **prepared);
+
+int bpak_mbed_verify_prepared(const uint8_t *signature,
+                              size_t signature_length, const uint8_t *hash,
+                              size_t hash_length, enum bpak_hash_kind kind,
+                              void *prepared, bool *verified);
+
+int bpak_mbed_prepare_sign_key(struct bpak_key *key, void **prepared);
+
+int bpak_mbed_sign_prepared(const uint8_t *hash, size_t hash_length,
+                            enum bpak_hash_kind kind, void *prepared,
+                            uint8_t *signature, size_t *signature_length);
+
+void bpak_mbed_free_key(void *prepared);
+
 int bpak_mbed_sign(const uint8_t *hash, size_t hash_length,
                    enum bpak_hash_kind kind, struct bpak_key *key,
                    uint8_t *signature, size_t *signature_length);
@@ -8,6 +8,8 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <bpak/bpak.h>
 
 static bpak_calloc_t _calloc_func = NULL;
@@ -48,3 +50,123 @@ void bpak_free(void *ptr)
 
     // bpak_printf(2, "bpak_free(%p)\n", ptr);
 }
+
+BPAK_EXPORT void *bpak_allocator_calloc(const struct bpak_allocator *allocator,
+                                        size_t nmemb, size_t size)
+{
+    if (allocator == NULL)
+        return bpak_calloc(nmemb, size);
+
+    return allocator->calloc_func(allocator->user, nmemb, size);
+}
+
+BPAK_EXPORT void bpak_allocator_free(const struct bpak_allocator *allocator,
+                                     void *ptr)
+{
+    if (allocator == NULL)
+        bpak_free(ptr);
+    else
+        allocator->free_func(allocator->user, ptr);
+}
+
+/* Arena blocks are aligned like malloc on the common targets */
+#define ARENA_ALIGN 16
+
+/* Header in front of each arena block. The blocks form a list from the
+ * most recent one, which is what lets them be freed out of order. */
+struct arena_block {
+    struct arena_block *prev;
+    size_t start; /* 'used' before the block was allocated */
+    bool freed;
+};
+
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_BLOCK_HEADER ARENA_ROUND(sizeof(struct arena_block))
+
+BPAK_EXPORT int bpak_arena_init(struct bpak_arena *arena, void *buffer,
+                                size_t size)
+{
+    uintptr_t start = (uintptr_t)buffer;
+    size_t pad = (ARENA_ALIGN - (start % ARENA_ALIGN)) % ARENA_ALIGN;
+
+    memset(arena, 0, sizeof(*arena));
+
+    if ((buffer == NULL) || (size < pad + ARENA_BLOCK_HEADER))
+        return -BPAK_SIZE_ERROR;
+
+    arena->buffer = (uint8_t *)buffer + pad;
+    arena->size = (size - pad) & ~(size_t)(ARENA_ALIGN - 1);
+    return BPAK_OK;
+}
+
+BPAK_EXPORT void *bpak_arena_calloc(struct bpak_arena *arena, size_t nmemb,
+                                    size_t size)
+{
+    struct arena_block *block;
+    size_t available = arena->size - arena->used;
+    size_t length;
+
+    if ((size != 0) && (nmemb > SIZE_MAX / size))
+        return NULL;
+
+    length = nmemb * size;
+
+    if ((available < ARENA_BLOCK_HEADER) ||
+        (length > available - ARENA_BLOCK_HEADER))
+        return NULL;
+
+    /* 'size' and 'used' are aligned, so the rounded length still fits */
+    length = ARENA_ROUND(length);
+
+    block = (struct arena_block *)&arena->buffer[arena->used];
+    block->prev = arena->top;
+    block->start = arena->used;
+    block->freed = false;
+
+    arena->used += ARENA_BLOCK_HEADER + length;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    arena->top = block;
+    arena->count++;
+
+    memset((uint8_t *)block + ARENA_BLOCK_HEADER, 0, length);
+    return (uint8_t *)block + ARENA_BLOCK_HEADER;
+}
+
+BPAK_EXPORT void bpak_arena_free(struct bpak_arena *arena, void *ptr)
+{
+    struct arena_block *block;
+
+    if (ptr == NULL)
+        return;
+
+    block = (struct arena_block *)((uint8_t *)ptr - ARENA_BLOCK_HEADER);
+    block->freed = true;
+    arena->count--;
+
+    /* Give back the space of every freed block at the top */
+    while ((arena->top != NULL) &&
+           ((struct arena_block *)arena->top)->freed) {
+        block = arena->top;
+        arena->used = block->start;
+        arena->top = block->prev;
+    }
+}
+
+static void *arena_calloc_wrap(void *user, size_t nmemb, size_t size)
+{
+    return bpak_arena_calloc((struct bpak_arena *)user, nmemb, size);
+}
+
+static void arena_free_wrap(void *user, void *ptr)
+{
+    bpak_arena_free((struct bpak_arena *)user, ptr);
+}
+
+BPAK_EXPORT void bpak_arena_allocator(struct bpak_arena *arena,
+                                      struct bpak_allocator *allocator)
+{
+    allocator->calloc_func = arena_calloc_wrap;
+    allocator->free_func = arena_free_wrap;
+    allocator->user = arena;
+}
@@ -8,44 +8,336 @@
  */
 
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <bpak/bpak.h>
 #include <bpak/merkle.h>
 #include <bpak/crypto.h>
+#if BPAK_CONFIG_SHA == 1
+#include "sha.h"
+#endif
+#include "trace.h"
 
-BPAK_EXPORT ssize_t bpak_merkle_compute_size(size_t input_data_length)
+/* Block header of struct bpak_arena, see bpak_merkle_heap_size */
+#define MERKLE_HEAP_MARGIN 64
+
+struct merkle_leaf_job {
+    const struct bpak_merkle_context *ctx;
+    const uint8_t *data;
+    uint8_t *hashes;
+    size_t count;
+    pthread_t thread;
+    bool started;
+    int rc;
+};
+
+/* Start a leaf or node hash from a copy of the salted state. Backends that
+ * can not clone a context fall back to hashing the salt again. */
+static int merkle_hash_start(const struct bpak_merkle_context *ctx,
+                             struct bpak_hash_context *hash)
+{
+    int rc;
+
+    if (ctx->salted_hash_valid &&
+        (bpak_hash_clone(hash, &ctx->salted_hash) == BPAK_OK)) {
+        return BPAK_OK;
+    }
+
+    rc = bpak_hash_init(hash, BPAK_HASH_SHA256);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_hash_update(hash, ctx->salt, ctx->salt_length);
+
+    if (rc != BPAK_OK)
+        bpak_hash_free(hash);
+
+    return rc;
+}
+
+static void merkle_hash_release(struct bpak_merkle_context *ctx)
+{
+    if (ctx->salted_hash_valid)
+        bpak_hash_free(&ctx->salted_hash);
+
+    ctx->salted_hash_valid = false;
+}
+
+static int merkle_hash_leaves(const struct bpak_merkle_context *ctx,
+                              const uint8_t *data, size_t count,
+                              uint8_t *hashes)
+{
+    int rc;
+    struct bpak_hash_context hash;
+
+#if BPAK_CONFIG_SHA == 1
+    /* Leaves have a fixed length, which lets the multi-buffer kernel hash
+     * several of them at once */
+    if ((count > 1) && (bpak_sha256_lanes() > 1) && bpak_hash_is_builtin()) {
+        bpak_sha256_salted(ctx->salt,
+                           ctx->salt_length,
+                           data,
+                           ctx->block_size,
+                           count,
+                           hashes);
+        return BPAK_OK;
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        rc = merkle_hash_start(ctx, &hash);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        rc = bpak_hash_update(&hash,
+                              &data[i * ctx->block_size],
+                              ctx->block_size);
+
+        if (rc == BPAK_OK) {
+            rc = bpak_hash_final(&hash,
+                                 &hashes[i * BPAK_MERKLE_HASH_BYTES],
+                                 BPAK_MERKLE_HASH_BYTES,
+                                 NULL);
+        }
+
+        bpak_hash_free(&hash);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    return BPAK_OK;
+}
+
+/* Leaves per thread and batch, the same number of bytes as
+ * BPAK_MERKLE_JOB_LEAVES leaves of the default block size */
+static size_t merkle_job_leaves(const struct bpak_merkle_context *ctx)
 {
-    size_t level_length = input_data_length;
+    size_t data_length = BPAK_MERKLE_JOB_LEAVES * BPAK_MERKLE_BLOCK_SZ;
+
+    return (data_length > ctx->block_size) ?
+               (data_length / ctx->block_size) : 1;
+}
+
+static void *merkle_leaf_worker(void *arg)
+{
+    struct merkle_leaf_job *job = (struct merkle_leaf_job *)arg;
+
+    job->rc = merkle_hash_leaves(job->ctx, job->data, job->count, job->hashes);
+    return NULL;
+}
+
+/* Hash 'count' leaves into 'hashes', split over up to ctx->jobs threads. The
+ * calling thread hashes the first range. */
+static int merkle_hash_batch(const struct bpak_merkle_context *ctx,
+                             const uint8_t *data, size_t count,
+                             uint8_t *hashes)
+{
+    struct merkle_leaf_job jobs[BPAK_MERKLE_MAX_JOBS];
+    size_t job_leaves = merkle_job_leaves(ctx);
+    size_t no_of_jobs = (count + job_leaves - 1) / job_leaves;
+    size_t leaves_per_job;
+    int rc = BPAK_OK;
+
+    no_of_jobs = BPAK_MIN(no_of_jobs, ctx->jobs);
+
+    if (no_of_jobs <= 1)
+        return merkle_hash_leaves(ctx, data, count, hashes);
+
+    leaves_per_job = (count + no_of_jobs - 1) / no_of_jobs;
+
+    for (size_t i = 0; i < no_of_jobs; i++) {
+        struct merkle_leaf_job *job = &jobs[i];
+        size_t first = BPAK_MIN(i * leaves_per_job, count);
+
+        job->ctx = ctx;
+        job->data = &data[first * ctx->block_size];
+        job->hashes = &hashes[first * BPAK_MERKLE_HASH_BYTES];
+        job->count = BPAK_MIN(leaves_per_job, count - first);
+        job->rc = BPAK_OK;
+        job->started = (i > 0) && (pthread_create(&job->thread,
+                                                  NULL,
+                                                  merkle_leaf_worker,
+                                                  job) == 0);
+    }
+
+    /* The first range, and any range that did not get a thread */
+    for (size_t i = 0; i < no_of_jobs; i++) {
+        if (!jobs[i].started)
+            merkle_leaf_worker(&jobs[i]);
+    }
+
+    for (size_t i = 0; i < no_of_jobs; i++) {
+        if (jobs[i].started)
+            pthread_join(jobs[i].thread, NULL);
+
+        if ((rc == BPAK_OK) && (jobs[i].rc != BPAK_OK))
+            rc = jobs[i].rc;
+    }
+
+    return rc;
+}
+
+static int merkle_write(struct bpak_merkle_context *ctx, off_t offset,
+                        uint8_t *buffer, size_t length)
+{
+    ssize_t n_written =
+        ctx->wr(ctx->offset + offset, buffer, length, ctx->priv);
+
+    if (n_written < 0)
+        return n_written;
+    if ((size_t)n_written != length)
+        return -BPAK_WRITE_ERROR;
+
+    return BPAK_OK;
+}
+
+static int merkle_read(struct bpak_merkle_context *ctx, off_t offset,
+                       uint8_t *buffer, size_t length)
+{
+    ssize_t n_read = ctx->rd(ctx->offset + offset, buffer, length, ctx->priv);
+
+    if (n_read < 0)
+        return n_read;
+    if ((size_t)n_read != length)
+        return -BPAK_READ_ERROR;
+
+    return BPAK_OK;
+}
+
+/* Write the level 0 hashes that are collected in ctx->block */
+static int merkle_flush_level0(struct bpak_merkle_context *ctx)
+{
+    int rc;
+
+    if (ctx->block_fill == 0)
+        return BPAK_OK;
+
+    rc = merkle_write(ctx,
+                      ctx->level_offset[0] + ctx->input_chunk_counter,
+                      ctx->block,
+                      ctx->block_fill);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    ctx->input_chunk_counter += ctx->block_fill;
+    ctx->block_fill = 0;
+    return BPAK_OK;
+}
+
+/* Block size and level limit of 'options', NULL gives the defaults */
+static int merkle_options_get(const struct bpak_merkle_options *options,
+                              size_t *block_size, unsigned int *max_levels)
+{
+    *block_size = BPAK_MERKLE_BLOCK_SZ;
+    *max_levels = BPAK_MERKLE_MAX_LEVELS;
+
+    if (options == NULL)
+        return BPAK_OK;
+
+    if (options->block_size != 0)
+        *block_size = options->block_size;
+    if (options->max_levels != 0)
+        *max_levels = options->max_levels;
+
+    if ((*block_size < BPAK_MERKLE_MIN_BLOCK_SZ) ||
+        (*block_size > BPAK_MERKLE_MAX_BLOCK_SZ) ||
+        (*block_size & (*block_size - 1)) ||
+        (*max_levels > BPAK_MERKLE_MAX_LEVELS))
+        return -BPAK_NOT_SUPPORTED;
+
+    return BPAK_OK;
+}
+
+/* Length of each level, from level 0 and up. Every level is padded to a
+ * whole block and the top level is one block. */
+static int merkle_layout(size_t input_data_length, size_t block_size,
+                         unsigned int max_levels, size_t *level_length,
+                         unsigned int *no_of_levels)
+{
+    size_t length = input_data_length;
     unsigned int level = 0;
-    size_t pad_bytes;
-    size_t result = 0;
 
-    if (input_data_length % BPAK_MERKLE_BLOCK_SZ != 0)
+    if ((input_data_length == 0) || (input_data_length % block_size != 0))
         return -BPAK_BAD_ALIGNMENT;
 
     do {
-        level_length = (level_length >> BPAK_MERKLE_BLOCK_BITS) * 32;
-        pad_bytes = (~level_length + 1) & (BPAK_MERKLE_BLOCK_SZ - 1);
-        level_length += pad_bytes;
-        result += level_length;
-        level = level + 1;
-
-        if (level > BPAK_MERKLE_MAX_LEVELS)
+        if (level >= max_levels)
             return -BPAK_NO_SPACE_LEFT;
 
-    } while (level_length != BPAK_MERKLE_BLOCK_SZ);
+        length = (length / block_size) * BPAK_MERKLE_HASH_BYTES;
+        length += (~length + 1) & (block_size - 1);
+        level_length[level++] = length;
+    } while (length != block_size);
+
+    *no_of_levels = level;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT ssize_t
+bpak_merkle_compute_tree_size(size_t input_data_length,
+                              const struct bpak_merkle_options *options)
+{
+    int rc;
+    size_t block_size;
+    unsigned int max_levels;
+    size_t level_length[BPAK_MERKLE_MAX_LEVELS];
+    unsigned int no_of_levels;
+    size_t result = 0;
+
+    rc = merkle_options_get(options, &block_size, &max_levels);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = merkle_layout(input_data_length,
+                       block_size,
+                       max_levels,
+                       level_length,
+                       &no_of_levels);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    for (unsigned int i = 0; i < no_of_levels; i++)
+        result += level_length[i];
 
     return result;
 }
 
-BPAK_EXPORT int bpak_merkle_init(struct bpak_merkle_context *ctx,
-                                 size_t input_data_length, const uint8_t *salt,
-                                 size_t salt_length, bpak_io_t wr, bpak_io_t rd,
-                                 off_t offset, bool zero_fill_output,
-                                 void *priv)
+BPAK_EXPORT ssize_t bpak_merkle_compute_size(size_t input_data_length)
 {
-    unsigned int level = 0;
-    size_t level_length = 0;
-    size_t pad_bytes = 0;
+    return bpak_merkle_compute_tree_size(input_data_length, NULL);
+}
+
+BPAK_EXPORT void
+bpak_merkle_options_from_meta(const uint8_t *block_size_meta,
+                              struct bpak_merkle_options *options)
+{
+    uint32_t block_size = 0;
+
+    memset(options, 0, sizeof(*options));
+
+    /* The low word of the 64 bit integer meta of 'bpak add' */
+    if (block_size_meta != NULL)
+        memcpy(&block_size, block_size_meta, sizeof(block_size));
+
+    options->block_size = block_size;
+}
+
+BPAK_EXPORT int bpak_merkle_init_opts(struct bpak_merkle_context *ctx,
+                                      size_t input_data_length,
+                                      const uint8_t *salt, size_t salt_length,
+                                      bpak_io_t wr, bpak_io_t rd, off_t offset,
+                                      bool zero_fill_output,
+                                      const struct bpak_merkle_options *options,
+                                      void *priv)
+{
+    int rc;
+    unsigned int max_levels;
 
     bpak_printf(2, "%s: input length: %zu\n", __func__, input_data_length);
 
@@ -54,12 +346,16 @@ BPAK_EXPORT int bpak_merkle_init(struct bpak_merkle_context *ctx,
     ctx->rd = rd;
     ctx->offset = offset;
     ctx->input_data_length = input_data_length;
-    ctx->block_byte_counter = BPAK_MERKLE_BLOCK_SZ;
     ctx->salt_length = salt_length;
+    ctx->jobs = 1;
     ctx->priv = priv;
 
-    if (input_data_length % BPAK_MERKLE_BLOCK_SZ != 0)
-        return -BPAK_BAD_ALIGNMENT;
+    rc = merkle_options_get(options, &ctx->block_size, &max_levels);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    ctx->block_byte_counter = ctx->block_size;
 
     if (salt_length > sizeof(ctx->salt))
         return -BPAK_NO_SPACE_LEFT;
@@ -67,21 +363,17 @@ BPAK_EXPORT int bpak_merkle_init(struct bpak_merkle_context *ctx,
     memcpy(ctx->salt, salt, salt_length);
 
     /* Compute the length of each level and the total length of the hash tree */
-    level_length = input_data_length;
-    do {
-        level_length = (level_length >> BPAK_MERKLE_BLOCK_BITS) * 32;
-        pad_bytes = (~level_length + 1) & (BPAK_MERKLE_BLOCK_SZ - 1);
-        level_length += pad_bytes;
-        ctx->level_length[level] = level_length;
-        ctx->hash_tree_length += level_length;
-        level = level + 1;
-
-        if (level >= BPAK_MERKLE_MAX_LEVELS)
-            return -BPAK_NO_SPACE_LEFT;
+    rc = merkle_layout(input_data_length,
+                       ctx->block_size,
+                       max_levels,
+                       ctx->level_length,
+                       &ctx->no_of_levels);
 
-    } while (level_length != BPAK_MERKLE_BLOCK_SZ);
+    if (rc != BPAK_OK)
+        return rc;
 
-    ctx->no_of_levels = level;
+    for (unsigned int i = 0; i < ctx->no_of_levels; i++)
+        ctx->hash_tree_length += ctx->level_length[i];
 
     /* Compute offsets for each level */
     off_t tree_level_offset = ctx->hash_tree_length;
@@ -99,31 +391,366 @@ BPAK_EXPORT int bpak_merkle_init(struct bpak_merkle_context *ctx,
     /* Zero fill output tree */
     if (zero_fill_output) {
         bpak_printf(2, "Zero filling tree\n");
-        size_t zero_fill_bytes = ctx->hash_tree_length;
-        off_t output_offset = offset;
-        while (zero_fill_bytes > 0) {
-            ssize_t n_written =
-                ctx->wr(output_offset, ctx->buffer, sizeof(ctx->buffer), priv);
-
-            if (n_written < 0)
-                return n_written;
-            if (n_written != sizeof(ctx->buffer))
-                return -BPAK_WRITE_ERROR;
-
-            output_offset += n_written;
-            zero_fill_bytes -= sizeof(ctx->buffer);
+        /* ctx->block is zeroed */
+        for (off_t output_offset = 0;
+             output_offset < (off_t)ctx->hash_tree_length;
+             output_offset += sizeof(ctx->block)) {
+            rc = merkle_write(ctx,
+                              output_offset,
+                              ctx->block,
+                              BPAK_MIN(sizeof(ctx->block),
+                                       ctx->hash_tree_length -
+                                           output_offset));
+
+            if (rc != BPAK_OK)
+                return rc;
         }
         bpak_printf(2, "Zero fill done\n");
     }
 
+    /* The salt is hashed once, each leaf starts from a copy of this state */
+    if (bpak_hash_init(&ctx->salted_hash, BPAK_HASH_SHA256) == BPAK_OK) {
+        if (bpak_hash_update(&ctx->salted_hash, salt, salt_length) ==
+            BPAK_OK) {
+            ctx->salted_hash_valid = true;
+        } else {
+            bpak_hash_free(&ctx->salted_hash);
+        }
+    }
+
     return BPAK_OK;
 }
 
+BPAK_EXPORT int bpak_merkle_init(struct bpak_merkle_context *ctx,
+                                 size_t input_data_length, const uint8_t *salt,
+                                 size_t salt_length, bpak_io_t wr, bpak_io_t rd,
+                                 off_t offset, bool zero_fill_output,
+                                 void *priv)
+{
+    return bpak_merkle_init_opts(ctx,
+                                 input_data_length,
+                                 salt,
+                                 salt_length,
+                                 wr,
+                                 rd,
+                                 offset,
+                                 zero_fill_output,
+                                 NULL,
+                                 priv);
+}
+
 BPAK_EXPORT size_t bpak_merkle_get_size(struct bpak_merkle_context *ctx)
 {
     return ctx->hash_tree_length;
 }
 
+BPAK_EXPORT int bpak_merkle_set_jobs(struct bpak_merkle_context *ctx,
+                                     unsigned int jobs)
+{
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = (cpus > 0) ? cpus : 1;
+    }
+
+    ctx->jobs = BPAK_MIN(jobs, BPAK_MERKLE_MAX_JOBS);
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_merkle_set_allocator(struct bpak_merkle_context *ctx,
+                          const struct bpak_allocator *allocator)
+{
+    ctx->allocator = allocator;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT size_t
+bpak_merkle_heap_size(const struct bpak_merkle_context *ctx)
+{
+    size_t leaves = ctx->jobs * merkle_job_leaves(ctx);
+    size_t length = leaves * BPAK_MERKLE_HASH_BYTES;
+
+    /* The leaf hashes and the block of bpak_merkle_finish are not
+     * allocated at the same time */
+    length = (length > ctx->block_size) ? length : ctx->block_size;
+    return length + MERKLE_HEAP_MARGIN;
+}
+
+BPAK_EXPORT int bpak_merkle_write_leaves(struct bpak_merkle_context *ctx,
+                                         const uint8_t *buffer, size_t count)
+{
+    int rc = BPAK_OK;
+    size_t batch_leaves;
+    uint8_t *hashes;
+
+    if (ctx->block_byte_counter != ctx->block_size)
+        return -BPAK_BAD_ALIGNMENT;
+
+    if (count == 0)
+        return BPAK_OK;
+
+    /* Hashes of leaves that were split over several chunks go first */
+    rc = merkle_flush_level0(ctx);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    batch_leaves = BPAK_MIN(count, ctx->jobs * merkle_job_leaves(ctx));
+    hashes = bpak_allocator_calloc(ctx->allocator,
+                                   batch_leaves,
+                                   BPAK_MERKLE_HASH_BYTES);
+
+    if (hashes == NULL)
+        return -BPAK_FAILED;
+
+    while (count > 0) {
+        size_t n = BPAK_MIN(count, batch_leaves);
+        size_t hashes_length = n * BPAK_MERKLE_HASH_BYTES;
+
+        rc = merkle_hash_batch(ctx, buffer, n, hashes);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+
+        /* Level 0 is the leaf hashes in input order */
+        rc = merkle_write(ctx,
+                          ctx->level_offset[0] + ctx->input_chunk_counter,
+                          hashes,
+                          hashes_length);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+
+        ctx->input_chunk_counter += hashes_length;
+        buffer += n * ctx->block_size;
+        count -= n;
+
+        /* Keep the last leaf hash, it is the root hash of a one block tree */
+        memcpy(ctx->buffer,
+               &hashes[hashes_length - BPAK_MERKLE_HASH_BYTES],
+               sizeof(ctx->buffer));
+    }
+
+    if (ctx->input_data_length == ctx->block_size) {
+        bpak_printf(2, "Early out\n");
+        ctx->finished = true;
+    }
+
+err_free_out:
+    bpak_allocator_free(ctx->allocator, hashes);
+    return rc;
+}
+
+BPAK_EXPORT int bpak_merkle_write_hashes(struct bpak_merkle_context *ctx,
+                                         const uint8_t *hashes, size_t count)
+{
+    int rc;
+
+    if (ctx->block_byte_counter != ctx->block_size)
+        return -BPAK_BAD_ALIGNMENT;
+
+    for (size_t i = 0; i < count; i++) {
+        if (ctx->finished)
+            return BPAK_OK;
+
+        memcpy(ctx->buffer,
+               &hashes[i * BPAK_MERKLE_HASH_BYTES],
+               sizeof(ctx->buffer));
+        memcpy(&ctx->block[ctx->block_fill], ctx->buffer, sizeof(ctx->buffer));
+        ctx->block_fill += sizeof(ctx->buffer);
+
+        if (ctx->block_fill == sizeof(ctx->block)) {
+            rc = merkle_flush_level0(ctx);
+
+            if (rc != BPAK_OK)
+                return rc;
+        }
+
+        /* The only leaf hash is the root hash of a one block tree */
+        if (ctx->input_data_length == ctx->block_size) {
+            ctx->finished = true;
+            return merkle_flush_level0(ctx);
+        }
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_merkle_write_zero_leaves(struct bpak_merkle_context *ctx,
+                                             size_t count)
+{
+    int rc;
+    struct bpak_hash_context hash;
+    uint8_t zero[256];
+    uint8_t hashes[64 * BPAK_MERKLE_HASH_BYTES];
+
+    if (count == 0)
+        return BPAK_OK;
+
+    /* Every zero leaf has the same hash */
+    memset(zero, 0, sizeof(zero));
+    rc = merkle_hash_start(ctx, &hash);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    for (size_t i = 0; (rc == BPAK_OK) && (i < ctx->block_size);
+         i += sizeof(zero)) {
+        rc = bpak_hash_update(&hash, zero, sizeof(zero));
+    }
+
+    if (rc == BPAK_OK)
+        rc = bpak_hash_final(&hash, hashes, BPAK_MERKLE_HASH_BYTES, NULL);
+
+    bpak_hash_free(&hash);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    for (size_t i = 1; i < sizeof(hashes) / BPAK_MERKLE_HASH_BYTES; i++) {
+        memcpy(&hashes[i * BPAK_MERKLE_HASH_BYTES],
+               hashes,
+               BPAK_MERKLE_HASH_BYTES);
+    }
+
+    while (count > 0) {
+        size_t n = BPAK_MIN(count, sizeof(hashes) / BPAK_MERKLE_HASH_BYTES);
+
+        rc = bpak_merkle_write_hashes(ctx, hashes, n);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        count -= n;
+    }
+
+    return BPAK_OK;
+}
+
+/* Add 'length' zero bytes, whole leaves are added as zero leaves. With
+ * other than the default block size, an extent can start or end within a
+ * leaf. */
+static int merkle_write_zeros(struct bpak_merkle_context *ctx,
+                              uint64_t length)
+{
+    int rc;
+    uint8_t zero[256];
+
+    memset(zero, 0, sizeof(zero));
+
+    while (length > 0) {
+        if ((ctx->block_byte_counter == ctx->block_size) &&
+            (length >= ctx->block_size)) {
+            rc = bpak_merkle_write_zero_leaves(ctx,
+                                               length / ctx->block_size);
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            length %= ctx->block_size;
+            continue;
+        }
+
+        size_t n = BPAK_MIN(length, sizeof(zero));
+
+        n = BPAK_MIN(n, ctx->block_byte_counter);
+        rc = bpak_merkle_write_chunk(ctx, zero, n);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        length -= n;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_merkle_write_sparse(struct bpak_merkle_context *ctx,
+                                         const struct bpak_sparse_map *map,
+                                         uint64_t position, uint8_t *buffer,
+                                         size_t length)
+{
+    int rc;
+    uint64_t end = BPAK_MIN(position + length, map->stored_size);
+    uint64_t zeros = 0;
+
+    /* An extent is added in front of the stored byte that follows it */
+    for (size_t i = 0; (i < map->count) && (position < end); i++) {
+        uint64_t start = (uint64_t)map->extents[i].block *
+                             BPAK_SPARSE_BLOCK_SZ -
+                         zeros;
+
+        zeros += (uint64_t)map->extents[i].count * BPAK_SPARSE_BLOCK_SZ;
+
+        if (start < position)
+            continue;
+        if (start >= end)
+            break;
+
+        rc = bpak_merkle_write_chunk(ctx, buffer, start - position);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        buffer += start - position;
+        position = start;
+
+        rc = merkle_write_zeros(ctx,
+                                (uint64_t)map->extents[i].count *
+                                    BPAK_SPARSE_BLOCK_SZ);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    if (position >= end)
+        return BPAK_OK;
+
+    return bpak_merkle_write_chunk(ctx, buffer, end - position);
+}
+
+BPAK_EXPORT off_t
+bpak_merkle_tree_leaf_offset(size_t input_data_length,
+                             const struct bpak_merkle_options *options,
+                             size_t index)
+{
+    int rc;
+    size_t block_size;
+    unsigned int max_levels;
+    size_t level_length[BPAK_MERKLE_MAX_LEVELS];
+    unsigned int no_of_levels;
+    size_t tree_length = 0;
+
+    rc = merkle_options_get(options, &block_size, &max_levels);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = merkle_layout(input_data_length,
+                       block_size,
+                       max_levels,
+                       level_length,
+                       &no_of_levels);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (index >= (input_data_length / block_size))
+        return -BPAK_SIZE_ERROR;
+
+    for (unsigned int i = 0; i < no_of_levels; i++)
+        tree_length += level_length[i];
+
+    /* Level 0 is the last level in the tree */
+    return tree_length - level_length[0] + index * BPAK_MERKLE_HASH_BYTES;
+}
+
+BPAK_EXPORT off_t bpak_merkle_leaf_offset(size_t input_data_length,
+                                          size_t index)
+{
+    return bpak_merkle_tree_leaf_offset(input_data_length, NULL, index);
+}
+
 BPAK_EXPORT int bpak_merkle_write_chunk(struct bpak_merkle_context *ctx,
                                         uint8_t *buffer, size_t length)
 {
@@ -133,15 +760,27 @@ BPAK_EXPORT int bpak_merkle_write_chunk(struct bpak_merkle_context *ctx,
     uint8_t *chunk_buffer = buffer;
 
     while (data_to_process > 0) {
-        if (ctx->block_byte_counter == BPAK_MERKLE_BLOCK_SZ) {
-            rc = bpak_hash_init(&ctx->running_hash, BPAK_HASH_SHA256);
+        /* Complete leaves are hashed in batches */
+        if ((ctx->block_byte_counter == ctx->block_size) &&
+            (data_to_process >= ctx->block_size)) {
+            size_t count = data_to_process / ctx->block_size;
+
+            rc = bpak_merkle_write_leaves(ctx, chunk_buffer, count);
+
             if (rc != BPAK_OK)
                 return rc;
-            rc = bpak_hash_update(&ctx->running_hash,
-                                  ctx->salt,
-                                  ctx->salt_length);
+            if (ctx->finished)
+                return BPAK_OK;
+
+            chunk_buffer += count * ctx->block_size;
+            data_to_process -= count * ctx->block_size;
+            continue;
+        }
+
+        if (ctx->block_byte_counter == ctx->block_size) {
+            rc = merkle_hash_start(ctx, &ctx->running_hash);
             if (rc != BPAK_OK)
-                goto err_free_hash_ctx_out;
+                return rc;
         }
 
         chunk_length = BPAK_MIN(ctx->block_byte_counter, data_to_process);
@@ -156,7 +795,7 @@ BPAK_EXPORT int bpak_merkle_write_chunk(struct bpak_merkle_context *ctx,
         data_to_process -= chunk_length;
 
         if (ctx->block_byte_counter == 0) {
-            ctx->block_byte_counter = BPAK_MERKLE_BLOCK_SZ;
+            ctx->block_byte_counter = ctx->block_size;
 
             rc = bpak_hash_final(&ctx->running_hash, ctx->buffer, 32, NULL);
 
@@ -165,27 +804,26 @@ BPAK_EXPORT int bpak_merkle_write_chunk(struct bpak_merkle_context *ctx,
 
             bpak_hash_free(&ctx->running_hash);
 
-            off_t output_offset =
-                ctx->input_chunk_counter + ctx->level_offset[0];
-            ssize_t bytes_written = ctx->wr(ctx->offset + output_offset,
-                                            ctx->buffer,
-                                            sizeof(ctx->buffer),
-                                            ctx->priv);
+            /* Collect the hashes and write them a block at a time */
+            memcpy(&ctx->block[ctx->block_fill],
+                   ctx->buffer,
+                   sizeof(ctx->buffer));
+            ctx->block_fill += sizeof(ctx->buffer);
 
-            if (bytes_written < 0)
-                return bytes_written;
-            if (bytes_written != sizeof(ctx->buffer))
-                return -BPAK_WRITE_ERROR;
+            if (ctx->block_fill == sizeof(ctx->block)) {
+                rc = merkle_flush_level0(ctx);
 
-            ctx->input_chunk_counter += bytes_written;
+                if (rc != BPAK_OK)
+                    return rc;
+            }
 
-            if (ctx->input_data_length == BPAK_MERKLE_BLOCK_SZ) {
+            if (ctx->input_data_length == ctx->block_size) {
                 bpak_printf(2, "Early out\n");
-                /* Special case when total input bytes == 4096. In this
-                 * case the root hash will be the hash of the first and only
+                /* Special case when the input is one block. In this case
+                 * the root hash will be the hash of the first and only
                  * input block. */
                 ctx->finished = true;
-                return BPAK_OK;
+                return merkle_flush_level0(ctx);
             }
         }
     }
@@ -201,126 +839,312 @@ BPAK_EXPORT int bpak_merkle_finish(struct bpak_merkle_context *ctx,
 {
     int rc;
     off_t input_offset, output_offset;
-    ssize_t input_block_count;
-    ssize_t bytes_to_process;
-    ssize_t chunk_length;
-    ssize_t n_read;
-    ssize_t n_written;
+    size_t input_block_count;
+    uint8_t *input_block;
 
     if (ctx->finished) {
         memcpy(roothash, ctx->buffer, 32);
+        merkle_hash_release(ctx);
         return BPAK_OK;
     }
 
+    rc = merkle_flush_level0(ctx);
+
+    if (rc != BPAK_OK)
+        goto err_release_out;
+
+    BPAK_TRACE2(merkle__level, 0, ctx->level_length[0]);
+
+    /* Levels are read back one block at a time and the hashes of the next
+     * level are collected in ctx->block before they are written */
+    input_block = bpak_allocator_calloc(ctx->allocator, 1, ctx->block_size);
+
+    if (input_block == NULL) {
+        rc = -BPAK_FAILED;
+        goto err_release_out;
+    }
+
     /* Build the rest of the tree from level 1 and up */
     for (unsigned int i = 1; i < ctx->no_of_levels; i++) {
-        input_block_count = ctx->level_length[i - 1] / BPAK_MERKLE_BLOCK_SZ;
+        input_block_count = ctx->level_length[i - 1] / ctx->block_size;
         input_offset = ctx->level_offset[i - 1];
         output_offset = ctx->level_offset[i];
 
-        for (int n = 0; n < input_block_count; n++) {
-            bpak_printf(2, "Computing block %i on level %i\n", n, i);
-            rc = bpak_hash_init(&ctx->running_hash, BPAK_HASH_SHA256);
+        for (size_t n = 0; n < input_block_count; n++) {
+            bpak_printf(2, "Computing block %zu on level %u\n", n, i);
+
+            rc = merkle_read(ctx,
+                             input_offset,
+                             input_block,
+                             ctx->block_size);
+
             if (rc != BPAK_OK)
-                return rc;
+                goto err_free_out;
+
+            rc = merkle_hash_leaves(ctx,
+                                    input_block,
+                                    1,
+                                    &ctx->block[ctx->block_fill]);
 
-            rc = bpak_hash_update(&ctx->running_hash,
-                                  ctx->salt,
-                                  ctx->salt_length);
             if (rc != BPAK_OK)
-                goto err_free_hash_ctx_out;
+                goto err_free_out;
+
+            ctx->block_fill += BPAK_MERKLE_HASH_BYTES;
+            input_offset += ctx->block_size;
 
-            /* Read sizof(ctx->buffer) sized chunks and update hash for block
-             *  n */
-            for (unsigned int c = 0; c < BPAK_MERKLE_BLOCK_SZ;
-                 c += sizeof(ctx->buffer)) {
-                n_read = ctx->rd(ctx->offset + input_offset + c,
-                                 ctx->buffer,
-                                 sizeof(ctx->buffer),
-                                 ctx->priv);
-                if (n_read < 0) {
-                    rc = n_read;
-                    goto err_free_hash_ctx_out;
-                }
-                if (n_read != sizeof(ctx->buffer)) {
-                    rc = -BPAK_READ_ERROR;
-                    goto err_free_hash_ctx_out;
-                }
-
-                rc = bpak_hash_update(&ctx->running_hash,
-                                      ctx->buffer,
-                                      sizeof(ctx->buffer));
+            if ((ctx->block_fill == sizeof(ctx->block)) ||
+                (n == input_block_count - 1)) {
+                rc = merkle_write(ctx,
+                                  output_offset,
+                                  ctx->block,
+                                  ctx->block_fill);
 
                 if (rc != BPAK_OK)
-                    goto err_free_hash_ctx_out;
+                    goto err_free_out;
+
+                output_offset += ctx->block_fill;
+                ctx->block_fill = 0;
             }
+        }
 
-            rc = bpak_hash_final(&ctx->running_hash, ctx->buffer, 32, NULL);
+        BPAK_TRACE2(merkle__level, i, ctx->level_length[i]);
+    }
 
-            if (rc != BPAK_OK)
-                goto err_free_hash_ctx_out;
+    /* Compute the root hash, which is the hash of the top level. The top
+     * level is always exactly one block. */
+    bpak_printf(2, "Computing root hash\n");
 
-            n_written = ctx->wr(ctx->offset + output_offset,
-                                ctx->buffer,
-                                sizeof(ctx->buffer),
-                                ctx->priv);
+    rc = merkle_read(ctx,
+                     ctx->level_offset[ctx->no_of_levels - 1],
+                     input_block,
+                     ctx->block_size);
 
-            if (n_written < 0) {
-                rc = n_written;
-                goto err_free_hash_ctx_out;
-            }
-            if (n_written != sizeof(ctx->buffer)) {
-                rc = -BPAK_WRITE_ERROR;
-                goto err_free_hash_ctx_out;
-            }
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    rc = merkle_hash_leaves(ctx, input_block, 1, roothash);
 
-            output_offset += n_written;
-            input_offset += BPAK_MERKLE_BLOCK_SZ;
+    if (rc == BPAK_OK)
+        ctx->finished = true;
+
+err_free_out:
+    bpak_allocator_free(ctx->allocator, input_block);
+err_release_out:
+    merkle_hash_release(ctx);
+    return rc;
+}
+
+static struct bpak_merkle_cache_block *
+merkle_cache_lookup(struct bpak_merkle_verify_context *ctx, off_t offset)
+{
+    for (unsigned int i = 0; i < BPAK_MERKLE_CACHE_BLOCKS; i++) {
+        struct bpak_merkle_cache_block *block = &ctx->cache[i];
+
+        if ((block->state == BPAK_MERKLE_CACHE_VERIFIED) &&
+            (block->offset == offset)) {
+            block->stamp = ++ctx->stamp;
+            return block;
         }
     }
 
-    bpak_hash_free(&ctx->running_hash);
-    /* Compute the root hash, which is the hash of the top level */
-    bpak_printf(2, "Computing root hash\n");
-    rc = bpak_hash_init(&ctx->running_hash, BPAK_HASH_SHA256);
+    return NULL;
+}
+
+/* Take an unused entry, or evict the least recently used verified one.
+ * There are more entries than levels, so the blocks that are pending on
+ * the current path are never evicted. */
+static struct bpak_merkle_cache_block *
+merkle_cache_alloc(struct bpak_merkle_verify_context *ctx, off_t offset)
+{
+    struct bpak_merkle_cache_block *victim = NULL;
+
+    for (unsigned int i = 0; i < BPAK_MERKLE_CACHE_BLOCKS; i++) {
+        struct bpak_merkle_cache_block *block = &ctx->cache[i];
+
+        if (block->state == BPAK_MERKLE_CACHE_UNUSED) {
+            victim = block;
+            break;
+        }
+
+        if ((block->state == BPAK_MERKLE_CACHE_VERIFIED) &&
+            ((victim == NULL) || (block->stamp < victim->stamp))) {
+            victim = block;
+        }
+    }
+
+    victim->offset = offset;
+    victim->stamp = ++ctx->stamp;
+    victim->state = BPAK_MERKLE_CACHE_PENDING;
+    return victim;
+}
+
+BPAK_EXPORT int
+bpak_merkle_verify_init_opts(struct bpak_merkle_verify_context *ctx,
+                             size_t input_data_length, const uint8_t *salt,
+                             size_t salt_length,
+                             const bpak_merkle_hash_t roothash, bpak_io_t rd,
+                             off_t offset,
+                             const struct bpak_merkle_options *options,
+                             void *priv)
+{
+    int rc;
+    uint8_t *cache_data = &ctx->cache_data[0][0];
+
+    memset(ctx, 0, sizeof(*ctx));
+    memcpy(ctx->roothash, roothash, sizeof(ctx->roothash));
+
+    rc = bpak_merkle_init_opts(&ctx->tree,
+                               input_data_length,
+                               salt,
+                               salt_length,
+                               NULL,
+                               rd,
+                               offset,
+                               false,
+                               options,
+                               priv);
 
     if (rc != BPAK_OK)
-        return rc;
+        goto err_release_out;
+
+    /* Blocks larger than the default do not fit in the context */
+    if (ctx->tree.block_size > BPAK_MERKLE_BLOCK_SZ) {
+        ctx->cache_heap = bpak_calloc(BPAK_MERKLE_CACHE_BLOCKS,
+                                      ctx->tree.block_size);
+
+        if (ctx->cache_heap == NULL) {
+            rc = -BPAK_FAILED;
+            goto err_release_out;
+        }
+
+        cache_data = ctx->cache_heap;
+    }
+
+    for (unsigned int i = 0; i < BPAK_MERKLE_CACHE_BLOCKS; i++)
+        ctx->cache[i].data = &cache_data[i * ctx->tree.block_size];
+
+    return BPAK_OK;
+
+err_release_out:
+    merkle_hash_release(&ctx->tree);
+    return rc;
+}
+
+BPAK_EXPORT int bpak_merkle_verify_init(struct bpak_merkle_verify_context *ctx,
+                                        size_t input_data_length,
+                                        const uint8_t *salt,
+                                        size_t salt_length,
+                                        const bpak_merkle_hash_t roothash,
+                                        bpak_io_t rd, off_t offset, void *priv)
+{
+    return bpak_merkle_verify_init_opts(ctx,
+                                        input_data_length,
+                                        salt,
+                                        salt_length,
+                                        roothash,
+                                        rd,
+                                        offset,
+                                        NULL,
+                                        priv);
+}
+
+BPAK_EXPORT int bpak_merkle_verify_block(struct bpak_merkle_verify_context *ctx,
+                                         size_t block_index,
+                                         const uint8_t *data)
+{
+    int rc;
+    struct bpak_merkle_context *tree = &ctx->tree;
+    struct bpak_merkle_cache_block *path[BPAK_MERKLE_MAX_LEVELS];
+    unsigned int path_length = 0;
+    bpak_merkle_hash_t hash;
+    size_t pos = block_index;
 
-    rc = bpak_hash_update(&ctx->running_hash, ctx->salt, ctx->salt_length);
+    if (block_index >= tree->input_data_length / tree->block_size)
+        return -BPAK_SIZE_ERROR;
+
+    rc = merkle_hash_leaves(tree, data, 1, hash);
 
     if (rc != BPAK_OK)
-        goto err_free_hash_ctx_out;
-
-    bytes_to_process = ctx->level_length[ctx->no_of_levels - 1];
-    input_offset = ctx->level_offset[ctx->no_of_levels - 1];
-    while (bytes_to_process > 0) {
-        chunk_length = BPAK_MIN((ssize_t)sizeof(ctx->buffer), bytes_to_process);
-        n_read = ctx->rd(ctx->offset + input_offset,
-                         ctx->buffer,
-                         chunk_length,
-                         ctx->priv);
-
-        if (n_read < 0) {
-            rc = n_read;
-            goto err_free_hash_ctx_out;
+        return rc;
+
+    /* The root hash of a one block input is the hash of that block */
+    if (tree->input_data_length == tree->block_size) {
+        if (memcmp(hash, ctx->roothash, sizeof(hash)) != 0)
+            return -BPAK_BAD_ROOT_HASH;
+        return BPAK_OK;
+    }
+
+    /* Walk from the leaf towards the root. 'hash' is the verified value of
+     * entry 'pos' on the current level once the block that holds it is
+     * trusted. */
+    for (unsigned int level = 0; level < tree->no_of_levels; level++) {
+        off_t hash_offset =
+            tree->level_offset[level] + pos * BPAK_MERKLE_HASH_BYTES;
+        off_t block_offset = hash_offset & ~(off_t)(tree->block_size - 1);
+        struct bpak_merkle_cache_block *block;
+
+        block = merkle_cache_lookup(ctx, block_offset);
+
+        if (block != NULL) {
+            if (memcmp(&block->data[hash_offset - block_offset],
+                       hash,
+                       sizeof(hash)) != 0) {
+                rc = -BPAK_BAD_ROOT_HASH;
+                goto err_out;
+            }
+
+            /* The rest of the path was verified before */
+            goto verified_out;
         }
-        if (n_read != chunk_length) {
-            rc = -BPAK_READ_ERROR;
-            goto err_free_hash_ctx_out;
+
+        block = merkle_cache_alloc(ctx, block_offset);
+        path[path_length++] = block;
+
+        rc = merkle_read(tree, block_offset, block->data, tree->block_size);
+
+        if (rc != BPAK_OK)
+            goto err_out;
+
+        if (memcmp(&block->data[hash_offset - block_offset],
+                   hash,
+                   sizeof(hash)) != 0) {
+            rc = -BPAK_BAD_ROOT_HASH;
+            goto err_out;
         }
 
-        rc = bpak_hash_update(&ctx->running_hash, ctx->buffer, chunk_length);
+        rc = merkle_hash_leaves(tree, block->data, 1, hash);
+
         if (rc != BPAK_OK)
-            goto err_free_hash_ctx_out;
-        bytes_to_process -= chunk_length;
-        input_offset += chunk_length;
+            goto err_out;
+
+        pos = (block_offset - tree->level_offset[level]) / tree->block_size;
     }
 
-    rc = bpak_hash_final(&ctx->running_hash, roothash, 32, NULL);
-    ctx->finished = true;
+    /* The top level is one block, its hash is the root hash */
+    if (memcmp(hash, ctx->roothash, sizeof(hash)) != 0) {
+        rc = -BPAK_BAD_ROOT_HASH;
+        goto err_out;
+    }
+
+verified_out:
+    for (unsigned int i = 0; i < path_length; i++)
+        path[i]->state = BPAK_MERKLE_CACHE_VERIFIED;
+
+    return BPAK_OK;
+err_out:
+    for (unsigned int i = 0; i < path_length; i++)
+        path[i]->state = BPAK_MERKLE_CACHE_UNUSED;
 
-err_free_hash_ctx_out:
-    bpak_hash_free(&ctx->running_hash);
     return rc;
 }
+
+BPAK_EXPORT void bpak_merkle_verify_free(struct bpak_merkle_verify_context *ctx)
+{
+    merkle_hash_release(&ctx->tree);
+
+    for (unsigned int i = 0; i < BPAK_MERKLE_CACHE_BLOCKS; i++)
+        ctx->cache[i].state = BPAK_MERKLE_CACHE_UNUSED;
+
+    bpak_free(ctx->cache_heap);
+    ctx->cache_heap = NULL;
+}
@@ -7,11 +7,15 @@
  *
  */
 
+/* O_DIRECT and sync_file_range */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -20,7 +24,230 @@
 #include <bpak/crc.h>
 #include <bpak/pkg.h>
 #include <bpak/utils.h>
+#include <bpak/id.h>
 #include <bpak/transport.h>
+#include "file_copy.h"
+#include "pkg_hash.h"
+#include "hash_pipeline.h"
+#if BPAK_CONFIG_SHA == 1
+#include "sha.h"
+#endif
+
+#define PKG_HASH_CACHE_MAGIC   0x53485042 /* 'BPHS' */
+#define PKG_HASH_CACHE_VERSION 1
+
+/* Payload hash state after the first 'no_of_parts' part headers. When only
+ * parts are appended, the payload hash continues from this state instead
+ * of hashing the whole payload again. */
+struct pkg_hash_state {
+    uint8_t hash_kind;
+    unsigned int no_of_parts;
+    struct bpak_part_header parts[BPAK_MAX_PARTS];
+    struct bpak_hash_context hash;
+    bool hash_valid;
+    bool builtin; /*!< 'hash' holds a struct bpak_sha_context */
+    char *cache_filename;
+    bool deferred; /*!< Hash updates wait for bpak_pkg_commit */
+    bool all_touched; /*!< More parts were edited than 'touched' holds */
+    unsigned int no_of_touched;
+    bpak_id_t touched[BPAK_MAX_PARTS]; /*!< Parts edited in the session */
+};
+
+#if BPAK_CONFIG_SHA == 1
+/* Hash cache file. It is a local cache in host byte order, and is only
+ * trusted while the package file is unchanged since the cache was saved. */
+struct pkg_hash_cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hash_kind;
+    uint32_t no_of_parts;
+    struct bpak_part_header parts[BPAK_MAX_PARTS];
+    uint64_t pkg_size;
+    uint64_t pkg_ino;
+    int64_t pkg_mtime_sec;
+    int64_t pkg_mtime_nsec;
+    struct bpak_sha_context sha;
+};
+#endif
+
+/* Default backend, 'priv' is the FILE of the package. Every access seeks
+ * first so that reads and writes can be mixed on the stream. */
+static ssize_t pkg_stdio_read_at(off_t offset, uint8_t *buf, size_t size,
+                                 void *priv)
+{
+    FILE *fp = (FILE *)priv;
+
+    if (fseeko(fp, offset, SEEK_SET) != 0)
+        return -BPAK_SEEK_ERROR;
+
+    size_t read_bytes = fread(buf, 1, size, fp);
+
+    if ((read_bytes == 0) && ferror(fp))
+        return -BPAK_READ_ERROR;
+
+    return read_bytes;
+}
+
+static ssize_t pkg_stdio_write_at(off_t offset, uint8_t *buf, size_t size,
+                                  void *priv)
+{
+    FILE *fp = (FILE *)priv;
+
+    if (fseeko(fp, offset, SEEK_SET) != 0)
+        return -BPAK_SEEK_ERROR;
+
+    size_t written_bytes = fwrite(buf, 1, size, fp);
+
+    if (written_bytes == 0)
+        return -BPAK_WRITE_ERROR;
+
+    return written_bytes;
+}
+
+static ssize_t pkg_stdio_size(void *priv)
+{
+    FILE *fp = (FILE *)priv;
+    struct stat statbuf;
+
+    /* Buffered writes count as well */
+    if (fflush(fp) != 0)
+        return -BPAK_WRITE_ERROR;
+
+    if (fstat(fileno(fp), &statbuf) != 0)
+        return -BPAK_FAILED;
+
+    return statbuf.st_size;
+}
+
+static int pkg_stdio_sync(void *priv)
+{
+    if (fflush((FILE *)priv) != 0)
+        return -BPAK_WRITE_ERROR;
+
+    return BPAK_OK;
+}
+
+static const struct bpak_pkg_io pkg_stdio_io = {
+    .read_at = pkg_stdio_read_at,
+    .write_at = pkg_stdio_write_at,
+    .size = pkg_stdio_size,
+    .sync = pkg_stdio_sync,
+    .map = NULL,
+};
+
+BPAK_EXPORT int bpak_pkg_read_at(struct bpak_package *pkg, off_t offset,
+                                 uint8_t *buf, size_t size)
+{
+    size_t bytes_read = 0;
+
+    while (bytes_read < size) {
+        ssize_t n = pkg->io->read_at(offset + bytes_read,
+                                     &buf[bytes_read],
+                                     size - bytes_read,
+                                     pkg->io_priv);
+
+        if (n <= 0)
+            return -BPAK_READ_ERROR;
+
+        bytes_read += n;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_pkg_write_at(struct bpak_package *pkg, off_t offset,
+                                  const uint8_t *buf, size_t size)
+{
+    size_t written = 0;
+
+    if (pkg->io->write_at == NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    while (written < size) {
+        /* Backends don't modify the data, bpak_io_t is not const */
+        ssize_t n = pkg->io->write_at(offset + written,
+                                      (uint8_t *)&buf[written],
+                                      size - written,
+                                      pkg->io_priv);
+
+        if (n <= 0)
+            return -BPAK_WRITE_ERROR;
+
+        written += n;
+    }
+
+    return BPAK_OK;
+}
+
+/* Read the continuation tables that follow the header */
+static int pkg_open_tables(struct bpak_package *pkg)
+{
+    int rc;
+    unsigned int count = bpak_pkg_table_count(pkg);
+
+    if (count == 0)
+        return BPAK_OK;
+
+    pkg->tables = bpak_calloc(count, sizeof(struct bpak_header));
+
+    if (pkg->tables == NULL)
+        return -BPAK_FAILED;
+
+    rc = bpak_pkg_read_at(pkg,
+                          sizeof(pkg->header),
+                          (uint8_t *)pkg->tables,
+                          count * sizeof(struct bpak_header));
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    for (unsigned int i = 0; i < count; i++) {
+        rc = bpak_valid_table(&pkg->tables[i]);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    return BPAK_OK;
+}
+
+/* Read the header, and write a new one to an empty package */
+static int pkg_open_header(struct bpak_package *pkg)
+{
+    int rc;
+    ssize_t size = pkg->io->size(pkg->io_priv);
+
+    if (size < 0)
+        return size;
+
+    if ((size_t)size < sizeof(pkg->header)) {
+        rc = bpak_init_header(&pkg->header);
+        if (rc != BPAK_OK)
+            return rc;
+
+        rc = bpak_pkg_update_hash(pkg, NULL, NULL);
+        if (rc != BPAK_OK)
+            return rc;
+
+        rc = bpak_pkg_write_header(pkg);
+        if (rc != BPAK_OK) {
+            bpak_printf(0, "Could not write header to empty package\n");
+            return rc;
+        }
+    } else {
+        rc = bpak_pkg_read_at(pkg, 0, (uint8_t *)&pkg->header,
+                              sizeof(pkg->header));
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    rc = bpak_valid_header(&pkg->header);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    return pkg_open_tables(pkg);
+}
 
 BPAK_EXPORT int bpak_pkg_open(struct bpak_package *pkg, const char *filename,
                               const char *mode)
@@ -39,375 +266,2392 @@ BPAK_EXPORT int bpak_pkg_open(struct bpak_package *pkg, const char *filename,
     if (pkg->fp == NULL)
         return -BPAK_NOT_FOUND;
 
+    pkg->io = &pkg_stdio_io;
+    pkg->io_priv = pkg->fp;
+
+    rc = pkg_open_header(pkg);
+
+    if (rc != BPAK_OK) {
+        goto err_close_io;
+    }
+
     if (fseek(pkg->fp, 0, SEEK_SET) != 0) {
         rc = -BPAK_SEEK_ERROR;
         goto err_close_io;
     }
 
-    size_t read_bytes = fread(&pkg->header, 1, sizeof(pkg->header), pkg->fp);
+    return BPAK_OK;
 
-    /* Initialize and write BPAK header when new files are created */
-    if (read_bytes != sizeof(pkg->header)) {
-        rc = bpak_init_header(&pkg->header);
-        if (rc != BPAK_OK) {
-            goto err_close_io;
-        }
+err_close_io:
+    bpak_pkg_close(pkg);
+    return rc;
+}
 
-        rc = bpak_pkg_update_hash(pkg, NULL, NULL);
-        if (rc != BPAK_OK) {
-            goto err_close_io;
-        }
+BPAK_EXPORT int bpak_pkg_open_io(struct bpak_package *pkg,
+                                 const struct bpak_pkg_io *io, void *priv)
+{
+    int rc;
 
-        size_t written_bytes = fwrite(&pkg->header, 1, sizeof(pkg->header), pkg->fp);
-        if (written_bytes != sizeof(pkg->header)) {
-            bpak_printf(0, "Could not write header to empty file %s\n", filename);
-            rc = -BPAK_WRITE_ERROR;
-            goto err_close_io;
-        }
+    if ((io == NULL) || (io->read_at == NULL) || (io->size == NULL))
+        return -BPAK_FAILED;
 
-        if (fseek(pkg->fp, 0, SEEK_SET) != 0) {
-            rc = -BPAK_SEEK_ERROR;
-            goto err_close_io;
-        }
-    }
+    memset(pkg, 0, sizeof(*pkg));
+    pkg->io = io;
+    pkg->io_priv = priv;
 
-    rc = bpak_valid_header(&pkg->header);
+    rc = pkg_open_header(pkg);
 
     if (rc != BPAK_OK) {
-        goto err_close_io;
+        bpak_pkg_close(pkg);
+        return rc;
     }
 
-    if (fseek(pkg->fp, 0, SEEK_SET) != 0) {
-        rc = -BPAK_SEEK_ERROR;
-        goto err_close_io;
+    if (io->map != NULL)
+        pkg->map = io->map(&pkg->map_size, priv);
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_pkg_open_mmap(struct bpak_package *pkg,
+                                   const char *filename)
+{
+    int rc;
+    struct stat statbuf;
+    void *map;
+
+    rc = bpak_pkg_open(pkg, filename, "rb");
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (fstat(fileno(pkg->fp), &statbuf) != 0) {
+        rc = -BPAK_FAILED;
+        goto err_close_out;
+    }
+
+    map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED,
+               fileno(pkg->fp), 0);
+
+    if (map == MAP_FAILED) {
+        bpak_printf(0,
+                    "Error: Could not mmap '%s' (%s)\n",
+                    filename,
+                    strerror(errno));
+        rc = -BPAK_FAILED;
+        goto err_close_out;
     }
 
+    pkg->map = (const uint8_t *)map;
+    pkg->map_size = statbuf.st_size;
     return BPAK_OK;
 
-err_close_io:
-    fclose(pkg->fp);
+err_close_out:
+    bpak_pkg_close(pkg);
     return rc;
 }
 
+BPAK_EXPORT int bpak_pkg_part_view(struct bpak_package *pkg,
+                                   bpak_id_t part_id, const uint8_t **data,
+                                   size_t *size)
+{
+    int rc;
+    struct bpak_part_header *part = NULL;
+    off_t offset;
+    size_t length;
+
+    if (pkg->map == NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    rc = bpak_pkg_get_part(pkg, part_id, &part);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    offset = bpak_pkg_part_offset(pkg, part);
+    length = bpak_part_size_wo_pad(part);
+
+    if (((uint64_t)offset > pkg->map_size) ||
+        (length > pkg->map_size - offset))
+        return -BPAK_SIZE_ERROR;
+
+    *data = &pkg->map[offset];
+    *size = length;
+    return BPAK_OK;
+}
+
+static struct pkg_hash_state *pkg_hash_state(struct bpak_package *pkg)
+{
+    if (pkg->hash_state == NULL)
+        pkg->hash_state = bpak_calloc(1, sizeof(struct pkg_hash_state));
+
+    return (struct pkg_hash_state *)pkg->hash_state;
+}
+
+static void pkg_hash_state_invalidate(struct pkg_hash_state *state)
+{
+    if (state->hash_valid)
+        bpak_hash_free(&state->hash);
+
+    state->hash_valid = false;
+}
+
+#if BPAK_CONFIG_SHA == 1
+static void pkg_hash_cache_stat(FILE *fp, struct pkg_hash_cache_file *c)
+{
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    (void)fstat(fileno(fp), &st);
+
+    c->pkg_size = st.st_size;
+    c->pkg_ino = st.st_ino;
+    c->pkg_mtime_sec = st.st_mtim.tv_sec;
+    c->pkg_mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+static void pkg_hash_cache_load(struct bpak_package *pkg,
+                                struct pkg_hash_state *state)
+{
+    struct pkg_hash_cache_file *c;
+    struct pkg_hash_cache_file current;
+    FILE *fp;
+
+    if (state->hash_valid || !bpak_hash_is_builtin())
+        return;
+
+    fp = fopen(state->cache_filename, "rb");
+
+    if (fp == NULL)
+        return;
+
+    c = bpak_calloc(1, sizeof(*c));
+
+    if (c == NULL)
+        goto err_close_out;
+
+    if (fread(c, 1, sizeof(*c), fp) != sizeof(*c))
+        goto err_free_out;
+
+    pkg_hash_cache_stat(pkg->fp, &current);
+
+    if ((c->magic != PKG_HASH_CACHE_MAGIC) ||
+        (c->version != PKG_HASH_CACHE_VERSION) ||
+        (c->no_of_parts > BPAK_MAX_PARTS) ||
+        (c->pkg_size != current.pkg_size) ||
+        (c->pkg_ino != current.pkg_ino) ||
+        (c->pkg_mtime_sec != current.pkg_mtime_sec) ||
+        (c->pkg_mtime_nsec != current.pkg_mtime_nsec)) {
+        bpak_printf(2, "Ignoring stale hash cache\n");
+        goto err_free_out;
+    }
+
+    if (bpak_hash_init(&state->hash, c->hash_kind) != BPAK_OK)
+        goto err_free_out;
+
+    memcpy(&state->hash.backend.sha, &c->sha, sizeof(c->sha));
+    memcpy(state->parts, c->parts, sizeof(state->parts));
+    state->hash_kind = c->hash_kind;
+    state->no_of_parts = c->no_of_parts;
+    state->hash_valid = true;
+    state->builtin = true;
+
+    bpak_printf(2, "Loaded hash state of %u parts\n", state->no_of_parts);
+
+err_free_out:
+    bpak_free(c);
+err_close_out:
+    fclose(fp);
+}
+
+static void pkg_hash_cache_save(struct bpak_package *pkg,
+                                struct pkg_hash_state *state)
+{
+    struct pkg_hash_cache_file *c;
+    FILE *fp;
+
+    if (!state->hash_valid || !state->builtin)
+        return;
+
+    /* The cache matches the file as it is when all writes are done */
+    if (fflush(pkg->fp) != 0)
+        return;
+
+    c = bpak_calloc(1, sizeof(*c));
+
+    if (c == NULL)
+        return;
+
+    c->magic = PKG_HASH_CACHE_MAGIC;
+    c->version = PKG_HASH_CACHE_VERSION;
+    c->hash_kind = state->hash_kind;
+    c->no_of_parts = state->no_of_parts;
+    memcpy(c->parts, state->parts, sizeof(c->parts));
+    memcpy(&c->sha, &state->hash.backend.sha, sizeof(c->sha));
+    pkg_hash_cache_stat(pkg->fp, c);
+
+    fp = fopen(state->cache_filename, "wb");
+
+    if (fp != NULL) {
+        if (fwrite(c, 1, sizeof(*c), fp) != sizeof(*c))
+            bpak_printf(0, "Warning: Could not write hash cache\n");
+        fclose(fp);
+    }
+
+    bpak_free(c);
+}
+#endif
+
+BPAK_EXPORT int bpak_pkg_set_hash_cache(struct bpak_package *pkg,
+                                        const char *filename)
+{
+#if BPAK_CONFIG_SHA == 1
+    struct pkg_hash_state *state;
+
+    /* The cache is matched against the package file */
+    if (pkg->fp == NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    state = pkg_hash_state(pkg);
+
+    if (state == NULL)
+        return -BPAK_FAILED;
+
+    bpak_free(state->cache_filename);
+    state->cache_filename = NULL;
+
+    if (filename == NULL)
+        return BPAK_OK;
+
+    state->cache_filename = bpak_calloc(1, strlen(filename) + 1);
+
+    if (state->cache_filename == NULL)
+        return -BPAK_FAILED;
+
+    memcpy(state->cache_filename, filename, strlen(filename));
+
+    /* The cache is checked against the file before it is modified */
+    pkg_hash_cache_load(pkg, state);
+    return BPAK_OK;
+#else
+    (void)pkg;
+    (void)filename;
+    return -BPAK_NOT_SUPPORTED;
+#endif
+}
+
 BPAK_EXPORT int bpak_pkg_close(struct bpak_package *pkg)
 {
+    struct pkg_hash_state *state = (struct pkg_hash_state *)pkg->hash_state;
+
+    if (state != NULL) {
+#if BPAK_CONFIG_SHA == 1
+        if ((state->cache_filename != NULL) && (pkg->fp != NULL))
+            pkg_hash_cache_save(pkg, state);
+#endif
+        pkg_hash_state_invalidate(state);
+        bpak_free(state->cache_filename);
+        bpak_free(state);
+        pkg->hash_state = NULL;
+    }
+
+    /* Only the mappings of bpak_pkg_open_mmap belong to the package */
+    if ((pkg->map != NULL) && (pkg->fp != NULL))
+        munmap((void *)pkg->map, pkg->map_size);
+
+    pkg->map = NULL;
+    pkg->map_size = 0;
+    bpak_free(pkg->tables);
+    pkg->tables = NULL;
+
     if (pkg->fp != NULL) {
         fclose(pkg->fp);
         pkg->fp = NULL;
+    } else if ((pkg->io != NULL) && (pkg->io->sync != NULL) &&
+               (pkg->io->write_at != NULL)) {
+        pkg->io->sync(pkg->io_priv);
     }
+
+    pkg->io = NULL;
     return BPAK_OK;
 }
 
 static ssize_t pkg_read_payload(off_t offset, uint8_t *buf, size_t length,
                                 void *user)
 {
-    FILE *fp = (FILE *)user;
-    if (fseek(fp, offset, SEEK_SET) != 0)
-        return -BPAK_SEEK_ERROR;
-    size_t read_bytes = fread(buf, 1, length, fp);
+    int rc = bpak_pkg_read_at((struct bpak_package *)user, offset, buf,
+                              length);
 
-    if (read_bytes != length)
-        return -BPAK_READ_ERROR;
+    if (rc != BPAK_OK)
+        return rc;
 
-    return read_bytes;
+    return length;
 }
 
-BPAK_EXPORT int bpak_pkg_update_hash(struct bpak_package *pkg, char *output,
-                                     size_t *size)
+/* Header for 'index' 0, and continuation table 'index' - 1 otherwise */
+static struct bpak_header *pkg_table(struct bpak_package *pkg,
+                                     unsigned int index)
 {
-    int rc;
+    return (index == 0) ? &pkg->header : &pkg->tables[index - 1];
+}
 
-    size_t hash_size = sizeof(pkg->header.payload_hash);
+static bool pkg_part_touched(const struct pkg_hash_state *state,
+                             bpak_id_t part_id)
+{
+    for (unsigned int i = 0; i < state->no_of_touched; i++) {
+        if (state->touched[i] == part_id)
+            return true;
+    }
 
-    rc = bpak_verify_compute_payload_hash(&pkg->header,
-                                          pkg_read_payload,
-                                          sizeof(struct bpak_header),
-                                          (void *)pkg->fp,
-                                          pkg->header.payload_hash,
-                                          &hash_size);
+    return false;
+}
 
-    if (rc != BPAK_OK)
-        return rc;
+/* Recompute the digest of every part that has a 'part-digest' meta, or
+ * only of the parts that 'touched' has recorded */
+static int pkg_update_part_digests(struct bpak_package *pkg,
+                                   const struct pkg_hash_state *touched)
+{
+    int rc;
+    unsigned int count = bpak_pkg_table_count(pkg);
+    struct bpak_meta_header *meta;
+    struct bpak_header *meta_table;
+
+    bpak_foreach_table (&pkg->header, pkg->tables, count, t)
+    bpak_foreach_part (t, p) {
+        uint8_t hash[BPAK_HASH_MAX_LENGTH];
+        size_t hash_size = sizeof(hash);
+
+        if (!p->id)
+            continue;
+
+        if ((touched != NULL) && !pkg_part_touched(touched, p->id))
+            continue;
+
+        if (bpak_pkg_get_meta(pkg,
+                              BPAK_ID_PART_DIGEST,
+                              p->id,
+                              &meta,
+                              &meta_table) != BPAK_OK) {
+            continue;
+        }
+
+        rc = bpak_verify_compute_part_digest_tables(&pkg->header,
+                                                    pkg->tables,
+                                                    count,
+                                                    p,
+                                                    pkg_read_payload,
+                                                    sizeof(struct bpak_header),
+                                                    pkg,
+                                                    hash,
+                                                    &hash_size);
 
-    if ((output != NULL) && (size != NULL)) {
-        rc = bpak_verify_compute_header_hash(&pkg->header,
-                                             (uint8_t *)output,
-                                             size);
         if (rc != BPAK_OK)
             return rc;
+
+        if (meta->size != hash_size)
+            return -BPAK_SIZE_ERROR;
+
+        memcpy(bpak_get_meta_ptr(meta_table, meta, uint8_t), hash, hash_size);
     }
 
     return BPAK_OK;
 }
 
-BPAK_EXPORT size_t bpak_pkg_installed_size(struct bpak_package *pkg)
+BPAK_EXPORT int bpak_pkg_add_part_digests(struct bpak_package *pkg)
 {
-    size_t installed_size = 0;
+    int rc;
+    uint8_t hash[BPAK_HASH_MAX_LENGTH];
+    size_t hash_size = sizeof(hash);
+    struct bpak_hash_context hash_ctx;
+    struct bpak_meta_header *meta;
+    struct pkg_hash_state *state = (struct pkg_hash_state *)pkg->hash_state;
+    bool deferred = (state != NULL) && state->deferred;
+
+    /* The digest length of the package hash kind */
+    rc = bpak_hash_init(&hash_ctx, pkg->header.hash_kind);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_hash_final(&hash_ctx, hash, hash_size, &hash_size);
+    bpak_hash_free(&hash_ctx);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    /* Adding meta data can add a table, which moves the tables, so the
+     * parts are looked up by position */
+    for (unsigned int t = 0; t <= bpak_pkg_table_count(pkg); t++) {
+        for (unsigned int i = 0; i < BPAK_MAX_PARTS; i++) {
+            struct bpak_part_header *p = &pkg_table(pkg, t)->parts[i];
+
+            if (!p->id || (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH))
+                continue;
+
+            bpak_id_t part_id = p->id;
+
+            rc = bpak_pkg_add_meta(pkg,
+                                   BPAK_ID_PART_DIGEST,
+                                   part_id,
+                                   hash_size,
+                                   &meta,
+                                   NULL);
+
+            if (rc == -BPAK_EXISTS)
+                continue;
+            if (rc != BPAK_OK)
+                return rc;
+
+            /* In a session only the new digests are computed by commit */
+            if (deferred) {
+                rc = bpak_pkg_edited(pkg, part_id);
+
+                if (rc != BPAK_OK)
+                    return rc;
+            }
+        }
+    }
+
+    return deferred ? BPAK_OK : pkg_update_part_digests(pkg, NULL);
+}
+
+/* Start the payload hash from the cached state when the part headers it
+ * covers are unchanged. Returns the index of the first part to hash. */
+static unsigned int pkg_payload_hash_start(struct bpak_package *pkg,
+                                           struct pkg_hash_state *state,
+                                           struct bpak_hash_context *hash)
+{
+    if (state == NULL)
+        return 0;
+
+    if (!state->hash_valid || (state->hash_kind != pkg->header.hash_kind) ||
+        (memcmp(state->parts,
+                pkg->header.parts,
+                state->no_of_parts * sizeof(state->parts[0])) != 0)) {
+        return 0;
+    }
+
+    if ((state->no_of_parts == 0) ||
+        (bpak_hash_clone(hash, &state->hash) != BPAK_OK)) {
+        return 0;
+    }
+
+    bpak_printf(2, "Payload hash continues after %u parts\n",
+                state->no_of_parts);
+    return state->no_of_parts;
+}
+
+static int pkg_compute_payload_hash(struct bpak_package *pkg,
+                                    uint8_t *output, size_t *size)
+{
+    int rc;
+    struct bpak_header *h = &pkg->header;
+    struct pkg_hash_state *state = pkg_hash_state(pkg);
+    struct bpak_hash_context hash;
+    struct bpak_hash_range *ranges;
+    size_t no_of_ranges = 0;
+    unsigned int first = 0;
+    unsigned int no_of_parts = 0;
+    unsigned int count = bpak_pkg_table_count(pkg);
+    off_t offset = bpak_header_size(h);
+
+    /* The cached state only covers packages without tables */
+    if (count == 0)
+        first = pkg_payload_hash_start(pkg, state, &hash);
+
+    if (first == 0) {
+        rc = bpak_hash_init(&hash, h->hash_kind);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    /* The tables come first, see bpak_verify_payload_tables */
+    for (unsigned int i = 0; i < count; i++) {
+        rc = bpak_hash_update(&hash,
+                              (uint8_t *)&pkg->tables[i],
+                              sizeof(pkg->tables[i]));
+
+        if (rc != BPAK_OK)
+            goto err_free_hash_out;
+    }
+
+    ranges = bpak_calloc((count + 1) * BPAK_MAX_PARTS, sizeof(*ranges));
+
+    if (ranges == NULL) {
+        rc = -BPAK_FAILED;
+        goto err_free_hash_out;
+    }
+
+    bpak_foreach_table (h, pkg->tables, count, t)
+    for (unsigned int i = 0; i < BPAK_MAX_PARTS; i++) {
+        struct bpak_part_header *p = &t->parts[i];
+
+        if (!p->id)
+            continue;
+
+        no_of_parts = i + 1;
+
+        if ((i < first) || (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH)) {
+            offset += bpak_part_size(p);
+            continue;
+        }
+
+        bpak_hash_range_add(ranges, &no_of_ranges, offset, bpak_part_size(p));
+        offset += bpak_part_size(p);
+    }
+
+    rc = bpak_hash_pipeline(&hash, ranges, no_of_ranges, pkg_read_payload,
+                            pkg);
+    bpak_free(ranges);
+
+    if (rc != BPAK_OK)
+        goto err_free_hash_out;
+
+    /* Keep the state at the end of the payload for the next update */
+    if (state != NULL) {
+        pkg_hash_state_invalidate(state);
+
+        if ((count == 0) &&
+            (bpak_hash_clone(&state->hash, &hash) == BPAK_OK)) {
+            state->hash_valid = true;
+            state->hash_kind = h->hash_kind;
+            state->no_of_parts = no_of_parts;
+            memcpy(state->parts,
+                   h->parts,
+                   no_of_parts * sizeof(state->parts[0]));
+#if BPAK_CONFIG_SHA == 1
+            state->builtin = bpak_hash_is_builtin();
+#else
+            state->builtin = false;
+#endif
+        }
+    }
+
+    rc = bpak_hash_final(&hash, output, *size, size);
+
+err_free_hash_out:
+    bpak_hash_free(&hash);
+    return rc;
+}
+
+/* Update the payload hash and, when 'part_digests' is set, the part
+ * digests */
+static int pkg_update_hash(struct bpak_package *pkg, char *output,
+                           size_t *size, bool part_digests)
+{
+    int rc;
+
+    size_t hash_size = sizeof(pkg->header.payload_hash);
+
+    if (part_digests) {
+        rc = pkg_update_part_digests(pkg, NULL);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    rc = pkg_compute_payload_hash(pkg, pkg->header.payload_hash, &hash_size);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if ((output != NULL) && (size != NULL)) {
+        rc = bpak_verify_compute_header_hash(&pkg->header,
+                                             (uint8_t *)output,
+                                             size);
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_pkg_update_hash(struct bpak_package *pkg, char *output,
+                                     size_t *size)
+{
+    return pkg_update_hash(pkg, output, size, true);
+}
+
+int bpak_pkg_edited(struct bpak_package *pkg, bpak_id_t part_id)
+{
+    struct pkg_hash_state *state = (struct pkg_hash_state *)pkg->hash_state;
+
+    if ((state == NULL) || !state->deferred)
+        return pkg_update_hash(pkg, NULL, NULL, part_id != 0);
+
+    if ((part_id == 0) || pkg_part_touched(state, part_id))
+        return BPAK_OK;
+
+    if (state->no_of_touched < BPAK_MAX_PARTS)
+        state->touched[state->no_of_touched++] = part_id;
+    else
+        state->all_touched = true;
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_pkg_defer_hash(struct bpak_package *pkg)
+{
+    struct pkg_hash_state *state = pkg_hash_state(pkg);
+
+    if (state == NULL)
+        return -BPAK_FAILED;
+
+    state->deferred = true;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_pkg_commit(struct bpak_package *pkg, bool reuse_digests)
+{
+    int rc;
+    struct pkg_hash_state *state = (struct pkg_hash_state *)pkg->hash_state;
+    const struct pkg_hash_state *touched = NULL;
+
+    if ((state != NULL) && state->deferred && reuse_digests &&
+        !state->all_touched) {
+        touched = state;
+    }
+
+    rc = pkg_update_part_digests(pkg, touched);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = pkg_update_hash(pkg, NULL, NULL, false);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_pkg_write_header(pkg);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (state != NULL) {
+        state->deferred = false;
+        state->all_touched = false;
+        state->no_of_touched = 0;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT size_t bpak_pkg_installed_size(struct bpak_package *pkg)
+{
+    size_t installed_size = 0;
+
+    bpak_foreach_table (&pkg->header,
+                        pkg->tables,
+                        bpak_pkg_table_count(pkg),
+                        t) {
+        bpak_foreach_part (t, p) {
+            installed_size += p->size + p->pad_bytes;
+        }
+    }
+
+    return installed_size;
+}
+
+BPAK_EXPORT size_t bpak_pkg_size(struct bpak_package *pkg)
+{
+    size_t transport_size = 0;
+
+    bpak_foreach_table (&pkg->header,
+                        pkg->tables,
+                        bpak_pkg_table_count(pkg),
+                        t) {
+        bpak_foreach_part (t, p) {
+            if (p->flags & BPAK_FLAG_TRANSPORT)
+                transport_size += p->transport_size;
+            else
+                transport_size += p->size;
+        }
+    }
+
+    transport_size += bpak_header_size(&pkg->header);
+
+    return transport_size;
+}
+
+BPAK_EXPORT struct bpak_header *bpak_pkg_header(struct bpak_package *pkg)
+{
+    return &pkg->header;
+}
+
+BPAK_EXPORT int bpak_pkg_write_header(struct bpak_package *pkg)
+{
+    int rc = bpak_pkg_write_at(pkg,
+                               0,
+                               (const uint8_t *)&pkg->header,
+                               sizeof(pkg->header));
+
+    if ((rc == BPAK_OK) && (pkg->tables != NULL)) {
+        rc = bpak_pkg_write_at(pkg,
+                               sizeof(pkg->header),
+                               (const uint8_t *)pkg->tables,
+                               bpak_pkg_table_count(pkg) *
+                                   sizeof(struct bpak_header));
+    }
+
+    if (rc != BPAK_OK)
+        bpak_printf(0, "%s: Write failed\n", __func__);
+
+    return rc;
+}
+
+BPAK_EXPORT int bpak_pkg_write_raw_signature(struct bpak_package *pkg,
+                                             const uint8_t *signature,
+                                             size_t size)
+{
+    memset(pkg->header.signature, 0, sizeof(pkg->header.signature));
+    memcpy(pkg->header.signature, signature, size);
+    pkg->header.signature_sz = size;
+    return bpak_pkg_write_header(pkg);
+}
+
+/* Output buffer size when direct_io or drop_cache is used without one */
+#define DECODE_OUTPUT_BUFFER_DEFAULT (1024 * 1024)
+
+struct decode_private {
+    FILE *output_fp;
+    FILE *origin_fp;
+    bool positional_io; /* Use pread/pwrite on the underlying fd's */
+    /* Output write buffer, it holds the output range
+     * [out_base + out_start, out_base + out_end) and out_base is aligned */
+    uint8_t *out_buf;
+    size_t out_buf_length;
+    off_t out_base;
+    size_t out_start;
+    size_t out_end;
+    bool direct_io;      /* Write aligned blocks with O_DIRECT */
+    bool direct_enabled; /* O_DIRECT is set on the output fd */
+    bool drop_cache;     /* Drop written ranges from the page cache */
+    off_t output_position; /* FILE position of the output, -1 = unknown */
+};
+
+static ssize_t decode_pread(FILE *fp, off_t offset, uint8_t *buffer,
+                            size_t length)
+{
+    size_t pos = 0;
+
+    while (pos < length) {
+        ssize_t n = pread(fileno(fp), &buffer[pos], length - pos, offset + pos);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -BPAK_READ_ERROR;
+        if (n == 0)
+            break;
+
+        pos += n;
+    }
+
+    return pos;
+}
+
+static ssize_t decode_pwrite(FILE *fp, off_t offset, uint8_t *buffer,
+                             size_t length)
+{
+    size_t pos = 0;
+
+    while (pos < length) {
+        ssize_t n =
+            pwrite(fileno(fp), &buffer[pos], length - pos, offset + pos);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -BPAK_WRITE_ERROR;
+
+        pos += n;
+    }
+
+    return pos;
+}
+
+/* O_DIRECT is a flag of the open file, it is only kept set while the
+ * aligned blocks of the output buffer are written */
+static void decode_output_set_direct(struct decode_private *priv,
+                                     bool enable)
+{
+    int fd = fileno(priv->output_fp);
+    int flags;
+
+    if (!priv->direct_io || (priv->direct_enabled == enable))
+        return;
+
+    flags = fcntl(fd, F_GETFL);
+
+    if ((flags == -1) ||
+        (fcntl(fd, F_SETFL, enable ? (flags | O_DIRECT) :
+                                     (flags & ~O_DIRECT)) == -1)) {
+        bpak_printf(1,
+                    "O_DIRECT not supported by the output (%s)\n",
+                    strerror(errno));
+        priv->direct_io = false;
+        return;
+    }
+
+    priv->direct_enabled = enable;
+}
+
+static int decode_output_pwrite(struct decode_private *priv, off_t offset,
+                                uint8_t *buffer, size_t length, bool direct)
+{
+    ssize_t rc;
+
+    if (length == 0)
+        return BPAK_OK;
+
+    decode_output_set_direct(priv, direct);
+    rc = decode_pwrite(priv->output_fp, offset, buffer, length);
+
+    if ((rc < 0) && priv->direct_enabled && (errno == EINVAL)) {
+        /* The output takes O_DIRECT but not this alignment */
+        bpak_printf(1, "O_DIRECT write failed, using normal writes\n");
+        decode_output_set_direct(priv, false);
+        priv->direct_io = false;
+        rc = decode_pwrite(priv->output_fp, offset, buffer, length);
+    }
+
+    if (rc < 0)
+        return rc;
+
+    return BPAK_OK;
+}
+
+/* Write out the buffered range. The unaligned head and tail are written
+ * through the page cache, the blocks between them with O_DIRECT. */
+static int decode_output_flush(struct decode_private *priv)
+{
+    int rc;
+    const size_t align = BPAK_DECODE_OUTPUT_ALIGN;
+    size_t start = priv->out_start;
+    size_t end = priv->out_end;
+    size_t head_end = BPAK_MIN((start + align - 1) / align * align, end);
+    size_t tail_start = end / align * align;
+
+    if (start == end)
+        return BPAK_OK;
+
+    if (tail_start < head_end)
+        tail_start = head_end;
+
+    rc = decode_output_pwrite(priv,
+                              priv->out_base + start,
+                              &priv->out_buf[start],
+                              head_end - start,
+                              false);
+
+    if (rc == BPAK_OK) {
+        rc = decode_output_pwrite(priv,
+                                  priv->out_base + head_end,
+                                  &priv->out_buf[head_end],
+                                  tail_start - head_end,
+                                  true);
+    }
+
+    if (rc == BPAK_OK) {
+        rc = decode_output_pwrite(priv,
+                                  priv->out_base + tail_start,
+                                  &priv->out_buf[tail_start],
+                                  end - tail_start,
+                                  false);
+    }
+
+    if ((rc == BPAK_OK) && priv->drop_cache) {
+        /* Dirty pages can't be dropped, write them back first */
+        int fd = fileno(priv->output_fp);
+
+        (void)sync_file_range(fd,
+                              priv->out_base + start,
+                              end - start,
+                              SYNC_FILE_RANGE_WAIT_BEFORE |
+                                  SYNC_FILE_RANGE_WRITE |
+                                  SYNC_FILE_RANGE_WAIT_AFTER);
+        (void)posix_fadvise(fd,
+                            priv->out_base + start,
+                            end - start,
+                            POSIX_FADV_DONTNEED);
+    }
+
+    priv->out_start = 0;
+    priv->out_end = 0;
+    return rc;
+}
+
+/* Collect contiguous writes in the output buffer, any other write flushes
+ * it first */
+static ssize_t decode_output_write(struct decode_private *priv, off_t offset,
+                                   uint8_t *buffer, size_t length)
+{
+    int rc;
+    size_t pos = 0;
+
+    if (priv->out_buf == NULL)
+        return decode_pwrite(priv->output_fp, offset, buffer, length);
+
+    while (pos < length) {
+        off_t write_offset = offset + pos;
+
+        if (priv->out_start == priv->out_end) {
+            priv->out_base = write_offset / BPAK_DECODE_OUTPUT_ALIGN *
+                             BPAK_DECODE_OUTPUT_ALIGN;
+            priv->out_start = write_offset - priv->out_base;
+            priv->out_end = priv->out_start;
+        } else if (write_offset !=
+                   priv->out_base + (off_t)priv->out_end) {
+            rc = decode_output_flush(priv);
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            continue;
+        }
+
+        size_t n = BPAK_MIN(length - pos, priv->out_buf_length - priv->out_end);
+
+        memcpy(&priv->out_buf[priv->out_end], &buffer[pos], n);
+        priv->out_end += n;
+        pos += n;
+
+        if (priv->out_end == priv->out_buf_length) {
+            rc = decode_output_flush(priv);
+
+            if (rc != BPAK_OK)
+                return rc;
+        }
+    }
+
+    return length;
+}
+
+static ssize_t decode_write_output(off_t offset, uint8_t *buffer, size_t length,
+                                   void *user)
+{
+    struct decode_private *priv = (struct decode_private *)user;
+
+    size_t bytes_written;
+
+    if (priv->positional_io)
+        return decode_output_write(priv, offset, buffer, length);
+
+    /* A seek flushes the FILE buffer, sequential writes don't need one */
+    if ((offset != priv->output_position) &&
+        (fseek(priv->output_fp, offset, SEEK_SET) != 0)) {
+        priv->output_position = -1;
+        return -BPAK_SEEK_ERROR;
+    }
+
+    bytes_written = fwrite(buffer, 1, length, priv->output_fp);
+    priv->output_position =
+        (bytes_written == length) ? (off_t)(offset + length) : -1;
+    return bytes_written;
+}
+
+static ssize_t decode_read_output(off_t offset, uint8_t *buffer, size_t length,
+                                  void *user)
+{
+    struct decode_private *priv = (struct decode_private *)user;
+
+    if (priv->positional_io) {
+        /* Reads see the buffered output, and are not aligned */
+        if ((priv->out_start != priv->out_end) &&
+            (offset < priv->out_base + (off_t)priv->out_end) &&
+            (offset + (off_t)length >
+             priv->out_base + (off_t)priv->out_start)) {
+            int rc = decode_output_flush(priv);
+
+            if (rc != BPAK_OK)
+                return rc;
+        }
+
+        decode_output_set_direct(priv, false);
+        return decode_pread(priv->output_fp, offset, buffer, length);
+    }
+
+    priv->output_position = -1;
+
+    if (fseek(priv->output_fp, offset, SEEK_SET) != 0) {
+        return -BPAK_SEEK_ERROR;
+    }
+
+    return fread(buffer, 1, length, priv->output_fp);
+}
+
+static ssize_t decode_write_output_header(off_t offset, uint8_t *buffer,
+                                          size_t length, void *user)
+{
+    struct decode_private *priv = (struct decode_private *)user;
+    (void)offset;
+
+    if (length != sizeof(struct bpak_header))
+        return -BPAK_SIZE_ERROR;
+
+    if (priv->positional_io)
+        return decode_output_write(priv, 0, buffer, length);
+
+    priv->output_position = -1;
+
+    if (fseek(priv->output_fp, 0, SEEK_SET) != 0) {
+        return -BPAK_SEEK_ERROR;
+    }
+
+    return fwrite(buffer, 1, length, priv->output_fp);
+}
+
+static ssize_t decode_read_origin(off_t offset, uint8_t *buffer, size_t length,
+                                  void *user)
+{
+    struct decode_private *priv = (struct decode_private *)user;
+
+    if (priv->positional_io)
+        return decode_pread(priv->origin_fp, offset, buffer, length);
+
+    if (priv->origin_fp == priv->output_fp)
+        priv->output_position = -1;
+
+    if (fseek(priv->origin_fp, offset, SEEK_SET) != 0) {
+        return -BPAK_SEEK_ERROR;
+    }
+
+    return fread(buffer, 1, length, priv->origin_fp);
+}
+
+static void decode_prefetch_origin(off_t offset, size_t length, void *user)
+{
+    struct decode_private *priv = (struct decode_private *)user;
+
+    /* Let the kernel start reading the origin range in the background
+     * while we decompress, failure only means there is no read-ahead */
+    (void)posix_fadvise(fileno(priv->origin_fp),
+                        offset,
+                        length,
+                        POSIX_FADV_WILLNEED);
+}
+
+/* Settings shared by all part decoders of one bpak_pkg_transport_decode */
+struct decode_setup {
+    struct bpak_package *input;
+    struct bpak_package *origin;
+    size_t buffer_length;
+    bpak_calloc_t calloc_func;
+    bpak_free_t free_func;
+    bpak_transport_progress_t progress;
+    void *progress_user;
+    const struct bpak_allocator *allocator;
+    unsigned int threads;
+    size_t write_block_length; /* See bpak_transport_decode_set_write_buffer */
+    size_t in_place_scratch;   /* See bpak_transport_decode_set_in_place */
+    bool skip_unchanged; /* See bpak_transport_decode_set_skip_unchanged */
+    bool verify_origin;  /* See bpak_transport_decode_set_verify_origin */
+    struct decode_private priv;
+    size_t jobs_left; /* Jobs of the package in the decode_pool not done */
+    int rc;           /* First error of the package in the decode_pool */
+};
+
+/* Transport meta data of a transport encoded part, or NULL */
+static struct bpak_transport_meta *
+decode_transport_meta(struct bpak_header *header, struct bpak_part_header *part)
+{
+    struct bpak_meta_header *meta = NULL;
+
+    if (!(part->flags & BPAK_FLAG_TRANSPORT))
+        return NULL;
+
+    if (bpak_get_meta(header, BPAK_ID_BPAK_TRANSPORT, part->id, &meta) !=
+        BPAK_OK)
+        return NULL;
+
+    return bpak_get_meta_ptr(header, meta, struct bpak_transport_meta);
+}
+
+static ssize_t decode_skip_output_header(off_t offset, uint8_t *buffer,
+                                         size_t length, void *user)
+{
+    (void)offset;
+    (void)buffer;
+    (void)user;
+
+    /* Parallel decoders work on private header copies, the real header is
+     * written once all parts are done */
+    return length;
+}
+
+static int decode_context_init(struct decode_setup *setup,
+                               struct bpak_transport_decode *ctx,
+                               struct bpak_header *header,
+                               uint8_t *decode_buffer,
+                               bpak_io_t write_output_header)
+{
+    int rc;
+
+    rc = bpak_transport_decode_init(ctx,
+                                    decode_buffer,
+                                    setup->buffer_length,
+                                    header,
+                                    decode_write_output,
+                                    decode_read_output,
+                                    sizeof(struct bpak_header),
+                                    write_output_header,
+                                    &setup->priv);
+
+    if (rc != BPAK_OK) {
+        bpak_printf(0,
+                    "%s: Error: Transport decode init failed (%i) %s",
+                    __func__,
+                    rc,
+                    bpak_error_string(rc));
+        return rc;
+    }
+
+    rc = bpak_transport_decode_set_progress(ctx,
+                                            setup->progress,
+                                            setup->progress_user);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_transport_decode_set_allocator(ctx, setup->allocator);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_transport_decode_set_threads(ctx, setup->threads);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (setup->write_block_length > 0) {
+        uint8_t *write_buffer =
+            setup->calloc_func(1, setup->write_block_length);
+
+        if (write_buffer == NULL)
+            return -BPAK_FAILED;
+
+        rc = bpak_transport_decode_set_write_buffer(ctx,
+                                                    write_buffer,
+                                                    setup->write_block_length);
+
+        if (rc != BPAK_OK) {
+            setup->free_func(write_buffer);
+            return rc;
+        }
+    }
+
+    if (setup->skip_unchanged) {
+        size_t length = (setup->write_block_length > 0) ?
+                            setup->write_block_length :
+                            BPAK_DECODE_OUTPUT_ALIGN;
+        uint8_t *compare_buffer = setup->calloc_func(1, length);
+
+        if (compare_buffer == NULL)
+            return -BPAK_FAILED;
+
+        rc = bpak_transport_decode_set_skip_unchanged(ctx,
+                                                      compare_buffer,
+                                                      length);
+
+        if (rc != BPAK_OK) {
+            setup->free_func(compare_buffer);
+            return rc;
+        }
+    }
+
+    if (setup->in_place_scratch > 0) {
+        uint8_t *scratch = setup->calloc_func(1, setup->in_place_scratch);
+
+        if (scratch == NULL)
+            return -BPAK_FAILED;
+
+        rc = bpak_transport_decode_set_in_place(ctx,
+                                                scratch,
+                                                setup->in_place_scratch);
+
+        if (rc != BPAK_OK) {
+            setup->free_func(scratch);
+            return rc;
+        }
+    }
+
+    if (setup->origin != NULL) {
+        struct bpak_header *origin_header = bpak_pkg_header(setup->origin);
+
+        rc = bpak_transport_decode_set_origin(ctx,
+                                              origin_header,
+                                              decode_read_origin,
+                                              sizeof(struct bpak_header));
+
+        if (rc != BPAK_OK) {
+            bpak_printf(0,
+                        "Error: Origin stream init failed (%i) %s\n",
+                        rc,
+                        bpak_error_string(rc));
+            return rc;
+        }
+
+        rc = bpak_transport_decode_set_origin_prefetch(ctx,
+                                                       decode_prefetch_origin);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        rc = bpak_transport_decode_set_verify_origin(ctx,
+                                                     setup->verify_origin);
+    }
+
+    return rc;
+}
+
+static void decode_context_free(struct decode_setup *setup,
+                                struct bpak_transport_decode *ctx)
+{
+    bpak_transport_decode_free(ctx);
+
+    if (ctx->write_buffer != NULL) {
+        setup->free_func(ctx->write_buffer);
+        ctx->write_buffer = NULL;
+    }
+
+    if (ctx->in_place_buffer != NULL) {
+        setup->free_func(ctx->in_place_buffer);
+        ctx->in_place_buffer = NULL;
+    }
+
+    if (ctx->compare_buffer != NULL) {
+        setup->free_func(ctx->compare_buffer);
+        ctx->compare_buffer = NULL;
+    }
+}
+
+/* Decode one part. The input is read at 'input_offset' with positional io,
+ * otherwise the input stream is expected to be positioned there already */
+static int decode_part(struct decode_setup *setup,
+                       struct bpak_transport_decode *ctx,
+                       struct bpak_part_header *part, off_t input_offset,
+                       uint8_t *chunk_buffer)
+{
+    int rc;
+    struct bpak_part_header *origin_part = NULL;
+
+    /* Compute origin and output offsets */
+    if (setup->origin != NULL) {
+        bpak_id_t origin_id = bpak_transport_origin_id(
+            decode_transport_meta(ctx->patch_header, part),
+            part->id);
+
+        rc = bpak_get_part(&setup->origin->header, origin_id, &origin_part);
 
-    bpak_foreach_part (&pkg->header, p) {
-        installed_size += p->size + p->pad_bytes;
+        if (rc != BPAK_OK) {
+            bpak_printf(0,
+                        "Error could not get origin part with ref %x\n",
+                        origin_id);
+            return rc;
+        }
+    }
+
+    rc = bpak_transport_decode_start(ctx, part);
+
+    if (rc != BPAK_OK) {
+        bpak_printf(0,
+                    "Error: Decoder start failed for part 0x%x (%i)\n",
+                    part->id,
+                    rc);
+        return rc;
+    }
+
+    /* If there is any input data chunk it up and feed the decoder, input
+     * that the decoder does not need is skipped */
+    uint64_t part_position = 0;
+    uint64_t range_offset;
+    uint64_t bytes_to_process = 0;
+
+    while (true) {
+        if (bytes_to_process == 0) {
+            rc = bpak_transport_decode_next_input(ctx,
+                                                  &range_offset,
+                                                  &bytes_to_process);
+
+            if (rc != BPAK_OK)
+                return rc;
+            if (bytes_to_process == 0)
+                break;
+
+            if (range_offset != part_position) {
+                input_offset += range_offset - part_position;
+                part_position = range_offset;
+
+                if (!setup->priv.positional_io &&
+                    (fseek(setup->input->fp, input_offset, SEEK_SET) != 0))
+                    return -BPAK_SEEK_ERROR;
+            }
+        }
+
+        size_t chunk_length = BPAK_MIN(bytes_to_process, setup->buffer_length);
+        ssize_t bytes_read;
+
+        if (setup->priv.positional_io) {
+            bytes_read = decode_pread(setup->input->fp,
+                                      input_offset,
+                                      chunk_buffer,
+                                      chunk_length);
+        } else {
+            bytes_read =
+                fread(chunk_buffer, 1, chunk_length, setup->input->fp);
+        }
+
+        if (bytes_read != (ssize_t)chunk_length) {
+            bpak_printf(0, "%s: bytes_read != chunk_length\n", __func__);
+            return -BPAK_READ_ERROR;
+        }
+
+        input_offset += chunk_length;
+        part_position += chunk_length;
+
+        rc = bpak_transport_decode_write_chunk(ctx, chunk_buffer, chunk_length);
+
+        if (rc != BPAK_OK) {
+            bpak_printf(
+                0,
+                "Error: Decoder write chunk failed for part 0x%x (%i)\n",
+                part->id,
+                rc);
+            return rc;
+        }
+
+        bytes_to_process -= chunk_length;
+    }
+
+    /* The stream of the next part starts after any skipped input */
+    if (!setup->priv.positional_io &&
+        (part_position != bpak_part_size(part)) &&
+        (fseek(setup->input->fp,
+               input_offset + (bpak_part_size(part) - part_position),
+               SEEK_SET) != 0))
+        return -BPAK_SEEK_ERROR;
+
+    rc = bpak_transport_decode_finish(ctx);
+
+    if (rc != BPAK_OK) {
+        bpak_printf(0,
+                    "Error: Decoder finish failed for part 0x%x (%i)\n",
+                    part->id,
+                    rc);
+    }
+
+    return rc;
+}
+
+static int decode_sequential(struct decode_setup *setup)
+{
+    int rc;
+    struct bpak_header *patch_header = bpak_pkg_header(setup->input);
+    struct bpak_transport_decode decode_ctx;
+    off_t input_offset = sizeof(struct bpak_header);
+    uint8_t *chunk_buffer = setup->calloc_func(1, setup->buffer_length);
+    uint8_t *decode_buffer = setup->calloc_func(1, setup->buffer_length);
+
+    memset(&decode_ctx, 0, sizeof(decode_ctx));
+
+    if ((chunk_buffer == NULL) || (decode_buffer == NULL)) {
+        rc = -BPAK_FAILED;
+        goto err_free_out;
+    }
+
+    rc = decode_context_init(setup,
+                             &decode_ctx,
+                             patch_header,
+                             decode_buffer,
+                             decode_write_output_header);
+
+    if (rc != BPAK_OK)
+        goto err_out;
+
+    if (!setup->priv.positional_io &&
+        (fseek(setup->input->fp, input_offset, SEEK_SET) != 0)) {
+        bpak_printf(0, "%s: Error, could not seek input stream", __func__);
+        rc = -BPAK_SEEK_ERROR;
+        goto err_out;
+    }
+
+    bpak_foreach_part (patch_header, part) {
+        if (part->id == 0)
+            break;
+
+        size_t input_length = bpak_part_size(part);
+
+        rc = decode_part(setup, &decode_ctx, part, input_offset, chunk_buffer);
+
+        if (rc != BPAK_OK)
+            goto err_out;
+
+        input_offset += input_length;
+    }
+
+err_out:
+    decode_context_free(setup, &decode_ctx);
+err_free_out:
+    if (chunk_buffer != NULL)
+        setup->free_func(chunk_buffer);
+    if (decode_buffer != NULL)
+        setup->free_func(decode_buffer);
+    return rc;
+}
+
+/* In place and when unchanged blocks are skipped the output is decoded
+ * over an older package, which may be larger than the decoded one. Block
+ * devices keep their size. */
+static int decode_output_truncate(struct decode_setup *setup,
+                                    struct bpak_header *header)
+{
+    struct stat st;
+    FILE *fp = setup->priv.output_fp;
+    size_t new_size = sizeof(struct bpak_header);
+
+    if ((setup->in_place_scratch == 0) && !setup->skip_unchanged)
+        return BPAK_OK;
+
+    if ((fflush(fp) != 0) || (fstat(fileno(fp), &st) != 0))
+        return -BPAK_WRITE_ERROR;
+
+    if (!S_ISREG(st.st_mode))
+        return BPAK_OK;
+
+    bpak_foreach_part (header, part) {
+        if (part->id == 0)
+            break;
+
+        new_size += bpak_part_size(part);
+    }
+
+    if (ftruncate(fileno(fp), new_size) != 0) {
+        bpak_printf(0,
+                    "%s: Error: Couldn't truncate file: %s\n",
+                    __func__,
+                    strerror(errno));
+        return -BPAK_WRITE_ERROR;
+    }
+
+    return BPAK_OK;
+}
+
+/* A data part and optionally its hash tree, which are decoded in order with
+ * one context so that the tree is built while the data is written */
+#define DECODE_JOB_MAX_PARTS 2
+
+struct decode_job {
+    struct decode_setup *setup; /* Package of the job */
+    struct bpak_header header; /* Private copy, other parts decoded */
+    struct bpak_part_header *parts[DECODE_JOB_MAX_PARTS]; /* In 'header' */
+    off_t input_offset[DECODE_JOB_MAX_PARTS];
+    unsigned int part_count;
+};
+
+/* The jobs of one or more packages. The workers allocate their decode
+ * buffers with the settings of 'setup', the first package. */
+struct decode_pool {
+    struct decode_setup *setup;
+    pthread_mutex_t lock;
+    struct decode_job *jobs;
+    size_t job_count;
+    size_t next_job;
+    int rc; /* First error */
+};
+
+static int decode_job_run(struct decode_job *job,
+                          struct bpak_transport_decode *ctx,
+                          uint8_t *chunk_buffer, uint8_t *decode_buffer)
+{
+    int rc;
+    struct decode_setup *setup = job->setup;
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    rc = decode_context_init(setup,
+                             ctx,
+                             &job->header,
+                             decode_buffer,
+                             decode_skip_output_header);
+
+    for (unsigned int i = 0; (rc == BPAK_OK) && (i < job->part_count); i++) {
+        rc = decode_part(setup,
+                         ctx,
+                         job->parts[i],
+                         job->input_offset[i],
+                         chunk_buffer);
+    }
+
+    decode_context_free(setup, ctx);
+    return rc;
+}
+
+/* Mark every part of the package as decoded and write the output header,
+ * once all jobs of the package are done */
+static int decode_package_done(struct decode_setup *setup)
+{
+    struct bpak_header *patch_header = bpak_pkg_header(setup->input);
+    ssize_t bytes_written;
+
+    bpak_foreach_part (patch_header, part) {
+        if (part->id == 0)
+            break;
+        part->flags &= ~(BPAK_FLAG_TRANSPORT | BPAK_FLAG_REUSE_ORIGIN |
+                         BPAK_FLAG_AUTO_MASK);
+        part->transport_size = 0;
+    }
+
+    bytes_written = decode_write_output_header(0,
+                                               (uint8_t *)patch_header,
+                                               sizeof(struct bpak_header),
+                                               &setup->priv);
+
+    if (bytes_written != sizeof(struct bpak_header))
+        return (bytes_written < 0) ? bytes_written : -BPAK_WRITE_ERROR;
+
+    return decode_output_truncate(setup, patch_header);
+}
+
+/* Record the result of a job, called with the pool lock held. Returns true
+ * when it was the last job of a package that is now ready for
+ * decode_package_done. */
+static bool decode_job_done(struct decode_pool *pool, struct decode_job *job,
+                            int rc)
+{
+    struct decode_setup *setup = job->setup;
+
+    if (rc != BPAK_OK) {
+        if (pool->rc == BPAK_OK)
+            pool->rc = rc;
+        if (setup->rc == BPAK_OK)
+            setup->rc = rc;
+        return false;
+    }
+
+    return (--setup->jobs_left == 0) && (setup->rc == BPAK_OK);
+}
+
+static void *decode_worker(void *arg)
+{
+    struct decode_pool *pool = (struct decode_pool *)arg;
+    struct decode_setup *setup = pool->setup;
+    struct bpak_transport_decode *ctx =
+        setup->calloc_func(1, sizeof(struct bpak_transport_decode));
+    uint8_t *chunk_buffer = setup->calloc_func(1, setup->buffer_length);
+    uint8_t *decode_buffer = setup->calloc_func(1, setup->buffer_length);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if ((ctx == NULL) || (chunk_buffer == NULL) || (decode_buffer == NULL)) {
+        if (pool->rc == BPAK_OK)
+            pool->rc = -BPAK_FAILED;
+    }
+
+    while ((pool->next_job < pool->job_count) && (pool->rc == BPAK_OK)) {
+        struct decode_job *job = &pool->jobs[pool->next_job++];
+
+        pthread_mutex_unlock(&pool->lock);
+        int rc = decode_job_run(job, ctx, chunk_buffer, decode_buffer);
+        pthread_mutex_lock(&pool->lock);
+
+        if (decode_job_done(pool, job, rc)) {
+            pthread_mutex_unlock(&pool->lock);
+            rc = decode_package_done(job->setup);
+            pthread_mutex_lock(&pool->lock);
+
+            if (rc != BPAK_OK)
+                decode_job_done(pool, job, rc);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (ctx != NULL)
+        setup->free_func(ctx);
+    if (chunk_buffer != NULL)
+        setup->free_func(chunk_buffer);
+    if (decode_buffer != NULL)
+        setup->free_func(decode_buffer);
+    return NULL;
+}
+
+static uint32_t decode_decoder_id(struct bpak_header *header,
+                                  struct bpak_part_header *part)
+{
+    struct bpak_transport_meta *tm = decode_transport_meta(header, part);
+
+    return bpak_transport_decoder_id(tm, part);
+}
+
+static struct decode_job *decode_find_job(struct decode_pool *pool,
+                                          struct decode_setup *setup,
+                                          bpak_id_t part_id)
+{
+    for (size_t i = 0; i < pool->job_count; i++) {
+        if ((pool->jobs[i].setup == setup) &&
+            (pool->jobs[i].parts[0]->id == part_id))
+            return &pool->jobs[i];
+    }
+
+    return NULL;
+}
+
+static void decode_add_part(struct decode_job *job,
+                            struct bpak_header *patch_header,
+                            struct bpak_part_header *part)
+{
+    unsigned int n = job->part_count++;
+
+    /* The private header starts out with every part decoded so that the
+     * output offsets match the final layout, parts of this job are put
+     * back to their transport state */
+    if (n == 0) {
+        memcpy(&job->header, patch_header, sizeof(job->header));
+
+        bpak_foreach_part (&job->header, p) {
+            if (p->id == 0)
+                break;
+            p->flags &= ~(BPAK_FLAG_TRANSPORT | BPAK_FLAG_REUSE_ORIGIN |
+                          BPAK_FLAG_AUTO_MASK);
+            p->transport_size = 0;
+        }
+    }
+
+    bpak_get_part(&job->header, part->id, &job->parts[n]);
+    job->parts[n]->flags = part->flags;
+    job->parts[n]->transport_size = part->transport_size;
+    job->input_offset[n] = bpak_part_offset(patch_header, part);
+}
+
+static size_t decode_part_count(struct decode_setup *setup)
+{
+    size_t part_count = 0;
+
+    bpak_foreach_part (bpak_pkg_header(setup->input), part) {
+        if (part->id == 0)
+            break;
+        part_count++;
+    }
+
+    return part_count;
+}
+
+/* Queue the parts of the package of 'setup' in 'pool->jobs' */
+static void decode_pool_add(struct decode_pool *pool,
+                            struct decode_setup *setup)
+{
+    struct bpak_header *patch_header = bpak_pkg_header(setup->input);
+    size_t first_job = pool->job_count;
+
+    /* Merkle trees are generated from the decoded filesystem and join the
+     * job of that filesystem part */
+    for (int pass = 0; pass < 2; pass++) {
+        bpak_foreach_part (patch_header, part) {
+            if (part->id == 0)
+                break;
+
+            bool merkle = decode_decoder_id(patch_header, part) ==
+                          BPAK_ID_MERKLE_GENERATE;
+
+            if (merkle != (pass == 1))
+                continue;
+
+            struct decode_job *job = NULL;
+
+            if (merkle) {
+                job = decode_find_job(
+                    pool,
+                    setup,
+                    bpak_hash_tree_id_to_part_id(patch_header, part->id));
+            }
+
+            if ((job == NULL) || (job->part_count == DECODE_JOB_MAX_PARTS)) {
+                job = &pool->jobs[pool->job_count++];
+                job->setup = setup;
+            }
+
+            decode_add_part(job, patch_header, part);
+        }
+    }
+
+    setup->jobs_left = pool->job_count - first_job;
+    setup->rc = BPAK_OK;
+}
+
+/* Run the jobs of 'pool' on up to 'jobs' workers */
+static int decode_pool_run(struct decode_pool *pool, unsigned int jobs)
+{
+    pthread_t threads[BPAK_MAX_PARTS];
+    unsigned int thread_count = 0;
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    jobs = BPAK_MIN(jobs, BPAK_MIN(pool->job_count, BPAK_MAX_PARTS));
+
+    for (; (jobs > 1) && (thread_count < jobs); thread_count++) {
+        if (pthread_create(&threads[thread_count],
+                           NULL,
+                           decode_worker,
+                           pool) != 0)
+            break;
+    }
+
+    /* Run the queue in this thread with one job, or if no worker could be
+     * started */
+    if (thread_count == 0)
+        decode_worker(pool);
+
+    for (unsigned int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    return pool->rc;
+}
+
+static int decode_parallel(struct decode_setup *setup, unsigned int jobs)
+{
+    int rc;
+    struct decode_pool pool;
+    size_t part_count = decode_part_count(setup);
+
+    if (part_count == 0)
+        return BPAK_OK;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.setup = setup;
+    pool.jobs = setup->calloc_func(part_count, sizeof(struct decode_job));
+
+    if (pool.jobs == NULL)
+        return -BPAK_FAILED;
+
+    decode_pool_add(&pool, setup);
+    rc = decode_pool_run(&pool, jobs);
+
+    setup->free_func(pool.jobs);
+    return rc;
+}
+
+/* Common setup of bpak_pkg_transport_decode and the stream decoder,
+ * 'input' is NULL for the stream decoder */
+static int decode_setup_init(struct decode_setup *setup,
+                             struct bpak_package *input,
+                             struct bpak_package *output,
+                             struct bpak_package *origin,
+                             const struct bpak_transport_decode_options
+                                 *options,
+                             unsigned int *jobs)
+{
+    /* The decoders work on the streams of the packages, and on the
+     * parts of the header only */
+    if (((input != NULL) && (input->fp == NULL)) || (output->fp == NULL) ||
+        ((origin != NULL) && (origin->fp == NULL)) ||
+        ((input != NULL) && (input->tables != NULL)) ||
+        ((origin != NULL) && (origin->tables != NULL)))
+        return -BPAK_NOT_SUPPORTED;
+
+    memset(setup, 0, sizeof(*setup));
+    *jobs = 1;
+    setup->input = input;
+    setup->origin = origin;
+    setup->buffer_length = BPAK_CHUNK_BUFFER_LENGTH;
+    setup->calloc_func = bpak_calloc;
+    setup->free_func = bpak_free;
+    setup->priv.output_fp = output->fp;
+    setup->priv.output_position = -1;
+    if (origin != NULL)
+        setup->priv.origin_fp = origin->fp;
+    else
+        setup->priv.origin_fp = NULL;
+
+    if (options != NULL) {
+        if (options->buffer_length != 0)
+            setup->buffer_length = options->buffer_length;
+        if (options->calloc_func != NULL)
+            setup->calloc_func = options->calloc_func;
+        if (options->free_func != NULL)
+            setup->free_func = options->free_func;
+        if (options->jobs > 1)
+            *jobs = options->jobs;
+
+        setup->priv.out_buf_length = options->output_buffer_length;
+        setup->priv.direct_io = options->direct_io;
+        setup->priv.drop_cache = options->drop_cache;
+        setup->progress = options->progress;
+        setup->progress_user = options->progress_user;
+        setup->allocator = options->allocator;
+        setup->threads = options->threads;
+        setup->write_block_length = options->write_block_length;
+        setup->in_place_scratch = options->in_place_scratch;
+        setup->skip_unchanged = options->skip_unchanged;
+        setup->verify_origin = options->verify_origin;
+
+        if ((setup->priv.out_buf_length == 0) &&
+            (options->direct_io || options->drop_cache))
+            setup->priv.out_buf_length = DECODE_OUTPUT_BUFFER_DEFAULT;
+
+        /* Workers must never share a file position, and the output
+         * buffer is written with pwrite */
+        setup->priv.positional_io = options->positional_io || (*jobs > 1) ||
+                                    (setup->priv.out_buf_length > 0);
+    }
+
+    if (setup->priv.out_buf_length % BPAK_DECODE_OUTPUT_ALIGN != 0)
+        return -BPAK_SIZE_ERROR;
+
+    /* The output buffer holds one contiguous range, and in place the parts
+     * are written in order */
+    if (((setup->priv.out_buf_length > 0) || (setup->in_place_scratch > 0)) &&
+        (*jobs > 1))
+        return -BPAK_NOT_SUPPORTED;
+
+    /* bspatch splits the decoder buffer in two halves */
+    if ((setup->buffer_length < 2) || (setup->buffer_length % 2 != 0))
+        return -BPAK_SIZE_ERROR;
+
+    /* Nothing may still be buffered in the FILE when bypassing it */
+    if (setup->priv.positional_io && (fflush(output->fp) != 0))
+        return -BPAK_WRITE_ERROR;
+
+    if (setup->priv.out_buf_length > 0) {
+        void *out_buf = NULL;
+
+        if (posix_memalign(&out_buf,
+                           BPAK_DECODE_OUTPUT_ALIGN,
+                           setup->priv.out_buf_length) != 0)
+            return -BPAK_FAILED;
+
+        setup->priv.out_buf = (uint8_t *)out_buf;
+    }
+
+    return BPAK_OK;
+}
+
+/* Write what is left in the output buffer and free it */
+static int decode_setup_free(struct decode_setup *setup, int rc)
+{
+    if (setup->priv.out_buf != NULL) {
+        int flush_rc = decode_output_flush(&setup->priv);
+
+        if (rc == BPAK_OK)
+            rc = flush_rc;
+
+        decode_output_set_direct(&setup->priv, false);
+        free(setup->priv.out_buf);
+        setup->priv.out_buf = NULL;
     }
 
-    return installed_size;
-}
+    return rc;
+}
+
+BPAK_EXPORT int bpak_pkg_transport_decode(struct bpak_package *input,
+                                          struct bpak_package *output,
+                                          struct bpak_package *origin)
+{
+    return bpak_pkg_transport_decode_opts(input, output, origin, NULL);
+}
+
+BPAK_EXPORT int bpak_pkg_transport_decode_opts(
+    struct bpak_package *input, struct bpak_package *output,
+    struct bpak_package *origin,
+    const struct bpak_transport_decode_options *options)
+{
+    int rc;
+    struct decode_setup setup;
+    unsigned int jobs;
+
+    rc = decode_setup_init(&setup, input, output, origin, options, &jobs);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (jobs > 1)
+        return decode_parallel(&setup, jobs);
+
+    rc = decode_sequential(&setup);
+    rc = decode_setup_free(&setup, rc);
+
+    if (rc == BPAK_OK)
+        rc = decode_output_truncate(&setup, bpak_pkg_header(input));
+
+    return rc;
+}
+
+BPAK_EXPORT int bpak_pkg_transport_decode_multi(
+    struct bpak_pkg_install *packages, size_t count,
+    const struct bpak_transport_decode_options *options)
+{
+    int rc = BPAK_OK;
+    struct decode_setup *setups;
+    struct decode_pool pool;
+    unsigned int jobs = 1;
+    size_t part_count = 0;
+    size_t queued = 0;
+
+    if (count == 0)
+        return BPAK_OK;
+
+    /* Neither the range of the output buffer nor the in place ring can be
+     * shared by the parts of several outputs */
+    if ((options != NULL) &&
+        ((options->output_buffer_length > 0) || options->direct_io ||
+         options->drop_cache || (options->in_place_scratch > 0)))
+        return -BPAK_NOT_SUPPORTED;
+
+    for (size_t i = 0; i < count; i++)
+        packages[i].rc = -BPAK_FAILED;
+
+    memset(&pool, 0, sizeof(pool));
+    setups = bpak_calloc(count, sizeof(*setups));
+
+    if (setups == NULL)
+        return -BPAK_FAILED;
+
+    for (size_t i = 0; i < count; i++) {
+        rc = decode_setup_init(&setups[i],
+                               packages[i].input,
+                               packages[i].output,
+                               packages[i].origin,
+                               options,
+                               &jobs);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
 
-BPAK_EXPORT size_t bpak_pkg_size(struct bpak_package *pkg)
-{
-    size_t transport_size = 0;
+        /* Workers of different packages share no file positions */
+        if (!setups[i].priv.positional_io &&
+            (fflush(packages[i].output->fp) != 0)) {
+            rc = -BPAK_WRITE_ERROR;
+            goto err_free_out;
+        }
 
-    bpak_foreach_part (&pkg->header, p) {
-        if (p->flags & BPAK_FLAG_TRANSPORT)
-            transport_size += p->transport_size;
-        else
-            transport_size += p->size;
+        setups[i].priv.positional_io = true;
+        part_count += decode_part_count(&setups[i]);
     }
 
-    transport_size += sizeof(struct bpak_header);
+    pool.setup = &setups[0];
+    pool.jobs = bpak_calloc(part_count ? part_count : 1, sizeof(*pool.jobs));
 
-    return transport_size;
-}
+    if (pool.jobs == NULL) {
+        rc = -BPAK_FAILED;
+        goto err_free_out;
+    }
 
-BPAK_EXPORT struct bpak_header *bpak_pkg_header(struct bpak_package *pkg)
-{
-    return &pkg->header;
-}
+    for (; (queued < count) && (rc == BPAK_OK); queued++) {
+        decode_pool_add(&pool, &setups[queued]);
 
-BPAK_EXPORT int bpak_pkg_write_header(struct bpak_package *pkg)
-{
-    if (fseek(pkg->fp, 0, SEEK_SET) != 0) {
-        return -BPAK_SEEK_ERROR;
+        /* A package without parts is done right away */
+        if (setups[queued].jobs_left == 0)
+            rc = setups[queued].rc = decode_package_done(&setups[queued]);
     }
 
-    size_t bytes_written =
-        fwrite(&pkg->header, 1, sizeof(pkg->header), pkg->fp);
+    if (rc == BPAK_OK)
+        rc = decode_pool_run(&pool, jobs);
 
-    if (bytes_written != sizeof(pkg->header)) {
-        bpak_printf(0, "%s: Write failed\n", __func__);
-        return -BPAK_WRITE_ERROR;
+    for (size_t i = 0; i < queued; i++) {
+        if ((setups[i].rc != BPAK_OK) || (setups[i].jobs_left == 0))
+            packages[i].rc = setups[i].rc;
     }
 
-    return BPAK_OK;
+err_free_out:
+    if (pool.jobs != NULL)
+        bpak_free(pool.jobs);
+    bpak_free(setups);
+    return rc;
 }
 
-BPAK_EXPORT int bpak_pkg_write_raw_signature(struct bpak_package *pkg,
-                                             const uint8_t *signature,
-                                             size_t size)
+/* Estimate input, 'offset' is relative to the package data */
+static ssize_t estimate_read_input(off_t offset, uint8_t *buffer,
+                                   size_t length, void *user)
 {
-    memset(pkg->header.signature, 0, sizeof(pkg->header.signature));
-    memcpy(pkg->header.signature, signature, size);
-    pkg->header.signature_sz = size;
-    return bpak_pkg_write_header(pkg);
-}
+    struct bpak_package *pkg = (struct bpak_package *)user;
+    int rc = bpak_pkg_read_at(pkg,
+                              offset + sizeof(struct bpak_header),
+                              buffer,
+                              length);
 
-struct decode_private {
-    FILE *output_fp;
-    FILE *origin_fp;
-};
+    return (rc == BPAK_OK) ? (ssize_t)length : rc;
+}
 
-static ssize_t decode_write_output(off_t offset, uint8_t *buffer, size_t length,
-                                   void *user)
+BPAK_EXPORT int
+bpak_pkg_transport_estimate(struct bpak_package *pkg,
+                            struct bpak_transport_estimate *estimate)
 {
-    struct decode_private *priv = (struct decode_private *)user;
-
-    if (fseek(priv->output_fp, offset, SEEK_SET) != 0) {
-        return -BPAK_SEEK_ERROR;
-    }
-
-    return fwrite(buffer, 1, length, priv->output_fp);
+    return bpak_transport_decode_estimate(bpak_pkg_header(pkg),
+                                          estimate_read_input,
+                                          pkg,
+                                          estimate);
 }
 
-static ssize_t decode_read_output(off_t offset, uint8_t *buffer, size_t length,
-                                  void *user)
+/* Private part of a bpak_pkg_decode_stream */
+struct decode_stream_private {
+    struct decode_setup setup;
+    struct bpak_transport_decode ctx;
+    uint8_t *decode_buffer;
+};
+
+/* Start decoding the parts from 'stream->part' on. Parts without input
+ * data, for example generated hash trees, are decoded right away. */
+static int decode_stream_next_part(struct bpak_pkg_decode_stream *stream)
 {
-    struct decode_private *priv = (struct decode_private *)user;
+    int rc;
+    struct decode_stream_private *priv = stream->priv;
 
-    if (fseek(priv->output_fp, offset, SEEK_SET) != 0) {
-        return -BPAK_SEEK_ERROR;
-    }
+    while ((stream->part != NULL) && (stream->part->id != 0)) {
+        struct bpak_part_header *part = stream->part;
 
-    return fread(buffer, 1, length, priv->output_fp);
-}
+        rc = bpak_transport_decode_start(&priv->ctx, part);
 
-static ssize_t decode_write_output_header(off_t offset, uint8_t *buffer,
-                                          size_t length, void *user)
-{
-    struct decode_private *priv = (struct decode_private *)user;
-    (void)offset;
+        if (rc != BPAK_OK) {
+            bpak_printf(0,
+                        "Error: Decoder start failed for part 0x%x (%i)\n",
+                        part->id,
+                        rc);
+            return rc;
+        }
 
-    if (length != sizeof(struct bpak_header))
-        return -BPAK_SIZE_ERROR;
+        stream->part_remaining = bpak_part_size(part);
 
-    if (fseek(priv->output_fp, 0, SEEK_SET) != 0) {
-        return -BPAK_SEEK_ERROR;
-    }
+        if (stream->part_remaining > 0)
+            return BPAK_OK;
 
-    return fwrite(buffer, 1, length, priv->output_fp);
-}
+        rc = bpak_transport_decode_finish(&priv->ctx);
 
-static ssize_t decode_read_origin(off_t offset, uint8_t *buffer, size_t length,
-                                  void *user)
-{
-    struct decode_private *priv = (struct decode_private *)user;
+        if (rc != BPAK_OK) {
+            bpak_printf(0,
+                        "Error: Decoder finish failed for part 0x%x (%i)\n",
+                        part->id,
+                        rc);
+            return rc;
+        }
 
-    if (fseek(priv->origin_fp, offset, SEEK_SET) != 0) {
-        return -BPAK_SEEK_ERROR;
+        if (part == &stream->header.parts[BPAK_MAX_PARTS - 1])
+            stream->part = NULL;
+        else
+            stream->part = part + 1;
     }
 
-    return fread(buffer, 1, length, priv->origin_fp);
+    stream->part = NULL;
+    return BPAK_OK;
 }
 
-BPAK_EXPORT int bpak_pkg_transport_decode(struct bpak_package *input,
-                                          struct bpak_package *output,
-                                          struct bpak_package *origin)
+static int decode_stream_header(struct bpak_pkg_decode_stream *stream)
 {
     int rc;
+    struct decode_stream_private *priv = stream->priv;
 
-    struct bpak_header *patch_header = bpak_pkg_header(input);
-    struct bpak_part_header *origin_part = NULL;
-    struct bpak_transport_decode decode_ctx;
-    uint8_t chunk_buffer[BPAK_CHUNK_BUFFER_LENGTH];
-    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
-    struct decode_private decode_private;
-
-    memset(&decode_private, 0, sizeof(struct decode_private));
-    decode_private.output_fp = output->fp;
-    if (origin != NULL)
-        decode_private.origin_fp = origin->fp;
-    else
-        decode_private.origin_fp = NULL;
-
-    rc = bpak_transport_decode_init(&decode_ctx,
-                                    decode_buffer,
-                                    BPAK_CHUNK_BUFFER_LENGTH,
-                                    patch_header,
-                                    decode_write_output,
-                                    decode_read_output,
-                                    sizeof(struct bpak_header),
-                                    decode_write_output_header,
-                                    &decode_private);
+    rc = bpak_valid_header(&stream->header);
 
     if (rc != BPAK_OK) {
-        bpak_printf(0,
-                    "%s: Error: Transport decode init failed (%i) %s",
-                    __func__,
-                    rc,
-                    bpak_error_string(rc));
-        goto err_out;
+        bpak_printf(0, "Error: Invalid patch header (%i)\n", rc);
+        return rc;
     }
 
-    if (origin != NULL) {
-        struct bpak_header *origin_header = bpak_pkg_header(origin);
+    /* The continuation tables would have to be received before any part */
+    if (bpak_header_size(&stream->header) != sizeof(stream->header))
+        return -BPAK_NOT_SUPPORTED;
 
-        rc = bpak_transport_decode_set_origin(&decode_ctx,
-                                              origin_header,
-                                              decode_read_origin,
-                                              sizeof(struct bpak_header));
+    rc = decode_context_init(&priv->setup,
+                             &priv->ctx,
+                             &stream->header,
+                             priv->decode_buffer,
+                             decode_write_output_header);
 
-        if (rc != BPAK_OK) {
-            bpak_printf(0,
-                        "Error: Origin stream init failed (%i) %s\n",
-                        rc,
-                        bpak_error_string(rc));
-            goto err_out;
-        }
-    }
+    if (rc != BPAK_OK)
+        return rc;
 
-    if (fseek(input->fp, sizeof(struct bpak_header), SEEK_SET) != 0) {
-        bpak_printf(0, "%s: Error, could not seek input stream", __func__);
-        return -BPAK_SEEK_ERROR;
-    }
+    stream->part = &stream->header.parts[0];
+    return decode_stream_next_part(stream);
+}
 
-    bpak_foreach_part (patch_header, part) {
-        if (part->id == 0)
-            break;
+BPAK_EXPORT int bpak_pkg_transport_decode_stream_init(
+    struct bpak_pkg_decode_stream *stream, struct bpak_package *output,
+    struct bpak_package *origin,
+    const struct bpak_transport_decode_options *options)
+{
+    int rc;
+    unsigned int jobs;
+    struct decode_stream_private *priv;
 
-        /* Compute origin and output offsets */
-        if (origin != NULL) {
-            rc = bpak_get_part(&origin->header, part->id, &origin_part);
+    memset(stream, 0, sizeof(*stream));
+    priv = bpak_calloc(1, sizeof(*priv));
 
-            if (rc != BPAK_OK) {
-                bpak_printf(0,
-                            "Error could not get part with ref %x\n",
-                            part->id);
-                goto err_out;
-            }
-        }
+    if (priv == NULL)
+        return -BPAK_FAILED;
 
-        rc = bpak_transport_decode_start(&decode_ctx, part);
+    stream->priv = priv;
+    rc = decode_setup_init(&priv->setup,
+                           NULL,
+                           output,
+                           origin,
+                           options,
+                           &jobs);
 
-        if (rc != BPAK_OK) {
-            bpak_printf(0,
-                        "Error: Decoder start failed for part 0x%x (%i)\n",
-                        part->id,
-                        rc);
-            goto err_out;
-        }
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    /* The input arrives in order, one part at a time */
+    if (jobs > 1) {
+        rc = -BPAK_NOT_SUPPORTED;
+        goto err_free_out;
+    }
 
-        /* If there is any input data chunk it up and feed the decoder */
-        size_t bytes_to_process = bpak_part_size(part);
+    priv->decode_buffer = priv->setup.calloc_func(1,
+                                                  priv->setup.buffer_length);
 
-        while (bytes_to_process) {
-            size_t chunk_length =
-                BPAK_MIN(bytes_to_process, sizeof(chunk_buffer));
-            size_t bytes_read = fread(chunk_buffer, 1, chunk_length, input->fp);
+    if (priv->decode_buffer == NULL) {
+        rc = -BPAK_FAILED;
+        goto err_free_out;
+    }
 
-            if (bytes_read != chunk_length) {
-                bpak_printf(0, "%s: bytes_read != chunk_length\n", __func__);
-                return -BPAK_READ_ERROR;
-            }
+    return BPAK_OK;
 
-            rc = bpak_transport_decode_write_chunk(&decode_ctx,
-                                                   chunk_buffer,
+err_free_out:
+    bpak_pkg_transport_decode_stream_free(stream);
+    return rc;
+}
+
+BPAK_EXPORT int
+bpak_pkg_transport_decode_stream_write(struct bpak_pkg_decode_stream *stream,
+                                       uint8_t *buffer, size_t length)
+{
+    int rc;
+    struct decode_stream_private *priv = stream->priv;
+
+    if (stream->rc != BPAK_OK)
+        return stream->rc;
+
+    while (length > 0) {
+        size_t chunk_length;
+
+        if (stream->header_length < sizeof(stream->header)) {
+            chunk_length = BPAK_MIN(length,
+                                    sizeof(stream->header) -
+                                        stream->header_length);
+            memcpy((uint8_t *)&stream->header + stream->header_length,
+                   buffer,
+                   chunk_length);
+            stream->header_length += chunk_length;
+
+            if (stream->header_length == sizeof(stream->header))
+                rc = decode_stream_header(stream);
+            else
+                rc = BPAK_OK;
+        } else if (stream->part == NULL) {
+            bpak_printf(0, "Error: Data after the last part\n");
+            rc = -BPAK_SIZE_ERROR;
+            chunk_length = length;
+        } else {
+            chunk_length = BPAK_MIN(length, stream->part_remaining);
+            rc = bpak_transport_decode_write_chunk(&priv->ctx,
+                                                   buffer,
                                                    chunk_length);
 
             if (rc != BPAK_OK) {
                 bpak_printf(
                     0,
                     "Error: Decoder write chunk failed for part 0x%x (%i)\n",
-                    part->id,
+                    stream->part->id,
                     rc);
-                goto err_out;
             }
 
-            bytes_to_process -= chunk_length;
+            stream->part_remaining -= chunk_length;
+
+            if ((rc == BPAK_OK) && (stream->part_remaining == 0)) {
+                rc = bpak_transport_decode_finish(&priv->ctx);
+
+                if (rc != BPAK_OK) {
+                    bpak_printf(0,
+                                "Error: Decoder finish failed for part "
+                                "0x%x (%i)\n",
+                                stream->part->id,
+                                rc);
+                } else if (stream->part ==
+                           &stream->header.parts[BPAK_MAX_PARTS - 1]) {
+                    stream->part = NULL;
+                } else {
+                    stream->part++;
+                    rc = decode_stream_next_part(stream);
+                }
+            }
         }
 
-        rc = bpak_transport_decode_finish(&decode_ctx);
-
         if (rc != BPAK_OK) {
-            bpak_printf(0,
-                        "Error: Decoder finish failed for part 0x%x (%i)\n",
-                        part->id,
-                        rc);
-            goto err_out;
+            /* The decoders can't continue after an error */
+            stream->rc = rc;
+            return rc;
         }
+
+        buffer += chunk_length;
+        length -= chunk_length;
     }
 
-err_out:
-    bpak_transport_decode_free(&decode_ctx);
-    return rc;
+    return BPAK_OK;
 }
 
-BPAK_EXPORT int bpak_pkg_transport_encode(struct bpak_package *input,
-                                          struct bpak_package *output,
-                                          struct bpak_package *origin)
+BPAK_EXPORT int
+bpak_pkg_transport_decode_stream_finish(struct bpak_pkg_decode_stream *stream)
+{
+    struct decode_stream_private *priv = stream->priv;
+
+    if (stream->rc != BPAK_OK)
+        return stream->rc;
+
+    if ((stream->header_length < sizeof(stream->header)) ||
+        (stream->part != NULL)) {
+        bpak_printf(0, "Error: The patch stream ended early\n");
+        stream->rc = -BPAK_SIZE_ERROR;
+        return stream->rc;
+    }
+
+    stream->rc = decode_setup_free(&priv->setup, BPAK_OK);
+
+    if (stream->rc == BPAK_OK)
+        stream->rc = decode_output_truncate(&priv->setup, &stream->header);
+
+    return stream->rc;
+}
+
+BPAK_EXPORT void
+bpak_pkg_transport_decode_stream_free(struct bpak_pkg_decode_stream *stream)
+{
+    struct decode_stream_private *priv = stream->priv;
+
+    if (priv == NULL)
+        return;
+
+    decode_context_free(&priv->setup, &priv->ctx);
+
+    if (priv->decode_buffer != NULL)
+        priv->setup.free_func(priv->decode_buffer);
+
+    (void)decode_setup_free(&priv->setup, BPAK_OK);
+    bpak_free(priv);
+    stream->priv = NULL;
+}
+
+static int
+pkg_transport_encode(struct bpak_package *input, FILE *output_fp,
+                     struct bpak_header *output_header,
+                     struct bpak_package *origin,
+                     const struct bpak_transport_encode_options *options,
+                     bool stream)
 {
     FILE *origin_fp = NULL;
     struct bpak_header *origin_header = NULL;
+    struct bpak_transport_encode_options map_options;
+
+    /* The encoders work on the streams of the packages, and on the parts
+     * of the header only */
+    if ((input->fp == NULL) || (output_fp == NULL) ||
+        (input->tables != NULL) ||
+        ((origin != NULL) && (origin->tables != NULL)))
+        return -BPAK_NOT_SUPPORTED;
+
+    memset(&map_options, 0, sizeof(map_options));
+
+    if (options != NULL)
+        memcpy(&map_options, options, sizeof(map_options));
+
+    if (stream)
+        map_options.stream = true;
 
     if (origin != NULL) {
         if (origin->fp != NULL) {
             origin_fp = origin->fp;
             origin_header = &origin->header;
         }
+
+        if ((origin->map != NULL) && (map_options.origin_map == NULL)) {
+            map_options.origin_map = origin->map;
+            map_options.origin_map_size = origin->map_size;
+        }
+    }
+
+    /* The diff encoders use the package mappings instead of mapping the
+     * files again for every part */
+    if ((input->map != NULL) && (map_options.input_map == NULL)) {
+        map_options.input_map = input->map;
+        map_options.input_map_size = input->map_size;
+    }
+
+    return bpak_transport_encode_opts(input->fp,
+                                      &input->header,
+                                      output_fp,
+                                      output_header,
+                                      origin_fp,
+                                      origin_header,
+                                      &map_options);
+}
+
+BPAK_EXPORT int bpak_pkg_transport_encode(struct bpak_package *input,
+                                          struct bpak_package *output,
+                                          struct bpak_package *origin)
+{
+    return bpak_pkg_transport_encode_opts(input, output, origin, NULL);
+}
+
+BPAK_EXPORT int bpak_pkg_transport_encode_opts(
+    struct bpak_package *input, struct bpak_package *output,
+    struct bpak_package *origin,
+    const struct bpak_transport_encode_options *options)
+{
+    return pkg_transport_encode(input,
+                                output->fp,
+                                &output->header,
+                                origin,
+                                options,
+                                false);
+}
+
+BPAK_EXPORT int bpak_pkg_transport_encode_stream(
+    struct bpak_package *input, FILE *output_fp, struct bpak_package *origin,
+    const struct bpak_transport_encode_options *options)
+{
+    struct bpak_header output_header;
+
+    return pkg_transport_encode(input,
+                                output_fp,
+                                &output_header,
+                                origin,
+                                options,
+                                true);
+}
+
+/* Write 'length' bytes of the package at 'p_offset' to the current position
+ * of 'fp' */
+static int extract_copy(struct bpak_package *pkg, uint64_t p_offset,
+                        uint64_t length, FILE *fp)
+{
+    int rc = BPAK_OK;
+
+    if (pkg->map != NULL) {
+        /* The part is written straight from the mapping */
+        if ((p_offset > pkg->map_size) || (length > pkg->map_size - p_offset))
+            rc = -BPAK_SIZE_ERROR;
+        else if (fwrite(&pkg->map[p_offset], 1, length, fp) != length)
+            rc = -BPAK_WRITE_ERROR;
+    } else if (pkg->fp != NULL) {
+        /* The output is written from its current position, stdout may be
+         * a pipe */
+        rc = bpak_file_copy(pkg->fp, p_offset, fp, -1, length);
+    } else {
+        uint8_t chunk_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+
+        while ((rc == BPAK_OK) && (length > 0)) {
+            size_t chunk = BPAK_MIN(length, sizeof(chunk_buffer));
+
+            rc = bpak_pkg_read_at(pkg, p_offset, chunk_buffer, chunk);
+
+            if ((rc == BPAK_OK) && (fwrite(chunk_buffer, 1, chunk, fp) !=
+                                    chunk))
+                rc = -BPAK_WRITE_ERROR;
+
+            p_offset += chunk;
+            length -= chunk;
+        }
     }
 
-    return bpak_transport_encode(input->fp,
-                                 &input->header,
-                                 output->fp,
-                                 &output->header,
-                                 origin_fp,
-                                 origin_header);
+    return rc;
 }
 
 BPAK_EXPORT int bpak_pkg_extract_file(struct bpak_package *pkg,
@@ -416,20 +2660,35 @@ BPAK_EXPORT int bpak_pkg_extract_file(struct bpak_package *pkg,
 {
     int rc = BPAK_OK;
     uint64_t p_offset = 0;
-    struct bpak_header *h = bpak_pkg_header(pkg);
+    uint64_t length;
+    uint64_t position = 0;
+    uint64_t zeros = 0;
     struct bpak_part_header *part = NULL;
+    struct bpak_sparse_map sparse;
     FILE* fp;
 
-    rc = bpak_get_part(h, part_id, &part);
+    rc = bpak_pkg_get_part(pkg, part_id, &part);
     if (rc != BPAK_OK) {
         bpak_printf(0, "%s: Error: No such part!\n", __func__);
         return rc;
     }
 
-    p_offset = bpak_part_offset(h, part);
+    p_offset = bpak_pkg_part_offset(pkg, part);
 
-    if (fseek(pkg->fp, p_offset, SEEK_SET) != 0) {
-        return -BPAK_SEEK_ERROR;
+    /* Encoded data is extracted as it is */
+    if (part->flags & BPAK_FLAG_TRANSPORT) {
+        memset(&sparse, 0, sizeof(sparse));
+    } else {
+        rc = bpak_tables_get_sparse_map(&pkg->header,
+                                        pkg->tables,
+                                        bpak_pkg_table_count(pkg),
+                                        part,
+                                        &sparse);
+
+        if (rc != BPAK_OK) {
+            bpak_printf(0, "%s: Error: Bad sparse map\n", __func__);
+            return rc;
+        }
     }
 
     if (filename != NULL) {
@@ -444,34 +2703,29 @@ BPAK_EXPORT int bpak_pkg_extract_file(struct bpak_package *pkg,
         fp = stdout;
     }
 
-    char copy_buffer[BPAK_CHUNK_BUFFER_LENGTH];
-    size_t bytes_to_copy = bpak_part_size(part) - part->pad_bytes;
-    size_t chunk_to_write = 0;
-    size_t chunk_read = 0;
-
-    while (bytes_to_copy) {
-        if (bytes_to_copy > sizeof(copy_buffer)) {
-            chunk_to_write = sizeof(copy_buffer);
-        } else {
-            chunk_to_write = bytes_to_copy;
-        }
+    length = bpak_part_size(part) - part->pad_bytes;
 
-        chunk_read = fread(copy_buffer, 1, chunk_to_write, pkg->fp);
-        if (chunk_read != chunk_to_write) {
-            rc = -BPAK_READ_ERROR;
-            goto err_close_fp_out;
-        }
+    /* The zero extents of a sparse part are skipped in the output, or
+     * zeroed in place */
+    for (size_t i = 0; (rc == BPAK_OK) && (i < sparse.count); i++) {
+        uint64_t extent = (uint64_t)sparse.extents[i].count *
+                          BPAK_SPARSE_BLOCK_SZ;
+        uint64_t start = (uint64_t)sparse.extents[i].block *
+                             BPAK_SPARSE_BLOCK_SZ -
+                         zeros;
 
+        rc = extract_copy(pkg, p_offset + position, start - position, fp);
 
-        if (fwrite(copy_buffer, 1, chunk_read, fp) != chunk_read) {
-            rc = -BPAK_WRITE_ERROR;
-            goto err_close_fp_out;
-        }
+        if (rc == BPAK_OK)
+            rc = bpak_file_zero(fp, extent);
 
-        bytes_to_copy -= chunk_to_write;
+        position = start;
+        zeros += extent;
     }
 
-err_close_fp_out:
+    if (rc == BPAK_OK)
+        rc = extract_copy(pkg, p_offset + position, length - position, fp);
+
     if ((fp != stdout) && (fp != NULL)) {
         fclose(fp);
     }
@@ -490,6 +2744,11 @@ BPAK_EXPORT int bpak_pkg_delete_part(struct bpak_package *pkg,
 
     bpak_printf(1, "Deleting 0x%08x\n", part_id);
 
+    /* The file is collapsed and truncated, parts in continuation tables
+     * are not moved */
+    if ((pkg->fp == NULL) || (pkg->tables != NULL))
+        return -BPAK_NOT_SUPPORTED;
+
     rc = bpak_get_part(h, part_id, &part);
     if (rc != BPAK_OK) {
         bpak_printf(0, "%s: Error: No such part!\n", __func__);
@@ -525,43 +2784,16 @@ BPAK_EXPORT int bpak_pkg_delete_part(struct bpak_package *pkg,
     /* Move the actual data, range [p_offset+p_size  end) to [p_offset  end-p_size)
      * and then truncate the file
      */
-    uint64_t write_offset = p_offset;
-    uint64_t read_offset = p_offset + p_size;
-    char copy_buffer[BPAK_CHUNK_BUFFER_LENGTH];
-
-    while (bytes_to_process > 0) {
-        if (fseek(pkg->fp, read_offset, SEEK_SET) != 0) {
-            bpak_printf(0, "%s: Error: Couldn't read file: %s\n",
-                        __func__, strerror(errno));
-            return -BPAK_READ_ERROR;
-        }
-
-        size_t chunk_length =
-            BPAK_MIN(bytes_to_process, sizeof(copy_buffer));
-        size_t chunk_read = fread(copy_buffer, 1, BPAK_CHUNK_BUFFER_LENGTH, pkg->fp);
-
-        if (chunk_read != chunk_length) {
-            rc = ferror(pkg->fp);
-            if (rc != 0) {
-                bpak_printf(0, "%s: Error: Couldn't read file: %d\n",
-                            __func__, rc);
-                return -BPAK_READ_ERROR;
-            }
-        }
-
-        if (fseek(pkg->fp, write_offset, SEEK_SET) != 0 ||
-            fwrite(copy_buffer, 1, chunk_read, pkg->fp) != chunk_read) {
-            bpak_printf(0, "%s: Error: Couldn't write file: %s\n",
-                        __func__, strerror(errno));
-            return -BPAK_WRITE_ERROR;
-        }
-
-        bytes_to_process -= chunk_read;
-        read_offset += chunk_read;
-        write_offset += chunk_read;
+    rc = bpak_file_collapse(pkg->fp, p_offset, p_size, bytes_to_process);
+    if (rc != BPAK_OK) {
+        bpak_printf(0, "%s: Error: Couldn't move part data: %s\n",
+                    __func__, strerror(errno));
+        return rc;
     }
 
-    rc = bpak_pkg_update_hash(pkg, NULL, NULL);
+    /* The parts that were moved keep their content, only the payload hash
+     * needs to be recomputed */
+    rc = bpak_pkg_edited(pkg, 0);
     if (rc != BPAK_OK) {
         bpak_printf(0, "%s: Error: Could not update payload hash\n", __func__);
         return rc;
@@ -598,6 +2830,9 @@ BPAK_EXPORT int bpak_pkg_delete_all_parts(struct bpak_package *pkg, bool remove_
     struct bpak_header *h = bpak_pkg_header(pkg);
     int rc;
 
+    if ((pkg->fp == NULL) || (pkg->tables != NULL))
+        return -BPAK_NOT_SUPPORTED;
+
     /* Clear out all parts data */
     memset(h->parts, 0, sizeof(h->parts));
 
@@ -612,7 +2847,7 @@ BPAK_EXPORT int bpak_pkg_delete_all_parts(struct bpak_package *pkg, bool remove_
         }
     }
 
-    rc = bpak_pkg_update_hash(pkg, NULL, NULL);
+    rc = bpak_pkg_edited(pkg, 0);
     if (rc != BPAK_OK) {
         bpak_printf(0, "%s: Error: Could not update payload hash\n", __func__);
         return rc;
@@ -0,0 +1,520 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <bpak/bpak.h>
+#include <bpak/pkg.h>
+#include <bpak/id.h>
+#include <bpak/utils.h>
+#include <bpak/merkle.h>
+#include <bpak/crypto.h>
+#include <bpak/verify.h>
+
+/* Input is copied through a buffer of this size */
+#define BUILDER_BUFFER_LENGTH (1024 * 1024)
+
+/* State of the part that is being written */
+struct builder_part {
+    struct bpak_part_header *p;
+    struct bpak_hash_context digest; /* Part digest, when requested */
+    bool digest_valid;
+};
+
+static int builder_begin_part(struct bpak_pkg_builder *builder, bpak_id_t id,
+                              uint64_t size, uint8_t flags,
+                              struct builder_part *part)
+{
+    int rc;
+    struct bpak_header *h = &builder->pkg.header;
+    struct bpak_part_header *p = NULL;
+
+    /* Parts are streamed as they are, the zero blocks of a sparse part
+     * are only found by bpak_pkg_add_file */
+    if (flags & BPAK_FLAG_SPARSE)
+        return -BPAK_NOT_SUPPORTED;
+
+    memset(part, 0, sizeof(*part));
+
+    rc = bpak_add_part(h, id, &p);
+
+    if (rc != BPAK_OK) {
+        bpak_printf(0, "Error: Could not add part\n");
+        return rc;
+    }
+
+    p->id = id;
+    p->offset = builder->offset;
+    p->flags = flags;
+    p->size = size;
+
+    if (size % BPAK_PART_ALIGN)
+        p->pad_bytes = BPAK_PART_ALIGN - (size % BPAK_PART_ALIGN);
+    else
+        p->pad_bytes = 0;
+
+    part->p = p;
+
+    if (fseek(builder->pkg.fp, builder->offset, SEEK_SET) != 0)
+        return -BPAK_SEEK_ERROR;
+
+    if (builder->part_digests && !(flags & BPAK_FLAG_EXCLUDE_FROM_HASH)) {
+        rc = bpak_hash_init(&part->digest, h->hash_kind);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        part->digest_valid = true;
+    }
+
+    return BPAK_OK;
+}
+
+static int builder_write(struct bpak_pkg_builder *builder,
+                         struct builder_part *part, const uint8_t *buffer,
+                         size_t length)
+{
+    int rc;
+
+    if (fwrite(buffer, 1, length, builder->pkg.fp) != length)
+        return -BPAK_WRITE_ERROR;
+
+    if (part->p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH)
+        return BPAK_OK;
+
+    rc = bpak_hash_update(&builder->payload_hash, buffer, length);
+
+    if ((rc == BPAK_OK) && part->digest_valid)
+        rc = bpak_hash_update(&part->digest, buffer, length);
+
+    return rc;
+}
+
+static void builder_release_part(struct builder_part *part)
+{
+    if (part->digest_valid)
+        bpak_hash_free(&part->digest);
+
+    part->digest_valid = false;
+}
+
+/* Write the zero padding and the part digest */
+static int builder_end_part(struct bpak_pkg_builder *builder,
+                            struct builder_part *part)
+{
+    int rc;
+    uint8_t zero[BPAK_PART_ALIGN];
+    uint8_t hash[BPAK_HASH_MAX_LENGTH];
+    size_t hash_size = sizeof(hash);
+    struct bpak_meta_header *meta = NULL;
+
+    memset(zero, 0, sizeof(zero));
+
+    rc = builder_write(builder, part, zero, part->p->pad_bytes);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    builder->offset += bpak_part_size(part->p);
+
+    if (!part->digest_valid)
+        return BPAK_OK;
+
+    rc = bpak_hash_final(&part->digest, hash, hash_size, &hash_size);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_add_meta(&builder->pkg.header,
+                       BPAK_ID_PART_DIGEST,
+                       part->p->id,
+                       hash_size,
+                       &meta);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    memcpy(bpak_get_meta_ptr(&builder->pkg.header, meta, uint8_t),
+           hash,
+           hash_size);
+    return BPAK_OK;
+}
+
+/* Copy 'filename' into a new part, the data is also passed to 'merkle'
+ * when it is not NULL */
+static int builder_add_file(struct bpak_pkg_builder *builder,
+                            const char *filename, const char *part_name,
+                            uint8_t flags, struct bpak_merkle_context *merkle,
+                            size_t buffer_length)
+{
+    int rc;
+    struct stat statbuf;
+    struct builder_part part;
+    uint8_t *buffer = NULL;
+    uint64_t bytes_to_copy;
+    FILE *in_fp;
+
+    if (!builder->payload_hash_valid)
+        return -BPAK_FAILED;
+
+    if (stat(filename, &statbuf) != 0) {
+        bpak_printf(0, "Error: can't open file '%s'\n", filename);
+        return -BPAK_FILE_NOT_FOUND;
+    }
+
+    bpak_printf(1, "Adding %s <%s>\n", part_name, filename);
+
+    in_fp = fopen(filename, "rb");
+
+    if (in_fp == NULL) {
+        bpak_printf(0, "Could not open input file: %s\n", filename);
+        return -BPAK_FILE_NOT_FOUND;
+    }
+
+    rc = builder_begin_part(builder,
+                            bpak_id(part_name),
+                            statbuf.st_size,
+                            flags,
+                            &part);
+
+    if (rc != BPAK_OK)
+        goto err_release_out;
+
+    buffer = bpak_calloc(1, buffer_length);
+
+    if (buffer == NULL) {
+        rc = -BPAK_FAILED;
+        goto err_release_out;
+    }
+
+    bytes_to_copy = statbuf.st_size;
+
+    while (bytes_to_copy > 0) {
+        size_t chunk = BPAK_MIN(bytes_to_copy, (uint64_t)buffer_length);
+
+        if (fread(buffer, 1, chunk, in_fp) != chunk) {
+            rc = -BPAK_READ_ERROR;
+            goto err_release_out;
+        }
+
+        rc = builder_write(builder, &part, buffer, chunk);
+
+        if (rc != BPAK_OK)
+            goto err_release_out;
+
+#if BPAK_CONFIG_MERKLE == 1
+        if (merkle != NULL) {
+            rc = bpak_merkle_write_chunk(merkle, buffer, chunk);
+
+            if (rc != BPAK_OK)
+                goto err_release_out;
+        }
+#else
+        (void)merkle;
+#endif
+
+        bytes_to_copy -= chunk;
+    }
+
+    rc = builder_end_part(builder, &part);
+
+err_release_out:
+    builder_release_part(&part);
+    bpak_free(buffer);
+    fclose(in_fp);
+    return rc;
+}
+
+BPAK_EXPORT int bpak_pkg_builder_init(struct bpak_pkg_builder *builder,
+                                      const char *filename,
+                                      enum bpak_hash_kind hash_kind,
+                                      enum bpak_signature_kind signature_kind,
+                                      bool part_digests)
+{
+    int rc;
+
+    memset(builder, 0, sizeof(*builder));
+
+    rc = bpak_pkg_open(&builder->pkg, filename, "w+");
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    builder->pkg.header.hash_kind = hash_kind;
+    builder->pkg.header.signature_kind = signature_kind;
+    builder->part_digests = part_digests;
+    builder->offset = sizeof(struct bpak_header);
+
+    rc = bpak_hash_init(&builder->payload_hash, hash_kind);
+
+    if (rc != BPAK_OK) {
+        bpak_pkg_close(&builder->pkg);
+        return rc;
+    }
+
+    builder->payload_hash_valid = true;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_pkg_builder_add_meta(struct bpak_pkg_builder *builder,
+                                          bpak_id_t id, bpak_id_t part_ref_id,
+                                          const void *data, size_t size)
+{
+    int rc;
+    struct bpak_meta_header *meta = NULL;
+
+    rc = bpak_add_meta(&builder->pkg.header, id, part_ref_id, size, &meta);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    memcpy(bpak_get_meta_ptr(&builder->pkg.header, meta, uint8_t),
+           data,
+           size);
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_pkg_builder_add_file(struct bpak_pkg_builder *builder,
+                                          const char *filename,
+                                          const char *part_name,
+                                          uint8_t flags)
+{
+    return builder_add_file(builder,
+                            filename,
+                            part_name,
+                            flags,
+                            NULL,
+                            BUILDER_BUFFER_LENGTH);
+}
+
+#if BPAK_CONFIG_MERKLE == 1
+static ssize_t merkle_wr(off_t offset, uint8_t *buf, size_t size, void *priv)
+{
+    uint8_t *data = (uint8_t *)priv;
+    memcpy(&data[offset], buf, size);
+    return size;
+}
+
+static ssize_t merkle_rd(off_t offset, uint8_t *buf, size_t size, void *priv)
+{
+    uint8_t *data = (uint8_t *)priv + offset;
+    memcpy(buf, data, size);
+    return size;
+}
+#endif
+
+BPAK_EXPORT int
+bpak_pkg_builder_add_file_with_merkle_tree(struct bpak_pkg_builder *builder,
+                                           const char *filename,
+                                           const char *part_name,
+                                           uint8_t flags)
+{
+#if BPAK_CONFIG_MERKLE == 1
+    int rc;
+    struct bpak_merkle_context ctx;
+    struct builder_part part;
+    struct stat statbuf;
+    bpak_merkle_hash_t salt;
+    bpak_merkle_hash_t hash;
+    uint8_t *merkle_buf;
+    ssize_t merkle_sz;
+    uint32_t *salt_ptr = (uint32_t *)salt;
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_merkle_options merkle_options;
+
+    if (stat(filename, &statbuf) != 0) {
+        bpak_printf(0, "Error: Can't open file '%s'\n", filename);
+        return -BPAK_FILE_NOT_FOUND;
+    }
+
+    /* The block size is set by a 'merkle-block-size' meta that is added
+     * before the part */
+    bpak_merkle_options_from_meta(NULL, &merkle_options);
+
+    if (bpak_get_meta(&builder->pkg.header,
+                      BPAK_ID_MERKLE_BLOCK_SIZE,
+                      bpak_id(part_name),
+                      &meta) == BPAK_OK) {
+        bpak_merkle_options_from_meta(
+            bpak_get_meta_ptr(&builder->pkg.header, meta, uint8_t),
+            &merkle_options);
+    }
+
+    merkle_sz = bpak_merkle_compute_tree_size(statbuf.st_size,
+                                              &merkle_options);
+
+    if (merkle_sz < 0)
+        return merkle_sz;
+
+    merkle_buf = bpak_calloc(merkle_sz, 1);
+
+    if (merkle_buf == NULL)
+        return -BPAK_FAILED;
+
+    for (unsigned int i = 0; i < sizeof(salt) / sizeof(uint32_t); i++)
+        salt_ptr[i] = random() & 0xFFFFFFFF;
+
+    rc = bpak_merkle_init_opts(&ctx,
+                               statbuf.st_size,
+                               salt,
+                               sizeof(salt),
+                               merkle_wr,
+                               merkle_rd,
+                               0,
+                               false,
+                               &merkle_options,
+                               merkle_buf);
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    /* The tree is computed from the same reads as the part data, with the
+     * leaves hashed on all CPUs */
+    bpak_merkle_set_jobs(&ctx, 0);
+
+    rc = builder_add_file(builder,
+                          filename,
+                          part_name,
+                          flags,
+                          &ctx,
+                          ctx.jobs * BPAK_MERKLE_JOB_LEAVES *
+                              BPAK_MERKLE_BLOCK_SZ);
+
+    if (rc != BPAK_OK) {
+        bpak_merkle_finish(&ctx, hash);
+        goto err_free_out;
+    }
+
+    rc = bpak_merkle_finish(&ctx, hash);
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    rc = bpak_pkg_builder_add_meta(builder,
+                                   BPAK_ID_MERKLE_SALT,
+                                   bpak_id(part_name),
+                                   salt,
+                                   sizeof(salt));
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    rc = bpak_pkg_builder_add_meta(builder,
+                                   BPAK_ID_MERKLE_ROOT_HASH,
+                                   bpak_id(part_name),
+                                   hash,
+                                   sizeof(hash));
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    /* The merkle tree is a multiple of the block size, there is no
+     * padding */
+    rc = builder_begin_part(builder,
+                            bpak_part_name_to_hash_tree_id(part_name),
+                            merkle_sz,
+                            flags,
+                            &part);
+
+    if (rc == BPAK_OK)
+        rc = builder_write(builder, &part, merkle_buf, merkle_sz);
+
+    if (rc == BPAK_OK)
+        rc = builder_end_part(builder, &part);
+
+    builder_release_part(&part);
+err_free_out:
+    bpak_free(merkle_buf);
+    return rc;
+#else
+    (void)builder;
+    (void)filename;
+    (void)part_name;
+    (void)flags;
+    return -BPAK_NOT_SUPPORTED;
+#endif
+}
+
+BPAK_EXPORT int bpak_pkg_builder_finish(struct bpak_pkg_builder *builder,
+                                        const char *key_filename)
+{
+    int rc;
+    struct bpak_header *h = &builder->pkg.header;
+    size_t hash_size = sizeof(h->payload_hash);
+
+    if (!builder->payload_hash_valid)
+        return -BPAK_FAILED;
+
+    rc = bpak_hash_final(&builder->payload_hash,
+                         h->payload_hash,
+                         hash_size,
+                         &hash_size);
+
+    bpak_hash_free(&builder->payload_hash);
+    builder->payload_hash_valid = false;
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (key_filename != NULL) {
+        struct bpak_key *sign_key = NULL;
+        uint8_t hash_output[BPAK_HASH_MAX_LENGTH];
+        size_t signature_length = sizeof(h->signature);
+
+        hash_size = sizeof(hash_output);
+
+        rc = bpak_verify_compute_header_hash(h, hash_output, &hash_size);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        rc = bpak_crypto_load_private_key(key_filename, &sign_key);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        memset(h->signature, 0, sizeof(h->signature));
+
+        rc = bpak_crypto_sign(hash_output,
+                              hash_size,
+                              h->hash_kind,
+                              sign_key,
+                              h->signature,
+                              &signature_length);
+
+        bpak_free(sign_key);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        h->signature_sz = (uint16_t)signature_length;
+    }
+
+    rc = bpak_pkg_write_header(&builder->pkg);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (fflush(builder->pkg.fp) != 0)
+        return -BPAK_WRITE_ERROR;
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT void bpak_pkg_builder_free(struct bpak_pkg_builder *builder)
+{
+    if (builder->payload_hash_valid)
+        bpak_hash_free(&builder->payload_hash);
+
+    builder->payload_hash_valid = false;
+    bpak_pkg_close(&builder->pkg);
+}
@@ -20,19 +20,227 @@
 #include <bpak/merkle.h>
 #include <bpak/crc.h>
 #include <bpak/crypto.h>
+#include "pkg_hash.h"
+
+/* Zero extents kept in the bpak-sparse-map of a part, the map is header
+ * meta data */
+#define PKG_SPARSE_MAX_EXTENTS 64
+
+static int sparse_extent_compare(const void *a_p, const void *b_p)
+{
+    const struct bpak_sparse_extent *a = a_p;
+    const struct bpak_sparse_extent *b = b_p;
+
+    return (a->block < b->block) ? -1 : (a->block > b->block);
+}
+
+/* Add a run of zero blocks, when the map is full the smallest run is
+ * replaced */
+static void sparse_keep(struct bpak_sparse_extent *extents, size_t *count,
+                        uint32_t block, uint32_t length)
+{
+    size_t smallest = 0;
+
+    if (*count < PKG_SPARSE_MAX_EXTENTS) {
+        extents[*count].block = block;
+        extents[*count].count = length;
+        (*count)++;
+        return;
+    }
+
+    for (size_t i = 1; i < *count; i++) {
+        if (extents[i].count < extents[smallest].count)
+            smallest = i;
+    }
+
+    if (length > extents[smallest].count) {
+        extents[smallest].block = block;
+        extents[smallest].count = length;
+    }
+}
+
+/* Find the runs of all-zero blocks in 'filename'. The last block is always
+ * stored. Returns the number of zero bytes. */
+static ssize_t sparse_scan(const char *filename, uint64_t size,
+                           struct bpak_sparse_extent *extents, size_t *count)
+{
+    uint8_t block[BPAK_SPARSE_BLOCK_SZ];
+    uint64_t blocks = (size > 0) ? (size - 1) / BPAK_SPARSE_BLOCK_SZ : 0;
+    uint32_t run_block = 0;
+    uint32_t run_length = 0;
+    ssize_t zeros = 0;
+    FILE *fp;
+
+    *count = 0;
+
+    if (blocks > UINT32_MAX)
+        return -BPAK_NOT_SUPPORTED;
+
+    fp = fopen(filename, "rb");
+
+    if (fp == NULL) {
+        bpak_printf(0, "Could not open input file: %s\n", filename);
+        return -BPAK_FILE_NOT_FOUND;
+    }
+
+    for (uint64_t b = 0; b < blocks; b++) {
+        if (fread(block, 1, sizeof(block), fp) != sizeof(block)) {
+            fclose(fp);
+            return -BPAK_READ_ERROR;
+        }
+
+        if ((block[0] == 0) &&
+            (memcmp(block, &block[1], sizeof(block) - 1) == 0)) {
+            if (run_length == 0)
+                run_block = b;
+            run_length++;
+            continue;
+        }
+
+        if (run_length > 0)
+            sparse_keep(extents, count, run_block, run_length);
+        run_length = 0;
+    }
+
+    if (run_length > 0)
+        sparse_keep(extents, count, run_block, run_length);
+
+    fclose(fp);
+
+    qsort(extents, *count, sizeof(*extents), sparse_extent_compare);
+
+    for (size_t i = 0; i < *count; i++)
+        zeros += (ssize_t)extents[i].count * BPAK_SPARSE_BLOCK_SZ;
+
+    bpak_printf(1,
+                "Sparse: %zu zero extents, %zd bytes are not stored\n",
+                *count,
+                zeros);
+    return zeros;
+}
+
+/* Write input data at 'position' of the expanded part to the part data at
+ * 'offset' in the package, the zero extents are left out */
+static int sparse_write(struct bpak_package *pkg, off_t offset,
+                        const struct bpak_sparse_extent *extents, size_t count,
+                        uint64_t position, const uint8_t *buffer,
+                        size_t length)
+{
+    int rc;
+    uint64_t zeros = 0;
+
+    for (size_t i = 0; (i <= count) && (length > 0); i++) {
+        uint64_t start = UINT64_MAX;
+        uint64_t end = UINT64_MAX;
+        size_t n;
+
+        if (i < count) {
+            start = (uint64_t)extents[i].block * BPAK_SPARSE_BLOCK_SZ;
+            end = start + (uint64_t)extents[i].count * BPAK_SPARSE_BLOCK_SZ;
+        }
+
+        if (position < start) {
+            n = BPAK_MIN(length, start - position);
+            rc = bpak_pkg_write_at(pkg, offset + position - zeros, buffer, n);
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            buffer += n;
+            position += n;
+            length -= n;
+        }
+
+        if ((length > 0) && (position < end)) {
+            n = BPAK_MIN(length, end - position);
+            buffer += n;
+            position += n;
+            length -= n;
+        }
+
+        zeros += end - start;
+    }
+
+    return BPAK_OK;
+}
+
+static int sparse_add_map(struct bpak_package *pkg, bpak_id_t part_id,
+                          const struct bpak_sparse_extent *extents,
+                          size_t count)
+{
+    int rc;
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_header *h = NULL;
+
+    if (count == 0)
+        return BPAK_OK;
+
+    rc = bpak_pkg_add_meta(pkg,
+                           BPAK_ID_SPARSE_MAP,
+                           part_id,
+                           count * sizeof(*extents),
+                           &meta,
+                           &h);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    memcpy(bpak_get_meta_ptr(h, meta, uint8_t),
+           extents,
+           count * sizeof(*extents));
+    return BPAK_OK;
+}
+
+/* Set the size of a new part, zero blocks are found for sparse parts */
+static int sparse_part_init(struct bpak_part_header *p, const char *filename,
+                            uint64_t size, struct bpak_sparse_extent *extents,
+                            size_t *count)
+{
+    ssize_t zeros = 0;
+
+    *count = 0;
+
+    if (p->flags & BPAK_FLAG_SPARSE) {
+        zeros = sparse_scan(filename, size, extents, count);
+
+        if (zeros < 0)
+            return zeros;
+
+        /* A part without zero blocks is stored as it is */
+        if (*count == 0)
+            p->flags &= ~BPAK_FLAG_SPARSE;
+    }
+
+    p->size = size - zeros;
+
+    if (p->size % BPAK_PART_ALIGN)
+        p->pad_bytes = BPAK_PART_ALIGN - (p->size % BPAK_PART_ALIGN);
+    else
+        p->pad_bytes = 0;
+
+    return BPAK_OK;
+}
 
 #if BPAK_CONFIG_MERKLE == 1
+/* The hash tree is built in place in the package file, 'priv' is the
+ * package */
 static ssize_t merkle_wr(off_t offset, uint8_t *buf, size_t size, void *priv)
 {
-    uint8_t *data = (uint8_t *)priv;
-    memcpy(&data[offset], buf, size);
+    int rc = bpak_pkg_write_at((struct bpak_package *)priv, offset, buf, size);
+
+    if (rc != BPAK_OK)
+        return rc;
+
     return size;
 }
 
 static ssize_t merkle_rd(off_t offset, uint8_t *buf, size_t size, void *priv)
 {
-    uint8_t *data = (uint8_t *)priv + offset;
-    memcpy(buf, data, size);
+    int rc = bpak_pkg_read_at((struct bpak_package *)priv, offset, buf, size);
+
+    if (rc != BPAK_OK)
+        return rc;
+
     return size;
 }
 
@@ -42,156 +250,242 @@ BPAK_EXPORT int bpak_pkg_add_file_with_merkle_tree(struct bpak_package *pkg,
                                                    uint8_t flags)
 {
     int rc;
-    struct bpak_header *h = bpak_pkg_header(pkg);
+    struct bpak_header *h = NULL;
     struct bpak_merkle_context ctx;
+    struct bpak_part_header *p = NULL;
+    struct bpak_part_header *tree_part = NULL;
     struct stat statbuf;
-    uint8_t block_buf[BPAK_CHUNK_BUFFER_LENGTH];
-    size_t chunk_sz;
-    uint64_t new_offset = sizeof(*h);
+    uint8_t *block_buf = NULL;
+    size_t block_buf_sz;
+    uint64_t bytes_to_copy;
+    uint64_t position = 0;
+    uint64_t new_offset;
+    uint64_t tree_offset;
+    bpak_merkle_hash_t hash;
+    struct bpak_meta_header *meta = NULL;
+    uint8_t *m = NULL;
+    FILE *fp = NULL;
+    bpak_id_t hash_tree_id = bpak_part_name_to_hash_tree_id(part_name);
+    struct bpak_sparse_extent extents[PKG_SPARSE_MAX_EXTENTS];
+    size_t extent_count = 0;
+    struct bpak_merkle_options merkle_options;
 
     if (stat(filename, &statbuf) != 0) {
         bpak_printf(0, "Error: Can't open file '%s'\n", filename);
         return -BPAK_FILE_NOT_FOUND;
     }
 
-    rc = bpak_pkg_add_file(pkg, filename, part_name, flags);
-
-    if (rc != 0)
-        return rc;
+    /* The block size is set by a 'merkle-block-size' meta that is added
+     * before the part */
+    bpak_merkle_options_from_meta(NULL, &merkle_options);
+
+    if (bpak_pkg_get_meta(pkg,
+                          BPAK_ID_MERKLE_BLOCK_SIZE,
+                          bpak_id(part_name),
+                          &meta,
+                          &h) == BPAK_OK) {
+        bpak_merkle_options_from_meta(bpak_get_meta_ptr(h, meta, uint8_t),
+                                      &merkle_options);
+    }
 
-    ssize_t merkle_sz = bpak_merkle_compute_size(statbuf.st_size);
+    ssize_t merkle_sz = bpak_merkle_compute_tree_size(statbuf.st_size,
+                                                      &merkle_options);
 
     if (merkle_sz < 0)
         return merkle_sz;
 
-    char *merkle_buf = bpak_calloc(merkle_sz, 1);
+    bpak_printf(1, "Adding %s <%s>\n", part_name, filename);
+
+    /* Both parts are added first. Adding a part can add a continuation
+     * table, which moves the payload and the tables. */
+    rc = bpak_pkg_add_part(pkg, bpak_id(part_name), &p);
+
+    if (rc == BPAK_OK)
+        rc = bpak_pkg_add_part(pkg, hash_tree_id, &tree_part);
 
-    memset(merkle_buf, 0, merkle_sz);
+    if (rc == BPAK_OK)
+        rc = bpak_pkg_get_part(pkg, bpak_id(part_name), &p);
 
-    bpak_printf(1, "Allocated %li bytes for merkle tree\n", merkle_sz);
+    if (rc != BPAK_OK) {
+        bpak_printf(0, "Error: Could not add part\n");
+        return rc;
+    }
+
+    new_offset = bpak_pkg_part_offset(pkg, p);
+    p->offset = new_offset;
+    p->flags = flags;
+
+    rc = sparse_part_init(p, filename, statbuf.st_size, extents, &extent_count);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    /* The tree follows the data part, it is built over the expanded data */
+    tree_offset = new_offset + p->size + p->pad_bytes;
+    tree_part->offset = tree_offset;
+    tree_part->flags = flags & ~BPAK_FLAG_SPARSE;
+    tree_part->size = merkle_sz;
+    tree_part->pad_bytes =
+        0; /* Merkle tree is multiples of the block size, no padding needed */
 
     bpak_merkle_hash_t salt;
     memset(salt, 0, 32);
 
-    uint32_t *salt_ptr = (uint32_t *)salt;
-
-    for (unsigned int i = 0; i < sizeof(salt) / sizeof(uint32_t); i++) {
-        (*salt_ptr) = random() & 0xFFFFFFFF;
-        salt_ptr++;
+    /* A salt that is already in the header is kept. With the salt of the
+     * previous version, a transport decode can reuse the leaf hashes of
+     * unchanged blocks from the origin tree. */
+    bool keep_salt = (bpak_pkg_get_meta(pkg,
+                                        BPAK_ID_MERKLE_SALT,
+                                        bpak_id(part_name),
+                                        &meta,
+                                        &h) == BPAK_OK) &&
+                     (meta->size == sizeof(salt));
+
+    if (keep_salt) {
+        memcpy(salt, bpak_get_meta_ptr(h, meta, uint8_t), sizeof(salt));
+    } else {
+        uint32_t *salt_ptr = (uint32_t *)salt;
+
+        for (unsigned int i = 0; i < sizeof(salt) / sizeof(uint32_t); i++) {
+            (*salt_ptr) = random() & 0xFFFFFFFF;
+            salt_ptr++;
+        }
     }
 
-    rc = bpak_merkle_init(&ctx,
-                          statbuf.st_size,
-                          salt,
-                          32,
-                          merkle_wr,
-                          merkle_rd,
-                          0,
-                          true,
-                          merkle_buf);
+    rc = bpak_merkle_init_opts(&ctx,
+                               statbuf.st_size,
+                               salt,
+                               32,
+                               merkle_wr,
+                               merkle_rd,
+                               tree_offset,
+                               true,
+                               &merkle_options,
+                               pkg);
+
+    if (rc != BPAK_OK)
+        return rc;
 
-    FILE *fp = fopen(filename, "rb");
+    /* Leaves are hashed on all CPUs, read enough for every thread */
+    bpak_merkle_set_jobs(&ctx, 0);
+    block_buf_sz = ctx.jobs * BPAK_MERKLE_JOB_LEAVES * BPAK_MERKLE_BLOCK_SZ;
+    block_buf = bpak_calloc(block_buf_sz, 1);
+
+    if (block_buf == NULL) {
+        rc = -BPAK_FAILED;
+        goto err_finish_out;
+    }
+
+    fp = fopen(filename, "rb");
 
     if (fp == NULL) {
+        bpak_printf(0, "Could not open input file: %s\n", filename);
         rc = -BPAK_FILE_NOT_FOUND;
-        goto err_free_buf_out;
+        goto err_finish_out;
     }
 
-    rc = BPAK_OK;
-    while (true) {
-        chunk_sz = fread(block_buf, 1, sizeof(block_buf), fp);
-
-        if (chunk_sz == 0)
-            break;
+    /* One pass over the input, the data goes to the package and the
+     * merkle context */
+    bytes_to_copy = statbuf.st_size;
 
-        rc = bpak_merkle_write_chunk(&ctx, block_buf, chunk_sz);
+    while (bytes_to_copy > 0) {
+        size_t chunk_sz = BPAK_MIN(bytes_to_copy, (uint64_t)block_buf_sz);
 
-        if (rc != BPAK_OK)
-            goto err_close_fp_out;
-    }
+        if (fread(block_buf, 1, chunk_sz, fp) != chunk_sz) {
+            rc = -BPAK_READ_ERROR;
+            goto err_finish_out;
+        }
 
-    bpak_merkle_hash_t hash;
+        rc = sparse_write(pkg,
+                          p->offset,
+                          extents,
+                          extent_count,
+                          position,
+                          block_buf,
+                          chunk_sz);
 
-    rc = bpak_merkle_finish(&ctx, hash);
+        if (rc != BPAK_OK)
+            goto err_finish_out;
 
-    if (rc != BPAK_OK)
-        goto err_close_fp_out;
+        rc = bpak_merkle_write_chunk(&ctx, block_buf, chunk_sz);
 
-    /* Write tree to bpak file */
+        if (rc != BPAK_OK)
+            goto err_finish_out;
 
-    bpak_foreach_part (h, p) {
-        new_offset += (p->size + p->pad_bytes);
+        position += chunk_sz;
+        bytes_to_copy -= chunk_sz;
     }
 
-    /* Add salt */
-    struct bpak_meta_header *meta = NULL;
-    uint8_t *m = NULL;
-
-    rc = bpak_add_meta(h,
-                       BPAK_ID_MERKLE_SALT,
-                       bpak_id(part_name),
-                       sizeof(bpak_merkle_hash_t),
-                       &meta);
+    new_offset += p->size;
 
-    if (rc != BPAK_OK)
-        goto err_close_fp_out;
+    if (p->pad_bytes) {
+        bpak_printf(2, "Adding %i z-pad\n", p->pad_bytes);
+        memset(block_buf, 0, p->pad_bytes);
+        rc = bpak_pkg_write_at(pkg, new_offset, block_buf, p->pad_bytes);
 
-    m = bpak_get_meta_ptr(h, meta, uint8_t);
-    memcpy(m, salt, sizeof(bpak_merkle_hash_t));
+        if (rc != BPAK_OK)
+            goto err_finish_out;
+    }
 
-    rc = bpak_add_meta(h,
-                       BPAK_ID_MERKLE_ROOT_HASH,
-                       bpak_id(part_name),
-                       sizeof(bpak_merkle_hash_t),
-                       &meta);
+    rc = bpak_merkle_finish(&ctx, hash);
 
     if (rc != BPAK_OK)
-        goto err_close_fp_out;
+        goto err_free_buf_out;
 
-    m = bpak_get_meta_ptr(h, meta, uint8_t);
-    memcpy(m, hash, sizeof(bpak_merkle_hash_t));
+    rc = sparse_add_map(pkg, bpak_id(part_name), extents, extent_count);
 
-    struct bpak_part_header *p = NULL;
+    if (rc != BPAK_OK)
+        goto err_free_buf_out;
 
-    bpak_id_t hash_tree_id = bpak_part_name_to_hash_tree_id(part_name);
+    /* Add salt */
+    if (!keep_salt) {
+        rc = bpak_pkg_add_meta(pkg,
+                               BPAK_ID_MERKLE_SALT,
+                               bpak_id(part_name),
+                               sizeof(bpak_merkle_hash_t),
+                               &meta,
+                               &h);
 
-    rc = bpak_add_part(h, hash_tree_id, &p);
+        if (rc != BPAK_OK)
+            goto err_free_buf_out;
 
-    if (rc != BPAK_OK) {
-        bpak_printf(0, "Error: Could not add part\n");
-        goto err_close_fp_out;
+        m = bpak_get_meta_ptr(h, meta, uint8_t);
+        memcpy(m, salt, sizeof(bpak_merkle_hash_t));
     }
 
-    p->offset = new_offset;
-    p->flags = flags;
-    p->size = merkle_sz;
-    p->pad_bytes =
-        0; /* Merkle tree is multiples of 4kByte, no padding needed */
+    rc = bpak_pkg_add_meta(pkg,
+                           BPAK_ID_MERKLE_ROOT_HASH,
+                           bpak_id(part_name),
+                           sizeof(bpak_merkle_hash_t),
+                           &meta,
+                           &h);
 
-    rc = fseek(pkg->fp, new_offset, SEEK_SET);
+    if (rc != BPAK_OK)
+        goto err_free_buf_out;
 
-    if (rc != BPAK_OK) {
-        bpak_printf(0, "Could not seek to new pos\n");
-        goto err_close_fp_out;
-    }
+    m = bpak_get_meta_ptr(h, meta, uint8_t);
+    memcpy(m, hash, sizeof(bpak_merkle_hash_t));
 
-    if (fwrite(merkle_buf, 1, merkle_sz, pkg->fp) != (size_t)merkle_sz) {
-        rc = -BPAK_WRITE_ERROR;
-        goto err_close_fp_out;
-    }
+    rc = bpak_pkg_edited(pkg, bpak_id(part_name));
 
-    rc = bpak_pkg_update_hash(pkg, NULL, NULL);
+    if (rc == BPAK_OK)
+        rc = bpak_pkg_edited(pkg, hash_tree_id);
 
     if (rc != BPAK_OK) {
         bpak_printf(0, "Error: Could not update payload hash\n");
-        goto err_close_fp_out;
+        goto err_free_buf_out;
     }
 
     rc = bpak_pkg_write_header(pkg);
-err_close_fp_out:
-    fclose(fp);
+    goto err_free_buf_out;
+
+err_finish_out:
+    /* Releases the worker threads, the result is not used */
+    bpak_merkle_finish(&ctx, hash);
 err_free_buf_out:
-    bpak_free(merkle_buf);
+    if (fp != NULL)
+        fclose(fp);
+    bpak_free(block_buf);
     return rc;
 }
 
@@ -202,11 +496,13 @@ BPAK_EXPORT int bpak_pkg_add_file(struct bpak_package *pkg,
                                   uint8_t flags)
 {
     int rc;
-    struct bpak_header *h = bpak_pkg_header(pkg);
     struct bpak_part_header *p = NULL;
     struct stat statbuf;
-    uint64_t new_offset = sizeof(struct bpak_header);
+    uint64_t new_offset;
+    uint64_t position = 0;
     char chunk_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    struct bpak_sparse_extent extents[PKG_SPARSE_MAX_EXTENTS];
+    size_t extent_count = 0;
 
     if (stat(filename, &statbuf) != 0) {
         bpak_printf(0, "Error: can't open file '%s'\n", filename);
@@ -217,35 +513,24 @@ BPAK_EXPORT int bpak_pkg_add_file(struct bpak_package *pkg,
 
     bpak_printf(1, "Adding %s <%s>\n", part_name, filename);
 
-    bpak_foreach_part (h, p) {
-        new_offset += (p->size + p->pad_bytes);
-    }
-
-    rc = bpak_add_part(h, bpak_id(part_name), &p);
+    rc = bpak_pkg_add_part(pkg, bpak_id(part_name), &p);
 
     if (rc != BPAK_OK) {
         bpak_printf(0, "Error: Could not add part\n");
         return rc;
     }
 
-    p->id = bpak_id(part_name);
+    /* The new part is last in the payload */
+    new_offset = bpak_pkg_part_offset(pkg, p);
     p->offset = new_offset;
     p->flags = flags;
-    p->size = statbuf.st_size;
-
-    if (statbuf.st_size % BPAK_PART_ALIGN)
-        p->pad_bytes = BPAK_PART_ALIGN - (statbuf.st_size % BPAK_PART_ALIGN);
-    else
-        p->pad_bytes = 0;
 
-    rc = fseek(pkg->fp, new_offset, SEEK_SET);
+    rc = sparse_part_init(p, filename, statbuf.st_size, extents, &extent_count);
 
-    if (rc != 0) {
-        bpak_printf(0, "Error: Could not seek to new pos\n");
-        return -BPAK_SEEK_ERROR;
-    }
+    if (rc != BPAK_OK)
+        return rc;
 
-    uint64_t bytes_to_write = p->size;
+    uint64_t bytes_to_write = statbuf.st_size;
 
     in_fp = fopen(filename, "r");
 
@@ -256,10 +541,24 @@ BPAK_EXPORT int bpak_pkg_add_file(struct bpak_package *pkg,
 
     while (bytes_to_write) {
         size_t read_bytes = fread(chunk_buffer, 1, sizeof(chunk_buffer), in_fp);
-        if (fwrite(chunk_buffer, 1, read_bytes, pkg->fp) != read_bytes) {
-            rc = -BPAK_WRITE_ERROR;
+
+        if (read_bytes == 0) {
+            rc = -BPAK_READ_ERROR;
             break;
         }
+
+        rc = sparse_write(pkg,
+                          new_offset,
+                          extents,
+                          extent_count,
+                          position,
+                          (uint8_t *)chunk_buffer,
+                          read_bytes);
+
+        if (rc != BPAK_OK)
+            break;
+
+        position += read_bytes;
         bytes_to_write -= read_bytes;
     }
 
@@ -267,16 +566,24 @@ BPAK_EXPORT int bpak_pkg_add_file(struct bpak_package *pkg,
         goto err_close_fp;
     }
 
+    new_offset += p->size;
+
     if (p->pad_bytes) {
         bpak_printf(2, "Adding %i z-pad\n", p->pad_bytes);
         memset(chunk_buffer, 0, sizeof(chunk_buffer));
-        if (fwrite(chunk_buffer, 1, p->pad_bytes, pkg->fp) != p->pad_bytes) {
-            rc = -BPAK_WRITE_ERROR;
+        rc = bpak_pkg_write_at(pkg, new_offset, (uint8_t *)chunk_buffer,
+                               p->pad_bytes);
+
+        if (rc != BPAK_OK)
             goto err_close_fp;
-        }
     }
 
-    rc = bpak_pkg_update_hash(pkg, NULL, NULL);
+    rc = sparse_add_map(pkg, bpak_id(part_name), extents, extent_count);
+
+    if (rc != BPAK_OK)
+        goto err_close_fp;
+
+    rc = bpak_pkg_edited(pkg, bpak_id(part_name));
 
     if (rc != BPAK_OK) {
         bpak_printf(0, "Error: Could not update payload hash\n");
@@ -295,28 +602,22 @@ BPAK_EXPORT int bpak_pkg_add_key(struct bpak_package *pkg, const char *filename,
 {
     int rc;
     struct bpak_key *key = NULL;
-    struct bpak_header *h = bpak_pkg_header(pkg);
     struct bpak_part_header *p = NULL;
-    uint64_t new_offset = sizeof(struct bpak_header);
+    uint64_t new_offset;
 
     rc = bpak_crypto_load_public_key(filename, &key);
 
     if (rc != BPAK_OK)
         return rc;
 
-    /* Write header */
-    bpak_foreach_part (h, p) {
-        new_offset += (p->size + p->pad_bytes);
-    }
-
-    rc = bpak_add_part(h, bpak_id(part_name), &p);
+    rc = bpak_pkg_add_part(pkg, bpak_id(part_name), &p);
 
     if (rc != BPAK_OK) {
         bpak_printf(0, "Error: Could not add part\n");
         goto err_free_key_out;
     }
 
-    p->id = bpak_id(part_name);
+    new_offset = bpak_pkg_part_offset(pkg, p);
     p->offset = new_offset;
     p->flags = flags;
     p->size = key->size;
@@ -326,28 +627,22 @@ BPAK_EXPORT int bpak_pkg_add_key(struct bpak_package *pkg, const char *filename,
     else
         p->pad_bytes = 0;
 
-    rc = fseek(pkg->fp, new_offset, SEEK_SET);
-
-    if (rc != 0) {
-        bpak_printf(0, "Could not seek to new pos\n");
-        rc = -BPAK_SEEK_ERROR;
-        goto err_free_key_out;
-    }
-
     /* Write key data */
-    if (fwrite(key->data, 1, key->size, pkg->fp) != key->size) {
-        rc = -BPAK_WRITE_ERROR;
+    rc = bpak_pkg_write_at(pkg, new_offset, key->data, key->size);
+
+    if (rc != BPAK_OK)
         goto err_free_key_out;
-    }
 
     /* Write zero padding */
-    uint8_t zero = 0;
-    if (fwrite(&zero, 1, p->pad_bytes, pkg->fp) != p->pad_bytes) {
-        rc = -BPAK_WRITE_ERROR;
+    uint8_t zero[BPAK_PART_ALIGN];
+
+    memset(zero, 0, sizeof(zero));
+    rc = bpak_pkg_write_at(pkg, new_offset + key->size, zero, p->pad_bytes);
+
+    if (rc != BPAK_OK)
         goto err_free_key_out;
-    }
 
-    rc = bpak_pkg_update_hash(pkg, NULL, NULL);
+    rc = bpak_pkg_edited(pkg, bpak_id(part_name));
 
     if (rc != BPAK_OK) {
         bpak_printf(0, "Error: Could not update payload hash\n");
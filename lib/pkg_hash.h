@@ -0,0 +1,14 @@
+#ifndef BPAK_PKG_HASH_H
+#define BPAK_PKG_HASH_H
+
+#include <bpak/bpak.h>
+#include <bpak/pkg.h>
+
+/* Called by the functions that modify a package after the header has been
+ * changed and before it is written. 'part_id' is a part with new data, or
+ * zero when no part data changed. Outside of a bpak_pkg_defer_hash session
+ * the payload hash, and the part digests when 'part_id' is set, are
+ * updated at once. In a session the part is only recorded for
+ * bpak_pkg_commit. */
+int bpak_pkg_edited(struct bpak_package *pkg, bpak_id_t part_id);
+#endif
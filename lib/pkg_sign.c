@@ -12,52 +12,168 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <pthread.h>
 #include <bpak/bpak.h>
 #include <bpak/pkg.h>
 #include <bpak/crypto.h>
 #include <bpak/keystore.h>
 
-BPAK_EXPORT int bpak_pkg_sign(struct bpak_package *pkg,
-                              const char *key_filename)
+/* Sign with 'key', or with 'prepared' when it is not NULL */
+static int pkg_sign(struct bpak_package *pkg, struct bpak_key *key,
+                    struct bpak_prepared_key *prepared)
 {
     int rc;
-    struct bpak_key *sign_key = NULL;
     uint8_t hash_output[BPAK_HASH_MAX_LENGTH];
     size_t hash_size = sizeof(hash_output);
+    size_t signature_length = sizeof(pkg->header.signature);
 
     rc = bpak_pkg_update_hash(pkg, (char *)hash_output, &hash_size);
 
     if (rc != BPAK_OK)
         return rc;
 
-    rc = bpak_crypto_load_private_key(key_filename, &sign_key);
-
-    if (rc != BPAK_OK) {
-        return rc;
-    }
-
     memset(pkg->header.signature, 0, sizeof(pkg->header.signature));
 
-    size_t signature_length = sizeof(pkg->header.signature);
-
-    rc = bpak_crypto_sign(hash_output,
-                          hash_size,
-                          pkg->header.hash_kind,
-                          sign_key,
-                          pkg->header.signature,
-                          &signature_length);
+    if (prepared != NULL) {
+        rc = bpak_crypto_sign_prepared(hash_output,
+                                       hash_size,
+                                       pkg->header.hash_kind,
+                                       prepared,
+                                       pkg->header.signature,
+                                       &signature_length);
+    } else {
+        rc = bpak_crypto_sign(hash_output,
+                              hash_size,
+                              pkg->header.hash_kind,
+                              key,
+                              pkg->header.signature,
+                              &signature_length);
+    }
 
     if (rc != BPAK_OK)
-        goto err_free_key_out;
+        return rc;
 
     pkg->header.signature_sz = (uint16_t)signature_length;
 
-    rc = bpak_pkg_write_header(pkg);
+    return bpak_pkg_write_header(pkg);
+}
+
+BPAK_EXPORT int bpak_pkg_sign(struct bpak_package *pkg,
+                              const char *key_filename)
+{
+    int rc;
+    struct bpak_key *sign_key = NULL;
+
+    rc = bpak_crypto_load_private_key(key_filename, &sign_key);
 
     if (rc != BPAK_OK)
-        goto err_free_key_out;
+        return rc;
+
+    rc = pkg_sign(pkg, sign_key, NULL);
 
-err_free_key_out:
     bpak_free(sign_key);
     return rc;
 }
+
+BPAK_EXPORT int bpak_pkg_sign_prepared(struct bpak_package *pkg,
+                                       struct bpak_prepared_key *key)
+{
+    return pkg_sign(pkg, NULL, key);
+}
+
+struct sign_batch {
+    struct bpak_sign_batch_item *items;
+    size_t count;
+    size_t next;
+    struct bpak_key *key;
+    pthread_mutex_t lock;
+};
+
+static void *sign_batch_worker(void *arg)
+{
+    struct sign_batch *batch = (struct sign_batch *)arg;
+    struct bpak_prepared_key prepared;
+    int prepare_rc;
+
+    /* The random generator of a prepared key is not shared between the
+     * workers, every worker prepares its own copy of the key once */
+    prepare_rc = bpak_crypto_prepare_sign_key(&prepared, batch->key);
+
+    pthread_mutex_lock(&batch->lock);
+
+    while (batch->next < batch->count) {
+        struct bpak_sign_batch_item *item = &batch->items[batch->next++];
+
+        pthread_mutex_unlock(&batch->lock);
+
+        if (prepare_rc != BPAK_OK)
+            item->rc = prepare_rc;
+        else
+            item->rc = pkg_sign(item->pkg, NULL, &prepared);
+
+        pthread_mutex_lock(&batch->lock);
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+
+    if (prepare_rc == BPAK_OK)
+        bpak_crypto_free_prepared_key(&prepared);
+
+    return NULL;
+}
+
+BPAK_EXPORT int bpak_pkg_sign_batch(struct bpak_sign_batch_item *items,
+                                    size_t count, struct bpak_key *key,
+                                    unsigned int jobs)
+{
+    struct sign_batch batch;
+    pthread_t *threads;
+    unsigned int thread_count = 0;
+
+    if (count == 0)
+        return BPAK_OK;
+
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = (cpus > 0) ? cpus : 1;
+    }
+
+    jobs = BPAK_MIN(jobs, count);
+
+    memset(&batch, 0, sizeof(batch));
+    batch.items = items;
+    batch.count = count;
+    batch.key = key;
+
+    for (size_t i = 0; i < count; i++)
+        items[i].rc = -BPAK_FAILED;
+
+    threads = (jobs > 1) ? bpak_calloc(jobs, sizeof(*threads)) : NULL;
+
+    pthread_mutex_init(&batch.lock, NULL);
+
+    for (; (threads != NULL) && (thread_count < jobs); thread_count++) {
+        if (pthread_create(&threads[thread_count],
+                           NULL,
+                           sign_batch_worker,
+                           &batch) != 0)
+            break;
+    }
+
+    /* Sign in this thread with one job or if no worker could be started */
+    if (thread_count == 0)
+        sign_batch_worker(&batch);
+
+    for (unsigned int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&batch.lock);
+    bpak_free(threads);
+
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].rc != BPAK_OK)
+            return items[i].rc;
+    }
+
+    return BPAK_OK;
+}
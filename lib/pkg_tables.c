@@ -0,0 +1,188 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/pkg.h>
+
+BPAK_EXPORT unsigned int bpak_pkg_table_count(struct bpak_package *pkg)
+{
+    return bpak_header_size(&pkg->header) / sizeof(struct bpak_header) - 1;
+}
+
+BPAK_EXPORT int bpak_pkg_get_part(struct bpak_package *pkg, bpak_id_t id,
+                                  struct bpak_part_header **part)
+{
+    return bpak_tables_get_part(&pkg->header,
+                                pkg->tables,
+                                bpak_pkg_table_count(pkg),
+                                id,
+                                part);
+}
+
+BPAK_EXPORT int bpak_pkg_get_meta(struct bpak_package *pkg, bpak_id_t id,
+                                  bpak_id_t part_id_ref,
+                                  struct bpak_meta_header **meta,
+                                  struct bpak_header **table)
+{
+    return bpak_tables_get_meta(&pkg->header,
+                                pkg->tables,
+                                bpak_pkg_table_count(pkg),
+                                id,
+                                part_id_ref,
+                                meta,
+                                table);
+}
+
+BPAK_EXPORT off_t bpak_pkg_part_offset(struct bpak_package *pkg,
+                                       struct bpak_part_header *part)
+{
+    unsigned int count = bpak_pkg_table_count(pkg);
+
+    if (count == 0)
+        return bpak_part_offset(&pkg->header, part);
+
+    return bpak_tables_part_offset(&pkg->header, pkg->tables, count, part);
+}
+
+/* Append an empty table. The payload is moved up by one table, starting
+ * from the end, and the header and tables are written back. */
+static int pkg_tables_grow(struct bpak_package *pkg)
+{
+    int rc;
+    unsigned int count = bpak_pkg_table_count(pkg);
+    uint64_t start = bpak_header_size(&pkg->header);
+    uint64_t end = start;
+    struct bpak_header *tables;
+    uint8_t chunk[BPAK_CHUNK_BUFFER_LENGTH];
+
+    if (count >= BPAK_MAX_TABLES)
+        return -BPAK_NO_SPACE_LEFT;
+
+    bpak_foreach_table (&pkg->header, pkg->tables, count, t) {
+        bpak_foreach_part (t, p) {
+            if (p->id)
+                end += bpak_part_size(p);
+        }
+    }
+
+    bpak_printf(1, "Adding continuation table %u\n", count);
+
+    while (end > start) {
+        size_t length = BPAK_MIN(end - start, sizeof(chunk));
+
+        end -= length;
+        rc = bpak_pkg_read_at(pkg, end, chunk, length);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        rc = bpak_pkg_write_at(pkg,
+                               end + sizeof(struct bpak_header),
+                               chunk,
+                               length);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    tables = bpak_calloc(count + 1, sizeof(*tables));
+
+    if (tables == NULL)
+        return -BPAK_FAILED;
+
+    if (count > 0)
+        memcpy(tables, pkg->tables, count * sizeof(*tables));
+
+    bpak_init_table(&tables[count]);
+    bpak_free(pkg->tables);
+    pkg->tables = tables;
+    pkg->header.magic = BPAK_HEADER_MAGIC_EXT;
+    pkg->header.table_count = count + 1;
+
+    bpak_foreach_table (&pkg->header, pkg->tables, count + 1, t) {
+        bpak_foreach_part (t, p) {
+            if (p->id)
+                p->offset += sizeof(struct bpak_header);
+        }
+    }
+
+    return bpak_pkg_write_header(pkg);
+}
+
+BPAK_EXPORT int bpak_pkg_add_part(struct bpak_package *pkg, bpak_id_t id,
+                                  struct bpak_part_header **part)
+{
+    int rc;
+    unsigned int count = bpak_pkg_table_count(pkg);
+    struct bpak_header *last = &pkg->header;
+    struct bpak_part_header *existing = NULL;
+
+    if (bpak_pkg_get_part(pkg, id, &existing) == BPAK_OK)
+        return -BPAK_EXISTS;
+
+    /* The data of a new part goes to the end of the payload, so the part
+     * is added after the last table that has parts */
+    bpak_foreach_table (&pkg->header, pkg->tables, count, t) {
+        if (t->parts[0].id)
+            last = t;
+    }
+
+    for (struct bpak_header *t = last; t != NULL;
+         t = bpak_next_table(&pkg->header, pkg->tables, count, t)) {
+        rc = bpak_add_part(t, id, part);
+
+        if (rc != -BPAK_NO_SPACE_LEFT)
+            return rc;
+    }
+
+    rc = pkg_tables_grow(pkg);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    return bpak_add_part(&pkg->tables[count], id, part);
+}
+
+BPAK_EXPORT int bpak_pkg_add_meta(struct bpak_package *pkg, bpak_id_t id,
+                                  bpak_id_t part_ref_id, uint16_t size,
+                                  struct bpak_meta_header **meta,
+                                  struct bpak_header **table)
+{
+    int rc;
+    unsigned int count = bpak_pkg_table_count(pkg);
+
+    if (bpak_pkg_get_meta(pkg, id, part_ref_id, meta, NULL) == BPAK_OK)
+        return -BPAK_EXISTS;
+
+    bpak_foreach_table (&pkg->header, pkg->tables, count, t) {
+        rc = bpak_add_meta(t, id, part_ref_id, size, meta);
+
+        if (rc == BPAK_OK) {
+            if (table != NULL)
+                (*table) = t;
+            return BPAK_OK;
+        }
+
+        if (rc != -BPAK_NO_SPACE_LEFT)
+            return rc;
+    }
+
+    rc = pkg_tables_grow(pkg);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_add_meta(&pkg->tables[count], id, part_ref_id, size, meta);
+
+    if ((rc == BPAK_OK) && (table != NULL))
+        (*table) = &pkg->tables[count];
+
+    return rc;
+}
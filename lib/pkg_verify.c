@@ -12,29 +12,74 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <bpak/bpak.h>
 #include <bpak/pkg.h>
 #include <bpak/verify.h>
 #include <bpak/keystore.h>
+#include "hash_pipeline.h"
 
+/* Read through the I/O backend of the package */
 static ssize_t verify_payload_read(off_t offset, uint8_t *buf, size_t size,
                                    void *user)
 {
-    FILE *fp = (FILE *)user;
+    int rc = bpak_pkg_read_at((struct bpak_package *)user, offset, buf, size);
 
-    if (fseek(fp, offset, SEEK_SET) != 0)
-        return -BPAK_SEEK_ERROR;
+    if (rc != BPAK_OK)
+        return rc;
+
+    return size;
+}
+
+/* Positional read that leaves the stream position alone, it is safe to
+ * call from several threads */
+static ssize_t verify_payload_pread(off_t offset, uint8_t *buf, size_t size,
+                                    void *user)
+{
+    int fd = fileno((FILE *)user);
+    size_t bytes_read = 0;
+
+    while (bytes_read < size) {
+        ssize_t n = pread(fd, &buf[bytes_read], size - bytes_read,
+                          offset + bytes_read);
 
-    size_t read_bytes = fread(buf, 1, size, fp);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)
+            return -BPAK_READ_ERROR;
 
-    if (read_bytes != size)
+        bytes_read += n;
+    }
+
+    return bytes_read;
+}
+
+/* Read from a package mapped by bpak_pkg_open_mmap, it is safe to call
+ * from several threads */
+static ssize_t verify_payload_map_read(off_t offset, uint8_t *buf,
+                                       size_t size, void *user)
+{
+    struct bpak_package *pkg = (struct bpak_package *)user;
+
+    if ((offset < 0) || ((uint64_t)offset > pkg->map_size) ||
+        (size > pkg->map_size - offset))
         return -BPAK_READ_ERROR;
 
-    return read_bytes;
+    memcpy(buf, &pkg->map[offset], size);
+    return size;
 }
 
 BPAK_EXPORT int bpak_pkg_verify(struct bpak_package *pkg,
                                 struct bpak_key *key)
+{
+    return bpak_pkg_verify_jobs(pkg, key, 1);
+}
+
+/* Verify the header signature with 'key', or with 'prepared' when it is
+ * not NULL */
+static int pkg_verify_header(struct bpak_package *pkg, struct bpak_key *key,
+                             struct bpak_prepared_key *prepared)
 {
     int rc;
     uint8_t hash_output[BPAK_HASH_MAX_LENGTH];
@@ -46,25 +91,76 @@ BPAK_EXPORT int bpak_pkg_verify(struct bpak_package *pkg,
     if (rc != BPAK_OK)
         return rc;
 
-    rc = bpak_crypto_verify(pkg->header.signature,
-                            pkg->header.signature_sz,
-                            hash_output,
-                            hash_size,
-                            pkg->header.hash_kind,
-                            key,
-                            &header_verified);
+    if (prepared != NULL) {
+        rc = bpak_crypto_verify_prepared(pkg->header.signature,
+                                         pkg->header.signature_sz,
+                                         hash_output,
+                                         hash_size,
+                                         pkg->header.hash_kind,
+                                         prepared,
+                                         &header_verified);
+    } else {
+        rc = bpak_crypto_verify(pkg->header.signature,
+                                pkg->header.signature_sz,
+                                hash_output,
+                                hash_size,
+                                pkg->header.hash_kind,
+                                key,
+                                &header_verified);
+    }
+
+    if (rc != BPAK_OK)
+        return rc;
+    if (header_verified == false)
+        return -BPAK_VERIFY_FAIL;
+
+    return BPAK_OK;
+}
+
+/* Verify with 'key', or with 'prepared' when it is not NULL */
+static int pkg_verify(struct bpak_package *pkg, struct bpak_key *key,
+                      struct bpak_prepared_key *prepared, unsigned int jobs)
+{
+    int rc;
+    bpak_io_t read_payload = verify_payload_read;
+    void *user = pkg;
+
+    rc = pkg_verify_header(pkg, key, prepared);
 
     if (rc != BPAK_OK)
         goto err_out;
-    if (header_verified == false) {
-        rc = -BPAK_VERIFY_FAIL;
-        goto err_out;
+
+    if (pkg->map != NULL) {
+        read_payload = verify_payload_map_read;
+    } else if ((jobs != 1) && (pkg->fp != NULL)) {
+        /* The stream can't be shared by the threads, read the fd with
+         * pread which bypasses the stream buffer. Other backends take
+         * concurrent reads, see bpak_pkg_open_io. */
+        if (fflush(pkg->fp) != 0) {
+            rc = -BPAK_WRITE_ERROR;
+            goto err_out;
+        }
+
+        read_payload = verify_payload_pread;
+        user = pkg->fp;
     }
 
-    rc = bpak_verify_payload(&pkg->header,
-                             verify_payload_read,
-                             sizeof(struct bpak_header),
-                             pkg->fp);
+    /* The tables are covered by the payload hash, which is computed in
+     * one pass */
+    if (pkg->tables != NULL) {
+        rc = bpak_verify_payload_tables(&pkg->header,
+                                        pkg->tables,
+                                        bpak_pkg_table_count(pkg),
+                                        read_payload,
+                                        sizeof(struct bpak_header),
+                                        user);
+    } else {
+        rc = bpak_verify_payload_parallel(&pkg->header,
+                                          read_payload,
+                                          sizeof(struct bpak_header),
+                                          user,
+                                          jobs);
+    }
 
     if (rc != BPAK_OK) {
         bpak_printf(0, "Error: payload verification failed\n");
@@ -75,6 +171,161 @@ err_out:
     return rc;
 }
 
+BPAK_EXPORT int bpak_pkg_verify_jobs(struct bpak_package *pkg,
+                                     struct bpak_key *key, unsigned int jobs)
+{
+    return pkg_verify(pkg, key, NULL, jobs);
+}
+
+BPAK_EXPORT int
+bpak_pkg_verify_installed(struct bpak_package *pkg, struct bpak_key *key,
+                          const struct bpak_verify_location *locations,
+                          size_t count, unsigned int jobs)
+{
+    int rc;
+
+    if (pkg->tables != NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    rc = pkg_verify_header(pkg, key, NULL);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_verify_installed(&pkg->header, locations, count, jobs);
+
+    if (rc != BPAK_OK)
+        bpak_printf(0, "Error: installed part verification failed\n");
+
+    return rc;
+}
+
+#ifndef BPAK_VERIFY_BATCH_KEY_CACHE
+#define BPAK_VERIFY_BATCH_KEY_CACHE 8
+#endif
+
+struct verify_batch {
+    struct bpak_verify_batch_item *items;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+/* Prepared keys of one worker. The keys are not shared between the
+ * workers since the backend may update a prepared key while verifying. */
+struct verify_batch_keys {
+    struct bpak_prepared_key keys[BPAK_VERIFY_BATCH_KEY_CACHE];
+    size_t count;
+    size_t oldest;
+};
+
+static struct bpak_prepared_key *
+verify_batch_key(struct verify_batch_keys *cache, struct bpak_key *key)
+{
+    struct bpak_prepared_key *prepared;
+
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache->keys[i].key == key)
+            return &cache->keys[i];
+    }
+
+    if (cache->count < BPAK_VERIFY_BATCH_KEY_CACHE) {
+        prepared = &cache->keys[cache->count++];
+    } else {
+        prepared = &cache->keys[cache->oldest];
+        cache->oldest = (cache->oldest + 1) % BPAK_VERIFY_BATCH_KEY_CACHE;
+        bpak_crypto_free_prepared_key(prepared);
+    }
+
+    /* A key the backend can't prepare is still verified, and fails, the
+     * same way as with bpak_pkg_verify */
+    if (bpak_crypto_prepare_key(prepared, key) != BPAK_OK)
+        prepared->backend = NULL;
+
+    return prepared;
+}
+
+static void *verify_batch_worker(void *arg)
+{
+    struct verify_batch *batch = (struct verify_batch *)arg;
+    struct verify_batch_keys cache;
+
+    memset(&cache, 0, sizeof(cache));
+    pthread_mutex_lock(&batch->lock);
+
+    while (batch->next < batch->count) {
+        struct bpak_verify_batch_item *item = &batch->items[batch->next++];
+
+        pthread_mutex_unlock(&batch->lock);
+        item->rc = pkg_verify(item->pkg,
+                              item->key,
+                              verify_batch_key(&cache, item->key),
+                              1);
+        pthread_mutex_lock(&batch->lock);
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+
+    for (size_t i = 0; i < cache.count; i++)
+        bpak_crypto_free_prepared_key(&cache.keys[i]);
+
+    return NULL;
+}
+
+BPAK_EXPORT int bpak_pkg_verify_batch(struct bpak_verify_batch_item *items,
+                                      size_t count, unsigned int jobs)
+{
+    struct verify_batch batch;
+    pthread_t *threads;
+    unsigned int thread_count = 0;
+
+    if (count == 0)
+        return BPAK_OK;
+
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = (cpus > 0) ? cpus : 1;
+    }
+
+    jobs = BPAK_MIN(jobs, count);
+
+    memset(&batch, 0, sizeof(batch));
+    batch.items = items;
+    batch.count = count;
+
+    for (size_t i = 0; i < count; i++)
+        items[i].rc = -BPAK_FAILED;
+
+    threads = (jobs > 1) ? bpak_calloc(jobs, sizeof(*threads)) : NULL;
+
+    pthread_mutex_init(&batch.lock, NULL);
+
+    for (; (threads != NULL) && (thread_count < jobs); thread_count++) {
+        if (pthread_create(&threads[thread_count],
+                           NULL,
+                           verify_batch_worker,
+                           &batch) != 0)
+            break;
+    }
+
+    /* Verify in this thread with one job or if no worker could be started */
+    if (thread_count == 0)
+        verify_batch_worker(&batch);
+
+    for (unsigned int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&batch.lock);
+    bpak_free(threads);
+
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].rc != BPAK_OK)
+            return items[i].rc;
+    }
+
+    return BPAK_OK;
+}
+
 BPAK_EXPORT int bpak_pkg_part_sha256(struct bpak_package *pkg,
                                      uint8_t *hash_buffer,
                                      size_t hash_buffer_length,
@@ -83,47 +334,46 @@ BPAK_EXPORT int bpak_pkg_part_sha256(struct bpak_package *pkg,
     int rc;
     struct bpak_part_header *part;
     struct bpak_hash_context hash;
-    uint8_t chunk[BPAK_CHUNK_BUFFER_LENGTH];
-    off_t offset;
-    size_t part_size;
-    size_t bytes_to_hash;
-    size_t chunk_len;
+    struct bpak_hash_range range;
 
-    rc = bpak_get_part(&pkg->header, part_id, &part);
+    rc = bpak_pkg_get_part(pkg, part_id, &part);
 
     if (rc != BPAK_OK)
         return rc;
 
-    offset = bpak_part_offset(&pkg->header, part);
+    if (pkg->map != NULL) {
+        const uint8_t *data;
+        size_t size;
 
-    rc = bpak_hash_init(&hash, BPAK_HASH_SHA256);
+        rc = bpak_pkg_part_view(pkg, part_id, &data, &size);
 
-    if (rc != BPAK_OK)
-        return rc;
+        if (rc != BPAK_OK)
+            return rc;
 
-    if (fseek(pkg->fp, offset, SEEK_SET) != 0) {
-        rc = -BPAK_SEEK_ERROR;
-        goto err_free_hash_ctx_out;
-    }
+        rc = bpak_hash_init(&hash, BPAK_HASH_SHA256);
 
-    part_size = bpak_part_size_wo_pad(part);
-    bytes_to_hash = part_size;
+        if (rc != BPAK_OK)
+            return rc;
 
-    while (bytes_to_hash > 0) {
-        chunk_len = (bytes_to_hash > sizeof(chunk))?sizeof(chunk):bytes_to_hash;
+        rc = bpak_hash_update(&hash, data, size);
 
-        if (fread(chunk, 1, chunk_len, pkg->fp) != chunk_len) {
-            rc = -BPAK_READ_ERROR;
-            goto err_free_hash_ctx_out;
-        }
+        if (rc == BPAK_OK)
+            rc = bpak_hash_final(&hash, hash_buffer, hash_buffer_length, NULL);
 
-        rc = bpak_hash_update(&hash, chunk, chunk_len);
+        goto err_free_hash_ctx_out;
+    }
 
-        if (rc != BPAK_OK)
-            goto err_free_hash_ctx_out;
+    rc = bpak_hash_init(&hash, BPAK_HASH_SHA256);
 
-        bytes_to_hash -= chunk_len;
-    }
+    if (rc != BPAK_OK)
+        return rc;
+
+    range.offset = bpak_pkg_part_offset(pkg, part);
+    range.length = bpak_part_size_wo_pad(part);
+    rc = bpak_hash_pipeline(&hash, &range, 1, verify_payload_read, pkg);
+
+    if (rc != BPAK_OK)
+        goto err_free_hash_ctx_out;
 
     rc = bpak_hash_final(&hash, hash_buffer, hash_buffer_length, NULL);
 
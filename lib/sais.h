@@ -2,7 +2,29 @@
 #define LIB_SAIS_H_
 
 #include <stdint.h>
+#include <bpak/bpak.h>
+
+/* Inputs shorter than this are always sorted with sais-lite */
+#ifndef BPAK_SAIS_PARALLEL_MIN_LENGTH
+#define BPAK_SAIS_PARALLEL_MIN_LENGTH (1024 * 1024)
+#endif
+
+#ifndef BPAK_SAIS_PARALLEL_MAX_JOBS
+#define BPAK_SAIS_PARALLEL_MAX_JOBS 64
+#endif
 
 int64_t sais(const uint8_t *t_p, int64_t *sa_p, int64_t n);
+int32_t sais32(const uint8_t *t_p, int32_t *sa_p, int32_t n);
+
+#if BPAK_CONFIG_PARALLEL_SAIS == 1
+/* Multithreaded prefix doubling suffix sort, 'jobs' = 0 uses one thread
+ * per online CPU. Needs about twice the memory of sais-lite and is only
+ * faster than sais-lite when several cores are available. */
+unsigned int sais_parallel_jobs(unsigned int jobs);
+int64_t sais_parallel(const uint8_t *t_p, int64_t *sa_p, int64_t n,
+                      unsigned int jobs);
+int32_t sais32_parallel(const uint8_t *t_p, int32_t *sa_p, int32_t n,
+                        unsigned int jobs);
+#endif
 
 #endif
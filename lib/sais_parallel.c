@@ -0,0 +1,73 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <bpak/bpak.h>
+#include "sais.h"
+
+#define saidx_t      int64_t
+#define SAIS_FN(_fn) _fn##_64
+#include "sais_parallel_impl.h"
+#undef saidx_t
+#undef SAIS_FN
+
+#define saidx_t      int32_t
+#define SAIS_FN(_fn) _fn##_32
+#include "sais_parallel_impl.h"
+#undef saidx_t
+#undef SAIS_FN
+
+unsigned int sais_parallel_jobs(unsigned int jobs)
+{
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = (cpus > 0) ? cpus : 1;
+    }
+
+    return BPAK_MIN(jobs, BPAK_SAIS_PARALLEL_MAX_JOBS);
+}
+
+int64_t sais_parallel(const uint8_t *t_p, int64_t *sa_p, int64_t n,
+                      unsigned int jobs)
+{
+    if ((t_p == NULL) || (sa_p == NULL) || (n < 0)) {
+        return (-1);
+    }
+
+    if (n <= 1) {
+        if (n == 1) {
+            sa_p[0] = 0;
+        }
+
+        return (0);
+    }
+
+    return sais_parallel_main_64(t_p, sa_p, n, sais_parallel_jobs(jobs));
+}
+
+int32_t sais32_parallel(const uint8_t *t_p, int32_t *sa_p, int32_t n,
+                        unsigned int jobs)
+{
+    if ((t_p == NULL) || (sa_p == NULL) || (n < 0)) {
+        return (-1);
+    }
+
+    if (n <= 1) {
+        if (n == 1) {
+            sa_p[0] = 0;
+        }
+
+        return (0);
+    }
+
+    return sais_parallel_main_32(t_p, sa_p, n, sais_parallel_jobs(jobs));
+}
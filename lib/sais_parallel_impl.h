@@ -0,0 +1,505 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Parallel prefix doubling suffix sorter, instantiated by sais_parallel.c
+ * for each suffix array index type. The includer defines 'saidx_t' as the
+ * index type and 'SAIS_FN(name)' to give each instance unique names.
+ *
+ */
+
+#if !defined(saidx_t) || !defined(SAIS_FN)
+#error "saidx_t and SAIS_FN must be defined before including this file"
+#endif
+
+/* Rank of the suffix that starts 'h' bytes after suffix '_i', suffixes that
+ * end before that sort first */
+#define SORT_KEY(_i)                                                           \
+    ((h < (n - (_i))) ? rank_p[(_i) + h] : (saidx_t)-1)
+
+struct SAIS_FN(group) {
+    saidx_t start;
+    saidx_t length;
+};
+
+struct SAIS_FN(worker) {
+    pthread_t thread;
+    const uint8_t *t_p;
+    saidx_t *sa_p;
+    saidx_t *rank_p;
+    uint8_t *head_p;
+    saidx_t n;
+    saidx_t h;
+    saidx_t begin; /* Text range for the bucket phase */
+    saidx_t end;
+    saidx_t *counts;
+    const saidx_t *bucket_start;
+    struct SAIS_FN(group) *groups; /* Groups handled by this worker */
+    size_t no_of_groups;
+    struct SAIS_FN(group) *refined; /* Unsorted groups for the next round */
+    size_t no_of_refined;
+    size_t refined_capacity;
+    int rc;
+};
+
+static int SAIS_FN(add_group)(struct SAIS_FN(worker) *w, saidx_t start,
+                              saidx_t length)
+{
+    if (w->no_of_refined == w->refined_capacity) {
+        size_t new_capacity = w->refined_capacity ? w->refined_capacity * 2
+                                                  : 1024;
+        struct SAIS_FN(group) *new_groups =
+            bpak_calloc(new_capacity, sizeof(*new_groups));
+
+        if (new_groups == NULL)
+            return -2;
+
+        if (w->refined != NULL) {
+            memcpy(new_groups,
+                   w->refined,
+                   w->no_of_refined * sizeof(*new_groups));
+            bpak_free(w->refined);
+        }
+
+        w->refined = new_groups;
+        w->refined_capacity = new_capacity;
+    }
+
+    w->refined[w->no_of_refined].start = start;
+    w->refined[w->no_of_refined].length = length;
+    w->no_of_refined++;
+
+    return 0;
+}
+
+static void SAIS_FN(sift_down)(saidx_t *sa_p, const saidx_t *rank_p, saidx_t n,
+                               saidx_t h, saidx_t root, saidx_t length)
+{
+    saidx_t tmp;
+
+    for (;;) {
+        saidx_t child = root * 2 + 1;
+
+        if (child >= length)
+            break;
+
+        if ((child + 1 < length) &&
+            (SORT_KEY(sa_p[child]) < SORT_KEY(sa_p[child + 1]))) {
+            child++;
+        }
+
+        if (SORT_KEY(sa_p[root]) >= SORT_KEY(sa_p[child]))
+            break;
+
+        tmp = sa_p[root];
+        sa_p[root] = sa_p[child];
+        sa_p[child] = tmp;
+        root = child;
+    }
+}
+
+static void SAIS_FN(heap_sort)(saidx_t *sa_p, const saidx_t *rank_p, saidx_t n,
+                               saidx_t h, saidx_t length)
+{
+    saidx_t tmp;
+
+    for (saidx_t i = length / 2; i > 0; i--)
+        SAIS_FN(sift_down)(sa_p, rank_p, n, h, i - 1, length);
+
+    for (saidx_t i = length - 1; i > 0; i--) {
+        tmp = sa_p[0];
+        sa_p[0] = sa_p[i];
+        sa_p[i] = tmp;
+        SAIS_FN(sift_down)(sa_p, rank_p, n, h, 0, i);
+    }
+}
+
+/* Three way quick sort of sa_p[lo..hi) on SORT_KEY. Many suffixes in a group
+ * usually share the same key, which the three way partition handles well.
+ * Falls back to heap sort if the recursion gets too deep. */
+static void SAIS_FN(sort_group)(saidx_t *sa_p, const saidx_t *rank_p,
+                                saidx_t n, saidx_t h, saidx_t lo, saidx_t hi,
+                                int depth)
+{
+    saidx_t tmp;
+
+    while ((hi - lo) > 16) {
+        saidx_t lt = lo;
+        saidx_t gt = hi;
+        saidx_t i = lo;
+        saidx_t a = SORT_KEY(sa_p[lo]);
+        saidx_t b = SORT_KEY(sa_p[lo + (hi - lo) / 2]);
+        saidx_t c = SORT_KEY(sa_p[hi - 1]);
+        saidx_t pivot;
+
+        if (depth-- == 0) {
+            SAIS_FN(heap_sort)(&sa_p[lo], rank_p, n, h, hi - lo);
+            return;
+        }
+
+        /* Median of three */
+        if (a < b)
+            pivot = (b < c) ? b : ((a < c) ? c : a);
+        else
+            pivot = (a < c) ? a : ((b < c) ? c : b);
+
+        while (i < gt) {
+            saidx_t k = SORT_KEY(sa_p[i]);
+
+            if (k < pivot) {
+                tmp = sa_p[lt];
+                sa_p[lt++] = sa_p[i];
+                sa_p[i++] = tmp;
+            } else if (k > pivot) {
+                tmp = sa_p[--gt];
+                sa_p[gt] = sa_p[i];
+                sa_p[i] = tmp;
+            } else {
+                i++;
+            }
+        }
+
+        /* Recurse on the smaller side to bound the stack usage */
+        if ((lt - lo) < (hi - gt)) {
+            SAIS_FN(sort_group)(sa_p, rank_p, n, h, lo, lt, depth);
+            lo = gt;
+        } else {
+            SAIS_FN(sort_group)(sa_p, rank_p, n, h, gt, hi, depth);
+            hi = lt;
+        }
+    }
+
+    for (saidx_t i = lo + 1; i < hi; i++) {
+        saidx_t x = sa_p[i];
+        saidx_t k = SORT_KEY(x);
+        saidx_t j = i;
+
+        while ((j > lo) && (SORT_KEY(sa_p[j - 1]) > k)) {
+            sa_p[j] = sa_p[j - 1];
+            j--;
+        }
+
+        sa_p[j] = x;
+    }
+}
+
+/* key of the two first bytes, the last suffix sorts before any longer
+ * suffix that starts with the same byte */
+#define BUCKET_KEY(_i)                                                         \
+    ((saidx_t)t_p[(_i)] * 257 + (((_i) + 1 < n) ? t_p[(_i) + 1] + 1 : 0))
+#define NO_OF_BUCKETS (256 * 257)
+
+static void *SAIS_FN(count_worker)(void *arg)
+{
+    struct SAIS_FN(worker) *w = (struct SAIS_FN(worker) *)arg;
+    const uint8_t *t_p = w->t_p;
+    saidx_t n = w->n;
+
+    for (saidx_t i = w->begin; i < w->end; i++)
+        w->counts[BUCKET_KEY(i)]++;
+
+    return NULL;
+}
+
+static void *SAIS_FN(scatter_worker)(void *arg)
+{
+    struct SAIS_FN(worker) *w = (struct SAIS_FN(worker) *)arg;
+    const uint8_t *t_p = w->t_p;
+    saidx_t n = w->n;
+
+    /* 'counts' holds the output position of this worker in each bucket */
+    for (saidx_t i = w->begin; i < w->end; i++) {
+        saidx_t k = BUCKET_KEY(i);
+        w->sa_p[w->counts[k]++] = i;
+        w->rank_p[i] = w->bucket_start[k];
+    }
+
+    return NULL;
+}
+
+static void *SAIS_FN(sort_worker)(void *arg)
+{
+    struct SAIS_FN(worker) *w = (struct SAIS_FN(worker) *)arg;
+    saidx_t *sa_p = w->sa_p;
+    const saidx_t *rank_p = w->rank_p;
+    saidx_t n = w->n;
+    saidx_t h = w->h;
+
+    for (size_t g = 0; g < w->no_of_groups; g++) {
+        saidx_t start = w->groups[g].start;
+        saidx_t end = start + w->groups[g].length;
+        saidx_t prev;
+
+        SAIS_FN(sort_group)(sa_p, rank_p, n, h, start, end, 64);
+
+        /* Mark where the keys change, the ranks are updated once all
+         * workers are done reading them */
+        prev = SORT_KEY(sa_p[start]);
+        w->head_p[start] = 1;
+
+        for (saidx_t i = start + 1; i < end; i++) {
+            saidx_t k = SORT_KEY(sa_p[i]);
+            w->head_p[i] = (k != prev);
+            prev = k;
+        }
+    }
+
+    return NULL;
+}
+
+static void *SAIS_FN(rank_worker)(void *arg)
+{
+    struct SAIS_FN(worker) *w = (struct SAIS_FN(worker) *)arg;
+
+    w->no_of_refined = 0;
+
+    for (size_t g = 0; g < w->no_of_groups; g++) {
+        saidx_t start = w->groups[g].start;
+        saidx_t end = start + w->groups[g].length;
+        saidx_t sub_start = start;
+
+        for (saidx_t i = start; i < end; i++) {
+            if (w->head_p[i] && (i != start)) {
+                if ((i - sub_start) > 1) {
+                    if (SAIS_FN(add_group)(w, sub_start, i - sub_start) != 0) {
+                        w->rc = -2;
+                        return NULL;
+                    }
+                }
+                sub_start = i;
+            }
+
+            w->rank_p[w->sa_p[i]] = sub_start;
+        }
+
+        if ((end - sub_start) > 1) {
+            if (SAIS_FN(add_group)(w, sub_start, end - sub_start) != 0) {
+                w->rc = -2;
+                return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int SAIS_FN(run_workers)(struct SAIS_FN(worker) *workers,
+                                unsigned int jobs, void *(*fn)(void *))
+{
+    unsigned int started = 0;
+    int rc = 0;
+
+    for (unsigned int i = 0; i < jobs; i++) {
+        if (pthread_create(&workers[i].thread, NULL, fn, &workers[i]) != 0) {
+            rc = -2;
+            break;
+        }
+        started++;
+    }
+
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for (unsigned int i = 0; i < started; i++) {
+        if (workers[i].rc != 0)
+            rc = workers[i].rc;
+    }
+
+    return rc;
+}
+
+/* Split the group list in 'jobs' slices with roughly the same number of
+ * suffixes in each */
+static void SAIS_FN(split_groups)(struct SAIS_FN(worker) *workers,
+                                  unsigned int jobs,
+                                  struct SAIS_FN(group) *groups,
+                                  size_t no_of_groups)
+{
+    size_t total = 0;
+    size_t g = 0;
+
+    for (size_t i = 0; i < no_of_groups; i++)
+        total += groups[i].length;
+
+    for (unsigned int i = 0; i < jobs; i++) {
+        size_t target = total / (jobs - i);
+        size_t sum = 0;
+
+        workers[i].groups = &groups[g];
+        workers[i].no_of_groups = 0;
+
+        while ((g < no_of_groups) &&
+               ((sum < target) || (i == (jobs - 1)))) {
+            sum += groups[g].length;
+            workers[i].no_of_groups++;
+            g++;
+        }
+
+        total -= sum;
+    }
+}
+
+static saidx_t SAIS_FN(sais_parallel_main)(const uint8_t *t_p, saidx_t *sa_p,
+                                           saidx_t n, unsigned int jobs)
+{
+    int rc = 0;
+    struct SAIS_FN(worker) *workers = NULL;
+    saidx_t *rank_p = NULL;
+    uint8_t *head_p = NULL;
+    saidx_t *bucket_start = NULL;
+    struct SAIS_FN(group) *groups = NULL;
+    size_t no_of_groups = 0;
+    saidx_t chunk = (n + jobs - 1) / jobs;
+    saidx_t sum = 0;
+
+    workers = bpak_calloc(jobs, sizeof(*workers));
+    rank_p = bpak_calloc(n, sizeof(saidx_t));
+    head_p = bpak_calloc(n, sizeof(uint8_t));
+    bucket_start = bpak_calloc(NO_OF_BUCKETS, sizeof(saidx_t));
+
+    if ((workers == NULL) || (rank_p == NULL) || (head_p == NULL) ||
+        (bucket_start == NULL)) {
+        rc = -2;
+        goto err_free_out;
+    }
+
+    /* Stage 1: bucket sort on the first two bytes */
+    for (unsigned int i = 0; i < jobs; i++) {
+        workers[i].t_p = t_p;
+        workers[i].sa_p = sa_p;
+        workers[i].rank_p = rank_p;
+        workers[i].head_p = head_p;
+        workers[i].n = n;
+        workers[i].begin = BPAK_MIN((saidx_t)i * chunk, n);
+        workers[i].end = BPAK_MIN(workers[i].begin + chunk, n);
+        workers[i].bucket_start = bucket_start;
+        workers[i].counts = bpak_calloc(NO_OF_BUCKETS, sizeof(saidx_t));
+
+        if (workers[i].counts == NULL) {
+            rc = -2;
+            goto err_free_out;
+        }
+    }
+
+    rc = SAIS_FN(run_workers)(workers, jobs, SAIS_FN(count_worker));
+
+    if (rc != 0)
+        goto err_free_out;
+
+    for (saidx_t k = 0; k < NO_OF_BUCKETS; k++) {
+        bucket_start[k] = sum;
+
+        for (unsigned int i = 0; i < jobs; i++) {
+            saidx_t count = workers[i].counts[k];
+            workers[i].counts[k] = sum;
+            sum += count;
+        }
+
+        if ((sum - bucket_start[k]) > 1)
+            no_of_groups++;
+    }
+
+    groups = bpak_calloc(no_of_groups ? no_of_groups : 1, sizeof(*groups));
+
+    if (groups == NULL) {
+        rc = -2;
+        goto err_free_out;
+    }
+
+    no_of_groups = 0;
+
+    for (saidx_t k = 0; k < NO_OF_BUCKETS; k++) {
+        saidx_t end = (k == (NO_OF_BUCKETS - 1)) ? n : bucket_start[k + 1];
+
+        if ((end - bucket_start[k]) > 1) {
+            groups[no_of_groups].start = bucket_start[k];
+            groups[no_of_groups].length = end - bucket_start[k];
+            no_of_groups++;
+        }
+    }
+
+    rc = SAIS_FN(run_workers)(workers, jobs, SAIS_FN(scatter_worker));
+
+    if (rc != 0)
+        goto err_free_out;
+
+    /* Stage 2: prefix doubling, every unsorted group is sorted on the rank
+     * of the suffix 'h' bytes later until all groups are singletons */
+    for (saidx_t h = 2; no_of_groups > 0; h = (h <= (n / 2)) ? h * 2 : n) {
+        size_t no_of_next = 0;
+        struct SAIS_FN(group) *next;
+
+        SAIS_FN(split_groups)(workers, jobs, groups, no_of_groups);
+
+        for (unsigned int i = 0; i < jobs; i++)
+            workers[i].h = h;
+
+        rc = SAIS_FN(run_workers)(workers, jobs, SAIS_FN(sort_worker));
+
+        if (rc != 0)
+            goto err_free_out;
+
+        rc = SAIS_FN(run_workers)(workers, jobs, SAIS_FN(rank_worker));
+
+        if (rc != 0)
+            goto err_free_out;
+
+        for (unsigned int i = 0; i < jobs; i++)
+            no_of_next += workers[i].no_of_refined;
+
+        next = bpak_calloc(no_of_next ? no_of_next : 1, sizeof(*next));
+
+        if (next == NULL) {
+            rc = -2;
+            goto err_free_out;
+        }
+
+        no_of_next = 0;
+
+        for (unsigned int i = 0; i < jobs; i++) {
+            memcpy(&next[no_of_next],
+                   workers[i].refined,
+                   workers[i].no_of_refined * sizeof(*next));
+            no_of_next += workers[i].no_of_refined;
+        }
+
+        bpak_free(groups);
+        groups = next;
+        no_of_groups = no_of_next;
+
+        if ((h == n) && (no_of_groups > 0)) {
+            /* Can't happen, all suffixes are unique */
+            rc = -1;
+            goto err_free_out;
+        }
+    }
+
+err_free_out:
+    if (workers != NULL) {
+        for (unsigned int i = 0; i < jobs; i++) {
+            if (workers[i].counts != NULL)
+                bpak_free(workers[i].counts);
+            if (workers[i].refined != NULL)
+                bpak_free(workers[i].refined);
+        }
+        bpak_free(workers);
+    }
+
+    if (groups != NULL)
+        bpak_free(groups);
+    if (bucket_start != NULL)
+        bpak_free(bucket_start);
+    if (head_p != NULL)
+        bpak_free(head_p);
+    if (rank_p != NULL)
+        bpak_free(rank_p);
+
+    return rc;
+}
+
+#undef SORT_KEY
+#undef BUCKET_KEY
+#undef NO_OF_BUCKETS
@@ -0,0 +1,771 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Built-in SHA-256/384/512 hash backend. The SHA-256 block function uses
+ * the SHA extensions on x86 and the ARMv8 crypto extensions on aarch64
+ * when the CPU supports them, otherwise portable C code is used.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <bpak/bpak.h>
+#include <bpak/crypto.h>
+#include "sha.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#define SHA_ARM64
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define SHA256_BLOCK_SZ 64
+#define SHA512_BLOCK_SZ 128
+
+#define ROR32(_x, _n) (((_x) >> (_n)) | ((_x) << (32 - (_n))))
+#define ROR64(_x, _n) (((_x) >> (_n)) | ((_x) << (64 - (_n))))
+
+/* Largest number of messages hashed in parallel by a multi-buffer kernel */
+#define SHA_MB_LANES_MAX 16
+
+typedef void (*sha256_blocks_func_t)(uint32_t state[8], const uint8_t *data,
+                                     size_t blocks);
+
+typedef void (*sha256_multi_func_t)(uint32_t *state, const uint8_t *base,
+                                    size_t stride);
+
+static const uint32_t k256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint64_t k512[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+    0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+    0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+    0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+    0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+    0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+    0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+    0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+    0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+    0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+    0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+    0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+    0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+    0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint32_t iv256[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint64_t iv384[8] = {
+    0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL,
+    0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+    0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL,
+    0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+static const uint64_t iv512[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t load_be64(const uint8_t *p)
+{
+    return ((uint64_t)load_be32(p) << 32) | load_be32(p + 4);
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+    store_be32(p, v >> 32);
+    store_be32(p + 4, (uint32_t)v);
+}
+
+static void sha256_blocks_generic(uint32_t state[8], const uint8_t *data,
+                                  size_t blocks)
+{
+    uint32_t w[64];
+
+    while (blocks--) {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 16; i++)
+            w[i] = load_be32(&data[i * 4]);
+
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+                          (w[i - 15] >> 3);
+            uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+                          (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + k256[i] + w[i];
+            uint32_t s0 = ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + s0 + maj;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += SHA256_BLOCK_SZ;
+    }
+}
+
+static void sha512_blocks(uint64_t state[8], const uint8_t *data,
+                          size_t blocks)
+{
+    uint64_t w[80];
+
+    while (blocks--) {
+        uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 16; i++)
+            w[i] = load_be64(&data[i * 8]);
+
+        for (int i = 16; i < 80; i++) {
+            uint64_t s0 = ROR64(w[i - 15], 1) ^ ROR64(w[i - 15], 8) ^
+                          (w[i - 15] >> 7);
+            uint64_t s1 = ROR64(w[i - 2], 19) ^ ROR64(w[i - 2], 61) ^
+                          (w[i - 2] >> 6);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        for (int i = 0; i < 80; i++) {
+            uint64_t s1 = ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41);
+            uint64_t ch = (e & f) ^ (~e & g);
+            uint64_t t1 = h + s1 + ch + k512[i] + w[i];
+            uint64_t s0 = ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39);
+            uint64_t maj = (a & b) ^ (a & c) ^ (b & c);
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + s0 + maj;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += SHA512_BLOCK_SZ;
+    }
+}
+
+#ifdef SHA_X86
+/* Four rounds per iteration, w[] holds the last 16 message words */
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const __m128i bswap_mask =
+        _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, tmp, msg, abef_save, cdgh_save;
+    __m128i w[4];
+
+    /* The SHA instructions work on the state as ABEF and CDGH */
+    tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                msg = _mm_loadu_si128((const __m128i *)&data[i * 16]);
+                w[i] = _mm_shuffle_epi8(msg, bswap_mask);
+            } else {
+                tmp = _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4);
+                msg = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                w[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(msg, tmp),
+                                                w[(i + 3) & 3]);
+            }
+
+            msg = _mm_add_epi32(w[i & 3],
+                                _mm_loadu_si128((const __m128i *)&k256[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += SHA256_BLOCK_SZ;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+/* Eight messages at a time */
+#define SHA_MB_FN            sha256_x8_avx2
+#define SHA_MB_TARGET        __attribute__((target("avx2")))
+#define SHA_MB_VEC           __m256i
+#define SHA_MB_LANES         8
+#define SHA_MB_LOAD(_p)      _mm256_loadu_si256((const __m256i *)(_p))
+#define SHA_MB_STORE(_p, _v) _mm256_storeu_si256((__m256i *)(_p), (_v))
+#define SHA_MB_SET1(_x)      _mm256_set1_epi32((int)(_x))
+#define SHA_MB_ADD(_a, _b)   _mm256_add_epi32((_a), (_b))
+#define SHA_MB_SHR(_x, _n)   _mm256_srli_epi32((_x), (_n))
+#define SHA_MB_ROR(_x, _n)                                                     \
+    _mm256_or_si256(_mm256_srli_epi32((_x), (_n)),                             \
+                    _mm256_slli_epi32((_x), 32 - (_n)))
+#define SHA_MB_XOR3(_a, _b, _c)                                                \
+    _mm256_xor_si256(_mm256_xor_si256((_a), (_b)), (_c))
+#define SHA_MB_CH(_e, _f, _g)                                                  \
+    _mm256_xor_si256(_mm256_and_si256((_e), (_f)),                             \
+                     _mm256_andnot_si256((_e), (_g)))
+#define SHA_MB_MAJ(_a, _b, _c)                                                 \
+    _mm256_or_si256(_mm256_and_si256((_a), (_b)),                              \
+                    _mm256_and_si256((_c), _mm256_or_si256((_a), (_b))))
+#define SHA_MB_INDEX(_stride)                                                  \
+    _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),              \
+                       _mm256_set1_epi32((int)(_stride)))
+#define SHA_MB_GATHER(_p, _index)                                              \
+    _mm256_i32gather_epi32((const int *)(_p), (_index), 1)
+#define SHA_MB_BSWAP(_v)                                                       \
+    _mm256_shuffle_epi8((_v),                                                  \
+                        _mm256_set_epi64x(0x0c0d0e0f08090a0bULL,               \
+                                          0x0405060700010203ULL,               \
+                                          0x0c0d0e0f08090a0bULL,               \
+                                          0x0405060700010203ULL))
+#include "sha256_mb_impl.h"
+#undef SHA_MB_FN
+#undef SHA_MB_TARGET
+#undef SHA_MB_VEC
+#undef SHA_MB_LANES
+#undef SHA_MB_LOAD
+#undef SHA_MB_STORE
+#undef SHA_MB_SET1
+#undef SHA_MB_ADD
+#undef SHA_MB_SHR
+#undef SHA_MB_ROR
+#undef SHA_MB_XOR3
+#undef SHA_MB_CH
+#undef SHA_MB_MAJ
+#undef SHA_MB_INDEX
+#undef SHA_MB_GATHER
+#undef SHA_MB_BSWAP
+
+/* Sixteen messages at a time */
+#define SHA_MB_FN            sha256_x16_avx512
+#define SHA_MB_TARGET        __attribute__((target("avx512f,avx512bw")))
+#define SHA_MB_VEC           __m512i
+#define SHA_MB_LANES         16
+#define SHA_MB_LOAD(_p)      _mm512_loadu_si512((const void *)(_p))
+#define SHA_MB_STORE(_p, _v) _mm512_storeu_si512((void *)(_p), (_v))
+#define SHA_MB_SET1(_x)      _mm512_set1_epi32((int)(_x))
+#define SHA_MB_ADD(_a, _b)   _mm512_add_epi32((_a), (_b))
+#define SHA_MB_SHR(_x, _n)   _mm512_srli_epi32((_x), (_n))
+#define SHA_MB_ROR(_x, _n)   _mm512_ror_epi32((_x), (_n))
+#define SHA_MB_XOR3(_a, _b, _c)                                                \
+    _mm512_ternarylogic_epi32((_a), (_b), (_c), 0x96)
+#define SHA_MB_CH(_e, _f, _g)                                                  \
+    _mm512_ternarylogic_epi32((_e), (_f), (_g), 0xCA)
+#define SHA_MB_MAJ(_a, _b, _c)                                                 \
+    _mm512_ternarylogic_epi32((_a), (_b), (_c), 0xE8)
+#define SHA_MB_INDEX(_stride)                                                  \
+    _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,    \
+                                         11, 12, 13, 14, 15),                  \
+                       _mm512_set1_epi32((int)(_stride)))
+#define SHA_MB_GATHER(_p, _index)                                              \
+    _mm512_i32gather_epi32((_index), (const void *)(_p), 1)
+#define SHA_MB_BSWAP(_v)                                                       \
+    _mm512_shuffle_epi8((_v),                                                  \
+                        _mm512_set_epi64(0x0c0d0e0f08090a0bULL,                \
+                                         0x0405060700010203ULL,                \
+                                         0x0c0d0e0f08090a0bULL,                \
+                                         0x0405060700010203ULL,                \
+                                         0x0c0d0e0f08090a0bULL,                \
+                                         0x0405060700010203ULL,                \
+                                         0x0c0d0e0f08090a0bULL,                \
+                                         0x0405060700010203ULL))
+#include "sha256_mb_impl.h"
+#undef SHA_MB_FN
+#undef SHA_MB_TARGET
+#undef SHA_MB_VEC
+#undef SHA_MB_LANES
+#undef SHA_MB_LOAD
+#undef SHA_MB_STORE
+#undef SHA_MB_SET1
+#undef SHA_MB_ADD
+#undef SHA_MB_SHR
+#undef SHA_MB_ROR
+#undef SHA_MB_XOR3
+#undef SHA_MB_CH
+#undef SHA_MB_MAJ
+#undef SHA_MB_INDEX
+#undef SHA_MB_GATHER
+#undef SHA_MB_BSWAP
+#endif
+
+#ifdef SHA_ARM64
+#if defined(__clang__)
+#define SHA_ARM64_TARGET __attribute__((target("crypto")))
+#else
+#define SHA_ARM64_TARGET __attribute__((target("+crypto")))
+#endif
+
+/* Four rounds per iteration, w[] holds the last 16 message words */
+SHA_ARM64_TARGET static void
+sha256_blocks_armv8(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+    uint32x4_t w[4];
+
+    while (blocks--) {
+        uint32x4_t abcd_save = state0;
+        uint32x4_t efgh_save = state1;
+
+        for (int i = 0; i < 16; i++) {
+            uint32x4_t msg;
+            uint32x4_t tmp;
+
+            if (i < 4) {
+                msg = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&data[i * 16])));
+                w[i] = msg;
+            } else {
+                msg = vsha256su0q_u32(w[i & 3], w[(i + 1) & 3]);
+                w[i & 3] =
+                    vsha256su1q_u32(msg, w[(i + 2) & 3], w[(i + 3) & 3]);
+            }
+
+            msg = vaddq_u32(w[i & 3], vld1q_u32(&k256[i * 4]));
+            tmp = state0;
+            state0 = vsha256hq_u32(state0, state1, msg);
+            state1 = vsha256h2q_u32(state1, tmp, msg);
+        }
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+        data += SHA256_BLOCK_SZ;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+#endif
+
+static sha256_blocks_func_t sha256_blocks = sha256_blocks_generic;
+static sha256_multi_func_t sha256_multi = NULL;
+static size_t sha256_multi_lanes = 1;
+static pthread_once_t sha_init_once = PTHREAD_ONCE_INIT;
+
+static sha256_blocks_func_t sha256_detect(void)
+{
+#if defined(SHA_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1") &&
+        __builtin_cpu_supports("ssse3")) {
+        return sha256_blocks_shani;
+    }
+#elif defined(SHA_ARM64)
+    if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+        return sha256_blocks_armv8;
+#endif
+    return sha256_blocks_generic;
+}
+
+static sha256_multi_func_t sha256_multi_detect(size_t *lanes)
+{
+#if defined(SHA_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw")) {
+        (*lanes) = 16;
+        return sha256_x16_avx512;
+    }
+
+    /* Eight AVX2 lanes are about as fast as the SHA extensions */
+    if (__builtin_cpu_supports("avx2") &&
+        (sha256_detect() == sha256_blocks_generic)) {
+        (*lanes) = 8;
+        return sha256_x8_avx2;
+    }
+#endif
+    (*lanes) = 1;
+    return NULL;
+}
+
+static void sha_select(void)
+{
+    sha256_blocks = sha256_detect();
+    sha256_multi = sha256_multi_detect(&sha256_multi_lanes);
+
+    if (sha256_blocks != sha256_blocks_generic)
+        bpak_printf(2, "sha: using cpu sha-256 instructions\n");
+    if (sha256_multi != NULL)
+        bpak_printf(2, "sha: %zu lane sha-256\n", sha256_multi_lanes);
+}
+
+BPAK_EXPORT void bpak_sha_set_acceleration(bool enable)
+{
+    pthread_once(&sha_init_once, sha_select);
+
+    if (enable) {
+        sha256_blocks = sha256_detect();
+        sha256_multi = sha256_multi_detect(&sha256_multi_lanes);
+    } else {
+        sha256_blocks = sha256_blocks_generic;
+        sha256_multi = NULL;
+        sha256_multi_lanes = 1;
+    }
+}
+
+static size_t sha_block_size(enum bpak_hash_kind kind)
+{
+    return (kind == BPAK_HASH_SHA256) ? SHA256_BLOCK_SZ : SHA512_BLOCK_SZ;
+}
+
+static void sha_blocks(struct bpak_hash_context *ctx, const uint8_t *data,
+                       size_t blocks)
+{
+    if (ctx->kind == BPAK_HASH_SHA256)
+        sha256_blocks(ctx->backend.sha.state.s256, data, blocks);
+    else
+        sha512_blocks(ctx->backend.sha.state.s512, data, blocks);
+}
+
+BPAK_EXPORT int bpak_sha_hash_init(struct bpak_hash_context *ctx)
+{
+    struct bpak_sha_context *sha = &ctx->backend.sha;
+
+    pthread_once(&sha_init_once, sha_select);
+    memset(sha, 0, sizeof(*sha));
+
+    switch (ctx->kind) {
+    case BPAK_HASH_SHA256:
+        memcpy(sha->state.s256, iv256, sizeof(iv256));
+        break;
+    case BPAK_HASH_SHA384:
+        memcpy(sha->state.s512, iv384, sizeof(iv384));
+        break;
+    case BPAK_HASH_SHA512:
+        memcpy(sha->state.s512, iv512, sizeof(iv512));
+        break;
+    default:
+        return -BPAK_UNSUPPORTED_HASH_ALG;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_sha_hash_update(struct bpak_hash_context *ctx,
+                                     const uint8_t *buffer, size_t length)
+{
+    struct bpak_sha_context *sha = &ctx->backend.sha;
+    size_t block_size = sha_block_size(ctx->kind);
+
+    sha->length += length;
+
+    /* Complete a partial block from an earlier update first */
+    if (sha->block_fill > 0) {
+        size_t n = BPAK_MIN(block_size - sha->block_fill, length);
+
+        memcpy(&sha->block[sha->block_fill], buffer, n);
+        sha->block_fill += n;
+        buffer += n;
+        length -= n;
+
+        if (sha->block_fill < block_size)
+            return BPAK_OK;
+
+        sha_blocks(ctx, sha->block, 1);
+        sha->block_fill = 0;
+    }
+
+    if (length >= block_size) {
+        size_t blocks = length / block_size;
+
+        sha_blocks(ctx, buffer, blocks);
+        buffer += blocks * block_size;
+        length -= blocks * block_size;
+    }
+
+    memcpy(sha->block, buffer, length);
+    sha->block_fill = length;
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_sha_hash_final(struct bpak_hash_context *ctx,
+                                    uint8_t *buffer, size_t buffer_length,
+                                    size_t *result_length)
+{
+    struct bpak_sha_context *sha = &ctx->backend.sha;
+    size_t block_size = sha_block_size(ctx->kind);
+    /* The message length in bits is stored in the last 8 or 16 bytes */
+    size_t length_bytes = (ctx->kind == BPAK_HASH_SHA256) ? 8 : 16;
+    size_t hash_length;
+
+    switch (ctx->kind) {
+    case BPAK_HASH_SHA256:
+        hash_length = 32;
+        break;
+    case BPAK_HASH_SHA384:
+        hash_length = 48;
+        break;
+    case BPAK_HASH_SHA512:
+        hash_length = 64;
+        break;
+    default:
+        return -BPAK_UNSUPPORTED_HASH_ALG;
+    }
+
+    if (buffer_length < hash_length)
+        return -BPAK_SIZE_ERROR;
+    if (result_length != NULL)
+        (*result_length) = hash_length;
+
+    sha->block[sha->block_fill++] = 0x80;
+
+    if (sha->block_fill > block_size - length_bytes) {
+        memset(&sha->block[sha->block_fill], 0, block_size - sha->block_fill);
+        sha_blocks(ctx, sha->block, 1);
+        sha->block_fill = 0;
+    }
+
+    memset(&sha->block[sha->block_fill], 0, block_size - sha->block_fill);
+    store_be64(&sha->block[block_size - 16], sha->length >> 61);
+    store_be64(&sha->block[block_size - 8], sha->length << 3);
+    sha_blocks(ctx, sha->block, 1);
+
+    for (size_t i = 0; i < hash_length; i += (hash_length == 32) ? 4 : 8) {
+        if (hash_length == 32)
+            store_be32(&buffer[i], sha->state.s256[i / 4]);
+        else
+            store_be64(&buffer[i], sha->state.s512[i / 8]);
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT void bpak_sha_hash_free(struct bpak_hash_context *ctx)
+{
+    memset(&ctx->backend.sha, 0, sizeof(ctx->backend.sha));
+}
+
+BPAK_EXPORT int bpak_sha_hash_clone(struct bpak_hash_context *dst,
+                                    const struct bpak_hash_context *src)
+{
+    memcpy(&dst->backend.sha, &src->backend.sha, sizeof(src->backend.sha));
+    return BPAK_OK;
+}
+
+/* Copy block 'block' of the message salt || data, with the SHA-256 padding,
+ * to 'output' */
+static void salted_block(const uint8_t *salt, size_t salt_length,
+                         const uint8_t *data, size_t data_length,
+                         size_t block, size_t blocks, uint8_t *output)
+{
+    size_t length = salt_length + data_length;
+    size_t pos = block * SHA256_BLOCK_SZ;
+
+    memset(output, 0, SHA256_BLOCK_SZ);
+
+    for (size_t i = 0; (i < SHA256_BLOCK_SZ) && (pos + i < length); i++) {
+        size_t p = pos + i;
+        output[i] = (p < salt_length) ? salt[p] : data[p - salt_length];
+    }
+
+    if ((length >= pos) && (length < pos + SHA256_BLOCK_SZ))
+        output[length - pos] = 0x80;
+    if (block == blocks - 1)
+        store_be64(&output[SHA256_BLOCK_SZ - 8], (uint64_t)length << 3);
+}
+
+static void sha256_salted_one(const uint8_t *salt, size_t salt_length,
+                              const uint8_t *data, size_t data_length,
+                              uint8_t *hash)
+{
+    size_t length = salt_length + data_length;
+    size_t blocks = (length + 8) / SHA256_BLOCK_SZ + 1;
+    /* Blocks in [first, end) are read directly from 'data' */
+    size_t first = (salt_length + SHA256_BLOCK_SZ - 1) / SHA256_BLOCK_SZ;
+    size_t end = length / SHA256_BLOCK_SZ;
+    uint8_t tmp[SHA256_BLOCK_SZ];
+    uint32_t state[8];
+
+    memcpy(state, iv256, sizeof(iv256));
+
+    for (size_t j = 0; j < blocks;) {
+        if ((j >= first) && (j < end)) {
+            sha256_blocks(state,
+                          &data[j * SHA256_BLOCK_SZ - salt_length],
+                          end - j);
+            j = end;
+        } else {
+            salted_block(salt, salt_length, data, data_length, j, blocks, tmp);
+            sha256_blocks(state, tmp, 1);
+            j++;
+        }
+    }
+
+    for (int i = 0; i < 8; i++)
+        store_be32(&hash[i * 4], state[i]);
+}
+
+/* Hash sha256_multi_lanes messages with the multi-buffer kernel */
+static void sha256_salted_multi(const uint8_t *salt, size_t salt_length,
+                                const uint8_t *data, size_t data_length,
+                                uint8_t *hashes)
+{
+    size_t lanes = sha256_multi_lanes;
+    size_t length = salt_length + data_length;
+    size_t blocks = (length + 8) / SHA256_BLOCK_SZ + 1;
+    size_t first = (salt_length + SHA256_BLOCK_SZ - 1) / SHA256_BLOCK_SZ;
+    size_t end = length / SHA256_BLOCK_SZ;
+    uint8_t tmp[SHA_MB_LANES_MAX * SHA256_BLOCK_SZ];
+    uint32_t state[8 * SHA_MB_LANES_MAX];
+
+    for (size_t i = 0; i < 8; i++) {
+        for (size_t l = 0; l < lanes; l++)
+            state[i * lanes + l] = iv256[i];
+    }
+
+    for (size_t j = 0; j < blocks; j++) {
+        if ((j >= first) && (j < end)) {
+            sha256_multi(state,
+                         &data[j * SHA256_BLOCK_SZ - salt_length],
+                         data_length);
+            continue;
+        }
+
+        for (size_t l = 0; l < lanes; l++) {
+            salted_block(salt,
+                         salt_length,
+                         &data[l * data_length],
+                         data_length,
+                         j,
+                         blocks,
+                         &tmp[l * SHA256_BLOCK_SZ]);
+        }
+
+        sha256_multi(state, tmp, SHA256_BLOCK_SZ);
+    }
+
+    for (size_t l = 0; l < lanes; l++) {
+        for (size_t i = 0; i < 8; i++)
+            store_be32(&hashes[l * 32 + i * 4], state[i * lanes + l]);
+    }
+}
+
+size_t bpak_sha256_lanes(void)
+{
+    pthread_once(&sha_init_once, sha_select);
+    return sha256_multi_lanes;
+}
+
+void bpak_sha256_salted(const uint8_t *salt, size_t salt_length,
+                        const uint8_t *data, size_t data_length, size_t count,
+                        uint8_t *hashes)
+{
+    pthread_once(&sha_init_once, sha_select);
+
+    /* The gather offsets of the multi-buffer kernels are 32-bit */
+    if ((sha256_multi != NULL) &&
+        (data_length <= INT32_MAX / SHA_MB_LANES_MAX)) {
+        size_t lanes = sha256_multi_lanes;
+
+        for (; count >= lanes; count -= lanes) {
+            sha256_salted_multi(salt, salt_length, data, data_length, hashes);
+            data += lanes * data_length;
+            hashes += lanes * 32;
+        }
+    }
+
+    for (; count > 0; count--) {
+        sha256_salted_one(salt, salt_length, data, data_length, hashes);
+        data += data_length;
+        hashes += 32;
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef BPAK_SHA_H
+#define BPAK_SHA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Number of messages the multi-buffer SHA-256 kernel hashes at once, 1 when
+ * there is no multi-buffer kernel for this CPU */
+size_t bpak_sha256_lanes(void);
+
+/* SHA-256 of salt || data[i * data_length] for 'count' messages of the same
+ * length, the 32 byte hashes are stored back to back in 'hashes' */
+void bpak_sha256_salted(const uint8_t *salt, size_t salt_length,
+                        const uint8_t *data, size_t data_length, size_t count,
+                        uint8_t *hashes);
+
+/* True when bpak_hash_* uses the built-in SHA backend */
+bool bpak_hash_is_builtin(void);
+#endif
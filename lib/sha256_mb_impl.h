@@ -0,0 +1,94 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Multi-buffer SHA-256 block function, included by sha.c once per vector
+ * width. Each vector lane holds one message, lane 'l' reads its block from
+ * base + l * stride.
+ *
+ * The includer defines:
+ *   SHA_MB_FN       Name of the function
+ *   SHA_MB_TARGET   Function attribute that enables the instruction set
+ *   SHA_MB_VEC      Vector type
+ *   SHA_MB_LANES    Number of 32-bit lanes in SHA_MB_VEC
+ *   SHA_MB_LOAD(p), SHA_MB_STORE(p, v), SHA_MB_SET1(x), SHA_MB_ADD(a, b),
+ *   SHA_MB_ROR(x, n), SHA_MB_SHR(x, n), SHA_MB_XOR3(a, b, c),
+ *   SHA_MB_CH(e, f, g), SHA_MB_MAJ(a, b, c), SHA_MB_INDEX(stride),
+ *   SHA_MB_GATHER(p, index), SHA_MB_BSWAP(v)
+ */
+
+/* 'state' is eight rows of SHA_MB_LANES words, row i is word i of every
+ * lane's state */
+SHA_MB_TARGET static void SHA_MB_FN(uint32_t *state, const uint8_t *base,
+                                    size_t stride)
+{
+    const SHA_MB_VEC index = SHA_MB_INDEX(stride);
+    SHA_MB_VEC w[16];
+    SHA_MB_VEC s[8];
+    SHA_MB_VEC a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 8; i++)
+        s[i] = SHA_MB_LOAD(&state[i * SHA_MB_LANES]);
+
+    for (int t = 0; t < 16; t++)
+        w[t] = SHA_MB_BSWAP(SHA_MB_GATHER(&base[t * 4], index));
+
+    a = s[0];
+    b = s[1];
+    c = s[2];
+    d = s[3];
+    e = s[4];
+    f = s[5];
+    g = s[6];
+    h = s[7];
+
+    for (int t = 0; t < 64; t++) {
+        SHA_MB_VEC t1, t2;
+
+        if (t >= 16) {
+            SHA_MB_VEC w15 = w[(t + 1) & 15];
+            SHA_MB_VEC w2 = w[(t + 14) & 15];
+            SHA_MB_VEC s0 = SHA_MB_XOR3(SHA_MB_ROR(w15, 7),
+                                        SHA_MB_ROR(w15, 18),
+                                        SHA_MB_SHR(w15, 3));
+            SHA_MB_VEC s1 = SHA_MB_XOR3(SHA_MB_ROR(w2, 17),
+                                        SHA_MB_ROR(w2, 19),
+                                        SHA_MB_SHR(w2, 10));
+
+            w[t & 15] = SHA_MB_ADD(SHA_MB_ADD(w[t & 15], s0),
+                                   SHA_MB_ADD(w[(t + 9) & 15], s1));
+        }
+
+        t1 = SHA_MB_ADD(h,
+                        SHA_MB_XOR3(SHA_MB_ROR(e, 6),
+                                    SHA_MB_ROR(e, 11),
+                                    SHA_MB_ROR(e, 25)));
+        t1 = SHA_MB_ADD(t1, SHA_MB_CH(e, f, g));
+        t1 = SHA_MB_ADD(t1, SHA_MB_ADD(SHA_MB_SET1(k256[t]), w[t & 15]));
+        t2 = SHA_MB_ADD(SHA_MB_XOR3(SHA_MB_ROR(a, 2),
+                                    SHA_MB_ROR(a, 13),
+                                    SHA_MB_ROR(a, 22)),
+                        SHA_MB_MAJ(a, b, c));
+
+        h = g;
+        g = f;
+        f = e;
+        e = SHA_MB_ADD(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = SHA_MB_ADD(t1, t2);
+    }
+
+    SHA_MB_STORE(&state[0 * SHA_MB_LANES], SHA_MB_ADD(s[0], a));
+    SHA_MB_STORE(&state[1 * SHA_MB_LANES], SHA_MB_ADD(s[1], b));
+    SHA_MB_STORE(&state[2 * SHA_MB_LANES], SHA_MB_ADD(s[2], c));
+    SHA_MB_STORE(&state[3 * SHA_MB_LANES], SHA_MB_ADD(s[3], d));
+    SHA_MB_STORE(&state[4 * SHA_MB_LANES], SHA_MB_ADD(s[4], e));
+    SHA_MB_STORE(&state[5 * SHA_MB_LANES], SHA_MB_ADD(s[5], f));
+    SHA_MB_STORE(&state[6 * SHA_MB_LANES], SHA_MB_ADD(s[6], g));
+    SHA_MB_STORE(&state[7 * SHA_MB_LANES], SHA_MB_ADD(s[7], h));
+}
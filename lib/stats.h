@@ -0,0 +1,30 @@
+#ifndef BPAK_STATS_H
+#define BPAK_STATS_H
+
+#include <stdint.h>
+#include <bpak/bpak.h>
+
+/* Profiling counters of bsdiff and bspatch. The macros update 'ctx->stats'
+ * when the library is built with BPAK_STATS and compile to nothing
+ * otherwise. */
+#if BPAK_CONFIG_STATS == 1
+#include <time.h>
+
+static inline uint64_t bpak_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#define BPAK_STATS_CLOCK(t)      uint64_t t = bpak_stats_now()
+#define BPAK_STATS_TIME(field, t) (ctx->stats.field += bpak_stats_now() - (t))
+#define BPAK_STATS_ADD(field, n) (ctx->stats.field += (n))
+#else
+#define BPAK_STATS_CLOCK(t)      do {} while (0)
+#define BPAK_STATS_TIME(field, t) do {} while (0)
+#define BPAK_STATS_ADD(field, n) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef BPAK_TRACE_H
+#define BPAK_TRACE_H
+
+#include <bpak/bpak.h>
+
+/* USDT probes of the 'bpak' provider. A double underscore in the name is a
+ * dash in the probe, BPAK_TRACE(part__start, ...) is bpak:part-start to
+ * perf and bpftrace. The probes are a nop instruction in the text until a
+ * tracer attaches and compile to nothing when the library is built without
+ * BPAK_TRACE or without systemtap's sys/sdt.h. */
+#if BPAK_CONFIG_TRACE == 1
+#include <sys/sdt.h>
+
+#define BPAK_TRACE1(name, a)          DTRACE_PROBE1(bpak, name, a)
+#define BPAK_TRACE2(name, a, b)       DTRACE_PROBE2(bpak, name, a, b)
+#define BPAK_TRACE3(name, a, b, c)    DTRACE_PROBE3(bpak, name, a, b, c)
+#define BPAK_TRACE4(name, a, b, c, d) DTRACE_PROBE4(bpak, name, a, b, c, d)
+#else
+#define BPAK_TRACE1(name, a)          do {} while (0)
+#define BPAK_TRACE2(name, a, b)       do {} while (0)
+#define BPAK_TRACE3(name, a, b, c)    do {} while (0)
+#define BPAK_TRACE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
@@ -8,25 +8,586 @@
  */
 
 #include <string.h>
+#include <time.h>
 #include <bpak/bpak.h>
 #include <bpak/crc.h>
 #include <bpak/transport.h>
 #include <bpak/bspatch.h>
+#include <bpak/blockpatch.h>
+#include <bpak/chunkpatch.h>
 #include <bpak/merkle.h>
 #include <bpak/id.h>
 #include <bpak/utils.h>
+#include "trace.h"
+
+static struct bpak_transport_meta *
+part_transport_meta(struct bpak_header *header, struct bpak_part_header *part)
+{
+    struct bpak_meta_header *meta = NULL;
+
+    /* Check if there is any transport meta data for this part in the header */
+    if (!(part->flags & BPAK_FLAG_TRANSPORT))
+        return NULL;
+
+    if (bpak_get_meta(header, BPAK_ID_BPAK_TRANSPORT, part->id, &meta) !=
+        BPAK_OK)
+        return NULL;
+
+    return bpak_get_meta_ptr(header, meta, struct bpak_transport_meta);
+}
+
+/* Offset of the origin data that 'part' is patched against */
+static off_t origin_part_offset(struct bpak_transport_decode *ctx,
+                                struct bpak_part_header *part)
+{
+    /* Reads of the virtual origin are mapped by decode_read_origin_parts */
+    if (ctx->origin_part_count > 0)
+        return 0;
+
+    struct bpak_part_header origin_part = {
+        .id = bpak_transport_origin_id(
+            part_transport_meta(ctx->patch_header, part),
+            part->id),
+    };
+
+    return bpak_part_offset(ctx->origin_header, &origin_part) -
+           sizeof(struct bpak_header) + ctx->origin_offset;
+}
+
+/* The decompress decoders run bspatch on a raw stream, without an origin */
+static bool decoder_is_raw(uint32_t decoder_id)
+{
+    return (decoder_id == BPAK_ID_DECOMPRESS_HS) ||
+           (decoder_id == BPAK_ID_DECOMPRESS_LZMA) ||
+           (decoder_id == BPAK_ID_DECOMPRESS_ZSTD);
+}
+
+/* Size of the origin data that 'part' is patched against, 0 when the
+ * origin does not have it */
+static size_t origin_part_size(struct bpak_transport_decode *ctx,
+                               struct bpak_part_header *part)
+{
+    struct bpak_part_header *origin_part = NULL;
+    bpak_id_t origin_id = bpak_transport_origin_id(
+        part_transport_meta(ctx->patch_header, part),
+        part->id);
+
+    if (ctx->origin_part_count > 0) {
+        size_t length = 0;
+
+        for (size_t i = 0; i < ctx->origin_part_count; i++)
+            length += ctx->origin_part_lengths[i];
+
+        return length;
+    }
+
+    if ((ctx->origin_header == NULL) ||
+        (bpak_get_part(ctx->origin_header, origin_id, &origin_part) !=
+         BPAK_OK))
+        return 0;
+
+    return bpak_part_size(origin_part);
+}
+
+/* Look up the origin parts of 'part' when it is patched against several
+ * of them */
+static int origin_parts_start(struct bpak_transport_decode *ctx,
+                              struct bpak_part_header *part)
+{
+    const bpak_id_t *origin_ids;
+    size_t count;
+    struct bpak_part_header *origin_part;
+    int rc;
+
+    ctx->origin_part_count = 0;
+
+    if ((ctx->origin_header == NULL) ||
+        (bpak_get_transport_origin_parts(ctx->patch_header,
+                                         part->id,
+                                         &origin_ids,
+                                         &count) != BPAK_OK))
+        return BPAK_OK;
+
+    for (size_t i = 0; i < count; i++) {
+        rc = bpak_get_part(ctx->origin_header, origin_ids[i], &origin_part);
+
+        if (rc != BPAK_OK) {
+            bpak_printf(0,
+                        "Error: Origin part 0x%x is missing\n",
+                        origin_ids[i]);
+            return rc;
+        }
+
+        ctx->origin_part_offsets[i] =
+            bpak_part_offset(ctx->origin_header, origin_part) -
+            sizeof(struct bpak_header) + ctx->origin_offset;
+        ctx->origin_part_lengths[i] = bpak_part_size(origin_part);
+    }
+
+    ctx->origin_part_count = count;
+    return BPAK_OK;
+}
+
+static uint32_t part_decoder_id(struct bpak_header *header,
+                                struct bpak_part_header *part)
+{
+    struct bpak_transport_meta *tm = part_transport_meta(header, part);
+
+    if ((tm != NULL) && (part->flags & BPAK_FLAG_REUSE_ORIGIN))
+        return BPAK_ID_REUSE_ORIGIN;
+
+    return bpak_transport_decoder_id(tm, part);
+}
+
+/* Print the bspatch profiling counters, when they are built in */
+static void bspatch_print_stats(struct bpak_transport_decode *ctx)
+{
+    struct bpak_bspatch_stats s;
+
+    if (bpak_bspatch_get_stats(&ctx->decoders.bspatch, &s) != BPAK_OK)
+        return;
+
+    bpak_printf(1,
+                "bspatch 0x%x: %llu ctrl, %llu diff, %llu extra, %llu copy "
+                "bytes\n",
+                ctx->part->id,
+                (unsigned long long)s.ctrl_blocks,
+                (unsigned long long)s.diff_bytes,
+                (unsigned long long)s.extra_bytes,
+                (unsigned long long)s.copy_bytes);
+    bpak_printf(1,
+                "bspatch 0x%x: read_origin %llu calls %.3f ms, write_output "
+                "%llu calls %.3f ms, patch %.3f ms, decompress %.3f ms\n",
+                ctx->part->id,
+                (unsigned long long)s.read_origin_calls,
+                s.read_origin_ns / 1e6,
+                (unsigned long long)s.write_output_calls,
+                s.write_output_ns / 1e6,
+                s.patch_ns / 1e6,
+                (s.total_ns - s.patch_ns) / 1e6);
+}
 
 #if BPAK_CONFIG_MERKLE == 1
+/* Offset of 'part' once every part in the header has been decoded */
+static off_t decoded_part_offset(struct bpak_header *header,
+                                 struct bpak_part_header *part)
+{
+    off_t offset = sizeof(*header);
+
+    bpak_foreach_part (header, p) {
+        if (!p->id || p->id == part->id)
+            break;
+
+        offset += p->size + p->pad_bytes;
+    }
+
+    return offset;
+}
+
+/* Tree layout of the hash tree of 'part_id' in 'header' */
+static void part_merkle_options(struct bpak_header *header,
+                                bpak_id_t part_id,
+                                struct bpak_merkle_options *options)
+{
+    struct bpak_meta_header *meta = NULL;
+    uint8_t *block_size = NULL;
+
+    if (bpak_get_meta(header, BPAK_ID_MERKLE_BLOCK_SIZE, part_id, &meta) ==
+        BPAK_OK)
+        block_size = bpak_get_meta_ptr(header, meta, uint8_t);
+
+    bpak_merkle_options_from_meta(block_size, options);
+}
+
+/* Leaves of the output that are unchanged copies of origin leaves have the
+ * same hash as in the origin tree, when both trees use the same salt. The
+ * root hash in the patch meta data is required, a tree built from reused
+ * hashes is only kept when it matches. */
+static void merkle_reuse_start(struct bpak_transport_decode *ctx,
+                               struct bpak_part_header *part,
+                               bpak_id_t tree_id, const uint8_t *salt)
+{
+    struct bpak_part_header *origin_part = NULL;
+    struct bpak_part_header *origin_tree = NULL;
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_merkle_options origin_options;
+    size_t block_size = ctx->merkle_tee.block_size;
+
+    ctx->merkle_reuse_tree = -1;
+    ctx->merkle_reused = 0;
+    ctx->merkle_run_length = 0;
+    ctx->merkle_skipped = 0;
+    ctx->merkle_cache_count = 0;
+
+    if ((ctx->origin_header == NULL) || (ctx->read_origin == NULL))
+        return;
+
+    /* The origin tree is only known for the same part, and in place it
+     * may already be overwritten */
+    if ((ctx->origin_part_count > 0) || (ctx->in_place_buffer != NULL) ||
+        bpak_transport_origin_id(part_transport_meta(ctx->patch_header, part),
+                                 part->id) != part->id)
+        return;
+
+    if (bpak_get_meta(ctx->patch_header,
+                      BPAK_ID_MERKLE_ROOT_HASH,
+                      part->id,
+                      &meta) != BPAK_OK)
+        return;
+
+    if ((bpak_get_part(ctx->origin_header, part->id, &origin_part) !=
+         BPAK_OK) ||
+        (bpak_get_part(ctx->origin_header, tree_id, &origin_tree) != BPAK_OK))
+        return;
+
+    /* Origin leaves are found by their offset in the stored data */
+    if ((origin_part->flags & (BPAK_FLAG_TRANSPORT | BPAK_FLAG_SPARSE)) ||
+        (origin_tree->flags & BPAK_FLAG_TRANSPORT))
+        return;
+
+    /* Both trees must have the same block size */
+    part_merkle_options(ctx->origin_header, part->id, &origin_options);
+
+    if (origin_options.block_size == 0)
+        origin_options.block_size = BPAK_MERKLE_BLOCK_SZ;
+    if (origin_options.block_size != block_size)
+        return;
+
+    size_t origin_length = origin_part->size + origin_part->pad_bytes;
+    ssize_t tree_size = bpak_merkle_compute_tree_size(origin_length,
+                                                      &origin_options);
+
+    if ((tree_size <= 0) || (origin_tree->size != (uint64_t)tree_size))
+        return;
+
+    if (bpak_get_meta(ctx->origin_header,
+                      BPAK_ID_MERKLE_SALT,
+                      part->id,
+                      &meta) != BPAK_OK)
+        return;
+
+    if (memcmp(bpak_get_meta_ptr(ctx->origin_header, meta, uint8_t),
+               salt,
+               32) != 0)
+        return;
+
+    ctx->merkle_reuse_part = bpak_part_offset(ctx->origin_header,
+                                              origin_part) -
+                             sizeof(struct bpak_header) + ctx->origin_offset;
+    ctx->merkle_reuse_tree = bpak_part_offset(ctx->origin_header,
+                                              origin_tree) -
+                             sizeof(struct bpak_header) + ctx->origin_offset;
+    ctx->merkle_reuse_leaves = origin_length / block_size;
+}
+
+/* Unchanged run hook of bspatch, adjacent runs are merged */
+static void merkle_reuse_unchanged(off_t output_position,
+                                   off_t origin_position, size_t length,
+                                   void *user)
+{
+    struct bpak_transport_decode *ctx = (struct bpak_transport_decode *)user;
+    off_t run_length = (off_t)ctx->merkle_run_length;
+
+    if ((run_length > 0) &&
+        (output_position == ctx->merkle_run_output + run_length) &&
+        (origin_position == ctx->merkle_run_origin + run_length)) {
+        ctx->merkle_run_length += length;
+        return;
+    }
+
+    ctx->merkle_run_output = output_position;
+    ctx->merkle_run_origin = origin_position;
+    ctx->merkle_run_length = length;
+}
+
+/* Origin position of the leaf that starts at 'position' in the output, if
+ * the output up to 'end' is an unchanged copy of a whole origin leaf */
+static off_t merkle_reuse_origin(struct bpak_transport_decode *ctx,
+                                 off_t position, off_t end)
+{
+    off_t origin_position;
+    size_t block_size = ctx->merkle_tee.block_size;
+
+    if ((ctx->merkle_run_length == 0) ||
+        (position < ctx->merkle_run_output) ||
+        (end > ctx->merkle_run_output + (off_t)ctx->merkle_run_length))
+        return -1;
+
+    origin_position = ctx->merkle_run_origin +
+                      (position - ctx->merkle_run_output);
+
+    if ((origin_position % block_size) ||
+        ((size_t)(origin_position / block_size) >= ctx->merkle_reuse_leaves))
+        return -1;
+
+    return origin_position;
+}
+
+/* Hash the skipped bytes of the current leaf, they are read from the
+ * origin since the output is a copy of it */
+static int merkle_reuse_flush(struct bpak_transport_decode *ctx)
+{
+    uint8_t chunk[BPAK_CHUNK_BUFFER_LENGTH];
+    size_t position = 0;
+    int rc;
+
+    while (position < ctx->merkle_skipped) {
+        size_t length = BPAK_MIN(ctx->merkle_skipped - position,
+                                 sizeof(chunk));
+
+        if (ctx->read_origin(ctx->merkle_reuse_part +
+                                 ctx->merkle_skipped_origin + position,
+                             chunk,
+                             length,
+                             ctx->user) != (ssize_t)length)
+            return -BPAK_READ_ERROR;
+
+        rc = bpak_merkle_write_chunk(&ctx->merkle_tee, chunk, length);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        position += length;
+    }
+
+    ctx->merkle_skipped = 0;
+    return BPAK_OK;
+}
+
+/* Add the origin hash of the unchanged leaf, origin leaf hashes are read
+ * a chunk at a time */
+static int merkle_reuse_leaf(struct bpak_transport_decode *ctx)
+{
+    struct bpak_merkle_options options = {
+        .block_size = ctx->merkle_tee.block_size,
+    };
+    size_t leaf = ctx->merkle_skipped_origin / options.block_size;
+    size_t hashes_per_chunk = sizeof(ctx->merkle_cache) /
+                              BPAK_MERKLE_HASH_BYTES;
+
+    if ((ctx->merkle_cache_count == 0) || (leaf < ctx->merkle_cache_first) ||
+        (leaf >= ctx->merkle_cache_first + ctx->merkle_cache_count)) {
+        size_t count = BPAK_MIN(ctx->merkle_reuse_leaves - leaf,
+                                hashes_per_chunk);
+        size_t length = count * BPAK_MERKLE_HASH_BYTES;
+        off_t offset =
+            bpak_merkle_tree_leaf_offset(ctx->merkle_reuse_leaves *
+                                             options.block_size,
+                                         &options,
+                                         leaf);
+
+        ctx->merkle_cache_count = 0;
+
+        if ((offset < 0) ||
+            (ctx->read_origin(ctx->merkle_reuse_tree + offset,
+                              ctx->merkle_cache,
+                              length,
+                              ctx->user) != (ssize_t)length))
+            return merkle_reuse_flush(ctx);
+
+        ctx->merkle_cache_first = leaf;
+        ctx->merkle_cache_count = count;
+    }
+
+    ctx->merkle_skipped = 0;
+    ctx->merkle_reused++;
+
+    return bpak_merkle_write_hashes(
+        &ctx->merkle_tee,
+        &ctx->merkle_cache[(leaf - ctx->merkle_cache_first) *
+                           BPAK_MERKLE_HASH_BYTES],
+        1);
+}
+
+/* Feed output at 'offset' to the tee. Leaves that are unchanged copies of
+ * an origin leaf are not hashed, their bytes are skipped until the leaf is
+ * complete and the origin hash is used instead. */
+static int merkle_tee_feed(struct bpak_transport_decode *ctx, off_t offset,
+                           uint8_t *buffer, size_t length)
+{
+    off_t position = offset - ctx->merkle_tee_start;
+    size_t block_size = ctx->merkle_tee.block_size;
+    int rc;
+
+    if (ctx->merkle_reuse_tree < 0)
+        return bpak_merkle_write_chunk(&ctx->merkle_tee, buffer, length);
+
+    while (length > 0) {
+        size_t in_leaf = position % block_size;
+        size_t n = BPAK_MIN(length, block_size - in_leaf);
+        off_t origin_position = -1;
+
+        if (in_leaf == ctx->merkle_skipped) {
+            origin_position = merkle_reuse_origin(ctx,
+                                                  position - in_leaf,
+                                                  position + n);
+        }
+
+        if ((origin_position >= 0) &&
+            ((in_leaf == 0) ||
+             (origin_position == ctx->merkle_skipped_origin))) {
+            ctx->merkle_skipped_origin = origin_position;
+            ctx->merkle_skipped += n;
+
+            if (ctx->merkle_skipped == block_size)
+                rc = merkle_reuse_leaf(ctx);
+            else
+                rc = BPAK_OK;
+        } else {
+            rc = merkle_reuse_flush(ctx);
+
+            if (rc == BPAK_OK)
+                rc = bpak_merkle_write_chunk(&ctx->merkle_tee, buffer, n);
+        }
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        buffer += n;
+        position += n;
+        length -= n;
+    }
+
+    return BPAK_OK;
+}
+
+/* Start hashing the output of 'part' if the package has a hash tree for it
+ * that should be generated. The tree is then built without reading the
+ * decoded data back. */
+static void merkle_tee_start(struct bpak_transport_decode *ctx,
+                             struct bpak_part_header *part)
+{
+    struct bpak_part_header *tree_part = NULL;
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_merkle_options options;
+    bpak_id_t tree_id = bpak_crc32(part->id, (uint8_t *)"-hash-tree", 10);
+
+    ctx->merkle_tee_id = 0;
+
+    /* The tree of a sparse part is generated from the written data */
+    if (part->flags & BPAK_FLAG_SPARSE)
+        return;
+
+    if (bpak_get_part(ctx->patch_header, tree_id, &tree_part) != BPAK_OK)
+        return;
+
+    if (part_decoder_id(ctx->patch_header, tree_part) !=
+        BPAK_ID_MERKLE_GENERATE)
+        return;
+
+    if (bpak_get_meta(ctx->patch_header,
+                      BPAK_ID_MERKLE_SALT,
+                      part->id,
+                      &meta) != BPAK_OK)
+        return;
+
+    uint8_t *salt = bpak_get_meta_ptr(ctx->patch_header, meta, uint8_t);
+    off_t tree_offset = decoded_part_offset(ctx->patch_header, tree_part) -
+                        sizeof(struct bpak_header) + ctx->output_offset;
+
+    part_merkle_options(ctx->patch_header, part->id, &options);
+
+    if (bpak_merkle_init_opts(&ctx->merkle_tee,
+                              part->size + part->pad_bytes,
+                              salt,
+                              32,
+                              ctx->write_output,
+                              ctx->read_output,
+                              tree_offset,
+                              true,
+                              &options,
+                              ctx->user) != BPAK_OK)
+        return;
+
+    bpak_merkle_set_allocator(&ctx->merkle_tee, ctx->allocator);
+
+    ctx->merkle_tee_id = tree_id;
+    ctx->merkle_tee_offset = bpak_part_offset(ctx->patch_header, part) -
+                             sizeof(struct bpak_header) + ctx->output_offset;
+    ctx->merkle_tee_start = ctx->merkle_tee_offset;
+    merkle_reuse_start(ctx, part, tree_id, salt);
+}
+
+/* Feed written output to the tee */
+static void merkle_tee_output(struct bpak_transport_decode *ctx, off_t offset,
+                              uint8_t *buffer, ssize_t bytes_written)
+{
+    if ((bytes_written <= 0) || (ctx->merkle_tee_id == 0))
+        return;
+
+    /* The tree can only be built from sequential output, otherwise it is
+     * generated from the written data as before */
+    if ((offset != ctx->merkle_tee_offset) ||
+        (merkle_tee_feed(ctx, offset, buffer, bytes_written) != BPAK_OK)) {
+        bpak_printf(1, "Merkle tee disabled, output is not sequential\n");
+        ctx->merkle_tee_id = 0;
+        return;
+    }
+
+    ctx->merkle_tee_offset += bytes_written;
+}
+
+/* A tree with origin leaf hashes is only used if the root hash matches,
+ * otherwise it is generated from the written data */
+static bool merkle_reuse_check(struct bpak_transport_decode *ctx,
+                               const bpak_merkle_hash_t roothash)
+{
+    struct bpak_meta_header *meta = NULL;
+    bpak_id_t fs_id;
+
+    if (ctx->merkle_reused == 0)
+        return true;
+
+    bpak_printf(1,
+                "Reused %zu origin merkle leaves\n",
+                ctx->merkle_reused);
+
+    fs_id = bpak_hash_tree_id_to_part_id(ctx->patch_header,
+                                         ctx->merkle_tee_id);
+
+    if ((bpak_get_meta(ctx->patch_header,
+                       BPAK_ID_MERKLE_ROOT_HASH,
+                       fs_id,
+                       &meta) == BPAK_OK) &&
+        (memcmp(bpak_get_meta_ptr(ctx->patch_header, meta, uint8_t),
+                roothash,
+                sizeof(bpak_merkle_hash_t)) == 0))
+        return true;
+
+    bpak_printf(1, "Merkle root hash mismatch, regenerating the tree\n");
+    return false;
+}
+
+static void merkle_tee_finish(struct bpak_transport_decode *ctx)
+{
+    bpak_merkle_hash_t roothash;
+
+    if (ctx->merkle_tee_id == 0)
+        return;
+
+    if ((merkle_reuse_flush(ctx) == BPAK_OK) &&
+        (bpak_merkle_finish(&ctx->merkle_tee, roothash) == BPAK_OK) &&
+        merkle_reuse_check(ctx, roothash)) {
+        ctx->merkle_generated_id = ctx->merkle_tee_id;
+        ctx->merkle_generated_length = bpak_merkle_get_size(&ctx->merkle_tee);
+    }
+
+    ctx->merkle_tee_id = 0;
+}
+
 static ssize_t merkle_generate(struct bpak_transport_decode *ctx)
 {
     int rc;
     struct bpak_part_header *fs_part;
     struct bpak_meta_header *meta;
+    struct bpak_sparse_map sparse;
+    struct bpak_merkle_options options;
     uint8_t chunk_buffer[BPAK_CHUNK_BUFFER_LENGTH];
     uint32_t fs_id = 0;
     uint8_t *salt = NULL;
     size_t bytes_to_process;
     size_t chunk_length;
+    size_t data_length;
 
     /* The part id currently begin processed is for the hash tree,
      *  Locate the filesystem that should be used */
@@ -60,26 +621,45 @@ static ssize_t merkle_generate(struct bpak_transport_decode *ctx)
         return rc;
     }
 
+    /* The tree of a sparse part covers the expanded data */
+    rc = bpak_tables_get_sparse_map(ctx->patch_header, NULL, 0, fs_part,
+                                    &sparse);
+
+    if (rc != BPAK_OK) {
+        bpak_printf(0, "Error: Bad sparse map for part 0x%x\n", fs_id);
+        return rc;
+    }
+
+    data_length = bpak_part_size(fs_part);
+
+    if (fs_part->flags & BPAK_FLAG_SPARSE)
+        data_length = sparse.size;
+
     off_t output_offset = bpak_part_offset(ctx->patch_header, ctx->part) -
                           sizeof(struct bpak_header) + ctx->output_offset;
 
     bpak_printf(0, "Merkle tree at offset: %i\n", output_offset);
 
-    rc = bpak_merkle_init(&ctx->decoders.merkle,
-                          bpak_part_size(fs_part),
-                          salt,
-                          32,
-                          ctx->write_output,
-                          ctx->read_output,
-                          output_offset,
-                          true,
-                          ctx->user);
+    part_merkle_options(ctx->patch_header, fs_id, &options);
+
+    rc = bpak_merkle_init_opts(&ctx->decoders.merkle,
+                               data_length,
+                               salt,
+                               32,
+                               ctx->write_output,
+                               ctx->read_output,
+                               output_offset,
+                               true,
+                               &options,
+                               ctx->user);
 
     if (rc != BPAK_OK) {
         bpak_printf(0, "Error: Could not init bpak merkle\n");
         return rc;
     }
 
+    bpak_merkle_set_allocator(&ctx->decoders.merkle, ctx->allocator);
+
     /* Source data is alwas in the part before the hash tree
      * And the user read/write calls are expected to offset io calls
      * to the hashtree, therefore the data should be at an offset
@@ -104,9 +684,18 @@ static ssize_t merkle_generate(struct bpak_transport_decode *ctx)
             return -BPAK_READ_ERROR;
         }
 
-        rc = bpak_merkle_write_chunk(&ctx->decoders.merkle,
-                                     chunk_buffer,
-                                     chunk_length);
+        if (fs_part->flags & BPAK_FLAG_SPARSE) {
+            rc = bpak_merkle_write_sparse(&ctx->decoders.merkle,
+                                          &sparse,
+                                          bpak_part_size(fs_part) -
+                                              bytes_to_process,
+                                          chunk_buffer,
+                                          chunk_length);
+        } else {
+            rc = bpak_merkle_write_chunk(&ctx->decoders.merkle,
+                                         chunk_buffer,
+                                         chunk_length);
+        }
 
         if (rc != BPAK_OK) {
             bpak_printf(0, "Error: merkle processing failed (%i)\n", rc);
@@ -129,8 +718,604 @@ static ssize_t merkle_generate(struct bpak_transport_decode *ctx)
     return bpak_merkle_get_size(&ctx->decoders.merkle);
 }
 
+/* Check the origin reads of 'part' against the hash tree of its origin
+ * part, the tree is read from the origin as the blocks are verified */
+static int origin_verify_start(struct bpak_transport_decode *ctx,
+                               struct bpak_part_header *part)
+{
+    struct bpak_part_header *origin_part = NULL;
+    struct bpak_part_header *origin_tree = NULL;
+    struct bpak_meta_header *salt_meta = NULL;
+    struct bpak_meta_header *root_meta = NULL;
+    struct bpak_merkle_options options;
+    bpak_id_t origin_id = bpak_transport_origin_id(
+        part_transport_meta(ctx->patch_header, part),
+        part->id);
+    bpak_id_t tree_id = bpak_crc32(origin_id, (uint8_t *)"-hash-tree", 10);
+    size_t block_size;
+    size_t length;
+    ssize_t tree_size;
+    int rc;
+
+    /* In place the origin tree may be overwritten before it is read */
+    if ((ctx->origin_part_count > 0) || (ctx->in_place_buffer != NULL)) {
+        bpak_printf(0,
+                    "Error: The origin of part 0x%x can't be verified as it "
+                    "is read\n",
+                    part->id);
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    if ((bpak_get_part(ctx->origin_header, origin_id, &origin_part) !=
+         BPAK_OK) ||
+        (bpak_get_part(ctx->origin_header, tree_id, &origin_tree) !=
+         BPAK_OK) ||
+        (bpak_get_meta(ctx->origin_header,
+                       BPAK_ID_MERKLE_SALT,
+                       origin_id,
+                       &salt_meta) != BPAK_OK) ||
+        (bpak_get_meta(ctx->origin_header,
+                       BPAK_ID_MERKLE_ROOT_HASH,
+                       origin_id,
+                       &root_meta) != BPAK_OK))
+        goto err_no_tree_out;
+
+    /* Blocks are found by their offset in the stored data */
+    if ((origin_part->flags & (BPAK_FLAG_TRANSPORT | BPAK_FLAG_SPARSE)) ||
+        (origin_tree->flags & BPAK_FLAG_TRANSPORT))
+        goto err_no_tree_out;
+
+    part_merkle_options(ctx->origin_header, origin_id, &options);
+    block_size = (options.block_size > 0) ? options.block_size :
+                                            BPAK_MERKLE_BLOCK_SZ;
+    length = origin_part->size + origin_part->pad_bytes;
+    tree_size = bpak_merkle_compute_tree_size(length, &options);
+
+    if ((tree_size <= 0) || (origin_tree->size != (uint64_t)tree_size))
+        goto err_no_tree_out;
+
+    /* The context is followed by the block buffer */
+    ctx->origin_verify =
+        bpak_allocator_calloc(ctx->allocator,
+                              1,
+                              sizeof(*ctx->origin_verify) + block_size);
+
+    if (ctx->origin_verify == NULL)
+        return -BPAK_FAILED;
+
+    rc = bpak_merkle_verify_init_opts(
+        ctx->origin_verify,
+        length,
+        bpak_get_meta_ptr(ctx->origin_header, salt_meta, uint8_t),
+        32,
+        bpak_get_meta_ptr(ctx->origin_header, root_meta, uint8_t),
+        ctx->read_origin,
+        bpak_part_offset(ctx->origin_header, origin_tree) -
+            sizeof(struct bpak_header) + ctx->origin_offset,
+        &options,
+        ctx->user);
+
+    if (rc != BPAK_OK) {
+        bpak_allocator_free(ctx->allocator, ctx->origin_verify);
+        ctx->origin_verify = NULL;
+        return rc;
+    }
+
+    ctx->origin_verify_offset = bpak_part_offset(ctx->origin_header,
+                                                 origin_part) -
+                                sizeof(struct bpak_header) +
+                                ctx->origin_offset;
+    ctx->origin_verify_length = length;
+    ctx->origin_verify_block = (uint8_t *)&ctx->origin_verify[1];
+    ctx->origin_verify_cached = false;
+    return BPAK_OK;
+
+err_no_tree_out:
+    bpak_printf(0,
+                "Error: Origin part 0x%x has no hash tree to verify it with\n",
+                origin_id);
+    return -BPAK_NOT_SUPPORTED;
+}
+
+static void origin_verify_stop(struct bpak_transport_decode *ctx)
+{
+    if (ctx->origin_verify == NULL)
+        return;
+
+    bpak_merkle_verify_free(ctx->origin_verify);
+    bpak_allocator_free(ctx->allocator, ctx->origin_verify);
+    ctx->origin_verify = NULL;
+}
+
+/* Read origin data in whole tree blocks and check them before they are
+ * passed on. The last block is kept for the small and overlapping reads of
+ * bspatch, whole blocks are verified in 'buffer' itself. */
+static ssize_t origin_verify_read(struct bpak_transport_decode *ctx,
+                                  off_t offset, uint8_t *buffer,
+                                  size_t length)
+{
+    size_t block_size = ctx->origin_verify->tree.block_size;
+    uint64_t position;
+    size_t pos = 0;
+    int rc;
+
+    if (offset < ctx->origin_verify_offset)
+        return -BPAK_READ_ERROR;
+
+    position = offset - ctx->origin_verify_offset;
+
+    while ((pos < length) && (position < ctx->origin_verify_length)) {
+        size_t index = position / block_size;
+        size_t skip = position % block_size;
+        size_t n = BPAK_MIN(length - pos, block_size - skip);
+        uint8_t *block = ctx->origin_verify_block;
+        bool cached = ctx->origin_verify_cached &&
+                      (ctx->origin_verify_index == index);
+
+        if (!cached) {
+            if (n == block_size)
+                block = &buffer[pos];
+            else
+                ctx->origin_verify_cached = false;
+
+            ssize_t bytes_read = ctx->read_origin(ctx->origin_verify_offset +
+                                                      index * block_size,
+                                                  block,
+                                                  block_size,
+                                                  ctx->user);
+
+            if (bytes_read < 0)
+                return bytes_read;
+            if (bytes_read != (ssize_t)block_size)
+                return -BPAK_READ_ERROR;
+
+            rc = bpak_merkle_verify_block(ctx->origin_verify, index, block);
+
+            if (rc != BPAK_OK) {
+                bpak_printf(0,
+                            "Error: Block %zu of the origin of part 0x%x "
+                            "does not match its hash tree (%i)\n",
+                            index,
+                            ctx->part->id,
+                            rc);
+                return rc;
+            }
+
+            if (block == ctx->origin_verify_block) {
+                ctx->origin_verify_index = index;
+                ctx->origin_verify_cached = true;
+            }
+        }
+
+        if (block != &buffer[pos])
+            memcpy(&buffer[pos], &block[skip], n);
+
+        pos += n;
+        position += n;
+    }
+
+    return pos;
+}
+
 #endif // BPAK_CONFIG_MERKLE
 
+static uint64_t progress_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Clock at the start of a decoder call or io, 0 without progress */
+static uint64_t progress_clock(struct bpak_transport_decode *ctx)
+{
+    return (ctx->progress != NULL) ? progress_now() : 0;
+}
+
+/* Account an io call that was started at 'start' */
+static void progress_io(struct bpak_transport_decode *ctx,
+                        enum bpak_transport_stage stage, uint64_t start,
+                        uint64_t *counter, ssize_t length)
+{
+    if (ctx->progress == NULL)
+        return;
+
+    ctx->stats.stage_ns[stage] += progress_now() - start;
+
+    if (length > 0)
+        (*counter) += length;
+}
+
+/* Report the statistics at the end of a decoder call started at 'start' */
+static void progress_report(struct bpak_transport_decode *ctx,
+                            enum bpak_transport_event event, uint64_t start)
+{
+    struct bpak_transport_progress *stats = &ctx->stats;
+    uint64_t now;
+
+    if (ctx->progress == NULL)
+        return;
+
+    now = progress_now();
+    ctx->progress_busy_ns += now - start;
+
+    stats->event = event;
+    stats->bytes_in = ctx->input_position;
+    stats->elapsed_ns = now - ctx->progress_start_ns;
+    stats->stage_ns[BPAK_TRANSPORT_STAGE_CODEC] =
+        ctx->progress_busy_ns - stats->stage_ns[BPAK_TRANSPORT_STAGE_OUTPUT] -
+        stats->stage_ns[BPAK_TRANSPORT_STAGE_ORIGIN];
+    stats->stage_ns[BPAK_TRANSPORT_STAGE_INPUT] =
+        stats->elapsed_ns - ctx->progress_busy_ns;
+
+    ctx->progress(stats, ctx->progress_user);
+}
+
+/* Write output unless the output holds it already. The output is compared
+ * in aligned blocks of the compare buffer and only the blocks that differ
+ * are written. */
+static ssize_t write_changed(struct bpak_transport_decode *ctx, off_t offset,
+                             uint8_t *buffer, size_t length)
+{
+    size_t block = ctx->compare_buffer_length;
+    size_t pos = 0;
+
+    if (ctx->compare_buffer == NULL)
+        return ctx->write_output(offset, buffer, length, ctx->user);
+
+    while (pos < length) {
+        size_t n = BPAK_MIN(length - pos, block - (offset + pos) % block);
+        ssize_t bytes = ctx->read_output(offset + pos,
+                                         ctx->compare_buffer,
+                                         n,
+                                         ctx->user);
+
+        if (bytes < 0)
+            return bytes;
+
+        /* Output past the end of a file reads short */
+        if ((bytes == (ssize_t)n) &&
+            (memcmp(ctx->compare_buffer, &buffer[pos], n) == 0)) {
+            ctx->stats.bytes_unchanged += n;
+        } else {
+            bytes = ctx->write_output(offset + pos, &buffer[pos], n, ctx->user);
+
+            if (bytes < 0)
+                return bytes;
+            if (bytes != (ssize_t)n)
+                return -BPAK_WRITE_ERROR;
+        }
+
+        pos += n;
+    }
+
+    return length;
+}
+
+/* Write out the buffered output range */
+static int write_buffer_flush(struct bpak_transport_decode *ctx)
+{
+    size_t length = ctx->write_end - ctx->write_start;
+    ssize_t bytes_written;
+
+    if (length == 0)
+        return BPAK_OK;
+
+    bytes_written = write_changed(ctx,
+                                  ctx->write_base + ctx->write_start,
+                                  &ctx->write_buffer[ctx->write_start],
+                                  length);
+    ctx->write_start = 0;
+    ctx->write_end = 0;
+
+    if (bytes_written < 0)
+        return bytes_written;
+    if (bytes_written != (ssize_t)length)
+        return -BPAK_WRITE_ERROR;
+
+    return BPAK_OK;
+}
+
+/* Collect contiguous output in the write buffer, a write anywhere else
+ * flushes it first. Whole blocks that arrive aligned while the buffer is
+ * empty are written without copying them. */
+static ssize_t write_buffered(struct bpak_transport_decode *ctx,
+                              off_t offset, uint8_t *buffer, size_t length)
+{
+    int rc;
+    size_t block = ctx->write_buffer_length;
+    size_t pos = 0;
+
+    if (ctx->write_buffer == NULL)
+        return write_changed(ctx, offset, buffer, length);
+
+    while (pos < length) {
+        off_t write_offset = offset + pos;
+        size_t n;
+
+        if (ctx->write_start == ctx->write_end) {
+            if ((write_offset % block == 0) && (length - pos >= block)) {
+                ssize_t bytes_written;
+
+                n = (length - pos) / block * block;
+                bytes_written =
+                    write_changed(ctx, write_offset, &buffer[pos], n);
+
+                if (bytes_written < 0)
+                    return bytes_written;
+                if (bytes_written != (ssize_t)n)
+                    return -BPAK_WRITE_ERROR;
+
+                pos += n;
+                continue;
+            }
+
+            ctx->write_base = write_offset / block * block;
+            ctx->write_start = write_offset - ctx->write_base;
+            ctx->write_end = ctx->write_start;
+        } else if (write_offset != ctx->write_base + (off_t)ctx->write_end) {
+            rc = write_buffer_flush(ctx);
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            continue;
+        }
+
+        n = BPAK_MIN(length - pos, block - ctx->write_end);
+        memcpy(&ctx->write_buffer[ctx->write_end], &buffer[pos], n);
+        ctx->write_end += n;
+        pos += n;
+
+        if (ctx->write_end == block) {
+            rc = write_buffer_flush(ctx);
+
+            if (rc != BPAK_OK)
+                return rc;
+        }
+    }
+
+    return length;
+}
+
+/* Pass 'length' bytes of the in place ring on to the write buffer */
+static int in_place_flush(struct bpak_transport_decode *ctx, size_t length)
+{
+    size_t size = ctx->in_place_length;
+
+    while (length > 0) {
+        size_t index = ctx->in_place_written % size;
+        size_t n = BPAK_MIN(length, size - index);
+        ssize_t bytes_written =
+            write_buffered(ctx,
+                           ctx->in_place_base + ctx->in_place_written,
+                           &ctx->in_place_buffer[index],
+                           n);
+
+        if (bytes_written < 0)
+            return bytes_written;
+        if (bytes_written != (ssize_t)n)
+            return -BPAK_WRITE_ERROR;
+
+        ctx->in_place_written += n;
+        length -= n;
+    }
+
+    return BPAK_OK;
+}
+
+/* Hold the output of an in place part back in the scratch ring, half of
+ * it is passed on whenever it is full. Nothing closer than half the ring
+ * behind the output position is written, which is where the patch may
+ * still read the origin. */
+static ssize_t in_place_write(struct bpak_transport_decode *ctx,
+                              off_t offset, uint8_t *buffer, size_t length)
+{
+    int rc;
+    size_t size = ctx->in_place_length;
+    size_t pos = 0;
+
+    if (offset != ctx->in_place_base + (off_t)ctx->in_place_end)
+        return -BPAK_WRITE_ERROR;
+
+    while (pos < length) {
+        size_t fill = ctx->in_place_end - ctx->in_place_written;
+        size_t index = ctx->in_place_end % size;
+        size_t n;
+
+        if (fill == size) {
+            rc = in_place_flush(ctx, size / 2);
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            continue;
+        }
+
+        n = BPAK_MIN(length - pos, BPAK_MIN(size - fill, size - index));
+        memcpy(&ctx->in_place_buffer[index], &buffer[pos], n);
+        ctx->in_place_end += n;
+        pos += n;
+    }
+
+    return length;
+}
+
+/* The decoders do their io through these when the output is hashed by the
+ * merkle tee, is buffered, is decoded in place, progress is reported or the
+ * library is built with probes */
+static ssize_t decode_write_output(off_t offset, uint8_t *buffer,
+                                   size_t length, void *user)
+{
+    struct bpak_transport_decode *ctx = (struct bpak_transport_decode *)user;
+    uint64_t start = progress_clock(ctx);
+    ssize_t bytes_written;
+
+    BPAK_TRACE2(output__write__start, offset, length);
+    bytes_written =
+        ctx->in_place_active ? in_place_write(ctx, offset, buffer, length) :
+                               write_buffered(ctx, offset, buffer, length);
+    BPAK_TRACE2(output__write__done, offset, bytes_written);
+
+    progress_io(ctx,
+                BPAK_TRANSPORT_STAGE_OUTPUT,
+                start,
+                &ctx->stats.bytes_out,
+                bytes_written);
+#if BPAK_CONFIG_MERKLE == 1
+    merkle_tee_output(ctx, offset, buffer, bytes_written);
+#endif
+    return bytes_written;
+}
+
+/* Reads of output that is still buffered see it once it is written */
+static ssize_t decode_read_output(off_t offset, uint8_t *buffer,
+                                  size_t length, void *user)
+{
+    struct bpak_transport_decode *ctx = (struct bpak_transport_decode *)user;
+
+    if ((ctx->write_start != ctx->write_end) &&
+        (offset < ctx->write_base + (off_t)ctx->write_end) &&
+        (offset + (off_t)length > ctx->write_base + (off_t)ctx->write_start)) {
+        int rc = write_buffer_flush(ctx);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    return ctx->read_output(offset, buffer, length, ctx->user);
+}
+
+static ssize_t decode_read_origin(off_t offset, uint8_t *buffer,
+                                  size_t length, void *user)
+{
+    struct bpak_transport_decode *ctx = (struct bpak_transport_decode *)user;
+    uint64_t start = progress_clock(ctx);
+    ssize_t bytes_read;
+
+    BPAK_TRACE2(origin__read__start, offset, length);
+#if BPAK_CONFIG_MERKLE == 1
+    if (ctx->origin_verify != NULL)
+        bytes_read = origin_verify_read(ctx, offset, buffer, length);
+    else
+#endif
+        bytes_read = ctx->read_origin(offset, buffer, length, ctx->user);
+    BPAK_TRACE2(origin__read__done, offset, bytes_read);
+
+    progress_io(ctx,
+                BPAK_TRANSPORT_STAGE_ORIGIN,
+                start,
+                &ctx->stats.origin_bytes,
+                bytes_read);
+    return bytes_read;
+}
+
+/* Copy the origin part of a reused part to the output, returns the output
+ * length or a negative number */
+static ssize_t decode_reuse_origin(struct bpak_transport_decode *ctx)
+{
+    size_t length = ctx->part->size + ctx->part->pad_bytes;
+    off_t origin_offset = origin_part_offset(ctx, ctx->part);
+    off_t output_offset = bpak_part_offset(ctx->patch_header, ctx->part) -
+                          sizeof(struct bpak_header) + ctx->output_offset;
+
+    if (ctx->keep_reused)
+        return length;
+
+    while (ctx->copy_offset < (off_t)length) {
+        size_t n = BPAK_MIN(ctx->buffer_length, length - ctx->copy_offset);
+        ssize_t bytes = decode_read_origin(origin_offset + ctx->copy_offset,
+                                           ctx->buffer,
+                                           n,
+                                           ctx);
+
+        if (bytes < 0)
+            return bytes;
+        if (bytes != (ssize_t)n)
+            return -BPAK_READ_ERROR;
+
+        bytes = decode_write_output(output_offset + ctx->copy_offset,
+                                    ctx->buffer,
+                                    n,
+                                    ctx);
+
+        if (bytes < 0)
+            return bytes;
+        if (bytes != (ssize_t)n)
+            return -BPAK_WRITE_ERROR;
+
+        ctx->copy_offset += n;
+    }
+
+    return length;
+}
+
+static void decode_prefetch_origin(off_t offset, size_t length, void *user)
+{
+    struct bpak_transport_decode *ctx = (struct bpak_transport_decode *)user;
+    ctx->prefetch_origin(offset, length, ctx->user);
+}
+
+/* Split a read of the virtual origin into reads of the origin parts */
+static ssize_t decode_read_origin_parts(off_t offset, uint8_t *buffer,
+                                        size_t length, void *user)
+{
+    struct bpak_transport_decode *ctx = (struct bpak_transport_decode *)user;
+    uint64_t start = 0;
+    size_t pos = 0;
+
+    for (size_t i = 0; (i < ctx->origin_part_count) && (pos < length); i++) {
+        uint64_t end = start + ctx->origin_part_lengths[i];
+
+        if ((uint64_t)offset + pos < end) {
+            size_t n = BPAK_MIN(length - pos, end - (offset + pos));
+            ssize_t bytes_read =
+                decode_read_origin(ctx->origin_part_offsets[i] +
+                                       (offset + pos - start),
+                                   &buffer[pos],
+                                   n,
+                                   ctx);
+
+            if (bytes_read < 0)
+                return bytes_read;
+
+            pos += bytes_read;
+
+            if ((size_t)bytes_read != n)
+                break;
+        }
+
+        start = end;
+    }
+
+    return pos;
+}
+
+static void decode_prefetch_origin_parts(off_t offset, size_t length,
+                                         void *user)
+{
+    struct bpak_transport_decode *ctx = (struct bpak_transport_decode *)user;
+    uint64_t start = 0;
+
+    for (size_t i = 0; (i < ctx->origin_part_count) && (length > 0); i++) {
+        uint64_t end = start + ctx->origin_part_lengths[i];
+
+        if ((uint64_t)offset < end) {
+            size_t n = BPAK_MIN(length, end - offset);
+
+            ctx->prefetch_origin(ctx->origin_part_offsets[i] +
+                                     (offset - start),
+                                 n,
+                                 ctx->user);
+            offset += n;
+            length -= n;
+        }
+
+        start = end;
+    }
+}
+
 BPAK_EXPORT int bpak_transport_decode_init(
     struct bpak_transport_decode *ctx, uint8_t *buffer, size_t buffer_length,
     struct bpak_header *patch_header, bpak_io_t write_output,
@@ -184,21 +1369,266 @@ bpak_transport_decode_set_origin(struct bpak_transport_decode *ctx,
     if (rc != BPAK_OK)
         return rc;
 
-    patch_package_uuid = bpak_get_meta_ptr(origin_header, meta, uint8_t);
+    patch_package_uuid = bpak_get_meta_ptr(origin_header, meta, uint8_t);
+
+    if (memcmp(origin_package_uuid, patch_package_uuid, 16) != 0)
+        return -BPAK_PACKAGE_UUID_MISMATCH;
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_origin_prefetch(struct bpak_transport_decode *ctx,
+                                          bpak_prefetch_t prefetch_origin)
+{
+    ctx->prefetch_origin = prefetch_origin;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_progress(struct bpak_transport_decode *ctx,
+                                   bpak_transport_progress_t progress,
+                                   void *user)
+{
+    ctx->progress = progress;
+    ctx->progress_user = user;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_allocator(struct bpak_transport_decode *ctx,
+                                    const struct bpak_allocator *allocator)
+{
+    ctx->allocator = allocator;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_threads(struct bpak_transport_decode *ctx,
+                                  unsigned int threads)
+{
+    ctx->threads = threads;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_keep_reused(struct bpak_transport_decode *ctx,
+                                      bool keep)
+{
+    ctx->keep_reused = keep;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_write_buffer(struct bpak_transport_decode *ctx,
+                                       uint8_t *buffer, size_t length)
+{
+    if ((buffer != NULL) && (length == 0))
+        return -BPAK_SIZE_ERROR;
+
+    /* Anything buffered in the old buffer would be lost */
+    if (ctx->write_start != ctx->write_end)
+        return -BPAK_FAILED;
+
+    ctx->write_buffer = buffer;
+    ctx->write_buffer_length = (buffer != NULL) ? length : 0;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_skip_unchanged(struct bpak_transport_decode *ctx,
+                                         uint8_t *buffer, size_t length)
+{
+    if ((buffer != NULL) && (length == 0))
+        return -BPAK_SIZE_ERROR;
+
+    if ((buffer != NULL) && (ctx->read_output == NULL))
+        return -BPAK_NOT_SUPPORTED;
+
+    ctx->compare_buffer = buffer;
+    ctx->compare_buffer_length = (buffer != NULL) ? length : 0;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_verify_origin(struct bpak_transport_decode *ctx,
+                                        bool verify)
+{
+#if BPAK_CONFIG_MERKLE != 1
+    if (verify)
+        return -BPAK_NOT_SUPPORTED;
+#endif
+
+    ctx->verify_origin = verify;
+    return BPAK_OK;
+}
+
+/* The decoder of the current part reads its origin part */
+static bool decoder_reads_origin(struct bpak_transport_decode *ctx,
+                                 struct bpak_part_header *part)
+{
+    if ((ctx->origin_header == NULL) || (ctx->read_origin == NULL))
+        return false;
+
+    switch (ctx->decoder_id) {
+    case BPAK_ID_BSPATCH:
+    case BPAK_ID_BSPATCH_NO_COMP:
+    case BPAK_ID_BSPATCH_LZMA:
+    case BPAK_ID_BSPATCH_ZSTD:
+    case BPAK_ID_BLOCKPATCH:
+        return true;
+    case BPAK_ID_CHUNKPATCH:
+        return origin_part_size(ctx, part) > 0;
+    case BPAK_ID_REUSE_ORIGIN:
+        return !ctx->keep_reused;
+    default:
+        return false;
+    }
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_set_in_place(struct bpak_transport_decode *ctx,
+                                   uint8_t *buffer, size_t length)
+{
+    if ((buffer != NULL) && (length < 2))
+        return -BPAK_SIZE_ERROR;
+
+    /* Output that is held back in the old ring would be lost */
+    if (ctx->in_place_active)
+        return -BPAK_FAILED;
+
+    ctx->in_place_buffer = buffer;
+    ctx->in_place_length = (buffer != NULL) ? (length / 2 * 2) : 0;
+    return BPAK_OK;
+}
+
+/* Parts that read the origin behind the output position are written
+ * through the scratch ring. Reused parts are copied front to back. Both
+ * must start no later than their origin part, so that the output before
+ * them never covers origin data that is still read. */
+static int in_place_start(struct bpak_transport_decode *ctx,
+                          struct bpak_part_header *part)
+{
+    bool bspatch = (ctx->decoder_id == BPAK_ID_BSPATCH) ||
+                   (ctx->decoder_id == BPAK_ID_BSPATCH_NO_COMP) ||
+                   (ctx->decoder_id == BPAK_ID_BSPATCH_LZMA) ||
+                   (ctx->decoder_id == BPAK_ID_BSPATCH_ZSTD);
+    off_t output_offset = bpak_part_offset(ctx->patch_header, part) -
+                          sizeof(struct bpak_header) + ctx->output_offset;
+    uint32_t scratch;
+
+    if ((ctx->decoder_id == BPAK_ID_BLOCKPATCH) ||
+        (ctx->decoder_id == BPAK_ID_CHUNKPATCH) ||
+        (ctx->origin_part_count > 0)) {
+        bpak_printf(0,
+                    "Error: Part 0x%x can't be decoded in place\n",
+                    part->id);
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    /* Without an origin the decoders fail on their own */
+    if ((!bspatch && (ctx->decoder_id != BPAK_ID_REUSE_ORIGIN)) ||
+        (ctx->origin_header == NULL))
+        return BPAK_OK;
+
+    if (output_offset > origin_part_offset(ctx, part)) {
+        bpak_printf(0,
+                    "Error: Part 0x%x is after its origin part, it can't be "
+                    "decoded in place\n",
+                    part->id);
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    if (!bspatch)
+        return BPAK_OK;
+
+    scratch = bpak_transport_in_place_scratch(
+        part_transport_meta(ctx->patch_header, part));
+
+    if (scratch == 0) {
+        bpak_printf(0,
+                    "Error: Part 0x%x is not encoded for in place "
+                    "decoding\n",
+                    part->id);
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    if (scratch > ctx->in_place_length) {
+        bpak_printf(0,
+                    "Error: Part 0x%x needs %u bytes of in place scratch\n",
+                    part->id,
+                    scratch);
+        return -BPAK_SIZE_ERROR;
+    }
+
+    ctx->in_place_active = true;
+    ctx->in_place_base = output_offset;
+    ctx->in_place_written = 0;
+    ctx->in_place_end = 0;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_transport_decode_start(struct bpak_transport_decode *ctx,
+                                            struct bpak_part_header *part)
+{
+    int rc;
+    ssize_t bytes_written;
+    uint64_t start = progress_clock(ctx);
+
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->stats.part_id = part->id;
+    ctx->progress_start_ns = start;
+    ctx->progress_busy_ns = 0;
+
+    ctx->part = part;
+    ctx->decoder_id = part_decoder_id(ctx->patch_header, part);
+    ctx->input_position = 0;
+    ctx->in_place_active = false;
+
+    BPAK_TRACE3(part__start, part->id, ctx->decoder_id, bpak_part_size(part));
+
+    /* Decoders write through these, the merkle tee, the progress counters
+     * and the io probes wrap them */
+    bpak_io_t read_origin = ctx->read_origin;
+    bpak_io_t write_output = ctx->write_output;
+    bpak_io_t read_output = ctx->read_output;
+    bpak_prefetch_t prefetch_origin = ctx->prefetch_origin;
+    void *user = ctx->user;
+    bool wrap_io = (ctx->progress != NULL) || (ctx->write_buffer != NULL) ||
+                   (ctx->compare_buffer != NULL) || (BPAK_CONFIG_TRACE == 1);
+
+    rc = origin_parts_start(ctx, part);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (ctx->origin_part_count > 0)
+        wrap_io = true;
+
+    if (ctx->in_place_buffer != NULL) {
+        rc = in_place_start(ctx, part);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        wrap_io = true;
+    }
+
+#if BPAK_CONFIG_MERKLE == 1
+    origin_verify_stop(ctx);
 
-    if (memcmp(origin_package_uuid, patch_package_uuid, 16) != 0)
-        return -BPAK_PACKAGE_UUID_MISMATCH;
+    if (ctx->verify_origin && decoder_reads_origin(ctx, part)) {
+        rc = origin_verify_start(ctx, part);
 
-    return BPAK_OK;
-}
+        if (rc != BPAK_OK)
+            return rc;
 
-BPAK_EXPORT int bpak_transport_decode_start(struct bpak_transport_decode *ctx,
-                                            struct bpak_part_header *part)
-{
-    int rc;
-    struct bpak_meta_header *meta = NULL;
-    ssize_t bytes_written;
+        wrap_io = true;
+    }
+#endif
 
+    /* A part that can't be decoded in place is refused before the header
+     * of the origin is overwritten */
     bytes_written = ctx->write_output_header(0,
                                              (uint8_t *)ctx->patch_header,
                                              sizeof(struct bpak_header),
@@ -209,26 +1639,43 @@ BPAK_EXPORT int bpak_transport_decode_start(struct bpak_transport_decode *ctx,
     if (bytes_written != sizeof(struct bpak_header))
         return -BPAK_WRITE_ERROR;
 
-    ctx->part = part;
-    ctx->decoder_id = 0;
+#if BPAK_CONFIG_MERKLE == 1
+    ctx->merkle_tee_id = 0;
 
-    /* Check if there is any transport meta data for this part in the header */
-    if (part->flags & BPAK_FLAG_TRANSPORT) {
-        if (bpak_get_meta(ctx->patch_header,
-                          BPAK_ID_BPAK_TRANSPORT,
-                          part->id,
-                          &meta) == BPAK_OK) {
-            ctx->decoder_id =
-                bpak_get_meta_ptr(ctx->patch_header, meta,
-                                  struct bpak_transport_meta)->alg_id_decode;
-        }
+    if (ctx->decoder_id != BPAK_ID_MERKLE_GENERATE)
+        merkle_tee_start(ctx, part);
+
+    if (ctx->merkle_tee_id != 0)
+        wrap_io = true;
+#endif
+
+    if (wrap_io) {
+        read_origin = decode_read_origin;
+        write_output = decode_write_output;
+        if (read_output != NULL)
+            read_output = decode_read_output;
+        if (prefetch_origin != NULL)
+            prefetch_origin = decode_prefetch_origin;
+        user = ctx;
+    }
+
+    if (ctx->origin_part_count > 0) {
+        read_origin = decode_read_origin_parts;
+        if (prefetch_origin != NULL)
+            prefetch_origin = decode_prefetch_origin_parts;
     }
 
     switch (ctx->decoder_id) {
     case BPAK_ID_BSPATCH: /* heatshrink decompressor*/
     case BPAK_ID_BSPATCH_NO_COMP:
-    case BPAK_ID_BSPATCH_LZMA: {
-        if (ctx->read_origin == NULL) {
+    case BPAK_ID_BSPATCH_LZMA:
+    case BPAK_ID_BSPATCH_ZSTD:
+    case BPAK_ID_DECOMPRESS_HS:
+    case BPAK_ID_DECOMPRESS_LZMA:
+    case BPAK_ID_DECOMPRESS_ZSTD: {
+        bool raw = decoder_is_raw(ctx->decoder_id);
+
+        if ((ctx->read_origin == NULL) && !raw) {
             /* bspach requires the origin stream */
             return -BPAK_PATCH_READ_ORIGIN_ERROR;
         }
@@ -238,12 +1685,17 @@ BPAK_EXPORT int bpak_transport_decode_start(struct bpak_transport_decode *ctx,
 
         enum bpak_compression compression;
 
-        if (ctx->decoder_id == BPAK_ID_BSPATCH)
+        if ((ctx->decoder_id == BPAK_ID_BSPATCH) ||
+            (ctx->decoder_id == BPAK_ID_DECOMPRESS_HS))
             compression = BPAK_COMPRESSION_HS;
         else if (ctx->decoder_id == BPAK_ID_BSPATCH_NO_COMP)
             compression = BPAK_COMPRESSION_NONE;
-        else if (ctx->decoder_id == BPAK_ID_BSPATCH_LZMA)
+        else if ((ctx->decoder_id == BPAK_ID_BSPATCH_LZMA) ||
+                 (ctx->decoder_id == BPAK_ID_DECOMPRESS_LZMA))
             compression = BPAK_COMPRESSION_LZMA;
+        else if ((ctx->decoder_id == BPAK_ID_BSPATCH_ZSTD) ||
+                 (ctx->decoder_id == BPAK_ID_DECOMPRESS_ZSTD))
+            compression = BPAK_COMPRESSION_ZSTD;
         else
             return -BPAK_UNSUPPORTED_COMPRESSION;
 
@@ -251,20 +1703,113 @@ BPAK_EXPORT int bpak_transport_decode_start(struct bpak_transport_decode *ctx,
         off_t output_offset = bpak_part_offset(ctx->patch_header, part) -
                               sizeof(struct bpak_header) + ctx->output_offset;
 
-        off_t origin_offset = bpak_part_offset(ctx->origin_header, part) -
-                              sizeof(struct bpak_header) + ctx->origin_offset;
+        off_t origin_offset = raw ? 0 : origin_part_offset(ctx, part);
 
         rc = bpak_bspatch_init(&ctx->decoders.bspatch,
                                ctx->buffer,
                                ctx->buffer_length,
                                patch_input_length,
-                               ctx->read_origin,
+                               raw ? NULL : read_origin,
                                origin_offset,
-                               ctx->write_output,
+                               write_output,
                                output_offset,
                                compression,
-                               ctx->user);
+                               user);
+
+        if ((rc == BPAK_OK) && raw)
+            rc = bpak_bspatch_set_raw(&ctx->decoders.bspatch);
+
+        /* The part has transport meta, otherwise there is no decoder id */
+        if (rc == BPAK_OK) {
+            struct bpak_transport_meta *tm =
+                part_transport_meta(ctx->patch_header, part);
+            rc = bpak_bspatch_check_heatshrink_params(
+                &ctx->decoders.bspatch,
+                (const struct bpak_transport_heatshrink_params *)tm->data);
+
+            if ((rc == BPAK_OK) && (tm->data[BPAK_BSDIFF_REVISION_OFFSET] >
+                                    BPAK_BSDIFF_REVISION_COPY)) {
+                bpak_printf(0,
+                            "Error: Unknown bsdiff revision %u\n",
+                            tm->data[BPAK_BSDIFF_REVISION_OFFSET]);
+                rc = -BPAK_NOT_SUPPORTED;
+            }
+        }
 
+        if ((rc == BPAK_OK) && (ctx->allocator != NULL)) {
+            rc = bpak_bspatch_set_allocator(&ctx->decoders.bspatch,
+                                            ctx->allocator);
+        }
+
+        if ((rc == BPAK_OK) && (ctx->threads > 1)) {
+            rc = bpak_bspatch_set_threads(&ctx->decoders.bspatch,
+                                          ctx->threads);
+        }
+
+        if ((rc == BPAK_OK) && (prefetch_origin != NULL)) {
+            rc = bpak_bspatch_set_prefetch(&ctx->decoders.bspatch,
+                                           prefetch_origin);
+        }
+
+#if BPAK_CONFIG_MERKLE == 1
+        if ((rc == BPAK_OK) && (ctx->merkle_tee_id != 0) &&
+            (ctx->merkle_reuse_tree >= 0)) {
+            rc = bpak_bspatch_set_unchanged_hook(&ctx->decoders.bspatch,
+                                                 merkle_reuse_unchanged);
+        }
+#endif
+
+    } break;
+    case BPAK_ID_BLOCKPATCH: {
+        if (ctx->read_origin == NULL)
+            return -BPAK_PATCH_READ_ORIGIN_ERROR;
+
+        if (ctx->origin_part_count > 0)
+            return -BPAK_NOT_SUPPORTED;
+
+        off_t output_offset = bpak_part_offset(ctx->patch_header, part) -
+                              sizeof(struct bpak_header) + ctx->output_offset;
+
+        off_t origin_offset = origin_part_offset(ctx, part);
+
+        rc = bpak_blockpatch_init(&ctx->decoders.blockpatch,
+                                  ctx->buffer,
+                                  ctx->buffer_length,
+                                  read_origin,
+                                  origin_offset,
+                                  write_output,
+                                  output_offset,
+                                  user);
+    } break;
+    case BPAK_ID_CHUNKPATCH: {
+        /* Without an origin every chunk is taken from the chunk store */
+        size_t origin_length = 0;
+        off_t origin_offset = 0;
+
+        if (ctx->read_origin != NULL) {
+            origin_length = origin_part_size(ctx, part);
+            origin_offset = origin_part_offset(ctx, part);
+        }
+
+        off_t output_offset = bpak_part_offset(ctx->patch_header, part) -
+                              sizeof(struct bpak_header) + ctx->output_offset;
+
+        rc = bpak_chunkpatch_init(&ctx->decoders.chunkpatch,
+                                  ctx->buffer,
+                                  ctx->buffer_length,
+                                  bpak_part_size(part),
+                                  (origin_length > 0) ? read_origin : NULL,
+                                  origin_offset,
+                                  origin_length,
+                                  write_output,
+                                  read_output,
+                                  output_offset,
+                                  user);
+
+        if (rc == BPAK_OK) {
+            rc = bpak_chunkpatch_set_allocator(&ctx->decoders.chunkpatch,
+                                               ctx->allocator);
+        }
     } break;
 #if BPAK_CONFIG_MERKLE == 1
     case BPAK_ID_MERKLE_GENERATE:
@@ -273,6 +1818,18 @@ BPAK_EXPORT int bpak_transport_decode_start(struct bpak_transport_decode *ctx,
         rc = BPAK_OK;
         break;
 #endif
+    case BPAK_ID_REUSE_ORIGIN:
+        /* The part is copied from the origin in the final call */
+        if (((ctx->read_origin == NULL) && !ctx->keep_reused) ||
+            (ctx->origin_part_count > 0))
+            return -BPAK_PATCH_READ_ORIGIN_ERROR;
+
+        if (origin_part_size(ctx, part) != part->size + part->pad_bytes)
+            return -BPAK_SIZE_ERROR;
+
+        ctx->copy_offset = 0;
+        rc = BPAK_OK;
+        break;
     case 0: /* Copy data */
         ctx->copy_offset = 0;
         rc = BPAK_OK;
@@ -281,6 +1838,9 @@ BPAK_EXPORT int bpak_transport_decode_start(struct bpak_transport_decode *ctx,
         return -BPAK_NOT_SUPPORTED;
     }
 
+    if (rc == BPAK_OK)
+        progress_report(ctx, BPAK_TRANSPORT_PART_START, start);
+
     return rc;
 }
 
@@ -289,14 +1849,25 @@ bpak_transport_decode_write_chunk(struct bpak_transport_decode *ctx,
                                   uint8_t *buffer, size_t length)
 {
     int rc;
+    uint64_t start = progress_clock(ctx);
 
     switch (ctx->decoder_id) {
     case BPAK_ID_BSPATCH_NO_COMP:
     case BPAK_ID_BSPATCH_LZMA:
+    case BPAK_ID_BSPATCH_ZSTD:
     case BPAK_ID_BSPATCH: /* id("bspatch") heatshrink decompressor*/
+    case BPAK_ID_DECOMPRESS_HS:
+    case BPAK_ID_DECOMPRESS_LZMA:
+    case BPAK_ID_DECOMPRESS_ZSTD:
     {
         rc = bpak_bspatch_write(&ctx->decoders.bspatch, buffer, length);
     } break;
+    case BPAK_ID_BLOCKPATCH:
+        rc = bpak_blockpatch_write(&ctx->decoders.blockpatch, buffer, length);
+        break;
+    case BPAK_ID_CHUNKPATCH:
+        rc = bpak_chunkpatch_write(&ctx->decoders.chunkpatch, buffer, length);
+        break;
     case 0: /* Copy data */
     {
         off_t write_offset = bpak_part_offset(ctx->patch_header, ctx->part) -
@@ -304,7 +1875,8 @@ bpak_transport_decode_write_chunk(struct bpak_transport_decode *ctx,
                              ctx->copy_offset;
 
         ssize_t bytes_written =
-            ctx->write_output(write_offset, buffer, length, ctx->user);
+            decode_write_output(write_offset, buffer, length, ctx);
+
         if (bytes_written < 0)
             return bytes_written;
         if (bytes_written != (ssize_t)length)
@@ -313,31 +1885,208 @@ bpak_transport_decode_write_chunk(struct bpak_transport_decode *ctx,
         ctx->copy_offset += bytes_written;
         rc = 0;
     } break;
+    case BPAK_ID_REUSE_ORIGIN:
+        /* Nothing is stored for the part */
+        rc = (length > 0) ? -BPAK_SIZE_ERROR : BPAK_OK;
+        break;
     default:
         return -BPAK_NOT_SUPPORTED;
     }
 
+    if (rc == BPAK_OK) {
+        ctx->input_position += length;
+        progress_report(ctx, BPAK_TRANSPORT_PART_UPDATE, start);
+    }
+
     return rc;
 }
 
+BPAK_EXPORT int
+bpak_transport_decode_next_input(struct bpak_transport_decode *ctx,
+                                 uint64_t *offset, uint64_t *length)
+{
+    int rc;
+    size_t part_length = bpak_part_size(ctx->part);
+
+    switch (ctx->decoder_id) {
+    case BPAK_ID_CHUNKPATCH:
+        rc = bpak_chunkpatch_next_input(&ctx->decoders.chunkpatch,
+                                        offset,
+                                        length);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        ctx->input_position = *offset;
+        break;
+#if BPAK_CONFIG_MERKLE == 1
+    case BPAK_ID_MERKLE_GENERATE:
+        /* Generated from the output, the input is not used */
+        ctx->input_position = part_length;
+        *offset = part_length;
+        *length = 0;
+        break;
+#endif
+    default:
+        *offset = ctx->input_position;
+        *length = part_length - ctx->input_position;
+        break;
+    }
+
+    return BPAK_OK;
+}
+
+static uint32_t checkpoint_crc(const struct bpak_transport_checkpoint *cp)
+{
+    struct bpak_transport_checkpoint tmp = *cp;
+
+    tmp.crc = 0;
+    return bpak_crc32(0, (const uint8_t *)&tmp, sizeof(tmp));
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_checkpoint(struct bpak_transport_decode *ctx,
+                                 struct bpak_transport_checkpoint *checkpoint)
+{
+    int rc;
+
+    memset(checkpoint, 0, sizeof(*checkpoint));
+
+    /* In place the origin that a resumed part would read is overwritten */
+    if (ctx->in_place_buffer != NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    /* The output before the checkpoint must be written */
+    rc = write_buffer_flush(ctx);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    switch (ctx->decoder_id) {
+    case BPAK_ID_BSPATCH_NO_COMP:
+    case BPAK_ID_BSPATCH:
+    case BPAK_ID_DECOMPRESS_HS:
+        rc = bpak_bspatch_save(&ctx->decoders.bspatch, &checkpoint->bspatch);
+        break;
+    case BPAK_ID_REUSE_ORIGIN:
+    case 0: /* Copy data */
+        rc = BPAK_OK;
+        break;
+    default:
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    checkpoint->magic = BPAK_TRANSPORT_CHECKPOINT_MAGIC;
+    checkpoint->part_id = ctx->part->id;
+    checkpoint->decoder_id = ctx->decoder_id;
+    checkpoint->input_position = ctx->input_position;
+    checkpoint->copy_offset = ctx->copy_offset;
+    checkpoint->crc = checkpoint_crc(checkpoint);
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int
+bpak_transport_decode_resume(struct bpak_transport_decode *ctx,
+                             struct bpak_part_header *part,
+                             const struct bpak_transport_checkpoint *checkpoint)
+{
+    int rc;
+
+    if ((checkpoint->magic != BPAK_TRANSPORT_CHECKPOINT_MAGIC) ||
+        (checkpoint->crc != checkpoint_crc(checkpoint))) {
+        bpak_printf(0, "Error: Invalid transport checkpoint\n");
+        return -BPAK_FAILED;
+    }
+
+    if (ctx->in_place_buffer != NULL)
+        return -BPAK_NOT_SUPPORTED;
+
+    if ((checkpoint->part_id != part->id) ||
+        (checkpoint->input_position > bpak_part_size(part))) {
+        bpak_printf(0, "Error: Checkpoint is not for part 0x%x\n", part->id);
+        return -BPAK_FAILED;
+    }
+
+    rc = bpak_transport_decode_start(ctx, part);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (ctx->decoder_id != checkpoint->decoder_id)
+        return -BPAK_FAILED;
+
+#if BPAK_CONFIG_MERKLE == 1
+    /* The hashes of the output before the checkpoint are lost */
+    ctx->merkle_tee_id = 0;
+#endif
+
+    switch (ctx->decoder_id) {
+    case BPAK_ID_BSPATCH_NO_COMP:
+    case BPAK_ID_BSPATCH:
+    case BPAK_ID_DECOMPRESS_HS:
+        rc = bpak_bspatch_restore(&ctx->decoders.bspatch,
+                                  &checkpoint->bspatch);
+        break;
+    case BPAK_ID_REUSE_ORIGIN:
+    case 0: /* Copy data */
+        ctx->copy_offset = checkpoint->copy_offset;
+        rc = BPAK_OK;
+        break;
+    default:
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    ctx->input_position = checkpoint->input_position;
+    return BPAK_OK;
+}
+
 BPAK_EXPORT int bpak_transport_decode_finish(struct bpak_transport_decode *ctx)
 {
+    int rc;
     ssize_t bytes_written;
     ssize_t output_length = 0;
+    uint64_t start = progress_clock(ctx);
 
     switch (ctx->decoder_id) {
     case BPAK_ID_BSPATCH_NO_COMP:
     case BPAK_ID_BSPATCH_LZMA:
+    case BPAK_ID_BSPATCH_ZSTD:
     case BPAK_ID_BSPATCH: /* id("bspatch") heatshrink decompressor*/
+    case BPAK_ID_DECOMPRESS_HS:
+    case BPAK_ID_DECOMPRESS_LZMA:
+    case BPAK_ID_DECOMPRESS_ZSTD:
     {
         output_length = bpak_bspatch_final(&ctx->decoders.bspatch);
+        bspatch_print_stats(ctx);
         bpak_bspatch_free(&ctx->decoders.bspatch);
     } break;
+    case BPAK_ID_BLOCKPATCH:
+        output_length = bpak_blockpatch_final(&ctx->decoders.blockpatch);
+        break;
+    case BPAK_ID_CHUNKPATCH:
+        output_length = bpak_chunkpatch_final(&ctx->decoders.chunkpatch);
+        bpak_chunkpatch_free(&ctx->decoders.chunkpatch);
+        break;
 #if BPAK_CONFIG_MERKLE == 1
     case BPAK_ID_MERKLE_GENERATE: /* id("merkle-generate") */
-        output_length = merkle_generate(ctx);
+        if (ctx->merkle_generated_id == ctx->part->id) {
+            /* Already built while the filesystem was written */
+            output_length = ctx->merkle_generated_length;
+        } else {
+            output_length = merkle_generate(ctx);
+        }
         break;
 #endif
+    case BPAK_ID_REUSE_ORIGIN:
+        output_length = decode_reuse_origin(ctx);
+        break;
     case 0: /* Copy data */
         output_length = bpak_part_size(ctx->part);
         break;
@@ -345,6 +2094,10 @@ BPAK_EXPORT int bpak_transport_decode_finish(struct bpak_transport_decode *ctx)
         return -BPAK_NOT_SUPPORTED;
     }
 
+#if BPAK_CONFIG_MERKLE == 1
+    origin_verify_stop(ctx);
+#endif
+
     if (output_length < 0)
         return output_length;
 
@@ -359,8 +2112,26 @@ BPAK_EXPORT int bpak_transport_decode_finish(struct bpak_transport_decode *ctx)
         return -BPAK_SIZE_ERROR;
     }
 
+    if (ctx->in_place_active) {
+        rc = in_place_flush(ctx, ctx->in_place_end - ctx->in_place_written);
+        ctx->in_place_active = false;
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    rc = write_buffer_flush(ctx);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+#if BPAK_CONFIG_MERKLE == 1
+    merkle_tee_finish(ctx);
+#endif
+
     /* Update part header to indicate that the part has been decoded */
-    ctx->part->flags &= ~BPAK_FLAG_TRANSPORT;
+    ctx->part->flags &=
+        ~(BPAK_FLAG_TRANSPORT | BPAK_FLAG_REUSE_ORIGIN | BPAK_FLAG_AUTO_MASK);
     ctx->part->transport_size = 0;
 
     bytes_written = ctx->write_output_header(0,
@@ -372,11 +2143,272 @@ BPAK_EXPORT int bpak_transport_decode_finish(struct bpak_transport_decode *ctx)
         return bytes_written;
     if (bytes_written != sizeof(struct bpak_header))
         return -BPAK_WRITE_ERROR;
+
+    if (ctx->compare_buffer != NULL) {
+        bpak_printf(1,
+                    "Part 0x%x: %llu bytes unchanged\n",
+                    ctx->part->id,
+                    (unsigned long long)ctx->stats.bytes_unchanged);
+    }
+
+    ctx->stats.bytes_out = output_length;
+    progress_report(ctx, BPAK_TRANSPORT_PART_DONE, start);
+    BPAK_TRACE2(part__done, ctx->part->id, output_length);
     return BPAK_OK;
 }
 
 BPAK_EXPORT void bpak_transport_decode_free(struct bpak_transport_decode *ctx)
 {
-    /* Nothing to implement so far */
-    (void)ctx;
+    /* Output of a failed part that is still buffered is dropped */
+    ctx->write_start = 0;
+    ctx->write_end = 0;
+    ctx->in_place_active = false;
+#if BPAK_CONFIG_MERKLE == 1
+    origin_verify_stop(ctx);
+#endif
+}
+
+#if BPAK_CONFIG_LZMA == 1
+static void *estimate_lzma_alloc(void *opaque, size_t nmemb, size_t size)
+{
+    (void)opaque;
+    return bpak_calloc(nmemb, size);
+}
+
+static void estimate_lzma_free(void *opaque, void *ptr)
+{
+    (void)opaque;
+    bpak_free(ptr);
+}
+
+/* Dictionary size of the LZMA2 filter in the first block header of the xz
+ * stream at 'offset', 0 when it can't be read */
+static uint32_t estimate_xz_dict_size(bpak_io_t read_input, off_t offset,
+                                      size_t length, void *user)
+{
+    uint8_t buf[LZMA_STREAM_HEADER_SIZE + LZMA_BLOCK_HEADER_SIZE_MAX];
+    const lzma_allocator allocator = {
+        .alloc = estimate_lzma_alloc,
+        .free = estimate_lzma_free,
+    };
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_stream_flags flags;
+    lzma_block block;
+    uint32_t dict_size = 0;
+    ssize_t nread;
+
+    nread = read_input(offset, buf, BPAK_MIN(sizeof(buf), length), user);
+
+    if (nread <= LZMA_STREAM_HEADER_SIZE)
+        return 0;
+
+    if (lzma_stream_header_decode(&flags, buf) != LZMA_OK)
+        return 0;
+
+    memset(&block, 0, sizeof(block));
+    block.version = 0;
+    block.check = flags.check;
+    block.header_size =
+        lzma_block_header_size_decode(buf[LZMA_STREAM_HEADER_SIZE]);
+    block.filters = filters;
+
+    if ((buf[LZMA_STREAM_HEADER_SIZE] == 0) ||
+        (LZMA_STREAM_HEADER_SIZE + block.header_size > (size_t)nread))
+        return 0;
+
+    if (lzma_block_header_decode(&block,
+                                 &allocator,
+                                 &buf[LZMA_STREAM_HEADER_SIZE]) != LZMA_OK)
+        return 0;
+
+    for (unsigned int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+        if (filters[i].id == LZMA_FILTER_LZMA2)
+            dict_size =
+                ((const lzma_options_lzma *)filters[i].options)->dict_size;
+
+        bpak_free(filters[i].options);
+    }
+
+    return dict_size;
+}
+
+/* Dictionary size of the encoder settings in the transport meta data */
+static uint32_t estimate_meta_dict_size(struct bpak_transport_meta *tm)
+{
+    const struct bpak_transport_lzma_params *params =
+        (const struct bpak_transport_lzma_params *)tm->data;
+    uint32_t preset = LZMA_PRESET_DEFAULT;
+    lzma_options_lzma opt_lzma2;
+
+    if (params->dict_size != 0)
+        return params->dict_size;
+
+    if (params->preset > 0)
+        preset = params->preset - 1;
+
+    if (lzma_lzma_preset(&opt_lzma2, preset))
+        return 0;
+
+    return opt_lzma2.dict_size;
+}
+#endif
+
+#if BPAK_CONFIG_MERKLE == 1
+/* Hash tree work buffers of the tree of 'fs_id', the decoder hashes with
+ * one job */
+static size_t estimate_merkle_heap_size(struct bpak_header *patch_header,
+                                        bpak_id_t fs_id)
+{
+    struct bpak_merkle_context merkle;
+    struct bpak_merkle_options options;
+
+    part_merkle_options(patch_header, fs_id, &options);
+
+    memset(&merkle, 0, sizeof(merkle));
+    merkle.jobs = 1;
+    merkle.block_size = (options.block_size != 0) ? options.block_size :
+                                                    BPAK_MERKLE_BLOCK_SZ;
+    return bpak_merkle_heap_size(&merkle);
+}
+#endif
+
+BPAK_EXPORT int
+bpak_transport_decode_estimate(struct bpak_header *patch_header,
+                               bpak_io_t read_input, void *user,
+                               struct bpak_transport_estimate *estimate)
+{
+    int rc;
+    size_t merkle_heap_size = 0;
+
+    memset(estimate, 0, sizeof(*estimate));
+    estimate->output_bytes = sizeof(struct bpak_header);
+
+    bpak_foreach_part (patch_header, part) {
+        if (part->id == 0)
+            break;
+
+        struct bpak_transport_meta *tm =
+            part_transport_meta(patch_header, part);
+        uint64_t output_length = part->size + part->pad_bytes;
+        enum bpak_compression compression;
+        uint32_t dict_size = 0;
+        size_t heap_size;
+
+        estimate->input_bytes += bpak_part_size(part);
+        estimate->output_bytes += output_length;
+
+        switch (part_decoder_id(patch_header, part)) {
+        case 0: /* Copy data */
+            continue;
+        case BPAK_ID_BLOCKPATCH:
+        case BPAK_ID_REUSE_ORIGIN:
+            estimate->origin_bytes += output_length;
+            continue;
+        case BPAK_ID_CHUNKPATCH: {
+            uint8_t header[BPAK_CHUNKDIFF_HEADER_LENGTH];
+            uint32_t chunk_count = 0;
+
+            if ((read_input != NULL) &&
+                (read_input(bpak_part_offset(patch_header, part) -
+                                sizeof(struct bpak_header),
+                            header,
+                            sizeof(header),
+                            user) == sizeof(header))) {
+                chunk_count = header[4] | (header[5] << 8) |
+                              (header[6] << 16) | ((uint32_t)header[7] << 24);
+            } else {
+                /* At most one chunk per BPAK_CHUNKDIFF_MIN_SIZE */
+                chunk_count = output_length / BPAK_CHUNKDIFF_MIN_SIZE + 1;
+            }
+
+            heap_size = bpak_chunkpatch_heap_size(chunk_count);
+
+            if (heap_size > estimate->heap_size)
+                estimate->heap_size = heap_size;
+
+            /* The origin, about the size of the output, is split into
+             * chunks once and then chunks are copied from it */
+            estimate->origin_bytes += 2 * output_length;
+            continue;
+        }
+#if BPAK_CONFIG_MERKLE == 1
+        case BPAK_ID_MERKLE_GENERATE: {
+            struct bpak_part_header *fs_part = NULL;
+            bpak_id_t fs_id =
+                bpak_hash_tree_id_to_part_id(patch_header, part->id);
+
+            if ((fs_id == 0) ||
+                (bpak_get_part(patch_header, fs_id, &fs_part) != BPAK_OK))
+                return -BPAK_MISSING_META_DATA;
+
+            estimate->merkle_bytes += fs_part->size + fs_part->pad_bytes;
+            heap_size = estimate_merkle_heap_size(patch_header, fs_id);
+
+            if (heap_size > merkle_heap_size)
+                merkle_heap_size = heap_size;
+            continue;
+        }
+#endif
+        case BPAK_ID_BSPATCH:
+        case BPAK_ID_DECOMPRESS_HS: {
+            const struct bpak_transport_heatshrink_params *params =
+                (const struct bpak_transport_heatshrink_params *)tm->data;
+            uint8_t window_bits = BPAK_CONFIG_HS_WINDOW_BITS;
+
+            if (params->window_bits != 0)
+                window_bits = params->window_bits;
+            if (window_bits > estimate->hs_window_bits)
+                estimate->hs_window_bits = window_bits;
+
+            compression = BPAK_COMPRESSION_HS;
+        } break;
+        case BPAK_ID_BSPATCH_NO_COMP:
+            compression = BPAK_COMPRESSION_NONE;
+            break;
+#if BPAK_CONFIG_LZMA == 1
+        case BPAK_ID_BSPATCH_LZMA:
+        case BPAK_ID_DECOMPRESS_LZMA:
+            if (read_input != NULL) {
+                off_t offset = bpak_part_offset(patch_header, part) -
+                               sizeof(struct bpak_header);
+
+                dict_size = estimate_xz_dict_size(read_input,
+                                                  offset,
+                                                  bpak_part_size(part),
+                                                  user);
+            }
+
+            if (dict_size == 0)
+                dict_size = estimate_meta_dict_size(tm);
+            if (dict_size > estimate->lzma_dict_size)
+                estimate->lzma_dict_size = dict_size;
+
+            compression = BPAK_COMPRESSION_LZMA;
+            break;
+#endif
+        case BPAK_ID_BSPATCH_ZSTD:
+        case BPAK_ID_DECOMPRESS_ZSTD:
+            compression = BPAK_COMPRESSION_ZSTD;
+            break;
+        default:
+            return -BPAK_NOT_SUPPORTED;
+        }
+
+        /* bspatch reads at most one origin byte per output byte, raw
+         * streams don't read the origin */
+        if (!decoder_is_raw(part_decoder_id(patch_header, part)))
+            estimate->origin_bytes += output_length;
+
+        rc = bpak_bspatch_heap_size(compression, dict_size, &heap_size);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        if (heap_size > estimate->heap_size)
+            estimate->heap_size = heap_size;
+    }
+
+    /* Hash trees are built while the other parts are patched */
+    estimate->heap_size += merkle_heap_size;
+    return BPAK_OK;
 }
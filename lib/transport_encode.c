@@ -12,17 +12,24 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <bpak/bpak.h>
 #include <bpak/crc.h>
+#include <bpak/crypto.h>
 #include <bpak/utils.h>
 #include <bpak/id.h>
 #include <bpak/merkle.h>
 #include <bpak/bsdiff.h>
+#include <bpak/blockdiff.h>
+#include <bpak/chunkdiff.h>
 #include <bpak/transport.h>
+#include "file_copy.h"
+#include "trace.h"
 
 static int transport_copy(struct bpak_header *input_hdr,
                           struct bpak_header *output_hdr, uint32_t id,
@@ -41,184 +48,1687 @@ static int transport_copy(struct bpak_header *input_hdr,
 
     part_offset = bpak_part_offset(input_hdr, p);
 
-    rc = fseek(input_fp, part_offset, SEEK_SET);
+    rc = bpak_file_copy(input_fp,
+                        part_offset,
+                        output_fp,
+                        bpak_part_offset(output_hdr, p),
+                        bpak_part_size(p));
 
-    if (rc != 0) {
-        bpak_printf(0, "%s: Could not seek input stream\n", __func__);
+    if (rc != BPAK_OK)
+        bpak_printf(0, "%s: Could not copy part %x\n", __func__, id);
+
+    return rc;
+}
+
+/* Statistics of the part that is being encoded */
+struct encode_progress {
+    const struct bpak_transport_encode_options *options;
+    struct bpak_transport_progress stats;
+    uint64_t start_ns;
+};
+
+static uint64_t progress_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void progress_report(struct encode_progress *progress,
+                            enum bpak_transport_event event)
+{
+    struct bpak_transport_progress *stats = &progress->stats;
+
+    stats->event = event;
+    stats->elapsed_ns = progress_now() - progress->start_ns;
+    stats->stage_ns[BPAK_TRANSPORT_STAGE_CODEC] =
+        stats->elapsed_ns - stats->stage_ns[BPAK_TRANSPORT_STAGE_INPUT] -
+        stats->stage_ns[BPAK_TRANSPORT_STAGE_OUTPUT] -
+        stats->stage_ns[BPAK_TRANSPORT_STAGE_ORIGIN];
+
+    progress->options->progress(stats, progress->options->progress_user);
+}
+
+struct bsdiff_private {
+    int fd;
+    struct encode_progress *progress; /* NULL = no progress */
+};
+
+/* Write's the compressed output of bsdiff */
+static ssize_t bsdiff_write_output(off_t offset, uint8_t *buffer, size_t length,
+                                   void *user_priv)
+{
+    struct bsdiff_private *priv = (struct bsdiff_private *)user_priv;
+    uint64_t start = (priv->progress != NULL) ? progress_now() : 0;
+
+    if (lseek(priv->fd, offset, SEEK_SET) == -1) {
+        bpak_printf(0, "Error: bsdiff_write_output seek\n");
         return -BPAK_SEEK_ERROR;
     }
 
-    rc = fseek(output_fp, bpak_part_offset(output_hdr, p), SEEK_SET);
+    ssize_t bytes_written = write(priv->fd, buffer, length);
 
-    if (rc != 0) {
-        bpak_printf(0, "%s: Error, could not seek output stream", __func__);
-        return -BPAK_SEEK_ERROR;
+    if (bytes_written < 0) {
+        return bytes_written;
+    }
+
+    if (bytes_written != (ssize_t)length) {
+        bpak_printf(0, "Error: bsdiff_write_output write\n");
+        return -BPAK_WRITE_ERROR;
+    }
+
+    if (priv->progress != NULL) {
+        struct bpak_transport_progress *stats = &priv->progress->stats;
+
+        stats->stage_ns[BPAK_TRANSPORT_STAGE_OUTPUT] += progress_now() - start;
+        stats->bytes_out += bytes_written;
+        progress_report(priv->progress, BPAK_TRANSPORT_PART_UPDATE);
     }
 
-    uint8_t buf[1024];
-    uint64_t bytes_to_copy = bpak_part_size(p);
-    uint64_t chunk = 0;
+    return bytes_written;
+}
+
+#define ORIGIN_DIGEST_LENGTH 32
+
+/* Origin index of an encode session */
+struct session_origin {
+    uint8_t digest[ORIGIN_DIGEST_LENGTH];
+    size_t length;
+    pthread_mutex_t lock; /* Held while the index is built */
+    bool ready;
+    uint8_t *mapping; /* Mapping of the origin file that holds the data */
+    size_t mapping_size;
+    struct bpak_bsdiff_origin origin;
+    struct session_origin *next;
+};
+
+struct bpak_transport_encode_session {
+    pthread_mutex_t lock;
+    struct session_origin *origins;
+};
+
+/* The origins are identified by the sha256 of the origin part data. The
+ * package UUID can't be used since origin and target normally share it. */
+static int origin_digest(const uint8_t *origin_data, size_t origin_length,
+                         uint8_t *digest)
+{
+    int rc;
+    struct bpak_hash_context hash;
+    size_t hash_size = ORIGIN_DIGEST_LENGTH;
+
+    rc = bpak_hash_init(&hash, BPAK_HASH_SHA256);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_hash_update(&hash, origin_data, origin_length);
+
+    if (rc == BPAK_OK)
+        rc = bpak_hash_final(&hash, digest, hash_size, &hash_size);
+
+    bpak_hash_free(&hash);
+    return rc;
+}
+
+/* The suffix array cache is keyed on the origin digest */
+static int sa_cache_filename(const char *cache_dir, const uint8_t *digest,
+                             char *buf, size_t buf_sz)
+{
+    int rc;
+    char hash_str[ORIGIN_DIGEST_LENGTH * 2 + 1];
+
+    rc = bpak_bin2hex((uint8_t *)digest,
+                      ORIGIN_DIGEST_LENGTH,
+                      hash_str,
+                      sizeof(hash_str));
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (snprintf(buf, buf_sz, "%s/%s.sa", cache_dir, hash_str) >=
+        (int)buf_sz) {
+        bpak_printf(0, "Error: Cache directory name is too long\n");
+        return -BPAK_SIZE_ERROR;
+    }
+
+    return BPAK_OK;
+}
+
+BPAK_EXPORT int bpak_transport_encode_session_create(
+    struct bpak_transport_encode_session **session)
+{
+    struct bpak_transport_encode_session *s = bpak_calloc(1, sizeof(*s));
+
+    if (s == NULL)
+        return -BPAK_FAILED;
+
+    if (pthread_mutex_init(&s->lock, NULL) != 0) {
+        bpak_free(s);
+        return -BPAK_FAILED;
+    }
+
+    *session = s;
+    return BPAK_OK;
+}
+
+BPAK_EXPORT void bpak_transport_encode_session_free(
+    struct bpak_transport_encode_session *session)
+{
+    struct session_origin *next;
+
+    if (session == NULL)
+        return;
+
+    for (struct session_origin *o = session->origins; o != NULL; o = next) {
+        next = o->next;
+
+        if (o->ready) {
+            bpak_bsdiff_origin_free(&o->origin);
+            munmap(o->mapping, o->mapping_size);
+        }
+
+        pthread_mutex_destroy(&o->lock);
+        bpak_free(o);
+    }
+
+    pthread_mutex_destroy(&session->lock);
+    bpak_free(session);
+}
+
+/* Get a pointer to 'length' bytes at 'offset' of 'fp'. 'map' is an
+ * existing mapping of the whole file, when it is NULL the file is mapped
+ * and the new mapping is returned in 'mapping' */
+static int transport_map(FILE *fp, const uint8_t *map, size_t map_size,
+                         off_t offset, size_t length, const char *name,
+                         uint8_t **mapping, size_t *mapping_size,
+                         uint8_t **data)
+{
+    *mapping = NULL;
+    *mapping_size = 0;
+
+    if (map == NULL) {
+        /* Map the entrire file because mmap's offset must be page aligned
+         * and we need to handle non page aligned offsets */
+        if (fseek(fp, 0, SEEK_END) != 0)
+            return -BPAK_SEEK_ERROR;
+
+        long file_sz = ftell(fp);
+
+        if (file_sz == -1)
+            return -BPAK_SEEK_ERROR;
+
+        map = mmap(NULL, file_sz, PROT_READ, MAP_SHARED, fileno(fp), 0);
+
+        if (map == MAP_FAILED) {
+            bpak_printf(0,
+                        "Error: Could not mmap %s data (%s)\n",
+                        name,
+                        strerror(errno));
+            return -BPAK_FAILED;
+        }
+
+        map_size = file_sz;
+        *mapping = (uint8_t *)map;
+        *mapping_size = map_size;
+    }
+
+    if (((uint64_t)offset > map_size) || (length > map_size - offset)) {
+        bpak_printf(0, "Error: %s data is outside of the file\n", name);
+
+        if (*mapping != NULL)
+            munmap(*mapping, *mapping_size);
+
+        *mapping = NULL;
+        return -BPAK_SIZE_ERROR;
+    }
+
+    /* Calculate pointer to where the needed data starts */
+    *data = (uint8_t *)map + offset;
+    return BPAK_OK;
+}
+
+/* Access hint for the 'length' bytes of a file mapping at 'data'. The
+ * target is scanned front to back, the origin is read all over by the
+ * suffix sort and the searches. With 'populate' the range is faulted in
+ * now, where MADV_POPULATE_READ is missing it is only read ahead. */
+static void transport_map_advise(const uint8_t *data, size_t length,
+                                 int advice, bool populate)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(page - 1);
+    size_t span = (uintptr_t)data + length - start;
+
+    if (length == 0)
+        return;
+
+    (void)madvise((void *)start, span, advice);
+
+    if (!populate)
+        return;
+
+#ifdef MADV_POPULATE_READ
+    if (madvise((void *)start, span, MADV_POPULATE_READ) == 0)
+        return;
+#endif
+
+    (void)madvise((void *)start, span, MADV_WILLNEED);
+}
+
+/* Print the origin seeks of the patch and the bsdiff profiling counters,
+ * when they are built in */
+static void bsdiff_print_stats(struct bpak_bsdiff_context *bsdiff)
+{
+    struct bpak_bsdiff_stats s;
+
+    bpak_printf(1,
+                "bsdiff: %llu origin seeks, %llu backward, %llu bytes\n",
+                (unsigned long long)bsdiff->origin_seeks,
+                (unsigned long long)bsdiff->origin_backward_seeks,
+                (unsigned long long)bsdiff->origin_seek_bytes);
+
+    if (bpak_bsdiff_get_stats(bsdiff, &s) != BPAK_OK)
+        return;
+
+    bpak_printf(1,
+                "bsdiff: %llu ctrl, %llu diff, %llu extra, %llu copy bytes, "
+                "%llu searches\n",
+                (unsigned long long)s.ctrl_blocks,
+                (unsigned long long)s.diff_bytes,
+                (unsigned long long)s.extra_bytes,
+                (unsigned long long)s.copy_bytes,
+                (unsigned long long)s.searches);
+    bpak_printf(1,
+                "bsdiff: suffix sort %.3f ms, diff %.3f ms, search %.3f ms, "
+                "compress %.3f ms, write_output %llu calls %.3f ms\n",
+                s.suffix_sort_ns / 1e6,
+                s.scan_ns / 1e6,
+                s.search_ns / 1e6,
+                s.compress_ns / 1e6,
+                (unsigned long long)s.write_output_calls,
+                s.write_output_ns / 1e6);
+}
+
+/* Find the index of the origin with 'digest' in 'session', or build it.
+ * Every origin gets its own mapping of 'origin', the mappings of the
+ * encode are gone when the index is used again. */
+static int session_origin_get(struct bpak_transport_encode_session *session,
+                              const uint8_t *digest, FILE *origin,
+                              off_t origin_offset, size_t origin_length,
+                              const struct bpak_bsdiff_options *bsdiff_options,
+                              bool populate, struct session_origin **result)
+{
+    int rc = BPAK_OK;
+    struct session_origin *o;
+    uint8_t *origin_data;
+
+    pthread_mutex_lock(&session->lock);
+
+    for (o = session->origins; o != NULL; o = o->next) {
+        if ((o->length == origin_length) &&
+            (memcmp(o->digest, digest, sizeof(o->digest)) == 0))
+            break;
+    }
+
+    if (o == NULL) {
+        o = bpak_calloc(1, sizeof(*o));
+
+        if ((o == NULL) || (pthread_mutex_init(&o->lock, NULL) != 0)) {
+            bpak_free(o);
+            pthread_mutex_unlock(&session->lock);
+            return -BPAK_FAILED;
+        }
+
+        memcpy(o->digest, digest, sizeof(o->digest));
+        o->length = origin_length;
+        o->next = session->origins;
+        session->origins = o;
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    /* Encodes of other origins go on while this one is built */
+    pthread_mutex_lock(&o->lock);
+
+    if (o->ready) {
+        bpak_printf(1, "Using the origin index of the encode session\n");
+        goto err_unlock_out;
+    }
+
+    rc = transport_map(origin,
+                       NULL,
+                       0,
+                       origin_offset,
+                       origin_length,
+                       "origin",
+                       &o->mapping,
+                       &o->mapping_size,
+                       &origin_data);
+
+    if (rc != BPAK_OK)
+        goto err_unlock_out;
+
+    transport_map_advise(origin_data,
+                         origin_length,
+                         MADV_WILLNEED,
+                         populate);
+
+    rc = bpak_bsdiff_origin_init_opts(&o->origin,
+                                      origin_data,
+                                      origin_length,
+                                      bsdiff_options);
+
+    /* A failed origin is built again by the next encode */
+    if (rc != BPAK_OK) {
+        munmap(o->mapping, o->mapping_size);
+        goto err_unlock_out;
+    }
+
+    o->ready = true;
+
+err_unlock_out:
+    pthread_mutex_unlock(&o->lock);
+
+    if (rc == BPAK_OK)
+        *result = o;
+
+    return rc;
+}
+
+static ssize_t
+transport_diff(struct bpak_transport_meta *tm, FILE *target,
+               off_t target_offset, size_t target_length, FILE *origin,
+               off_t origin_offset, size_t origin_length, FILE *output,
+               off_t output_offset, enum bpak_compression compression,
+               const struct bpak_transport_encode_options *options,
+               struct encode_progress *progress)
+{
+    ssize_t rc;
+    struct bsdiff_private priv;
+    struct bpak_bsdiff_context bsdiff;
+    uint8_t *origin_data = NULL;
+    uint8_t *origin_data_mmap = NULL;
+    size_t origin_mmap_sz;
+    uint8_t *target_data = NULL;
+    uint8_t *target_data_mmap = NULL;
+    size_t target_mmap_sz;
+    char cache_filename[1024];
+    uint8_t digest[ORIGIN_DIGEST_LENGTH];
+    struct session_origin *session_origin = NULL;
+    struct bpak_bsdiff_options bsdiff_options;
+    uint64_t start = (progress != NULL) ? progress_now() : 0;
+
+    memset(&priv, 0, sizeof(priv));
+    priv.fd = fileno(output);
+    priv.progress = progress;
+
+    rc = transport_map(target,
+                       options->input_map,
+                       options->input_map_size,
+                       target_offset,
+                       target_length,
+                       "target",
+                       &target_data_mmap,
+                       &target_mmap_sz,
+                       &target_data);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (progress != NULL) {
+        uint64_t now = progress_now();
+
+        progress->stats.stage_ns[BPAK_TRANSPORT_STAGE_INPUT] += now - start;
+        progress->stats.bytes_in = target_length;
+        start = now;
+    }
+
+    rc = transport_map(origin,
+                       options->origin_map,
+                       options->origin_map_size,
+                       origin_offset,
+                       origin_length,
+                       "origin",
+                       &origin_data_mmap,
+                       &origin_mmap_sz,
+                       &origin_data);
+
+    if (rc != BPAK_OK)
+        goto err_munmap_target;
+
+    if (progress != NULL) {
+        progress->stats.stage_ns[BPAK_TRANSPORT_STAGE_ORIGIN] +=
+            progress_now() - start;
+        progress->stats.origin_bytes = origin_length;
+    }
+
+    transport_map_advise(target_data,
+                         target_length,
+                         MADV_SEQUENTIAL,
+                         options->populate);
+    transport_map_advise(origin_data,
+                         origin_length,
+                         MADV_WILLNEED,
+                         options->populate);
+
+    if (tm->alg_id_encode == BPAK_ID_BLOCKDIFF) {
+        rc = bpak_blockdiff(origin_data,
+                            origin_length,
+                            target_data,
+                            target_length,
+                            bsdiff_write_output,
+                            output_offset,
+                            &priv);
+
+        if (rc < 0)
+            bpak_printf(0, "Error: bpak_blockdiff failed (%i)\n", rc);
+        else
+            bpak_printf(1, "blockdiff completed, output size = %zu\n", rc);
+
+        goto err_munmap_origin;
+    }
+
+    memset(&bsdiff_options, 0, sizeof(bsdiff_options));
+    bsdiff_options.jobs = options->jobs;
+    bsdiff_options.seek_cost = options->seek_cost;
+    bsdiff_options.pages = options->pages;
+    bsdiff_options.in_place_scratch = bpak_transport_in_place_scratch(tm);
+
+    /* The transport meta data holds the compressor parameters */
+    if (compression == BPAK_COMPRESSION_LZMA)
+        bsdiff_options.lzma_params =
+            (const struct bpak_transport_lzma_params *)tm->data;
+    else if (compression == BPAK_COMPRESSION_HS)
+        bsdiff_options.heatshrink_params =
+            (const struct bpak_transport_heatshrink_params *)tm->data;
+
+    bsdiff_options.revision = tm->data[BPAK_BSDIFF_REVISION_OFFSET];
+
+    if (bsdiff_options.revision > BPAK_BSDIFF_REVISION_COPY) {
+        bpak_printf(0,
+                    "Error: Unknown bsdiff revision %u\n",
+                    bsdiff_options.revision);
+        rc = -BPAK_NOT_SUPPORTED;
+        goto err_munmap_origin;
+    }
+
+    /* Origins with a suffix array larger than the budget are diffed in
+     * windows */
+    if (options->memory_budget != 0)
+        bsdiff_options.window_size =
+            bpak_bsdiff_window_size(origin_length, options->memory_budget);
+
+    if ((bsdiff_options.window_size != 0) &&
+        (bsdiff_options.in_place_scratch != 0)) {
+        bpak_printf(0,
+                    "Error: In place parts can't be diffed in origin "
+                    "windows\n");
+        rc = -BPAK_NOT_SUPPORTED;
+        goto err_munmap_origin;
+    }
+
+    if ((bsdiff_options.window_size == 0) &&
+        ((options->cache_dir != NULL) || (options->session != NULL))) {
+        rc = origin_digest(origin_data, origin_length, digest);
+
+        if (rc != BPAK_OK)
+            goto err_munmap_origin;
+    }
+
+    if ((options->cache_dir != NULL) && (bsdiff_options.window_size == 0)) {
+        bsdiff_options.cache_filename = cache_filename;
+        rc = sa_cache_filename(options->cache_dir,
+                               digest,
+                               cache_filename,
+                               sizeof(cache_filename));
+
+        if (rc != BPAK_OK)
+            goto err_munmap_origin;
+    }
+
+    if ((options->session != NULL) && (bsdiff_options.window_size == 0)) {
+        rc = session_origin_get(options->session,
+                                digest,
+                                origin,
+                                origin_offset,
+                                origin_length,
+                                &bsdiff_options,
+                                options->populate,
+                                &session_origin);
+
+        if (rc != BPAK_OK)
+            goto err_munmap_origin;
+
+        rc = bpak_bsdiff_init_origin(&bsdiff,
+                                     &session_origin->origin,
+                                     target_data,
+                                     target_length,
+                                     bsdiff_write_output,
+                                     output_offset,
+                                     compression,
+                                     &bsdiff_options,
+                                     &priv);
+    } else {
+        rc = bpak_bsdiff_init_opts(&bsdiff,
+                                   origin_data,
+                                   origin_length,
+                                   target_data,
+                                   target_length,
+                                   bsdiff_write_output,
+                                   output_offset,
+                                   compression,
+                                   &bsdiff_options,
+                                   &priv);
+    }
+
+    if (rc != BPAK_OK) {
+        bpak_printf(0, "Error: bpak_bsdiff_init failed (%i)\n", rc);
+        goto err_munmap_origin;
+    }
+
+    rc = bpak_bsdiff(&bsdiff);
+
+    if (rc < 0) {
+        bpak_printf(0, "Error: bpak_bsdiff failed (%i)\n", rc);
+        goto err_bsdiff_free;
+    }
+
+    bpak_printf(1, "bsdiff completed, output size = %zu\n", rc);
+    bsdiff_print_stats(&bsdiff);
+
+err_bsdiff_free:
+    bpak_bsdiff_free(&bsdiff);
+err_munmap_origin:
+    if (origin_data_mmap != NULL)
+        munmap(origin_data_mmap, origin_mmap_sz);
+err_munmap_target:
+    if (target_data_mmap != NULL)
+        munmap(target_data_mmap, target_mmap_sz);
+    return rc;
+}
 
-    while (bytes_to_copy) {
-        chunk = (bytes_to_copy > sizeof(buf)) ? sizeof(buf) : bytes_to_copy;
-        uint64_t read_bytes = fread(buf, 1, chunk, input_fp);
+/* chunkdiff only reads the target, the stream is the same for every
+ * origin */
+static ssize_t transport_chunkdiff(FILE *target, off_t target_offset,
+                                   size_t target_length, FILE *output,
+                                   off_t output_offset,
+                                   const struct bpak_transport_encode_options
+                                       *options,
+                                   struct encode_progress *progress)
+{
+    ssize_t rc;
+    struct bsdiff_private priv;
+    uint8_t *target_data = NULL;
+    uint8_t *target_data_mmap = NULL;
+    size_t target_mmap_sz;
+    uint64_t start = (progress != NULL) ? progress_now() : 0;
+
+    memset(&priv, 0, sizeof(priv));
+    priv.fd = fileno(output);
+    priv.progress = progress;
+
+    rc = transport_map(target,
+                       options->input_map,
+                       options->input_map_size,
+                       target_offset,
+                       target_length,
+                       "target",
+                       &target_data_mmap,
+                       &target_mmap_sz,
+                       &target_data);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (progress != NULL) {
+        progress->stats.stage_ns[BPAK_TRANSPORT_STAGE_INPUT] +=
+            progress_now() - start;
+        progress->stats.bytes_in = target_length;
+    }
+
+    rc = bpak_chunkdiff(target_data,
+                        target_length,
+                        bsdiff_write_output,
+                        output_offset,
+                        &priv);
+
+    if (rc < 0)
+        bpak_printf(0, "Error: bpak_chunkdiff failed (%i)\n", rc);
+    else
+        bpak_printf(1, "chunkdiff completed, output size = %zu\n", rc);
+
+    if (target_data_mmap != NULL)
+        munmap(target_data_mmap, target_mmap_sz);
+    return rc;
+}
+
+/* Compress the target on its own, without an origin */
+static ssize_t transport_compress(struct bpak_transport_meta *tm,
+                                  FILE *target, off_t target_offset,
+                                  size_t target_length, FILE *output,
+                                  off_t output_offset,
+                                  enum bpak_compression compression,
+                                  const struct bpak_transport_encode_options
+                                      *options,
+                                  struct encode_progress *progress)
+{
+    ssize_t rc;
+    struct bsdiff_private priv;
+    struct bpak_bsdiff_options compress_options;
+    uint8_t *target_data = NULL;
+    uint8_t *target_data_mmap = NULL;
+    size_t target_mmap_sz;
+    uint64_t start = (progress != NULL) ? progress_now() : 0;
+
+    memset(&priv, 0, sizeof(priv));
+    priv.fd = fileno(output);
+    priv.progress = progress;
+
+    rc = transport_map(target,
+                       options->input_map,
+                       options->input_map_size,
+                       target_offset,
+                       target_length,
+                       "target",
+                       &target_data_mmap,
+                       &target_mmap_sz,
+                       &target_data);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (progress != NULL) {
+        progress->stats.stage_ns[BPAK_TRANSPORT_STAGE_INPUT] +=
+            progress_now() - start;
+        progress->stats.bytes_in = target_length;
+    }
+
+    /* Same compressor parameters as the bsdiff encoders */
+    memset(&compress_options, 0, sizeof(compress_options));
+    compress_options.jobs = options->jobs;
+
+    if (compression == BPAK_COMPRESSION_LZMA)
+        compress_options.lzma_params =
+            (const struct bpak_transport_lzma_params *)tm->data;
+    else if (compression == BPAK_COMPRESSION_HS)
+        compress_options.heatshrink_params =
+            (const struct bpak_transport_heatshrink_params *)tm->data;
+
+    rc = bpak_bsdiff_compress(target_data,
+                              target_length,
+                              bsdiff_write_output,
+                              output_offset,
+                              compression,
+                              &compress_options,
+                              &priv);
+
+    if (rc < 0)
+        bpak_printf(0, "Error: compression failed (%i)\n", rc);
+    else
+        bpak_printf(1, "compression completed, output size = %zu\n", rc);
+
+    if (target_data_mmap != NULL)
+        munmap(target_data_mmap, target_mmap_sz);
+    return rc;
+}
+
+/* Read the origin parts of 'ids' into one buffer, in order. This is the
+ * virtual origin of parts with bpak-origin-parts meta data. */
+static int origin_parts_load(FILE *origin_fp, struct bpak_header *origin_header,
+                             const bpak_id_t *ids, size_t count,
+                             uint8_t **data, size_t *length)
+{
+    struct bpak_part_header *parts[BPAK_TRANSPORT_MAX_ORIGIN_PARTS];
+    size_t total = 0;
+    size_t pos = 0;
+    int rc;
+
+    for (size_t i = 0; i < count; i++) {
+        rc = bpak_get_part(origin_header, ids[i], &parts[i]);
+
+        if (rc != BPAK_OK) {
+            bpak_printf(0,
+                        "Error could not get origin part with ref %x\n",
+                        ids[i]);
+            return rc;
+        }
+
+        total += bpak_part_size(parts[i]);
+    }
+
+    *data = bpak_calloc(1, total ? total : 1);
+
+    if (*data == NULL)
+        return -BPAK_FAILED;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t part_size = bpak_part_size(parts[i]);
+        off_t offset = bpak_part_offset(origin_header, parts[i]);
+        size_t done = 0;
+
+        while (done < part_size) {
+            ssize_t n = pread(fileno(origin_fp),
+                              &(*data)[pos + done],
+                              part_size - done,
+                              offset + done);
+
+            if (n <= 0) {
+                bpak_free(*data);
+                *data = NULL;
+                return -BPAK_READ_ERROR;
+            }
+
+            done += n;
+        }
+
+        pos += part_size;
+    }
+
+    *length = total;
+    return BPAK_OK;
+}
+
+/* Compare 'length' bytes of two files, returns 1 when they are equal, 0
+ * when they differ or a negative number */
+static int transport_data_equal(FILE *a_fp, const uint8_t *a_map,
+                                size_t a_map_size, off_t a_offset,
+                                FILE *b_fp, const uint8_t *b_map,
+                                size_t b_map_size, off_t b_offset,
+                                size_t length)
+{
+    const size_t chunk_length = 64 * 1024;
+    uint8_t *a_buf;
+    uint8_t *b_buf;
+    size_t pos = 0;
+    int rc = 1;
+
+    if ((a_map != NULL) && (b_map != NULL) &&
+        ((uint64_t)a_offset <= a_map_size) &&
+        (length <= a_map_size - a_offset) &&
+        ((uint64_t)b_offset <= b_map_size) &&
+        (length <= b_map_size - b_offset)) {
+        return memcmp(&a_map[a_offset], &b_map[b_offset], length) == 0;
+    }
+
+    a_buf = bpak_calloc(2, chunk_length);
+
+    if (a_buf == NULL)
+        return -BPAK_FAILED;
+
+    b_buf = a_buf + chunk_length;
+
+    while ((rc == 1) && (pos < length)) {
+        size_t n = BPAK_MIN(chunk_length, length - pos);
+
+        if ((pread(fileno(a_fp), a_buf, n, a_offset + pos) != (ssize_t)n) ||
+            (pread(fileno(b_fp), b_buf, n, b_offset + pos) != (ssize_t)n))
+            rc = -BPAK_READ_ERROR;
+        else if (memcmp(a_buf, b_buf, n) != 0)
+            rc = 0;
+
+        pos += n;
+    }
+
+    bpak_free(a_buf);
+    return rc;
+}
+
+/* Check if the part is identical to its origin part, so that nothing has
+ * to be encoded. Returns 1 when it is, 0 when it is not or a negative
+ * number. The data is compared byte by byte, the compare stops at the first
+ * difference so parts that changed cost next to nothing. */
+static int
+transport_origin_identical(struct bpak_transport_meta *tm, FILE *input_fp,
+                           struct bpak_header *input_header,
+                           struct bpak_part_header *input_part,
+                           FILE *origin_fp, struct bpak_header *origin_header,
+                           struct bpak_part_header *origin_part,
+                           const struct bpak_transport_encode_options *options)
+{
+    const bpak_id_t *origin_ids;
+    size_t origin_count;
+
+    switch (tm->alg_id_encode) {
+    case BPAK_ID_BSDIFF:
+    case BPAK_ID_BSDIFF_NO_COMP:
+    case BPAK_ID_BSDIFF_LZMA:
+    case BPAK_ID_BSDIFF_ZSTD:
+    case BPAK_ID_BLOCKDIFF:
+    case BPAK_ID_CHUNKDIFF:
+    case BPAK_ID_REUSE_ORIGIN:
+    case BPAK_ID_AUTO:
+        break;
+    default:
+        return 0;
+    }
+
+    if ((origin_fp == NULL) || (origin_header == NULL) ||
+        (origin_part == NULL))
+        return 0;
+
+    if (bpak_get_transport_origin_parts(input_header,
+                                        input_part->id,
+                                        &origin_ids,
+                                        &origin_count) == BPAK_OK)
+        return 0;
+
+    /* Stored data of sparse parts depends on the sparse map as well */
+    if ((input_part->flags & (BPAK_FLAG_TRANSPORT | BPAK_FLAG_SPARSE)) ||
+        (origin_part->flags & (BPAK_FLAG_TRANSPORT | BPAK_FLAG_SPARSE)))
+        return 0;
+
+    if ((input_part->size != origin_part->size) ||
+        (input_part->pad_bytes != origin_part->pad_bytes))
+        return 0;
+
+    return transport_data_equal(input_fp,
+                                options->input_map,
+                                options->input_map_size,
+                                bpak_part_offset(input_header, input_part),
+                                origin_fp,
+                                options->origin_map,
+                                options->origin_map_size,
+                                bpak_part_offset(origin_header, origin_part),
+                                bpak_part_size(input_part));
+}
+
+#define PATCH_CACHE_MAGIC "BPAK patch cache 1"
+
+static int hash_file_range(struct bpak_hash_context *hash, FILE *fp,
+                           const uint8_t *map, size_t map_size, off_t offset,
+                           size_t length, const char *name)
+{
+    int rc;
+    uint8_t *mapping;
+    size_t mapping_size;
+    uint8_t *data;
+
+    rc = transport_map(fp,
+                       map,
+                       map_size,
+                       offset,
+                       length,
+                       name,
+                       &mapping,
+                       &mapping_size,
+                       &data);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_hash_update(hash, data, length);
+
+    if (mapping != NULL)
+        munmap(mapping, mapping_size);
+
+    return rc;
+}
+
+/* The encoded part is cached under the sha256 of everything that the
+ * encoder output depends on: the encoder and its parameters, the target
+ * data and, for the diff encoders, the origin data. The settings that
+ * change how a diff is split are part of the key as well. */
+static int patch_cache_key(struct bpak_transport_meta *tm, FILE *input_fp,
+                           struct bpak_header *input_header,
+                           struct bpak_part_header *input_part,
+                           FILE *origin_fp, struct bpak_header *origin_header,
+                           struct bpak_part_header *origin_part,
+                           const struct bpak_transport_encode_options *options,
+                           uint8_t *key)
+{
+    int rc;
+    struct bpak_hash_context hash;
+    size_t hash_size = ORIGIN_DIGEST_LENGTH;
+    const bpak_id_t *origin_ids;
+    size_t origin_count;
+    uint64_t settings[6] = {
+        (options->jobs > 1) ? options->jobs : 1,
+        options->memory_budget,
+        options->seek_cost,
+        bpak_part_size(input_part),
+        input_part->flags,
+        input_part->pad_bytes,
+    };
+
+    rc = bpak_hash_init(&hash, BPAK_HASH_SHA256);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_hash_update(&hash,
+                          (const uint8_t *)PATCH_CACHE_MAGIC,
+                          strlen(PATCH_CACHE_MAGIC));
+
+    if (rc == BPAK_OK)
+        rc = bpak_hash_update(&hash, (const uint8_t *)tm, sizeof(*tm));
+
+    if (rc == BPAK_OK)
+        rc = bpak_hash_update(&hash,
+                              (const uint8_t *)settings,
+                              sizeof(settings));
+
+    if (rc == BPAK_OK)
+        rc = hash_file_range(&hash,
+                             input_fp,
+                             options->input_map,
+                             options->input_map_size,
+                             bpak_part_offset(input_header, input_part),
+                             bpak_part_size(input_part),
+                             "target");
+
+    if ((rc != BPAK_OK) || (tm->alg_id_encode == BPAK_ID_CHUNKDIFF) ||
+        (origin_fp == NULL) || (origin_header == NULL))
+        goto err_free_hash_out;
+
+    switch (tm->alg_id_encode) {
+    case BPAK_ID_COMPRESS_HS:
+    case BPAK_ID_COMPRESS_LZMA:
+    case BPAK_ID_COMPRESS_ZSTD:
+        goto err_free_hash_out;
+    default:
+        break;
+    }
+
+    if (bpak_get_transport_origin_parts(input_header,
+                                        input_part->id,
+                                        &origin_ids,
+                                        &origin_count) != BPAK_OK) {
+        origin_ids = NULL;
+        origin_count = 1;
+    }
+
+    for (size_t i = 0; (rc == BPAK_OK) && (i < origin_count); i++) {
+        struct bpak_part_header *part = origin_part;
+
+        if (origin_ids != NULL) {
+            rc = bpak_get_part(origin_header, origin_ids[i], &part);
+
+            if (rc != BPAK_OK)
+                break;
+        }
+
+        if (part == NULL)
+            break;
+
+        rc = hash_file_range(&hash,
+                             origin_fp,
+                             options->origin_map,
+                             options->origin_map_size,
+                             bpak_part_offset(origin_header, part),
+                             bpak_part_size(part),
+                             "origin");
+    }
+
+err_free_hash_out:
+    if (rc == BPAK_OK)
+        rc = bpak_hash_final(&hash, key, hash_size, &hash_size);
+
+    bpak_hash_free(&hash);
+    return rc;
+}
+
+static int patch_cache_filename(const char *cache_dir, const uint8_t *key,
+                                char *buf, size_t buf_sz)
+{
+    int rc;
+    char key_str[ORIGIN_DIGEST_LENGTH * 2 + 1];
+
+    rc = bpak_bin2hex((uint8_t *)key,
+                      ORIGIN_DIGEST_LENGTH,
+                      key_str,
+                      sizeof(key_str));
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (snprintf(buf, buf_sz, "%s/%s.patch", cache_dir, key_str) >=
+        (int)buf_sz) {
+        bpak_printf(0, "Error: Cache directory name is too long\n");
+        return -BPAK_SIZE_ERROR;
+    }
+
+    return BPAK_OK;
+}
+
+/* Copy a cached part to 'output_offset' of 'output_fp'. Returns the size of
+ * the part or a negative number when it is not in the cache. */
+static ssize_t patch_cache_load(const char *filename, FILE *output_fp,
+                                off_t output_offset)
+{
+    int rc;
+    struct stat statbuf;
+    FILE *fp = fopen(filename, "rb");
+
+    if (fp == NULL)
+        return -BPAK_FILE_NOT_FOUND;
+
+    if (fstat(fileno(fp), &statbuf) != 0) {
+        rc = -BPAK_READ_ERROR;
+        goto err_close_out;
+    }
+
+    rc = bpak_file_copy(fp, 0, output_fp, output_offset, statbuf.st_size);
+
+err_close_out:
+    fclose(fp);
+    return (rc == BPAK_OK) ? (ssize_t)statbuf.st_size : rc;
+}
+
+/* Store an encoded part through a temporary file that is renamed, so
+ * that concurrent encoders never see a part that is partially written */
+static int patch_cache_store(const char *filename, FILE *output_fp,
+                             off_t output_offset, size_t length)
+{
+    int rc;
+    char tmp_filename[1024];
+    FILE *fp;
+    static unsigned int tmp_counter;
+
+    if (snprintf(tmp_filename,
+                 sizeof(tmp_filename),
+                 "%s.%i.%u.tmp",
+                 filename,
+                 (int)getpid(),
+                 __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED)) >=
+        (int)sizeof(tmp_filename)) {
+        return -BPAK_SIZE_ERROR;
+    }
+
+    fp = fopen(tmp_filename, "wb");
+
+    if (fp == NULL) {
+        bpak_printf(0,
+                    "Error: Could not create '%s' (%s)\n",
+                    tmp_filename,
+                    strerror(errno));
+        return -BPAK_WRITE_ERROR;
+    }
+
+    rc = bpak_file_copy(output_fp, output_offset, fp, 0, length);
+
+    if (fclose(fp) != 0)
+        rc = -BPAK_WRITE_ERROR;
+
+    if ((rc == BPAK_OK) && (rename(tmp_filename, filename) != 0))
+        rc = -BPAK_WRITE_ERROR;
+
+    if (rc != BPAK_OK) {
+        bpak_printf(0, "Error: Could not write '%s'\n", filename);
+        unlink(tmp_filename);
+    }
+
+    return rc;
+}
+
+/* Encode the data of one part with 'alg_id' to 'output_offset' of
+ * 'output_fp', through the patch cache. Returns the size of the encoded
+ * data or a negative number. */
+static ssize_t
+transport_encode_alg(struct bpak_transport_meta *tm, uint32_t alg_id,
+                     FILE *input_fp, struct bpak_header *input_header,
+                     struct bpak_part_header *input_part, FILE *origin_fp,
+                     struct bpak_header *origin_header,
+                     struct bpak_part_header *origin_part, FILE *output_fp,
+                     off_t output_offset,
+                     const struct bpak_transport_encode_options *options,
+                     struct encode_progress *p)
+{
+    ssize_t output_size;
+    uint8_t key[ORIGIN_DIGEST_LENGTH];
+    char cache_filename[1024];
+    bool cache = false;
+
+    if ((options->patch_cache_dir != NULL) && (alg_id != BPAK_ID_REMOVE_DATA) &&
+        (alg_id != BPAK_ID_REUSE_ORIGIN)) {
+        output_size = patch_cache_key(tm,
+                                      input_fp,
+                                      input_header,
+                                      input_part,
+                                      origin_fp,
+                                      origin_header,
+                                      origin_part,
+                                      options,
+                                      key);
+
+        if (output_size == BPAK_OK)
+            output_size = patch_cache_filename(options->patch_cache_dir,
+                                               key,
+                                               cache_filename,
+                                               sizeof(cache_filename));
+
+        if (output_size != BPAK_OK)
+            return output_size;
+
+        output_size =
+            patch_cache_load(cache_filename, output_fp, output_offset);
+
+        if (output_size >= 0) {
+            bpak_printf(1,
+                        "Part 0x%x is in the patch cache '%s'\n",
+                        input_part->id,
+                        cache_filename);
+            return output_size;
+        }
+
+        cache = true;
+    }
+
+    /* Only bsdiff keeps the origin reads close to the output position */
+    if ((bpak_transport_in_place_scratch(tm) != 0) &&
+        ((alg_id == BPAK_ID_BLOCKDIFF) || (alg_id == BPAK_ID_CHUNKDIFF))) {
+        bpak_printf(0,
+                    "Error: Part 0x%x can't be encoded for in place "
+                    "decoding\n",
+                    input_part->id);
+        return -BPAK_NOT_SUPPORTED;
+    }
+
+    switch (alg_id) {
+    case BPAK_ID_BSDIFF: /* heatshrink compressor */
+    case BPAK_ID_BSDIFF_NO_COMP:
+    case BPAK_ID_BSDIFF_LZMA:
+    case BPAK_ID_BSDIFF_ZSTD:
+    case BPAK_ID_BLOCKDIFF: {
+        if ((origin_header == NULL) || (origin_fp == NULL)) {
+            bpak_printf(0, "Error: Need an origin stream for diff operation\n");
+            return -BPAK_PATCH_READ_ORIGIN_ERROR;
+        }
+
+        enum bpak_compression compression = BPAK_COMPRESSION_NONE;
+
+        if (alg_id == BPAK_ID_BSDIFF)
+            compression = BPAK_COMPRESSION_HS;
+        else if (alg_id == BPAK_ID_BSDIFF_NO_COMP)
+            compression = BPAK_COMPRESSION_NONE;
+        else if (alg_id == BPAK_ID_BSDIFF_LZMA)
+            compression = BPAK_COMPRESSION_LZMA;
+        else if (alg_id == BPAK_ID_BSDIFF_ZSTD)
+            compression = BPAK_COMPRESSION_ZSTD;
+
+        const bpak_id_t *origin_ids;
+        size_t origin_count;
+
+        if (bpak_get_transport_origin_parts(input_header,
+                                            input_part->id,
+                                            &origin_ids,
+                                            &origin_count) != BPAK_OK) {
+            output_size = transport_diff(tm,
+                                         input_fp,
+                                         bpak_part_offset(input_header,
+                                                          input_part),
+                                         bpak_part_size(input_part),
+                                         origin_fp,
+                                         bpak_part_offset(origin_header,
+                                                          origin_part),
+                                         bpak_part_size(origin_part),
+                                         output_fp,
+                                         output_offset,
+                                         compression,
+                                         options,
+                                         p);
+            break;
+        }
+
+        /* Diff against the concatenated origin parts */
+        struct bpak_transport_encode_options parts_options = *options;
+        uint8_t *origin_data;
+        size_t origin_length;
+
+        if (alg_id == BPAK_ID_BLOCKDIFF) {
+            bpak_printf(0, "Error: blockdiff needs a single origin part\n");
+            return -BPAK_NOT_SUPPORTED;
+        }
+
+        output_size = origin_parts_load(origin_fp,
+                                        origin_header,
+                                        origin_ids,
+                                        origin_count,
+                                        &origin_data,
+                                        &origin_length);
+
+        if (output_size != BPAK_OK)
+            return output_size;
+
+        parts_options.origin_map = origin_data;
+        parts_options.origin_map_size = origin_length;
+
+        output_size = transport_diff(tm,
+                                     input_fp,
+                                     bpak_part_offset(input_header,
+                                                      input_part),
+                                     bpak_part_size(input_part),
+                                     origin_fp,
+                                     0,
+                                     origin_length,
+                                     output_fp,
+                                     output_offset,
+                                     compression,
+                                     &parts_options,
+                                     p);
+        bpak_free(origin_data);
+    } break;
+    case BPAK_ID_CHUNKDIFF:
+        output_size = transport_chunkdiff(input_fp,
+                                          bpak_part_offset(input_header,
+                                                           input_part),
+                                          bpak_part_size(input_part),
+                                          output_fp,
+                                          output_offset,
+                                          options,
+                                          p);
+        break;
+    case BPAK_ID_COMPRESS_HS:
+    case BPAK_ID_COMPRESS_LZMA:
+    case BPAK_ID_COMPRESS_ZSTD: {
+        enum bpak_compression compression = BPAK_COMPRESSION_HS;
+
+        if (alg_id == BPAK_ID_COMPRESS_LZMA)
+            compression = BPAK_COMPRESSION_LZMA;
+        else if (alg_id == BPAK_ID_COMPRESS_ZSTD)
+            compression = BPAK_COMPRESSION_ZSTD;
+
+        output_size = transport_compress(tm,
+                                         input_fp,
+                                         bpak_part_offset(input_header,
+                                                          input_part),
+                                         bpak_part_size(input_part),
+                                         output_fp,
+                                         output_offset,
+                                         compression,
+                                         options,
+                                         p);
+    } break;
+    case BPAK_ID_REMOVE_DATA:
+    case BPAK_ID_REUSE_ORIGIN:
+        /* No data is produced for this part */
+        output_size = 0;
+        break;
+    default:
+        bpak_printf(0, "Error, unknown alg 0x%x\n", alg_id);
+        return -1;
+    }
+
+    /* The cache only saves time, the encode can proceed without it */
+    if (cache && (output_size > 0))
+        (void)patch_cache_store(cache_filename,
+                                output_fp,
+                                output_offset,
+                                output_size);
+
+    return output_size;
+}
+
+/* An encoder that the 'auto' encoder picks from */
+struct auto_candidate {
+    uint32_t alg_id_encode;
+    enum bpak_transport_auto_decoder decoder;
+    enum bpak_compression compression;
+};
+
+static const struct auto_candidate auto_diff_candidates[] = {
+    { BPAK_ID_BSDIFF_NO_COMP, BPAK_TRANSPORT_AUTO_BSPATCH_NO_COMP,
+      BPAK_COMPRESSION_NONE },
+    { BPAK_ID_BSDIFF, BPAK_TRANSPORT_AUTO_BSPATCH, BPAK_COMPRESSION_HS },
+#if BPAK_CONFIG_LZMA == 1
+    { BPAK_ID_BSDIFF_LZMA, BPAK_TRANSPORT_AUTO_BSPATCH_LZMA,
+      BPAK_COMPRESSION_LZMA },
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    { BPAK_ID_BSDIFF_ZSTD, BPAK_TRANSPORT_AUTO_BSPATCH_ZSTD,
+      BPAK_COMPRESSION_ZSTD },
+#endif
+};
+
+static const struct auto_candidate auto_compress_candidates[] = {
+    { BPAK_ID_COMPRESS_HS, BPAK_TRANSPORT_AUTO_DECOMPRESS_HS,
+      BPAK_COMPRESSION_HS },
+#if BPAK_CONFIG_LZMA == 1
+    { BPAK_ID_COMPRESS_LZMA, BPAK_TRANSPORT_AUTO_DECOMPRESS_LZMA,
+      BPAK_COMPRESSION_LZMA },
+#endif
+#if BPAK_CONFIG_ZSTD == 1
+    { BPAK_ID_COMPRESS_ZSTD, BPAK_TRANSPORT_AUTO_DECOMPRESS_ZSTD,
+      BPAK_COMPRESSION_ZSTD },
+#endif
+};
+
+#define AUTO_MAX_CANDIDATES \
+    (sizeof(auto_diff_candidates) / sizeof(auto_diff_candidates[0]))
+
+/* Arguments that the encodes of one 'auto' part share */
+struct auto_encode {
+    FILE *input_fp;
+    struct bpak_header *input_header;
+    struct bpak_part_header *input_part;
+    FILE *origin_fp;
+    struct bpak_header *origin_header;
+    struct bpak_part_header *origin_part;
+    const struct bpak_transport_encode_options *options;
+};
+
+/* One candidate of an 'auto' part, encoded into 'fp' on its own thread */
+struct auto_job {
+    struct auto_encode *encode;
+    const struct auto_candidate *candidate;
+    struct bpak_transport_meta tm;
+    FILE *fp;
+    pthread_t thread;
+    bool started;
+    ssize_t output_size;
+    uint64_t decode_time_us;
+    size_t heap_size;
+};
 
-        if (read_bytes != chunk) {
-            bpak_printf(0, "Error: Could not read chunk");
-            rc = -BPAK_READ_ERROR;
-            goto err_out;
-        }
+static void *auto_job_run(void *arg)
+{
+    struct auto_job *job = (struct auto_job *)arg;
+    struct auto_encode *encode = job->encode;
+
+    job->output_size = transport_encode_alg(&job->tm,
+                                            job->tm.alg_id_encode,
+                                            encode->input_fp,
+                                            encode->input_header,
+                                            encode->input_part,
+                                            encode->origin_fp,
+                                            encode->origin_header,
+                                            encode->origin_part,
+                                            job->fp,
+                                            0,
+                                            encode->options,
+                                            NULL);
+    return NULL;
+}
 
-        uint64_t written_bytes = fwrite(buf, 1, chunk, output_fp);
+/* Estimate the decode time and heap of an encoded candidate on the
+ * target of 'select' */
+static int auto_job_estimate(struct auto_job *job,
+                             const struct bpak_transport_auto *select,
+                             uint64_t output_length)
+{
+    static const uint64_t default_rates[] = {
+        [BPAK_COMPRESSION_NONE] = BPAK_TRANSPORT_AUTO_RATE_NONE,
+        [BPAK_COMPRESSION_HS] = BPAK_TRANSPORT_AUTO_RATE_HS,
+        [BPAK_COMPRESSION_LZMA] = BPAK_TRANSPORT_AUTO_RATE_LZMA,
+        [BPAK_COMPRESSION_ZSTD] = BPAK_TRANSPORT_AUTO_RATE_ZSTD,
+    };
+    enum bpak_compression compression = job->candidate->compression;
+    uint64_t input_rate = select->input_rate[compression];
+    uint64_t output_rate = select->output_rate;
+
+    if (input_rate == 0)
+        input_rate = default_rates[compression];
+    if (output_rate == 0)
+        output_rate = BPAK_TRANSPORT_AUTO_RATE_OUTPUT;
+
+    job->decode_time_us = job->output_size * 1000000ULL / input_rate +
+                          output_length * 1000000ULL / output_rate;
+
+    /* The compressor parameters are the defaults */
+    return bpak_bspatch_heap_size(compression, 0, &job->heap_size);
+}
 
-        if (written_bytes != read_bytes) {
-            bpak_printf(0, "Error: Could not write chunk");
-            rc = -BPAK_WRITE_ERROR;
-            goto err_out;
+/* Encode a part with every candidate at the same time and keep the
+ * smallest output that fits in the decode budget of the target. The
+ * decoder of the result is stored in the flags of 'output_part'. */
+static ssize_t
+transport_encode_auto(struct bpak_transport_meta *tm, FILE *input_fp,
+                      struct bpak_header *input_header,
+                      struct bpak_part_header *input_part, FILE *origin_fp,
+                      struct bpak_header *origin_header,
+                      struct bpak_part_header *origin_part,
+                      struct bpak_part_header *output_part, FILE *output_fp,
+                      off_t output_offset,
+                      const struct bpak_transport_encode_options *options)
+{
+    ssize_t rc = BPAK_OK;
+    const struct bpak_transport_auto *select = &options->auto_select;
+    const struct auto_candidate *candidates = auto_compress_candidates;
+    size_t count =
+        sizeof(auto_compress_candidates) / sizeof(auto_compress_candidates[0]);
+    struct bpak_transport_encode_options auto_options = *options;
+    struct bpak_transport_encode_session *session = NULL;
+    struct auto_job jobs[AUTO_MAX_CANDIDATES];
+    struct auto_encode encode;
+    struct auto_job *best = NULL;
+    bool fits = false;
+
+    /* The compressor parameters would only fit one of the candidates, and
+     * the decoder reads them as well */
+    for (size_t i = 0; i < BPAK_BSDIFF_REVISION_OFFSET; i++) {
+        if (tm->data[i] != 0) {
+            bpak_printf(0,
+                        "Error: Part 0x%x has compressor parameters, the "
+                        "auto encoder uses the defaults\n",
+                        input_part->id);
+            return -BPAK_NOT_SUPPORTED;
         }
-
-        bytes_to_copy -= chunk;
     }
 
-err_out:
-    return rc;
-}
+    if ((origin_fp != NULL) && (origin_header != NULL)) {
+        candidates = auto_diff_candidates;
+        count = AUTO_MAX_CANDIDATES;
 
-struct bsdiff_private {
-    int fd;
-};
+        /* The candidates share one origin index */
+        if (auto_options.session == NULL) {
+            rc = bpak_transport_encode_session_create(&session);
 
-/* Write's the compressed output of bsdiff */
-static ssize_t bsdiff_write_output(off_t offset, uint8_t *buffer, size_t length,
-                                   void *user_priv)
-{
-    struct bsdiff_private *priv = (struct bsdiff_private *)user_priv;
+            if (rc != BPAK_OK)
+                return rc;
 
-    if (lseek(priv->fd, offset, SEEK_SET) == -1) {
-        bpak_printf(0, "Error: bsdiff_write_output seek\n");
-        return -BPAK_SEEK_ERROR;
+            auto_options.session = session;
+        }
     }
 
-    ssize_t bytes_written = write(priv->fd, buffer, length);
+    encode.input_fp = input_fp;
+    encode.input_header = input_header;
+    encode.input_part = input_part;
+    encode.origin_fp = origin_fp;
+    encode.origin_header = origin_header;
+    encode.origin_part = origin_part;
+    encode.options = &auto_options;
+    memset(jobs, 0, sizeof(jobs));
+
+    for (size_t i = 0; i < count; i++) {
+        struct auto_job *job = &jobs[i];
+
+        job->encode = &encode;
+        job->candidate = &candidates[i];
+        job->tm = *tm;
+        job->tm.alg_id_encode = candidates[i].alg_id_encode;
+        job->fp = tmpfile();
+
+        if (job->fp == NULL) {
+            bpak_printf(0,
+                        "Error: Could not create temporary file (%s)\n",
+                        strerror(errno));
+            rc = -BPAK_WRITE_ERROR;
+            goto err_join_out;
+        }
 
-    if (bytes_written < 0) {
-        return bytes_written;
-    }
+        if (pthread_create(&job->thread, NULL, auto_job_run, job) != 0) {
+            rc = -BPAK_FAILED;
+            goto err_join_out;
+        }
 
-    if (bytes_written != (ssize_t)length) {
-        bpak_printf(0, "Error: bsdiff_write_output write\n");
-        return -BPAK_WRITE_ERROR;
+        job->started = true;
     }
 
-    return bytes_written;
-}
-
-static ssize_t transport_bsdiff(FILE *target, off_t target_offset,
-                                size_t target_length, FILE *origin,
-                                off_t origin_offset, size_t origin_length,
-                                FILE *output, off_t output_offset,
-                                enum bpak_compression compression)
-{
-    ssize_t rc;
-    struct bsdiff_private priv;
-    struct bpak_bsdiff_context bsdiff;
-    uint8_t *origin_data = NULL;
-    uint8_t *origin_data_mmap = NULL;
-    uint8_t *target_data = NULL;
-    uint8_t *target_data_mmap = NULL;
-    int target_fd = fileno(target);
-    int origin_fd = fileno(origin);
+err_join_out:
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].started)
+            pthread_join(jobs[i].thread, NULL);
+    }
 
-    memset(&priv, 0, sizeof(priv));
-    priv.fd = fileno(output);
+    if (rc != BPAK_OK)
+        goto err_close_out;
 
-    /* Map the entrire file because mmap's offset must be page aligned and
-     * we need to handle non page aligned offsets */
-    if (fseek(target, 0, SEEK_END) != 0)
-        return -BPAK_SEEK_ERROR;
+    for (size_t i = 0; i < count; i++) {
+        struct auto_job *job = &jobs[i];
+        bool job_fits;
 
-    long target_file_sz = ftell(target);
+        if (job->output_size < 0) {
+            rc = job->output_size;
+            goto err_close_out;
+        }
 
-    if (target_file_sz == -1)
-        return -BPAK_SEEK_ERROR;
+        rc = auto_job_estimate(job, select, bpak_part_size(input_part));
 
-    target_data_mmap =
-        mmap(NULL, target_file_sz, PROT_READ, MAP_SHARED, target_fd, 0);
+        if (rc != BPAK_OK)
+            goto err_close_out;
+
+        job_fits = ((select->decode_time_us == 0) ||
+                    (job->decode_time_us <= select->decode_time_us)) &&
+                   ((select->heap_size == 0) ||
+                    (job->heap_size <= select->heap_size));
+
+        bpak_printf(1,
+                    "auto: part 0x%x encoder 0x%08x, %zi bytes, "
+                    "decode %llu us, heap %zu bytes%s\n",
+                    input_part->id,
+                    job->tm.alg_id_encode,
+                    job->output_size,
+                    (unsigned long long)job->decode_time_us,
+                    job->heap_size,
+                    job_fits ? "" : ", over budget");
+
+        /* Without a fit the fastest decoder is used */
+        if ((best == NULL) || (job_fits && !fits) ||
+            ((job_fits == fits) &&
+             (fits ? (job->output_size < best->output_size) :
+                     (job->decode_time_us < best->decode_time_us)))) {
+            best = job;
+            fits = job_fits;
+        }
+    }
 
-    if (((intptr_t)target_data_mmap) == -1) {
+    if (!fits) {
         bpak_printf(0,
-                    "Error: Could not mmap target data (%s)\n",
-                    strerror(errno));
-        return -BPAK_FAILED;
+                    "Warning: No encoder of part 0x%x fits the decode "
+                    "budget, using the fastest\n",
+                    input_part->id);
     }
 
-    /* Calculate pointer to where the needed data starts */
-    target_data = target_data_mmap + target_offset;
-
-    if (fseek(origin, 0, SEEK_END) != 0) {
-        rc = -BPAK_SEEK_ERROR;
-        goto err_munmap_target;
+    bpak_printf(1,
+                "auto: part 0x%x uses encoder 0x%08x\n",
+                input_part->id,
+                best->tm.alg_id_encode);
+
+    rc = bpak_file_copy(best->fp,
+                        0,
+                        output_fp,
+                        output_offset,
+                        best->output_size);
+
+    if (rc == BPAK_OK) {
+        output_part->flags &= ~BPAK_FLAG_AUTO_MASK;
+        output_part->flags |= best->candidate->decoder << BPAK_FLAG_AUTO_SHIFT;
+        rc = best->output_size;
     }
 
-    long origin_file_sz = ftell(origin);
-
-    if (origin_file_sz == -1) {
-        rc = -BPAK_SEEK_ERROR;
-        goto err_munmap_target;
+err_close_out:
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].fp != NULL)
+            fclose(jobs[i].fp);
     }
 
-    origin_data_mmap =
-        mmap(NULL, origin_file_sz, PROT_READ, MAP_SHARED, origin_fd, 0);
+    bpak_transport_encode_session_free(session);
+    return rc;
+}
 
-    if (((intptr_t)origin_data_mmap) == -1) {
-        bpak_printf(0,
-                    "Error: Could not mmap origin data (%s)\n",
-                    strerror(errno));
-        rc = -BPAK_FAILED;
-        goto err_munmap_target;
+/* Encode the data of one part to 'output_offset' of 'output_fp', returns
+ * the size of the encoded data or a negative number */
+static ssize_t
+transport_encode_data(struct bpak_transport_meta *tm, FILE *input_fp,
+                      struct bpak_header *input_header,
+                      struct bpak_part_header *input_part, FILE *origin_fp,
+                      struct bpak_header *origin_header,
+                      struct bpak_part_header *origin_part,
+                      struct bpak_part_header *output_part, FILE *output_fp,
+                      off_t output_offset,
+                      const struct bpak_transport_encode_options *options)
+{
+    uint32_t alg_id = tm->alg_id_encode;
+    struct encode_progress progress;
+    struct encode_progress *p = NULL;
+    ssize_t output_size;
+
+    if (options->progress != NULL) {
+        memset(&progress, 0, sizeof(progress));
+        progress.options = options;
+        progress.stats.part_id = input_part->id;
+        progress.start_ns = progress_now();
+        p = &progress;
+        progress_report(p, BPAK_TRANSPORT_PART_START);
     }
 
-    /* Calculate pointer to where the needed data starts */
-    origin_data = origin_data_mmap + origin_offset;
-
-    rc = bpak_bsdiff_init(&bsdiff,
-                          origin_data,
-                          origin_length,
-                          target_data,
-                          target_length,
-                          bsdiff_write_output,
-                          output_offset,
-                          compression,
-                          &priv);
-
-    if (rc != BPAK_OK) {
-        bpak_printf(0, "Error: bpak_bsdiff_init failed (%i)\n", rc);
-        goto err_munmap_origin;
+    BPAK_TRACE2(encode__start, input_part->id, alg_id);
+
+    output_size = transport_origin_identical(tm,
+                                             input_fp,
+                                             input_header,
+                                             input_part,
+                                             origin_fp,
+                                             origin_header,
+                                             origin_part,
+                                             options);
+
+    if (output_size < 0)
+        return output_size;
+
+    if (output_size == 1) {
+        /* Nothing is stored, the decoder copies or keeps the origin part */
+        bpak_printf(1,
+                    "Part 0x%x is identical to the origin part\n",
+                    input_part->id);
+        output_part->flags |= BPAK_FLAG_REUSE_ORIGIN;
+        alg_id = BPAK_ID_REUSE_ORIGIN;
+    } else if (alg_id == BPAK_ID_REUSE_ORIGIN) {
+        bpak_printf(0,
+                    "Error: Part 0x%x differs from the origin part\n",
+                    input_part->id);
+        return -BPAK_NOT_SUPPORTED;
     }
 
-    rc = bpak_bsdiff(&bsdiff);
-
-    if (rc < 0) {
-        bpak_printf(0, "Error: bpak_bsdiff failed (%i)\n", rc);
-        goto err_bsdiff_free;
+    if (alg_id == BPAK_ID_AUTO) {
+        output_size = transport_encode_auto(tm,
+                                            input_fp,
+                                            input_header,
+                                            input_part,
+                                            origin_fp,
+                                            origin_header,
+                                            origin_part,
+                                            output_part,
+                                            output_fp,
+                                            output_offset,
+                                            options);
+    } else {
+        output_size = transport_encode_alg(tm,
+                                           alg_id,
+                                           input_fp,
+                                           input_header,
+                                           input_part,
+                                           origin_fp,
+                                           origin_header,
+                                           origin_part,
+                                           output_fp,
+                                           output_offset,
+                                           options,
+                                           p);
     }
 
-    bpak_printf(1, "bsdiff completed, output size = %zu\n", rc);
+    if ((p != NULL) && (output_size >= 0))
+        progress_report(p, BPAK_TRANSPORT_PART_DONE);
 
-err_bsdiff_free:
-    bpak_bsdiff_free(&bsdiff);
-err_munmap_origin:
-    munmap(origin_data_mmap, origin_file_sz);
-err_munmap_target:
-    munmap(target_data_mmap, target_file_sz);
-    return rc;
+    BPAK_TRACE2(encode__done, input_part->id, output_size);
+    return output_size;
 }
 
 static int
 transport_encode_part(struct bpak_transport_meta *tm, uint32_t part_ref_id,
                       FILE *input_fp, struct bpak_header *input_header,
                       FILE *output_fp, struct bpak_header *output_header,
-                      FILE *origin_fp, struct bpak_header *origin_header)
+                      FILE *origin_fp, struct bpak_header *origin_header,
+                      const struct bpak_transport_encode_options *options)
 {
     int rc = 0;
     struct bpak_part_header *input_part = NULL;
@@ -242,12 +1752,14 @@ transport_encode_part(struct bpak_transport_meta *tm, uint32_t part_ref_id,
     }
 
     if (origin_header != NULL) {
-        rc = bpak_get_part(origin_header, part_ref_id, &origin_part);
+        bpak_id_t origin_id = bpak_transport_origin_id(tm, part_ref_id);
+
+        rc = bpak_get_part(origin_header, origin_id, &origin_part);
 
         if (rc != BPAK_OK) {
             bpak_printf(0,
-                        "Error could not get part with ref %x\n",
-                        part_ref_id);
+                        "Error could not get origin part with ref %x\n",
+                        origin_id);
             return rc;
         }
     }
@@ -293,50 +1805,22 @@ transport_encode_part(struct bpak_transport_meta *tm, uint32_t part_ref_id,
         return rc;
     }
 
-    switch (alg_id) {
-    case BPAK_ID_BSDIFF: /* heatshrink compressor */
-    case BPAK_ID_BSDIFF_NO_COMP:
-    case BPAK_ID_BSDIFF_LZMA: {
-        if ((origin_header == NULL) || (origin_fp == NULL)) {
-            bpak_printf(0, "Error: Need an origin stream for diff operation\n");
-            rc = -BPAK_PATCH_READ_ORIGIN_ERROR;
-            goto err_out;
-        }
-
-        enum bpak_compression compression = BPAK_COMPRESSION_NONE;
-
-        if (alg_id == BPAK_ID_BSDIFF)
-            compression = BPAK_COMPRESSION_HS;
-        else if (alg_id == BPAK_ID_BSDIFF_NO_COMP)
-            compression = BPAK_COMPRESSION_NONE;
-        else if (alg_id == BPAK_ID_BSDIFF_LZMA)
-            compression = BPAK_COMPRESSION_LZMA;
-
-        output_size =
-            transport_bsdiff(input_fp,
-                             bpak_part_offset(input_header, input_part),
-                             bpak_part_size(input_part),
-                             origin_fp,
-                             bpak_part_offset(origin_header, origin_part),
-                             bpak_part_size(origin_part),
-                             output_fp,
-                             bpak_part_offset(output_header, output_part),
-                             compression);
-    } break;
-    case BPAK_ID_REMOVE_DATA:
-        /* No data is produced for this part */
-        output_size = 0;
-        break;
-    default:
-        bpak_printf(0, "Error, unknown alg 0x%x\n", alg_id);
-        rc = -1;
-        goto err_out;
-    }
+    output_size = transport_encode_data(tm,
+                                        input_fp,
+                                        input_header,
+                                        input_part,
+                                        origin_fp,
+                                        origin_header,
+                                        origin_part,
+                                        output_part,
+                                        output_fp,
+                                        bpak_part_offset(output_header,
+                                                         output_part),
+                                        options);
 
     if (output_size < 0) {
         bpak_printf(0, "Error: processing of part failed (%i)\n", output_size);
-        rc = output_size;
-        goto err_out;
+        return output_size;
     }
 
     bpak_printf(1, "Done processing, output size %li bytes\n", output_size);
@@ -345,19 +1829,426 @@ transport_encode_part(struct bpak_transport_meta *tm, uint32_t part_ref_id,
     output_part->transport_size = output_size;
     output_part->flags |= BPAK_FLAG_TRANSPORT;
 
-err_out:
+    return BPAK_OK;
+}
+
+/* One part of a parallel encode. The part is encoded into 'fp' at offset
+ * zero and copied to the output once all parts are done. */
+struct encode_job {
+    struct bpak_transport_meta *tm;
+    struct bpak_part_header *input_part;
+    struct bpak_part_header *origin_part;
+    struct bpak_part_header *output_part;
+    size_t cost; /*!< Estimated size of the suffix array */
+    FILE *fp;
+    ssize_t output_size;
+};
+
+struct encode_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct encode_job *jobs;
+    size_t no_of_jobs;
+    size_t next_job;
+    size_t memory_in_use;
+    int rc;
+    FILE *input_fp;
+    struct bpak_header *input_header;
+    FILE *origin_fp;
+    struct bpak_header *origin_header;
+    const struct bpak_transport_encode_options *options;
+};
+
+static size_t encode_job_cost(struct encode_job *job,
+                              struct bpak_header *input_header,
+                              struct bpak_header *origin_header)
+{
+    uint64_t origin_length;
+    uint64_t extra = 0;
+    const bpak_id_t *origin_ids;
+    size_t origin_count;
+
+    switch (job->tm->alg_id_encode) {
+    case BPAK_ID_AUTO: /* The candidates share one origin index */
+    case BPAK_ID_BSDIFF:
+    case BPAK_ID_BSDIFF_NO_COMP:
+    case BPAK_ID_BSDIFF_LZMA:
+    case BPAK_ID_BSDIFF_ZSTD:
+        origin_length = bpak_part_size(job->origin_part);
+
+        if (bpak_get_transport_origin_parts(input_header,
+                                            job->input_part->id,
+                                            &origin_ids,
+                                            &origin_count) == BPAK_OK) {
+            struct bpak_part_header *part;
+
+            origin_length = 0;
+
+            for (size_t i = 0; i < origin_count; i++) {
+                if (bpak_get_part(origin_header, origin_ids[i], &part) ==
+                    BPAK_OK)
+                    origin_length += bpak_part_size(part);
+            }
+
+            /* The virtual origin is copied to memory as well */
+            extra = origin_length;
+        }
+
+        /* Same suffix array width as bsdiff picks */
+        if (origin_length < INT32_MAX)
+            return origin_length * sizeof(int32_t) + extra;
+        else
+            return origin_length * sizeof(int64_t) + extra;
+    default:
+        return 0;
+    }
+}
+
+static void encode_job_run(struct encode_pool *pool, struct encode_job *job)
+{
+    job->fp = tmpfile();
+
+    if (job->fp == NULL) {
+        bpak_printf(0,
+                    "Error: Could not create temporary file (%s)\n",
+                    strerror(errno));
+        job->output_size = -BPAK_WRITE_ERROR;
+        return;
+    }
+
+    bpak_printf(2,
+                "Encoding part 0x%x using encoder 0x%x\n",
+                job->input_part->id,
+                job->tm->alg_id_encode);
+
+    job->output_size = transport_encode_data(job->tm,
+                                             pool->input_fp,
+                                             pool->input_header,
+                                             job->input_part,
+                                             pool->origin_fp,
+                                             pool->origin_header,
+                                             job->origin_part,
+                                             job->output_part,
+                                             job->fp,
+                                             0,
+                                             pool->options);
+}
+
+static void *encode_worker(void *arg)
+{
+    struct encode_pool *pool = (struct encode_pool *)arg;
+    const size_t budget = pool->options->memory_budget;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while ((pool->rc == BPAK_OK) && (pool->next_job < pool->no_of_jobs)) {
+        struct encode_job *job = &pool->jobs[pool->next_job];
+
+        /* Parts are started in order, a part that does not fit next to the
+         * ones that are running waits until they are done */
+        if ((budget != 0) && (pool->memory_in_use > 0) &&
+            (job->cost > budget - BPAK_MIN(budget, pool->memory_in_use))) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+
+        pool->next_job++;
+        pool->memory_in_use += job->cost;
+        pthread_mutex_unlock(&pool->lock);
+
+        encode_job_run(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->memory_in_use -= job->cost;
+
+        if ((job->output_size < 0) && (pool->rc == BPAK_OK)) {
+            bpak_printf(0,
+                        "Error: processing of part failed (%i)\n",
+                        job->output_size);
+            pool->rc = job->output_size;
+        }
+
+        pthread_cond_broadcast(&pool->cond);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Encode the parts into temporary files, by 'part_jobs' threads, and then
+ * copy them and the other parts to the output in order */
+static int transport_encode_spooled(FILE *input_fp,
+                                    struct bpak_header *input_header,
+                                    struct bpak_header_index *input_index,
+                                    FILE *output_fp,
+                                    struct bpak_header *output_header,
+                                    FILE *origin_fp,
+                                    struct bpak_header *origin_header,
+                                    const struct bpak_transport_encode_options
+                                        *options)
+{
+    int rc = BPAK_OK;
+    struct bpak_transport_encode_options worker_options;
+    struct encode_pool pool;
+    struct encode_job *job;
+    struct bpak_meta_header *meta = NULL;
+    uint8_t *input_mmap = NULL;
+    size_t input_mmap_sz = 0;
+    uint8_t *origin_mmap = NULL;
+    size_t origin_mmap_sz = 0;
+    uint8_t *data;
+    pthread_t *threads = NULL;
+    unsigned int no_of_threads;
+    unsigned int started = 0;
+
+    memset(&pool, 0, sizeof(pool));
+    memcpy(&worker_options, options, sizeof(worker_options));
+
+    /* The workers share one mapping of each file instead of seeking and
+     * mapping the streams */
+    if (worker_options.input_map == NULL) {
+        rc = transport_map(input_fp,
+                           NULL,
+                           0,
+                           0,
+                           0,
+                           "input",
+                           &input_mmap,
+                           &input_mmap_sz,
+                           &data);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        worker_options.input_map = input_mmap;
+        worker_options.input_map_size = input_mmap_sz;
+    }
+
+    if ((origin_fp != NULL) && (worker_options.origin_map == NULL)) {
+        rc = transport_map(origin_fp,
+                           NULL,
+                           0,
+                           0,
+                           0,
+                           "origin",
+                           &origin_mmap,
+                           &origin_mmap_sz,
+                           &data);
+
+        if (rc != BPAK_OK)
+            goto err_munmap_out;
+
+        worker_options.origin_map = origin_mmap;
+        worker_options.origin_map_size = origin_mmap_sz;
+    }
+
+    pool.jobs = bpak_calloc(BPAK_MAX_PARTS, sizeof(*pool.jobs));
+
+    if (pool.jobs == NULL) {
+        rc = -BPAK_FAILED;
+        goto err_munmap_out;
+    }
+
+    bpak_foreach_part (input_header, ph) {
+        if (ph->id == 0)
+            break;
+
+        if (bpak_header_index_get_meta(input_index,
+                                       BPAK_ID_BPAK_TRANSPORT,
+                                       ph->id,
+                                       &meta) != BPAK_OK)
+            continue;
+
+        job = &pool.jobs[pool.no_of_jobs];
+        job->tm = bpak_get_meta_ptr(input_header,
+                                    meta,
+                                    struct bpak_transport_meta);
+        job->input_part = ph;
+        rc = bpak_get_part(output_header, ph->id, &job->output_part);
+
+        if ((rc == BPAK_OK) && (origin_header != NULL)) {
+            rc = bpak_get_part(origin_header,
+                               bpak_transport_origin_id(job->tm, ph->id),
+                               &job->origin_part);
+        }
+
+        if (rc != BPAK_OK) {
+            bpak_printf(0, "Error could not get part with ref %x\n", ph->id);
+            goto err_free_jobs_out;
+        }
+
+        /* Already processed for transport ?*/
+        if (job->output_part->flags & BPAK_FLAG_TRANSPORT)
+            continue;
+
+        if (job->origin_part != NULL)
+            job->cost = encode_job_cost(job, input_header, origin_header);
+
+        pool.no_of_jobs++;
+    }
+
+    pool.input_fp = input_fp;
+    pool.input_header = input_header;
+    pool.origin_fp = origin_fp;
+    pool.origin_header = origin_header;
+    pool.options = &worker_options;
+    no_of_threads = BPAK_MIN(options->part_jobs > 1 ? options->part_jobs : 1,
+                             pool.no_of_jobs);
+
+    if (no_of_threads > 0) {
+        threads = bpak_calloc(no_of_threads, sizeof(*threads));
+
+        if (threads == NULL) {
+            rc = -BPAK_FAILED;
+            goto err_free_jobs_out;
+        }
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    bpak_printf(1,
+                "Encoding %zu parts with %u threads\n",
+                pool.no_of_jobs,
+                no_of_threads);
+
+    for (unsigned int i = 0; i < no_of_threads; i++) {
+        if (pthread_create(&threads[i], NULL, encode_worker, &pool) != 0) {
+            bpak_printf(0, "Error: Could not create encoder thread\n");
+            pthread_mutex_lock(&pool.lock);
+            pool.rc = -BPAK_FAILED;
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+
+        started++;
+    }
+
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    rc = pool.rc;
+
+    if (rc != BPAK_OK)
+        goto err_free_jobs_out;
+
+    for (size_t i = 0; i < pool.no_of_jobs; i++) {
+        job = &pool.jobs[i];
+
+        bpak_printf(1,
+                    "Done processing part 0x%x, output size %li bytes\n",
+                    job->input_part->id,
+                    job->output_size);
+
+        job->output_part->transport_size = job->output_size;
+        job->output_part->flags |= BPAK_FLAG_TRANSPORT;
+    }
+
+    if (options->stream) {
+        if (fwrite(output_header, 1, sizeof(*output_header), output_fp) !=
+            sizeof(*output_header)) {
+            bpak_printf(0, "Error: could not write header\n");
+            rc = -BPAK_WRITE_ERROR;
+            goto err_free_jobs_out;
+        }
+    }
+
+    /* Lay out the parts in order, the offset of a part depends on the
+     * transport size of the parts before it. Parts that are not encoded,
+     * including parts that already were transport encoded in the input,
+     * are copied from the input. */
+    job = pool.jobs;
+
+    bpak_foreach_part (input_header, ph) {
+        FILE *fp = input_fp;
+        off_t offset = bpak_part_offset(input_header, ph);
+        uint64_t length = bpak_part_size(ph);
+        struct bpak_part_header *output_part = NULL;
+
+        if (ph->id == 0)
+            break;
+
+        if ((job < &pool.jobs[pool.no_of_jobs]) && (job->input_part == ph)) {
+            fp = job->fp;
+            offset = 0;
+            length = job->output_size;
+            job++;
+        } else {
+            bpak_printf(2, "Copying part: %x\n", ph->id);
+        }
+
+        if (length == 0)
+            continue;
+
+        rc = bpak_get_part(output_header, ph->id, &output_part);
+
+        if (rc != BPAK_OK)
+            goto err_free_jobs_out;
+
+        /* A negative output offset writes at the current position */
+        rc = bpak_file_copy(fp,
+                            offset,
+                            output_fp,
+                            options->stream ?
+                                -1 :
+                                bpak_part_offset(output_header, output_part),
+                            length);
+
+        if (rc != BPAK_OK) {
+            bpak_printf(0, "%s: Could not copy part %x\n", __func__, ph->id);
+            goto err_free_jobs_out;
+        }
+    }
+
+err_free_jobs_out:
+    for (size_t i = 0; i < pool.no_of_jobs; i++) {
+        if (pool.jobs[i].fp != NULL)
+            fclose(pool.jobs[i].fp);
+    }
+
+    bpak_free(threads);
+    bpak_free(pool.jobs);
+err_munmap_out:
+    if (origin_mmap != NULL)
+        munmap(origin_mmap, origin_mmap_sz);
+    if (input_mmap != NULL)
+        munmap(input_mmap, input_mmap_sz);
     return rc;
 }
 
 int bpak_transport_encode(FILE *input_fp, struct bpak_header *input_header,
                           FILE *output_fp, struct bpak_header *output_header,
                           FILE *origin_fp, struct bpak_header *origin_header)
+{
+    return bpak_transport_encode_opts(input_fp,
+                                      input_header,
+                                      output_fp,
+                                      output_header,
+                                      origin_fp,
+                                      origin_header,
+                                      NULL);
+}
+
+int bpak_transport_encode_opts(
+    FILE *input_fp, struct bpak_header *input_header, FILE *output_fp,
+    struct bpak_header *output_header, FILE *origin_fp,
+    struct bpak_header *origin_header,
+    const struct bpak_transport_encode_options *options)
 {
     int rc = BPAK_OK;
     struct bpak_meta_header *meta = NULL;
     struct bpak_transport_meta *tm = NULL;
+    struct bpak_transport_encode_options default_options;
+    struct bpak_header_index input_index;
     ssize_t written;
 
+    if (options == NULL) {
+        memset(&default_options, 0, sizeof(default_options));
+        options = &default_options;
+    }
+
     if ((origin_fp != NULL) && (origin_header != NULL)) {
         uint8_t *origin_package_uuid;
         uint8_t *patch_package_uuid;
@@ -389,15 +2280,28 @@ int bpak_transport_encode(FILE *input_fp, struct bpak_header *input_header,
 
     /* Initialize output header by copying the input header */
     memcpy(output_header, input_header, sizeof(*input_header));
+    bpak_header_index_init(&input_index, input_header);
+
+    if ((options->part_jobs > 1) || options->stream) {
+        rc = transport_encode_spooled(input_fp,
+                                      input_header,
+                                      &input_index,
+                                      output_fp,
+                                      output_header,
+                                      origin_fp,
+                                      origin_header,
+                                      options);
+        goto err_check_out;
+    }
 
     bpak_foreach_part (input_header, ph) {
         if (ph->id == 0)
             break;
 
-        if (bpak_get_meta(input_header,
-                          BPAK_ID_BPAK_TRANSPORT,
-                          ph->id,
-                          &meta) == BPAK_OK) {
+        if (bpak_header_index_get_meta(&input_index,
+                                       BPAK_ID_BPAK_TRANSPORT,
+                                       ph->id,
+                                       &meta) == BPAK_OK) {
             tm = bpak_get_meta_ptr(input_header, meta, struct bpak_transport_meta);
             bpak_printf(2, "Transport encoding part: %x\n", ph->id);
 
@@ -408,7 +2312,8 @@ int bpak_transport_encode(FILE *input_fp, struct bpak_header *input_header,
                                        output_fp,
                                        output_header,
                                        origin_fp,
-                                       origin_header);
+                                       origin_header,
+                                       options);
 
             if (rc != BPAK_OK)
                 break;
@@ -426,11 +2331,16 @@ int bpak_transport_encode(FILE *input_fp, struct bpak_header *input_header,
         }
     }
 
+err_check_out:
     if (rc != BPAK_OK) {
         bpak_printf(0, "%s: Failed\n", __func__);
         goto err_out;
     }
 
+    /* The header is written before the parts of a stream */
+    if (options->stream)
+        goto err_out;
+
     rc = fseek(output_fp, 0, SEEK_SET);
 
     if (rc != 0) {
@@ -87,6 +87,18 @@ BPAK_EXPORT int bpak_meta_to_string(struct bpak_header *h,
     } else if (m->id == BPAK_ID_MERKLE_ROOT_HASH) {
         byte_ptr = bpak_get_meta_ptr(h, m, uint8_t);
         bpak_bin2hex(byte_ptr, 32, buf, size);
+    } else if (m->id == BPAK_ID_MERKLE_BLOCK_SIZE) {
+        uint32_t *block_size = bpak_get_meta_ptr(h, m, uint32_t);
+        snprintf(buf, size, "%" PRIu32, *block_size);
+    } else if (m->id == BPAK_ID_PART_DIGEST) {
+        /* SHA-512 digests are cut to what fits in 'buf' */
+        byte_ptr = bpak_get_meta_ptr(h, m, uint8_t);
+        if (size > 0) {
+            bpak_bin2hex(byte_ptr,
+                         BPAK_MIN(m->size, (size - 1) / 2),
+                         buf,
+                         size);
+        }
     } else if (m->id == BPAK_ID_PB_LOAD_ADDR) {
         uint64_t *entry_addr = bpak_get_meta_ptr(h, m, uint64_t);
         snprintf(buf, size, "Entry: 0x%08" PRIX64, *entry_addr);
@@ -97,6 +109,38 @@ BPAK_EXPORT int bpak_meta_to_string(struct bpak_header *h,
             return -BPAK_SIZE_ERROR;
 
         memcpy(buf, byte_ptr, m->size);
+    } else if (m->id == BPAK_ID_SPARSE_MAP) {
+        struct bpak_sparse_extent *extents =
+            bpak_get_meta_ptr(h, m, struct bpak_sparse_extent);
+        size_t count = m->size / sizeof(*extents);
+        uint64_t zeros = 0;
+
+        for (size_t i = 0; i < count; i++)
+            zeros += (uint64_t)extents[i].count * BPAK_SPARSE_BLOCK_SZ;
+
+        snprintf(buf,
+                 size,
+                 "Extents: %zu, zero bytes: %" PRIu64,
+                 count,
+                 zeros);
+    } else if (m->id == BPAK_ID_ORIGIN_PARTS) {
+        size_t n = 0;
+
+        id_ptr = bpak_get_meta_ptr(h, m, bpak_id_t);
+
+        if (size)
+            *buf = 0;
+
+        for (size_t i = 0; i < m->size / sizeof(bpak_id_t); i++) {
+            if (n >= size)
+                break;
+
+            n += snprintf(&buf[n],
+                          size - n,
+                          "%s%8.8" PRIx32,
+                          i ? " " : "",
+                          id_ptr[i]);
+        }
     } else if (m->id == BPAK_ID_KEYSTORE_PROVIDER_ID) {
         id_ptr = bpak_get_meta_ptr(h, m, bpak_id_t);
         snprintf(buf, size, "0x%" PRIx32, *id_ptr);
@@ -8,6 +8,8 @@
  */
 
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <bpak/bpak.h>
 #include <bpak/id.h>
@@ -16,12 +18,14 @@
 #include <bpak/merkle.h>
 #include <bpak/crypto.h>
 #include <bpak/utils.h>
+#include "hash_pipeline.h"
 
 BPAK_EXPORT int bpak_verify_compute_header_hash(struct bpak_header *header,
                                                 uint8_t *output, size_t *size)
 {
     int rc;
-    uint8_t zero = 0;
+    static const uint8_t zeros[sizeof(header->signature) +
+                               sizeof(header->signature_sz)];
     struct bpak_hash_context hash_ctx;
 
     /* Compute header hash */
@@ -39,14 +43,10 @@ BPAK_EXPORT int bpak_verify_compute_header_hash(struct bpak_header *header,
         goto err_free_hash_ctx_out;
 
     /* Additional update to hash zeroes for signature/signature_sz */
-    bytes_to_hash = sizeof(header->signature) + sizeof(header->signature_sz);
+    rc = bpak_hash_update(&hash_ctx, zeros, sizeof(zeros));
 
-    for (size_t i = 0; i < bytes_to_hash; i++) {
-        rc = bpak_hash_update(&hash_ctx, &zero, 1);
-
-        if (rc != BPAK_OK)
-            goto err_free_hash_ctx_out;
-    }
+    if (rc != BPAK_OK)
+        goto err_free_hash_ctx_out;
 
     rc = bpak_hash_final(&hash_ctx, output, *size, size);
 
@@ -64,47 +64,43 @@ BPAK_EXPORT int bpak_verify_compute_payload_hash(struct bpak_header *header,
                                                  uint8_t *output, size_t *size)
 {
     off_t current_offset = data_offset;
-    unsigned char chunk_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    struct bpak_hash_range ranges[BPAK_MAX_PARTS];
+    size_t no_of_ranges = 0;
     int rc;
     struct bpak_hash_context hash_ctx;
 
-    rc = bpak_hash_init(&hash_ctx, header->hash_kind);
-
-    if (rc != BPAK_OK)
-        return rc;
+    /* The tables are hashed before the parts, see
+     * bpak_verify_payload_tables */
+    if (bpak_header_size(header) != sizeof(*header))
+        return -BPAK_NOT_SUPPORTED;
 
     bpak_foreach_part (header, p) {
-        size_t bytes_to_read = bpak_part_size(p);
-        size_t chunk = 0;
-
         if (!p->id)
             continue;
 
-        if (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH) {
-            current_offset += bpak_part_size(p);
-            continue;
+        if (!(p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH)) {
+            bpak_hash_range_add(ranges,
+                                &no_of_ranges,
+                                current_offset,
+                                bpak_part_size(p));
         }
 
-        do {
-            chunk = (bytes_to_read > sizeof(chunk_buffer))
-                        ? sizeof(chunk_buffer)
-                        : bytes_to_read;
+        current_offset += bpak_part_size(p);
+    }
 
-            if (read_payload(current_offset, chunk_buffer, chunk, user) !=
-                (ssize_t)chunk) {
-                rc = -BPAK_READ_ERROR;
-                goto err_free_hash_ctx_out;
-            }
+    rc = bpak_hash_init(&hash_ctx, header->hash_kind);
 
-            rc = bpak_hash_update(&hash_ctx, chunk_buffer, chunk);
+    if (rc != BPAK_OK)
+        return rc;
 
-            if (rc != BPAK_OK)
-                goto err_free_hash_ctx_out;
+    rc = bpak_hash_pipeline(&hash_ctx,
+                            ranges,
+                            no_of_ranges,
+                            read_payload,
+                            user);
 
-            bytes_to_read -= chunk;
-            current_offset += chunk;
-        } while (bytes_to_read);
-    }
+    if (rc != BPAK_OK)
+        goto err_free_hash_ctx_out;
 
     rc = bpak_hash_final(&hash_ctx, output, *size, size);
 
@@ -116,17 +112,117 @@ err_free_hash_ctx_out:
     return rc;
 }
 
+BPAK_EXPORT int bpak_verify_compute_part_digest(struct bpak_header *header,
+                                                struct bpak_part_header *part,
+                                                bpak_io_t read_payload,
+                                                off_t data_offset, void *user,
+                                                uint8_t *output, size_t *size)
+{
+    return bpak_verify_compute_part_digest_tables(header,
+                                                  NULL,
+                                                  0,
+                                                  part,
+                                                  read_payload,
+                                                  data_offset,
+                                                  user,
+                                                  output,
+                                                  size);
+}
+
+BPAK_EXPORT int
+bpak_verify_compute_part_digest_tables(struct bpak_header *header,
+                                       struct bpak_header *tables,
+                                       unsigned int count,
+                                       struct bpak_part_header *part,
+                                       bpak_io_t read_payload,
+                                       off_t data_offset, void *user,
+                                       uint8_t *output, size_t *size)
+{
+    struct bpak_hash_range range;
+    off_t current_offset;
+    int rc;
+    struct bpak_hash_context hash_ctx;
+
+    if (count == 0)
+        current_offset = bpak_part_offset(header, part);
+    else
+        current_offset = bpak_tables_part_offset(header, tables, count, part);
+
+    current_offset += data_offset - sizeof(struct bpak_header);
+
+    rc = bpak_hash_init(&hash_ctx, header->hash_kind);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    range.offset = current_offset;
+    range.length = bpak_part_size(part);
+    rc = bpak_hash_pipeline(&hash_ctx, &range, 1, read_payload, user);
+
+    if (rc != BPAK_OK)
+        goto err_free_hash_ctx_out;
+
+    rc = bpak_hash_final(&hash_ctx, output, *size, size);
+
+err_free_hash_ctx_out:
+    bpak_hash_free(&hash_ctx);
+    return rc;
+}
+
+BPAK_EXPORT int bpak_verify_part_digest(struct bpak_header *header,
+                                        bpak_id_t part_id,
+                                        bpak_io_t read_payload,
+                                        off_t data_offset, void *user)
+{
+    int rc;
+    uint8_t hash[BPAK_HASH_MAX_LENGTH];
+    size_t hash_length = sizeof(hash);
+    struct bpak_part_header *part = NULL;
+    struct bpak_meta_header *meta = NULL;
+
+    rc = bpak_get_part(header, part_id, &part);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_get_meta(header, BPAK_ID_PART_DIGEST, part_id, &meta);
+
+    if (rc != BPAK_OK)
+        return -BPAK_MISSING_META_DATA;
+
+    rc = bpak_verify_compute_part_digest(header,
+                                         part,
+                                         read_payload,
+                                         data_offset,
+                                         user,
+                                         hash,
+                                         &hash_length);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if ((meta->size != hash_length) ||
+        (memcmp(hash, bpak_get_meta_ptr(header, meta, uint8_t), hash_length) !=
+         0)) {
+        return -BPAK_BAD_PAYLOAD_HASH;
+    }
+
+    return BPAK_OK;
+}
+
 #if BPAK_CONFIG_MERKLE == 1
 struct merkle_verify_private {
     void *user;
     bpak_io_t read_payload;
 };
 
+/* The merkle code writes the computed tree a block at a time, compare it
+ * with the stored tree in reads of the same size */
 static ssize_t merkle_verify_wr(off_t offset, uint8_t *buf, size_t size,
                                 void *user)
 {
-    uint8_t chunk_buffer[BPAK_MERKLE_HASH_BYTES];
-    ssize_t chunk_length;
+    uint8_t chunk_buffer[BPAK_MERKLE_BLOCK_SZ];
+    size_t chunk_length;
     size_t bytes_to_process = size;
     struct merkle_verify_private *priv = (struct merkle_verify_private *)user;
     off_t current_offset = 0;
@@ -141,7 +237,7 @@ static ssize_t merkle_verify_wr(off_t offset, uint8_t *buf, size_t size,
 
         if (bytes_read < 0)
             return bytes_read;
-        if (bytes_read != chunk_length)
+        if ((size_t)bytes_read != chunk_length)
             return -BPAK_READ_ERROR;
 
         if (memcmp(&buf[current_offset], chunk_buffer, chunk_length) != 0) {
@@ -160,11 +256,18 @@ static ssize_t merkle_verify_rd(off_t offset, uint8_t *buf, size_t size,
     return priv->read_payload(offset, buf, size, priv->user);
 }
 
-BPAK_EXPORT int bpak_verify_merkle_tree(bpak_io_t read_payload,
-                                        off_t data_offset, size_t data_length,
-                                        off_t tree_offset,
-                                        bpak_merkle_hash_t expected_root_hash,
-                                        bpak_merkle_hash_t salt, void *user)
+/* 'data_length' bytes of stored data at 'data_offset', the tree of a part
+ * with a 'sparse' map covers the expanded data. The tree is read with
+ * 'read_tree', which may be another device than the data. */
+static int verify_merkle_tree(bpak_io_t read_payload, off_t data_offset,
+                              size_t data_length,
+                              const struct bpak_sparse_map *sparse,
+                              off_t tree_offset,
+                              bpak_merkle_hash_t expected_root_hash,
+                              bpak_merkle_hash_t salt,
+                              const struct bpak_merkle_options *options,
+                              void *user, bpak_io_t read_tree,
+                              void *tree_user)
 {
     int rc;
     struct bpak_merkle_context ctx;
@@ -172,18 +275,19 @@ BPAK_EXPORT int bpak_verify_merkle_tree(bpak_io_t read_payload,
     struct merkle_verify_private merkle_verify_private;
 
     memset(&merkle_verify_private, 0, sizeof(merkle_verify_private));
-    merkle_verify_private.read_payload = read_payload;
-    merkle_verify_private.user = user;
-
-    rc = bpak_merkle_init(&ctx,
-                          data_length,
-                          salt,
-                          32,
-                          merkle_verify_wr,
-                          merkle_verify_rd,
-                          tree_offset,
-                          false,
-                          &merkle_verify_private);
+    merkle_verify_private.read_payload = read_tree;
+    merkle_verify_private.user = tree_user;
+
+    rc = bpak_merkle_init_opts(&ctx,
+                               (sparse != NULL) ? sparse->size : data_length,
+                               salt,
+                               32,
+                               merkle_verify_wr,
+                               merkle_verify_rd,
+                               tree_offset,
+                               false,
+                               options,
+                               &merkle_verify_private);
 
     if (rc != BPAK_OK) {
         return rc;
@@ -203,7 +307,15 @@ BPAK_EXPORT int bpak_verify_merkle_tree(bpak_io_t read_payload,
         if (bytes_read != chunk_length)
             return -BPAK_READ_ERROR;
 
-        rc = bpak_merkle_write_chunk(&ctx, chunk_buffer, chunk_length);
+        if (sparse != NULL) {
+            rc = bpak_merkle_write_sparse(&ctx,
+                                          sparse,
+                                          data_length - bytes_to_process,
+                                          chunk_buffer,
+                                          chunk_length);
+        } else {
+            rc = bpak_merkle_write_chunk(&ctx, chunk_buffer, chunk_length);
+        }
 
         if (rc != BPAK_OK) {
             return rc;
@@ -228,97 +340,725 @@ BPAK_EXPORT int bpak_verify_merkle_tree(bpak_io_t read_payload,
 
     return BPAK_OK;
 }
+
+BPAK_EXPORT int bpak_verify_merkle_tree(bpak_io_t read_payload,
+                                        off_t data_offset, size_t data_length,
+                                        off_t tree_offset,
+                                        bpak_merkle_hash_t expected_root_hash,
+                                        bpak_merkle_hash_t salt, void *user)
+{
+    return verify_merkle_tree(read_payload,
+                              data_offset,
+                              data_length,
+                              NULL,
+                              tree_offset,
+                              expected_root_hash,
+                              salt,
+                              NULL,
+                              user,
+                              read_payload,
+                              user);
+}
+#endif // BPAK_CONFIG_MERKLE
+
+/* Meta data and part lookups in a header and its continuation tables, the
+ * header is indexed and the tables are searched in order */
+struct verify_lookup {
+    struct bpak_header_index index;
+    struct bpak_header *tables;
+    unsigned int count;
+};
+
+#if BPAK_CONFIG_MERKLE == 1
+static int verify_get_meta(const struct verify_lookup *lookup, bpak_id_t id,
+                           bpak_id_t part_id_ref, uint8_t **data)
+{
+    struct bpak_meta_header *meta;
+    struct bpak_header *table = lookup->index.header;
+
+    if (bpak_header_index_get_meta(&lookup->index, id, part_id_ref, &meta) ==
+        BPAK_OK) {
+        (*data) = bpak_get_meta_ptr(table, meta, uint8_t);
+        return BPAK_OK;
+    }
+
+    for (unsigned int i = 0; i < lookup->count; i++) {
+        table = &lookup->tables[i];
+
+        if (bpak_get_meta(table, id, part_id_ref, &meta) == BPAK_OK) {
+            (*data) = bpak_get_meta_ptr(table, meta, uint8_t);
+            return BPAK_OK;
+        }
+    }
+
+    return -BPAK_NOT_FOUND;
+}
+
+static int verify_get_part(const struct verify_lookup *lookup, bpak_id_t id,
+                           struct bpak_part_header **part)
+{
+    if (bpak_header_index_get_part(&lookup->index, id, part) == BPAK_OK)
+        return BPAK_OK;
+
+    for (unsigned int i = 0; i < lookup->count; i++) {
+        if (bpak_get_part(&lookup->tables[i], id, part) == BPAK_OK)
+            return BPAK_OK;
+    }
+
+    return -BPAK_NOT_FOUND;
+}
+
+/* Offset of 'part' as bpak_part_offset */
+static off_t verify_part_offset(const struct verify_lookup *lookup,
+                                struct bpak_part_header *part)
+{
+    struct bpak_header *header = lookup->index.header;
+
+    if ((part >= header->parts) && (part < &header->parts[BPAK_MAX_PARTS]))
+        return bpak_header_index_part_offset(&lookup->index, part);
+
+    return bpak_tables_part_offset(header,
+                                   lookup->tables,
+                                   lookup->count,
+                                   part);
+}
+
+/* Look up the root hash, salt, tree layout and hash tree offset of part
+ * 'p'. Returns -BPAK_NOT_FOUND when the part has no hash tree. */
+static int verify_part_merkle_meta(const struct verify_lookup *lookup,
+                                   struct bpak_part_header *p,
+                                   off_t data_offset, uint8_t **root_hash,
+                                   uint8_t **salt,
+                                   struct bpak_merkle_options *options,
+                                   off_t *tree_offset)
+{
+    int rc;
+    struct bpak_part_header *merkle_tree_part = NULL;
+    uint8_t *block_size = NULL;
+
+    /* Test part to see if it has a hash tree */
+    rc = verify_get_meta(lookup, BPAK_ID_MERKLE_ROOT_HASH, p->id, root_hash);
+
+    if (rc != BPAK_OK)
+        return -BPAK_NOT_FOUND;
+
+    /* There should also be a salt meta data for this part */
+    rc = verify_get_meta(lookup, BPAK_ID_MERKLE_SALT, p->id, salt);
+
+    if (rc != BPAK_OK)
+        return -BPAK_MISSING_META_DATA;
+
+    /* Trees without a block size meta use the default, 'block_size' is
+     * left as NULL */
+    (void)verify_get_meta(lookup,
+                          BPAK_ID_MERKLE_BLOCK_SIZE,
+                          p->id,
+                          &block_size);
+
+    bpak_merkle_options_from_meta(block_size, options);
+
+    /* The part id of the merkle tree is always an extension of the data
+     * part id, suffixed with '-hash-tree' */
+    rc = verify_get_part(lookup,
+                         bpak_part_id_to_hash_tree_id(p->id),
+                         &merkle_tree_part);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    /* Tree offset relative input 'data_offset' */
+    (*tree_offset) = verify_part_offset(lookup, merkle_tree_part) -
+                     sizeof(struct bpak_header) + data_offset;
+
+    return BPAK_OK;
+}
 #endif // BPAK_CONFIG_MERKLE
 
+/* The payload hash and the merkle trees are computed in one pass over the
+ * payload. A failed merkle tree is only reported when the payload hash is
+ * correct, a bad payload hash takes precedence. */
 BPAK_EXPORT int bpak_verify_payload(struct bpak_header *header,
                                     bpak_io_t read_payload, off_t data_offset,
                                     void *user)
+{
+    return bpak_verify_payload_tables(header,
+                                      NULL,
+                                      0,
+                                      read_payload,
+                                      data_offset,
+                                      user);
+}
+
+BPAK_EXPORT int bpak_verify_payload_tables(struct bpak_header *header,
+                                           struct bpak_header *tables,
+                                           unsigned int count,
+                                           bpak_io_t read_payload,
+                                           off_t data_offset, void *user)
+{
+    int rc;
+    int merkle_rc = BPAK_OK;
+    uint8_t hash[BPAK_HASH_MAX_LENGTH];
+    size_t hash_length = sizeof(hash);
+    unsigned char chunk_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    off_t current_offset = data_offset + count * sizeof(struct bpak_header);
+    struct bpak_hash_context hash_ctx;
+#if BPAK_CONFIG_MERKLE == 1
+    struct bpak_merkle_context merkle;
+    struct merkle_verify_private merkle_verify_private;
+    uint8_t *part_merkle_root_hash = NULL;
+    uint8_t *part_merkle_salt = NULL;
+    struct bpak_merkle_options part_merkle_options;
+    off_t part_tree_offset = 0;
+    struct verify_lookup lookup;
+    struct bpak_sparse_map sparse;
+
+    /* The merkle meta data of every part is looked up in the index */
+    bpak_header_index_init(&lookup.index, header);
+    lookup.tables = tables;
+    lookup.count = count;
+    memset(&merkle_verify_private, 0, sizeof(merkle_verify_private));
+    merkle_verify_private.read_payload = read_payload;
+    merkle_verify_private.user = user;
+#endif
+
+    if (bpak_header_size(header) != (1 + count) * sizeof(*header))
+        return -BPAK_NOT_SUPPORTED;
+
+    for (unsigned int i = 0; i < count; i++) {
+        rc = bpak_valid_table(&tables[i]);
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    rc = bpak_hash_init(&hash_ctx, header->hash_kind);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    /* The tables come first in the payload hash */
+    for (unsigned int i = 0; i < count; i++) {
+        rc = bpak_hash_update(&hash_ctx,
+                              (uint8_t *)&tables[i],
+                              sizeof(tables[i]));
+
+        if (rc != BPAK_OK)
+            goto err_free_hash_ctx_out;
+    }
+
+    bpak_foreach_table (header, tables, count, t)
+    bpak_foreach_part (t, p) {
+        size_t bytes_to_read = bpak_part_size(p);
+        bool hashed = !(p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH);
+        bool merkle_part = false;
+
+        if (!p->id)
+            continue;
+
+#if BPAK_CONFIG_MERKLE == 1
+        if (merkle_rc == BPAK_OK) {
+            rc = verify_part_merkle_meta(&lookup,
+                                         p,
+                                         data_offset,
+                                         &part_merkle_root_hash,
+                                         &part_merkle_salt,
+                                         &part_merkle_options,
+                                         &part_tree_offset);
+
+            /* The tree of a sparse part covers the expanded data */
+            if (rc == BPAK_OK) {
+                rc = bpak_tables_get_sparse_map(header,
+                                                tables,
+                                                count,
+                                                p,
+                                                &sparse);
+            }
+
+            if (rc == BPAK_OK) {
+                rc = bpak_merkle_init_opts(&merkle,
+                                           (p->flags & BPAK_FLAG_SPARSE) ?
+                                               sparse.size :
+                                               bytes_to_read,
+                                           part_merkle_salt,
+                                           32,
+                                           merkle_verify_wr,
+                                           merkle_verify_rd,
+                                           part_tree_offset,
+                                           false,
+                                           &part_merkle_options,
+                                           &merkle_verify_private);
+                merkle_part = (rc == BPAK_OK);
+            }
+
+            if ((rc != BPAK_OK) && (rc != -BPAK_NOT_FOUND))
+                merkle_rc = rc;
+        }
+#endif
+
+        if (!hashed && !merkle_part) {
+            current_offset += bytes_to_read;
+            continue;
+        }
+
+        while (bytes_to_read > 0) {
+            size_t chunk = BPAK_MIN(bytes_to_read, sizeof(chunk_buffer));
+
+            if (read_payload(current_offset, chunk_buffer, chunk, user) !=
+                (ssize_t)chunk) {
+                rc = -BPAK_READ_ERROR;
+                goto err_free_hash_ctx_out;
+            }
+
+            if (hashed) {
+                rc = bpak_hash_update(&hash_ctx, chunk_buffer, chunk);
+
+                if (rc != BPAK_OK)
+                    goto err_free_hash_ctx_out;
+            }
+
+#if BPAK_CONFIG_MERKLE == 1
+            if (merkle_part && (p->flags & BPAK_FLAG_SPARSE)) {
+                merkle_rc = bpak_merkle_write_sparse(&merkle,
+                                                     &sparse,
+                                                     bpak_part_size(p) -
+                                                         bytes_to_read,
+                                                     chunk_buffer,
+                                                     chunk);
+                merkle_part = (merkle_rc == BPAK_OK);
+            } else if (merkle_part) {
+                merkle_rc =
+                    bpak_merkle_write_chunk(&merkle, chunk_buffer, chunk);
+                merkle_part = (merkle_rc == BPAK_OK);
+            }
+#endif
+            bytes_to_read -= chunk;
+            current_offset += chunk;
+        }
+
+#if BPAK_CONFIG_MERKLE == 1
+        if (merkle_part) {
+            bpak_merkle_hash_t calculated_root_hash;
+
+            merkle_rc = bpak_merkle_finish(&merkle, calculated_root_hash);
+
+            if ((merkle_rc == BPAK_OK) &&
+                (memcmp(calculated_root_hash,
+                        part_merkle_root_hash,
+                        BPAK_MERKLE_HASH_BYTES) != 0)) {
+                merkle_rc = -BPAK_BAD_ROOT_HASH;
+            }
+        }
+#endif
+    }
+
+    rc = bpak_hash_final(&hash_ctx, hash, hash_length, &hash_length);
+
+    if (rc != BPAK_OK)
+        goto err_free_hash_ctx_out;
+
+    if (memcmp(hash, header->payload_hash, hash_length) != 0)
+        rc = -BPAK_BAD_PAYLOAD_HASH;
+    else
+        rc = merkle_rc;
+
+err_free_hash_ctx_out:
+    bpak_hash_free(&hash_ctx);
+    return rc;
+}
+
+#if BPAK_CONFIG_MERKLE == 1
+enum verify_task_kind {
+    VERIFY_PAYLOAD_HASH,
+    VERIFY_PART_DIGEST,
+    VERIFY_MERKLE_TREE,
+};
+
+struct verify_task {
+    enum verify_task_kind kind;
+    struct bpak_part_header *part;
+    struct bpak_sparse_map sparse; /* Zero extents of a sparse part */
+    uint8_t *root_hash;
+    uint8_t *salt;
+    struct bpak_merkle_options merkle_options;
+    off_t part_data_offset;
+    off_t part_tree_offset;
+    bpak_io_t read_payload; /* Reads the part data */
+    off_t data_offset;      /* Payload data offset for 'read_payload' */
+    void *user;
+    bpak_io_t read_tree;    /* Reads the hash tree of the part */
+    void *tree_user;
+    bool done;
+    int rc;
+};
+
+struct verify_pool {
+    struct bpak_header *header;
+    bpak_io_t read_payload;
+    off_t data_offset;
+    void *user;
+    struct verify_task tasks[BPAK_MAX_PARTS * 2];
+    size_t task_count;
+    size_t next_task;
+    pthread_mutex_t lock;
+};
+
+static int verify_task_run(struct verify_pool *pool, struct verify_task *task)
 {
     int rc;
     uint8_t hash[BPAK_HASH_MAX_LENGTH];
     size_t hash_length = sizeof(hash);
 
-    /* Compute and compare payload hash */
-    rc = bpak_verify_compute_payload_hash(header,
-                                          read_payload,
-                                          data_offset,
-                                          user,
+    if (task->kind == VERIFY_PART_DIGEST) {
+        return bpak_verify_part_digest(pool->header,
+                                       task->part->id,
+                                       task->read_payload,
+                                       task->data_offset,
+                                       task->user);
+    }
+
+    if (task->kind == VERIFY_MERKLE_TREE) {
+        return verify_merkle_tree(task->read_payload,
+                                  task->part_data_offset,
+                                  bpak_part_size(task->part),
+                                  (task->part->flags & BPAK_FLAG_SPARSE) ?
+                                      &task->sparse :
+                                      NULL,
+                                  task->part_tree_offset,
+                                  task->root_hash,
+                                  task->salt,
+                                  &task->merkle_options,
+                                  task->user,
+                                  task->read_tree,
+                                  task->tree_user);
+    }
+
+    rc = bpak_verify_compute_payload_hash(pool->header,
+                                          pool->read_payload,
+                                          pool->data_offset,
+                                          pool->user,
                                           hash,
                                           &hash_length);
 
     if (rc != BPAK_OK)
         return rc;
 
-    if (memcmp(hash, header->payload_hash, hash_length) != 0) {
+    if (memcmp(hash, pool->header->payload_hash, hash_length) != 0)
         return -BPAK_BAD_PAYLOAD_HASH;
+
+    return BPAK_OK;
+}
+
+/* True when every part that is covered by the payload hash has a digest */
+static bool verify_has_part_digests(const struct bpak_header_index *index)
+{
+    struct bpak_meta_header *meta;
+    bool has_parts = false;
+
+    bpak_foreach_part (index->header, p) {
+        if (!p->id || (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH))
+            continue;
+
+        if (bpak_header_index_get_meta(index,
+                                       BPAK_ID_PART_DIGEST,
+                                       p->id,
+                                       &meta) != BPAK_OK) {
+            return false;
+        }
+
+        has_parts = true;
     }
 
+    return has_parts;
+}
+
+static void *verify_worker(void *arg)
+{
+    struct verify_pool *pool = (struct verify_pool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->next_task < pool->task_count) {
+        struct verify_task *task = &pool->tasks[pool->next_task++];
+
+        if (task->done)
+            continue;
+
+        pthread_mutex_unlock(&pool->lock);
+        task->rc = verify_task_run(pool, task);
+        pthread_mutex_lock(&pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Run the tasks of 'pool' on up to 'jobs' threads, returns the result of
+ * the first task that failed */
+static int verify_pool_run(struct verify_pool *pool, unsigned int jobs)
+{
+    pthread_t threads[BPAK_MAX_PARTS * 2];
+    unsigned int thread_count = 0;
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    jobs = BPAK_MIN(jobs, pool->task_count);
+
+    for (; thread_count < jobs; thread_count++) {
+        if (pthread_create(&threads[thread_count],
+                           NULL,
+                           verify_worker,
+                           pool) != 0)
+            break;
+    }
+
+    /* Run the queue in this thread if no worker could be started */
+    if (thread_count == 0)
+        verify_worker(pool);
+
+    for (unsigned int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+
+    for (size_t i = 0; i < pool->task_count; i++) {
+        if (pool->tasks[i].rc != BPAK_OK)
+            return pool->tasks[i].rc;
+    }
+
+    return BPAK_OK;
+}
+#endif // BPAK_CONFIG_MERKLE
+
+BPAK_EXPORT int bpak_verify_payload_parallel(struct bpak_header *header,
+                                             bpak_io_t read_payload,
+                                             off_t data_offset, void *user,
+                                             unsigned int jobs)
+{
 #if BPAK_CONFIG_MERKLE == 1
-    struct bpak_meta_header *meta;
-    uint8_t *part_merkle_root_hash;
-    uint8_t *part_merkle_salt;
+    struct verify_pool pool;
+    struct verify_lookup lookup;
+    int rc = BPAK_OK;
+
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = (cpus > 0) ? cpus : 1;
+    }
+
+    if (jobs == 1)
+        return bpak_verify_payload(header, read_payload, data_offset, user);
+
+    memset(&pool, 0, sizeof(pool));
+    pool.header = header;
+    pool.read_payload = read_payload;
+    pool.data_offset = data_offset;
+    pool.user = user;
+
+    /* When every hashed part has a digest in the signed header the parts
+     * are checked one by one, otherwise the payload hash is the first task.
+     * The merkle trees follow with one task per tree. */
+    bpak_header_index_init(&lookup.index, header);
+    lookup.tables = NULL;
+    lookup.count = 0;
+
+    if (verify_has_part_digests(&lookup.index)) {
+        bpak_foreach_part (header, p) {
+            if (!p->id || (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH))
+                continue;
+
+            pool.tasks[pool.task_count].kind = VERIFY_PART_DIGEST;
+            pool.tasks[pool.task_count].part = p;
+            pool.tasks[pool.task_count].read_payload = read_payload;
+            pool.tasks[pool.task_count].data_offset = data_offset;
+            pool.tasks[pool.task_count].user = user;
+            pool.task_count++;
+        }
+    } else {
+        pool.tasks[pool.task_count++].kind = VERIFY_PAYLOAD_HASH;
+    }
 
-    /* Compute and compare merkle hash trees and root hashes */
     bpak_foreach_part (header, p) {
+        struct verify_task *task = &pool.tasks[pool.task_count];
+
         if (!p->id)
             continue;
 
-        /* Test part to see if it has a hash tree */
-        rc = bpak_get_meta(header,
-                           BPAK_ID_MERKLE_ROOT_HASH,
-                           p->id,
-                           &meta);
+        rc = verify_part_merkle_meta(&lookup,
+                                     p,
+                                     data_offset,
+                                     &task->root_hash,
+                                     &task->salt,
+                                     &task->merkle_options,
+                                     &task->part_tree_offset);
 
-        if (rc != BPAK_OK) {
-            /* This part does not have a merkle tree, skip to next part */
+        if (rc == -BPAK_NOT_FOUND)
             continue;
-        }
-        part_merkle_root_hash = bpak_get_meta_ptr(header, meta, uint8_t);
 
-        /* There should also be a salt meta data for this part */
-        rc = bpak_get_meta(header,
-                           BPAK_ID_MERKLE_SALT,
-                           p->id,
-                           &meta);
+        if (rc == BPAK_OK)
+            rc = bpak_tables_get_sparse_map(header, NULL, 0, p, &task->sparse);
 
-        if (rc != BPAK_OK)
-            return -BPAK_MISSING_META_DATA;
-        part_merkle_salt = bpak_get_meta_ptr(header, meta, uint8_t);
+        task->kind = VERIFY_MERKLE_TREE;
+        task->part = p;
+        task->part_data_offset = verify_part_offset(&lookup, p) -
+                                 sizeof(struct bpak_header) + data_offset;
+        task->read_payload = read_payload;
+        task->user = user;
+        task->read_tree = read_payload;
+        task->tree_user = user;
+        task->done = (rc != BPAK_OK);
+        task->rc = rc;
+        pool.task_count++;
+    }
+
+    /* Errors are reported in the same order as bpak_verify_payload, the
+     * payload hash first and then the parts in header order */
+    return verify_pool_run(&pool, jobs);
+#else
+    (void)jobs;
+    return bpak_verify_payload(header, read_payload, data_offset, user);
+#endif // BPAK_CONFIG_MERKLE
+}
 
-        /* Compute the part id for the merkle tree, this is always an
-         *  extension of the data part id, suffixed with '-hash-tree'
-         */
-        uint32_t merkle_tree_part_id = bpak_part_id_to_hash_tree_id(p->id);
+#if BPAK_CONFIG_MERKLE == 1
+static const struct bpak_verify_location *
+verify_find_location(const struct bpak_verify_location *locations,
+                     size_t count, bpak_id_t part_id)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (locations[i].part_id == part_id)
+            return &locations[i];
+    }
 
-        struct bpak_part_header *merkle_tree_part = NULL;
+    return NULL;
+}
 
-        /* Get the hash tree meta data header */
-        rc = bpak_get_part(header, merkle_tree_part_id, &merkle_tree_part);
+/* True when 'part_id' is the hash tree of another installed part */
+static bool verify_is_installed_tree(const struct bpak_verify_location *loc,
+                                     size_t count, bpak_id_t part_id)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (bpak_part_id_to_hash_tree_id(loc[i].part_id) == part_id)
+            return true;
+    }
 
-        if (rc != BPAK_OK) {
+    return false;
+}
+#endif // BPAK_CONFIG_MERKLE
+
+BPAK_EXPORT int
+bpak_verify_installed(struct bpak_header *header,
+                      const struct bpak_verify_location *locations,
+                      size_t count, unsigned int jobs)
+{
+    int rc;
+#if BPAK_CONFIG_MERKLE == 1
+    struct verify_pool pool;
+    struct verify_lookup lookup;
+
+    if (count > BPAK_MAX_PARTS)
+        return -BPAK_SIZE_ERROR;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.header = header;
+    bpak_header_index_init(&lookup.index, header);
+    lookup.tables = NULL;
+    lookup.count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct bpak_verify_location *loc = &locations[i];
+        const struct bpak_verify_location *tree_loc = NULL;
+        struct bpak_part_header *p;
+        struct bpak_meta_header *meta;
+        struct verify_task *task;
+        bool checked = false;
+
+        rc = bpak_get_part(header, loc->part_id, &p);
+
+        if (rc != BPAK_OK)
             return rc;
+
+        /* The digest covers the data as it is stored in the package, the
+         * offset is moved so that the part lands at 'loc->offset' */
+        if (bpak_header_index_get_meta(&lookup.index,
+                                       BPAK_ID_PART_DIGEST,
+                                       p->id,
+                                       &meta) == BPAK_OK) {
+            task = &pool.tasks[pool.task_count++];
+            task->kind = VERIFY_PART_DIGEST;
+            task->part = p;
+            task->read_payload = loc->read_payload;
+            task->data_offset = loc->offset - bpak_part_offset(header, p) +
+                                sizeof(struct bpak_header);
+            task->user = loc->user;
+            checked = true;
         }
 
-        /* Compute part data and tree offsets relative input 'data_offset' */
-        off_t part_data_offset = bpak_part_offset(header, p) -
-                                 sizeof(struct bpak_header) + data_offset;
-        off_t part_tree_offset = bpak_part_offset(header, merkle_tree_part) -
-                                 sizeof(struct bpak_header) + data_offset;
+        task = &pool.tasks[pool.task_count];
+        rc = verify_part_merkle_meta(&lookup,
+                                     p,
+                                     0,
+                                     &task->root_hash,
+                                     &task->salt,
+                                     &task->merkle_options,
+                                     &task->part_tree_offset);
 
-        /* Verify this data/merkle tree and compare the root hash */
-        rc = bpak_verify_merkle_tree(read_payload,
-                                     part_data_offset,
-                                     bpak_part_size(p),
-                                     part_tree_offset,
-                                     part_merkle_root_hash,
-                                     part_merkle_salt,
-                                     user);
+        if (rc == BPAK_OK) {
+            bpak_id_t tree_id = bpak_part_id_to_hash_tree_id(p->id);
 
-        if (rc != BPAK_OK) {
+            tree_loc = verify_find_location(locations, count, tree_id);
+        } else if (rc != -BPAK_NOT_FOUND) {
             return rc;
         }
+
+        if (tree_loc != NULL) {
+            rc = bpak_tables_get_sparse_map(header, NULL, 0, p, &task->sparse);
+
+            task->kind = VERIFY_MERKLE_TREE;
+            task->part = p;
+            task->part_data_offset = loc->offset;
+            task->part_tree_offset = tree_loc->offset;
+            task->read_payload = loc->read_payload;
+            task->user = loc->user;
+            task->read_tree = tree_loc->read_payload;
+            task->tree_user = tree_loc->user;
+            task->done = (rc != BPAK_OK);
+            task->rc = rc;
+            pool.task_count++;
+            checked = true;
+        }
+
+        /* A hash tree is checked with the part that it belongs to */
+        if (!checked && !verify_is_installed_tree(locations, count, p->id))
+            return -BPAK_MISSING_META_DATA;
+    }
+
+    /* Every check reads one device, by default they all run at once */
+    if (jobs == 0)
+        jobs = pool.task_count;
+
+    return verify_pool_run(&pool, jobs);
+#else
+    (void)jobs;
+
+    for (size_t i = 0; i < count; i++) {
+        struct bpak_part_header *p;
+
+        rc = bpak_get_part(header, locations[i].part_id, &p);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        rc = bpak_verify_part_digest(header,
+                                     p->id,
+                                     locations[i].read_payload,
+                                     locations[i].offset -
+                                         bpak_part_offset(header, p) +
+                                         sizeof(struct bpak_header),
+                                     locations[i].user);
+
+        if (rc != BPAK_OK)
+            return rc;
     }
-#endif // BPAK_CONFIG_MERKLE
 
     return BPAK_OK;
+#endif // BPAK_CONFIG_MERKLE
 }
@@ -0,0 +1,156 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <string.h>
+
+#include <bpak/bpak.h>
+#include <bpak/crypto.h>
+#include <bpak/verify_boot.h>
+
+static int verify_boot_header(struct bpak_verify_boot_ctx *ctx,
+                              struct bpak_header *header, size_t *hash_size)
+{
+    int rc;
+    size_t zeros = sizeof(header->signature) + sizeof(header->signature_sz);
+
+    rc = bpak_hash_update(&ctx->hash,
+                          (uint8_t *)header,
+                          sizeof(*header) - zeros);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    /* The signature and its size are hashed as zeros */
+    memset(ctx->chunk, 0, BPAK_MIN(zeros, ctx->chunk_size));
+
+    while (zeros > 0) {
+        size_t length = BPAK_MIN(zeros, ctx->chunk_size);
+
+        rc = bpak_hash_update(&ctx->hash, ctx->chunk, length);
+
+        if (rc != BPAK_OK)
+            return rc;
+
+        zeros -= length;
+    }
+
+    return bpak_hash_final(&ctx->hash,
+                           ctx->digest,
+                           sizeof(ctx->digest),
+                           hash_size);
+}
+
+static int verify_boot_payload(struct bpak_verify_boot_ctx *ctx,
+                               struct bpak_header *header,
+                               bpak_io_t read_payload, off_t data_offset,
+                               void *user, size_t *hash_size)
+{
+    int rc;
+    off_t offset = data_offset;
+
+    bpak_foreach_part (header, p) {
+        uint64_t bytes_to_read = bpak_part_size(p);
+
+        if (!p->id)
+            continue;
+
+        if (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH) {
+            offset += bytes_to_read;
+            continue;
+        }
+
+        while (bytes_to_read > 0) {
+            size_t length = BPAK_MIN(bytes_to_read, ctx->chunk_size);
+
+            if (read_payload(offset, ctx->chunk, length, user) !=
+                (ssize_t)length) {
+                return -BPAK_READ_ERROR;
+            }
+
+            rc = bpak_hash_update(&ctx->hash, ctx->chunk, length);
+
+            if (rc != BPAK_OK)
+                return rc;
+
+            bytes_to_read -= length;
+            offset += length;
+        }
+    }
+
+    return bpak_hash_final(&ctx->hash,
+                           ctx->digest,
+                           sizeof(ctx->digest),
+                           hash_size);
+}
+
+BPAK_EXPORT int bpak_verify_boot(struct bpak_verify_boot_ctx *ctx,
+                                 struct bpak_header *header,
+                                 struct bpak_key *key, bpak_io_t read_payload,
+                                 off_t data_offset, void *user)
+{
+    int rc;
+    size_t hash_size = 0;
+    bool verified = false;
+
+    if ((ctx->chunk == NULL) || (ctx->chunk_size == 0))
+        return -BPAK_BUFFER_TOO_SMALL;
+
+    rc = bpak_valid_header(header);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (bpak_header_size(header) != sizeof(*header))
+        return -BPAK_NOT_SUPPORTED;
+
+    rc = bpak_hash_init(&ctx->hash, header->hash_kind);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = verify_boot_header(ctx, header, &hash_size);
+    bpak_hash_free(&ctx->hash);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_crypto_verify(header->signature,
+                            header->signature_sz,
+                            ctx->digest,
+                            hash_size,
+                            header->hash_kind,
+                            key,
+                            &verified);
+
+    if (rc != BPAK_OK)
+        return rc;
+    if (!verified)
+        return -BPAK_VERIFY_FAIL;
+
+    rc = bpak_hash_init(&ctx->hash, header->hash_kind);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = verify_boot_payload(ctx,
+                             header,
+                             read_payload,
+                             data_offset,
+                             user,
+                             &hash_size);
+    bpak_hash_free(&ctx->hash);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    if (memcmp(ctx->digest, header->payload_hash, hash_size) != 0)
+        return -BPAK_BAD_PAYLOAD_HASH;
+
+    return BPAK_OK;
+}
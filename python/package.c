@@ -26,6 +26,23 @@ int package_write_header(BPAKPackage *package, bool update_hash)
     return rc;
 }
 
+int package_acquire(BPAKPackage *package)
+{
+    if (package->busy) {
+        PyErr_SetString(BPAKPackageError,
+                        "package is in use by another thread");
+        return -1;
+    }
+
+    package->busy = true;
+    return 0;
+}
+
+void package_release(BPAKPackage *package)
+{
+    package->busy = false;
+}
+
 static PyObject *package_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     (void)args;
@@ -35,6 +52,8 @@ static PyObject *package_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     self = (BPAKPackage *)type->tp_alloc(type, 0);
     if (self != NULL) {
         memset(&self->pkg, 0, sizeof(struct bpak_package));
+        self->busy = false;
+        self->exports = 0;
     }
     return (PyObject *)self;
 }
@@ -50,27 +69,38 @@ static void package_dealloc(BPAKPackage *self)
 static int package_init(BPAKPackage *self, PyObject *args, PyObject *kwds)
 {
     int rc;
-    static char *kwlist[] = {"filename", "mode", NULL};
+    static char *kwlist[] = {"filename", "mode", "mmap", NULL};
     PyObject *filename;
     char *mode = NULL;
+    int map = 0;
 
     rc = PyArg_ParseTupleAndKeywords(args,
                                      kwds,
-                                     "O&s:bpak.Package.__init__",
+                                     "O&s|p:bpak.Package.__init__",
                                      kwlist,
                                      &PyUnicode_FSDecoder,
                                      &filename,
-                                     &mode);
+                                     &mode,
+                                     &map);
     if (!rc) {
         return -1;
     }
 
+    /* The mapping is read-only */
+    if (map && (strchr(mode, '+') || strchr(mode, 'w') || strchr(mode, 'a'))) {
+        PyErr_SetString(PyExc_ValueError, "mmap requires a read-only mode");
+        return -1;
+    }
+
     PyObject *filename_ascii = PyUnicode_AsASCIIString(filename);
     if (!filename_ascii) {
         return -1;
     }
 
-    rc = bpak_pkg_open(&self->pkg, PyBytes_AsString(filename_ascii), mode);
+    if (map)
+        rc = bpak_pkg_open_mmap(&self->pkg, PyBytes_AsString(filename_ascii));
+    else
+        rc = bpak_pkg_open(&self->pkg, PyBytes_AsString(filename_ascii), mode);
 
     Py_DECREF(filename_ascii);
 
@@ -86,6 +116,19 @@ static PyObject *package_close(PyObject *self, PyObject *Py_UNUSED(args))
 {
     BPAKPackage *package = (BPAKPackage *)self;
 
+    if (package->busy) {
+        PyErr_SetString(BPAKPackageError,
+                        "package is in use by another thread");
+        return NULL;
+    }
+
+    /* Part buffers point into the mapping */
+    if (package->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "cannot close a package with exported part buffers");
+        return NULL;
+    }
+
     bpak_pkg_close(&package->pkg);
     memset(&package->pkg, 0, sizeof(package->pkg));
 
@@ -125,7 +168,16 @@ static PyObject *package_verify(BPAKPackage *self, PyObject *args,
                 bpak_error_string(rc));
     }
 
+    if (package_acquire(self) != 0) {
+        free(key);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
     rc = bpak_pkg_verify(&self->pkg, key);
+    Py_END_ALLOW_THREADS
+
+    package_release(self);
 
     free(key);
 
@@ -159,8 +211,16 @@ static PyObject *package_sign(PyObject *self, PyObject *args, PyObject *kwds)
         return NULL;
     }
 
+    if (package_acquire(package) != 0) {
+        Py_DECREF(filename_ascii);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
     rc = bpak_pkg_sign(&package->pkg, PyBytes_AsString(filename_ascii));
+    Py_END_ALLOW_THREADS
 
+    package_release(package);
     Py_DECREF(filename_ascii);
 
     if (rc != BPAK_OK) {
@@ -175,7 +235,6 @@ static PyObject *package_add_file(PyObject *self, PyObject *args, PyObject *kwds
 {
     static char *kwlist[] = {"part_name", "filename", "with_merkle_tree", NULL};
     BPAKPackage *package = (BPAKPackage *)self;
-    struct bpak_header *h = bpak_pkg_header(&package->pkg);
     struct bpak_part_header *part;
     int rc;
     const char *part_name = NULL;
@@ -200,14 +259,23 @@ static PyObject *package_add_file(PyObject *self, PyObject *args, PyObject *kwds
         return NULL;
     }
 
+    if (package_acquire(package) != 0) {
+        Py_DECREF(filename_ascii);
+        return NULL;
+    }
+
+    const char *path = PyBytes_AsString(filename_ascii);
+
+    Py_BEGIN_ALLOW_THREADS
     if (with_merkle_tree) {
         rc = bpak_pkg_add_file_with_merkle_tree(&package->pkg,
-                PyBytes_AsString(filename_ascii), part_name, 0);
+                path, part_name, 0);
     } else {
-        rc = bpak_pkg_add_file(&package->pkg, PyBytes_AsString(filename_ascii),
-                part_name, 0);
+        rc = bpak_pkg_add_file(&package->pkg, path, part_name, 0);
     }
+    Py_END_ALLOW_THREADS
 
+    package_release(package);
     Py_DECREF(filename_ascii);
 
     if (rc != BPAK_OK) {
@@ -215,7 +283,8 @@ static PyObject *package_add_file(PyObject *self, PyObject *args, PyObject *kwds
                 bpak_error_string(rc));
     }
 
-    rc = bpak_get_part(h, bpak_id(part_name), &part);
+    /* The part can be in a continuation table */
+    rc = bpak_pkg_get_part(&package->pkg, bpak_id(part_name), &part);
     if (rc != BPAK_OK) {
         return PyErr_Format(PyExc_KeyError, "failed to get part: %s",
                 bpak_error_string(rc));
@@ -370,6 +439,132 @@ err_out:
     return NULL;
 }
 
+static PyObject *package_add_transport_meta(PyObject *self, PyObject *args,
+                                            PyObject *kwds)
+{
+    static char *kwlist[] = {"part_id", "encoder", "decoder", "origin_part_id",
+                             "lzma_preset", "lzma_dict_size", "lzma_bcj",
+                             "hs_window", "hs_lookahead", "bsdiff_copy",
+                             "lzma_block_size", NULL};
+    BPAKPackage *package = (BPAKPackage *)self;
+    struct bpak_header *h = bpak_pkg_header(&package->pkg);
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_transport_meta *tm;
+    struct bpak_transport_lzma_params lzma_params;
+    struct bpak_transport_heatshrink_params hs_params;
+    bpak_id_t part_id;
+    bpak_id_t encoder_id;
+    bpak_id_t decoder_id;
+    bpak_id_t origin_part_id = 0;
+    int lzma_preset = -1;
+    unsigned int lzma_dict_size = 0;
+    int lzma_bcj = -1;
+    unsigned int hs_window = 0;
+    unsigned int hs_lookahead = 0;
+    int bsdiff_copy = 0;
+    unsigned long lzma_block_size = 0;
+    int rc;
+
+    rc = PyArg_ParseTupleAndKeywords(args,
+                                     kwds,
+                                     "III|IiIiIIpk:add_transport_meta",
+                                     kwlist,
+                                     &part_id,
+                                     &encoder_id,
+                                     &decoder_id,
+                                     &origin_part_id,
+                                     &lzma_preset,
+                                     &lzma_dict_size,
+                                     &lzma_bcj,
+                                     &hs_window,
+                                     &hs_lookahead,
+                                     &bsdiff_copy,
+                                     &lzma_block_size);
+
+    if (!rc) {
+        return NULL;
+    }
+
+    /* Same limits as 'bpak transport --add' */
+    if (lzma_preset > 9 ||
+        (lzma_dict_size != 0 && lzma_dict_size < 4096) ||
+        lzma_bcj > BPAK_LZMA_BCJ_ARM64 ||
+        (lzma_block_size != 0 &&
+         ((lzma_block_size & (lzma_block_size - 1)) ||
+          lzma_block_size < (1UL << BPAK_LZMA_BLOCK_BITS_MIN) ||
+          lzma_block_size > (1UL << BPAK_LZMA_BLOCK_BITS_MAX))) ||
+        (hs_window != 0 && (hs_window < 4 || hs_window > 15)) ||
+        (hs_lookahead != 0 && (hs_lookahead < 3 || hs_lookahead > 14))) {
+        return PyErr_Format(PyExc_ValueError, "invalid encoder parameter");
+    }
+
+    bool lzma_params_flag = (lzma_preset >= 0) || (lzma_dict_size != 0) ||
+                            (lzma_bcj >= 0) || (lzma_block_size != 0);
+    bool hs_params_flag = (hs_window != 0) || (hs_lookahead != 0);
+
+    /* Both are stored in the same transport meta data field */
+    if (lzma_params_flag && hs_params_flag) {
+        return PyErr_Format(PyExc_ValueError,
+                "LZMA and heatshrink parameters can't be combined");
+    }
+
+    rc = bpak_add_transport_meta(h, part_id, encoder_id, decoder_id);
+
+    if (rc != BPAK_OK) {
+        return PyErr_Format(BPAKPackageError,
+                "failed to add transport meta data: %s",
+                bpak_error_string(rc));
+    }
+
+    rc = bpak_get_meta(h, BPAK_ID_BPAK_TRANSPORT, part_id, &meta);
+
+    if (rc != BPAK_OK) {
+        return PyErr_Format(BPAKPackageError,
+                "failed to get transport meta data: %s",
+                bpak_error_string(rc));
+    }
+
+    tm = bpak_get_meta_ptr(h, meta, struct bpak_transport_meta);
+
+    if (lzma_params_flag) {
+        memset(&lzma_params, 0, sizeof(lzma_params));
+        lzma_params.preset = (lzma_preset >= 0) ? lzma_preset + 1 : 0;
+        lzma_params.dict_size = lzma_dict_size;
+        lzma_params.block_bits =
+            lzma_block_size ? __builtin_ctzl(lzma_block_size) : 0;
+        lzma_params.bcj_filter = (lzma_bcj >= 0) ? lzma_bcj
+                                                 : BPAK_LZMA_BCJ_X86;
+        memcpy(tm->data, &lzma_params, sizeof(lzma_params));
+    } else if (hs_params_flag) {
+        memset(&hs_params, 0, sizeof(hs_params));
+        hs_params.window_bits = hs_window;
+        hs_params.lookahead_bits = hs_lookahead;
+        memcpy(tm->data, &hs_params, sizeof(hs_params));
+    }
+
+    if (bsdiff_copy) {
+        tm->data[BPAK_BSDIFF_REVISION_OFFSET] = BPAK_BSDIFF_REVISION_COPY;
+    }
+
+    if (origin_part_id != 0) {
+        rc = bpak_set_transport_origin(h, part_id, origin_part_id);
+
+        if (rc != BPAK_OK) {
+            return PyErr_Format(BPAKPackageError,
+                    "failed to set transport origin: %s",
+                    bpak_error_string(rc));
+        }
+    }
+
+    rc = package_write_header(package, false);
+    if (rc != BPAK_OK) {
+        return PyErr_Format(PyExc_IOError, "could not write header: %s",
+                bpak_error_string(rc));
+    }
+
+    return meta_allocate(package, meta->id, meta->part_id_ref);
+}
+
 static PyObject *package_get_part(PyObject *self, PyObject *args, PyObject *kwds)
 {
     static char *kwlist[] = {"id", NULL};
@@ -437,8 +632,12 @@ static PyObject *package_enter(PyObject *self, PyObject *Py_UNUSED(args))
 
 static PyObject *package_exit(PyObject *self, PyObject *args)
 {
-    package_close(self, args);
+    PyObject *result = package_close(self, args);
+
+    if (result == NULL)
+        return NULL;
 
+    Py_DECREF(result);
     Py_RETURN_NONE;
 }
 
@@ -451,8 +650,19 @@ static PyObject *package_get_digest(PyObject *self, void *closure)
     BPAKPackage *package = (BPAKPackage *)self;
 
     size_t hash_size = sizeof(digest_data);
+    int rc;
+
+    if (package_acquire(package) != 0)
+        return NULL;
+
+    /* The payload hash reads every hashed part */
+    Py_BEGIN_ALLOW_THREADS
+    rc = bpak_pkg_update_hash(&package->pkg, digest_data, &hash_size);
+    Py_END_ALLOW_THREADS
+
+    package_release(package);
 
-    if (bpak_pkg_update_hash(&package->pkg, digest_data, &hash_size) != BPAK_OK)
+    if (rc != BPAK_OK)
         Py_RETURN_NONE;
 
     return Py_BuildValue("y#", digest_data, hash_size);
@@ -794,6 +1004,11 @@ static PyMethodDef package_methods[] = {
      METH_VARARGS | METH_KEYWORDS,
      "Create a new metadata object"},
 
+    {"add_transport_meta",
+     (PyCFunction)(void (*)(void))package_add_transport_meta,
+     METH_VARARGS | METH_KEYWORDS,
+     "Add transport meta data with encoder parameters for a part"},
+
     {"get_part",
      (PyCFunction)(void (*)(void))package_get_part,
      METH_VARARGS | METH_KEYWORDS,
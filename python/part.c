@@ -181,7 +181,19 @@ static PyObject *part_read_data(PyObject *self, PyObject *Py_UNUSED(ignored))
                 strerror(ferror(fp)));
     }
 
-    read_size = fread(PyBytes_AsString(bytes), part_size, 1, fp);
+    if (package_acquire(part->package) != 0) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+
+    char *buf = PyBytes_AsString(bytes);
+
+    Py_BEGIN_ALLOW_THREADS
+    read_size = fread(buf, part_size, 1, fp);
+    Py_END_ALLOW_THREADS
+
+    package_release(part->package);
+
     if (read_size != 1) {
         Py_DECREF(bytes);
         return PyErr_Format(PyExc_IOError, "failed to read: %s",
@@ -196,7 +208,21 @@ static PyObject *part_delete(PyObject *self, PyObject *Py_UNUSED(ignored))
     BPAKPart *part = (BPAKPart *)self;
     int rc;
 
+    if (part->package->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "cannot delete a part with exported part buffers");
+        return NULL;
+    }
+
+    if (package_acquire(part->package) != 0) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
     rc = bpak_pkg_delete_part(&part->package->pkg, part->part_id, true);
+    Py_END_ALLOW_THREADS
+
+    package_release(part->package);
     if (rc != BPAK_OK) {
         return PyErr_Format(BPAKPackageError, "failed to delete part: %s",
                 bpak_error_string(rc));
@@ -205,6 +231,57 @@ static PyObject *part_delete(PyObject *self, PyObject *Py_UNUSED(ignored))
     Py_RETURN_NONE;
 }
 
+/* Parts of a package opened with mmap=True export the mapped data as a
+ * read-only buffer, the package can't be closed until it is released */
+static int part_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+    BPAKPart *part = (BPAKPart *)self;
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    int rc;
+
+    rc = bpak_pkg_part_view(&part->package->pkg, part->part_id, &data, &size);
+
+    if (rc == -BPAK_NOT_SUPPORTED) {
+        PyErr_SetString(PyExc_BufferError,
+                        "package is not opened with mmap=True");
+        view->obj = NULL;
+        return -1;
+    } else if (rc != BPAK_OK) {
+        PyErr_Format(PyExc_BufferError, "failed to map part: %s",
+                bpak_error_string(rc));
+        view->obj = NULL;
+        return -1;
+    }
+
+    if (PyBuffer_FillInfo(view, self, (void *)data, size, 1, flags) < 0) {
+        return -1;
+    }
+
+    part->package->exports++;
+    return 0;
+}
+
+static void part_releasebuffer(PyObject *self, Py_buffer *view)
+{
+    (void)view;
+    BPAKPart *part = (BPAKPart *)self;
+
+    part->package->exports--;
+}
+
+static PyBufferProcs part_as_buffer = {
+    .bf_getbuffer = part_getbuffer,
+    .bf_releasebuffer = part_releasebuffer,
+};
+
+static PyObject *part_get_data(PyObject *self, void *closure)
+{
+    (void)closure;
+
+    return PyMemoryView_FromObject(self);
+}
+
 static PyMethodDef part_methods[] = {
     {"read_data",
      (PyCFunction)(void (*)(void))part_read_data,
@@ -244,6 +321,13 @@ static PyGetSetDef part_getset[] = {
      "If part is transport encoded",
      NULL},
 
+    {"data",
+     (getter)part_get_data,
+     (setter)NULL,
+     "Read-only memoryview of the part data, the package must be opened "
+     "with mmap=True",
+     NULL},
+
     {NULL}
 };
 
@@ -258,4 +342,5 @@ PyTypeObject BPAKPartType = {
     .tp_repr = (reprfunc)part_repr,
     .tp_methods = part_methods,
     .tp_getset = part_getset,
+    .tp_as_buffer = &part_as_buffer,
 };
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 /* Python 3.10 and newer must set PY_SSIZE_T_CLEAN when using # variant
  *  when parsing arguments */
 #define PY_SSIZE_T_CLEAN
@@ -7,6 +9,7 @@
 #include <bpak/pkg.h>
 #include <bpak/utils.h>
 #include <bpak/id.h>
+#include <bpak/transport.h>
 
 #include "python_wrapper.h"
 
@@ -21,10 +24,21 @@ int bpak_printf(int verbosity, const char *fmt, ...)
     vsnprintf(log_buf, sizeof(log_buf), fmt, args);
     va_end(args);
 
+    /* Long running calls release the GIL and the encoders log from their
+     * worker threads */
+    PyGILState_STATE gil = PyGILState_Ensure();
+
     if (log_func != Py_None) {
-        PyObject_CallFunction(log_func, "(is)", verbosity, log_buf);
+        PyObject *result =
+            PyObject_CallFunction(log_func, "(is)", verbosity, log_buf);
+
+        if (result == NULL)
+            PyErr_WriteUnraisable(log_func);
+        else
+            Py_DECREF(result);
     }
 
+    PyGILState_Release(gil);
     return BPAK_OK;
 }
 
@@ -49,50 +63,205 @@ static PyObject *m_set_log_func(PyObject *module, PyObject *args,
 {
     int rc;
     static char *kwlist[] = {"log_func", NULL};
+    PyObject *func = NULL;
+    PyObject *old_func = log_func;
     (void)module;
 
-    rc = PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &log_func);
+    rc = PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &func);
     if (!rc) {
         return NULL;
     }
 
+    /* Keep a reference, the function is called after this returns */
+    Py_INCREF(func);
+    log_func = func;
+    Py_DECREF(old_func);
+
     Py_RETURN_NONE;
 }
 
+static int transport_acquire(BPAKPackage *input, BPAKPackage *output,
+                             BPAKPackage *origin)
+{
+    if (package_acquire(input) != 0)
+        return -1;
+
+    if (package_acquire(output) != 0)
+        goto err_release_input;
+
+    if (origin && package_acquire(origin) != 0)
+        goto err_release_output;
+
+    return 0;
+
+err_release_output:
+    package_release(output);
+err_release_input:
+    package_release(input);
+    return -1;
+}
+
+static void transport_release(BPAKPackage *input, BPAKPackage *output,
+                              BPAKPackage *origin)
+{
+    package_release(input);
+    package_release(output);
+
+    if (origin)
+        package_release(origin);
+}
+
+/* The DONE events of every part, collected from the encoder and decoder
+ * threads without the GIL */
+struct transport_stats {
+    PyThread_type_lock lock;
+    struct bpak_transport_progress *parts;
+    size_t count;
+    size_t capacity;
+};
+
+static void transport_stats_progress(
+    const struct bpak_transport_progress *progress, void *user)
+{
+    struct transport_stats *stats = (struct transport_stats *)user;
+
+    if (progress->event != BPAK_TRANSPORT_PART_DONE)
+        return;
+
+    PyThread_acquire_lock(stats->lock, WAIT_LOCK);
+
+    if (stats->count == stats->capacity) {
+        size_t capacity = stats->capacity ? stats->capacity * 2 : 16;
+        void *parts = realloc(stats->parts, capacity * sizeof(*stats->parts));
+
+        if (parts != NULL) {
+            stats->parts = parts;
+            stats->capacity = capacity;
+        }
+    }
+
+    if (stats->count < stats->capacity)
+        stats->parts[stats->count++] = *progress;
+
+    PyThread_release_lock(stats->lock);
+}
+
+static int transport_stats_init(struct transport_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->lock = PyThread_allocate_lock();
+
+    if (stats->lock == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    return 0;
+}
+
+static void transport_stats_free(struct transport_stats *stats)
+{
+    PyThread_free_lock(stats->lock);
+    free(stats->parts);
+}
+
+/* A list with a dict per part, the times are in seconds */
+static PyObject *transport_stats_list(struct transport_stats *stats)
+{
+    PyObject *list = PyList_New(stats->count);
+
+    if (list == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < stats->count; i++) {
+        const struct bpak_transport_progress *p = &stats->parts[i];
+        const uint64_t *ns = p->stage_ns;
+        PyObject *item = Py_BuildValue(
+            "{s:I,s:K,s:K,s:K,s:K,s:d,s:d,s:d,s:d,s:d}",
+            "part_id", p->part_id,
+            "bytes_in", (unsigned long long)p->bytes_in,
+            "bytes_out", (unsigned long long)p->bytes_out,
+            "origin_bytes", (unsigned long long)p->origin_bytes,
+            "bytes_unchanged", (unsigned long long)p->bytes_unchanged,
+            "elapsed", p->elapsed_ns / 1e9,
+            "codec", ns[BPAK_TRANSPORT_STAGE_CODEC] / 1e9,
+            "input", ns[BPAK_TRANSPORT_STAGE_INPUT] / 1e9,
+            "output", ns[BPAK_TRANSPORT_STAGE_OUTPUT] / 1e9,
+            "origin", ns[BPAK_TRANSPORT_STAGE_ORIGIN] / 1e9);
+
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+
+        PyList_SET_ITEM(list, i, item);
+    }
+
+    return list;
+}
+
 static PyObject *m_transport_encode(PyObject *self, PyObject *args,
                                     PyObject *kwds)
 {
     (void)self;
     int rc;
-    static char *kwlist[] = {"input", "output", "origin", NULL};
+    static char *kwlist[] = {"input", "output", "origin", "jobs", "cache_dir",
+                             "part_jobs", "memory_budget", NULL};
     BPAKPackage *input = NULL;
     BPAKPackage *origin = NULL;
     BPAKPackage *output = NULL;
+    struct bpak_transport_encode_options options = { .jobs = 1 };
+    struct transport_stats stats;
+    PyObject *result;
 
     rc = PyArg_ParseTupleAndKeywords(args,
                                      kwds,
-                                     "O!O!|O!:transport_encode",
+                                     "O!O!|O!IzIn:transport_encode",
                                      kwlist,
                                      &BPAKPackageType,
                                      &input,
                                      &BPAKPackageType,
                                      &output,
                                      &BPAKPackageType,
-                                     &origin);
+                                     &origin,
+                                     &options.jobs,
+                                     &options.cache_dir,
+                                     &options.part_jobs,
+                                     &options.memory_budget);
     if (!rc) {
         return NULL;
     }
 
-    rc = bpak_pkg_transport_encode(&input->pkg,
-                                   &output->pkg,
-                                   origin ? &origin->pkg : NULL);
+    if (transport_stats_init(&stats) != 0) {
+        return NULL;
+    }
+
+    options.progress = transport_stats_progress;
+    options.progress_user = &stats;
+
+    if (transport_acquire(input, output, origin) != 0) {
+        transport_stats_free(&stats);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = bpak_pkg_transport_encode_opts(&input->pkg,
+                                        &output->pkg,
+                                        origin ? &origin->pkg : NULL,
+                                        &options);
+    Py_END_ALLOW_THREADS
+
+    transport_release(input, output, origin);
 
     if (rc != BPAK_OK) {
+        transport_stats_free(&stats);
         return PyErr_Format(BPAKPackageError,
             "Transport encoding failed: %s", bpak_error_string(rc));
     }
 
-    Py_RETURN_NONE;
+    result = transport_stats_list(&stats);
+    transport_stats_free(&stats);
+    return result;
 }
 
 static PyObject *m_transport_decode(PyObject *self, PyObject *args,
@@ -100,35 +269,319 @@ static PyObject *m_transport_decode(PyObject *self, PyObject *args,
 {
     (void)self;
     int rc;
-    static char *kwlist[] = {"input", "output", "origin", NULL};
+    static char *kwlist[] = {"input", "output", "origin", "buffer_size",
+                             "jobs", "output_buffer", "direct_io",
+                             "drop_cache", "threads", "skip_unchanged",
+                             NULL};
     BPAKPackage *input = NULL;
     BPAKPackage *origin = NULL;
     BPAKPackage *output = NULL;
+    struct bpak_transport_decode_options options;
+    struct transport_stats stats;
+    int direct_io = 0;
+    int drop_cache = 0;
+    int skip_unchanged = 0;
+    PyObject *result;
+
+    memset(&options, 0, sizeof(options));
 
     rc = PyArg_ParseTupleAndKeywords(args,
                                      kwds,
-                                     "O!O!|O!:transport_decode",
+                                     "O!O!|O!nInppIp:transport_decode",
                                      kwlist,
                                      &BPAKPackageType,
                                      &input,
                                      &BPAKPackageType,
                                      &output,
                                      &BPAKPackageType,
-                                     &origin);
+                                     &origin,
+                                     &options.buffer_length,
+                                     &options.jobs,
+                                     &options.output_buffer_length,
+                                     &direct_io,
+                                     &drop_cache,
+                                     &options.threads,
+                                     &skip_unchanged);
     if (!rc) {
         return NULL;
     }
 
-    rc = bpak_pkg_transport_decode(&input->pkg,
-                                   &output->pkg,
-                                   origin ? &origin->pkg : NULL);
+    options.direct_io = direct_io;
+    options.drop_cache = drop_cache;
+    options.skip_unchanged = skip_unchanged;
+
+    if (transport_stats_init(&stats) != 0) {
+        return NULL;
+    }
+
+    options.progress = transport_stats_progress;
+    options.progress_user = &stats;
+
+    if (transport_acquire(input, output, origin) != 0) {
+        transport_stats_free(&stats);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = bpak_pkg_transport_decode_opts(&input->pkg,
+                                        &output->pkg,
+                                        origin ? &origin->pkg : NULL,
+                                        &options);
+    Py_END_ALLOW_THREADS
+
+    transport_release(input, output, origin);
 
     if (rc != BPAK_OK) {
+        transport_stats_free(&stats);
         return PyErr_Format(BPAKPackageError,
             "Transport decoding failed: %s", bpak_error_string(rc));
     }
 
-    Py_RETURN_NONE;
+    result = transport_stats_list(&stats);
+    transport_stats_free(&stats);
+    return result;
+}
+
+/* The header and tables of one file of read_headers, read without the
+ * GIL */
+struct header_entry {
+    struct bpak_header header;
+    struct bpak_header *tables;
+    int rc;
+};
+
+static int header_entry_read(struct header_entry *entry, const char *path)
+{
+    int rc;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    uint8_t *buffer = NULL;
+    size_t header_size;
+    ssize_t n;
+
+    if (fd < 0)
+        return -BPAK_NOT_FOUND;
+
+    /* One pread is enough for a header without tables */
+    n = pread(fd, &entry->header, sizeof(entry->header), 0);
+
+    if (n < 0) {
+        rc = -BPAK_READ_ERROR;
+        goto err_close_out;
+    }
+
+    if (n < (ssize_t)sizeof(entry->header)) {
+        rc = -BPAK_SIZE_ERROR;
+        goto err_close_out;
+    }
+
+    rc = bpak_valid_header(&entry->header);
+
+    if ((rc != BPAK_OK) || (entry->header.magic != BPAK_HEADER_MAGIC_EXT))
+        goto err_close_out;
+
+    header_size = bpak_header_size(&entry->header);
+    buffer = malloc(header_size);
+    entry->tables = calloc(entry->header.table_count, sizeof(*entry->tables));
+
+    if ((buffer == NULL) || (entry->tables == NULL)) {
+        rc = -BPAK_FAILED;
+        goto err_close_out;
+    }
+
+    n = pread(fd, buffer, header_size, 0);
+
+    if (n < 0) {
+        rc = -BPAK_READ_ERROR;
+        goto err_close_out;
+    }
+
+    rc = bpak_tables_parse(&entry->header, entry->tables, buffer, n);
+
+err_close_out:
+    free(buffer);
+    close(fd);
+    return rc;
+}
+
+static size_t header_hash_size(uint8_t hash_kind)
+{
+    switch (hash_kind) {
+    case BPAK_HASH_SHA256:
+        return 32;
+    case BPAK_HASH_SHA384:
+        return 48;
+    default:
+        return 64;
+    }
+}
+
+/* A dict with the fields of a header and lists of dicts for its parts and
+ * meta data */
+static PyObject *header_entry_dict(struct header_entry *entry)
+{
+    struct bpak_header *h = &entry->header;
+    unsigned int count = (h->magic == BPAK_HEADER_MAGIC_EXT) ?
+                          h->table_count : 0;
+    PyObject *parts = PyList_New(0);
+    PyObject *meta = PyList_New(0);
+    PyObject *result = NULL;
+    uint64_t installed_size = 0;
+    uint64_t size = bpak_header_size(h);
+
+    if ((parts == NULL) || (meta == NULL))
+        goto err_out;
+
+    bpak_foreach_table (h, entry->tables, count, t) {
+        bpak_foreach_part (t, p) {
+            if (!p->id)
+                break;
+
+            PyObject *item = Py_BuildValue(
+                "{s:I,s:K,s:K,s:K,s:I}",
+                "id", p->id,
+                "size", (unsigned long long)bpak_part_size(p),
+                "offset",
+                (unsigned long long)bpak_tables_part_offset(h,
+                                                            entry->tables,
+                                                            count,
+                                                            p),
+                "transport_size", (unsigned long long)p->transport_size,
+                "flags", p->flags);
+
+            if ((item == NULL) || (PyList_Append(parts, item) < 0)) {
+                Py_XDECREF(item);
+                goto err_out;
+            }
+
+            Py_DECREF(item);
+            installed_size += p->size + p->pad_bytes;
+            size += (p->flags & BPAK_FLAG_TRANSPORT) ? p->transport_size :
+                                                       p->size;
+        }
+
+        bpak_foreach_meta (t, m) {
+            if (!m->id)
+                break;
+
+            PyObject *item = Py_BuildValue("{s:I,s:I,s:y#}",
+                                           "id", m->id,
+                                           "part_id_ref", m->part_id_ref,
+                                           "data",
+                                           &t->metadata[m->offset],
+                                           (Py_ssize_t)m->size);
+
+            if ((item == NULL) || (PyList_Append(meta, item) < 0)) {
+                Py_XDECREF(item);
+                goto err_out;
+            }
+
+            Py_DECREF(item);
+        }
+    }
+
+    result = Py_BuildValue(
+        "{s:i,s:i,s:I,s:I,s:y#,s:y#,s:K,s:K,s:O,s:O}",
+        "hash_kind", h->hash_kind,
+        "signature_kind", h->signature_kind,
+        "key_id", h->key_id,
+        "keystore_id", h->keystore_id,
+        "payload_hash", h->payload_hash,
+        (Py_ssize_t)header_hash_size(h->hash_kind),
+        "signature", h->signature,
+        (Py_ssize_t)BPAK_MIN(h->signature_sz, sizeof(h->signature)),
+        "size", (unsigned long long)size,
+        "installed_size", (unsigned long long)installed_size,
+        "parts", parts,
+        "meta", meta);
+
+err_out:
+    Py_XDECREF(parts);
+    Py_XDECREF(meta);
+    return result;
+}
+
+static PyObject *m_read_headers(PyObject *self, PyObject *args,
+                                PyObject *kwds)
+{
+    (void)self;
+    int rc;
+    static char *kwlist[] = {"paths", NULL};
+    PyObject *paths_arg;
+    PyObject *paths = NULL;
+    PyObject **names = NULL;
+    struct header_entry *entries = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t count;
+
+    rc = PyArg_ParseTupleAndKeywords(args,
+                                     kwds,
+                                     "O:read_headers",
+                                     kwlist,
+                                     &paths_arg);
+    if (!rc) {
+        return NULL;
+    }
+
+    paths = PySequence_Fast(paths_arg, "paths must be a sequence");
+
+    if (paths == NULL)
+        return NULL;
+
+    count = PySequence_Fast_GET_SIZE(paths);
+    names = PyMem_Calloc(count ? count : 1, sizeof(*names));
+    entries = calloc(count ? count : 1, sizeof(*entries));
+
+    if ((names == NULL) || (entries == NULL)) {
+        PyErr_NoMemory();
+        goto err_free_out;
+    }
+
+    for (Py_ssize_t i = 0; i < count; i++) {
+        if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(paths, i),
+                                   &names[i]))
+            goto err_free_out;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t i = 0; i < count; i++)
+        entries[i].rc = header_entry_read(&entries[i],
+                                          PyBytes_AS_STRING(names[i]));
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New(count);
+
+    if (result == NULL)
+        goto err_free_out;
+
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject *item;
+
+        if (entries[i].rc != BPAK_OK) {
+            Py_INCREF(Py_None);
+            item = Py_None;
+        } else {
+            item = header_entry_dict(&entries[i]);
+        }
+
+        if (item == NULL) {
+            Py_CLEAR(result);
+            goto err_free_out;
+        }
+
+        PyList_SET_ITEM(result, i, item);
+    }
+
+err_free_out:
+    for (Py_ssize_t i = 0; (entries != NULL) && (i < count); i++)
+        free(entries[i].tables);
+
+    for (Py_ssize_t i = 0; (names != NULL) && (i < count); i++)
+        Py_XDECREF(names[i]);
+
+    free(entries);
+    PyMem_Free(names);
+    Py_DECREF(paths);
+    return result;
 }
 
 
@@ -148,13 +601,23 @@ static PyMethodDef module_methods[] = {
     {"transport_encode",
      (PyCFunction)(void (*)(void))m_transport_encode,
      METH_VARARGS | METH_KEYWORDS,
-     "Transport encode from input to output, using origin for diff origin"
+     "Transport encode from input to output, using origin for diff origin. "
+     "Returns a list of per part statistics"
     },
 
     {"transport_decode",
      (PyCFunction)(void (*)(void))m_transport_decode,
      METH_VARARGS | METH_KEYWORDS,
-     "Transport decode from input to output, using origin for diff origin"
+     "Transport decode from input to output, using origin for diff origin. "
+     "Returns a list of per part statistics"
+    },
+
+    {"read_headers",
+     (PyCFunction)(void (*)(void))m_read_headers,
+     METH_VARARGS | METH_KEYWORDS,
+     "Read the headers of a list of package files without holding the GIL. "
+     "Returns a list with a dict per file, or None for files that are not "
+     "valid packages"
     },
 
     {NULL}
@@ -173,6 +636,8 @@ PyMODINIT_FUNC PyInit_bpak(void)
 {
     PyObject *m_p;
 
+    Py_INCREF(log_func);
+
     if (PyType_Ready(&BPAKPackageType) < 0)
         return NULL;
     if (PyType_Ready(&BPAKPartType) < 0)
@@ -225,5 +690,11 @@ PyMODINIT_FUNC PyInit_bpak(void)
     PyModule_AddIntConstant(m_p, "SIGN_PRIME256v1", BPAK_SIGN_PRIME256v1);
     PyModule_AddIntConstant(m_p, "SIGN_SECP384r1", BPAK_SIGN_SECP384r1);
     PyModule_AddIntConstant(m_p, "SIGN_SECP521r1", BPAK_SIGN_SECP521r1);
+
+    PyModule_AddIntConstant(m_p, "LZMA_BCJ_X86", BPAK_LZMA_BCJ_X86);
+    PyModule_AddIntConstant(m_p, "LZMA_BCJ_NONE", BPAK_LZMA_BCJ_NONE);
+    PyModule_AddIntConstant(m_p, "LZMA_BCJ_ARM", BPAK_LZMA_BCJ_ARM);
+    PyModule_AddIntConstant(m_p, "LZMA_BCJ_ARMTHUMB", BPAK_LZMA_BCJ_ARMTHUMB);
+    PyModule_AddIntConstant(m_p, "LZMA_BCJ_ARM64", BPAK_LZMA_BCJ_ARM64);
     return (m_p);
 }
@@ -8,6 +8,8 @@
 typedef struct {
     PyObject_HEAD
     struct bpak_package pkg;
+    bool busy;          /* A call without the GIL is using the package */
+    Py_ssize_t exports; /* Part buffers exported from the mapping */
 } BPAKPackage;
 
 typedef struct {
@@ -31,6 +33,11 @@ extern PyObject *BPAKPackageError;
 
 int package_write_header(BPAKPackage *package, bool update_hash);
 
+/* Mark 'package' as used by a call that releases the GIL, sets an
+ * exception and returns -1 if another thread is already using it */
+int package_acquire(BPAKPackage *package);
+void package_release(BPAKPackage *package);
+
 PyObject *part_allocate(BPAKPackage *package, bpak_id_t part_id);
 PyObject *meta_allocate(BPAKPackage *package, bpak_id_t meta_id, bpak_id_t part_ref);
 
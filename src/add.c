@@ -37,6 +37,7 @@ int action_add(int argc, char **argv)
     const char *from_string = NULL;
     const char *part_ref = NULL;
     const char *encoder = NULL;
+    const char *hash_cache = NULL;
     int rc = 0;
 
     struct option long_options[] = {
@@ -49,12 +50,13 @@ int action_add(int argc, char **argv)
         { "encoder", required_argument, 0, 'e' },
         { "set-flag", required_argument, 0, 'F' },
         { "part-ref", required_argument, 0, 'r' },
+        { "hash-cache", required_argument, 0, 'H' },
         { 0, 0, 0, 0 },
     };
 
     while ((opt = getopt_long(argc,
                               argv,
-                              "hvp:m:f:s:e:F:r:",
+                              "hvp:m:f:s:e:F:r:H:",
                               long_options,
                               &long_index)) != -1) {
         switch (opt) {
@@ -82,9 +84,14 @@ int action_add(int argc, char **argv)
         case 'e':
             encoder = (const char *)optarg;
             break;
+        case 'H':
+            hash_cache = (const char *)optarg;
+            break;
         case 'F':
             if (strcmp(optarg, "dont-hash") == 0)
                 flags |= BPAK_FLAG_EXCLUDE_FROM_HASH;
+            else if (strcmp(optarg, "sparse") == 0)
+                flags |= BPAK_FLAG_SPARSE;
             else {
                 fprintf(stderr, "Unknown flag '%s'\n", optarg);
                 return -1;
@@ -131,10 +138,14 @@ int action_add(int argc, char **argv)
         return rc;
     }
 
-    struct bpak_header *h = bpak_pkg_header(&pkg);
+    if ((hash_cache != NULL) &&
+        (bpak_pkg_set_hash_cache(&pkg, hash_cache) != BPAK_OK)) {
+        fprintf(stderr, "Warning: Hash cache is not supported\n");
+    }
 
     if (meta_name) {
         struct bpak_meta_header *meta = NULL;
+        struct bpak_header *meta_table = NULL;
         unsigned char *meta_data = NULL;
         bpak_id_t part_ref_id = 0;
 
@@ -180,18 +191,19 @@ int action_add(int argc, char **argv)
                     goto err_close_pkg_out;
                 }
 
-                rc = bpak_add_meta(h,
-                                   bpak_id(meta_name),
-                                   part_ref_id,
-                                   16,
-                                   &meta);
+                rc = bpak_pkg_add_meta(&pkg,
+                                       bpak_id(meta_name),
+                                       part_ref_id,
+                                       16,
+                                       &meta,
+                                       &meta_table);
 
                 if (rc != BPAK_OK) {
                     fprintf(stderr, "Error: Could not add meta data\n");
                     goto err_close_pkg_out;
                 }
 
-                meta_data = bpak_get_meta_ptr(h, meta, unsigned char);
+                meta_data = bpak_get_meta_ptr(meta_table, meta, unsigned char);
                 memcpy(meta_data, uu, 16);
 
                 if (bpak_get_verbosity()) {
@@ -210,18 +222,19 @@ int action_add(int argc, char **argv)
                     goto err_close_pkg_out;
                 }
 
-                rc = bpak_add_meta(h,
-                                   bpak_id(meta_name),
-                                   part_ref_id,
-                                   sizeof(value),
-                                   &meta);
+                rc = bpak_pkg_add_meta(&pkg,
+                                       bpak_id(meta_name),
+                                       part_ref_id,
+                                       sizeof(value),
+                                       &meta,
+                                       &meta_table);
 
                 if (rc != BPAK_OK) {
                     fprintf(stderr, "Error: Could not add meta data\n");
                     goto err_close_pkg_out;
                 }
 
-                meta_data = bpak_get_meta_ptr(h, meta, unsigned char);
+                meta_data = bpak_get_meta_ptr(meta_table, meta, unsigned char);
                 memcpy(meta_data, &value, sizeof(value));
 
                 if (bpak_get_verbosity()) {
@@ -230,18 +243,19 @@ int action_add(int argc, char **argv)
             } else if (strcmp(encoder, "id") == 0) {
                 bpak_id_t value = bpak_id(metadata_input);
 
-                rc = bpak_add_meta(h,
-                                   bpak_id(meta_name),
-                                   part_ref_id,
-                                   sizeof(value),
-                                   &meta);
+                rc = bpak_pkg_add_meta(&pkg,
+                                       bpak_id(meta_name),
+                                       part_ref_id,
+                                       sizeof(value),
+                                       &meta,
+                                       &meta_table);
 
                 if (rc != BPAK_OK) {
                     fprintf(stderr, "Error: Could not add meta data\n");
                     goto err_close_pkg_out;
                 }
 
-                meta_data = bpak_get_meta_ptr(h, meta, unsigned char);
+                meta_data = bpak_get_meta_ptr(meta_table, meta, unsigned char);
                 memcpy(meta_data, &value, sizeof(value));
 
                 if (bpak_get_verbosity()) {
@@ -256,24 +270,35 @@ int action_add(int argc, char **argv)
             if (bpak_get_verbosity())
                 printf("Adding metadata with id '%s'\n", meta_name);
 
-            rc = bpak_add_meta(h,
-                               bpak_id(meta_name),
-                               part_ref_id,
-                               metadata_input_length,
-                               &meta);
+            rc = bpak_pkg_add_meta(&pkg,
+                                   bpak_id(meta_name),
+                                   part_ref_id,
+                                   metadata_input_length,
+                                   &meta,
+                                   &meta_table);
 
             if (rc != BPAK_OK) {
                 fprintf(stderr, "Error: Could not add meta data\n");
                 goto err_close_pkg_out;
             }
 
-            meta_data = bpak_get_meta_ptr(h, meta, unsigned char);
+            meta_data = bpak_get_meta_ptr(meta_table, meta, unsigned char);
             memcpy(meta_data, metadata_input, metadata_input_length);
         }
 
         if (bpak_get_verbosity() > 2)
             printf("Meta data array pointer = %p\n", meta_data);
 
+        /* The continuation tables are covered by the payload hash */
+        if (bpak_pkg_table_count(&pkg) > 0) {
+            rc = bpak_pkg_update_hash(&pkg, NULL, NULL);
+
+            if (rc != BPAK_OK) {
+                fprintf(stderr, "Error: Could not update payload hash\n");
+                goto err_close_pkg_out;
+            }
+        }
+
         rc = bpak_pkg_write_header(&pkg);
 
         if (rc != BPAK_OK) {
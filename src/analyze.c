@@ -0,0 +1,419 @@
+/**
+ * BPAK - Bit Packer
+ *
+ * Copyright (C) 2022 Jonas Blixt <jonpe960@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <bpak/bspatch.h>
+#include <bpak/id.h>
+#include "bpak_tool.h"
+
+/* Size of the output regions that the patch is broken down into */
+#ifndef ANALYZE_REGION_LENGTH
+#define ANALYZE_REGION_LENGTH (1024 * 1024)
+#endif
+
+/* Patch input fed to bspatch per call, the compressed size of a region is
+ * counted with this granularity */
+#define ANALYZE_CHUNK_LENGTH 512
+
+/* Zero and one bucket for every power of two */
+#define ANALYZE_BUCKETS 65
+
+struct analyze_region {
+    uint64_t patch_bytes;   /* Compressed patch input */
+    uint64_t diff_bytes;
+    uint64_t changed_bytes; /* Diff bytes that are not zero */
+    uint64_t extra_bytes;
+    uint64_t copy_bytes;
+    int64_t origin_first;   /* Origin range that diff and copy bytes use */
+    int64_t origin_end;
+};
+
+struct analyze {
+    struct analyze_region *regions;
+    size_t no_of_regions;
+    off_t ctrl_output; /* Output position of the current control tuple */
+    off_t ctrl_origin;
+    int64_t ctrl_diff;
+    uint64_t ctrl_blocks;
+    uint64_t diff_hist[ANALYZE_BUCKETS];
+    uint64_t extra_hist[ANALYZE_BUCKETS];
+    uint64_t copy_hist[ANALYZE_BUCKETS];
+    uint64_t adjust_hist[ANALYZE_BUCKETS];
+};
+
+static unsigned int analyze_bucket(uint64_t value)
+{
+    unsigned int bucket = 0;
+
+    while (value != 0) {
+        bucket++;
+        value >>= 1;
+    }
+
+    return bucket;
+}
+
+static void analyze_ctrl(off_t output_position, off_t origin_position,
+                         int64_t diff_count, int64_t extra_count,
+                         int64_t adjust, void *user)
+{
+    struct analyze *a = (struct analyze *)user;
+
+    a->ctrl_output = output_position;
+    a->ctrl_origin = origin_position;
+    a->ctrl_diff = diff_count;
+    a->ctrl_blocks++;
+
+    if (diff_count < 0)
+        a->copy_hist[analyze_bucket(-diff_count)]++;
+    else
+        a->diff_hist[analyze_bucket(diff_count)]++;
+
+    a->extra_hist[analyze_bucket(extra_count)]++;
+    a->adjust_hist[analyze_bucket(adjust < 0 ? -adjust : adjust)]++;
+}
+
+/* The origin is never read, it is all zeros */
+static ssize_t analyze_read_origin(off_t offset, uint8_t *buffer,
+                                   size_t length, void *user)
+{
+    (void)offset;
+    (void)user;
+
+    memset(buffer, 0, length);
+    return length;
+}
+
+/* With a zero origin the output of diff tuples is the diff bytes, the
+ * output is split up on control tuple and region boundaries */
+static ssize_t analyze_write_output(off_t offset, uint8_t *buffer,
+                                    size_t length, void *user)
+{
+    struct analyze *a = (struct analyze *)user;
+    size_t pos = 0;
+
+    while (pos < length) {
+        off_t out = offset + pos;
+        size_t index = out / ANALYZE_REGION_LENGTH;
+        int64_t rel = out - a->ctrl_output;
+        int64_t data = (a->ctrl_diff < 0) ? -a->ctrl_diff : a->ctrl_diff;
+        size_t n = BPAK_MIN(length - pos,
+                            (index + 1) * ANALYZE_REGION_LENGTH - out);
+
+        if (index >= a->no_of_regions)
+            return -BPAK_SIZE_ERROR;
+
+        struct analyze_region *r = &a->regions[index];
+
+        if (rel < data) {
+            int64_t origin = a->ctrl_origin + rel;
+
+            n = BPAK_MIN(n, (size_t)(data - rel));
+
+            if ((r->origin_end == r->origin_first) ||
+                (origin < r->origin_first))
+                r->origin_first = origin;
+            if ((int64_t)(origin + n) > r->origin_end)
+                r->origin_end = origin + n;
+
+            if (a->ctrl_diff < 0) {
+                r->copy_bytes += n;
+            } else {
+                r->diff_bytes += n;
+
+                for (size_t i = 0; i < n; i++) {
+                    if (buffer[pos + i] != 0)
+                        r->changed_bytes++;
+                }
+            }
+        } else {
+            r->extra_bytes += n;
+        }
+
+        pos += n;
+    }
+
+    return length;
+}
+
+static void analyze_print_histogram(const char *name, const uint64_t *hist)
+{
+    printf("    %s:\n", name);
+
+    for (unsigned int i = 0; i < ANALYZE_BUCKETS; i++) {
+        if (hist[i] == 0)
+            continue;
+
+        if (i == 0) {
+            printf("        %10s %12s %" PRIu64 "\n", "0", "", hist[i]);
+        } else {
+            uint64_t first = 1ULL << (i - 1);
+            uint64_t last = first + (first - 1);
+
+            printf("        %10" PRIu64 " - %-10" PRIu64 " %" PRIu64 "\n",
+                   first,
+                   last,
+                   hist[i]);
+        }
+    }
+}
+
+static void analyze_print(struct bpak_part_header *part, const char *decoder,
+                          struct analyze *a)
+{
+    struct analyze_region total;
+    uint64_t stream_length;
+
+    memset(&total, 0, sizeof(total));
+
+    for (size_t i = 0; i < a->no_of_regions; i++) {
+        total.patch_bytes += a->regions[i].patch_bytes;
+        total.diff_bytes += a->regions[i].diff_bytes;
+        total.changed_bytes += a->regions[i].changed_bytes;
+        total.extra_bytes += a->regions[i].extra_bytes;
+        total.copy_bytes += a->regions[i].copy_bytes;
+    }
+
+    /* Copy tuples have no data in the stream */
+    stream_length = a->ctrl_blocks * BPAK_BSPATCH_CTRL_BUFFER_LENGTH +
+                    total.diff_bytes + total.extra_bytes;
+
+    printf("Part 0x%08x, %s\n", part->id, decoder);
+    printf("    Patch size:         %" PRIu64 " bytes\n", total.patch_bytes);
+    printf("    Uncompressed patch: %" PRIu64 " bytes\n", stream_length);
+    printf("    Output size:        %" PRIu64 " bytes\n",
+           part->size + part->pad_bytes);
+    printf("    Control tuples:     %" PRIu64 "\n", a->ctrl_blocks);
+    printf("    Diff bytes:         %" PRIu64 " (%" PRIu64 " changed)\n",
+           total.diff_bytes,
+           total.changed_bytes);
+    printf("    Extra bytes:        %" PRIu64 "\n", total.extra_bytes);
+    printf("    Copy bytes:         %" PRIu64 "\n", total.copy_bytes);
+
+    analyze_print_histogram("Diff lengths", a->diff_hist);
+    analyze_print_histogram("Extra lengths", a->extra_hist);
+    analyze_print_histogram("Copy lengths", a->copy_hist);
+    analyze_print_histogram("Adjustment distances", a->adjust_hist);
+
+    printf("    Regions of %u bytes:\n", ANALYZE_REGION_LENGTH);
+    printf("        %12s %10s %10s %10s %10s %10s  %s\n",
+           "Offset",
+           "Patch",
+           "Diff",
+           "Changed",
+           "Extra",
+           "Copy",
+           "Origin range");
+
+    for (size_t i = 0; i < a->no_of_regions; i++) {
+        struct analyze_region *r = &a->regions[i];
+
+        printf("        %12zu %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+               " %10" PRIu64 " %10" PRIu64,
+               i * ANALYZE_REGION_LENGTH,
+               r->patch_bytes,
+               r->diff_bytes,
+               r->changed_bytes,
+               r->extra_bytes,
+               r->copy_bytes);
+
+        if (r->origin_end > r->origin_first) {
+            printf("  %" PRId64 " - %" PRId64 "\n",
+                   r->origin_first,
+                   r->origin_end);
+        } else {
+            printf("  -\n");
+        }
+    }
+}
+
+static int analyze_part(struct bpak_package *pkg, struct bpak_part_header *part,
+                        struct bpak_transport_meta *tm)
+{
+    int rc;
+    struct analyze a;
+    struct bpak_bspatch_context bspatch;
+    enum bpak_compression compression;
+    const char *decoder;
+    uint8_t chunk[ANALYZE_CHUNK_LENGTH];
+    uint8_t *buffer = NULL;
+    off_t offset = bpak_part_offset(&pkg->header, part);
+    uint64_t remaining = bpak_part_size(part);
+    uint64_t output_length = part->size + part->pad_bytes;
+    uint32_t decoder_id = bpak_transport_decoder_id(tm, part);
+
+    switch (decoder_id) {
+    case BPAK_ID_BSPATCH:
+        compression = BPAK_COMPRESSION_HS;
+        decoder = "bspatch";
+        break;
+    case BPAK_ID_BSPATCH_NO_COMP:
+        compression = BPAK_COMPRESSION_NONE;
+        decoder = "bspatch-no-comp";
+        break;
+    case BPAK_ID_BSPATCH_LZMA:
+        compression = BPAK_COMPRESSION_LZMA;
+        decoder = "bspatch-lzma";
+        break;
+    case BPAK_ID_BSPATCH_ZSTD:
+        compression = BPAK_COMPRESSION_ZSTD;
+        decoder = "bspatch-zstd";
+        break;
+    default:
+        printf("Part 0x%08x, decoder 0x%08x: not a bspatch stream\n",
+               part->id,
+               decoder_id);
+        return BPAK_OK;
+    }
+
+    memset(&a, 0, sizeof(a));
+    a.no_of_regions = (output_length + ANALYZE_REGION_LENGTH - 1) /
+                      ANALYZE_REGION_LENGTH;
+    a.regions = calloc(a.no_of_regions + 1, sizeof(*a.regions));
+    buffer = malloc(BPAK_CHUNK_BUFFER_LENGTH * 2);
+
+    if ((a.regions == NULL) || (buffer == NULL)) {
+        rc = -BPAK_FAILED;
+        goto err_free_out;
+    }
+
+    rc = bpak_bspatch_init(&bspatch,
+                           buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH * 2,
+                           remaining,
+                           analyze_read_origin,
+                           0,
+                           analyze_write_output,
+                           0,
+                           compression,
+                           &a);
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    rc = bpak_bspatch_check_heatshrink_params(
+        &bspatch,
+        (const struct bpak_transport_heatshrink_params *)tm->data);
+
+    if (rc == BPAK_OK)
+        rc = bpak_bspatch_set_ctrl_hook(&bspatch, analyze_ctrl);
+
+    while ((rc == BPAK_OK) && (remaining > 0)) {
+        size_t length = BPAK_MIN(remaining, sizeof(chunk));
+
+        rc = bpak_pkg_read_at(pkg, offset, chunk, length);
+
+        if (rc != BPAK_OK)
+            break;
+
+        rc = bpak_bspatch_write(&bspatch, chunk, length);
+
+        /* The input is counted for the region that is being written, the
+         * last region is one past the end when the output is complete */
+        size_t index = bspatch.output_position / ANALYZE_REGION_LENGTH;
+        a.regions[BPAK_MIN(index, a.no_of_regions - 1)].patch_bytes +=
+            length;
+
+        offset += length;
+        remaining -= length;
+    }
+
+    if (rc == BPAK_OK) {
+        ssize_t patched = bpak_bspatch_final(&bspatch);
+
+        if (patched < 0)
+            rc = patched;
+        else if ((uint64_t)patched != output_length)
+            rc = -BPAK_SIZE_ERROR;
+    }
+
+    bpak_bspatch_free(&bspatch);
+
+    if (rc == BPAK_OK)
+        analyze_print(part, decoder, &a);
+    else
+        fprintf(stderr,
+                "Error: Could not analyze part 0x%08x (%i)\n",
+                part->id,
+                rc);
+
+err_free_out:
+    free(buffer);
+    free(a.regions);
+    return rc;
+}
+
+int transport_analyze(struct bpak_package *pkg, bpak_id_t part_ref)
+{
+    int rc;
+    struct bpak_header *header = bpak_pkg_header(pkg);
+    struct bpak_meta_header *meta = NULL;
+    bool found = false;
+
+    bpak_foreach_part (header, part) {
+        if (part->id == 0)
+            break;
+
+        if ((part_ref != 0) && (part->id != part_ref))
+            continue;
+
+        if (!(part->flags & BPAK_FLAG_TRANSPORT))
+            continue;
+
+        if (bpak_get_meta(header, BPAK_ID_BPAK_TRANSPORT, part->id, &meta) !=
+            BPAK_OK)
+            continue;
+
+        found = true;
+        rc = analyze_part(pkg,
+                          part,
+                          bpak_get_meta_ptr(header,
+                                            meta,
+                                            struct bpak_transport_meta));
+
+        if (rc != BPAK_OK)
+            return rc;
+    }
+
+    if (!found) {
+        fprintf(stderr, "Error: No transport encoded parts to analyze\n");
+        return -BPAK_NOT_FOUND;
+    }
+
+    return BPAK_OK;
+}
+
+int transport_estimate(struct bpak_package *pkg)
+{
+    int rc;
+    struct bpak_transport_estimate estimate;
+
+    rc = bpak_pkg_transport_estimate(pkg, &estimate);
+
+    if (rc != BPAK_OK) {
+        fprintf(stderr,
+                "Error: Could not estimate the decoding (%i, %s)\n",
+                rc,
+                bpak_error_string(rc));
+        return rc;
+    }
+
+    printf("Heap size:          %zu bytes\n", estimate.heap_size);
+    printf("LZMA dictionary:    %" PRIu32 " bytes\n", estimate.lzma_dict_size);
+    printf("Heatshrink window:  %u bits\n", estimate.hs_window_bits);
+    printf("Input bytes:        %" PRIu64 "\n", estimate.input_bytes);
+    printf("Origin bytes:       %" PRIu64 " at most\n", estimate.origin_bytes);
+    printf("Output bytes:       %" PRIu64 "\n", estimate.output_bytes);
+    printf("Merkle hash bytes:  %" PRIu64 "\n", estimate.merkle_bytes);
+
+    return BPAK_OK;
+}
@@ -20,6 +20,9 @@ int action_compare(int argc, char **argv);
 int action_extract(int argc, char **argv);
 int action_delete(int argc, char **argv);
 
+int transport_analyze(struct bpak_package *pkg, bpak_id_t part_ref);
+int transport_estimate(struct bpak_package *pkg);
+
 void print_usage(void);
 void print_add_usage(void);
 void print_create_usage(void);
@@ -37,7 +40,12 @@ void print_delete_usage(void);
 
 int bpak_get_verbosity(void);
 void bpak_inc_verbosity(void);
+void bpak_log_to_stderr(void);
+bool bpak_get_log_stderr(void);
 
 bpak_id_t bpak_get_id_for_name_or_ref(char *arg);
 
+/* Print 'str' as a quoted and escaped JSON string */
+void print_json_string(const char *str);
+
 #endif
@@ -17,8 +17,253 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <bpak/id.h>
+#include <bpak/pkg.h>
 #include "bpak_tool.h"
 
+#define RED_CLR "\033[31;1m"
+#define RED_YL  "\033[33;1m"
+#define NO_CLR  "\033[0m"
+
+struct compare {
+    struct bpak_package *pkg1;
+    struct bpak_package *pkg2;
+    bool json;         /* Print a JSON document instead of tables */
+    bool first;        /* Stop at the first difference */
+    bool data;         /* Compare data even when there are part digests */
+    bool differs;      /* At least one difference was found */
+    unsigned int items; /* Items printed in the current JSON array */
+};
+
+static const char *compare_status_name(char status)
+{
+    switch (status) {
+    case '*':
+        return "changed";
+    case '-':
+        return "removed";
+    case '+':
+        return "added";
+    default:
+        return "equal";
+    }
+}
+
+static bool compare_done(struct compare *c)
+{
+    return c->first && c->differs;
+}
+
+static void compare_begin_item(struct compare *c, char status)
+{
+    if (status != '=')
+        c->differs = true;
+
+    if (c->json) {
+        printf("%s\n        {\"status\": \"%s\", ",
+               c->items++ ? "," : "",
+               compare_status_name(status));
+    } else {
+        if (status == '*')
+            printf(RED_CLR);
+        else if ((status == '-') || (status == '+'))
+            printf(RED_YL);
+        printf("%c", status);
+    }
+}
+
+static void compare_print_meta(struct compare *c, char status,
+                               struct bpak_header *h,
+                               struct bpak_meta_header *m)
+{
+    char string_output[128];
+
+    bpak_meta_to_string(h, m, string_output, sizeof(string_output));
+    compare_begin_item(c, status);
+
+    if (c->json) {
+        printf("\"id\": \"%08x\", \"size\": %u, \"name\": ", m->id, m->size);
+        print_json_string(bpak_id_to_string(m->id));
+        printf(", \"part_ref\": \"%08x\", \"data\": ", m->part_id_ref);
+        print_json_string(string_output);
+        printf("}");
+    } else {
+        printf("   %8.8x   %-3u    %-20s %s\n",
+               m->id,
+               m->size,
+               bpak_id_to_string(m->id),
+               string_output);
+        printf(NO_CLR);
+    }
+}
+
+static void compare_print_part(struct compare *c, char status,
+                               struct bpak_part_header *p)
+{
+    char flags_str[9] = "--------";
+    uint64_t transport_size = (p->flags & BPAK_FLAG_TRANSPORT)
+                                  ? p->transport_size
+                                  : p->size;
+
+    if (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH)
+        flags_str[0] = 'h';
+    if (p->flags & BPAK_FLAG_TRANSPORT)
+        flags_str[1] = 'T';
+
+    compare_begin_item(c, status);
+
+    if (c->json) {
+        printf("\"id\": \"%08x\", \"size\": %" PRIu64 ", \"pad_bytes\": %u, "
+               "\"flags\": \"%s\", \"transport_size\": %" PRIu64 "}",
+               p->id,
+               p->size,
+               p->pad_bytes,
+               flags_str,
+               transport_size);
+    } else {
+        printf("   %8.8x   %-12" PRIu64 " %-3u    %s       %-12" PRIu64 "\n",
+               p->id,
+               p->size,
+               p->pad_bytes,
+               flags_str,
+               transport_size);
+        printf(NO_CLR);
+    }
+}
+
+/* Parts with equal headers have the same size. Their digests are compared
+ * when both packages carry a 'part-digest' of the same kind, otherwise the
+ * mapped data is compared, which stops at the first differing byte. */
+static int compare_part_data(struct compare *c, struct bpak_part_header *p1,
+                             struct bpak_part_header *p2, bool *change)
+{
+    int rc;
+    struct bpak_header *h1 = bpak_pkg_header(c->pkg1);
+    struct bpak_header *h2 = bpak_pkg_header(c->pkg2);
+    struct bpak_meta_header *m1 = NULL;
+    struct bpak_meta_header *m2 = NULL;
+    const uint8_t *data1 = NULL;
+    const uint8_t *data2 = NULL;
+    size_t size1 = 0;
+    size_t size2 = 0;
+
+    if (!c->data && (h1->hash_kind == h2->hash_kind) &&
+        (bpak_get_meta(h1, BPAK_ID_PART_DIGEST, p1->id, &m1) == BPAK_OK) &&
+        (bpak_get_meta(h2, BPAK_ID_PART_DIGEST, p2->id, &m2) == BPAK_OK) &&
+        (m1->size == m2->size)) {
+        *change = memcmp(bpak_get_meta_ptr(h1, m1, uint8_t),
+                         bpak_get_meta_ptr(h2, m2, uint8_t),
+                         m1->size) != 0;
+        return BPAK_OK;
+    }
+
+    rc = bpak_pkg_part_view(c->pkg1, p1->id, &data1, &size1);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    rc = bpak_pkg_part_view(c->pkg2, p2->id, &data2, &size2);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    *change = (size1 != size2) || (memcmp(data1, data2, size1) != 0);
+    return BPAK_OK;
+}
+
+static void compare_meta(struct compare *c)
+{
+    struct bpak_header *h1 = bpak_pkg_header(c->pkg1);
+    struct bpak_header *h2 = bpak_pkg_header(c->pkg2);
+    struct bpak_meta_header *meta = NULL;
+    char status;
+
+    bpak_foreach_meta (h1, m) {
+        if (!m->id)
+            continue;
+        if (compare_done(c))
+            return;
+
+        /* Missing in file 2? */
+        if (bpak_get_meta(h2, m->id, m->part_id_ref, &meta) != BPAK_OK)
+            status = '-';
+        else if ((meta->size != m->size) ||
+                 (memcmp(bpak_get_meta_ptr(h1, m, uint8_t),
+                         bpak_get_meta_ptr(h2, meta, uint8_t),
+                         m->size) != 0))
+            status = '*';
+        else
+            status = '=';
+
+        compare_print_meta(c, status, h1, m);
+    }
+
+    /* Check for stuff thats in file 2 but not in 1 */
+    bpak_foreach_meta (h2, m) {
+        if (!m->id)
+            continue;
+        if (compare_done(c))
+            return;
+
+        if (bpak_get_meta(h1, m->id, m->part_id_ref, &meta) != BPAK_OK)
+            compare_print_meta(c, '+', h2, m);
+    }
+}
+
+static int compare_parts(struct compare *c)
+{
+    int rc;
+    struct bpak_header *h1 = bpak_pkg_header(c->pkg1);
+    struct bpak_header *h2 = bpak_pkg_header(c->pkg2);
+    struct bpak_part_header *p1 = NULL;
+    struct bpak_part_header *p2 = NULL;
+    bool change;
+    char status;
+
+    bpak_foreach_part (h1, p) {
+        if (!p->id)
+            continue;
+        if (compare_done(c))
+            return BPAK_OK;
+
+        status = '=';
+
+        if (bpak_get_part(h2, p->id, &p2) != BPAK_OK) {
+            status = '-';
+        } else if (memcmp(p2, p, sizeof(*p)) != 0) {
+            /* The part headers differ, there is no need to read the data */
+            status = '*';
+        } else {
+            rc = compare_part_data(c, p, p2, &change);
+
+            if (rc != BPAK_OK) {
+                fprintf(stderr,
+                        "Error: Could not read part %08x (%i)\n",
+                        p->id,
+                        rc);
+                return rc;
+            }
+
+            if (change)
+                status = '*';
+        }
+
+        compare_print_part(c, status, p);
+    }
+
+    /* Check parts for parts in 2 that are missing in 1 */
+    bpak_foreach_part (h2, p) {
+        if (!p->id)
+            continue;
+        if (compare_done(c))
+            return BPAK_OK;
+
+        if (bpak_get_part(h1, p->id, &p1) != BPAK_OK)
+            compare_print_part(c, '+', p);
+    }
+
+    return BPAK_OK;
+}
+
 int action_compare(int argc, char **argv)
 {
     int opt;
@@ -26,17 +271,24 @@ int action_compare(int argc, char **argv)
     int long_index = 0;
     const char *filename1 = NULL;
     const char *filename2 = NULL;
-    uint8_t chunk1[4096];
-    uint8_t chunk2[4096];
+    struct compare c;
+
+    memset(&c, 0, sizeof(c));
 
     struct option long_options[] = {
         { "help", no_argument, 0, 'h' },
         { "verbose", no_argument, 0, 'v' },
+        { "json", no_argument, 0, 'j' },
+        { "first", no_argument, 0, 'f' },
+        { "data", no_argument, 0, 'D' },
         { 0, 0, 0, 0 },
     };
 
-    while ((opt = getopt_long(argc, argv, "hv", long_options, &long_index)) !=
-           -1) {
+    while ((opt = getopt_long(argc,
+                              argv,
+                              "hvjfD",
+                              long_options,
+                              &long_index)) != -1) {
         switch (opt) {
         case 'h':
             print_compare_usage();
@@ -45,6 +297,15 @@ int action_compare(int argc, char **argv)
         case 'v':
             bpak_inc_verbosity();
             break;
+        case 'j':
+            c.json = true;
+            break;
+        case 'f':
+            c.first = true;
+            break;
+        case 'D':
+            c.data = true;
+            break;
         case '?':
             fprintf(stderr, "Unknown option: %c\n", optopt);
             return -1;
@@ -72,284 +333,90 @@ int action_compare(int argc, char **argv)
         return -1;
     }
 
-    FILE *fp1 = NULL;
-    FILE *fp2 = NULL;
-    struct bpak_header h1, h2;
+    /* Keep stdout a valid JSON document */
+    if (c.json)
+        bpak_log_to_stderr();
 
-    fp1 = fopen(filename1, "r");
+    struct bpak_package pkg1;
+    struct bpak_package pkg2;
 
-    if (fp1 == NULL) {
-        return -BPAK_FILE_NOT_FOUND;
-    }
-
-    fp2 = fopen(filename2, "r");
+    /* The part data is compared straight from the mappings */
+    rc = bpak_pkg_open_mmap(&pkg1, filename1);
 
-    if (fp2 == NULL) {
-        rc = -BPAK_FILE_NOT_FOUND;
-        goto err_close_fp1_out;
+    if (rc != BPAK_OK) {
+        fprintf(stderr, "Error: Could not open package %s\n", filename1);
+        return rc;
     }
 
-    if (fread(&h1, 1, sizeof(h1), fp1) != sizeof(h1)) {
-        fprintf(stderr, "Could not read first header\n");
-        rc = -BPAK_READ_ERROR;
-        goto err_close_fp2_out;
-    }
+    rc = bpak_pkg_open_mmap(&pkg2, filename2);
 
-    if (fread(&h2, 1, sizeof(h2), fp2) != sizeof(h2)) {
-        fprintf(stderr, "Could not read second header\n");
-        rc = -BPAK_READ_ERROR;
-        goto err_close_fp2_out;
+    if (rc != BPAK_OK) {
+        fprintf(stderr, "Error: Could not open package %s\n", filename2);
+        goto err_close_pkg1_out;
     }
 
-    rc = bpak_valid_header(&h1);
-
-    if (rc != BPAK_OK)
-        goto err_close_fp2_out;
+    c.pkg1 = &pkg1;
+    c.pkg2 = &pkg2;
 
-    rc = bpak_valid_header(&h2);
+    rc = bpak_valid_header(bpak_pkg_header(&pkg1));
 
     if (rc != BPAK_OK)
-        goto err_close_fp2_out;
-
-    printf("BPAK comparison between:\n1: '%s'\n2: '%s'\n",
-           filename1,
-           filename2);
-    printf("\n");
-    printf("=   : No differance\n");
-    printf("+   : Exists in file 2 but not in file 1\n");
-    printf("-   : Exists in file 1 but not in file 2\n");
-    printf("*   : Exists in both but data differs\n\n");
-
-    char string_output[64];
-    struct bpak_header *h1p = &h1;
-    struct bpak_header *h2p = &h2;
-    struct bpak_meta_header *meta = NULL;
-    char *data1 = NULL;
-    char *data2 = NULL;
-    bool change;
-    bool removed;
-
-#define RED_CLR "\033[31;1m"
-#define RED_YL  "\033[33;1m"
-#define RED_GR  "\033[32;1m"
-#define NO_CLR  "\033[0m"
-
-    printf("Metadata:\n");
-    printf("    ID         Size   Meta ID              Data\n");
-
-    bpak_foreach_meta (h1p, m) {
-        if (!m->id)
-            continue;
+        goto err_close_pkg2_out;
 
-        data1 = NULL;
-        data2 = NULL;
-        change = false;
-        removed = false;
-
-        data1 = bpak_get_meta_ptr(h1p, m, char);
-
-        rc = bpak_get_meta(h2p, m->id, m->part_id_ref, &meta);
-
-        /* Missing in file 2? */
-        if (rc != BPAK_OK)
-            removed = true;
-
-        data2 = bpak_get_meta_ptr(h2p, meta, char);
-
-        if (!data1 || !data2) {
-            removed = true;
-        } else if (rc == BPAK_OK) {
-            if (memcmp(data1, data2, m->size) != 0)
-                change = true;
-        }
-
-        if (change) {
-            printf(RED_CLR);
-            printf("*");
-        } else if (removed) {
-            printf(RED_YL);
-            printf("-");
-        } else {
-            printf("=");
-        }
+    rc = bpak_valid_header(bpak_pkg_header(&pkg2));
 
-        bpak_meta_to_string(h1p, m, string_output, sizeof(string_output));
-        printf("   %8.8x   %-3u    %-20s %s\n",
-               m->id,
-               m->size,
-               bpak_id_to_string(m->id),
-               string_output);
-        printf(NO_CLR);
+    if (rc != BPAK_OK)
+        goto err_close_pkg2_out;
+
+    if (c.json) {
+        printf("{\n    \"file1\": ");
+        print_json_string(filename1);
+        printf(",\n    \"file2\": ");
+        print_json_string(filename2);
+        printf(",\n    \"meta\": [");
+    } else {
+        printf("BPAK comparison between:\n1: '%s'\n2: '%s'\n",
+               filename1,
+               filename2);
+        printf("\n");
+        printf("=   : No differance\n");
+        printf("+   : Exists in file 2 but not in file 1\n");
+        printf("-   : Exists in file 1 but not in file 2\n");
+        printf("*   : Exists in both but data differs\n\n");
+
+        printf("Metadata:\n");
+        printf("    ID         Size   Meta ID              Data\n");
     }
 
-    /* Check for stuff thats in file 2 but not in 1 */
-    bpak_foreach_meta (h2p, m) {
-        if (!m->id)
-            continue;
-
-        data1 = NULL;
-        data2 = NULL;
-        change = false;
-        removed = false;
+    compare_meta(&c);
 
-        data1 = bpak_get_meta_ptr(h2p, m, char);
-
-        rc = bpak_get_meta(h1p, m->id, m->part_id_ref, &meta);
-
-        /* Missing in file 1? */
-        if (rc != BPAK_OK) {
-            printf(RED_YL);
-            bpak_meta_to_string(h2p, m, string_output, sizeof(string_output));
-            printf("+   %8.8x   %-3u    %-20s %s\n",
-                   m->id,
-                   m->size,
-                   bpak_id_to_string(m->id),
-                   string_output);
-            printf(NO_CLR);
-        }
+    if (c.json) {
+        printf("%s],\n    \"parts\": [", c.items ? "\n    " : "");
+        c.items = 0;
+    } else {
+        printf("\nParts:\n");
+        printf("    ID         Size         Z-pad  Flags          Transport "
+               "Size\n");
     }
 
-    /* Compare parts */
+    rc = compare_parts(&c);
 
-    printf("\nParts:\n");
-    printf(
-        "    ID         Size         Z-pad  Flags          Transport Size\n");
-
-    char flags_str[9] = "--------";
-    struct bpak_part_header *p2 = NULL;
-    struct bpak_part_header *p1 = NULL;
-
-    bpak_foreach_part (h1p, p) {
-        change = false;
-        removed = false;
-
-        if (p->id) {
-            rc = bpak_get_part(h2p, p->id, &p2);
-
-            if (rc != BPAK_OK) {
-                removed = true;
-            } else {
-                /* Check if metadata is the same */
-                if (memcmp(p2, p, sizeof(*p)) != 0)
-                    change = true;
-
-                /* Compare the data */
-                rc = fseek(fp1, bpak_part_offset(h1p, p), SEEK_SET);
-
-                if (rc != 0) {
-                    fprintf(stderr, "Error: Seek failed\n");
-                    rc = -BPAK_SEEK_ERROR;
-                    break;
-                }
-
-                rc = fseek(fp2, bpak_part_offset(h2p, p2), SEEK_SET);
-
-                if (rc != 0) {
-                    fprintf(stderr, "Error: Seek failed\n");
-                    rc = -BPAK_SEEK_ERROR;
-                    break;
-                }
-
-                size_t data_to_compare = bpak_part_size(p);
-
-                while (data_to_compare) {
-                    size_t chunk = (data_to_compare > sizeof(chunk1))
-                                       ? sizeof(chunk1)
-                                       : data_to_compare;
-
-                    if (fread(chunk1, 1, chunk, fp1) != chunk) {
-                        rc = -BPAK_READ_ERROR;
-                        goto err_close_fp2_out;
-                    }
-                    if (fread(chunk2, 1, chunk, fp2) != chunk) {
-                        rc = -BPAK_READ_ERROR;
-                        goto err_close_fp2_out;
-                    }
-
-                    if (memcmp(chunk1, chunk2, chunk) != 0) {
-                        change = true;
-                        break;
-                    }
-
-                    data_to_compare -= chunk;
-                }
-            }
-
-            if (change) {
-                printf(RED_CLR);
-                printf("*");
-            } else if (removed) {
-                printf(RED_YL);
-                printf("-");
-            } else {
-                printf("=");
-            }
+    if (rc != BPAK_OK)
+        goto err_close_pkg2_out;
 
-            if (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH)
-                flags_str[0] = 'h';
-            else
-                flags_str[0] = '-';
-
-            if (p->flags & BPAK_FLAG_TRANSPORT)
-                flags_str[1] = 'T';
-            else
-                flags_str[1] = '-';
-
-            printf("   %8.8x   %-12"PRIu64" %-3u    %s",
-                   p->id,
-                   p->size,
-                   p->pad_bytes,
-                   flags_str);
-
-            if (p->flags & BPAK_FLAG_TRANSPORT)
-                printf("       %-12"PRIu64, p->transport_size);
-            else
-                printf("       %-12"PRIu64, p->size);
-
-            printf("\n");
-            printf(NO_CLR);
-        }
+    if (c.json) {
+        printf("%s],\n    \"identical\": %s\n}\n",
+               c.items ? "\n    " : "",
+               c.differs ? "false" : "true");
     }
 
-    /* Check parts for parts in 2 that are missing in 1 */
-    bpak_foreach_part (h2p, p) {
-        if (p->id) {
-            rc = bpak_get_part(h1p, p->id, &p1);
-
-            if (rc != BPAK_OK) {
-                printf(RED_YL);
-                printf("-");
-
-                if (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH)
-                    flags_str[0] = 'h';
-                else
-                    flags_str[0] = '-';
-
-                if (p->flags & BPAK_FLAG_TRANSPORT)
-                    flags_str[1] = 'T';
-                else
-                    flags_str[1] = '-';
-
-                printf("   %8.8x   %-12"PRIu64" %-3u    %s",
-                       p->id,
-                       p->size,
-                       p->pad_bytes,
-                       flags_str);
-
-                if (p->flags & BPAK_FLAG_TRANSPORT)
-                    printf("       %-12"PRIu64, p->transport_size);
-                else
-                    printf("       %-12"PRIu64, p->size);
-
-                printf("\n");
-                printf(NO_CLR);
-            }
-        }
-    }
+    /* A difference is an error when the comparison stops at it */
+    if (c.first && c.differs)
+        rc = -BPAK_FAILED;
 
-err_close_fp2_out:
-    fclose(fp2);
-err_close_fp1_out:
-    fclose(fp1);
+err_close_pkg2_out:
+    bpak_pkg_close(&pkg2);
+err_close_pkg1_out:
+    bpak_pkg_close(&pkg1);
     return rc;
 }
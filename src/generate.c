@@ -10,10 +10,19 @@
 #include <bpak/bpak.h>
 #include <bpak/id.h>
 #include <bpak/crypto.h>
+#include <bpak/pkg.h>
 
 #include "uuid.h"
 #include "bpak_tool.h"
 
+static int compare_part_id(const void *a, const void *b)
+{
+    bpak_id_t id_a = (*(struct bpak_part_header *const *)a)->id;
+    bpak_id_t id_b = (*(struct bpak_part_header *const *)b)->id;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
 int action_generate(int argc, char **argv)
 {
     int opt;
@@ -95,61 +104,73 @@ int action_generate(int argc, char **argv)
             return -BPAK_FAILED;
         }
 
-        FILE *fp = NULL;
-        struct bpak_header *h = malloc(sizeof(struct bpak_header));
+        struct bpak_package pkg;
+        struct bpak_part_header **parts = NULL;
+        size_t no_of_parts = 0;
+        char *keystore_name_copy = NULL;
 
-        if (!h)
-            return -BPAK_FAILED;
-
-        fp = fopen(filename, "rb");
-
-        if (fp == NULL) {
-            rc = -BPAK_NOT_FOUND;
-            goto err_free_header_out;
-        }
-
-        size_t read_bytes = fread(h, 1, sizeof(*h), fp);
-
-        if (read_bytes != sizeof(*h)) {
-            rc = -BPAK_READ_ERROR;
-            goto err_free_io_out;
-        }
-
-        rc = bpak_valid_header(h);
+        rc = bpak_pkg_open(&pkg, filename, "rb");
 
         if (rc != BPAK_OK)
-            goto err_free_io_out;
+            return rc;
 
         struct bpak_meta_header *meta = NULL;
         unsigned char *package_id = NULL;
 
-        rc = bpak_get_meta(h,
-                           bpak_id("bpak-package"),
-                           0,
-                           &meta);
+        rc = bpak_pkg_get_meta(&pkg, bpak_id("bpak-package"), 0, &meta, NULL);
 
         if (rc != BPAK_OK) {
             fprintf(stderr, "Error: Could not read bpak-package-id\n");
-            goto err_free_io_out;
+            goto err_close_pkg_out;
         }
 
-        package_id = bpak_get_meta_ptr(h, meta, unsigned char);
+        package_id = bpak_get_meta_ptr(&pkg.header, meta, unsigned char);
         (void)package_id;
 
         uint32_t *keystore_provider_id = NULL;
+        struct bpak_header *meta_table = NULL;
 
-        rc = bpak_get_meta(h,
-                           bpak_id("keystore-provider-id"),
-                           0,
-                           &meta);
+        rc = bpak_pkg_get_meta(&pkg,
+                               bpak_id("keystore-provider-id"),
+                               0,
+                               &meta,
+                               &meta_table);
 
         if (rc != BPAK_OK) {
             fprintf(stderr,
                     "Error: Could not read keystore-provider-id meta\n");
-            goto err_free_io_out;
+            goto err_close_pkg_out;
+        }
+
+        keystore_provider_id = bpak_get_meta_ptr(meta_table, meta, uint32_t);
+
+        /* The keys are emitted sorted by id, which lets bpak_keystore_get
+         * use a binary search */
+        parts = calloc(BPAK_MAX_PARTS * (bpak_pkg_table_count(&pkg) + 1),
+                       sizeof(*parts));
+
+        if (parts == NULL) {
+            rc = -BPAK_FAILED;
+            goto err_close_pkg_out;
         }
 
-        keystore_provider_id = bpak_get_meta_ptr(h, meta, uint32_t);
+        bpak_foreach_table (&pkg.header,
+                            pkg.tables,
+                            bpak_pkg_table_count(&pkg),
+                            t) {
+            bpak_foreach_part (t, p) {
+                if (p->id)
+                    parts[no_of_parts++] = p;
+            }
+        }
+
+        if (no_of_parts > UINT16_MAX) {
+            fprintf(stderr, "Error: Too many keys\n");
+            rc = -BPAK_NO_SPACE_LEFT;
+            goto err_close_pkg_out;
+        }
+
+        qsort(parts, no_of_parts, sizeof(*parts), compare_part_id);
 
         int key_index = 0;
         unsigned char key_buffer[4096];
@@ -161,17 +182,15 @@ int action_generate(int argc, char **argv)
 
         printf("\n\n");
 
-        char *keystore_name_copy = strdup(keystore_name);
+        keystore_name_copy = strdup(keystore_name);
 
         for (unsigned int i = 0; i < strlen(keystore_name); i++) {
             if (keystore_name[i] == '-')
                 keystore_name_copy[i] = '_';
         }
 
-        bpak_foreach_part (h, p) {
-            if (!p->id)
-                continue;
-
+        for (size_t n = 0; n < no_of_parts; n++) {
+            struct bpak_part_header *p = parts[n];
             const char *keystore_key_decorator =
                 "__attribute__((section (\".keystore_key\"))) ";
 
@@ -184,21 +203,18 @@ int action_generate(int argc, char **argv)
             printf("    .id = 0x%x,\n", p->id);
             printf("    .size = %"PRIu64",\n", p->size);
 
-            if (fseek(fp, p->offset, SEEK_SET) != 0) {
-                rc = -BPAK_SEEK_ERROR;
-                goto err_free_keystore_name;
-            }
-
             if (p->size > sizeof(key_buffer)) {
                 fprintf(stderr, "Key data can't fit in buffer");
                 rc = -BPAK_BUFFER_TOO_SMALL;
                 goto err_free_keystore_name;
             }
 
-            read_bytes = fread(key_buffer, 1, p->size, fp);
+            rc = bpak_pkg_read_at(&pkg,
+                                  bpak_pkg_part_offset(&pkg, p),
+                                  key_buffer,
+                                  p->size);
 
-            if (read_bytes != p->size) {
-                rc = -BPAK_READ_ERROR;
+            if (rc != BPAK_OK) {
                 fprintf(stderr, "Error: Could not read key\n");
                 goto err_free_keystore_name;
             }
@@ -256,6 +272,7 @@ int action_generate(int argc, char **argv)
         printf("    .id = 0x%x,\n", *keystore_provider_id);
         printf("    .no_of_keys = %i,\n", key_index);
         printf("    .verified = true,\n");
+        printf("    .sorted = true,\n");
         printf("    .keys =\n");
         printf("    {\n");
         for (int i = 0; i < key_index; i++)
@@ -269,10 +286,9 @@ err_free_key_out:
             free(key);
 err_free_keystore_name:
         free(keystore_name_copy);
-err_free_io_out:
-        fclose(fp);
-err_free_header_out:
-        free(h);
+err_close_pkg_out:
+        free(parts);
+        bpak_pkg_close(&pkg);
     }
 
     return rc;
@@ -16,7 +16,7 @@ int bpak_printf(int verbosity, const char *fmt, ...)
 
     va_list args;
     va_start(args, fmt);
-    if (verbosity == 0)
+    if ((verbosity == 0) || bpak_get_log_stderr())
         vfprintf(stderr, fmt, args);
     else
         vprintf(fmt, args);
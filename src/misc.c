@@ -20,8 +20,30 @@ void bpak_inc_verbosity(void) { verbosity++; }
 
 int bpak_get_verbosity(void) { return verbosity; }
 
+static bool log_stderr;
+
+void bpak_log_to_stderr(void) { log_stderr = true; }
+
+bool bpak_get_log_stderr(void) { return log_stderr; }
+
 void print_version(void) { printf("BitPacker %s\n", bpak_version()); }
 
+void print_json_string(const char *str)
+{
+    putchar('"');
+
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        if ((*c == '"') || (*c == '\\'))
+            printf("\\%c", *c);
+        else if (*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+
+    putchar('"');
+}
+
 void print_common_usage(void)
 {
     printf("Common options:\n");
@@ -96,7 +118,17 @@ void print_compare_usage(void)
 {
     print_version();
     printf("\n");
-    printf("bpak compare <first.bpak> <second.bpak>        Compare files\n");
+    printf("bpak compare [options] <first.bpak> <second.bpak>  Compare "
+           "files\n");
+    printf("\n");
+
+    printf("Options:\n");
+    printf("    -j, --json                Print the comparison as JSON\n");
+    printf("    -f, --first               Stop at the first difference and "
+           "fail\n");
+    printf("    -D, --data                Compare part data even when both "
+           "packages\n"
+           "                              have part digests\n");
     printf("\n");
 
     print_common_usage();
@@ -108,24 +140,152 @@ void print_transport_usage(void)
     printf("\n");
     printf("bpak transport <filename.bpak> (--add || --encode || --decode) "
            "[options]    Transport operations\n");
+    printf("    With --decode, '-' as <filename.bpak> reads the patch from "
+           "stdin\n");
     printf("\n");
 
     printf("Transport commands:\n");
     printf("    -a, --add                 Add transport meta data\n");
     printf("    -E, --encode              Encode archive for transport\n");
     printf("    -D, --decode              Decode package\n");
+    printf("    -A, --analyze             Print control tuple and region "
+           "statistics of\n"
+           "                              bspatch encoded parts, -r selects "
+           "one part\n");
+    printf("    -I, --estimate            Print the memory and i/o that "
+           "decoding takes\n");
+    printf("    -Q, --serve               Encode against <filename.bpak> "
+           "for every line of\n"
+           "                              '<input> <output>' on stdin, "
+           "replies 'ok <output>'\n"
+           "                              or 'error <code> <output>' on "
+           "stdout\n");
+    printf("    -n, --install             Decode the packages of every "
+           "line of\n"
+           "                              '<input> <output> [<origin>]' in "
+           "<filename>, '-'\n"
+           "                              for stdin, in one decode pipeline "
+           "and reply like\n"
+           "                              --serve\n");
     printf("\n");
 
     printf("Add options:\n");
     printf("    -p, --part <part name>    Which part id to operate on\n");
-    printf("    -e, --encode <enc. name>  Encoder algorithm to use\n");
+    printf("    -e, --encode <enc. name>  Encoder algorithm to use, 'auto' "
+           "picks one of the\n"
+           "                              bsdiff or compress encoders at "
+           "encode time and\n"
+           "                              needs no decoder\n");
     printf("    -d, --decode <dec. name>  Decoder algorithm to use\n");
+    printf("    -L, --lzma-preset <0-9>   LZMA preset for bsdiff-lzma\n");
+    printf("    -Z, --lzma-dict-size <n>  LZMA dictionary size, accepts K and "
+           "M suffixes\n");
+    printf("    -B, --lzma-bcj <filter>   BCJ filter: x86 (default), none, "
+           "arm, armthumb\n"
+           "                              or arm64\n");
+    printf("    -S, --lzma-block-size <n> Compress LZMA blocks of <n> bytes in "
+           "parallel on\n"
+           "                              --jobs threads, a power of two "
+           "from 64K to 2G\n");
+    printf("    -W, --hs-window <4-15>    Heatshrink window bits for bsdiff\n");
+    printf("    -K, --hs-lookahead <3-14> Heatshrink lookahead bits for "
+           "bsdiff\n");
+    printf("    -Y, --bsdiff-copy         Write unchanged bsdiff runs as "
+           "origin copies,\n"
+           "                              the decoder must support bsdiff "
+           "revision 1\n");
+    printf("    -R, --origin-part <name>  Diff against this origin part "
+           "instead of the\n"
+           "                              origin part with the same name, "
+           "when given\n"
+           "                              several times the diff runs "
+           "against the\n"
+           "                              origin parts concatenated\n");
     printf("\n");
 
     printf("Encode/Decode options:\n");
     printf("    -O, --origin <filename>   Source data to use during "
            "encoding/decoding\n");
-    printf("    -o, --output <filename>   Write to output to <filename>\n");
+    printf("    -o, --output <filename>   Write to output to <filename>, "
+           "'-' streams an\n"
+           "                              encoded package to stdout\n");
+    printf("    -j, --jobs <n>            Number of threads to use for "
+           "bsdiff encoding, or\n"
+           "                              parts to decode concurrently\n");
+    printf("    -C, --cache-dir <dir>     Cache origin suffix arrays in "
+           "<dir> to speed up\n"
+           "                              repeated bsdiff encodes\n");
+    printf("    -H, --patch-cache-dir <dir>\n"
+           "                              Cache encoded parts in <dir>, "
+           "parts with the\n"
+           "                              same data, origin and encoder "
+           "are copied from\n"
+           "                              the cache\n");
+    printf("    -J, --encode-jobs <n>     Number of parts to encode "
+           "concurrently\n");
+    printf("    -N, --decode-threads <n>  Decompress the LZMA blocks of a "
+           "part on <n>\n"
+           "                              threads, see --lzma-block-size\n");
+    printf("    -M, --memory-budget <n>   Limit for the suffix arrays of "
+           "parts encoded\n"
+           "                              concurrently, larger origins are "
+           "diffed in\n"
+           "                              windows, accepts K and M "
+           "suffixes\n");
+    printf("    -l, --seek-cost <n>       Patch bytes that an origin seek "
+           "costs on the target,\n"
+           "                              bsdiff prefers origin reads "
+           "that run forward,\n"
+           "                              accepts K and M suffixes\n");
+    printf("    -x, --huge-pages <pages>  Allocate the bsdiff suffix "
+           "arrays in\n"
+           "                              'transparent' or 'hugetlb' huge "
+           "pages\n");
+    printf("    -y, --populate            Fault in the origin and target "
+           "data before\n"
+           "                              diffing it\n");
+    printf("    -b, --buffer-size <n>     Decoder buffer size, accepts K and "
+           "M suffixes\n");
+    printf("    -U, --output-buffer <n>   Collect decoder output in a buffer "
+           "of <n> bytes,\n"
+           "                              a multiple of 4K\n");
+    printf("    -w, --write-block <n>     Write decoder output in aligned "
+           "blocks of <n> bytes,\n"
+           "                              for example the flash erase "
+           "block size\n");
+    printf("    -i, --in-place <n>        With --add, diff the part so that "
+           "it can be\n"
+           "                              decoded over its origin with <n> "
+           "bytes of\n"
+           "                              scratch. With --decode, write the "
+           "output over\n"
+           "                              the origin package in the output "
+           "file\n");
+    printf("    -u, --skip-unchanged      Compare decoder output with the "
+           "output file and\n"
+           "                              only write the blocks that "
+           "differ\n");
+    printf("    -V, --verify-origin       Check the origin data that is "
+           "read against the\n"
+           "                              hash trees of the origin "
+           "package\n");
+    printf("    -X, --direct-io           Write decoder output with "
+           "O_DIRECT\n");
+    printf("    -P, --drop-cache          Drop decoder output from the page "
+           "cache\n");
+    printf("    -T, --progress            Print the size and time of each "
+           "part to stderr\n");
+    printf("    -F, --decode-time <ms>    Decode time limit of each 'auto' "
+           "part on the target\n");
+    printf("    -g, --decode-heap <n>     Decoder heap limit of 'auto' parts, "
+           "accepts K and M\n"
+           "                              suffixes\n");
+    printf("    -k, --decode-rate <c>=<n> Bytes per second that the target "
+           "decodes, <c> is\n"
+           "                              none, hs, lzma or zstd for patch "
+           "input or output\n"
+           "                              for written output, accepts K and "
+           "M suffixes\n");
     printf("\n");
 
     print_common_usage();
@@ -143,6 +303,7 @@ void print_show_usage(void)
     printf("    -H, --hash                      Print package hash\n");
     printf("    -B, --binary-hash               Output package hash in binary form\n");
     printf("    -P, --part-hash <name or id>    Display a sha256 hash of a part\n");
+    printf("    -j, --json                      Print the overview as JSON\n");
     printf("\n");
     printf("Note: If no options are supplied an overview of the package will be displayed\n");
     printf("\n");
@@ -187,11 +348,15 @@ void print_add_usage(void)
     printf(
         "    -F, --set-flag=flag             Set flag 'flag' for this part\n");
     printf("    -r, --part-ref=ref              Reference part\n");
+    printf("    -H, --hash-cache=filename       Keep the payload hash state "
+           "in 'filename'\n");
     printf("\n");
 
     printf("Optional flags:\n");
     printf("    dont-hash                       Exclude part from hashing "
            "context\n");
+    printf("    sparse                          Leave out all-zero 4 KiB "
+           "blocks\n");
     printf("\n");
 
     printf("Encoders that can be used together with --from-string:\n");
@@ -213,12 +378,24 @@ void print_sign_usage(void)
     print_version();
     printf("\n");
     printf("bpak sign <filename.bpak> <options>  Sign a bpak file\n");
+    printf("bpak sign --batch <a.bpak> <b.bpak> ... <options>\n");
+    printf("                                     Sign several files with "
+           "the same key\n");
     printf("\n");
 
     printf("Sign options:\n");
     printf(
         "    -f, --signature <filename>       Write precomputed signature\n");
     printf("    -k, --key <key>                  Sign using key <key>\n");
+    printf(
+        "    -d, --part-digests               Add a signed digest per part\n");
+    printf("    -H, --hash-cache <filename>      Payload hash state cache, see "
+           "'add'\n");
+    printf("    -b, --batch                      Sign every file argument, "
+           "needs --key\n");
+    printf("    -j, --jobs <n>                   Sign <n> files of a batch "
+           "concurrently,\n"
+           "                                     0 uses all CPUs\n");
     printf("\n");
 
     print_common_usage();
@@ -229,11 +406,29 @@ void print_verify_usage(void)
     print_version();
     printf("\n");
     printf("bpak verify [options] <filename.bpak>   Verify a bpak file\n");
+    printf("bpak verify [options] <a.bpak> <b.bpak> ...\n");
+    printf("                                         Verify several files, "
+           "with -j files\n"
+           "                                         are verified "
+           "concurrently\n");
     printf("\n");
 
     printf("Verify options:\n");
     printf("    -k, --key <key>                  Verify using key <key>\n");
     printf("    -K, --keystore <keystore.bpak>   Verify using keystore\n");
+    printf("    -j, --jobs <n>                   Verify the payload hash and "
+           "merkle trees\n"
+           "                                     concurrently, 0 uses all "
+           "CPUs\n");
+    printf("    -i, --installed <part>:<file>[:<offset>]\n"
+           "                                     Verify an installed part "
+           "in <file>\n"
+           "                                     against the package header "
+           "instead of\n"
+           "                                     the payload, may be repeated. "
+           "With -j 0\n"
+           "                                     every part is checked at "
+           "once\n");
     printf("\n");
 
     print_common_usage();
@@ -20,6 +20,106 @@
 #include <bpak/id.h>
 #include "bpak_tool.h"
 
+static void show_json_flags(struct bpak_part_header *p, char *flags_str)
+{
+    flags_str[0] = (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH) ? 'h' : '-';
+    flags_str[1] = (p->flags & BPAK_FLAG_TRANSPORT) ? 'T' : '-';
+    flags_str[2] = (p->flags & BPAK_FLAG_SPARSE) ? 'S' : '-';
+    flags_str[3] = (p->flags & BPAK_FLAG_REUSE_ORIGIN) ? 'R' : '-';
+}
+
+/* The overview as one JSON document, for tools that process many
+ * packages */
+static int show_json(struct bpak_package *pkg, const char *filename)
+{
+    int rc;
+    struct bpak_header *h = bpak_pkg_header(pkg);
+    unsigned int table_count = bpak_pkg_table_count(pkg);
+    char string_output[128];
+    char hash_output[64];
+    size_t hash_size = sizeof(hash_output);
+    char hash_str[128];
+    char flags_str[9] = "--------";
+    uint8_t payload_hash_copy[BPAK_HASH_MAX_LENGTH];
+    unsigned int items = 0;
+
+    memcpy(payload_hash_copy, pkg->header.payload_hash, BPAK_HASH_MAX_LENGTH);
+    rc = bpak_pkg_update_hash(pkg, hash_output, &hash_size);
+
+    if (rc != BPAK_OK) {
+        fprintf(stderr, "Error: Failed to compute header hash\n");
+        return rc;
+    }
+
+    printf("{\n    \"file\": ");
+    print_json_string(filename);
+    printf(",\n    \"hash\": ");
+    print_json_string(bpak_hash_kind(h->hash_kind));
+    printf(",\n    \"signature\": ");
+    print_json_string(bpak_signature_kind(h->signature_kind));
+    printf(",\n    \"key_id\": \"%08x\",\n", h->key_id);
+    printf("    \"keystore_id\": \"%08x\",\n", h->keystore_id);
+    printf("    \"tables\": %u,\n", table_count);
+    printf("    \"meta\": [");
+
+    bpak_foreach_table (h, pkg->tables, table_count, t)
+    bpak_foreach_meta (t, m) {
+        if (!m->id)
+            continue;
+
+        bpak_meta_to_string(t, m, string_output, sizeof(string_output));
+        printf("%s\n        {\"id\": \"%08x\", \"size\": %u, \"name\": ",
+               items++ ? "," : "",
+               m->id,
+               m->size);
+        print_json_string(bpak_id_to_string(m->id));
+        printf(", \"part_ref\": \"%08x\", \"data\": ", m->part_id_ref);
+        print_json_string(string_output);
+        printf("}");
+    }
+
+    printf("%s],\n    \"parts\": [", items ? "\n    " : "");
+    items = 0;
+
+    bpak_foreach_table (h, pkg->tables, table_count, t)
+    bpak_foreach_part (t, p) {
+        if (!p->id)
+            continue;
+
+        show_json_flags(p, flags_str);
+        printf("%s\n        {\"id\": \"%08x\", \"size\": %" PRIu64
+               ", \"pad_bytes\": %u, \"flags\": \"%s\", "
+               "\"transport_size\": %" PRIu64 "}",
+               items++ ? "," : "",
+               p->id,
+               p->size,
+               p->pad_bytes,
+               flags_str,
+               (p->flags & BPAK_FLAG_TRANSPORT) ? p->transport_size
+                                                : p->size);
+    }
+
+    printf("%s],\n", items ? "\n    " : "");
+
+    bpak_bin2hex((uint8_t *)hash_output, hash_size, hash_str, sizeof(hash_str));
+    printf("    \"header_hash\": \"%s\",\n", hash_str);
+    bpak_bin2hex(pkg->header.payload_hash,
+                 hash_size,
+                 hash_str,
+                 sizeof(hash_str));
+    printf("    \"payload_hash\": \"%s\",\n", hash_str);
+    printf("    \"payload_hash_valid\": %s,\n",
+           (memcmp(pkg->header.payload_hash,
+                   payload_hash_copy,
+                   BPAK_HASH_MAX_LENGTH) == 0)
+               ? "true"
+               : "false");
+    printf("    \"transport_size\": %zu,\n", bpak_pkg_size(pkg));
+    printf("    \"installed_size\": %zu\n}\n", bpak_pkg_installed_size(pkg));
+
+    return BPAK_OK;
+}
+
 int action_show(int argc, char **argv)
 {
     int opt;
@@ -31,6 +131,7 @@ int action_show(int argc, char **argv)
     const char *meta_name = NULL;
     bool text_hash_output = false;
     bool binary_hash_output = false;
+    bool json_output = false;
     char hash_output[64];
     size_t hash_size = sizeof(hash_output);
     char string_output[128];
@@ -47,11 +148,12 @@ int action_show(int argc, char **argv)
         { "part-hash", required_argument, 0, 'P' },
         { "hash", no_argument, 0, 'H' },
         { "binary-hash", no_argument, 0, 'B' },
+        { "json", no_argument, 0, 'j' },
         { 0, 0, 0, 0 },
     };
 
     while ( (opt = getopt_long(argc, argv,
-                               "hvm:p:P:HB",
+                               "hvm:p:P:HBj",
                                long_options, &long_index)) != -1) {
         switch (opt) {
         case 'h':
@@ -79,6 +181,10 @@ int action_show(int argc, char **argv)
         case 'B':
             binary_hash_output = true;
             break;
+        case 'j':
+            json_output = true;
+            bpak_log_to_stderr();
+            break;
         case '?':
             fprintf(stderr, "Unknown option: %c\n", optopt);
             return -1;
@@ -109,6 +215,7 @@ int action_show(int argc, char **argv)
     }
 
     struct bpak_header *h = bpak_pkg_header(&pkg);
+    unsigned int table_count = bpak_pkg_table_count(&pkg);
 
     rc = bpak_valid_header(h);
     if (rc != BPAK_OK) {
@@ -121,19 +228,27 @@ int action_show(int argc, char **argv)
     if (meta_name) {
         rc = -BPAK_MISSING_META_DATA;
 
-        bpak_foreach_meta (h, m) {
-            if (m->id == meta_id) {
-                if (part_name)
-                    if (part_id != m->part_id_ref)
-                        continue;
-
-                bpak_meta_to_string(h, m, string_output, sizeof(string_output));
-                if (strlen(string_output))
-                    printf("%s\n", string_output);
+        bpak_foreach_table (h, pkg.tables, table_count, t) {
+            bpak_foreach_meta (t, m) {
+                if (m->id == meta_id) {
+                    if (part_name)
+                        if (part_id != m->part_id_ref)
+                            continue;
+
+                    bpak_meta_to_string(t,
+                                        m,
+                                        string_output,
+                                        sizeof(string_output));
+                    if (strlen(string_output))
+                        printf("%s\n", string_output);
+
+                    rc = BPAK_OK;
+                    break;
+                }
+            }
 
-                rc = BPAK_OK;
+            if (rc == BPAK_OK)
                 break;
-            }
         }
 
         if (rc != BPAK_OK) {
@@ -144,15 +259,12 @@ int action_show(int argc, char **argv)
     }
 
     if (part_name) {
-        rc = -BPAK_NOT_FOUND;
+        struct bpak_part_header *p = NULL;
 
-        bpak_foreach_part (h, p) {
-            if (p->id == part_id) {
-                printf("Found 0x%x, %"PRIu64" bytes\n", p->id, p->size);
-                rc = BPAK_OK;
-                break;
-            }
-        }
+        rc = bpak_pkg_get_part(&pkg, part_id, &p);
+
+        if (rc == BPAK_OK)
+            printf("Found 0x%x, %"PRIu64" bytes\n", p->id, p->size);
 
         if (rc != BPAK_OK) {
             fprintf(stderr, "Error: Could not find part '%s'\n", part_name);
@@ -197,6 +309,11 @@ int action_show(int argc, char **argv)
         goto err_pkg_close;
     }
 
+    if (json_output) {
+        rc = show_json(&pkg, filename);
+        goto err_pkg_close;
+    }
+
     printf("BPAK File: %s\n", filename);
     printf("\n");
     printf("Hash:        %s\n", bpak_hash_kind(h->hash_kind));
@@ -204,12 +321,16 @@ int action_show(int argc, char **argv)
     printf("Key ID:      %08x\n", h->key_id);
     printf("Keystore ID: %08x\n", h->keystore_id);
 
+    if (table_count > 0)
+        printf("Tables:      %u\n", table_count);
+
     printf("\nMetadata:\n");
     printf("    ID         Size   Meta ID              Part Ref   Data\n");
 
-    bpak_foreach_meta (h, m) {
+    bpak_foreach_table (h, pkg.tables, table_count, t)
+    bpak_foreach_meta (t, m) {
         if (m->id) {
-            bpak_meta_to_string(h, m, string_output, sizeof(string_output));
+            bpak_meta_to_string(t, m, string_output, sizeof(string_output));
             printf("    %8.8x   %-3u    %-20s ",
                    m->id,
                    m->size,
@@ -230,7 +351,8 @@ int action_show(int argc, char **argv)
 
     char flags_str[9] = "--------";
 
-    bpak_foreach_part (h, p) {
+    bpak_foreach_table (h, pkg.tables, table_count, t)
+    bpak_foreach_part (t, p) {
         if (p->id) {
             if (p->flags & BPAK_FLAG_EXCLUDE_FROM_HASH)
                 flags_str[0] = 'h';
@@ -242,6 +364,16 @@ int action_show(int argc, char **argv)
             else
                 flags_str[1] = '-';
 
+            if (p->flags & BPAK_FLAG_SPARSE)
+                flags_str[2] = 'S';
+            else
+                flags_str[2] = '-';
+
+            if (p->flags & BPAK_FLAG_REUSE_ORIGIN)
+                flags_str[3] = 'R';
+            else
+                flags_str[3] = '-';
+
             printf("    %8.8x   %-12"PRIu64" %-3u    %s",
                    p->id,
                    p->size,
@@ -285,14 +417,15 @@ int action_show(int argc, char **argv)
         uint32_t meta_size = 0;
         uint8_t no_of_meta_headers = 0;
 
-        bpak_foreach_meta (h, m) {
+        bpak_foreach_table (h, pkg.tables, table_count, t)
+        bpak_foreach_meta (t, m) {
             meta_size += m->size;
             no_of_meta_headers++;
         }
 
         printf("Metadata usage: %i/%zu bytes\n",
                meta_size,
-               sizeof(h->metadata));
+               (1 + table_count) * sizeof(h->metadata));
 
         printf("Transport size: %zu bytes\n", bpak_pkg_size(&pkg));
         printf("Installed size: %zu bytes\n", bpak_pkg_installed_size(&pkg));
@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <errno.h>
 
 #include <bpak/bpak.h>
 #include <bpak/pkg.h>
@@ -19,6 +20,78 @@
 
 #include "bpak_tool.h"
 
+/* Sign every file in 'filenames' with bpak_pkg_sign_batch */
+static int sign_batch(char **filenames, size_t count, const char *key_source,
+                      bool part_digests, unsigned int jobs)
+{
+    int rc;
+    struct bpak_package *pkgs;
+    struct bpak_sign_batch_item *items;
+    struct bpak_key *key = NULL;
+    size_t opened = 0;
+
+    pkgs = calloc(count, sizeof(*pkgs));
+    items = calloc(count, sizeof(*items));
+
+    if ((pkgs == NULL) || (items == NULL)) {
+        rc = -BPAK_FAILED;
+        goto err_free_out;
+    }
+
+    rc = bpak_crypto_load_private_key(key_source, &key);
+
+    if (rc != BPAK_OK)
+        goto err_free_out;
+
+    for (; opened < count; opened++) {
+        rc = bpak_pkg_open(&pkgs[opened], filenames[opened], "r+");
+
+        if (rc != BPAK_OK) {
+            fprintf(stderr,
+                    "Error: Could not open package '%s'\n",
+                    filenames[opened]);
+            goto err_close_out;
+        }
+
+        items[opened].pkg = &pkgs[opened];
+
+        if (part_digests) {
+            rc = bpak_pkg_add_part_digests(&pkgs[opened]);
+
+            if (rc != BPAK_OK) {
+                fprintf(stderr,
+                        "Error: Could not add part digests to '%s'\n",
+                        filenames[opened]);
+                opened++;
+                goto err_close_out;
+            }
+        }
+    }
+
+    rc = bpak_pkg_sign_batch(items, count, key, jobs);
+
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].rc != BPAK_OK) {
+            fprintf(stderr,
+                    "%s: Signing failed: %i, %s\n",
+                    filenames[i],
+                    items[i].rc,
+                    bpak_error_string(items[i].rc));
+        } else if (bpak_get_verbosity()) {
+            printf("%s: Signed\n", filenames[i]);
+        }
+    }
+
+err_close_out:
+    for (size_t i = 0; i < opened; i++)
+        bpak_pkg_close(&pkgs[i]);
+err_free_out:
+    free(key);
+    free(items);
+    free(pkgs);
+    return rc;
+}
+
 int action_sign(int argc, char **argv)
 {
     int opt;
@@ -26,6 +99,11 @@ int action_sign(int argc, char **argv)
     const char *filename = NULL;
     const char *signature_file = NULL;
     const char *key_source = NULL;
+    bool part_digests = false;
+    const char *hash_cache = NULL;
+    bool batch = false;
+    unsigned int jobs = 1;
+    char *endptr = NULL;
     char sig[1024];
     size_t size = sizeof(sig);
     struct bpak_package pkg;
@@ -36,12 +114,18 @@ int action_sign(int argc, char **argv)
         { "verbose", no_argument, 0, 'v' },
         { "key", required_argument, 0, 'k' },
         { "signature", required_argument, 0, 'f' },
+        { "part-digests", no_argument, 0, 'd' },
+        { "hash-cache", required_argument, 0, 'H' },
+        { "batch", no_argument, 0, 'b' },
+        { "jobs", required_argument, 0, 'j' },
         { 0, 0, 0, 0 },
     };
 
-    while (
-        (opt = getopt_long(argc, argv, "hvk:f:", long_options, &long_index)) !=
-        -1) {
+    while ((opt = getopt_long(argc,
+                              argv,
+                              "hvk:f:dH:bj:",
+                              long_options,
+                              &long_index)) != -1) {
         switch (opt) {
         case 'h':
             print_sign_usage();
@@ -55,6 +139,23 @@ int action_sign(int argc, char **argv)
         case 'f':
             signature_file = (const char *)optarg;
             break;
+        case 'd':
+            part_digests = true;
+            break;
+        case 'H':
+            hash_cache = (const char *)optarg;
+            break;
+        case 'b':
+            batch = true;
+            break;
+        case 'j':
+            jobs = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0') {
+                fprintf(stderr, "Error: Invalid number of jobs '%s'\n", optarg);
+                return -1;
+            }
+            break;
         case '?':
             fprintf(stderr, "Unknown option: %c\n", optopt);
             return -1;
@@ -68,13 +169,29 @@ int action_sign(int argc, char **argv)
         }
     }
 
-    if (optind < argc) {
-        filename = (const char *)argv[optind++];
-    } else {
+    if (optind >= argc) {
         fprintf(stderr, "Missing filename argument\n");
         return -1;
     }
 
+    if (batch) {
+        if ((key_source == NULL) || (signature_file != NULL) ||
+            (hash_cache != NULL)) {
+            fprintf(stderr,
+                    "Error: --batch signs with --key and can't be used "
+                    "with --signature or --hash-cache\n");
+            return -1;
+        }
+
+        return sign_batch(&argv[optind],
+                          argc - optind,
+                          key_source,
+                          part_digests,
+                          jobs);
+    }
+
+    filename = (const char *)argv[optind++];
+
     rc = bpak_pkg_open(&pkg, filename, "r+");
 
     if (rc != BPAK_OK) {
@@ -84,6 +201,20 @@ int action_sign(int argc, char **argv)
 
     FILE *sig_fp = NULL;
 
+    if ((hash_cache != NULL) &&
+        (bpak_pkg_set_hash_cache(&pkg, hash_cache) != BPAK_OK)) {
+        fprintf(stderr, "Warning: Hash cache is not supported\n");
+    }
+
+    if (part_digests) {
+        rc = bpak_pkg_add_part_digests(&pkg);
+
+        if (rc != BPAK_OK) {
+            fprintf(stderr, "Error: Could not add part digests\n");
+            goto err_out;
+        }
+    }
+
     /* Set pre-computed signature */
     if (signature_file) {
         sig_fp = fopen(signature_file, "r");
@@ -115,6 +246,202 @@ err_out:
     return rc;
 }
 
+/* Verify every file in 'filenames' with bpak_pkg_verify_batch. Packages
+ * that name the same key in the keystore share one loaded key. */
+static int verify_batch(char **filenames, size_t count, const char *key_source,
+                        const char *keystore_path, unsigned int jobs)
+{
+    int rc;
+    struct bpak_package *pkgs;
+    struct bpak_verify_batch_item *items;
+    struct bpak_key *key = NULL;
+    size_t opened = 0;
+
+    pkgs = calloc(count, sizeof(*pkgs));
+    items = calloc(count, sizeof(*items));
+
+    if ((pkgs == NULL) || (items == NULL)) {
+        rc = -BPAK_FAILED;
+        goto err_free_out;
+    }
+
+    if (key_source != NULL) {
+        rc = bpak_crypto_load_public_key(key_source, &key);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+    }
+
+    for (; opened < count; opened++) {
+        struct bpak_package *pkg = &pkgs[opened];
+
+        rc = bpak_pkg_open_mmap(pkg, filenames[opened]);
+
+        if (rc != BPAK_OK) {
+            fprintf(stderr,
+                    "Error: Could not open package '%s'\n",
+                    filenames[opened]);
+            goto err_close_out;
+        }
+
+        items[opened].pkg = pkg;
+        items[opened].key = key;
+
+        if (key != NULL)
+            continue;
+
+        for (size_t i = 0; i < opened; i++) {
+            if ((pkgs[i].header.keystore_id == pkg->header.keystore_id) &&
+                (pkgs[i].header.key_id == pkg->header.key_id)) {
+                items[opened].key = items[i].key;
+                break;
+            }
+        }
+
+        if (items[opened].key != NULL)
+            continue;
+
+        rc = bpak_keystore_load_key_from_file(keystore_path,
+                                              pkg->header.keystore_id,
+                                              pkg->header.key_id,
+                                              NULL,
+                                              NULL,
+                                              &items[opened].key);
+
+        if (rc != BPAK_OK) {
+            opened++;
+            goto err_close_out;
+        }
+    }
+
+    rc = bpak_pkg_verify_batch(items, count, jobs);
+
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].rc != BPAK_OK) {
+            fprintf(stderr,
+                    "%s: Verification failed: %i, %s\n",
+                    filenames[i],
+                    items[i].rc,
+                    bpak_error_string(items[i].rc));
+        } else {
+            printf("%s: Verification OK\n", filenames[i]);
+        }
+    }
+
+err_close_out:
+    for (size_t i = 0; i < opened; i++) {
+        bool shared = (key != NULL);
+
+        for (size_t n = 0; (n < i) && !shared; n++)
+            shared = (items[n].key == items[i].key);
+
+        if (!shared)
+            free(items[i].key);
+
+        bpak_pkg_close(&pkgs[i]);
+    }
+err_free_out:
+    free(key);
+    free(items);
+    free(pkgs);
+    return rc;
+}
+
+/* Positional read of an installed part, it is safe to call from several
+ * threads */
+static ssize_t installed_pread(off_t offset, uint8_t *buf, size_t size,
+                               void *user)
+{
+    int fd = fileno((FILE *)user);
+    size_t bytes_read = 0;
+
+    while (bytes_read < size) {
+        ssize_t n = pread(fd, &buf[bytes_read], size - bytes_read,
+                          offset + bytes_read);
+
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)
+            return -BPAK_READ_ERROR;
+
+        bytes_read += n;
+    }
+
+    return bytes_read;
+}
+
+/* Parse '<part>:<file>[:<offset>]' into 'loc' and open the file */
+static int installed_open(char *spec, struct bpak_verify_location *loc)
+{
+    char *filename = strchr(spec, ':');
+    char *offset = NULL;
+    char *endptr = NULL;
+
+    if (filename == NULL) {
+        fprintf(stderr, "Error: Expected <part>:<file>, got '%s'\n", spec);
+        return -BPAK_FAILED;
+    }
+
+    *filename++ = '\0';
+    offset = strrchr(filename, ':');
+    loc->offset = 0;
+
+    if (offset != NULL) {
+        unsigned long long value = strtoull(offset + 1, &endptr, 0);
+
+        /* A colon that is not followed by a number is part of the name */
+        if ((offset[1] != '\0') && (*endptr == '\0')) {
+            *offset = '\0';
+            loc->offset = value;
+        }
+    }
+
+    loc->part_id = bpak_get_id_for_name_or_ref(spec);
+    loc->read_payload = installed_pread;
+    loc->user = fopen(filename, "r");
+
+    if (loc->user == NULL) {
+        fprintf(stderr, "Error: Could not open '%s'\n", filename);
+        return -BPAK_FILE_NOT_FOUND;
+    }
+
+    return BPAK_OK;
+}
+
+/* Verify the parts in 'specs' where they are installed against the header
+ * of 'pkg' */
+static int verify_installed(struct bpak_package *pkg, struct bpak_key *key,
+                            char **specs, size_t count, unsigned int jobs)
+{
+    int rc = BPAK_OK;
+    struct bpak_verify_location locations[BPAK_MAX_PARTS];
+    size_t opened = 0;
+
+    for (; opened < count; opened++) {
+        rc = installed_open(specs[opened], &locations[opened]);
+
+        if (rc != BPAK_OK)
+            goto err_close_out;
+    }
+
+    rc = bpak_pkg_verify_installed(pkg, key, locations, count, jobs);
+
+    if (rc != BPAK_OK) {
+        fprintf(stderr,
+                "Verification failed: %i, %s\n",
+                rc,
+                bpak_error_string(rc));
+    } else {
+        printf("Verification OK\n");
+    }
+
+err_close_out:
+    for (size_t i = 0; i < opened; i++)
+        fclose(locations[i].user);
+
+    return rc;
+}
+
 int action_verify(int argc, char **argv)
 {
     int opt;
@@ -124,6 +451,10 @@ int action_verify(int argc, char **argv)
     const char *keystore_path = NULL;
     struct bpak_package pkg;
     struct bpak_key *key = NULL;
+    unsigned int jobs = 1;
+    char *endptr = NULL;
+    char *installed[BPAK_MAX_PARTS];
+    size_t installed_count = 0;
 
     int rc = 0;
 
@@ -132,10 +463,12 @@ int action_verify(int argc, char **argv)
                 { "verbose", no_argument, 0, 'v' },
                 { "key", required_argument, 0, 'k' },
                 { "keystore", required_argument, 0, 'K' },
+                { "jobs", required_argument, 0, 'j' },
+                { "installed", required_argument, 0, 'i' },
                 { 0, 0, 0, 0 },
     };
 
-    while ((opt = getopt_long(argc, argv, "hvk:K:", long_options, &long_index)) !=
+    while ((opt = getopt_long(argc, argv, "hvk:K:j:i:", long_options, &long_index)) !=
            -1) {
         switch (opt) {
         case 'h':
@@ -150,6 +483,22 @@ int action_verify(int argc, char **argv)
         case 'K':
             keystore_path = (const char *)optarg;
             break;
+        case 'j':
+            jobs = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0') {
+                fprintf(stderr, "Error: Invalid number of jobs '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'i':
+            if (installed_count == BPAK_MAX_PARTS) {
+                fprintf(stderr, "Error: Too many installed parts\n");
+                return -1;
+            }
+
+            installed[installed_count++] = optarg;
+            break;
         case '?':
             fprintf(stderr, "Unknown option: %c\n", optopt);
             return -1;
@@ -163,14 +512,32 @@ int action_verify(int argc, char **argv)
         }
     }
 
-    if (optind < argc) {
-        filename = (const char *)argv[optind++];
-    } else {
+    if (optind >= argc) {
         fprintf(stderr, "Missing filename argument\n");
         return -1;
     }
 
-    rc = bpak_pkg_open(&pkg, filename, "r+");
+    if ((key_source == NULL) && (keystore_path == NULL)) {
+        fprintf(stderr, "Either a key file or a keystore must be used to perform verification\n");
+        return -1;
+    }
+
+    if ((installed_count > 0) && (argc - optind > 1)) {
+        fprintf(stderr, "Error: --installed takes one package\n");
+        return -1;
+    }
+
+    if (argc - optind > 1) {
+        return verify_batch(&argv[optind],
+                            argc - optind,
+                            key_source,
+                            keystore_path,
+                            jobs);
+    }
+
+    filename = (const char *)argv[optind++];
+
+    rc = bpak_pkg_open_mmap(&pkg, filename);
 
     if (rc != BPAK_OK) {
         fprintf(stderr, "Error: Could not open package\n");
@@ -183,7 +550,7 @@ int action_verify(int argc, char **argv)
         if (rc != BPAK_OK) {
             goto err_close_pkg_out;
         }
-    } else if (keystore_path != NULL) {
+    } else {
         rc = bpak_keystore_load_key_from_file(keystore_path,
                                               pkg.header.keystore_id,
                                               pkg.header.key_id,
@@ -194,13 +561,15 @@ int action_verify(int argc, char **argv)
         if (rc != BPAK_OK) {
             goto err_close_pkg_out;
         }
-    } else {
-        fprintf(stderr, "Either a key file or a keystore must be used to perform verification\n");
-        rc = -1;
+    }
+
+    if (installed_count > 0) {
+        rc = verify_installed(&pkg, key, installed, installed_count, jobs);
+        free(key);
         goto err_close_pkg_out;
     }
 
-    rc = bpak_pkg_verify(&pkg, key);
+    rc = bpak_pkg_verify_jobs(&pkg, key, jobs);
 
     if (rc != BPAK_OK) {
         fprintf(stderr,
@@ -20,6 +20,370 @@
 
 #include "bpak_tool.h"
 
+/* Parse a byte count with an optional K or M suffix */
+static unsigned long parse_size(const char *str, char **endptr)
+{
+    unsigned long value = strtoul(str, endptr, 0);
+
+    if (**endptr == 'k' || **endptr == 'K') {
+        value *= 1024;
+        (*endptr)++;
+    } else if (**endptr == 'm' || **endptr == 'M') {
+        value *= 1024 * 1024;
+        (*endptr)++;
+    }
+
+    return value;
+}
+
+/* Parse '<none|hs|lzma|zstd|output>=<bytes per second>' into 'select' */
+static int parse_decode_rate(const char *str,
+                             struct bpak_transport_auto *select)
+{
+    static const char *const names[] = {
+        [BPAK_COMPRESSION_NONE] = "none",
+        [BPAK_COMPRESSION_HS] = "hs",
+        [BPAK_COMPRESSION_LZMA] = "lzma",
+        [BPAK_COMPRESSION_ZSTD] = "zstd",
+    };
+    const char *rate = strchr(str, '=');
+    char *endptr = NULL;
+    unsigned long value;
+
+    if (rate == NULL)
+        return -1;
+
+    value = parse_size(rate + 1, &endptr);
+
+    if ((*endptr != '\0') || (value == 0))
+        return -1;
+
+    if (((rate - str) == 6) && (strncmp(str, "output", 6) == 0)) {
+        select->output_rate = value;
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if ((strlen(names[i]) == (size_t)(rate - str)) &&
+            (strncmp(str, names[i], rate - str) == 0)) {
+            select->input_rate[i] = value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Print the statistics of every completed part to stderr, stdout may be
+ * the encoded stream */
+static void transport_progress(const struct bpak_transport_progress *progress,
+                               void *user)
+{
+    const uint64_t *ns = progress->stage_ns;
+    (void)user;
+
+    if (progress->event != BPAK_TRANSPORT_PART_DONE)
+        return;
+
+    fprintf(stderr,
+            "Part 0x%08x: %llu bytes in, %llu bytes out, %llu origin bytes",
+            progress->part_id,
+            (unsigned long long)progress->bytes_in,
+            (unsigned long long)progress->bytes_out,
+            (unsigned long long)progress->origin_bytes);
+
+    if (progress->bytes_unchanged > 0)
+        fprintf(stderr,
+                ", %llu unchanged",
+                (unsigned long long)progress->bytes_unchanged);
+
+    fprintf(stderr,
+            ", %.3f s (codec %.3f s, input %.3f s, output %.3f s, "
+            "origin %.3f s)\n",
+            progress->elapsed_ns / 1e9,
+            ns[BPAK_TRANSPORT_STAGE_CODEC] / 1e9,
+            ns[BPAK_TRANSPORT_STAGE_INPUT] / 1e9,
+            ns[BPAK_TRANSPORT_STAGE_OUTPUT] / 1e9,
+            ns[BPAK_TRANSPORT_STAGE_ORIGIN] / 1e9);
+}
+
+/* Feed the patch on stdin to the stream decoder */
+static int
+transport_decode_stdin(struct bpak_package *output,
+                       struct bpak_package *origin,
+                       const struct bpak_transport_decode_options *options)
+{
+    int rc;
+    struct bpak_pkg_decode_stream stream;
+    uint8_t buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    size_t length;
+
+    rc = bpak_pkg_transport_decode_stream_init(&stream,
+                                               output,
+                                               origin,
+                                               options);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    while ((length = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+        rc = bpak_pkg_transport_decode_stream_write(&stream, buffer, length);
+
+        if (rc != BPAK_OK)
+            goto err_free_out;
+    }
+
+    if (ferror(stdin)) {
+        rc = -BPAK_READ_ERROR;
+        goto err_free_out;
+    }
+
+    rc = bpak_pkg_transport_decode_stream_finish(&stream);
+
+err_free_out:
+    bpak_pkg_transport_decode_stream_free(&stream);
+    return rc;
+}
+
+/* One package of transport_install */
+struct install_package {
+    struct bpak_package input;
+    struct bpak_package output;
+    struct bpak_package origin;
+    bool has_origin;
+    char output_file[256];
+};
+
+static int install_package_open(struct install_package *package,
+                                const char *input_file,
+                                const char *output_file,
+                                const char *origin_file,
+                                bool keep_output)
+{
+    int rc;
+
+    memset(package, 0, sizeof(*package));
+    snprintf(package->output_file,
+             sizeof(package->output_file),
+             "%s",
+             output_file);
+
+    rc = bpak_pkg_open(&package->input, input_file, "rb");
+
+    if (rc != BPAK_OK) {
+        fprintf(stderr, "Error: Could not open package %s\n", input_file);
+        return rc;
+    }
+
+    rc = bpak_pkg_open(&package->output,
+                       output_file,
+                       keep_output ? "rb+" : "wb+");
+
+    if ((rc != BPAK_OK) && keep_output)
+        rc = bpak_pkg_open(&package->output, output_file, "wb+");
+
+    if (rc != BPAK_OK) {
+        fprintf(stderr, "Error: Could not open output file %s\n", output_file);
+        goto err_close_input;
+    }
+
+    if (origin_file != NULL) {
+        rc = bpak_pkg_open(&package->origin, origin_file, "rb");
+
+        if (rc != BPAK_OK) {
+            fprintf(stderr, "Error: Could not open package %s\n", origin_file);
+            goto err_close_output;
+        }
+
+        package->has_origin = true;
+    }
+
+    return BPAK_OK;
+
+err_close_output:
+    bpak_pkg_close(&package->output);
+err_close_input:
+    bpak_pkg_close(&package->input);
+    return rc;
+}
+
+static void install_package_close(struct install_package *package)
+{
+    bpak_pkg_close(&package->input);
+    bpak_pkg_close(&package->output);
+
+    if (package->has_origin)
+        bpak_pkg_close(&package->origin);
+}
+
+/* Decode the packages of 'list_file', '-' for stdin, through one decode
+ * pipeline. A line of the list is '<input.bpak> <output.bpak>
+ * [<origin.bpak>]' and every package gets a line of 'ok <output.bpak>' or
+ * 'error <code> <output.bpak>' on stdout. */
+static int transport_install(const char *list_file,
+                             const struct bpak_transport_decode_options
+                                 *options)
+{
+    int rc = BPAK_OK;
+    FILE *fp = stdin;
+    char *line = NULL;
+    size_t line_size = 0;
+    struct install_package *packages = NULL;
+    struct bpak_pkg_install *installs = NULL;
+    size_t count = 0;
+
+    if (strcmp(list_file, "-") != 0) {
+        fp = fopen(list_file, "r");
+
+        if (fp == NULL) {
+            fprintf(stderr, "Error: Could not open %s\n", list_file);
+            return -BPAK_FILE_NOT_FOUND;
+        }
+    }
+
+    while (getline(&line, &line_size, fp) != -1) {
+        char *save = NULL;
+        const char *input_file = strtok_r(line, " \t\r\n", &save);
+        const char *output_file = strtok_r(NULL, " \t\r\n", &save);
+        const char *origin_file = strtok_r(NULL, " \t\r\n", &save);
+        struct install_package *p;
+
+        if (input_file == NULL)
+            continue;
+
+        if (output_file == NULL) {
+            fprintf(stderr, "Error: No output file for %s\n", input_file);
+            rc = -BPAK_FAILED;
+            break;
+        }
+
+        p = realloc(packages, (count + 1) * sizeof(*packages));
+
+        if (p == NULL) {
+            rc = -BPAK_FAILED;
+            break;
+        }
+
+        packages = p;
+        rc = install_package_open(&packages[count],
+                                  input_file,
+                                  output_file,
+                                  origin_file,
+                                  options->skip_unchanged);
+
+        if (rc != BPAK_OK)
+            break;
+
+        count++;
+    }
+
+    free(line);
+
+    if (fp != stdin)
+        fclose(fp);
+
+    if ((rc == BPAK_OK) && (count > 0)) {
+        installs = calloc(count, sizeof(*installs));
+
+        if (installs == NULL)
+            rc = -BPAK_FAILED;
+    }
+
+    if ((rc == BPAK_OK) && (count > 0)) {
+        for (size_t i = 0; i < count; i++) {
+            installs[i].input = &packages[i].input;
+            installs[i].output = &packages[i].output;
+            installs[i].origin =
+                packages[i].has_origin ? &packages[i].origin : NULL;
+        }
+
+        rc = bpak_pkg_transport_decode_multi(installs, count, options);
+
+        for (size_t i = 0; i < count; i++) {
+            if (installs[i].rc == BPAK_OK)
+                printf("ok %s\n", packages[i].output_file);
+            else
+                printf("error %i %s\n",
+                       installs[i].rc,
+                       packages[i].output_file);
+        }
+
+        fflush(stdout);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        install_package_close(&packages[i]);
+
+    free(installs);
+    free(packages);
+    return rc;
+}
+
+/* Encode the packages of the requests on stdin against 'origin'. A request
+ * is a line of '<input.bpak> <output.bpak>' and gets a line of
+ * 'ok <output.bpak>' or 'error <code> <output.bpak>' back on stdout. The
+ * origin indexes are kept between the requests. */
+static int transport_serve(struct bpak_package *origin,
+                           struct bpak_transport_encode_options *options)
+{
+    int rc;
+    char *line = NULL;
+    size_t line_size = 0;
+    struct bpak_transport_encode_session *session;
+
+    rc = bpak_transport_encode_session_create(&session);
+
+    if (rc != BPAK_OK)
+        return rc;
+
+    options->session = session;
+
+    while (getline(&line, &line_size, stdin) != -1) {
+        char *save = NULL;
+        const char *input_file = strtok_r(line, " \t\r\n", &save);
+        const char *output_file = strtok_r(NULL, " \t\r\n", &save);
+        struct bpak_package input;
+        struct bpak_package output;
+
+        if (input_file == NULL)
+            continue;
+
+        if (output_file == NULL) {
+            printf("error %i %s\n", -BPAK_FAILED, input_file);
+            fflush(stdout);
+            continue;
+        }
+
+        rc = bpak_pkg_open_mmap(&input, input_file);
+
+        if (rc == BPAK_OK) {
+            rc = bpak_pkg_open(&output, output_file, "wb+");
+
+            if (rc == BPAK_OK) {
+                rc = bpak_pkg_transport_encode_opts(&input,
+                                                    &output,
+                                                    origin,
+                                                    options);
+                bpak_pkg_close(&output);
+            }
+
+            bpak_pkg_close(&input);
+        }
+
+        if (rc == BPAK_OK)
+            printf("ok %s\n", output_file);
+        else
+            printf("error %i %s\n", rc, output_file);
+
+        fflush(stdout);
+    }
+
+    free(line);
+    options->session = NULL;
+    bpak_transport_encode_session_free(session);
+    return BPAK_OK;
+}
+
 int action_transport(int argc, char **argv)
 {
     int opt;
@@ -32,8 +396,31 @@ int action_transport(int argc, char **argv)
     bool add_flag = false;
     bool encode_flag = false;
     bool decode_flag = false;
+    bool analyze_flag = false;
+    bool estimate_flag = false;
+    bool serve_flag = false;
+    bool install_flag = false;
     int rc = 0;
     uint32_t part_ref = 0;
+    uint32_t origin_part_refs[BPAK_TRANSPORT_MAX_ORIGIN_PARTS];
+    size_t origin_part_count = 0;
+    char *endptr = NULL;
+    struct bpak_transport_encode_options encode_options;
+    struct bpak_transport_decode_options decode_options;
+    struct bpak_transport_lzma_params lzma_params;
+    bool lzma_params_flag = false;
+    struct bpak_transport_heatshrink_params hs_params;
+    bool hs_params_flag = false;
+    bool bsdiff_copy_flag = false;
+    unsigned long in_place_scratch = 0;
+    unsigned long value;
+
+    memset(&encode_options, 0, sizeof(encode_options));
+    memset(&lzma_params, 0, sizeof(lzma_params));
+    memset(&hs_params, 0, sizeof(hs_params));
+    memset(&decode_options, 0, sizeof(decode_options));
+    /* The tool owns its files, skip the FILE seeks on every write */
+    decode_options.positional_io = true;
 
     struct option long_options[] = {
         { "help", no_argument, 0, 'h' },
@@ -45,15 +432,50 @@ int action_transport(int argc, char **argv)
         { "decoder", required_argument, 0, 'd' },
         { "encode", no_argument, 0, 'E' },
         { "decode", no_argument, 0, 'D' },
+        { "analyze", no_argument, 0, 'A' },
+        { "estimate", no_argument, 0, 'I' },
         { "part-ref", required_argument, 0, 'r' },
+        { "jobs", required_argument, 0, 'j' },
+        { "cache-dir", required_argument, 0, 'C' },
+        { "lzma-preset", required_argument, 0, 'L' },
+        { "lzma-dict-size", required_argument, 0, 'Z' },
+        { "lzma-bcj", required_argument, 0, 'B' },
+        { "lzma-block-size", required_argument, 0, 'S' },
+        { "buffer-size", required_argument, 0, 'b' },
+        { "hs-window", required_argument, 0, 'W' },
+        { "hs-lookahead", required_argument, 0, 'K' },
+        { "output-buffer", required_argument, 0, 'U' },
+        { "direct-io", no_argument, 0, 'X' },
+        { "drop-cache", no_argument, 0, 'P' },
+        { "encode-jobs", required_argument, 0, 'J' },
+        { "decode-threads", required_argument, 0, 'N' },
+        { "memory-budget", required_argument, 0, 'M' },
+        { "bsdiff-copy", no_argument, 0, 'Y' },
+        { "origin-part", required_argument, 0, 'R' },
+        { "progress", no_argument, 0, 'T' },
+        { "serve", no_argument, 0, 'Q' },
+        { "patch-cache-dir", required_argument, 0, 'H' },
+        { "decode-time", required_argument, 0, 'F' },
+        { "decode-heap", required_argument, 0, 'g' },
+        { "decode-rate", required_argument, 0, 'k' },
+        { "seek-cost", required_argument, 0, 'l' },
+        { "write-block", required_argument, 0, 'w' },
+        { "in-place", required_argument, 0, 'i' },
+        { "skip-unchanged", no_argument, 0, 'u' },
+        { "install", no_argument, 0, 'n' },
+        { "verify-origin", no_argument, 0, 'V' },
+        { "huge-pages", required_argument, 0, 'x' },
+        { "populate", no_argument, 0, 'y' },
         { 0, 0, 0, 0 },
     };
 
-    while ((opt = getopt_long(argc,
-                              argv,
-                              "hvao:s:O:e:d:EGr:",
-                              long_options,
-                              &long_index)) != -1) {
+    while ((opt = getopt_long(
+                argc,
+                argv,
+                "hvao:s:O:e:d:EGr:j:C:L:Z:B:S:b:W:K:U:XPJ:N:M:YR:TAIQH:F:g:k:"
+                "l:w:i:unVx:y",
+                long_options,
+                &long_index)) != -1) {
         switch (opt) {
         case 'h':
             print_transport_usage();
@@ -85,6 +507,272 @@ int action_transport(int argc, char **argv)
         case 'D':
             decode_flag = true;
             break;
+        case 'A':
+            analyze_flag = true;
+            break;
+        case 'I':
+            estimate_flag = true;
+            break;
+        case 'j':
+            encode_options.jobs = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0' || encode_options.jobs == 0) {
+                fprintf(stderr, "Error: Invalid number of jobs '%s'\n", optarg);
+                return -1;
+            }
+
+            decode_options.jobs = encode_options.jobs;
+            break;
+        case 'C':
+            encode_options.cache_dir = (const char *)optarg;
+            break;
+        case 'J':
+            encode_options.part_jobs = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0' || encode_options.part_jobs == 0) {
+                fprintf(stderr,
+                        "Error: Invalid number of part jobs '%s'\n",
+                        optarg);
+                return -1;
+            }
+            break;
+        case 'N':
+            decode_options.threads = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0' || decode_options.threads == 0) {
+                fprintf(stderr,
+                        "Error: Invalid number of decode threads '%s'\n",
+                        optarg);
+                return -1;
+            }
+            break;
+        case 'M':
+            value = parse_size(optarg, &endptr);
+
+            if (*endptr != '\0' || value == 0) {
+                fprintf(stderr, "Error: Invalid memory budget '%s'\n", optarg);
+                return -1;
+            }
+
+            encode_options.memory_budget = value;
+            break;
+        case 'F':
+            value = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0' || value == 0) {
+                fprintf(stderr, "Error: Invalid decode time '%s'\n", optarg);
+                return -1;
+            }
+
+            encode_options.auto_select.decode_time_us = value * 1000ULL;
+            break;
+        case 'g':
+            value = parse_size(optarg, &endptr);
+
+            if (*endptr != '\0' || value == 0) {
+                fprintf(stderr, "Error: Invalid decode heap '%s'\n", optarg);
+                return -1;
+            }
+
+            encode_options.auto_select.heap_size = value;
+            break;
+        case 'k':
+            rc = parse_decode_rate(optarg, &encode_options.auto_select);
+
+            if (rc != 0) {
+                fprintf(stderr, "Error: Invalid decode rate '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'l':
+            value = parse_size(optarg, &endptr);
+
+            if (*endptr != '\0') {
+                fprintf(stderr, "Error: Invalid seek cost '%s'\n", optarg);
+                return -1;
+            }
+
+            encode_options.seek_cost = value;
+            break;
+        case 'Y':
+            bsdiff_copy_flag = true;
+            break;
+        case 'x':
+            if (strcmp(optarg, "transparent") == 0) {
+                encode_options.pages = BPAK_BSDIFF_PAGES_TRANSPARENT;
+            } else if (strcmp(optarg, "hugetlb") == 0) {
+                encode_options.pages = BPAK_BSDIFF_PAGES_HUGETLB;
+            } else {
+                fprintf(stderr, "Error: Unknown huge pages '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'y':
+            encode_options.populate = true;
+            break;
+        case 'R':
+            if (origin_part_count >= BPAK_TRANSPORT_MAX_ORIGIN_PARTS) {
+                fprintf(stderr, "Error: Too many origin parts\n");
+                return -1;
+            }
+
+            origin_part_refs[origin_part_count++] =
+                bpak_get_id_for_name_or_ref(optarg);
+            break;
+        case 'L':
+            value = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0' || value > 9) {
+                fprintf(stderr, "Error: Invalid lzma preset '%s'\n", optarg);
+                return -1;
+            }
+
+            lzma_params.preset = value + 1;
+            lzma_params_flag = true;
+            break;
+        case 'Z':
+            value = parse_size(optarg, &endptr);
+
+            if (*endptr != '\0' || value < 4096 || value > UINT32_MAX) {
+                fprintf(stderr,
+                        "Error: Invalid lzma dictionary size '%s'\n",
+                        optarg);
+                return -1;
+            }
+
+            lzma_params.dict_size = value;
+            lzma_params_flag = true;
+            break;
+        case 'B':
+            if (strcmp(optarg, "x86") == 0) {
+                lzma_params.bcj_filter = BPAK_LZMA_BCJ_X86;
+            } else if (strcmp(optarg, "none") == 0) {
+                lzma_params.bcj_filter = BPAK_LZMA_BCJ_NONE;
+            } else if (strcmp(optarg, "arm") == 0) {
+                lzma_params.bcj_filter = BPAK_LZMA_BCJ_ARM;
+            } else if (strcmp(optarg, "armthumb") == 0) {
+                lzma_params.bcj_filter = BPAK_LZMA_BCJ_ARMTHUMB;
+            } else if (strcmp(optarg, "arm64") == 0) {
+                lzma_params.bcj_filter = BPAK_LZMA_BCJ_ARM64;
+            } else {
+                fprintf(stderr, "Error: Unknown BCJ filter '%s'\n", optarg);
+                return -1;
+            }
+
+            lzma_params_flag = true;
+            break;
+        case 'S':
+            value = parse_size(optarg, &endptr);
+
+            if ((*endptr != '\0') || (value & (value - 1)) ||
+                (value < (1UL << BPAK_LZMA_BLOCK_BITS_MIN)) ||
+                (value > (1UL << BPAK_LZMA_BLOCK_BITS_MAX))) {
+                fprintf(stderr,
+                        "Error: Invalid lzma block size '%s'\n",
+                        optarg);
+                return -1;
+            }
+
+            lzma_params.block_bits = __builtin_ctzl(value);
+            lzma_params_flag = true;
+            break;
+        case 'b':
+            value = parse_size(optarg, &endptr);
+
+            if (*endptr != '\0' || value < 2 || value % 2 != 0) {
+                fprintf(stderr, "Error: Invalid buffer size '%s'\n", optarg);
+                return -1;
+            }
+
+            decode_options.buffer_length = value;
+            break;
+        case 'U':
+            value = parse_size(optarg, &endptr);
+
+            if (*endptr != '\0' || value == 0 ||
+                value % BPAK_DECODE_OUTPUT_ALIGN != 0) {
+                fprintf(stderr,
+                        "Error: Invalid output buffer size '%s'\n",
+                        optarg);
+                return -1;
+            }
+
+            decode_options.output_buffer_length = value;
+            break;
+        case 'w':
+            value = parse_size(optarg, &endptr);
+
+            if (*endptr != '\0' || value == 0) {
+                fprintf(stderr, "Error: Invalid write block '%s'\n", optarg);
+                return -1;
+            }
+
+            decode_options.write_block_length = value;
+            break;
+        case 'i':
+            value = parse_size(optarg, &endptr);
+
+            if (*endptr != '\0' || value < 2 || value > UINT32_MAX) {
+                fprintf(stderr,
+                        "Error: Invalid in place scratch size '%s'\n",
+                        optarg);
+                return -1;
+            }
+
+            in_place_scratch = value;
+            decode_options.in_place_scratch = value;
+            break;
+        case 'u':
+            decode_options.skip_unchanged = true;
+            break;
+        case 'n':
+            install_flag = true;
+            break;
+        case 'V':
+            decode_options.verify_origin = true;
+            break;
+        case 'X':
+            decode_options.direct_io = true;
+            break;
+        case 'P':
+            decode_options.drop_cache = true;
+            break;
+        case 'T':
+            encode_options.progress = transport_progress;
+            decode_options.progress = transport_progress;
+            break;
+        case 'Q':
+            serve_flag = true;
+            break;
+        case 'H':
+            encode_options.patch_cache_dir = (const char *)optarg;
+            break;
+        case 'W':
+            value = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0' || value < 4 || value > 15) {
+                fprintf(stderr,
+                        "Error: Invalid heatshrink window '%s'\n",
+                        optarg);
+                return -1;
+            }
+
+            hs_params.window_bits = value;
+            hs_params_flag = true;
+            break;
+        case 'K':
+            value = strtoul(optarg, &endptr, 0);
+
+            if (*endptr != '\0' || value < 3 || value > 14) {
+                fprintf(stderr,
+                        "Error: Invalid heatshrink lookahead '%s'\n",
+                        optarg);
+                return -1;
+            }
+
+            hs_params.lookahead_bits = value;
+            hs_params_flag = true;
+            break;
         case '?':
             fprintf(stderr, "Unknown option: %c\n", optopt);
             return -1;
@@ -105,9 +793,30 @@ int action_transport(int argc, char **argv)
         return -1;
     }
 
-    if (encode_flag + add_flag + decode_flag > 1) {
+    if (encode_flag + add_flag + decode_flag + analyze_flag + estimate_flag +
+            serve_flag + install_flag >
+        1) {
+        fprintf(stderr,
+                "Error: Only one of --add, --encode, --decode, --analyze, "
+                "--estimate, --serve or --install is allowed\n");
+        return -1;
+    }
+
+    /* The replies are the only output on stdout */
+    if (install_flag) {
+        bpak_log_to_stderr();
+        rc = transport_install(filename, &decode_options);
+
+        if (rc != BPAK_OK)
+            fprintf(stderr, "Error: Install failed (%i)\n", rc);
+
+        return rc;
+    }
+
+    /* Both are stored in the same transport meta data field */
+    if (lzma_params_flag && hs_params_flag) {
         fprintf(stderr,
-                "Error: Only one of --add, --encode or --decode is allowed\n");
+                "Error: LZMA and heatshrink options can't be combined\n");
         return -1;
     }
 
@@ -115,15 +824,45 @@ int action_transport(int argc, char **argv)
     struct bpak_package output;
     struct bpak_package origin;
 
-    rc = bpak_pkg_open(&input, filename, "rb+");
+    /* '-o -' streams the encoded package to stdout, messages go to stderr
+     * to keep the stream clean */
+    bool stream_flag = encode_flag && (output_file != NULL) &&
+                       (strcmp(output_file, "-") == 0);
+
+    /* The replies of --serve are the only output on stdout */
+    if (stream_flag || serve_flag)
+        bpak_log_to_stderr();
+
+    /* Decoding '-' reads the patch from stdin as it arrives */
+    bool stdin_flag = decode_flag && (strcmp(filename, "-") == 0);
+
+    /* The encoders read the input and origin packages from a mapping */
+    if (stdin_flag) {
+        memset(&input, 0, sizeof(input));
+        rc = BPAK_OK;
+    } else if (encode_flag || serve_flag)
+        rc = bpak_pkg_open_mmap(&input, filename);
+    else if (analyze_flag || estimate_flag)
+        rc = bpak_pkg_open(&input, filename, "rb");
+    else
+        rc = bpak_pkg_open(&input, filename, "rb+");
 
     if (rc != BPAK_OK) {
         fprintf(stderr, "Error: Could not open package %s\n", filename);
         return rc;
     }
 
+    /* In place the output holds the origin package */
+    bool in_place_flag = decode_flag && (in_place_scratch > 0);
+
+    if (in_place_flag && (origin_file == NULL))
+        origin_file = output_file;
+
     if (origin_file) {
-        rc = bpak_pkg_open(&origin, origin_file, "rb+");
+        if (encode_flag)
+            rc = bpak_pkg_open_mmap(&origin, origin_file);
+        else
+            rc = bpak_pkg_open(&origin, origin_file, "rb+");
 
         if (rc != BPAK_OK) {
             fprintf(stderr, "Error: Could not open package %s\n", origin_file);
@@ -137,8 +876,17 @@ int action_transport(int argc, char **argv)
         goto err_out;
     }
 
-    if (encode_flag || decode_flag) {
-        rc = bpak_pkg_open(&output, output_file, "wb+");
+    /* Unchanged blocks are compared with an existing output package */
+    bool keep_output = in_place_flag ||
+                       (decode_flag && decode_options.skip_unchanged);
+
+    if ((encode_flag || decode_flag) && !stream_flag) {
+        rc = bpak_pkg_open(&output,
+                           output_file,
+                           keep_output ? "rb+" : "wb+");
+
+        if ((rc != BPAK_OK) && keep_output && !in_place_flag)
+            rc = bpak_pkg_open(&output, output_file, "wb+");
 
         if (rc != BPAK_OK) {
             fprintf(stderr,
@@ -148,14 +896,50 @@ int action_transport(int argc, char **argv)
         }
     }
 
-    if (encode_flag) {
-        rc = bpak_pkg_transport_encode(&input, &output, &origin);
+    if (stream_flag) {
+        rc = bpak_pkg_transport_encode_stream(&input,
+                                              stdout,
+                                              origin_file ? &origin : NULL,
+                                              &encode_options);
+
+        if ((rc == BPAK_OK) && (fflush(stdout) != 0))
+            rc = -BPAK_WRITE_ERROR;
+    } else if (encode_flag) {
+        rc = bpak_pkg_transport_encode_opts(&input,
+                                            &output,
+                                            origin_file ? &origin : NULL,
+                                            &encode_options);
+    } else if (stdin_flag) {
+        rc = transport_decode_stdin(&output,
+                                    origin_file ? &origin : NULL,
+                                    &decode_options);
     } else if (decode_flag) {
-        rc = bpak_pkg_transport_decode(
+        rc = bpak_pkg_transport_decode_opts(
             &input, /* Input package or 'patch' */
             &output,
-            &origin); /* Origin data to use for patch operation*/
-    } else if (add_flag && encoder_alg && decoder_alg) {
+            origin_file ? &origin : NULL, /* Origin data for patching */
+            &decode_options);
+    } else if (serve_flag) {
+        rc = transport_serve(&input, &encode_options);
+    } else if (analyze_flag) {
+        rc = transport_analyze(&input, part_ref);
+    } else if (estimate_flag) {
+        rc = transport_estimate(&input);
+    } else if (add_flag && encoder_alg &&
+               (decoder_alg || (bpak_id(encoder_alg) == BPAK_ID_AUTO))) {
+        /* The encoder picks the decoder of an 'auto' part */
+        if (decoder_alg == NULL)
+            decoder_alg = encoder_alg;
+
+        if ((bpak_id(encoder_alg) == BPAK_ID_AUTO) &&
+            (lzma_params_flag || hs_params_flag)) {
+            fprintf(stderr,
+                    "Error: The auto encoder uses the default compressor "
+                    "parameters\n");
+            rc = -BPAK_NOT_SUPPORTED;
+            goto err_out;
+        }
+
         rc = bpak_add_transport_meta(&input.header,
                                      part_ref,
                                      bpak_id(encoder_alg),
@@ -166,6 +950,58 @@ int action_transport(int argc, char **argv)
             goto err_out;
         }
 
+        if (lzma_params_flag || hs_params_flag || bsdiff_copy_flag) {
+            struct bpak_meta_header *meta = NULL;
+
+            rc = bpak_get_meta(&input.header,
+                               BPAK_ID_BPAK_TRANSPORT,
+                               part_ref,
+                               &meta);
+
+            if (rc != BPAK_OK)
+                goto err_out;
+
+            struct bpak_transport_meta *tm =
+                bpak_get_meta_ptr(&input.header,
+                                  meta,
+                                  struct bpak_transport_meta);
+            if (lzma_params_flag)
+                memcpy(tm->data, &lzma_params, sizeof(lzma_params));
+            else if (hs_params_flag)
+                memcpy(tm->data, &hs_params, sizeof(hs_params));
+
+            if (bsdiff_copy_flag) {
+                tm->data[BPAK_BSDIFF_REVISION_OFFSET] =
+                    BPAK_BSDIFF_REVISION_COPY;
+            }
+        }
+
+        if (origin_part_count == 1) {
+            rc = bpak_set_transport_origin(&input.header,
+                                           part_ref,
+                                           origin_part_refs[0]);
+
+            if (rc != BPAK_OK)
+                goto err_out;
+        } else if (origin_part_count > 1) {
+            rc = bpak_set_transport_origin_parts(&input.header,
+                                                 part_ref,
+                                                 origin_part_refs,
+                                                 origin_part_count);
+
+            if (rc != BPAK_OK)
+                goto err_out;
+        }
+
+        if (in_place_scratch > 0) {
+            rc = bpak_set_transport_in_place(&input.header,
+                                             part_ref,
+                                             in_place_scratch);
+
+            if (rc != BPAK_OK)
+                goto err_out;
+        }
+
         rc = bpak_pkg_write_header(&input);
     } else {
         rc = -BPAK_FAILED;
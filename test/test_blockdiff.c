@@ -0,0 +1,147 @@
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/blockdiff.h>
+#include <bpak/blockpatch.h>
+#include "nala.h"
+
+#define BLOCK BPAK_BLOCKDIFF_BLOCK_SIZE
+#define ORIGIN_LEN (64 * BLOCK)
+#define TARGET_LEN (70 * BLOCK + 123)
+
+static uint8_t origin_data[ORIGIN_LEN];
+static uint8_t new_data[TARGET_LEN];
+static uint8_t patch_data[2 * TARGET_LEN];
+static uint8_t output_data[TARGET_LEN];
+static size_t patch_length;
+
+static ssize_t write_patch(off_t offset, uint8_t *buffer, size_t length,
+                           void *user_priv)
+{
+    (void)user_priv;
+    memcpy(&patch_data[offset], buffer, length);
+    if ((offset + length) > patch_length)
+        patch_length = offset + length;
+    return length;
+}
+
+static ssize_t read_origin(off_t offset, uint8_t *buffer, size_t length,
+                           void *user_priv)
+{
+    (void)user_priv;
+
+    if ((offset + length) > ORIGIN_LEN)
+        return -BPAK_READ_ERROR;
+
+    memcpy(buffer, &origin_data[offset], length);
+    return length;
+}
+
+static ssize_t write_output(off_t offset, uint8_t *buffer, size_t length,
+                            void *user_priv)
+{
+    (void)user_priv;
+
+    if ((offset + length) > TARGET_LEN)
+        return -BPAK_WRITE_ERROR;
+
+    memcpy(&output_data[offset], buffer, length);
+    return length;
+}
+
+/**
+ * Shuffle origin blocks around in the target, add some new blocks and a
+ * partial tail. Encode and decode the patch in small chunks.
+ */
+TEST(blockdiff_moved_blocks)
+{
+    int rc;
+    uint32_t seed = 1;
+    uint8_t work_buffer[1024];
+    struct bpak_blockpatch_context blockpatch;
+
+    for (unsigned int i = 0; i < ORIGIN_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        origin_data[i] = seed >> 16;
+    }
+
+    for (unsigned int i = 0; i < 70; i++) {
+        uint8_t *block = &new_data[i * BLOCK];
+
+        if (i < 32)
+            memcpy(block, &origin_data[(63 - i) * BLOCK], BLOCK);
+        else if (i < 40)
+            memset(block, i, BLOCK);
+        else
+            memcpy(block, &origin_data[(i - 40) * BLOCK], BLOCK);
+    }
+
+    /* Modify one byte in an otherwise moved block */
+    new_data[50 * BLOCK + 17] ^= 0xff;
+    memset(&new_data[70 * BLOCK], 0x5a, 123);
+
+    patch_length = 0;
+    ssize_t length = bpak_blockdiff(origin_data,
+                                    ORIGIN_LEN,
+                                    new_data,
+                                    TARGET_LEN,
+                                    write_patch,
+                                    0,
+                                    NULL);
+    ASSERT(length > 0);
+    ASSERT_EQ((size_t)length, patch_length);
+
+    /* The 61 moved blocks are not part of the patch */
+    ASSERT(patch_length < (10 * BLOCK + 123 + 10 * BPAK_BLOCKDIFF_OP_LENGTH));
+
+    rc = bpak_blockpatch_init(&blockpatch,
+                              work_buffer,
+                              sizeof(work_buffer),
+                              read_origin,
+                              0,
+                              write_output,
+                              0,
+                              NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    for (size_t pos = 0; pos < patch_length; pos += 7) {
+        rc = bpak_blockpatch_write(&blockpatch,
+                                   &patch_data[pos],
+                                   BPAK_MIN(7, patch_length - pos));
+        ASSERT_EQ(rc, BPAK_OK);
+    }
+
+    ASSERT_EQ(bpak_blockpatch_final(&blockpatch), TARGET_LEN);
+    ASSERT_MEMORY(output_data, new_data, TARGET_LEN);
+}
+
+TEST(blockpatch_truncated_input)
+{
+    int rc;
+    uint8_t work_buffer[1024];
+    struct bpak_blockpatch_context blockpatch;
+
+    memcpy(new_data, origin_data, TARGET_LEN / 2);
+    patch_length = 0;
+
+    ASSERT(bpak_blockdiff(origin_data,
+                          ORIGIN_LEN,
+                          new_data,
+                          TARGET_LEN,
+                          write_patch,
+                          0,
+                          NULL) > 0);
+
+    rc = bpak_blockpatch_init(&blockpatch,
+                              work_buffer,
+                              sizeof(work_buffer),
+                              read_origin,
+                              0,
+                              write_output,
+                              0,
+                              NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_blockpatch_write(&blockpatch, patch_data, patch_length - 1);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_blockpatch_final(&blockpatch), -BPAK_SIZE_ERROR);
+}
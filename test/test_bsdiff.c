@@ -195,3 +195,1486 @@ TEST(diff_patch_no_comp)
     free(new_data);
     free(origin_data);
 }
+
+/**
+ * Apply a heatshrink compressed patch with mapped origin and output
+ * buffers instead of i/o callbacks.
+ */
+TEST(diff_patch_mapped)
+{
+    int rc;
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+    uint8_t patch_buffer[32 * 1024];
+    uint8_t output[DIFF_PATCH_NO_COMP_LEN];
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init(&bsdiff,
+                          origin_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          new_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          write_patch_output,
+                          0,
+                          BPAK_COMPRESSION_HS,
+                          (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    rc = bpak_bspatch_init_mapped(&bspatch,
+                                  decode_buffer,
+                                  sizeof(decode_buffer),
+                                  patch_length,
+                                  origin_data,
+                                  DIFF_PATCH_NO_COMP_LEN,
+                                  output,
+                                  sizeof(output),
+                                  BPAK_COMPRESSION_HS);
+    ASSERT_EQ(rc, 0);
+
+    for (size_t pos = 0; pos < patch_length; pos += 100) {
+        rc = bpak_bspatch_write(&bspatch,
+                                &patch_buffer[pos],
+                                BPAK_MIN(100, patch_length - pos));
+        ASSERT_EQ(rc, 0);
+    }
+
+    ssize_t output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_NO_COMP_LEN);
+
+    bpak_bspatch_free(&bspatch);
+
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_NO_COMP_LEN);
+
+    /* An output that is too small must fail instead of overflowing */
+    rc = bpak_bspatch_init_mapped(&bspatch,
+                                  decode_buffer,
+                                  sizeof(decode_buffer),
+                                  patch_length,
+                                  origin_data,
+                                  DIFF_PATCH_NO_COMP_LEN,
+                                  output,
+                                  DIFF_PATCH_NO_COMP_LEN / 2,
+                                  BPAK_COMPRESSION_HS);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, patch_length);
+    ASSERT_EQ(rc, -BPAK_PATCH_WRITE_ERROR);
+
+    bpak_bspatch_free(&bspatch);
+
+    free(new_data);
+    free(origin_data);
+}
+
+static size_t prefetch_origin_length;
+static size_t read_origin_length;
+static off_t prefetch_origin_end;
+
+static void prefetch_origin(off_t offset, size_t length, void *user_priv)
+{
+    (void)user_priv;
+    printf("Prefetch origin %li %zu\n", offset, length);
+    prefetch_origin_length += length;
+    prefetch_origin_end = offset + length;
+}
+
+static ssize_t read_origin_prefetched(off_t offset, uint8_t *buffer,
+                                      size_t length, void *user_priv)
+{
+    /* Every read must be covered by the latest prefetch hint */
+    ASSERT((off_t)(offset + length) <= prefetch_origin_end);
+    read_origin_length += length;
+    return read_origin(offset, buffer, length, user_priv);
+}
+
+/**
+ * The prefetch hook is called with the origin range of each control
+ * block before any of it is read.
+ */
+TEST(diff_patch_prefetch)
+{
+    int rc;
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+    uint8_t patch_buffer[32 * 1024];
+    uint8_t output[DIFF_PATCH_NO_COMP_LEN];
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+
+    patch_length = 0;
+    prefetch_origin_length = 0;
+    read_origin_length = 0;
+    prefetch_origin_end = 0;
+
+    rc = bpak_bsdiff_init(&bsdiff,
+                          origin_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          new_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          write_patch_output,
+                          0,
+                          BPAK_COMPRESSION_NONE,
+                          (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_NO_COMP_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_NO_COMP_LEN;
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin_prefetched,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_NONE,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_set_prefetch(&bspatch, prefetch_origin);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, patch_length);
+    ASSERT_EQ(rc, 0);
+
+    ssize_t output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_NO_COMP_LEN);
+
+    bpak_bspatch_free(&bspatch);
+
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_NO_COMP_LEN);
+    ASSERT(prefetch_origin_length > 0);
+    ASSERT_EQ(prefetch_origin_length, read_origin_length);
+
+    free(new_data);
+    free(origin_data);
+}
+
+/**
+ * Save the bspatch state halfway through a heatshrink patch, restore it
+ * into a fresh context and finish the patch from there.
+ */
+TEST(diff_patch_checkpoint)
+{
+    int rc;
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+    uint8_t patch_buffer[32 * 1024];
+    uint8_t output[DIFF_PATCH_NO_COMP_LEN];
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    struct bpak_bspatch_checkpoint checkpoint;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    size_t pos;
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init(&bsdiff,
+                          origin_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          new_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          write_patch_output,
+                          0,
+                          BPAK_COMPRESSION_HS,
+                          (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    memset(output, 0, sizeof(output));
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_NO_COMP_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_NO_COMP_LEN;
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_HS,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    for (pos = 0; pos < patch_length / 2; pos += 100) {
+        rc = bpak_bspatch_write(&bspatch,
+                                &patch_buffer[pos],
+                                BPAK_MIN(100, patch_length - pos));
+        ASSERT_EQ(rc, 0);
+    }
+
+    rc = bpak_bspatch_save(&bspatch, &checkpoint);
+    ASSERT_EQ(rc, 0);
+    bpak_bspatch_free(&bspatch);
+
+    /* Resume in a new context, as after a reboot */
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_HS,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_restore(&bspatch, &checkpoint);
+    ASSERT_EQ(rc, 0);
+
+    for (; pos < patch_length; pos += 100) {
+        rc = bpak_bspatch_write(&bspatch,
+                                &patch_buffer[pos],
+                                BPAK_MIN(100, patch_length - pos));
+        ASSERT_EQ(rc, 0);
+    }
+
+    ssize_t output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_NO_COMP_LEN);
+
+    bpak_bspatch_free(&bspatch);
+
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_NO_COMP_LEN);
+
+    /* The LZMA decoder state can not be saved */
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_LZMA,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(bpak_bspatch_save(&bspatch, &checkpoint), -BPAK_NOT_SUPPORTED);
+    bpak_bspatch_free(&bspatch);
+
+    free(new_data);
+    free(origin_data);
+}
+
+/**
+ * Split the target into segments that are diffed by several threads and
+ * verify that the stitched patch stream applies with the normal bspatch.
+ */
+
+#define DIFF_PATCH_PARALLEL_LEN (4 * 1024 * 1024)
+
+TEST(diff_patch_parallel)
+{
+    int rc;
+    uint8_t *origin_data = malloc(DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *new_data = malloc(DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *patch_buffer = malloc(2 * DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *output = malloc(DIFF_PATCH_PARALLEL_LEN);
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    struct bpak_bsdiff_options options = {
+        .jobs = 4,
+    };
+
+    uint32_t seed = 1;
+
+    ASSERT(origin_data != NULL);
+    ASSERT(new_data != NULL);
+    ASSERT(patch_buffer != NULL);
+    ASSERT(output != NULL);
+
+    /* Non repeating origin data keeps the suffix search fast */
+    for (unsigned int i = 0; i < DIFF_PATCH_PARALLEL_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        origin_data[i] = seed >> 16;
+    }
+
+    memcpy(new_data, origin_data, DIFF_PATCH_PARALLEL_LEN);
+
+    /* Changes around and across the segment boundaries */
+    memset(&new_data[1024 * 1024 - 100], 0xaa, 200);
+    memcpy(&new_data[2 * 1024 * 1024 + 17], "HELLO SEGMENT", 13);
+    memmove(&new_data[3 * 1024 * 1024 - 4096],
+            &new_data[3 * 1024 * 1024],
+            8192);
+    memset(&new_data[DIFF_PATCH_PARALLEL_LEN - 10], 0x55, 10);
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init_opts(&bsdiff,
+                               origin_data,
+                               DIFF_PATCH_PARALLEL_LEN,
+                               new_data,
+                               DIFF_PATCH_PARALLEL_LEN,
+                               write_patch_output,
+                               0,
+                               BPAK_COMPRESSION_NONE,
+                               &options,
+                               (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    printf("Applying patch, length = %zu\n", patch_length);
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_PARALLEL_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_PARALLEL_LEN;
+
+    memset(output, 0, DIFF_PATCH_PARALLEL_LEN);
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_NONE,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, patch_length);
+    ASSERT_EQ(rc, 0);
+
+    ssize_t output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_PARALLEL_LEN);
+
+    bpak_bspatch_free(&bspatch);
+
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_PARALLEL_LEN);
+
+    free(output);
+    free(patch_buffer);
+    free(new_data);
+    free(origin_data);
+}
+
+/**
+ * Diff a target, that has the two halves of the origin swapped, against
+ * origin windows that are much smaller than the origin. Every segment
+ * must find its window, so the patch stays small.
+ */
+
+#define DIFF_PATCH_WINDOW_LEN (6 * 1024 * 1024)
+
+TEST(diff_patch_windowed)
+{
+    int rc;
+    const size_t half = DIFF_PATCH_WINDOW_LEN / 2;
+    uint8_t *origin_data = malloc(DIFF_PATCH_WINDOW_LEN);
+    uint8_t *new_data = malloc(DIFF_PATCH_WINDOW_LEN);
+    uint8_t *patch_buffer = malloc(2 * DIFF_PATCH_WINDOW_LEN);
+    uint8_t *output = malloc(DIFF_PATCH_WINDOW_LEN);
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    struct bpak_bsdiff_options options = {
+        .window_size = BPAK_BSDIFF_MIN_WINDOW_SIZE,
+    };
+    uint32_t seed = 1;
+
+    ASSERT(origin_data != NULL);
+    ASSERT(new_data != NULL);
+    ASSERT(patch_buffer != NULL);
+    ASSERT(output != NULL);
+
+    for (unsigned int i = 0; i < DIFF_PATCH_WINDOW_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        origin_data[i] = seed >> 16;
+    }
+
+    memcpy(new_data, &origin_data[half], half);
+    memcpy(&new_data[half], origin_data, half);
+    memcpy(&new_data[100000], "HELLO WINDOW", 12);
+    memset(&new_data[half + 4096], 0xaa, 1000);
+
+    /* The budget decides if windows are needed at all */
+    ASSERT_EQ(bpak_bsdiff_window_size(DIFF_PATCH_WINDOW_LEN,
+                                      4 * DIFF_PATCH_WINDOW_LEN),
+              0);
+    ASSERT(bpak_bsdiff_window_size(DIFF_PATCH_WINDOW_LEN,
+                                   DIFF_PATCH_WINDOW_LEN) >=
+           BPAK_BSDIFF_MIN_WINDOW_SIZE);
+    ASSERT(bpak_bsdiff_window_size(DIFF_PATCH_WINDOW_LEN,
+                                   DIFF_PATCH_WINDOW_LEN) <
+           DIFF_PATCH_WINDOW_LEN);
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init_opts(&bsdiff,
+                               origin_data,
+                               DIFF_PATCH_WINDOW_LEN,
+                               new_data,
+                               DIFF_PATCH_WINDOW_LEN,
+                               write_patch_output,
+                               0,
+                               BPAK_COMPRESSION_NONE,
+                               &options,
+                               (void *)patch_buffer);
+    ASSERT_EQ(rc, 0);
+    ASSERT(bsdiff.suffix_array == NULL);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    /* Data that is found in the window becomes zero diff bytes, data that
+     * is not is random extra data */
+    size_t nonzero = 0;
+
+    for (size_t i = 0; i < patch_length; i++)
+        nonzero += (patch_buffer[i] != 0);
+
+    ASSERT(nonzero < DIFF_PATCH_WINDOW_LEN / 16);
+
+    printf("Applying patch, length = %zu\n", patch_length);
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_WINDOW_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_WINDOW_LEN;
+
+    memset(output, 0, DIFF_PATCH_WINDOW_LEN);
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_NONE,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, patch_length);
+    ASSERT_EQ(rc, 0);
+
+    ssize_t output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_WINDOW_LEN);
+
+    bpak_bspatch_free(&bspatch);
+
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_WINDOW_LEN);
+
+    free(output);
+    free(patch_buffer);
+    free(new_data);
+    free(origin_data);
+}
+
+/**
+ * Diff twice with a suffix array cache. The first run creates the cache and
+ * the second maps it, both runs must produce the same patch.
+ */
+
+#define DIFF_PATCH_SA_CACHE_FN "test_bsdiff_sa_cache.sa"
+
+static size_t diff_with_cache(uint8_t *origin_data, uint8_t *new_data,
+                              uint8_t *patch_buffer)
+{
+    int rc;
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bsdiff_options options = {
+        .cache_filename = DIFF_PATCH_SA_CACHE_FN,
+    };
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init_opts(&bsdiff,
+                               origin_data,
+                               DIFF_PATCH_NO_COMP_LEN,
+                               new_data,
+                               DIFF_PATCH_NO_COMP_LEN,
+                               write_patch_output,
+                               0,
+                               BPAK_COMPRESSION_NONE,
+                               &options,
+                               (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    return patch_length;
+}
+
+TEST(diff_patch_sa_cache)
+{
+    struct stat statbuf;
+    uint8_t patch1[32 * 1024];
+    uint8_t patch2[32 * 1024];
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+
+    unlink(DIFF_PATCH_SA_CACHE_FN);
+
+    size_t patch1_length = diff_with_cache(origin_data, new_data, patch1);
+    ASSERT_EQ(stat(DIFF_PATCH_SA_CACHE_FN, &statbuf), 0);
+
+    size_t patch2_length = diff_with_cache(origin_data, new_data, patch2);
+
+    ASSERT_EQ(patch1_length, patch2_length);
+    ASSERT_MEMORY(patch1, patch2, patch1_length);
+
+    /* An entry past the end of the origin makes the cache rebuilt */
+    FILE *fp = fopen(DIFF_PATCH_SA_CACHE_FN, "r+b");
+    uint32_t entry = 0xfffffff0;
+
+    ASSERT(fp != NULL);
+    ASSERT_EQ(fseek(fp, 64 + 100 * sizeof(entry), SEEK_SET), 0);
+    ASSERT_EQ(fwrite(&entry, sizeof(entry), 1, fp), 1);
+    fclose(fp);
+
+    memset(patch2, 0, sizeof(patch2));
+    patch2_length = diff_with_cache(origin_data, new_data, patch2);
+
+    ASSERT_EQ(patch1_length, patch2_length);
+    ASSERT_MEMORY(patch1, patch2, patch1_length);
+
+    fp = fopen(DIFF_PATCH_SA_CACHE_FN, "rb");
+    ASSERT(fp != NULL);
+    ASSERT_EQ(fseek(fp, 64 + 100 * sizeof(entry), SEEK_SET), 0);
+    ASSERT_EQ(fread(&entry, sizeof(entry), 1, fp), 1);
+    fclose(fp);
+    ASSERT(entry < DIFF_PATCH_NO_COMP_LEN);
+
+    unlink(DIFF_PATCH_SA_CACHE_FN);
+    free(new_data);
+    free(origin_data);
+}
+
+/**
+ * Diff two targets against one prepared origin index, with one and with
+ * several jobs. The patches must be the same as with a suffix array of
+ * their own, and the index must be left as it was.
+ */
+TEST(diff_patch_shared_origin)
+{
+    int rc;
+    struct bpak_bsdiff_origin origin;
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bsdiff_options options = {
+        .jobs = 2,
+    };
+    uint8_t patch1[32 * 1024];
+    uint8_t patch2[32 * 1024];
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+    uint8_t *targets[] = { new_data, origin_data };
+
+    rc = bpak_bsdiff_origin_init(&origin,
+                                 origin_data,
+                                 DIFF_PATCH_NO_COMP_LEN,
+                                 NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    for (unsigned int i = 0; i < 4; i++) {
+        uint8_t *target = targets[i % 2];
+        size_t patch1_length;
+
+        patch_length = 0;
+        rc = bpak_bsdiff_init_opts(&bsdiff,
+                                   origin_data,
+                                   DIFF_PATCH_NO_COMP_LEN,
+                                   target,
+                                   DIFF_PATCH_NO_COMP_LEN,
+                                   write_patch_output,
+                                   0,
+                                   BPAK_COMPRESSION_NONE,
+                                   (i < 2) ? NULL : &options,
+                                   (void *)patch1);
+        ASSERT_EQ(rc, BPAK_OK);
+        ASSERT(bpak_bsdiff(&bsdiff) > 0);
+        bpak_bsdiff_free(&bsdiff);
+        patch1_length = patch_length;
+
+        patch_length = 0;
+        rc = bpak_bsdiff_init_origin(&bsdiff,
+                                     &origin,
+                                     target,
+                                     DIFF_PATCH_NO_COMP_LEN,
+                                     write_patch_output,
+                                     0,
+                                     BPAK_COMPRESSION_NONE,
+                                     (i < 2) ? NULL : &options,
+                                     (void *)patch2);
+        ASSERT_EQ(rc, BPAK_OK);
+        ASSERT(bpak_bsdiff(&bsdiff) > 0);
+        bpak_bsdiff_free(&bsdiff);
+
+        ASSERT(origin.suffix_array != NULL);
+        ASSERT_EQ(patch_length, patch1_length);
+        ASSERT_MEMORY(patch1, patch2, patch_length);
+    }
+
+    bpak_bsdiff_origin_free(&origin);
+    ASSERT(origin.suffix_array == NULL);
+    free(new_data);
+    free(origin_data);
+}
+
+/**
+ * Diff with the suffix array in huge page mappings. HUGETLB falls back to
+ * transparent huge pages without a reserved pool, the patches must be the
+ * same as with bpak_calloc.
+ */
+TEST(diff_patch_huge_pages)
+{
+    int rc;
+    struct bpak_bsdiff_origin origin;
+    struct bpak_bsdiff_context bsdiff;
+    uint8_t patch1[32 * 1024];
+    uint8_t patch2[32 * 1024];
+    size_t patch1_length;
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+    enum bpak_bsdiff_pages pages[] = {
+        BPAK_BSDIFF_PAGES_TRANSPARENT,
+        BPAK_BSDIFF_PAGES_HUGETLB,
+    };
+
+    patch1_length = diff_with_cache(origin_data, new_data, patch1);
+    unlink(DIFF_PATCH_SA_CACHE_FN);
+
+    for (unsigned int i = 0; i < 2; i++) {
+        struct bpak_bsdiff_options options = {
+            .pages = pages[i],
+        };
+
+        patch_length = 0;
+        rc = bpak_bsdiff_init_opts(&bsdiff,
+                                   origin_data,
+                                   DIFF_PATCH_NO_COMP_LEN,
+                                   new_data,
+                                   DIFF_PATCH_NO_COMP_LEN,
+                                   write_patch_output,
+                                   0,
+                                   BPAK_COMPRESSION_NONE,
+                                   &options,
+                                   (void *)patch2);
+        ASSERT_EQ(rc, BPAK_OK);
+
+        /* Mapped in whole huge pages */
+        ASSERT(bsdiff.suffix_array_mem_size >= BPAK_BSDIFF_HUGE_PAGE_SIZE);
+        ASSERT_EQ(bsdiff.suffix_array_mem_size % BPAK_BSDIFF_HUGE_PAGE_SIZE,
+                  0);
+
+        ASSERT(bpak_bsdiff(&bsdiff) > 0);
+        bpak_bsdiff_free(&bsdiff);
+        ASSERT_EQ(bsdiff.suffix_array_mem_size, 0);
+
+        ASSERT_EQ(patch_length, patch1_length);
+        ASSERT_MEMORY(patch1, patch2, patch_length);
+
+        /* A shared origin index keeps its mapping until it is freed */
+        rc = bpak_bsdiff_origin_init_opts(&origin,
+                                          origin_data,
+                                          DIFF_PATCH_NO_COMP_LEN,
+                                          &options);
+        ASSERT_EQ(rc, BPAK_OK);
+        ASSERT(origin.suffix_array_mem_size > 0);
+
+        patch_length = 0;
+        rc = bpak_bsdiff_init_origin(&bsdiff,
+                                     &origin,
+                                     new_data,
+                                     DIFF_PATCH_NO_COMP_LEN,
+                                     write_patch_output,
+                                     0,
+                                     BPAK_COMPRESSION_NONE,
+                                     NULL,
+                                     (void *)patch2);
+        ASSERT_EQ(rc, BPAK_OK);
+        ASSERT(bpak_bsdiff(&bsdiff) > 0);
+        bpak_bsdiff_free(&bsdiff);
+
+        ASSERT_EQ(patch_length, patch1_length);
+        ASSERT_MEMORY(patch1, patch2, patch_length);
+        bpak_bsdiff_origin_free(&origin);
+    }
+
+    free(new_data);
+    free(origin_data);
+}
+
+/**
+ * Patch streams with origin copy tuples. The unchanged runs are copied
+ * instead of being added as zero diff bytes, so the uncompressed patch is
+ * smaller. Applied through i/o callbacks and mapped buffers, and diffed
+ * in parallel segments.
+ */
+
+static size_t diff_with_revision(uint8_t *origin_data, uint8_t *new_data,
+                                 size_t length, unsigned int jobs,
+                                 enum bpak_bsdiff_revision revision,
+                                 uint8_t *patch_buffer)
+{
+    int rc;
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bsdiff_options options = {
+        .jobs = jobs,
+        .revision = revision,
+    };
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init_opts(&bsdiff,
+                               origin_data,
+                               length,
+                               new_data,
+                               length,
+                               write_patch_output,
+                               0,
+                               BPAK_COMPRESSION_NONE,
+                               &options,
+                               (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    return patch_length;
+}
+
+TEST(diff_patch_copy)
+{
+    int rc;
+    uint8_t *origin_data = malloc(DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *new_data = malloc(DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *patch_buffer = malloc(2 * DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *output = malloc(DIFF_PATCH_PARALLEL_LEN);
+    struct bpak_bspatch_context bspatch;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    uint32_t seed = 1;
+    size_t length;
+    ssize_t output_length;
+
+    ASSERT(origin_data != NULL);
+    ASSERT(new_data != NULL);
+    ASSERT(patch_buffer != NULL);
+    ASSERT(output != NULL);
+
+    for (unsigned int i = 0; i < DIFF_PATCH_PARALLEL_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        origin_data[i] = seed >> 16;
+    }
+
+    memcpy(new_data, origin_data, DIFF_PATCH_PARALLEL_LEN);
+
+    /* Scattered small changes keep the diff tuples long */
+    for (unsigned int i = 1000; i < DIFF_PATCH_PARALLEL_LEN; i += 100000)
+        new_data[i] ^= 0x5a;
+
+    memcpy(&new_data[2 * 1024 * 1024 + 17], "HELLO COPY", 10);
+    memmove(&new_data[3 * 1024 * 1024 - 4096],
+            &new_data[3 * 1024 * 1024],
+            8192);
+
+    size_t original_length = diff_with_revision(origin_data,
+                                                new_data,
+                                                DIFF_PATCH_PARALLEL_LEN,
+                                                1,
+                                                BPAK_BSDIFF_REVISION_ORIGINAL,
+                                                patch_buffer);
+
+    length = diff_with_revision(origin_data,
+                                new_data,
+                                DIFF_PATCH_PARALLEL_LEN,
+                                1,
+                                BPAK_BSDIFF_REVISION_COPY,
+                                patch_buffer);
+
+    printf("Patch length %zu, with copies %zu\n", original_length, length);
+    ASSERT_LT(length, original_length / 100);
+
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_PARALLEL_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_PARALLEL_LEN;
+    memset(output, 0, DIFF_PATCH_PARALLEL_LEN);
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_NONE,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    for (size_t pos = 0; pos < length; pos += 100) {
+        rc = bpak_bspatch_write(&bspatch,
+                                &patch_buffer[pos],
+                                BPAK_MIN(100, length - pos));
+        ASSERT_EQ(rc, 0);
+    }
+
+    output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_PARALLEL_LEN);
+    bpak_bspatch_free(&bspatch);
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_PARALLEL_LEN);
+
+    memset(output, 0, DIFF_PATCH_PARALLEL_LEN);
+
+    rc = bpak_bspatch_init_mapped(&bspatch,
+                                  decode_buffer,
+                                  sizeof(decode_buffer),
+                                  length,
+                                  origin_data,
+                                  DIFF_PATCH_PARALLEL_LEN,
+                                  output,
+                                  DIFF_PATCH_PARALLEL_LEN,
+                                  BPAK_COMPRESSION_NONE);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, length);
+    ASSERT_EQ(rc, 0);
+
+    output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_PARALLEL_LEN);
+    bpak_bspatch_free(&bspatch);
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_PARALLEL_LEN);
+
+    /* Segments are stitched by their last tuple, which can be a copy */
+    length = diff_with_revision(origin_data,
+                                new_data,
+                                DIFF_PATCH_PARALLEL_LEN,
+                                4,
+                                BPAK_BSDIFF_REVISION_COPY,
+                                patch_buffer);
+
+    memset(output, 0, DIFF_PATCH_PARALLEL_LEN);
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_NONE,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, length);
+    ASSERT_EQ(rc, 0);
+
+    output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_PARALLEL_LEN);
+    bpak_bspatch_free(&bspatch);
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_PARALLEL_LEN);
+
+    free(output);
+    free(patch_buffer);
+    free(new_data);
+    free(origin_data);
+}
+
+static size_t diff_with_seek_cost(uint8_t *origin_data, uint8_t *new_data,
+                                  size_t length, unsigned int jobs,
+                                  size_t seek_cost, uint8_t *patch_buffer,
+                                  uint64_t *seeks)
+{
+    int rc;
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bsdiff_options options = {
+        .jobs = jobs,
+        .seek_cost = seek_cost,
+    };
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init_opts(&bsdiff,
+                               origin_data,
+                               length,
+                               new_data,
+                               length,
+                               write_patch_output,
+                               0,
+                               BPAK_COMPRESSION_NONE,
+                               &options,
+                               (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    *seeks = bsdiff.origin_seeks;
+    ASSERT(bsdiff.origin_backward_seeks <= bsdiff.origin_seeks);
+    bpak_bsdiff_free(&bsdiff);
+
+    return patch_length;
+}
+
+/**
+ * Short pieces of the target that are found far away in the origin are
+ * diffed against the current origin position when seeks are expensive
+ */
+TEST(diff_patch_seek_cost)
+{
+    int rc;
+    uint8_t *origin_data = malloc(DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *new_data = malloc(DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *patch_buffer = malloc(2 * DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *output = malloc(DIFF_PATCH_PARALLEL_LEN);
+    struct bpak_bspatch_context bspatch;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    uint32_t seed = 1;
+    uint64_t seeks;
+    uint64_t local_seeks;
+    size_t length;
+    size_t local_length;
+
+    ASSERT(origin_data != NULL);
+    ASSERT(new_data != NULL);
+    ASSERT(patch_buffer != NULL);
+    ASSERT(output != NULL);
+
+    for (unsigned int i = 0; i < DIFF_PATCH_PARALLEL_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        origin_data[i] = seed >> 16;
+    }
+
+    memcpy(new_data, origin_data, DIFF_PATCH_PARALLEL_LEN);
+
+    /* 300 bytes from the other half of the origin every 64 KiB */
+    for (unsigned int i = 1000; i < DIFF_PATCH_PARALLEL_LEN - 300;
+         i += 64 * 1024) {
+        memcpy(&new_data[i],
+               &origin_data[(i + DIFF_PATCH_PARALLEL_LEN / 2) %
+                            DIFF_PATCH_PARALLEL_LEN],
+               300);
+    }
+
+    length = diff_with_seek_cost(origin_data,
+                                 new_data,
+                                 DIFF_PATCH_PARALLEL_LEN,
+                                 1,
+                                 0,
+                                 patch_buffer,
+                                 &seeks);
+
+    local_length = diff_with_seek_cost(origin_data,
+                                       new_data,
+                                       DIFF_PATCH_PARALLEL_LEN,
+                                       1,
+                                       4096,
+                                       patch_buffer,
+                                       &local_seeks);
+
+    printf("Seeks %llu, patch length %zu, with seek cost %llu, %zu\n",
+           (unsigned long long)seeks,
+           length,
+           (unsigned long long)local_seeks,
+           local_length);
+    ASSERT(seeks >= 64);
+    ASSERT_LT(local_seeks, seeks / 8);
+    ASSERT_LT(local_length, length + 64 * 300 * 2);
+
+    memset(output, 0, DIFF_PATCH_PARALLEL_LEN);
+
+    rc = bpak_bspatch_init_mapped(&bspatch,
+                                  decode_buffer,
+                                  sizeof(decode_buffer),
+                                  local_length,
+                                  origin_data,
+                                  DIFF_PATCH_PARALLEL_LEN,
+                                  output,
+                                  DIFF_PATCH_PARALLEL_LEN,
+                                  BPAK_COMPRESSION_NONE);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, local_length);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(bpak_bspatch_final(&bspatch), DIFF_PATCH_PARALLEL_LEN);
+    bpak_bspatch_free(&bspatch);
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_PARALLEL_LEN);
+
+    /* The segments of a parallel diff use the seek cost as well */
+    diff_with_seek_cost(origin_data,
+                        new_data,
+                        DIFF_PATCH_PARALLEL_LEN,
+                        4,
+                        4096,
+                        patch_buffer,
+                        &local_seeks);
+    ASSERT_LT(local_seeks, seeks / 8);
+
+    free(output);
+    free(patch_buffer);
+    free(new_data);
+    free(origin_data);
+}
+
+#define IN_PLACE_SCRATCH (64 * 1024)
+#define IN_PLACE_SHIFT 1000
+
+static off_t in_place_output_end;
+static off_t in_place_max_lag;
+
+static ssize_t read_origin_in_place(off_t offset, uint8_t *buffer,
+                                    size_t length, void *user_priv)
+{
+    struct bspatch_priv *priv = (struct bspatch_priv *)user_priv;
+
+    if (in_place_output_end - offset > in_place_max_lag)
+        in_place_max_lag = in_place_output_end - offset;
+
+    memcpy(buffer, &priv->origin_data[offset], length);
+    return length;
+}
+
+static ssize_t write_output_in_place(off_t offset, uint8_t *buffer,
+                                     size_t length, void *user_priv)
+{
+    struct bspatch_priv *priv = (struct bspatch_priv *)user_priv;
+
+    ASSERT_EQ(offset, in_place_output_end);
+    memcpy(&priv->output_data[offset], buffer, length);
+    in_place_output_end = offset + length;
+    return length;
+}
+
+/**
+ * An in place diff never reads the origin more than half the scratch size
+ * behind the output position. Pieces of the target that are only found
+ * further back are diffed against the current offset instead.
+ */
+TEST(diff_patch_in_place)
+{
+    int rc;
+    uint8_t *origin_data = malloc(DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *new_data = malloc(DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *patch_buffer = malloc(2 * DIFF_PATCH_PARALLEL_LEN);
+    uint8_t *output = malloc(DIFF_PATCH_PARALLEL_LEN);
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    uint32_t seed = 1;
+    struct bpak_bsdiff_options options = {
+        .jobs = 4, /* An in place diff runs on one thread */
+        .in_place_scratch = IN_PLACE_SCRATCH,
+    };
+
+    ASSERT(origin_data != NULL);
+    ASSERT(new_data != NULL);
+    ASSERT(patch_buffer != NULL);
+    ASSERT(output != NULL);
+
+    for (unsigned int i = 0; i < DIFF_PATCH_PARALLEL_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        origin_data[i] = seed >> 16;
+    }
+
+    /* The origin moved back by a little, with pieces of the first half of
+     * the origin every 64 KiB in the second half */
+    memset(new_data, 0xa5, IN_PLACE_SHIFT);
+    memcpy(&new_data[IN_PLACE_SHIFT],
+           origin_data,
+           DIFF_PATCH_PARALLEL_LEN - IN_PLACE_SHIFT);
+
+    for (unsigned int i = DIFF_PATCH_PARALLEL_LEN / 2 + 1000;
+         i < DIFF_PATCH_PARALLEL_LEN - 300;
+         i += 64 * 1024) {
+        memcpy(&new_data[i],
+               &origin_data[i - DIFF_PATCH_PARALLEL_LEN / 2],
+               300);
+    }
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init_opts(&bsdiff,
+                               origin_data,
+                               DIFF_PATCH_PARALLEL_LEN,
+                               new_data,
+                               DIFF_PATCH_PARALLEL_LEN,
+                               write_patch_output,
+                               0,
+                               BPAK_COMPRESSION_NONE,
+                               &options,
+                               (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+    bpak_bsdiff_free(&bsdiff);
+
+    printf("In place patch length %zu\n", patch_length);
+
+    /* The shifted origin is still diffed, only the far pieces are extra */
+    ASSERT_LT(patch_length,
+              DIFF_PATCH_PARALLEL_LEN + IN_PLACE_SHIFT + 32 * 300 * 2);
+
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_PARALLEL_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_PARALLEL_LEN;
+    in_place_output_end = 0;
+    in_place_max_lag = 0;
+    memset(output, 0, DIFF_PATCH_PARALLEL_LEN);
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           sizeof(decode_buffer),
+                           patch_length,
+                           read_origin_in_place,
+                           0,
+                           write_output_in_place,
+                           0,
+                           BPAK_COMPRESSION_NONE,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, patch_length);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(bpak_bspatch_final(&bspatch), DIFF_PATCH_PARALLEL_LEN);
+    bpak_bspatch_free(&bspatch);
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_PARALLEL_LEN);
+
+    printf("Largest origin read lag %lld\n", (long long)in_place_max_lag);
+    ASSERT(in_place_max_lag >= IN_PLACE_SHIFT);
+    ASSERT(in_place_max_lag <= IN_PLACE_SCRATCH / 2);
+
+    /* Origin windows can't be diffed in place */
+    options.jobs = 1;
+    options.window_size = DIFF_PATCH_PARALLEL_LEN / 4;
+
+    rc = bpak_bsdiff_init_opts(&bsdiff,
+                               origin_data,
+                               DIFF_PATCH_PARALLEL_LEN,
+                               new_data,
+                               DIFF_PATCH_PARALLEL_LEN,
+                               write_patch_output,
+                               0,
+                               BPAK_COMPRESSION_NONE,
+                               &options,
+                               (void *)patch_buffer);
+    ASSERT_EQ(rc, -BPAK_NOT_SUPPORTED);
+
+    free(output);
+    free(patch_buffer);
+    free(new_data);
+    free(origin_data);
+}
+
+#if BPAK_CONFIG_ZSTD == 1
+/**
+ * zstd compressed patch, fed to bspatch in small chunks
+ */
+TEST(diff_patch_zstd)
+{
+    int rc;
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+    uint8_t patch_buffer[32 * 1024];
+    uint8_t output[DIFF_PATCH_NO_COMP_LEN];
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init(&bsdiff,
+                          origin_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          new_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          write_patch_output,
+                          0,
+                          BPAK_COMPRESSION_ZSTD,
+                          (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    printf("Applying patch, length = %zu\n", patch_length);
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_NO_COMP_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_NO_COMP_LEN;
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_ZSTD,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+
+    for (size_t pos = 0; pos < patch_length; pos += 100) {
+        rc = bpak_bspatch_write(&bspatch,
+                                &patch_buffer[pos],
+                                BPAK_MIN(100, patch_length - pos));
+        ASSERT_EQ(rc, 0);
+    }
+
+    ssize_t output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_NO_COMP_LEN);
+
+    bpak_bspatch_free(&bspatch);
+
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_NO_COMP_LEN);
+
+    free(new_data);
+    free(origin_data);
+}
+#endif
+
+/**
+ * Decode an LZMA patch with the decoder state in an arena that is sized by
+ * bpak_bspatch_heap_size, and refuse the patch with an arena that is too
+ * small for the dictionary.
+ */
+TEST(diff_patch_arena)
+{
+    int rc;
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+    uint8_t patch_buffer[32 * 1024];
+    uint8_t output[DIFF_PATCH_NO_COMP_LEN];
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+    struct bpak_arena arena;
+    struct bpak_allocator allocator;
+    size_t heap_size;
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init(&bsdiff,
+                          origin_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          new_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          write_patch_output,
+                          0,
+                          BPAK_COMPRESSION_LZMA,
+                          (void *)patch_buffer);
+    ASSERT(rc == 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    bpak_bsdiff_free(&bsdiff);
+
+    ASSERT_EQ(bpak_bspatch_heap_size(BPAK_COMPRESSION_HS, 0, &heap_size),
+              BPAK_OK);
+    ASSERT_EQ(heap_size, 0);
+    ASSERT_EQ(bpak_bspatch_heap_size(BPAK_COMPRESSION_LZMA, 0, &heap_size),
+              BPAK_OK);
+    ASSERT(heap_size > 8 * 1024 * 1024);
+
+    uint8_t *heap = malloc(heap_size);
+    ASSERT(heap != NULL);
+    ASSERT_EQ(bpak_arena_init(&arena, heap, heap_size), BPAK_OK);
+    bpak_arena_allocator(&arena, &allocator);
+
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_NO_COMP_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_NO_COMP_LEN;
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_LZMA,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(bpak_bspatch_set_allocator(&bspatch, &allocator), BPAK_OK);
+
+    for (size_t pos = 0; pos < patch_length; pos += 100) {
+        rc = bpak_bspatch_write(&bspatch,
+                                &patch_buffer[pos],
+                                BPAK_MIN(100, patch_length - pos));
+        ASSERT_EQ(rc, 0);
+    }
+
+    /* The allocator can't be changed once the stream is started */
+    ASSERT_EQ(bpak_bspatch_set_allocator(&bspatch, NULL), -BPAK_FAILED);
+
+    ssize_t output_length = bpak_bspatch_final(&bspatch);
+    ASSERT_EQ(output_length, DIFF_PATCH_NO_COMP_LEN);
+
+    bpak_bspatch_free(&bspatch);
+
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_NO_COMP_LEN);
+    printf("Arena peak %zu of %zu\n", arena.peak, heap_size);
+    ASSERT(arena.peak > 8 * 1024 * 1024);
+    ASSERT(arena.peak <= heap_size);
+    ASSERT_EQ(arena.count, 0);
+    ASSERT_EQ(arena.used, 0);
+
+    /* The dictionary does not fit, the stream fails without output */
+    ASSERT_EQ(bpak_arena_init(&arena, heap, 1024 * 1024), BPAK_OK);
+
+    rc = bpak_bspatch_init(&bspatch,
+                           decode_buffer,
+                           BPAK_CHUNK_BUFFER_LENGTH,
+                           patch_length,
+                           read_origin,
+                           0,
+                           write_output,
+                           0,
+                           BPAK_COMPRESSION_LZMA,
+                           &priv);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(bpak_bspatch_set_allocator(&bspatch, &allocator), BPAK_OK);
+
+    rc = bpak_bspatch_write(&bspatch, patch_buffer, patch_length);
+    ASSERT(rc < 0);
+    ASSERT_EQ(bspatch.output_position, 0);
+
+    bpak_bspatch_free(&bspatch);
+    ASSERT_EQ(arena.count, 0);
+
+    free(heap);
+    free(new_data);
+    free(origin_data);
+}
+
+/**
+ * The profiling counters of bsdiff and bspatch account for every byte of
+ * the target, or are not supported without BPAK_STATS.
+ */
+TEST(diff_patch_stats)
+{
+    int rc;
+    uint8_t *origin_data = create_origin_data(DIFF_PATCH_NO_COMP_LEN);
+    uint8_t *new_data = create_new_data(DIFF_PATCH_NO_COMP_LEN, origin_data);
+    uint8_t patch_buffer[32 * 1024];
+    uint8_t output[DIFF_PATCH_NO_COMP_LEN];
+    struct bpak_bsdiff_context bsdiff;
+    struct bpak_bspatch_context bspatch;
+    struct bpak_bsdiff_stats diff_stats;
+    struct bpak_bspatch_stats patch_stats;
+    struct bspatch_priv priv;
+    uint8_t decode_buffer[BPAK_CHUNK_BUFFER_LENGTH];
+
+    patch_length = 0;
+
+    rc = bpak_bsdiff_init(&bsdiff,
+                          origin_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          new_data,
+                          DIFF_PATCH_NO_COMP_LEN,
+                          write_patch_output,
+                          0,
+                          BPAK_COMPRESSION_NONE,
+                          (void *)patch_buffer);
+    ASSERT_EQ(rc, 0);
+
+    rc = bpak_bsdiff(&bsdiff);
+    ASSERT(rc > 0);
+
+    rc = bpak_bsdiff_get_stats(&bsdiff, &diff_stats);
+    bpak_bsdiff_free(&bsdiff);
+
+    priv.origin_data = origin_data;
+    priv.origin_length = DIFF_PATCH_NO_COMP_LEN;
+    priv.output_data = output;
+    priv.output_length = DIFF_PATCH_NO_COMP_LEN;
+
+    ASSERT_EQ(bpak_bspatch_init(&bspatch,
+                                decode_buffer,
+                                BPAK_CHUNK_BUFFER_LENGTH,
+                                patch_length,
+                                read_origin,
+                                0,
+                                write_output,
+                                0,
+                                BPAK_COMPRESSION_NONE,
+                                &priv),
+              0);
+    ASSERT_EQ(bpak_bspatch_write(&bspatch, patch_buffer, patch_length), 0);
+    ASSERT_EQ(bpak_bspatch_final(&bspatch), DIFF_PATCH_NO_COMP_LEN);
+    ASSERT_MEMORY(output, new_data, DIFF_PATCH_NO_COMP_LEN);
+
+#if BPAK_CONFIG_STATS == 1
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT(diff_stats.ctrl_blocks > 0);
+    ASSERT(diff_stats.searches > 0);
+    ASSERT_EQ(diff_stats.diff_bytes + diff_stats.extra_bytes +
+                  diff_stats.copy_bytes,
+              DIFF_PATCH_NO_COMP_LEN);
+    ASSERT(diff_stats.write_output_calls > 0);
+    ASSERT(diff_stats.search_ns <= diff_stats.scan_ns);
+
+    ASSERT_EQ(bpak_bspatch_get_stats(&bspatch, &patch_stats), BPAK_OK);
+    ASSERT_EQ(patch_stats.ctrl_blocks, diff_stats.ctrl_blocks);
+    ASSERT_EQ(patch_stats.diff_bytes, diff_stats.diff_bytes);
+    ASSERT_EQ(patch_stats.extra_bytes, diff_stats.extra_bytes);
+    ASSERT(patch_stats.read_origin_calls > 0);
+    ASSERT(patch_stats.write_output_calls > 0);
+    ASSERT(patch_stats.patch_ns <= patch_stats.total_ns);
+#else
+    ASSERT_EQ(rc, -BPAK_NOT_SUPPORTED);
+    ASSERT_EQ(bpak_bspatch_get_stats(&bspatch, &patch_stats),
+              -BPAK_NOT_SUPPORTED);
+    (void)diff_stats;
+#endif
+
+    bpak_bspatch_free(&bspatch);
+    free(new_data);
+    free(origin_data);
+}
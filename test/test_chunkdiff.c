@@ -0,0 +1,301 @@
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/chunkdiff.h>
+#include <bpak/chunkpatch.h>
+#include "nala.h"
+
+#define ORIGIN_LEN (1024 * 1024)
+#define INSERT_LEN 100
+#define ZERO_LEN (256 * 1024)
+#define TARGET_LEN (ORIGIN_LEN + INSERT_LEN + ZERO_LEN)
+
+static uint8_t origin_data[ORIGIN_LEN];
+static uint8_t new_data[TARGET_LEN];
+static uint8_t patch_data[2 * TARGET_LEN];
+static uint8_t output_data[TARGET_LEN];
+static size_t patch_length;
+
+static ssize_t write_patch(off_t offset, uint8_t *buffer, size_t length,
+                           void *user_priv)
+{
+    (void)user_priv;
+    memcpy(&patch_data[offset], buffer, length);
+    if ((offset + length) > patch_length)
+        patch_length = offset + length;
+    return length;
+}
+
+static ssize_t read_origin(off_t offset, uint8_t *buffer, size_t length,
+                           void *user_priv)
+{
+    (void)user_priv;
+
+    if ((offset + length) > ORIGIN_LEN)
+        return -BPAK_READ_ERROR;
+
+    memcpy(buffer, &origin_data[offset], length);
+    return length;
+}
+
+static ssize_t write_output(off_t offset, uint8_t *buffer, size_t length,
+                            void *user_priv)
+{
+    (void)user_priv;
+
+    if ((offset + length) > TARGET_LEN)
+        return -BPAK_WRITE_ERROR;
+
+    memcpy(&output_data[offset], buffer, length);
+    return length;
+}
+
+static ssize_t read_output(off_t offset, uint8_t *buffer, size_t length,
+                           void *user_priv)
+{
+    (void)user_priv;
+
+    if ((offset + length) > TARGET_LEN)
+        return -BPAK_READ_ERROR;
+
+    memcpy(buffer, &output_data[offset], length);
+    return length;
+}
+
+/* Target: the origin with bytes inserted at 300 KiB, one byte changed at
+ * 700 KiB and a zero padded tail */
+static void make_data(void)
+{
+    uint32_t seed = 1;
+
+    for (unsigned int i = 0; i < ORIGIN_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        origin_data[i] = seed >> 16;
+    }
+
+    memcpy(new_data, origin_data, 300 * 1024);
+    memset(&new_data[300 * 1024], 0xa5, INSERT_LEN);
+    memcpy(&new_data[300 * 1024 + INSERT_LEN],
+           &origin_data[300 * 1024],
+           ORIGIN_LEN - 300 * 1024);
+    new_data[700 * 1024] ^= 0xff;
+    memset(&new_data[ORIGIN_LEN + INSERT_LEN], 0, ZERO_LEN);
+
+    memset(output_data, 0, sizeof(output_data));
+    patch_length = 0;
+
+    ssize_t length = bpak_chunkdiff(new_data,
+                                    TARGET_LEN,
+                                    write_patch,
+                                    0,
+                                    NULL);
+    ASSERT(length > 0);
+    ASSERT_EQ((size_t)length, patch_length);
+}
+
+TEST(chunkdiff_stream)
+{
+    int rc;
+    uint8_t work_buffer[1024];
+    struct bpak_chunkpatch_context chunkpatch;
+
+    make_data();
+
+    /* Repeated chunks of the zero tail are only stored once */
+    ASSERT(patch_length < (TARGET_LEN - BPAK_CHUNKDIFF_MAX_SIZE));
+
+    rc = bpak_chunkpatch_init(&chunkpatch,
+                              work_buffer,
+                              sizeof(work_buffer),
+                              patch_length,
+                              read_origin,
+                              0,
+                              ORIGIN_LEN,
+                              write_output,
+                              read_output,
+                              0,
+                              NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    for (size_t pos = 0; pos < patch_length; pos += 777) {
+        rc = bpak_chunkpatch_write(&chunkpatch,
+                                   &patch_data[pos],
+                                   BPAK_MIN(777, patch_length - pos));
+        ASSERT_EQ(rc, BPAK_OK);
+    }
+
+    ASSERT_EQ(bpak_chunkpatch_final(&chunkpatch), TARGET_LEN);
+    ASSERT_MEMORY(output_data, new_data, TARGET_LEN);
+
+    /* Only the chunks around the two changes come from the store */
+    ASSERT(chunkpatch.origin_chunk_bytes >
+           (ORIGIN_LEN - 8 * BPAK_CHUNKDIFF_MAX_SIZE));
+    ASSERT(chunkpatch.store_bytes < 8 * BPAK_CHUNKDIFF_MAX_SIZE);
+    bpak_chunkpatch_free(&chunkpatch);
+}
+
+TEST(chunkdiff_ranges)
+{
+    int rc;
+    uint8_t work_buffer[4096];
+    struct bpak_chunkpatch_context chunkpatch;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t last_end = 0;
+    size_t fetched = 0;
+
+    make_data();
+
+    rc = bpak_chunkpatch_init(&chunkpatch,
+                              work_buffer,
+                              sizeof(work_buffer),
+                              patch_length,
+                              read_origin,
+                              0,
+                              ORIGIN_LEN,
+                              write_output,
+                              read_output,
+                              0,
+                              NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    /* Fetch only the ranges that the decoder asks for */
+    while (true) {
+        rc = bpak_chunkpatch_next_input(&chunkpatch, &offset, &length);
+        ASSERT_EQ(rc, BPAK_OK);
+
+        if (length == 0)
+            break;
+
+        ASSERT(offset >= last_end);
+        ASSERT(offset + length <= patch_length);
+
+        rc = bpak_chunkpatch_write(&chunkpatch, &patch_data[offset], length);
+        ASSERT_EQ(rc, BPAK_OK);
+
+        fetched += length;
+        last_end = offset + length;
+    }
+
+    ASSERT_EQ(bpak_chunkpatch_final(&chunkpatch), TARGET_LEN);
+    ASSERT_MEMORY(output_data, new_data, TARGET_LEN);
+    ASSERT(fetched < patch_length / 4);
+    bpak_chunkpatch_free(&chunkpatch);
+}
+
+TEST(chunkdiff_no_origin)
+{
+    int rc;
+    uint8_t work_buffer[1024];
+    struct bpak_chunkpatch_context chunkpatch;
+
+    make_data();
+
+    rc = bpak_chunkpatch_init(&chunkpatch,
+                              work_buffer,
+                              sizeof(work_buffer),
+                              patch_length,
+                              NULL,
+                              0,
+                              0,
+                              write_output,
+                              read_output,
+                              0,
+                              NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_chunkpatch_write(&chunkpatch, patch_data, patch_length);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_chunkpatch_final(&chunkpatch), TARGET_LEN);
+    ASSERT_MEMORY(output_data, new_data, TARGET_LEN);
+    ASSERT_EQ(chunkpatch.origin_chunk_bytes, 0);
+    bpak_chunkpatch_free(&chunkpatch);
+}
+
+TEST(chunkpatch_arena)
+{
+    int rc;
+    uint8_t work_buffer[1024];
+    static uint8_t arena_buffer[64 * 1024];
+    struct bpak_arena arena;
+    struct bpak_allocator allocator;
+    struct bpak_chunkpatch_context chunkpatch;
+    uint32_t count;
+
+    make_data();
+    count = patch_data[4] | (patch_data[5] << 8) | (patch_data[6] << 16) |
+            ((uint32_t)patch_data[7] << 24);
+
+    ASSERT_EQ(bpak_arena_init(&arena, arena_buffer, sizeof(arena_buffer)),
+              BPAK_OK);
+    bpak_arena_allocator(&arena, &allocator);
+
+    rc = bpak_chunkpatch_init(&chunkpatch,
+                              work_buffer,
+                              sizeof(work_buffer),
+                              patch_length,
+                              read_origin,
+                              0,
+                              ORIGIN_LEN,
+                              write_output,
+                              read_output,
+                              0,
+                              NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_chunkpatch_set_allocator(&chunkpatch, &allocator),
+              BPAK_OK);
+
+    rc = bpak_chunkpatch_write(&chunkpatch, patch_data, patch_length);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_chunkpatch_final(&chunkpatch), TARGET_LEN);
+    ASSERT_MEMORY(output_data, new_data, TARGET_LEN);
+    bpak_chunkpatch_free(&chunkpatch);
+
+    ASSERT(arena.peak <= bpak_chunkpatch_heap_size(count));
+    ASSERT_EQ(arena.used, 0);
+}
+
+TEST(chunkpatch_truncated_input)
+{
+    int rc;
+    uint8_t work_buffer[1024];
+    struct bpak_chunkpatch_context chunkpatch;
+
+    make_data();
+
+    rc = bpak_chunkpatch_init(&chunkpatch,
+                              work_buffer,
+                              sizeof(work_buffer),
+                              patch_length,
+                              NULL,
+                              0,
+                              0,
+                              write_output,
+                              read_output,
+                              0,
+                              NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_chunkpatch_write(&chunkpatch, patch_data, patch_length - 1);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_chunkpatch_final(&chunkpatch), -BPAK_SIZE_ERROR);
+    bpak_chunkpatch_free(&chunkpatch);
+
+    /* A corrupt magic is found before anything is written */
+    patch_data[0] ^= 0xff;
+
+    rc = bpak_chunkpatch_init(&chunkpatch,
+                              work_buffer,
+                              sizeof(work_buffer),
+                              patch_length,
+                              NULL,
+                              0,
+                              0,
+                              write_output,
+                              read_output,
+                              0,
+                              NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_chunkpatch_write(&chunkpatch, patch_data, patch_length);
+    ASSERT_EQ(rc, -BPAK_BAD_MAGIC);
+    bpak_chunkpatch_free(&chunkpatch);
+}
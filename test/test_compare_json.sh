@@ -0,0 +1,92 @@
+#!/bin/bash
+# Test: test_compare_json
+#
+# Description: Show and compare packages with JSON output, with and
+#  without part digests.
+#
+# Purpose: To ensure that the JSON output is valid, that compare trusts
+#  matching part digests unless --data is given and that --first fails
+#  at the first difference.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_compare_json
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex -o pipefail
+
+$BPAK --version
+
+IMG_A=${TEST_NAME}_a.bpak
+IMG_B=${TEST_NAME}_b.bpak
+IMG_C=${TEST_NAME}_c.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_data.bin 64
+cp ${TEST_NAME}_data.bin ${TEST_NAME}_data2.bin
+printf 'X' | dd of=${TEST_NAME}_data2.bin bs=1 seek=1000 conv=notrunc
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+    $BPAK add $1 --part fs --from-file ${TEST_NAME}_data.bin $V
+    $BPAK add $1 --part data --from-file $2 $V
+    $BPAK set $1 --key-id pb-development --keystore-id pb-internal $V
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $3 $V
+}
+
+json_get()
+{
+    python3 -c "import json, sys; print(eval('json.load(sys.stdin)' + \"$1\"))"
+}
+
+create_package $IMG_A ${TEST_NAME}_data.bin --part-digests
+create_package $IMG_B ${TEST_NAME}_data2.bin --part-digests
+
+$BPAK show $IMG_A --json $V > ${TEST_NAME}_show.json
+cat ${TEST_NAME}_show.json
+test $(json_get "['parts'][1]['size']" < ${TEST_NAME}_show.json) -eq 65536
+test $(json_get "['payload_hash_valid']" < ${TEST_NAME}_show.json) = True
+json_get "['meta']" < ${TEST_NAME}_show.json | grep part-digest
+
+# Identical packages
+$BPAK compare $IMG_A $IMG_A --json --first > ${TEST_NAME}_same.json
+test $(json_get "['identical']" < ${TEST_NAME}_same.json) = True
+
+# Only the second part differs, the signatures differ as well
+$BPAK compare $IMG_A $IMG_B --json $V > ${TEST_NAME}_diff.json
+cat ${TEST_NAME}_diff.json
+test $(json_get "['identical']" < ${TEST_NAME}_diff.json) = False
+test $(json_get "['parts'][0]['status']" < ${TEST_NAME}_diff.json) = equal
+test $(json_get "['parts'][1]['status']" < ${TEST_NAME}_diff.json) = changed
+
+if $BPAK compare $IMG_A $IMG_B --first; then
+    exit 1
+fi
+
+# Corrupt the second part after signing, the part digests still match
+cp $IMG_A $IMG_C
+printf 'X' | dd of=$IMG_C bs=1 seek=$(( $(stat -c %s $IMG_C) - 100 )) \
+                conv=notrunc
+
+$BPAK compare $IMG_A $IMG_C --json > ${TEST_NAME}_digest.json
+test $(json_get "['identical']" < ${TEST_NAME}_digest.json) = True
+
+$BPAK compare $IMG_A $IMG_C --json --data > ${TEST_NAME}_data.json
+test $(json_get "['parts'][1]['status']" < ${TEST_NAME}_data.json) = changed
+
+# Without part digests the data is compared
+create_package $IMG_A ${TEST_NAME}_data.bin
+cp $IMG_A $IMG_C
+printf 'X' | dd of=$IMG_C bs=1 seek=$(( $(stat -c %s $IMG_C) - 100 )) \
+                conv=notrunc
+$BPAK compare $IMG_A $IMG_C --json > ${TEST_NAME}_nodigest.json
+test $(json_get "['parts'][1]['status']" < ${TEST_NAME}_nodigest.json) = \
+    changed
+
+echo $TEST_NAME End
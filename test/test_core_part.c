@@ -151,3 +151,70 @@ TEST(delete_last_part)
     bpak_del_part(&h, p);
     ASSERT_EQ(p->id, 0);
 }
+
+TEST(header_index)
+{
+    struct bpak_header h;
+    struct bpak_header_index index;
+    struct bpak_part_header *p = NULL;
+    struct bpak_part_header *out = NULL;
+    struct bpak_part_header *expected = NULL;
+    struct bpak_meta_header *meta = NULL;
+    struct bpak_meta_header *expected_meta = NULL;
+    int rc;
+
+    rc = bpak_init_header(&h);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    /* Add parts in reverse id order so the index has to sort them */
+    for (int i = 0; i < BPAK_MAX_PARTS; i++) {
+        rc = bpak_add_part(&h, bpak_id("test-part") + BPAK_MAX_PARTS - i,
+                           &p);
+        ASSERT_EQ(rc, BPAK_OK);
+        p->size = 4096 * (i + 1);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        rc = bpak_add_meta(&h, bpak_id("meta"), bpak_id("test-part") + 8 - i,
+                           sizeof(uint32_t), &meta);
+        ASSERT_EQ(rc, BPAK_OK);
+    }
+
+    rc = bpak_header_index_init(&index, &h);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    for (int i = 0; i <= BPAK_MAX_PARTS + 1; i++) {
+        bpak_id_t id = bpak_id("test-part") + i;
+        int expected_rc = bpak_get_part(&h, id, &expected);
+
+        rc = bpak_header_index_get_part(&index, id, &out);
+        ASSERT_EQ(rc, expected_rc);
+
+        if (rc == BPAK_OK) {
+            ASSERT_EQ(out, expected);
+            ASSERT_EQ(bpak_header_index_part_offset(&index, out),
+                      bpak_part_offset(&h, out));
+        }
+    }
+
+    for (int i = 0; i <= 9; i++) {
+        bpak_id_t ref = bpak_id("test-part") + i;
+        int expected_rc = bpak_get_meta(&h, bpak_id("meta"), ref,
+                                        &expected_meta);
+
+        rc = bpak_header_index_get_meta(&index, bpak_id("meta"), ref, &meta);
+        ASSERT_EQ(rc, expected_rc);
+
+        if (rc == BPAK_OK)
+            ASSERT_EQ(meta, expected_meta);
+    }
+
+    rc = bpak_get_meta_anyref(&h, bpak_id("meta"), &expected_meta);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_header_index_get_meta_anyref(&index, bpak_id("meta"), &meta);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(meta, expected_meta);
+
+    rc = bpak_header_index_get_meta_anyref(&index, bpak_id("missing"), &meta);
+    ASSERT_EQ(rc, -BPAK_NOT_FOUND);
+}
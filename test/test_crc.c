@@ -0,0 +1,97 @@
+#include <string.h>
+#include <stdlib.h>
+#include <bpak/bpak.h>
+#include <bpak/crc.h>
+#include <bpak/id.h>
+#include "nala.h"
+
+/* Bit at a time reference with the same polynomial */
+static uint32_t crc32_reference(uint32_t crc, const uint8_t *buf,
+                                size_t length)
+{
+    while (length--) {
+        crc ^= *buf++;
+
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+    }
+
+    return crc;
+}
+
+static uint8_t *create_data(size_t length)
+{
+    uint8_t *data = malloc(length);
+    uint32_t x = 0x12345678;
+
+    ASSERT(data != NULL);
+
+    for (size_t i = 0; i < length; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = x >> 24;
+    }
+
+    return data;
+}
+
+static void check_lengths(void)
+{
+    uint8_t *data = create_data(4096);
+
+    /* Every alignment and the lengths around the kernel block sizes */
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t length = 0; length < 300; length++) {
+            uint32_t expected = crc32_reference(0xffffffff,
+                                                &data[offset],
+                                                length);
+
+            ASSERT_EQ(bpak_crc32_update(0xffffffff, &data[offset], length),
+                      expected);
+        }
+    }
+
+    ASSERT_EQ(bpak_crc32_update(0x5a5a5a5a, data, 4096 - 7),
+              crc32_reference(0x5a5a5a5a, data, 4096 - 7));
+    free(data);
+}
+
+TEST(crc32_check_value)
+{
+    const uint8_t *check = (const uint8_t *)"123456789";
+
+    /* The standard CRC-32 is inverted before and after */
+    ASSERT_EQ(~bpak_crc32(0xffffffff, check, 9), 0xcbf43926);
+    ASSERT_EQ(~bpak_crc32_update(0xffffffff, check, 9), 0xcbf43926);
+    ASSERT_EQ(bpak_crc32_update(0x1234, check, 0), 0x1234);
+}
+
+TEST(crc32_lengths)
+{
+    check_lengths();
+}
+
+TEST(crc32_lengths_portable)
+{
+    bpak_crc32_set_acceleration(false);
+    check_lengths();
+    bpak_crc32_set_acceleration(true);
+}
+
+/* Splitting the input anywhere gives the same CRC, and ids are unchanged */
+TEST(crc32_split)
+{
+    size_t length = 1024 * 1024 + 13;
+    uint8_t *data = create_data(length);
+    uint32_t whole = bpak_crc32_update(0, data, length);
+
+    ASSERT_EQ(whole, crc32_reference(0, data, length));
+
+    for (size_t split = 1; split < length; split += 77777) {
+        uint32_t crc = bpak_crc32_update(0, data, split);
+        crc = bpak_crc32(crc, &data[split], length - split);
+        ASSERT_EQ(crc, whole);
+    }
+
+    ASSERT_EQ(bpak_id("bpak-transport"), BPAK_ID_BPAK_TRANSPORT);
+    free(data);
+}
@@ -137,3 +137,45 @@ TEST(crypto_sign_verify)
     rc = bpak_hash_free(&hash_ctx);
     ASSERT_EQ(rc, BPAK_OK);
 }
+
+struct bpak_key sorted_key0 = {.id = 0x00000010};
+struct bpak_key sorted_key1 = {.id = 0x1a2b3c4d};
+struct bpak_key sorted_key2 = {.id = 0x7fffffff};
+struct bpak_key sorted_key3 = {.id = 0x80000000};
+struct bpak_key sorted_key4 = {.id = 0xfffffffe};
+
+struct bpak_keystore sorted = {.id = 0x9dd4db42,
+                               .no_of_keys = 5,
+                               .verified = true,
+                               .sorted = true,
+                               .keys = {
+                                   &sorted_key0,
+                                   &sorted_key1,
+                                   &sorted_key2,
+                                   &sorted_key3,
+                                   &sorted_key4,
+                               }};
+
+TEST(keystore_get_sorted)
+{
+    int rc;
+    struct bpak_key *key = NULL;
+    uint32_t missing[] = {0, 0x11, 0x7ffffffe, 0x80000001, 0xffffffff};
+
+    for (unsigned int i = 0; i < sorted.no_of_keys; i++) {
+        rc = bpak_keystore_get(&sorted, sorted.keys[i]->id, &key);
+        ASSERT_EQ(rc, BPAK_OK);
+        ASSERT_EQ(key, sorted.keys[i]);
+    }
+
+    for (unsigned int i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+        rc = bpak_keystore_get(&sorted, missing[i], &key);
+        ASSERT_EQ(rc, -BPAK_KEY_NOT_FOUND);
+        ASSERT_EQ(key, NULL);
+    }
+
+    sorted.verified = false;
+    rc = bpak_keystore_get(&sorted, sorted_key1.id, &key);
+    sorted.verified = true;
+    ASSERT_EQ(rc, -BPAK_FAILED);
+}
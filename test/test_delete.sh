@@ -104,3 +104,24 @@ $BPAK delete $IMG4 --part test2 $V
 $BPAK delete $IMG4 --part test1 $V
 $BPAK show $IMG4
 
+
+# Test case 5, remove a block aligned part from the front, which lets the
+# file system collapse the range instead of moving the data
+IMG5=${TEST_NAME}5.bpak
+IMG6=${TEST_NAME}6.bpak
+create_data ${TEST_NAME}_data3.bin 128
+
+$BPAK create $IMG5 -Y $V
+$BPAK add $IMG5 --part test3 --from-file ${TEST_NAME}_data3.bin $V
+$BPAK add $IMG5 --part test2 --from-file ${TEST_NAME}_data2.bin $V
+
+$BPAK create $IMG6 -Y $V
+$BPAK add $IMG6 --part test2 --from-file ${TEST_NAME}_data2.bin $V
+
+$BPAK delete $IMG5 --part test3 $V
+
+if ! cmp $IMG5 $IMG6;
+then
+    echo "Package differs after deleting an aligned part"
+    exit 1
+fi
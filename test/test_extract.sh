@@ -50,6 +50,15 @@ then
     exit 1
 fi
 
+# Without --output the part is written to stdout, here a pipe
+pipe_sha256=$($BPAK extract $IMG --part fs | sha256sum | cut -d ' ' -f 1)
+
+if [ $pipe_sha256 != $second_sha256  ];
+then
+    echo "SHA comparison failed $pipe_sha256 != $second_sha256"
+    exit 1
+fi
+
 $BPAK extract $IMG --meta test-meta --output ${TEST_NAME}_meta_dump.bin
 
 if [ "$(cat ${TEST_NAME}_meta_dump.bin)" != "Test string" ];
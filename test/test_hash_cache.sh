@@ -0,0 +1,80 @@
+#!/bin/bash
+# Test: test_hash_cache
+#
+# Description: This test builds the same archive with and without a payload
+#  hash cache file and compares the resulting hashes. It also changes the
+#  archive behind the cache's back.
+#
+# Purpose: To ensure that the payload hash continues from the cached state
+#  when parts are appended and that a stale cache is not used.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_hash_cache
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -e
+
+$BPAK --version
+
+IMG1=${TEST_NAME}1.bpak
+IMG2=${TEST_NAME}2.bpak
+CACHE=${TEST_NAME}.cache
+
+create_data ${TEST_NAME}_data1.bin 64
+create_data ${TEST_NAME}_data2.bin 13
+
+rm -f $CACHE
+$BPAK create $IMG1 -Y $V
+$BPAK create $IMG2 -Y $V
+
+for part in p1 p2 p3
+do
+    $BPAK add $IMG1 --part $part --from-file ${TEST_NAME}_data1.bin \
+        --hash-cache $CACHE $V
+    $BPAK add $IMG2 --part $part --from-file ${TEST_NAME}_data1.bin $V
+done
+
+output=$($BPAK add $IMG1 --part p4 --from-file ${TEST_NAME}_data2.bin \
+    --hash-cache $CACHE $V 2>&1)
+echo "$output"
+
+# Builds without the built-in SHA backend can not save the hash state
+if ! echo "$output" | grep -q "Hash cache is not supported";
+then
+    echo "$output" | grep "continues after 3 parts"
+fi
+$BPAK add $IMG2 --part p4 --from-file ${TEST_NAME}_data2.bin $V
+
+img1_hash=$($BPAK show -H $IMG1)
+img2_hash=$($BPAK show -H $IMG2)
+
+if [ $img1_hash != $img2_hash ];
+then
+    echo "Hash comparison failed $img1_hash != $img2_hash"
+    exit 1
+fi
+
+# Change the first part of both archives, the cache is now stale
+for img in $IMG1 $IMG2
+do
+    printf 'x' | dd of=$img bs=1 seek=5000 conv=notrunc
+done
+
+$BPAK add $IMG1 --part p5 --from-file ${TEST_NAME}_data2.bin \
+    --hash-cache $CACHE $V
+$BPAK add $IMG2 --part p5 --from-file ${TEST_NAME}_data2.bin $V
+
+img1_hash=$($BPAK show -H $IMG1)
+img2_hash=$($BPAK show -H $IMG2)
+
+if [ $img1_hash != $img2_hash ];
+then
+    echo "Hash comparison failed $img1_hash != $img2_hash"
+    exit 1
+fi
+
+echo $TEST_NAME End
@@ -0,0 +1,89 @@
+#!/bin/bash
+# Test: test_header_tables
+#
+# Description: This test creates an archive with more parts and meta data
+#  than fit in the header, so that continuation tables are added, and
+#  signs, verifies and extracts it.
+#
+# Purpose: To ensure that the continuation tables are covered by the
+#  signature through the payload hash.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_header_tables
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -e
+
+IMG=${TEST_NAME}.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_data.bin 16
+create_data ${TEST_NAME}_fs.bin 64
+head -c 1000 ${TEST_NAME}_data.bin > ${TEST_NAME}_small.bin
+
+echo $TEST_NAME Creating package
+$BPAK create $IMG -Y $V
+$BPAK add $IMG --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+# The merkle parts add two meta data each, the header runs out of meta data
+# before it runs out of parts
+for i in $(seq 1 20); do
+    $BPAK add $IMG --part fs$i \
+                     --from-file ${TEST_NAME}_fs.bin \
+                     --encoder merkle $V
+done
+
+for i in $(seq 1 30); do
+    $BPAK add $IMG --part part$i \
+                     --from-file ${TEST_NAME}_small.bin $V
+done
+
+$BPAK add $IMG --meta pb-load-addr --from-string 0x49000000 \
+                 --part-ref part30 --encoder integer $V
+
+$BPAK show $IMG $V
+$BPAK show $IMG | grep "Tables:"
+$BPAK show $IMG --meta pb-load-addr --part part30 | grep 0x49000000
+$BPAK show $IMG --part part30
+
+$BPAK set $IMG --key-id pb-development \
+                 --keystore-id pb-internal $V
+$BPAK sign $IMG --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+$BPAK verify $IMG --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+
+$BPAK extract $IMG --part part30 --output ${TEST_NAME}_out.bin $V
+cmp ${TEST_NAME}_out.bin ${TEST_NAME}_small.bin
+$BPAK extract $IMG --part fs20 --output ${TEST_NAME}_out.bin $V
+cmp ${TEST_NAME}_out.bin ${TEST_NAME}_fs.bin
+
+# Transport encoding only handles packages without tables
+set +e
+$BPAK transport $IMG --encode --output ${TEST_NAME}_transport.bpak $V
+result_code=$?
+set -e
+
+if [ $result_code -eq 0 ]; then
+    exit 1
+fi
+
+# Corrupt the meta data bytes of the first table, the header is intact but
+# the payload hash covers the table.
+cp $IMG ${TEST_NAME}_corrupt.bpak
+printf '\xff' | dd of=${TEST_NAME}_corrupt.bpak bs=1 seek=$((4096 + 1544)) \
+    conv=notrunc
+
+set +e
+$BPAK verify ${TEST_NAME}_corrupt.bpak \
+    --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+result_code=$?
+set -e
+
+if [ $result_code -eq 0 ]; then
+    exit 1
+fi
+
+echo $TEST_NAME End
@@ -42,3 +42,10 @@ $BPAK show $IMG
 
 $BPAK generate keystore $IMG --name test > test_keystore.c
 cc -c test_keystore.c -I $TEST_SRC_DIR/../include -I../lib
+
+# The keys are emitted in ascending id order for the binary search in
+# bpak_keystore_get
+grep "^    .id = 0x" test_keystore.c | head -n -1 | sed "s/.*0x//; s/,//" | \
+    while read -r id; do printf "%08x\n" 0x$id; done > test_keystore_ids.txt
+sort -c test_keystore_ids.txt
+grep -q "\.sorted = true" test_keystore.c
@@ -3,6 +3,7 @@
 #include <bpak/bpak.h>
 #include <bpak/utils.h>
 #include <bpak/merkle.h>
+#include <bpak/crypto.h>
 #include "nala.h"
 /*
  *
@@ -81,13 +82,62 @@ TEST(merkle_tree_sizes)
     merkle_sz = bpak_merkle_compute_size(1024 * 1024 * 1024 * 1024l);
     ASSERT_EQ(merkle_sz, 8657571840);
 
-    /* 1 TiB is the largest supported input data  with four levels */
+    /* 1 TiB is the largest input data with four levels, larger inputs
+     * get a fifth level */
     merkle_sz = bpak_merkle_compute_size(1024 * 1024 * 1024 * 1024l + 4096);
+    ASSERT_EQ(merkle_sz, 8657592320);
+
+    struct bpak_merkle_options options = {
+        .max_levels = 4,
+    };
+
+    merkle_sz = bpak_merkle_compute_tree_size(1024 * 1024 * 1024 * 1024l,
+                                              &options);
+    ASSERT_EQ(merkle_sz, 8657571840);
+    merkle_sz =
+        bpak_merkle_compute_tree_size(1024 * 1024 * 1024 * 1024l + 4096,
+                                      &options);
     ASSERT_EQ(merkle_sz, -BPAK_NO_SPACE_LEFT);
 }
 
-static void test_merkle(const char *test_name, size_t data_size,
-                        const char *expected_root_hash)
+TEST(merkle_tree_sizes_block_size)
+{
+    struct bpak_merkle_options options = {
+        .block_size = 64 * 1024,
+    };
+
+    /* 16384 leaf hashes and a top level block */
+    ASSERT_EQ(bpak_merkle_compute_tree_size(1024 * 1024 * 1024, &options),
+              512 * 1024 + 64 * 1024);
+
+    /* Three levels for 2 TiB */
+    ASSERT_EQ(bpak_merkle_compute_tree_size(2048l * 1024 * 1024 * 1024,
+                                            &options),
+              1024l * 1024 * 1024 + 512 * 1024 + 64 * 1024);
+
+    ASSERT_EQ(bpak_merkle_compute_tree_size(4096, &options),
+              -BPAK_BAD_ALIGNMENT);
+    ASSERT_EQ(bpak_merkle_tree_leaf_offset(1024 * 1024 * 1024, &options, 1),
+              64 * 1024 + BPAK_MERKLE_HASH_BYTES);
+
+    /* Powers of two from 1 KiB to 64 KiB */
+    options.block_size = 512;
+    ASSERT_EQ(bpak_merkle_compute_tree_size(1024 * 1024, &options),
+              -BPAK_NOT_SUPPORTED);
+    options.block_size = 3 * 1024;
+    ASSERT_EQ(bpak_merkle_compute_tree_size(3 * 1024 * 1024, &options),
+              -BPAK_NOT_SUPPORTED);
+    options.block_size = 128 * 1024;
+    ASSERT_EQ(bpak_merkle_compute_tree_size(1024 * 1024, &options),
+              -BPAK_NOT_SUPPORTED);
+    options.block_size = 1024;
+    ASSERT_EQ(bpak_merkle_compute_tree_size(1024 * 1024, &options),
+              32 * 1024 + 1024);
+}
+
+static void test_merkle_jobs(const char *test_name, size_t data_size,
+                             const char *expected_root_hash,
+                             unsigned int jobs)
 {
     int rc;
     struct bpak_merkle_context ctx;
@@ -121,6 +171,18 @@ static void test_merkle(const char *test_name, size_t data_size,
 
     uint32_t data_to_process = data_size;
     uint32_t pos = 0;
+
+    if (jobs > 1) {
+        /* Start in the middle of a leaf, then pass the rest in one go so
+         * that the complete leaves are hashed in parallel */
+        ASSERT_EQ(bpak_merkle_set_jobs(&ctx, jobs), BPAK_OK);
+        rc = bpak_merkle_write_chunk(&ctx, input_data, 100);
+        ASSERT_EQ(rc, BPAK_OK);
+        rc = bpak_merkle_write_chunk(&ctx, &input_data[100], data_size - 100);
+        ASSERT_EQ(rc, BPAK_OK);
+        data_to_process = 0;
+    }
+
     while (data_to_process) {
         uint32_t chunk = (data_to_process > BPAK_MERKLE_BLOCK_SZ)
                              ? BPAK_MERKLE_BLOCK_SZ
@@ -150,6 +212,12 @@ static void test_merkle(const char *test_name, size_t data_size,
     free(input_data);
 }
 
+static void test_merkle(const char *test_name, size_t data_size,
+                        const char *expected_root_hash)
+{
+    test_merkle_jobs(test_name, data_size, expected_root_hash, 1);
+}
+
 TEST(merkle_4KiB)
 {
     /* This tests a special case where there is only one hash block which
@@ -214,6 +282,88 @@ TEST(merkle_64MiB)
         "501ee45cff77e8aaaf3db1fe6948d0ab061ba7d1f5063bc07d2b420e83d689c3");
 }
 
+/* Parallel leaf hashing must give the same tree as the streaming API */
+TEST(merkle_516KiB_jobs)
+{
+    test_merkle_jobs(
+        "merkle_test_516KiB_jobs.bin",
+        1024 * 516,
+        "6c574d8b52fa339dd08a468665033e370c4b228f9c91f25c796a96196b348fd6",
+        4);
+}
+
+TEST(merkle_64MiB_jobs)
+{
+    test_merkle_jobs(
+        "merkle_test_64MiB_jobs.bin",
+        1024 * 1024 * 64,
+        "501ee45cff77e8aaaf3db1fe6948d0ab061ba7d1f5063bc07d2b420e83d689c3",
+        4);
+}
+
+/* The work buffers fit in an arena of bpak_merkle_heap_size bytes */
+TEST(merkle_516KiB_arena)
+{
+    size_t data_size = 1024 * 516;
+    struct bpak_merkle_context ctx;
+    struct bpak_arena arena;
+    struct bpak_allocator allocator;
+    uint8_t *input_data = malloc(data_size);
+    size_t merkle_sz = bpak_merkle_compute_size(data_size);
+    char *merkle_buf = calloc(1, merkle_sz);
+    bpak_merkle_hash_t hash;
+    char root_hash_str[65];
+
+    for (unsigned int i = 0; i < data_size; i += 16)
+        memcpy(&input_data[i], "0123456789abcdef", 16);
+
+    ASSERT_EQ(bpak_merkle_init(&ctx,
+                               data_size,
+                               salt,
+                               sizeof(salt),
+                               merkle_wr,
+                               merkle_rd,
+                               0,
+                               true,
+                               merkle_buf),
+              BPAK_OK);
+    ASSERT_EQ(bpak_merkle_set_jobs(&ctx, 4), BPAK_OK);
+
+    size_t heap_size = bpak_merkle_heap_size(&ctx);
+    uint8_t *heap = malloc(heap_size);
+    ASSERT_EQ(bpak_arena_init(&arena, heap, heap_size), BPAK_OK);
+    bpak_arena_allocator(&arena, &allocator);
+    ASSERT_EQ(bpak_merkle_set_allocator(&ctx, &allocator), BPAK_OK);
+
+    ASSERT_EQ(bpak_merkle_write_chunk(&ctx, input_data, data_size), BPAK_OK);
+    ASSERT_EQ(bpak_merkle_finish(&ctx, hash), BPAK_OK);
+
+    bpak_bin2hex(hash, 32, root_hash_str, sizeof(root_hash_str));
+    ASSERT_EQ((char *)root_hash_str,
+              "6c574d8b52fa339dd08a468665033e370c4b228f9c91f25c796a96196b348fd6");
+    ASSERT(arena.peak > 0);
+    ASSERT(arena.peak <= heap_size);
+    ASSERT_EQ(arena.count, 0);
+
+    free(heap);
+    free(merkle_buf);
+    free(input_data);
+}
+
+#if BPAK_CONFIG_SHA == 1
+/* The multi-buffer leaf hashing must match the portable single hash path */
+TEST(merkle_516KiB_portable_sha)
+{
+    bpak_sha_set_acceleration(false);
+    test_merkle_jobs(
+        "merkle_test_516KiB_portable_sha.bin",
+        1024 * 516,
+        "6c574d8b52fa339dd08a468665033e370c4b228f9c91f25c796a96196b348fd6",
+        4);
+    bpak_sha_set_acceleration(true);
+}
+#endif
+
 /* This tests that the chunk write function handles unaligned input correctly
  */
 TEST(merkle_unaligned_input)
@@ -288,3 +438,473 @@ TEST(merkle_unaligned_input)
     free(merkle_buf);
     free(input_data);
 }
+
+static void test_merkle_verify_blocks(size_t data_size)
+{
+    int rc;
+    struct bpak_merkle_context ctx;
+    struct bpak_merkle_verify_context *vctx;
+    uint8_t *input_data = malloc(data_size);
+    size_t merkle_sz = bpak_merkle_compute_size(data_size);
+    uint8_t *merkle_buf = malloc(merkle_sz);
+    size_t no_of_blocks = data_size / BPAK_MERKLE_BLOCK_SZ;
+    bpak_merkle_hash_t hash;
+
+    vctx = malloc(sizeof(*vctx));
+
+    for (unsigned int i = 0; i < data_size; i += 16)
+        memcpy(&input_data[i], "0123456789abcdef", 16);
+
+    rc = bpak_merkle_init(&ctx,
+                          data_size,
+                          salt,
+                          sizeof(salt),
+                          merkle_wr,
+                          merkle_rd,
+                          0,
+                          true,
+                          merkle_buf);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_merkle_write_chunk(&ctx, input_data, data_size);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_merkle_finish(&ctx, hash);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_merkle_verify_init(vctx,
+                                 data_size,
+                                 salt,
+                                 sizeof(salt),
+                                 hash,
+                                 merkle_rd,
+                                 0,
+                                 merkle_buf);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    /* Backwards, so that the path is not always in the cache */
+    for (size_t i = no_of_blocks; i > 0; i--) {
+        rc = bpak_merkle_verify_block(vctx,
+                                      i - 1,
+                                      &input_data[(i - 1) *
+                                                  BPAK_MERKLE_BLOCK_SZ]);
+        ASSERT_EQ(rc, BPAK_OK);
+    }
+
+    rc = bpak_merkle_verify_block(vctx, no_of_blocks, input_data);
+    ASSERT_EQ(rc, -BPAK_SIZE_ERROR);
+
+    input_data[100] ^= 1;
+    rc = bpak_merkle_verify_block(vctx, 0, input_data);
+    ASSERT_EQ(rc, -BPAK_BAD_ROOT_HASH);
+    input_data[100] ^= 1;
+    bpak_merkle_verify_free(vctx);
+
+    /* A corrupt leaf hash in the tree, with nothing cached */
+    if (no_of_blocks > 1) {
+        /* Level 0 is last in the tree */
+        size_t level0_sz = (no_of_blocks * BPAK_MERKLE_HASH_BYTES +
+                            BPAK_MERKLE_BLOCK_SZ - 1) &
+                           ~(BPAK_MERKLE_BLOCK_SZ - 1);
+
+        merkle_buf[merkle_sz - level0_sz] ^= 1;
+
+        rc = bpak_merkle_verify_init(vctx,
+                                     data_size,
+                                     salt,
+                                     sizeof(salt),
+                                     hash,
+                                     merkle_rd,
+                                     0,
+                                     merkle_buf);
+        ASSERT_EQ(rc, BPAK_OK);
+        rc = bpak_merkle_verify_block(vctx, 0, input_data);
+        ASSERT_EQ(rc, -BPAK_BAD_ROOT_HASH);
+        bpak_merkle_verify_free(vctx);
+    }
+
+    free(vctx);
+    free(merkle_buf);
+    free(input_data);
+}
+
+TEST(merkle_verify_block_4KiB)
+{
+    test_merkle_verify_blocks(4096);
+}
+
+TEST(merkle_verify_block_516KiB)
+{
+    test_merkle_verify_blocks(1024 * 516);
+}
+
+TEST(merkle_verify_block_68MiB)
+{
+    test_merkle_verify_blocks(1024 * 1024 * 68);
+}
+
+/* A tree built from known leaf hashes for every other run of leaves must be
+ * identical to the tree built from the data */
+static void test_merkle_reuse_hashes(size_t data_size)
+{
+    struct bpak_merkle_context ctx;
+    size_t merkle_sz = bpak_merkle_compute_size(data_size);
+    size_t no_of_leaves = data_size / BPAK_MERKLE_BLOCK_SZ;
+    uint8_t *input_data = malloc(data_size);
+    uint8_t *reference = calloc(1, merkle_sz);
+    uint8_t *result = calloc(1, merkle_sz);
+    bpak_merkle_hash_t reference_hash;
+    bpak_merkle_hash_t hash;
+
+    for (size_t i = 0; i < data_size; i++)
+        input_data[i] = (i * 7) ^ (i >> 12);
+
+    ASSERT_EQ(bpak_merkle_init(&ctx,
+                               data_size,
+                               salt,
+                               sizeof(salt),
+                               merkle_wr,
+                               merkle_rd,
+                               0,
+                               true,
+                               reference),
+              BPAK_OK);
+    ASSERT_EQ(bpak_merkle_write_chunk(&ctx, input_data, data_size), BPAK_OK);
+    ASSERT_EQ(bpak_merkle_finish(&ctx, reference_hash), BPAK_OK);
+
+    ASSERT_EQ(bpak_merkle_init(&ctx,
+                               data_size,
+                               salt,
+                               sizeof(salt),
+                               merkle_wr,
+                               merkle_rd,
+                               0,
+                               true,
+                               result),
+              BPAK_OK);
+
+    /* Runs of 1, 2, 3... leaves, alternating between data and hashes */
+    for (size_t i = 0, n = 1; i < no_of_leaves; i += n, n++) {
+        size_t count = BPAK_MIN(n, no_of_leaves - i);
+
+        if (n % 2) {
+            ASSERT_EQ(bpak_merkle_write_chunk(&ctx,
+                                              &input_data[i *
+                                                  BPAK_MERKLE_BLOCK_SZ],
+                                              count * BPAK_MERKLE_BLOCK_SZ),
+                      BPAK_OK);
+        } else {
+            off_t offset = bpak_merkle_leaf_offset(data_size, i);
+
+            ASSERT_GE(offset, 0);
+            ASSERT_EQ(bpak_merkle_write_hashes(&ctx,
+                                               &reference[offset],
+                                               count),
+                      BPAK_OK);
+        }
+    }
+
+    ASSERT_EQ(bpak_merkle_finish(&ctx, hash), BPAK_OK);
+    ASSERT_MEMORY(hash, reference_hash, sizeof(hash));
+    ASSERT_MEMORY(result, reference, merkle_sz);
+    ASSERT_LT(bpak_merkle_leaf_offset(data_size, no_of_leaves), 0);
+
+    free(result);
+    free(reference);
+    free(input_data);
+}
+
+TEST(merkle_reuse_hashes_4KiB)
+{
+    struct bpak_merkle_context ctx;
+    size_t merkle_sz = bpak_merkle_compute_size(4096);
+    uint8_t *input_data = calloc(1, 4096);
+    uint8_t *reference = calloc(1, merkle_sz);
+    uint8_t *result = calloc(1, merkle_sz);
+    bpak_merkle_hash_t reference_hash;
+    bpak_merkle_hash_t hash;
+
+    ASSERT_EQ(bpak_merkle_init(&ctx,
+                               4096,
+                               salt,
+                               sizeof(salt),
+                               merkle_wr,
+                               merkle_rd,
+                               0,
+                               true,
+                               reference),
+              BPAK_OK);
+    ASSERT_EQ(bpak_merkle_write_chunk(&ctx, input_data, 4096), BPAK_OK);
+    ASSERT_EQ(bpak_merkle_finish(&ctx, reference_hash), BPAK_OK);
+
+    ASSERT_EQ(bpak_merkle_init(&ctx,
+                               4096,
+                               salt,
+                               sizeof(salt),
+                               merkle_wr,
+                               merkle_rd,
+                               0,
+                               true,
+                               result),
+              BPAK_OK);
+    ASSERT_EQ(bpak_merkle_leaf_offset(4096, 0), 0);
+    ASSERT_EQ(bpak_merkle_write_hashes(&ctx, reference, 1), BPAK_OK);
+    ASSERT_EQ(bpak_merkle_finish(&ctx, hash), BPAK_OK);
+    ASSERT_MEMORY(hash, reference_hash, sizeof(hash));
+    ASSERT_MEMORY(result, reference, merkle_sz);
+
+    free(result);
+    free(reference);
+    free(input_data);
+}
+
+TEST(merkle_reuse_hashes_516KiB)
+{
+    test_merkle_reuse_hashes(1024 * 516);
+}
+
+TEST(merkle_reuse_hashes_68MiB)
+{
+    test_merkle_reuse_hashes(1024 * 1024 * 68);
+}
+
+TEST(merkle_sparse)
+{
+    struct bpak_merkle_context ctx;
+    size_t data_size = 1024 * 516;
+    size_t merkle_sz = bpak_merkle_compute_size(data_size);
+    uint8_t *input_data = malloc(data_size);
+    uint8_t *stored = malloc(data_size);
+    uint8_t *reference = calloc(1, merkle_sz);
+    uint8_t *result = calloc(1, merkle_sz);
+    bpak_merkle_hash_t reference_hash;
+    bpak_merkle_hash_t hash;
+    /* Zero runs at the start, in the middle and one that ends before the
+     * last stored block */
+    const struct bpak_sparse_extent extents[] = {
+        {.block = 0, .count = 3},
+        {.block = 10, .count = 1},
+        {.block = 40, .count = 80},
+    };
+    struct bpak_sparse_map map = {
+        .extents = extents,
+        .count = 3,
+        .size = data_size,
+    };
+    size_t stored_length = 0;
+
+    for (size_t i = 0; i < data_size; i++)
+        input_data[i] = (i * 7) ^ (i >> 12);
+
+    for (size_t i = 0, e = 0; i < data_size / BPAK_MERKLE_BLOCK_SZ; i++) {
+        uint8_t *block = &input_data[i * BPAK_MERKLE_BLOCK_SZ];
+
+        if ((e < map.count) && (i >= extents[e].block + extents[e].count))
+            e++;
+
+        if ((e < map.count) && (i >= extents[e].block)) {
+            memset(block, 0, BPAK_MERKLE_BLOCK_SZ);
+        } else {
+            memcpy(&stored[stored_length], block, BPAK_MERKLE_BLOCK_SZ);
+            stored_length += BPAK_MERKLE_BLOCK_SZ;
+        }
+    }
+
+    map.stored_size = stored_length;
+
+    ASSERT_EQ(bpak_merkle_init(&ctx,
+                               data_size,
+                               salt,
+                               sizeof(salt),
+                               merkle_wr,
+                               merkle_rd,
+                               0,
+                               true,
+                               reference),
+              BPAK_OK);
+    ASSERT_EQ(bpak_merkle_write_chunk(&ctx, input_data, data_size), BPAK_OK);
+    ASSERT_EQ(bpak_merkle_finish(&ctx, reference_hash), BPAK_OK);
+
+    ASSERT_EQ(bpak_merkle_init(&ctx,
+                               data_size,
+                               salt,
+                               sizeof(salt),
+                               merkle_wr,
+                               merkle_rd,
+                               0,
+                               true,
+                               result),
+              BPAK_OK);
+
+    /* Stored data in odd sized chunks, followed by padding that is
+     * ignored */
+    for (size_t pos = 0; pos < stored_length; pos += 1000) {
+        ASSERT_EQ(bpak_merkle_write_sparse(&ctx,
+                                           &map,
+                                           pos,
+                                           &stored[pos],
+                                           BPAK_MIN(1000,
+                                                    stored_length - pos)),
+                  BPAK_OK);
+    }
+
+    ASSERT_EQ(bpak_merkle_write_sparse(&ctx,
+                                       &map,
+                                       stored_length,
+                                       stored,
+                                       512),
+              BPAK_OK);
+    ASSERT_EQ(bpak_merkle_finish(&ctx, hash), BPAK_OK);
+    ASSERT_MEMORY(hash, reference_hash, sizeof(hash));
+    ASSERT_MEMORY(result, reference, merkle_sz);
+
+    free(result);
+    free(reference);
+    free(stored);
+    free(input_data);
+}
+
+/* Trees with other block sizes are the same when built from leaves on
+ * several threads and from small chunks, and every block verifies */
+static void test_merkle_block_size(size_t block_size, size_t data_size,
+                                   const bpak_merkle_hash_t expected_hash)
+{
+    struct bpak_merkle_context ctx;
+    struct bpak_merkle_verify_context *vctx = malloc(sizeof(*vctx));
+    struct bpak_merkle_options options = {
+        .block_size = block_size,
+    };
+    ssize_t merkle_sz = bpak_merkle_compute_tree_size(data_size, &options);
+    uint8_t *input_data = malloc(data_size);
+    uint8_t *merkle_buf;
+    uint8_t *chunked_buf;
+    bpak_merkle_hash_t hash;
+    bpak_merkle_hash_t chunked_hash;
+    uint32_t seed = 1;
+
+    ASSERT_GT(merkle_sz, 0);
+    merkle_buf = malloc(merkle_sz);
+    chunked_buf = malloc(merkle_sz);
+
+    for (size_t i = 0; i < data_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        input_data[i] = seed >> 16;
+    }
+
+    ASSERT_EQ(bpak_merkle_init_opts(&ctx,
+                                    data_size,
+                                    salt,
+                                    sizeof(salt),
+                                    merkle_wr,
+                                    merkle_rd,
+                                    0,
+                                    true,
+                                    &options,
+                                    merkle_buf),
+              BPAK_OK);
+    ASSERT_EQ(bpak_merkle_get_size(&ctx), (size_t)merkle_sz);
+    ASSERT_EQ(bpak_merkle_set_jobs(&ctx, 4), BPAK_OK);
+    ASSERT_EQ(bpak_merkle_write_chunk(&ctx, input_data, data_size), BPAK_OK);
+    ASSERT_EQ(bpak_merkle_finish(&ctx, hash), BPAK_OK);
+
+    if (expected_hash != NULL)
+        ASSERT_MEMORY(hash, expected_hash, sizeof(hash));
+
+    ASSERT_EQ(bpak_merkle_init_opts(&ctx,
+                                    data_size,
+                                    salt,
+                                    sizeof(salt),
+                                    merkle_wr,
+                                    merkle_rd,
+                                    0,
+                                    true,
+                                    &options,
+                                    chunked_buf),
+              BPAK_OK);
+
+    for (size_t pos = 0; pos < data_size; pos += 777) {
+        ASSERT_EQ(bpak_merkle_write_chunk(&ctx,
+                                          &input_data[pos],
+                                          BPAK_MIN(777, data_size - pos)),
+                  BPAK_OK);
+    }
+
+    ASSERT_EQ(bpak_merkle_finish(&ctx, chunked_hash), BPAK_OK);
+    ASSERT_MEMORY(chunked_hash, hash, sizeof(hash));
+    ASSERT_MEMORY(chunked_buf, merkle_buf, merkle_sz);
+
+    ASSERT_EQ(bpak_merkle_verify_init_opts(vctx,
+                                           data_size,
+                                           salt,
+                                           sizeof(salt),
+                                           hash,
+                                           merkle_rd,
+                                           0,
+                                           &options,
+                                           merkle_buf),
+              BPAK_OK);
+
+    for (size_t i = data_size / block_size; i > 0; i--) {
+        ASSERT_EQ(bpak_merkle_verify_block(vctx,
+                                           i - 1,
+                                           &input_data[(i - 1) * block_size]),
+                  BPAK_OK);
+    }
+
+    input_data[block_size + 100] ^= 1;
+    ASSERT_EQ(bpak_merkle_verify_block(vctx, 1, &input_data[block_size]),
+              -BPAK_BAD_ROOT_HASH);
+    bpak_merkle_verify_free(vctx);
+
+    free(chunked_buf);
+    free(merkle_buf);
+    free(input_data);
+    free(vctx);
+}
+
+/* Hash of 'salt' and 'length' bytes of 'data' */
+static void salted_sha256(const uint8_t *data, size_t length,
+                          uint8_t *output)
+{
+    struct bpak_hash_context hash;
+
+    ASSERT_EQ(bpak_hash_init(&hash, BPAK_HASH_SHA256), BPAK_OK);
+    ASSERT_EQ(bpak_hash_update(&hash, salt, sizeof(salt)), BPAK_OK);
+    ASSERT_EQ(bpak_hash_update(&hash, data, length), BPAK_OK);
+    ASSERT_EQ(bpak_hash_final(&hash, output, BPAK_MERKLE_HASH_BYTES, NULL),
+              BPAK_OK);
+    bpak_hash_free(&hash);
+}
+
+TEST(merkle_block_size_64KiB)
+{
+    size_t block_size = 64 * 1024;
+    size_t data_size = 16 * block_size;
+    uint8_t *input_data = malloc(data_size);
+    uint8_t *level0 = calloc(1, block_size);
+    bpak_merkle_hash_t expected_hash;
+    uint32_t seed = 1;
+
+    /* The same data as test_merkle_block_size. The tree is one level, the
+     * root hash is the hash of the leaf hashes padded to one block. */
+    for (size_t i = 0; i < data_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        input_data[i] = seed >> 16;
+    }
+
+    for (size_t i = 0; i < data_size / block_size; i++) {
+        salted_sha256(&input_data[i * block_size],
+                      block_size,
+                      &level0[i * BPAK_MERKLE_HASH_BYTES]);
+    }
+
+    salted_sha256(level0, block_size, expected_hash);
+    free(level0);
+    free(input_data);
+
+    test_merkle_block_size(block_size, data_size, expected_hash);
+}
+
+TEST(merkle_block_size_1KiB)
+{
+    /* Two levels of 1 KiB blocks */
+    test_merkle_block_size(1024, 1024 * 1024, NULL);
+}
@@ -0,0 +1,100 @@
+#!/bin/bash
+# Test: test_merkle_block_size
+#
+# Description: This test creates archives with a merkle protected part that
+#  uses 64 KiB hash tree blocks, verifies them and installs one from a
+#  transport patch where the hash tree is generated by the decoder.
+#
+# Purpose: To ensure that the 'merkle-block-size' meta is used when the
+#  tree is built, verified and generated.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_merkle_block_size
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -e
+
+$BPAK --version
+
+IMG_A=${TEST_NAME}_origin.bpak
+IMG_B=${TEST_NAME}_target.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_origin.bin 1024
+cp ${TEST_NAME}_origin.bin ${TEST_NAME}_target.bin
+printf 'changed block' | dd of=${TEST_NAME}_target.bin bs=1 seek=307200 \
+    conv=notrunc
+
+create_package() {
+    $BPAK create $1 -Y $V
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+    $BPAK transport $1 --add --part fs --encoder bsdiff \
+                                       --decoder bspatch $V
+    $BPAK transport $1 --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+
+    $BPAK add $1 --meta merkle-block-size --from-string 65536 \
+                 --part-ref fs --encoder integer $V
+    $BPAK add $1 --part fs \
+                 --from-file $2 \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_A ${TEST_NAME}_origin.bin
+create_package $IMG_B ${TEST_NAME}_target.bin
+
+# 16 leaves, the tree is one 64 KiB block
+$BPAK show $IMG_B $V | grep -E "merkle-block-size +.* 65536"
+# fs-hash-tree
+$BPAK show $IMG_B $V | grep -E "^ +77fadb17 +65536 "
+
+$BPAK verify $IMG_B --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+$BPAK verify $IMG_B --key $TEST_SRC_DIR/secp256r1-pub-key.der --jobs 4 $V
+
+# A changed data block is found with the 64 KiB tree
+cp $IMG_B ${TEST_NAME}_corrupt.bpak
+dd if=/dev/zero of=${TEST_NAME}_corrupt.bpak bs=1 seek=600000 count=16 \
+    conv=notrunc
+
+set +e
+$BPAK verify ${TEST_NAME}_corrupt.bpak \
+    --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+result_code=$?
+set -e
+
+if [ $result_code -eq 0 ];
+then
+    echo "Corrupt package verified"
+    exit 1
+fi
+
+$BPAK transport $IMG_B --encode --origin $IMG_A \
+                       --output ${TEST_NAME}_patch.bpak $V
+$BPAK transport ${TEST_NAME}_patch.bpak --decode \
+                       --origin $IMG_A \
+                       --output ${TEST_NAME}_install.bpak $V
+
+first_sha256=$(sha256sum $IMG_B | cut -d ' ' -f 1)
+second_sha256=$(sha256sum ${TEST_NAME}_install.bpak | cut -d ' ' -f 1)
+
+if [ $first_sha256 != $second_sha256  ];
+then
+    echo "SHA comparison failed $first_sha256 != $second_sha256"
+    exit 1
+fi
+
+$BPAK verify ${TEST_NAME}_install.bpak \
+    --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+
+echo $TEST_NAME End
@@ -15,3 +15,49 @@ TEST(error_codes)
     printf("%s %s\n", bpak_error_string(end + 1), bpak_error_string(1));
     ASSERT(bpak_error_string(end + 1) == bpak_error_string(1));
 }
+
+TEST(arena)
+{
+    uint8_t buffer[1024];
+    struct bpak_arena arena;
+    struct bpak_allocator allocator;
+
+    ASSERT_EQ(bpak_arena_init(&arena, buffer, 8), -BPAK_SIZE_ERROR);
+    ASSERT_EQ(bpak_arena_init(&arena, buffer, sizeof(buffer)), BPAK_OK);
+    bpak_arena_allocator(&arena, &allocator);
+
+    uint8_t *a = bpak_allocator_calloc(&allocator, 1, 100);
+    uint8_t *b = bpak_allocator_calloc(&allocator, 10, 10);
+    ASSERT(a != NULL);
+    ASSERT(b != NULL);
+    ASSERT_EQ((uintptr_t)a % 16, 0);
+    ASSERT_EQ((uintptr_t)b % 16, 0);
+    ASSERT(b >= a + 100);
+    ASSERT_EQ(arena.count, 2);
+
+    /* Requests that don't fit fail without touching the heap */
+    ASSERT(bpak_arena_calloc(&arena, 1, sizeof(buffer)) == NULL);
+    ASSERT(bpak_arena_calloc(&arena, SIZE_MAX, 2) == NULL);
+
+    /* 'a' is below 'b' and is returned together with it */
+    size_t used = arena.used;
+    bpak_allocator_free(&allocator, a);
+    ASSERT_EQ(arena.used, used);
+    bpak_allocator_free(&allocator, b);
+    ASSERT_EQ(arena.used, 0);
+    ASSERT_EQ(arena.count, 0);
+    ASSERT_EQ(arena.peak, used);
+
+    /* Freed space is zeroed again when it is reused */
+    a = bpak_arena_calloc(&arena, 1, 100);
+    memset(a, 0xff, 100);
+    bpak_arena_free(&arena, a);
+    a = bpak_arena_calloc(&arena, 1, 100);
+
+    for (int i = 0; i < 100; i++)
+        ASSERT_EQ(a[i], 0);
+
+    bpak_arena_free(&arena, a);
+    bpak_arena_free(&arena, NULL);
+    ASSERT_EQ(arena.used, 0);
+}
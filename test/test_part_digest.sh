@@ -0,0 +1,79 @@
+#!/bin/bash
+# Test: test_part_digest
+#
+# Description: This test signs an archive with a digest per part and
+#  verifies it with the part digests checked on several threads.
+#
+# Purpose: To ensure that the part digests are signed and that a corrupt
+#  part is reported with the same error as the payload hash check.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_part_digest
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -e
+
+$BPAK --version
+
+IMG=${TEST_NAME}.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_data.bin 128
+create_data ${TEST_NAME}_data2.bin 64
+
+echo $TEST_NAME Creating package
+$BPAK create $IMG -Y $V
+$BPAK add $IMG --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+$BPAK add $IMG --part fs \
+                 --from-file ${TEST_NAME}_data.bin \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+$BPAK add $IMG --part fs2 \
+                 --from-file ${TEST_NAME}_data2.bin \
+                 --encoder merkle $V
+
+$BPAK add $IMG --part data \
+                 --from-file ${TEST_NAME}_data2.bin $V
+
+$BPAK set $IMG --key-id pb-development \
+                 --keystore-id pb-internal $V
+echo SIGN
+$BPAK sign $IMG --key $TEST_SRC_DIR/secp256r1-key-pair.pem --part-digests $V
+$BPAK show $IMG $V | grep part-digest
+echo VERIFY
+$BPAK verify $IMG --key $TEST_SRC_DIR/secp256r1-pub-key.der --jobs 4 $V
+$BPAK verify $IMG --key $TEST_SRC_DIR/secp256r1-pub-key.der --jobs 0 $V
+
+# Corrupt 'offset' and check that both verify modes fail with the same code
+verify_corrupt() {
+    cp $IMG ${TEST_NAME}_corrupt.bpak
+    dd if=/dev/zero of=${TEST_NAME}_corrupt.bpak bs=1 seek=$1 count=16 \
+        conv=notrunc
+
+    set +e
+    $BPAK verify ${TEST_NAME}_corrupt.bpak \
+        --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+    expected_code=$?
+    $BPAK verify ${TEST_NAME}_corrupt.bpak \
+        --key $TEST_SRC_DIR/secp256r1-pub-key.der --jobs 4 $V
+    result_code=$?
+    set -e
+
+    if [ $expected_code -eq 0 ] || [ $result_code -ne $expected_code ];
+    then
+        exit 1
+    fi
+}
+
+# Hashed data of the second merkle part
+verify_corrupt 139364
+# The last part
+verify_corrupt $(( $(stat -c %s $IMG) - 64 ))
+
+echo $TEST_NAME End
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/pkg.h>
+#include <bpak/id.h>
+#include <bpak/utils.h>
+#include <bpak/crypto.h>
+#include "nala.h"
+
+static void write_test_file(const char *filename, size_t size)
+{
+    FILE *fp = fopen(filename, "wb");
+
+    for (size_t i = 0; i < size; i++)
+        fputc((i * 7) ^ (i >> 9), fp);
+
+    fclose(fp);
+}
+
+TEST(pkg_builder)
+{
+    int rc;
+    struct bpak_pkg_builder builder;
+    struct bpak_package pkg;
+    struct bpak_key *key = NULL;
+    struct bpak_part_header *part = NULL;
+    struct bpak_meta_header *meta = NULL;
+    uint8_t payload_hash[64];
+    uint32_t version = 0x01020304;
+    const char *filename = "test_pkg_builder.bpak";
+
+    write_test_file("test_pkg_builder_fs.bin", 33 * 4096);
+    write_test_file("test_pkg_builder_data.bin", 1000);
+
+    rc = bpak_pkg_builder_init(&builder,
+                               filename,
+                               BPAK_HASH_SHA256,
+                               BPAK_SIGN_PRIME256v1,
+                               true);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_add_meta(&builder,
+                                   bpak_id("version"),
+                                   0,
+                                   &version,
+                                   sizeof(version));
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_add_file_with_merkle_tree(&builder,
+                                                    "test_pkg_builder_fs.bin",
+                                                    "fs",
+                                                    0);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_add_file(&builder,
+                                   "test_pkg_builder_data.bin",
+                                   "data",
+                                   BPAK_FLAG_EXCLUDE_FROM_HASH);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_add_file(&builder,
+                                   "test_pkg_builder_data.bin",
+                                   "data2",
+                                   0);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_finish(&builder,
+                                 TEST_SRC_DIR "/secp256r1-key-pair.pem");
+    ASSERT_EQ(rc, BPAK_OK);
+    bpak_pkg_builder_free(&builder);
+
+    /* The package must look like one that was created step by step */
+    rc = bpak_pkg_open(&pkg, filename, "r");
+    ASSERT_EQ(rc, BPAK_OK);
+
+    ASSERT_EQ(bpak_get_part(&pkg.header, bpak_id("fs"), &part), BPAK_OK);
+    ASSERT_EQ(bpak_get_part(&pkg.header,
+                            bpak_part_name_to_hash_tree_id("fs"),
+                            &part),
+              BPAK_OK);
+    ASSERT_EQ(bpak_get_part(&pkg.header, bpak_id("data"), &part), BPAK_OK);
+    ASSERT_EQ(part->size, 1000);
+    ASSERT_EQ(part->pad_bytes, 24);
+    ASSERT_EQ(bpak_get_meta(&pkg.header,
+                            BPAK_ID_MERKLE_ROOT_HASH,
+                            bpak_id("fs"),
+                            &meta),
+              BPAK_OK);
+    ASSERT_EQ(bpak_get_meta(&pkg.header,
+                            BPAK_ID_PART_DIGEST,
+                            bpak_id("data2"),
+                            &meta),
+              BPAK_OK);
+    ASSERT_EQ(bpak_get_meta(&pkg.header,
+                            BPAK_ID_PART_DIGEST,
+                            bpak_id("data"),
+                            &meta),
+              -BPAK_NOT_FOUND);
+
+    memcpy(payload_hash, pkg.header.payload_hash, sizeof(payload_hash));
+    rc = bpak_pkg_update_hash(&pkg, NULL, NULL);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_MEMORY(payload_hash, pkg.header.payload_hash, sizeof(payload_hash));
+
+    /* Signature, payload hash, part digests and the merkle tree */
+    rc = bpak_crypto_load_public_key(TEST_SRC_DIR "/secp256r1-pub-key.der",
+                                     &key);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_pkg_verify(&pkg, key), BPAK_OK);
+    ASSERT_EQ(bpak_pkg_verify_jobs(&pkg, key, 4), BPAK_OK);
+
+    free(key);
+    bpak_pkg_close(&pkg);
+}
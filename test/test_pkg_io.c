@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/pkg.h>
+#include <bpak/id.h>
+#include <bpak/utils.h>
+#include <bpak/crypto.h>
+#include <bpak/verify.h>
+#include "nala.h"
+
+/* Package in a memory buffer */
+struct mem_file {
+    uint8_t data[64 * 1024];
+    size_t size;
+    unsigned int syncs;
+    unsigned int reads;
+};
+
+static ssize_t mem_read_at(off_t offset, uint8_t *buf, size_t size,
+                           void *priv)
+{
+    struct mem_file *f = (struct mem_file *)priv;
+
+    f->reads++;
+
+    if ((size_t)offset >= f->size)
+        return 0;
+
+    size = BPAK_MIN(size, f->size - offset);
+    memcpy(buf, &f->data[offset], size);
+    return size;
+}
+
+static ssize_t mem_write_at(off_t offset, uint8_t *buf, size_t size,
+                            void *priv)
+{
+    struct mem_file *f = (struct mem_file *)priv;
+
+    if (offset + size > sizeof(f->data))
+        return -BPAK_WRITE_ERROR;
+
+    memcpy(&f->data[offset], buf, size);
+
+    if (offset + size > f->size)
+        f->size = offset + size;
+
+    return size;
+}
+
+static ssize_t mem_size(void *priv)
+{
+    return ((struct mem_file *)priv)->size;
+}
+
+static int mem_sync(void *priv)
+{
+    ((struct mem_file *)priv)->syncs++;
+    return BPAK_OK;
+}
+
+static const uint8_t *mem_map(size_t *size, void *priv)
+{
+    struct mem_file *f = (struct mem_file *)priv;
+
+    *size = f->size;
+    return f->data;
+}
+
+static const struct bpak_pkg_io mem_io = {
+    .read_at = mem_read_at,
+    .write_at = mem_write_at,
+    .size = mem_size,
+    .sync = mem_sync,
+};
+
+static const struct bpak_pkg_io mem_io_mapped = {
+    .read_at = mem_read_at,
+    .size = mem_size,
+    .map = mem_map,
+};
+
+static struct mem_file mem;
+static struct mem_file mem_ref;
+
+TEST(pkg_io_memory_backend)
+{
+    int rc;
+    struct bpak_package pkg;
+    struct bpak_key *key = NULL;
+    uint8_t data[3000];
+    uint8_t extracted[sizeof(data) + 1];
+    const uint8_t *view = NULL;
+    size_t view_size = 0;
+    FILE *fp;
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (i * 31) ^ (i >> 7);
+
+    fp = fopen("test_pkg_io_data.bin", "wb");
+    ASSERT(fp != NULL);
+    fwrite(data, 1, sizeof(data), fp);
+    fclose(fp);
+
+    /* A new header is written to an empty backend */
+    memset(&mem, 0, sizeof(mem));
+    rc = bpak_pkg_open_io(&pkg, &mem_io, &mem);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(mem.size, sizeof(struct bpak_header));
+
+    pkg.header.hash_kind = BPAK_HASH_SHA256;
+    pkg.header.signature_kind = BPAK_SIGN_PRIME256v1;
+
+    rc = bpak_pkg_add_file(&pkg, "test_pkg_io_data.bin", "data", 0);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(mem.size, sizeof(struct bpak_header) + 3072);
+    ASSERT_MEMORY(&mem.data[sizeof(struct bpak_header)], data, sizeof(data));
+
+    rc = bpak_pkg_sign(&pkg, TEST_SRC_DIR "/secp256r1-key-pair.pem");
+    ASSERT_EQ(rc, BPAK_OK);
+
+    /* Parts can only be deleted from files */
+    rc = bpak_pkg_delete_part(&pkg, bpak_id("data"), false);
+    ASSERT_EQ(rc, -BPAK_NOT_SUPPORTED);
+
+    rc = bpak_pkg_close(&pkg);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT(mem.syncs > 0);
+
+    /* Verify and extract through read_at */
+    rc = bpak_crypto_load_public_key(TEST_SRC_DIR "/secp256r1-pub-key.der",
+                                     &key);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_open_io(&pkg, &mem_io, &mem);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_pkg_verify(&pkg, key), BPAK_OK);
+    ASSERT_EQ(bpak_pkg_verify_jobs(&pkg, key, 4), BPAK_OK);
+
+    rc = bpak_pkg_extract_file(&pkg,
+                               bpak_id("data"),
+                               "test_pkg_io_extracted.bin");
+    ASSERT_EQ(rc, BPAK_OK);
+    bpak_pkg_close(&pkg);
+
+    fp = fopen("test_pkg_io_extracted.bin", "rb");
+    ASSERT(fp != NULL);
+    ASSERT_EQ(fread(extracted, 1, sizeof(extracted), fp), sizeof(data));
+    fclose(fp);
+    ASSERT_MEMORY(extracted, data, sizeof(data));
+
+    /* A read-only backend with a mapping */
+    rc = bpak_pkg_open_io(&pkg, &mem_io_mapped, &mem);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_pkg_verify(&pkg, key), BPAK_OK);
+
+    rc = bpak_pkg_part_view(&pkg, bpak_id("data"), &view, &view_size);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(view_size, sizeof(data));
+    ASSERT_MEMORY(view, data, sizeof(data));
+
+    rc = bpak_pkg_write_header(&pkg);
+    ASSERT_EQ(rc, -BPAK_NOT_SUPPORTED);
+    bpak_pkg_close(&pkg);
+
+    free(key);
+}
+
+/* Add two parts with digests to the package in 'f', in a deferred session
+ * or with a hash update after every edit */
+static void pkg_io_add_parts(struct mem_file *f, bool deferred)
+{
+    int rc;
+    struct bpak_package pkg;
+    unsigned int reads;
+
+    memset(f, 0, sizeof(*f));
+    rc = bpak_pkg_open_io(&pkg, &mem_io, f);
+    ASSERT_EQ(rc, BPAK_OK);
+    pkg.header.hash_kind = BPAK_HASH_SHA256;
+
+    if (deferred)
+        ASSERT_EQ(bpak_pkg_defer_hash(&pkg), BPAK_OK);
+
+    reads = f->reads;
+    rc = bpak_pkg_add_file(&pkg, "test_pkg_io_data.bin", "a", 0);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_pkg_add_part_digests(&pkg);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_pkg_write_header(&pkg), BPAK_OK);
+    rc = bpak_pkg_add_file(&pkg, "test_pkg_io_data.bin", "b", 0);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_pkg_add_part_digests(&pkg);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_pkg_write_header(&pkg), BPAK_OK);
+
+    if (deferred) {
+        /* The edits never read the payload */
+        ASSERT_EQ(f->reads, reads);
+        ASSERT_EQ(bpak_pkg_commit(&pkg, false), BPAK_OK);
+    }
+
+    ASSERT_EQ(bpak_pkg_close(&pkg), BPAK_OK);
+}
+
+TEST(pkg_io_deferred_hash)
+{
+    int rc;
+    struct bpak_package pkg;
+    unsigned int reads;
+
+    pkg_io_add_parts(&mem_ref, false);
+    pkg_io_add_parts(&mem, true);
+    ASSERT_EQ(mem.size, mem_ref.size);
+    ASSERT_MEMORY(mem.data, mem_ref.data, mem.size);
+
+    /* Only the digest of the new part is computed */
+    rc = bpak_pkg_open_io(&pkg, &mem_io, &mem);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_pkg_defer_hash(&pkg), BPAK_OK);
+    rc = bpak_pkg_add_file(&pkg, "test_pkg_io_data.bin", "c", 0);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_pkg_add_part_digests(&pkg);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_pkg_write_header(&pkg), BPAK_OK);
+
+    reads = mem.reads;
+    ASSERT_EQ(bpak_pkg_commit(&pkg, true), BPAK_OK);
+    ASSERT(mem.reads > reads);
+    bpak_pkg_close(&pkg);
+
+    rc = bpak_pkg_open_io(&pkg, &mem_io, &mem_ref);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_pkg_add_file(&pkg, "test_pkg_io_data.bin", "c", 0);
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_pkg_add_part_digests(&pkg);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_pkg_write_header(&pkg), BPAK_OK);
+    bpak_pkg_close(&pkg);
+
+    ASSERT_EQ(mem.size, mem_ref.size);
+    ASSERT_MEMORY(mem.data, mem_ref.data, mem.size);
+}
+
+/* Payload of several read-ahead buffers, reads past 'big_limit' fail */
+static uint8_t big_data[1100 * 1024 + 123];
+static size_t big_limit;
+
+static ssize_t big_read(off_t offset, uint8_t *buf, size_t size, void *priv)
+{
+    (void)priv;
+
+    if ((size_t)offset + size > big_limit)
+        return -BPAK_READ_ERROR;
+
+    memcpy(buf, &big_data[offset], size);
+    return size;
+}
+
+TEST(pkg_io_pipelined_hash)
+{
+    int rc;
+    struct bpak_header header;
+    struct bpak_part_header *part = NULL;
+    struct bpak_hash_context hash;
+    uint8_t expected[32];
+    uint8_t output[32];
+    size_t expected_size = sizeof(expected);
+    size_t output_size = sizeof(output);
+    size_t a_size = 300 * 1024 + 7;
+    size_t b_size = 4096;
+
+    for (size_t i = 0; i < sizeof(big_data); i++)
+        big_data[i] = (i * 31) ^ (i >> 11);
+
+    bpak_init_header(&header);
+    header.hash_kind = BPAK_HASH_SHA256;
+
+    ASSERT_EQ(bpak_add_part(&header, bpak_id("a"), &part), BPAK_OK);
+    part->size = a_size;
+    ASSERT_EQ(bpak_add_part(&header, bpak_id("b"), &part), BPAK_OK);
+    part->size = b_size;
+    part->flags |= BPAK_FLAG_EXCLUDE_FROM_HASH;
+    ASSERT_EQ(bpak_add_part(&header, bpak_id("c"), &part), BPAK_OK);
+    part->size = sizeof(big_data) - a_size - b_size;
+
+    /* The excluded part in the middle is skipped */
+    ASSERT_EQ(bpak_hash_init(&hash, BPAK_HASH_SHA256), BPAK_OK);
+    ASSERT_EQ(bpak_hash_update(&hash, big_data, a_size), BPAK_OK);
+    ASSERT_EQ(bpak_hash_update(&hash,
+                               &big_data[a_size + b_size],
+                               sizeof(big_data) - a_size - b_size),
+              BPAK_OK);
+    ASSERT_EQ(bpak_hash_final(&hash, expected, expected_size, &expected_size),
+              BPAK_OK);
+    bpak_hash_free(&hash);
+
+    big_limit = sizeof(big_data);
+    rc = bpak_verify_compute_payload_hash(&header,
+                                          big_read,
+                                          0,
+                                          NULL,
+                                          output,
+                                          &output_size);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(output_size, expected_size);
+    ASSERT_MEMORY(output, expected, expected_size);
+
+    /* A read error in the middle of the payload stops the hash */
+    big_limit = 700 * 1024;
+    output_size = sizeof(output);
+    rc = bpak_verify_compute_payload_hash(&header,
+                                          big_read,
+                                          0,
+                                          NULL,
+                                          output,
+                                          &output_size);
+    ASSERT_EQ(rc, -BPAK_READ_ERROR);
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/pkg.h>
+#include <bpak/id.h>
+#include <bpak/utils.h>
+#include <bpak/crypto.h>
+#include "nala.h"
+
+static uint8_t data[5000];
+
+static void write_test_file(const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (i * 13) ^ (i >> 8);
+
+    fwrite(data, 1, sizeof(data), fp);
+    fclose(fp);
+}
+
+static void create_package(const char *filename)
+{
+    int rc;
+    struct bpak_pkg_builder builder;
+
+    write_test_file("test_pkg_mmap_data.bin");
+
+    rc = bpak_pkg_builder_init(&builder,
+                               filename,
+                               BPAK_HASH_SHA256,
+                               BPAK_SIGN_PRIME256v1,
+                               false);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_add_file(&builder,
+                                   "test_pkg_mmap_data.bin",
+                                   "data",
+                                   0);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_finish(&builder,
+                                 TEST_SRC_DIR "/secp256r1-key-pair.pem");
+    ASSERT_EQ(rc, BPAK_OK);
+    bpak_pkg_builder_free(&builder);
+}
+
+TEST(pkg_mmap_part_view)
+{
+    int rc;
+    struct bpak_package pkg;
+    const uint8_t *view = NULL;
+    size_t view_size = 0;
+    uint8_t hash[32];
+    uint8_t mapped_hash[32];
+
+    create_package("test_pkg_mmap.bpak");
+
+    /* Views need a mapping */
+    rc = bpak_pkg_open(&pkg, "test_pkg_mmap.bpak", "rb");
+    ASSERT_EQ(rc, BPAK_OK);
+    rc = bpak_pkg_part_view(&pkg, bpak_id("data"), &view, &view_size);
+    ASSERT_EQ(rc, -BPAK_NOT_SUPPORTED);
+    rc = bpak_pkg_part_sha256(&pkg, hash, sizeof(hash), bpak_id("data"));
+    ASSERT_EQ(rc, BPAK_OK);
+    bpak_pkg_close(&pkg);
+
+    rc = bpak_pkg_open_mmap(&pkg, "test_pkg_mmap.bpak");
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_part_view(&pkg, bpak_id("data"), &view, &view_size);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(view_size, sizeof(data));
+    ASSERT_MEMORY(view, data, sizeof(data));
+
+    rc = bpak_pkg_part_view(&pkg, bpak_id("missing"), &view, &view_size);
+    ASSERT_EQ(rc, -BPAK_NOT_FOUND);
+
+    rc = bpak_pkg_part_sha256(&pkg,
+                              mapped_hash,
+                              sizeof(mapped_hash),
+                              bpak_id("data"));
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_MEMORY(mapped_hash, hash, sizeof(hash));
+
+    bpak_pkg_close(&pkg);
+    ASSERT_EQ(pkg.map, NULL);
+}
+
+TEST(pkg_mmap_verify_and_extract)
+{
+    int rc;
+    struct bpak_package pkg;
+    struct bpak_key *key = NULL;
+    uint8_t extracted[sizeof(data) + 1];
+    FILE *fp;
+
+    create_package("test_pkg_mmap2.bpak");
+
+    rc = bpak_crypto_load_public_key(TEST_SRC_DIR "/secp256r1-pub-key.der",
+                                     &key);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_open_mmap(&pkg, "test_pkg_mmap2.bpak");
+    ASSERT_EQ(rc, BPAK_OK);
+
+    ASSERT_EQ(bpak_pkg_verify(&pkg, key), BPAK_OK);
+    ASSERT_EQ(bpak_pkg_verify_jobs(&pkg, key, 4), BPAK_OK);
+
+    rc = bpak_pkg_extract_file(&pkg,
+                               bpak_id("data"),
+                               "test_pkg_mmap_extracted.bin");
+    ASSERT_EQ(rc, BPAK_OK);
+
+    fp = fopen("test_pkg_mmap_extracted.bin", "rb");
+    ASSERT(fp != NULL);
+    ASSERT_EQ(fread(extracted, 1, sizeof(extracted), fp), sizeof(data));
+    fclose(fp);
+    ASSERT_MEMORY(extracted, data, sizeof(data));
+
+    free(key);
+    bpak_pkg_close(&pkg);
+}
+
+TEST(pkg_mmap_header_parse)
+{
+    int rc;
+    struct bpak_package pkg;
+    struct bpak_header hdr;
+    struct bpak_header table;
+    static uint8_t buffer[3 * sizeof(struct bpak_header) + 1];
+
+    create_package("test_pkg_mmap3.bpak");
+
+    rc = bpak_pkg_open_mmap(&pkg, "test_pkg_mmap3.bpak");
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_header_parse(&hdr, pkg.map, pkg.map_size);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_MEMORY(&hdr, &pkg.header, sizeof(hdr));
+    ASSERT_EQ(bpak_tables_parse(&hdr, NULL, pkg.map, sizeof(hdr)), BPAK_OK);
+
+    rc = bpak_header_parse(&hdr, pkg.map, sizeof(hdr) - 1);
+    ASSERT_EQ(rc, -BPAK_SIZE_ERROR);
+    bpak_pkg_close(&pkg);
+
+    /* A header with a table, at an odd address */
+    bpak_init_header(&hdr);
+    hdr.magic = BPAK_HEADER_MAGIC_EXT;
+    hdr.table_count = 1;
+    bpak_init_table(&table);
+    memcpy(&buffer[1], &hdr, sizeof(hdr));
+    memcpy(&buffer[1 + sizeof(hdr)], &table, sizeof(table));
+    memset(&hdr, 0, sizeof(hdr));
+    memset(&table, 0, sizeof(table));
+
+    rc = bpak_header_parse(&hdr, &buffer[1], sizeof(buffer) - 1);
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(bpak_header_size(&hdr), 2 * sizeof(hdr));
+
+    rc = bpak_tables_parse(&hdr, &table, &buffer[1], sizeof(hdr));
+    ASSERT_EQ(rc, -BPAK_SIZE_ERROR);
+    rc = bpak_tables_parse(&hdr, &table, &buffer[1], 2 * sizeof(hdr));
+    ASSERT_EQ(rc, BPAK_OK);
+    ASSERT_EQ(table.magic, BPAK_TABLE_MAGIC);
+
+    buffer[1 + sizeof(hdr)] ^= 0xff;
+    rc = bpak_tables_parse(&hdr, &table, &buffer[1], 2 * sizeof(hdr));
+    ASSERT_EQ(rc, -BPAK_BAD_MAGIC);
+}
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+import sys
+import os
+import threading
+srcdir = sys.argv[1] + "/test"
+sys.path.insert(0, "../python/")
+import bpak
+
+def log_callback(level, message):
+    print("LOG: %i, %s"%(level, message), end='')
+
+bpak.set_log_func(log_callback)
+
+data_a = os.urandom(64 * 1024)
+data_b = os.urandom(12345)
+
+with open("test_python_buffer_a.bin", "wb") as f:
+    f.write(data_a)
+with open("test_python_buffer_b.bin", "wb") as f:
+    f.write(data_b)
+
+# Create and sign two packages concurrently, the calls release the GIL
+def create_package(name):
+    with bpak.Package(name, "wb+") as p:
+        p.hash_kind = bpak.HASH_SHA256
+        p.signature_kind = bpak.SIGN_PRIME256v1
+        p.key_id = bpak.id("pb-development")
+        p.keystore_id = bpak.id("pb-internal")
+        p.add_file("a", "test_python_buffer_a.bin")
+        p.add_file("b", "test_python_buffer_b.bin")
+        assert p.sign(f"{srcdir}/secp256r1-key-pair.pem")
+
+names = ["test_python_buffer_%i.bpak" % (i) for i in range(4)]
+threads = [threading.Thread(target=create_package, args=(n,)) for n in names]
+
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+
+for name in names:
+    with bpak.Package(name, "rb") as p:
+        assert p.verify(f"{srcdir}/secp256r1-pub-key.pem")
+
+# Zero-copy access to the part data
+with bpak.Package(names[0], "rb", mmap=True) as p:
+    a = p.get_part(bpak.id("a"))
+    b = p.get_part(bpak.id("b"))
+
+    view = a.data
+    assert view.readonly
+    assert len(view) == len(data_a)
+    assert view == data_a
+
+    with memoryview(b) as view_b:
+        assert bytes(view_b) == data_b
+        assert bytes(view_b) == b.read_data()
+
+    # The mapping can't go away while a buffer is exported
+    try:
+        p.close()
+        assert False
+    except BufferError:
+        pass
+
+    view.release()
+    assert p.verify(f"{srcdir}/secp256r1-pub-key.pem")
+
+# Buffers need a mapped package and the mapping is read-only
+with bpak.Package(names[0], "rb") as p:
+    try:
+        memoryview(p.get_part(bpak.id("a")))
+        assert False
+    except BufferError:
+        pass
+
+try:
+    bpak.Package(names[0], "rb+", mmap=True)
+    assert False
+except ValueError:
+    pass
+
+print("Test end")
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+import sys
+import os
+srcdir = sys.argv[1] + "/test"
+sys.path.insert(0, "../python/")
+import bpak
+
+def log_callback(level, message):
+    print("LOG: %i, %s"%(level, message), end='')
+
+bpak.set_log_func(log_callback)
+
+with open("test_python_headers_a.bin", "wb") as f:
+    f.write(os.urandom(10000))
+
+# A package with a few parts and one with more parts than the header holds,
+# which get a continuation table
+names = ["test_python_headers_%i.bpak" % (i) for i in range(2)]
+
+for name, count in zip(names, [3, 40]):
+    with bpak.Package(name, "wb+") as p:
+        p.key_id = bpak.id("pb-development")
+        p.keystore_id = bpak.id("pb-internal")
+        p.add_meta(bpak.id("pb-version"), 0, b"1.2.3")
+        for i in range(count):
+            p.add_file("part%i" % (i), "test_python_headers_a.bin")
+
+with open("test_python_headers_bad.bpak", "wb") as f:
+    f.write(os.urandom(4096))
+
+paths = names + ["test_python_headers_bad.bpak",
+                 "test_python_headers_missing.bpak"]
+headers = bpak.read_headers(paths)
+
+assert len(headers) == 4
+assert headers[2] is None
+assert headers[3] is None
+
+for name, header, count in zip(names, headers, [3, 40]):
+    with bpak.Package(name, "rb") as p:
+        assert header["key_id"] == p.key_id
+        assert header["keystore_id"] == p.keystore_id
+        assert header["hash_kind"] == p.hash_kind
+        assert len(header["payload_hash"]) == 32
+        with open(name, "rb") as f:
+            assert header["payload_hash"] in f.read(4096)
+        assert header["size"] == p.size
+        assert header["installed_size"] == p.installed_size
+        assert len(header["parts"]) == count
+
+        # Part objects only see the parts in the header
+        for part in header["parts"][:3]:
+            assert part["offset"] == p.get_part(part["id"]).offset
+            assert part["size"] == p.get_part(part["id"]).size
+
+        meta = [m for m in header["meta"] if m["id"] == bpak.id("pb-version")]
+        assert meta[0]["data"] == b"1.2.3"
+
+assert headers[1]["parts"][39]["id"] == bpak.id("part39")
+assert bpak.read_headers([]) == []
+
+print("Test end")
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+import sys
+import os
+import uuid
+import concurrent.futures
+srcdir = sys.argv[1] + "/test"
+sys.path.insert(0, "../python/")
+import bpak
+
+PKG_UUID = uuid.UUID("0888b0fa-9c48-4524-9845-06a641b61edd")
+PAIRS = 3
+
+def create_package(name, p0, p1):
+    with bpak.Package(name, "wb+") as p:
+        p.hash_kind = bpak.HASH_SHA256
+        p.signature_kind = bpak.SIGN_PRIME256v1
+        p.key_id = bpak.id("pb-development")
+        p.keystore_id = bpak.id("pb-internal")
+        p.add_meta(bpak.id("bpak-package"), data=PKG_UUID.bytes)
+        p.add_transport_meta(bpak.id("p0"),
+                             bpak.id("bsdiff-lzma"),
+                             bpak.id("bspatch-lzma"),
+                             lzma_preset=1,
+                             lzma_bcj=bpak.LZMA_BCJ_NONE)
+        p.add_transport_meta(bpak.id("p1"),
+                             bpak.id("bsdiff"),
+                             bpak.id("bspatch"),
+                             bsdiff_copy=True)
+        p.add_file("p0", f"{srcdir}/{p0}")
+        p.add_file("p1", f"{srcdir}/{p1}")
+        assert p.sign(f"{srcdir}/secp256r1-key-pair.pem")
+
+def name(kind, i):
+    return f"test_python_transport_pool_{kind}{i}.bpak"
+
+def encode(i):
+    with bpak.Package(name("origin", i), "rb") as origin, \
+         bpak.Package(name("target", i), "rb") as target, \
+         bpak.Package(name("patch", i), "wb+") as patch:
+        return bpak.transport_encode(target, patch, origin, jobs=2)
+
+def decode(i):
+    with bpak.Package(name("origin", i), "rb") as origin, \
+         bpak.Package(name("patch", i), "rb") as patch, \
+         bpak.Package(name("install", i), "wb+") as install:
+        return bpak.transport_decode(patch, install, origin,
+                                     buffer_size=8192)
+
+for i in range(PAIRS):
+    create_package(name("origin", i), "diff2_origin.bin", "diff3_origin.bin")
+    create_package(name("target", i), "diff2_target.bin", "diff3_target.bin")
+
+try:
+    with bpak.Package(name("target", 0), "rb+") as p:
+        p.add_transport_meta(bpak.id("p0"), 0, 0, lzma_preset=1,
+                             hs_window=8)
+    assert False
+except ValueError:
+    pass
+
+with concurrent.futures.ThreadPoolExecutor(max_workers=PAIRS) as pool:
+    encode_stats = list(pool.map(encode, range(PAIRS)))
+
+with concurrent.futures.ThreadPoolExecutor(max_workers=PAIRS) as pool:
+    decode_stats = list(pool.map(decode, range(PAIRS)))
+
+for i in range(PAIRS):
+    print(f"Encode {i}: {encode_stats[i]}")
+    print(f"Decode {i}: {decode_stats[i]}")
+
+    assert sorted(s["part_id"] for s in encode_stats[i]) == \
+        sorted([bpak.id("p0"), bpak.id("p1")])
+    assert len(decode_stats[i]) == 2
+
+    for s in encode_stats[i] + decode_stats[i]:
+        assert s["bytes_out"] > 0
+        assert s["elapsed"] >= s["codec"] >= 0.0
+
+    with open(name("target", i), "rb") as f:
+        target = f.read()
+    with open(name("install", i), "rb") as f:
+        assert f.read() == target
+
+print("Test end")
@@ -0,0 +1,191 @@
+#include <string.h>
+#include <stdlib.h>
+#include <bpak/bpak.h>
+#include <bpak/crypto.h>
+#include "nala.h"
+
+/* Digests of the FIPS 180-2 example messages */
+static const uint8_t sha256_abc[] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde,
+    0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+    0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+};
+
+static const uint8_t sha384_abc[] = {
+    0xcb, 0x00, 0x75, 0x3f, 0x45, 0xa3, 0x5e, 0x8b, 0xb5, 0xa0, 0x3d, 0x69,
+    0x9a, 0xc6, 0x50, 0x07, 0x27, 0x2c, 0x32, 0xab, 0x0e, 0xde, 0xd1, 0x63,
+    0x1a, 0x8b, 0x60, 0x5a, 0x43, 0xff, 0x5b, 0xed, 0x80, 0x86, 0x07, 0x2b,
+    0xa1, 0xe7, 0xcc, 0x23, 0x58, 0xba, 0xec, 0xa1, 0x34, 0xc8, 0x25, 0xa7,
+};
+
+static const uint8_t sha512_abc[] = {
+    0xdd, 0xaf, 0x35, 0xa1, 0x93, 0x61, 0x7a, 0xba, 0xcc, 0x41, 0x73, 0x49,
+    0xae, 0x20, 0x41, 0x31, 0x12, 0xe6, 0xfa, 0x4e, 0x89, 0xa9, 0x7e, 0xa2,
+    0x0a, 0x9e, 0xee, 0xe6, 0x4b, 0x55, 0xd3, 0x9a, 0x21, 0x92, 0x99, 0x2a,
+    0x27, 0x4f, 0xc1, 0xa8, 0x36, 0xba, 0x3c, 0x23, 0xa3, 0xfe, 0xeb, 0xbd,
+    0x45, 0x4d, 0x44, 0x23, 0x64, 0x3c, 0xe8, 0x0e, 0x2a, 0x9a, 0xc9, 0x4f,
+    0xa5, 0x4c, 0xa4, 0x9f,
+};
+
+static const uint8_t sha256_two_block[] = {
+    0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93,
+    0x0c, 0x3e, 0x60, 0x39, 0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+    0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1,
+};
+
+static const uint8_t sha384_two_block[] = {
+    0x33, 0x91, 0xfd, 0xdd, 0xfc, 0x8d, 0xc7, 0x39, 0x37, 0x07, 0xa6, 0x5b,
+    0x1b, 0x47, 0x09, 0x39, 0x7c, 0xf8, 0xb1, 0xd1, 0x62, 0xaf, 0x05, 0xab,
+    0xfe, 0x8f, 0x45, 0x0d, 0xe5, 0xf3, 0x6b, 0xc6, 0xb0, 0x45, 0x5a, 0x85,
+    0x20, 0xbc, 0x4e, 0x6f, 0x5f, 0xe9, 0x5b, 0x1f, 0xe3, 0xc8, 0x45, 0x2b,
+};
+
+static const uint8_t sha512_two_block[] = {
+    0x20, 0x4a, 0x8f, 0xc6, 0xdd, 0xa8, 0x2f, 0x0a, 0x0c, 0xed, 0x7b, 0xeb,
+    0x8e, 0x08, 0xa4, 0x16, 0x57, 0xc1, 0x6e, 0xf4, 0x68, 0xb2, 0x28, 0xa8,
+    0x27, 0x9b, 0xe3, 0x31, 0xa7, 0x03, 0xc3, 0x35, 0x96, 0xfd, 0x15, 0xc1,
+    0x3b, 0x1b, 0x07, 0xf9, 0xaa, 0x1d, 0x3b, 0xea, 0x57, 0x78, 0x9c, 0xa0,
+    0x31, 0xad, 0x85, 0xc7, 0xa7, 0x1d, 0xd7, 0x03, 0x54, 0xec, 0x63, 0x12,
+    0x38, 0xca, 0x34, 0x45,
+};
+
+static const uint8_t sha256_million_a[] = {
+    0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92, 0x81, 0xa1, 0xc7, 0xe2,
+    0x84, 0xd7, 0x3e, 0x67, 0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e,
+    0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0,
+};
+
+static const uint8_t sha384_million_a[] = {
+    0x9d, 0x0e, 0x18, 0x09, 0x71, 0x64, 0x74, 0xcb, 0x08, 0x6e, 0x83, 0x4e,
+    0x31, 0x0a, 0x4a, 0x1c, 0xed, 0x14, 0x9e, 0x9c, 0x00, 0xf2, 0x48, 0x52,
+    0x79, 0x72, 0xce, 0xc5, 0x70, 0x4c, 0x2a, 0x5b, 0x07, 0xb8, 0xb3, 0xdc,
+    0x38, 0xec, 0xc4, 0xeb, 0xae, 0x97, 0xdd, 0xd8, 0x7f, 0x3d, 0x89, 0x85,
+};
+
+static const uint8_t sha512_million_a[] = {
+    0xe7, 0x18, 0x48, 0x3d, 0x0c, 0xe7, 0x69, 0x64, 0x4e, 0x2e, 0x42, 0xc7,
+    0xbc, 0x15, 0xb4, 0x63, 0x8e, 0x1f, 0x98, 0xb1, 0x3b, 0x20, 0x44, 0x28,
+    0x56, 0x32, 0xa8, 0x03, 0xaf, 0xa9, 0x73, 0xeb, 0xde, 0x0f, 0xf2, 0x44,
+    0x87, 0x7e, 0xa6, 0x0a, 0x4c, 0xb0, 0x43, 0x2c, 0xe5, 0x77, 0xc3, 0x1b,
+    0xeb, 0x00, 0x9c, 0x5c, 0x2c, 0x49, 0xaa, 0x2e, 0x4e, 0xad, 0xb2, 0x17,
+    0xad, 0x8c, 0xc0, 0x9b,
+};
+
+static const char *two_block =
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+static size_t hash_size(enum bpak_hash_kind kind)
+{
+    switch (kind) {
+    case BPAK_HASH_SHA256:
+        return 32;
+    case BPAK_HASH_SHA384:
+        return 48;
+    default:
+        return 64;
+    }
+}
+
+/* Hash 'data' in chunks of 'chunk' bytes, with and without the CPU
+ * accelerated code of the built-in backend */
+static void check_hash(enum bpak_hash_kind kind, const uint8_t *data,
+                       size_t length, size_t chunk, const uint8_t *expected)
+{
+    struct bpak_hash_context hash;
+    uint8_t result[64];
+    size_t result_length;
+
+    for (int accel = 0; accel < 2; accel++) {
+#if BPAK_CONFIG_SHA == 1
+        bpak_sha_set_acceleration(accel);
+#endif
+        ASSERT_EQ(bpak_hash_init(&hash, kind), BPAK_OK);
+
+        for (size_t pos = 0; pos < length; pos += chunk) {
+            ASSERT_EQ(bpak_hash_update(&hash, &data[pos],
+                                       BPAK_MIN(chunk, length - pos)),
+                      BPAK_OK);
+        }
+
+        ASSERT_EQ(bpak_hash_final(&hash, result, sizeof(result),
+                                  &result_length),
+                  BPAK_OK);
+        bpak_hash_free(&hash);
+
+        ASSERT_EQ(result_length, hash_size(kind));
+        ASSERT_MEMORY(result, expected, result_length);
+    }
+
+#if BPAK_CONFIG_SHA == 1
+    bpak_sha_set_acceleration(true);
+#endif
+}
+
+TEST(sha_abc)
+{
+    const uint8_t *data = (const uint8_t *)"abc";
+
+    check_hash(BPAK_HASH_SHA256, data, 3, 3, sha256_abc);
+    check_hash(BPAK_HASH_SHA384, data, 3, 3, sha384_abc);
+    check_hash(BPAK_HASH_SHA512, data, 3, 3, sha512_abc);
+}
+
+TEST(sha_two_block)
+{
+    const uint8_t *data = (const uint8_t *)two_block;
+    size_t length = strlen(two_block);
+
+    check_hash(BPAK_HASH_SHA256, data, length, length, sha256_two_block);
+    check_hash(BPAK_HASH_SHA384, data, length, 1, sha384_two_block);
+    check_hash(BPAK_HASH_SHA512, data, length, 7, sha512_two_block);
+}
+
+TEST(sha_million_a)
+{
+    size_t length = 1000000;
+    uint8_t *data = malloc(length);
+
+    ASSERT_NE(data, NULL);
+    memset(data, 'a', length);
+
+    /* Odd chunks make updates start and end in the middle of blocks */
+    check_hash(BPAK_HASH_SHA256, data, length, 1000, sha256_million_a);
+    check_hash(BPAK_HASH_SHA256, data, length, 4093, sha256_million_a);
+    check_hash(BPAK_HASH_SHA384, data, length, 4093, sha384_million_a);
+    check_hash(BPAK_HASH_SHA512, data, length, 129, sha512_million_a);
+    free(data);
+}
+
+TEST(sha_small_buffer)
+{
+    struct bpak_hash_context hash;
+    uint8_t result[64];
+
+    ASSERT_EQ(bpak_hash_init(&hash, BPAK_HASH_SHA512), BPAK_OK);
+    ASSERT_EQ(bpak_hash_final(&hash, result, 32, NULL), -BPAK_SIZE_ERROR);
+    bpak_hash_free(&hash);
+}
+
+TEST(sha_clone)
+{
+    struct bpak_hash_context salted;
+    struct bpak_hash_context hash;
+    uint8_t result[32];
+    const uint8_t *data = (const uint8_t *)two_block;
+
+    /* Both copies continue from the state after the first 20 bytes */
+    ASSERT_EQ(bpak_hash_init(&salted, BPAK_HASH_SHA256), BPAK_OK);
+    ASSERT_EQ(bpak_hash_update(&salted, data, 20), BPAK_OK);
+
+    for (int i = 0; i < 2; i++) {
+        ASSERT_EQ(bpak_hash_clone(&hash, &salted), BPAK_OK);
+        ASSERT_EQ(bpak_hash_update(&hash, &data[20], strlen(two_block) - 20),
+                  BPAK_OK);
+        ASSERT_EQ(bpak_hash_final(&hash, result, sizeof(result), NULL),
+                  BPAK_OK);
+        bpak_hash_free(&hash);
+        ASSERT_MEMORY(result, sha256_two_block, sizeof(result));
+    }
+
+    bpak_hash_free(&salted);
+}
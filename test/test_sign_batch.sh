@@ -0,0 +1,84 @@
+#!/bin/bash
+# Test: test_sign_batch
+#
+# Description: This test signs several archives with one bpak sign --batch
+#  call, sequentially and on several threads, and verifies every archive.
+#
+# Purpose: To ensure that batch signing produces the same valid signatures
+#  as signing the archives one by one.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_sign_batch
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -e
+
+$BPAK --version
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+IMGS=""
+
+for n in 1 2 3 4 5 6; do
+    IMG=${TEST_NAME}_$n.bpak
+
+    create_data ${TEST_NAME}_data_$n.bin 32
+
+    $BPAK create $IMG -Y $V
+    $BPAK add $IMG --meta bpak-package --from-string $PKG_UUID \
+                   --encoder uuid $V
+    $BPAK add $IMG --part fs \
+                   --from-file ${TEST_NAME}_data_$n.bin \
+                   --encoder merkle $V
+    $BPAK set $IMG --key-id pb-development \
+                   --keystore-id pb-internal $V
+
+    IMGS="$IMGS $IMG"
+done
+
+verify_all() {
+    for IMG in $IMGS; do
+        $BPAK verify $IMG --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+    done
+}
+
+echo SIGN
+$BPAK sign --batch $IMGS --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+verify_all
+
+$BPAK sign --batch $IMGS --key $TEST_SRC_DIR/secp256r1-key-pair.pem \
+    --jobs 4 --part-digests $V
+verify_all
+
+# Changing a package after signing breaks its signature until it is signed
+# again with the rest of the batch
+$BPAK set ${TEST_NAME}_2.bpak --key-id pb-development2 $V
+
+set +e
+$BPAK verify ${TEST_NAME}_2.bpak --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+result_code=$?
+set -e
+
+if [ $result_code -eq 0 ]; then
+    exit 1
+fi
+
+$BPAK sign --batch $IMGS --key $TEST_SRC_DIR/secp256r1-key-pair.pem \
+    --jobs 0 $V
+verify_all
+
+# A missing file fails the batch
+set +e
+$BPAK sign --batch $IMGS ${TEST_NAME}_missing.bpak \
+    --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+result_code=$?
+set -e
+
+if [ $result_code -eq 0 ]; then
+    exit 1
+fi
+
+echo $TEST_NAME End
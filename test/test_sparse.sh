@@ -0,0 +1,130 @@
+#!/bin/bash
+# Test: test_sparse
+#
+# Description: This test adds parts with large all-zero regions as sparse
+#  parts, with and without a merkle tree, and extracts, verifies and
+#  transport encodes/decodes them.
+#
+# Purpose: To ensure that zero blocks are left out of the package and that
+#  the expanded data, hash tree and signature are the same as for the
+#  dense image.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_sparse
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -e
+
+$BPAK --version
+
+IMG=${TEST_NAME}.bpak
+IMG_D=${TEST_NAME}_dense.bpak
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+DATA=${TEST_NAME}_data.bin
+DATA_O=${TEST_NAME}_data_origin.bin
+SALT=${TEST_NAME}_salt.bin
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+# 64 KiB data, 512 KiB zeros, 64 KiB data and an 8 KiB zero tail, the
+# last block is always stored
+make_image() {
+    rm -f $2
+    exec 3>&2 2>/dev/null
+    dd if=$TEST_SRC_DIR/diff2_origin.bin bs=1024 skip=$1 count=64 >> $2
+    dd if=/dev/zero bs=1024 count=512 >> $2
+    dd if=$TEST_SRC_DIR/diff2_origin.bin bs=1024 skip=$(($1 + 64)) \
+        count=64 >> $2
+    dd if=/dev/zero bs=1024 count=8 >> $2
+    exec 2>&3 3>&-
+}
+
+make_image 0 $DATA
+make_image 1 $DATA_O
+
+# All packages share the salt, so the sparse and the dense hash tree match
+dd if=/dev/urandom of=$SALT bs=32 count=1 status=none
+
+make_package() {
+    $BPAK create $1 -Y $V
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part fs --encoder bsdiff \
+                                       --decoder bspatch $V
+    $BPAK transport $1 --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+    $BPAK add $1 --meta merkle-salt --part-ref fs --from-file $SALT $V
+
+    $BPAK add $1 --part fs \
+                 --from-file $2 \
+                 --set-flag dont-hash \
+                 $3 \
+                 --encoder merkle $V
+
+    $BPAK add $1 --part data \
+                 --from-file $2 \
+                 $3 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+make_package $IMG $DATA "--set-flag sparse"
+make_package $IMG_D $DATA
+make_package $IMG_O $DATA_O "--set-flag sparse"
+
+$BPAK show $IMG $V
+
+# Both parts leave out the 512 KiB zero region
+sparse_size=$(stat -c %s $IMG)
+dense_size=$(stat -c %s $IMG_D)
+
+if [ $sparse_size -gt $((dense_size - 2 * 512 * 1024)) ];
+then
+    echo "Sparse package is too large $sparse_size, dense $dense_size"
+    exit 1
+fi
+
+# The hash tree covers the expanded image
+$BPAK extract $IMG --part fs-hash-tree --output ${TEST_NAME}_tree.bin
+$BPAK extract $IMG_D --part fs-hash-tree --output ${TEST_NAME}_tree_d.bin
+cmp ${TEST_NAME}_tree.bin ${TEST_NAME}_tree_d.bin
+
+for part in fs data
+do
+    $BPAK extract $IMG --part $part --output ${TEST_NAME}_$part.bin
+    cmp ${TEST_NAME}_$part.bin $DATA
+
+    # Extracting to a pipe writes the zero blocks
+    $BPAK extract $IMG --part $part | cmp - $DATA
+done
+
+$BPAK verify $IMG --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+$BPAK verify $IMG --key $TEST_SRC_DIR/secp256r1-pub-key.der --jobs 4 $V
+
+echo --- Transport encoding ---
+$BPAK transport $IMG --encode --origin $IMG_O --output $IMG_P $V
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_P --decode --origin $IMG_O --output $IMG_I $V
+
+first_sha256=$(sha256sum $IMG | cut -d ' ' -f 1)
+second_sha256=$(sha256sum $IMG_I | cut -d ' ' -f 1)
+
+if [ $first_sha256 != $second_sha256  ];
+then
+    echo "SHA comparison failed $first_sha256 != $second_sha256"
+    exit 1
+fi
+
+$BPAK verify $IMG_I --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+
+echo $TEST_NAME End
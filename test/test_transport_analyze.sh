@@ -0,0 +1,89 @@
+#!/bin/bash
+# Test: test_transport_analyze
+#
+# Description: Transport encode an archive with two diffed parts and
+#       analyze the patch
+#
+# Purpose: To test that the analysis accounts for the whole output of
+#       every part and that a single part can be selected
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_analyze
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex -o pipefail
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+LOG_A=${TEST_NAME}_analyze.log
+LOG_R=${TEST_NAME}_analyze_part.log
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK transport $1 --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+    $BPAK add $1 --part p0 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part p1 --from-file $TEST_SRC_DIR/$3 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O diff2_origin.bin diff3_origin.bin
+create_package $IMG_T diff2_target.bin diff3_target.bin
+
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_P
+
+# Analyzing doesn't need the origin and doesn't change the patch
+cp $IMG_P ${IMG_P}.orig
+$BPAK transport $IMG_P --analyze > $LOG_A
+cat $LOG_A
+cmp $IMG_P ${IMG_P}.orig
+
+test $(grep -c "^Part 0x" $LOG_A) -eq 2
+grep "bspatch-lzma" $LOG_A
+grep "bspatch$" $LOG_A
+grep "Regions of 1048576 bytes" $LOG_A
+
+# Diff, extra and copy bytes add up to the output size of each part
+for size in $(stat -c %s $TEST_SRC_DIR/diff2_target.bin \
+                         $TEST_SRC_DIR/diff3_target.bin)
+do
+    padded=$(( (size + 511) / 512 * 512 ))
+    grep "Output size: *$padded bytes" $LOG_A
+done
+
+awk '/Output size/ { out = $3 }
+     /Diff bytes/ { diff = $3 }
+     /Extra bytes/ { extra = $3 }
+     /Copy bytes/ { if (diff + extra + $3 != out) exit 1 }' $LOG_A
+
+$BPAK transport $IMG_P --analyze --part-ref p1 > $LOG_R
+cat $LOG_R
+test $(grep -c "^Part 0x" $LOG_R) -eq 1
+grep "bspatch$" $LOG_R
+
+# The origin package has no transport encoded parts
+if $BPAK transport $IMG_O --analyze; then
+    exit 1
+fi
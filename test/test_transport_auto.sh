@@ -0,0 +1,90 @@
+#!/bin/bash
+# Test: test_transport_auto
+#
+# Description: Encode parts with the auto encoder, with and without an
+#       origin and with decode budgets that rule out some of the encoders
+#
+# Purpose: To test that the auto encoder keeps the smallest encoding that
+#       fits in the budget and that the decoder finds the encoder it picked
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_auto
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+PUB_KEY=$TEST_SRC_DIR/secp256r1-pub-key.der
+BSDIFF_LZMA=0x1607e56e
+COMPRESS_LZMA=0x69bfe1b7
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part p0 --encoder auto $V
+
+    $BPAK add $1 --part p0 --from-file $TEST_SRC_DIR/$2 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+# Encode the target with the options in $1 and the encoder in $2, then
+# check that the decoded package is the signed target
+encode_decode()
+{
+    $BPAK transport $IMG_T --encode --output $IMG_P $1 $V \
+        > ${TEST_NAME}_log.txt 2>&1
+    grep "uses encoder $2" ${TEST_NAME}_log.txt
+
+    $BPAK transport $IMG_P --decode --output $IMG_I $1 $V
+    cmp $IMG_T $IMG_I
+    $BPAK verify $IMG_I --key $PUB_KEY $V
+}
+
+create_package $IMG_O diff2_origin.bin
+create_package $IMG_T diff2_target.bin
+
+# The compressor parameters would only fit one of the encoders
+set +e
+$BPAK transport $IMG_T --add --part p0 --encoder auto --lzma-preset 9 $V
+result_code=$?
+set -e
+test $result_code -ne 0
+
+echo --- Without limits the smallest patch is kept ---
+encode_decode "--origin $IMG_O" $BSDIFF_LZMA
+
+echo --- LZMA is too slow for the target ---
+encode_decode "--origin $IMG_O --decode-rate lzma=1K --decode-time 1000" \
+              0x9f7aacf9
+
+echo --- Heatshrink as well ---
+encode_decode "--origin $IMG_O --decode-rate lzma=1K --decode-rate hs=1K \
+               --decode-time 1000" 0x0a878e3e
+
+echo --- Nothing fits, the fastest decoder is used ---
+encode_decode "--origin $IMG_O --decode-heap 1 --decode-time 1" 0x0a878e3e
+grep "fits the decode budget" ${TEST_NAME}_log.txt
+
+echo --- Without an origin the part is compressed ---
+encode_decode "" $COMPRESS_LZMA
+
+echo $TEST_NAME End
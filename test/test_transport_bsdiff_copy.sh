@@ -0,0 +1,56 @@
+#!/bin/bash
+# Test: test_transport_bsdiff_copy
+#
+# Description: Transport encode parts with the bsdiff copy revision
+#
+# Purpose: Test that patch streams with origin copy tuples decode to the
+#   target, with heatshrink and lzma compression
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_bsdiff_copy
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+set -e
+
+IMG_A=${TEST_NAME}_origin.bpak
+IMG_B=${TEST_NAME}_target.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+DATA_A=${TEST_NAME}_a.bin
+DATA_B=${TEST_NAME}_b.bin
+
+dd if=/dev/urandom of=$DATA_A bs=4096 count=256 status=none
+cp $DATA_A $DATA_B
+dd if=/dev/urandom of=$DATA_B bs=1 count=300 seek=200000 \
+    conv=notrunc status=none
+dd if=/dev/urandom of=$DATA_B bs=1 count=10 seek=700000 \
+    conv=notrunc status=none
+
+create_package() {
+    $BPAK create $1 -Y $V
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+    $BPAK transport $1 --add --part p0 --encoder bsdiff \
+                       --decoder bspatch --bsdiff-copy $V
+    $BPAK transport $1 --add --part p1 --encoder bsdiff-lzma \
+                       --decoder bspatch-lzma --lzma-preset 6 \
+                       --bsdiff-copy $V
+    $BPAK add $1 --part p0 --from-file $2 $V
+    $BPAK add $1 --part p1 --from-file $2 $V
+    $BPAK set $1 --key-id pb-development --keystore-id pb-internal $V
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_A $DATA_A
+create_package $IMG_B $DATA_B
+
+$BPAK transport $IMG_B --encode --origin $IMG_A \
+                       --output ${TEST_NAME}_patch.bpak $V
+
+$BPAK transport ${TEST_NAME}_patch.bpak --decode --origin $IMG_A \
+                       --output ${TEST_NAME}_install.bpak $V
+
+cmp $IMG_B ${TEST_NAME}_install.bpak
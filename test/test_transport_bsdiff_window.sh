@@ -0,0 +1,67 @@
+#!/bin/bash
+# Test: test_transport_bsdiff_window
+#
+# Description: Transport encode a part with a memory budget that is smaller
+#  than the suffix array of its origin
+#
+# Purpose: Test that the origin is diffed in windows, that the patch stays
+#   small when data has moved far from its origin position and that it
+#   decodes to the target
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_bsdiff_window
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+set -e
+
+IMG_A=${TEST_NAME}_origin.bpak
+IMG_B=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+DATA_A=${TEST_NAME}_a.bin
+DATA_B=${TEST_NAME}_b.bin
+
+# 4 MiB origin, the target has the two halves swapped and a few changes
+dd if=/dev/urandom of=$DATA_A bs=4096 count=1024 status=none
+dd if=$DATA_A of=$DATA_B bs=4096 skip=512 status=none
+dd if=$DATA_A bs=4096 count=512 status=none >> $DATA_B
+dd if=/dev/urandom of=$DATA_B bs=1 count=300 seek=200000 \
+    conv=notrunc status=none
+dd if=/dev/urandom of=$DATA_B bs=1 count=10 seek=3000000 \
+    conv=notrunc status=none
+
+create_package() {
+    $BPAK create $1 -Y $V
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+    $BPAK transport $1 --add --part p0 --encoder bsdiff-lzma \
+                       --decoder bspatch-lzma $V
+    $BPAK add $1 --part p0 --from-file $2 $V
+    $BPAK set $1 --key-id pb-development --keystore-id pb-internal $V
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_A $DATA_A
+create_package $IMG_B $DATA_B
+
+$BPAK transport $IMG_B --encode --origin $IMG_A --output $IMG_P \
+                       --memory-budget 8M -vv | tee ${TEST_NAME}_encode.log
+
+grep -q "origin windows of" ${TEST_NAME}_encode.log
+
+patch_size=$(stat -c %s $IMG_P)
+
+if [ $patch_size -gt 65536 ];
+then
+    echo "Windowed patch is too large $patch_size"
+    exit 1
+fi
+
+$BPAK transport $IMG_P --decode --origin $IMG_A --output $IMG_I $V
+
+cmp $IMG_B $IMG_I
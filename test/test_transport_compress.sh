@@ -0,0 +1,108 @@
+#!/bin/bash
+# Test: test_transport_compress
+#
+# Description: Create an archive with parts that are transport encoded with
+#  the compress encoders
+#
+# Purpose: To test that parts can be compressed and decompressed without an
+#  origin, with lzma and heatshrink, and that LZMA blocks decode the same
+#  on several threads
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_compress
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG=${TEST_NAME}.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_data.bin 256
+seq 1 100000 > ${TEST_NAME}_text.bin
+
+$BPAK create $IMG -Y $V
+
+$BPAK add $IMG --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+$BPAK transport $IMG --add --part fs --encoder compress-lzma \
+                                     --decoder decompress-lzma \
+                                     --lzma-bcj none $V
+
+$BPAK transport $IMG --add --part fs-hash-tree \
+                     --encoder remove-data \
+                     --decoder merkle-generate $V
+
+$BPAK transport $IMG --add --part data --encoder compress-lzma \
+                                       --decoder decompress-lzma \
+                                       --lzma-block-size 256K $V
+
+$BPAK transport $IMG --add --part data2 --encoder compress-heatshrink \
+                                        --decoder decompress-heatshrink $V
+
+$BPAK add $IMG --part fs \
+               --from-file ${TEST_NAME}_data.bin \
+               --set-flag dont-hash \
+               --encoder merkle $V
+
+$BPAK add $IMG --part data \
+               --from-file ${TEST_NAME}_text.bin $V
+
+$BPAK add $IMG --part data2 \
+               --from-file ${TEST_NAME}_text.bin $V
+
+$BPAK set $IMG --key-id pb-development \
+               --keystore-id pb-internal $V
+
+$BPAK sign $IMG --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+# Test Transport encoding / decoding, no origin is needed
+echo --- Transport encoding ---
+
+$BPAK transport $IMG --encode --output $IMG_P --jobs 2 $V
+
+patch_size=$(stat -c %s $IMG_P)
+input_size=$(stat -c %s $IMG)
+
+if [ $((patch_size * 2)) -gt $input_size ];
+then
+    echo "Compressed package is too large $patch_size, input $input_size"
+    exit 1
+fi
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_P --decode --output $IMG_I $V
+
+$BPAK compare $IMG $IMG_I $V
+
+first_sha256=$(sha256sum $IMG | cut -d ' ' -f 1)
+second_sha256=$(sha256sum $IMG_I | cut -d ' ' -f 1)
+
+if [ $first_sha256 != $second_sha256  ];
+then
+    echo "SHA comparison failed $first_sha256 != $second_sha256"
+    exit 1
+fi
+
+# The blocks of the data part are decompressed in parallel
+rm -f $IMG_I
+$BPAK transport $IMG_P --decode --output $IMG_I --decode-threads 4 $V
+
+second_sha256=$(sha256sum $IMG_I | cut -d ' ' -f 1)
+
+if [ $first_sha256 != $second_sha256  ];
+then
+    echo "SHA comparison failed $first_sha256 != $second_sha256"
+    exit 1
+fi
+
+$BPAK transport $IMG_P --estimate $V
+$BPAK show $IMG_P $V
@@ -0,0 +1,135 @@
+#!/bin/bash
+# Test: test_transport_decode_stream
+#
+# Description: Create archives with several parts that should be transport
+#       encoded and decode the patch from a pipe
+#
+# Purpose: To test that the stream decoder, including a merkle tree that
+#       is generated from its filesystem part, produces the same package
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_decode_stream
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex -o pipefail
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+# Create origin package
+$BPAK create $IMG_O -Y $V
+
+$BPAK add $IMG_O --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+$BPAK transport $IMG_O --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+$BPAK transport $IMG_O --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+$BPAK transport $IMG_O --add --part fs --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+
+$BPAK transport $IMG_O --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+
+$BPAK add $IMG_O --part p0 \
+                 --from-file $TEST_SRC_DIR/diff2_origin.bin $V
+
+$BPAK add $IMG_O --part p1 \
+                 --from-file $TEST_SRC_DIR/diff2_origin.bin $V
+
+$BPAK add $IMG_O --part fs \
+                 --from-file $TEST_SRC_DIR/diff2_origin.bin \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+$BPAK set $IMG_O --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+$BPAK sign $IMG_O --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+# Create target package
+$BPAK create $IMG_T -Y $V
+
+$BPAK add $IMG_T --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+$BPAK transport $IMG_T --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+$BPAK transport $IMG_T --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+$BPAK transport $IMG_T --add --part fs --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+
+$BPAK transport $IMG_T --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+
+$BPAK add $IMG_T --part p0 \
+                 --from-file $TEST_SRC_DIR/diff2_target.bin $V
+
+$BPAK add $IMG_T --part p1 \
+                 --from-file $TEST_SRC_DIR/diff2_target.bin $V
+
+$BPAK add $IMG_T --part fs \
+                 --from-file $TEST_SRC_DIR/diff2_target.bin \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+$BPAK set $IMG_T --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+$BPAK sign $IMG_T --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+# Test Transport encoding / decoding
+echo --- Transport encoding ---
+
+$BPAK transport $IMG_T --encode --origin $IMG_O \
+                                --output $IMG_P \
+                                $V
+
+echo --- Transport decoding ---
+cat $IMG_P | $BPAK transport - --decode --origin $IMG_O \
+                               --output $IMG_I \
+                               $V
+
+$BPAK compare $IMG_T $IMG_I $V
+cmp $IMG_T $IMG_I
+
+# Buffered output and a decoder buffer that is not a multiple of the pipe
+# reads
+rm $IMG_I
+cat $IMG_P | $BPAK transport - --decode --origin $IMG_O \
+                               --output $IMG_I \
+                               --buffer-size 1000 \
+                               --output-buffer 64K \
+                               $V
+cmp $IMG_T $IMG_I
+
+# A truncated patch must fail
+set +e
+head -c 100000 $IMG_P | $BPAK transport - --decode --origin $IMG_O \
+                                          --output ${TEST_NAME}_short.bpak
+result_code=$?
+set -e
+
+if [ $result_code -eq 0 ];
+then
+    echo "Decoding a truncated patch should fail"
+    exit 1
+fi
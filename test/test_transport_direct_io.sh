@@ -0,0 +1,214 @@
+# Test: test_transport_direct_io
+#
+# Description: Create archives with parts that should be transport encoded/decoded
+#
+# Purpose: To test that patching works with the output buffer, O_DIRECT,
+#          dropping the page cache, aligned write blocks and skipping
+#          unchanged blocks
+#
+
+#!/bin/bash
+BPAK=../src/bpak
+TEST_NAME=test_transport_direct_io
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+# Create origin package
+$BPAK create $IMG_O -Y $V
+
+$BPAK add $IMG_O --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+$BPAK transport $IMG_O --add --part fs --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+
+$BPAK transport $IMG_O --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+
+$BPAK add $IMG_O --part fs \
+                 --from-file $TEST_SRC_DIR/diff2_origin.bin \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+$BPAK set $IMG_O --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+$BPAK sign $IMG_O --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+# Create target package
+$BPAK create $IMG_T -Y $V
+
+$BPAK add $IMG_T --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+$BPAK transport $IMG_T --add --part fs --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+
+$BPAK transport $IMG_T --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+
+$BPAK add $IMG_T --part fs \
+                 --from-file $TEST_SRC_DIR/diff2_target.bin \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+$BPAK set $IMG_T --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+$BPAK sign $IMG_T --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+# Test Transport encoding / decoding
+echo --- Transport encoding ---
+
+$BPAK transport $IMG_T --encode --origin $IMG_O \
+                                --output $IMG_P \
+                                $V
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output $IMG_I \
+                       --output-buffer 64K \
+                       --direct-io \
+                       --drop-cache \
+                       $V
+
+$BPAK compare $IMG_T $IMG_I $V
+
+first_sha256=$(sha256sum $IMG_T | cut -d ' ' -f 1)
+second_sha256=$(sha256sum $IMG_I | cut -d ' ' -f 1)
+
+if [ $first_sha256 != $second_sha256  ];
+then
+    echo "SHA comparison failed $first_sha256 != $second_sha256"
+    exit 1
+fi
+
+# Many flushes with a small buffer
+IMG_I2=${TEST_NAME}_install2.bpak
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output $IMG_I2 \
+                       --output-buffer 4K \
+                       $V
+
+cmp $IMG_T $IMG_I2
+
+# Decoder output written in aligned blocks, without and with the output
+# buffer and with parallel part decoders
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output $IMG_I2 \
+                       --write-block 128K \
+                       $V
+
+cmp $IMG_T $IMG_I2
+
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output $IMG_I2 \
+                       --write-block 5000 \
+                       --output-buffer 64K \
+                       $V
+
+cmp $IMG_T $IMG_I2
+
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output $IMG_I2 \
+                       --write-block 512K \
+                       --jobs 2 \
+                       $V
+
+cmp $IMG_T $IMG_I2
+
+# Decoding over an output that holds the data already only reads it, and
+# only the damaged block is written again
+LOG_S=${TEST_NAME}_skip.log
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output $IMG_I2 \
+                       --skip-unchanged \
+                       --progress \
+                       $V 2> $LOG_S
+
+cmp $IMG_T $IMG_I2
+grep "1572864 bytes out, [0-9]* origin bytes, 1572864 unchanged" $LOG_S
+
+dd if=/dev/zero of=$IMG_I2 bs=64K seek=8 count=1 conv=notrunc
+
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output $IMG_I2 \
+                       --skip-unchanged \
+                       --write-block 64K \
+                       --progress \
+                       $V 2> $LOG_S
+
+cmp $IMG_T $IMG_I2
+grep "1572864 bytes out, [0-9]* origin bytes, 1507328 unchanged" $LOG_S
+
+# Without the progress callback or a hash tree of the part the output is
+# still compared
+IMG_O3=${TEST_NAME}_origin3.bpak
+IMG_T3=${TEST_NAME}_target3.bpak
+IMG_P3=${TEST_NAME}_patch3.bpak
+IMG_I3=${TEST_NAME}_install3.bpak
+
+$BPAK create $IMG_O3 -Y $V
+$BPAK add $IMG_O3 --meta bpak-package --from-string $PKG_UUID \
+                  --encoder uuid $V
+$BPAK transport $IMG_O3 --add --part fs --encoder bsdiff-lzma \
+                                        --decoder bspatch-lzma $V
+$BPAK add $IMG_O3 --part fs \
+                  --from-file $TEST_SRC_DIR/diff2_origin.bin $V
+
+$BPAK create $IMG_T3 -Y $V
+$BPAK add $IMG_T3 --meta bpak-package --from-string $PKG_UUID \
+                  --encoder uuid $V
+$BPAK transport $IMG_T3 --add --part fs --encoder bsdiff-lzma \
+                                        --decoder bspatch-lzma $V
+$BPAK add $IMG_T3 --part fs \
+                  --from-file $TEST_SRC_DIR/diff2_target.bin $V
+
+$BPAK transport $IMG_T3 --encode --origin $IMG_O3 --output $IMG_P3 $V
+$BPAK transport $IMG_P3 --decode --origin $IMG_O3 --output $IMG_I3 $V
+cmp $IMG_T3 $IMG_I3
+
+$BPAK transport $IMG_P3 --decode --origin $IMG_O3 \
+                        --output $IMG_I3 \
+                        --skip-unchanged \
+                        $V > $LOG_S 2>&1
+
+cmp $IMG_T3 $IMG_I3
+grep "1572864 bytes unchanged" $LOG_S
+
+dd if=/dev/zero of=$IMG_I3 bs=64K seek=8 count=1 conv=notrunc
+
+$BPAK transport $IMG_P3 --decode --origin $IMG_O3 \
+                        --output $IMG_I3 \
+                        --skip-unchanged \
+                        --write-block 64K \
+                        $V > $LOG_S 2>&1
+
+cmp $IMG_T3 $IMG_I3
+grep "1507328 bytes unchanged" $LOG_S
+
+# The output buffer must be a multiple of 4 KiB
+if $BPAK transport $IMG_P --decode --origin $IMG_O \
+                          --output $IMG_I2 \
+                          --output-buffer 1000 $V; then
+    echo "Unaligned output buffer was accepted"
+    exit 1
+fi
+
+$BPAK show $IMG_P $V
+$BPAK show $IMG_T $V
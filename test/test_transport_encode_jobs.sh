@@ -0,0 +1,80 @@
+#!/bin/bash
+# Test: test_transport_encode_jobs
+#
+# Description: Create archives with several diffed parts and a copied part
+#       and encode the parts concurrently
+#
+# Purpose: To test that a parallel encode, with and without a memory budget,
+#       produces the same patch as a sequential encode
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_encode_jobs
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_PJ=${TEST_NAME}_patch_jobs.bpak
+IMG_PM=${TEST_NAME}_patch_budget.bpak
+IMG_I=${TEST_NAME}_install.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_copy 16
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK transport $1 --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+    $BPAK transport $1 --add --part p2 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK add $1 --part p0 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part copy --from-file ${TEST_NAME}_copy $V
+    $BPAK add $1 --part p1 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part p2 --from-file $TEST_SRC_DIR/$3 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O diff2_origin.bin diff3_origin.bin
+create_package $IMG_T diff2_target.bin diff3_target.bin
+
+echo --- Transport encoding ---
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_P $V
+
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_PJ \
+                       --encode-jobs 3 $V
+
+# A budget below the size of one suffix array encodes one part at a time
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_PM \
+                       --encode-jobs 3 --memory-budget 1K $V
+
+cmp $IMG_P $IMG_PJ
+cmp $IMG_P $IMG_PM
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_PJ --decode --origin $IMG_O --output $IMG_I $V
+
+$BPAK compare $IMG_T $IMG_I $V
+cmp $IMG_T $IMG_I
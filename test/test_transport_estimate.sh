@@ -0,0 +1,85 @@
+#!/bin/bash
+# Test: test_transport_estimate
+#
+# Description: Transport encode an archive with an LZMA diffed file
+#       system that has a generated hash tree and a heatshrink diffed
+#       part, then estimate the decoding
+#
+# Purpose: To test that the estimate reports the dictionary that the
+#       LZMA stream was encoded with and the sizes that the decoder
+#       really reads and writes
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_estimate
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+set -ex -o pipefail
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+LOG=${TEST_NAME}.log
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+FS_O=${TEST_NAME}_fs_origin.bin
+FS_T=${TEST_NAME}_fs_target.bin
+SALT=${TEST_NAME}_salt.bin
+
+dd if=/dev/urandom of=$FS_O bs=4096 count=512 status=none
+dd if=/dev/urandom of=$SALT bs=32 count=1 status=none
+cp $FS_O $FS_T
+dd if=/dev/urandom of=$FS_T bs=1 count=4096 seek=409600 \
+    conv=notrunc status=none
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+    $BPAK transport $1 --add --part fs --encoder bsdiff-lzma \
+                       --decoder bspatch-lzma --lzma-dict-size 1M $V
+    $BPAK transport $1 --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+    $BPAK transport $1 --add --part p1 --encoder bsdiff \
+                       --decoder bspatch $V
+    $BPAK add $1 --meta merkle-salt --part-ref fs --from-file $SALT $V
+    $BPAK add $1 --part fs --from-file $2 --set-flag dont-hash \
+                 --encoder merkle $V
+    $BPAK add $1 --part p1 --from-file $TEST_SRC_DIR/$3 $V
+    $BPAK set $1 --key-id pb-development --keystore-id pb-internal $V
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O $FS_O diff3_origin.bin
+create_package $IMG_T $FS_T diff3_target.bin
+
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_P $V
+
+$BPAK transport $IMG_P --estimate > $LOG
+cat $LOG
+
+grep "LZMA dictionary: *1048576 bytes" $LOG
+grep -E "Heatshrink window: *[1-9][0-9]* bits" $LOG
+grep "Merkle hash bytes: *$(stat -c %s $FS_T)$" $LOG
+grep "Input bytes: *$(( $(stat -c %s $IMG_P) - 4096 ))$" $LOG
+
+# The dictionary dominates the heap
+heap=$(awk '/Heap size/ { print $3 }' $LOG)
+test $heap -gt 1048576
+test $heap -lt $(( 2 * 1048576 ))
+
+$BPAK transport $IMG_P --decode --origin $IMG_O --output $IMG_I $V
+grep "Output bytes: *$(stat -c %s $IMG_I)$" $LOG
+
+origin=$(awk '/Origin bytes/ { print $3 }' $LOG)
+test $origin -le $(( $(stat -c %s $IMG_I) - 4096 ))
+
+# Only one of the commands at a time
+if $BPAK transport $IMG_P --estimate --analyze; then
+    exit 1
+fi
@@ -0,0 +1,126 @@
+# Test: test_transport_in_place
+#
+# Description: Create archives with parts that should be transport encoded/decoded
+#
+# Purpose: To test that a patch can be decoded over the origin package, in
+#          the file that holds the origin
+#
+
+#!/bin/bash
+BPAK=../src/bpak
+TEST_NAME=test_transport_in_place
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+IMG_N=${TEST_NAME}_normal_patch.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+# Create origin package
+$BPAK create $IMG_O -Y $V
+
+$BPAK add $IMG_O --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+
+$BPAK transport $IMG_O --add --part fs --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+$BPAK transport $IMG_O --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+
+$BPAK add $IMG_O --part fs \
+                 --from-file $TEST_SRC_DIR/diff2_origin.bin \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+$BPAK set $IMG_O --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+$BPAK sign $IMG_O --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+# Create a target package, the arguments are added to the fs transport
+# meta data
+create_target() {
+    IMG=$1
+    shift
+
+    $BPAK create $IMG -Y $V
+
+    $BPAK add $IMG --meta bpak-package --from-string $PKG_UUID \
+                   --encoder uuid $V
+
+    $BPAK transport $IMG --add --part fs --encoder bsdiff-lzma \
+                                         --decoder bspatch-lzma "$@" $V
+
+    $BPAK transport $IMG --add --part fs-hash-tree \
+                         --encoder remove-data \
+                         --decoder merkle-generate $V
+
+    $BPAK add $IMG --part fs \
+                   --from-file $TEST_SRC_DIR/diff2_target.bin \
+                   --set-flag dont-hash \
+                   --encoder merkle $V
+
+    $BPAK set $IMG --key-id pb-development \
+                   --keystore-id pb-internal $V
+
+    $BPAK sign $IMG --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+# The fs part is diffed for a 64 KiB scratch
+create_target $IMG_T --in-place 64K
+
+echo --- Transport encoding ---
+$BPAK transport $IMG_T --encode --origin $IMG_O \
+                                --output $IMG_P \
+                                $V
+
+echo --- Transport decoding in place ---
+cp $IMG_O $IMG_I
+$BPAK transport $IMG_P --decode --output $IMG_I --in-place 64K $V
+
+$BPAK compare $IMG_T $IMG_I $V
+cmp $IMG_T $IMG_I
+
+# The patch is a normal bsdiff stream as well
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output ${TEST_NAME}_install2.bpak \
+                       $V
+
+cmp $IMG_T ${TEST_NAME}_install2.bpak
+
+# A scratch smaller than the one the patch was made for is refused, before
+# the origin is overwritten
+cp $IMG_O $IMG_I
+
+if $BPAK transport $IMG_P --decode --output $IMG_I --in-place 32K $V; then
+    echo "Too small scratch was accepted"
+    exit 1
+fi
+
+cmp $IMG_O $IMG_I
+
+# Parts that are not diffed for in place decoding are refused as well
+IMG_T2=${TEST_NAME}_target2.bpak
+create_target $IMG_T2
+
+$BPAK transport $IMG_T2 --encode --origin $IMG_O \
+                                 --output $IMG_N \
+                                 $V
+
+if $BPAK transport $IMG_N --decode --output $IMG_I --in-place 64K $V; then
+    echo "Patch without in place parts was decoded in place"
+    exit 1
+fi
+
+cmp $IMG_O $IMG_I
@@ -0,0 +1,108 @@
+#!/bin/bash
+# Test: test_transport_install
+#
+# Description: Decode two patches and a package without an origin through
+#       one 'bpak transport --install' pipeline
+#
+# Purpose: To test that the packages of a shared decode pipeline are the
+#       same as from separate decodes
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_install
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T1=${TEST_NAME}_target1.bpak
+IMG_T2=${TEST_NAME}_target2.bpak
+IMG_T3=${TEST_NAME}_target3.bpak
+IMG_P1=${TEST_NAME}_patch1.bpak
+IMG_P2=${TEST_NAME}_patch2.bpak
+IMG_P3=${TEST_NAME}_patch3.bpak
+IMG_I1=${TEST_NAME}_install1.bpak
+IMG_I2=${TEST_NAME}_install2.bpak
+IMG_I3=${TEST_NAME}_install3.bpak
+LIST=${TEST_NAME}_list.txt
+REPLIES=${TEST_NAME}_replies.txt
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK transport $1 --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+    $BPAK add $1 --part p0 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part p1 --from-file $TEST_SRC_DIR/$3 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O diff2_origin.bin diff2_origin.bin
+create_package $IMG_T1 diff2_target.bin diff2_target.bin
+create_package $IMG_T2 diff2_target.bin diff2_origin.bin
+
+# A package with a compressed part that needs no origin
+$BPAK create $IMG_T3 -Y $V
+$BPAK add $IMG_T3 --meta bpak-package --from-string $PKG_UUID \
+                  --encoder uuid $V
+$BPAK transport $IMG_T3 --add --part p0 --encoder compress-heatshrink \
+                                        --decoder decompress-heatshrink $V
+$BPAK add $IMG_T3 --part p0 --from-file $TEST_SRC_DIR/diff2_target.bin $V
+$BPAK set $IMG_T3 --key-id pb-development --keystore-id pb-internal $V
+$BPAK sign $IMG_T3 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+echo --- Transport encoding ---
+$BPAK transport $IMG_T1 --encode --origin $IMG_O --output $IMG_P1 $V
+$BPAK transport $IMG_T2 --encode --origin $IMG_O --output $IMG_P2 $V
+$BPAK transport $IMG_T3 --encode --output $IMG_P3 $V
+
+printf "%s %s %s\n\n%s %s %s\n%s %s\n" $IMG_P1 $IMG_I1 $IMG_O \
+       $IMG_P2 $IMG_I2 $IMG_O $IMG_P3 $IMG_I3 > $LIST
+
+echo --- Transport install ---
+for jobs in 1 2 4; do
+    rm -f $IMG_I1 $IMG_I2 $IMG_I3
+
+    $BPAK transport $LIST --install --jobs $jobs $V > $REPLIES
+
+    cat $REPLIES
+    test $(wc -l < $REPLIES) -eq 3
+    grep -q "^ok $IMG_I1$" $REPLIES
+    grep -q "^ok $IMG_I2$" $REPLIES
+    grep -q "^ok $IMG_I3$" $REPLIES
+
+    cmp $IMG_T1 $IMG_I1
+    cmp $IMG_T2 $IMG_I2
+    cmp $IMG_T3 $IMG_I3
+done
+
+# The list is read from stdin with '-'
+rm -f $IMG_I1 $IMG_I2 $IMG_I3
+$BPAK transport - --install $V < $LIST > $REPLIES
+test $(grep -c "^ok " $REPLIES) -eq 3
+cmp $IMG_T2 $IMG_I2
+
+# A missing input stops the install before anything is decoded
+if printf "%s %s\n" ${TEST_NAME}_missing.bpak $IMG_I1 | \
+    $BPAK transport - --install $V; then
+    exit 1
+fi
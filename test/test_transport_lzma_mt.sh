@@ -0,0 +1,95 @@
+# Test: test_transport_lzma_mt
+#
+# Description: Create archives with parts that should be transport encoded/decoded
+#
+# Purpose: To test that the threaded LZMA encoder writes the same multi-block
+#  stream for any number of jobs and that bspatch-lzma decodes it
+#
+
+#!/bin/bash
+BPAK=../src/bpak
+TEST_NAME=test_transport_lzma_mt
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_P1=${TEST_NAME}_patch1.bpak
+IMG_I=${TEST_NAME}_install.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_package() {
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part fs --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma \
+                                       --lzma-block-size 64K $V
+
+    $BPAK transport $1 --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+
+    $BPAK add $1 --part fs \
+                 --from-file $2 \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O $TEST_SRC_DIR/diff2_origin.bin
+create_package $IMG_T $TEST_SRC_DIR/diff2_target.bin
+
+# Test Transport encoding / decoding
+echo --- Transport encoding ---
+
+$BPAK transport $IMG_T --encode --origin $IMG_O \
+                                --output $IMG_P \
+                                --jobs 4 $V
+
+$BPAK transport $IMG_T --encode --origin $IMG_O \
+                                --output $IMG_P1 \
+                                --jobs 1 $V
+
+# The stream only depends on the block size
+cmp $IMG_P $IMG_P1
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_P --decode --origin $IMG_O \
+                       --output $IMG_I \
+                       $V
+
+$BPAK compare $IMG_T $IMG_I $V
+
+first_sha256=$(sha256sum $IMG_T | cut -d ' ' -f 1)
+second_sha256=$(sha256sum $IMG_I | cut -d ' ' -f 1)
+
+if [ $first_sha256 != $second_sha256  ];
+then
+    echo "SHA comparison failed $first_sha256 != $second_sha256"
+    exit 1
+fi
+
+# Block sizes outside of the limits are rejected
+if $BPAK transport $IMG_T --add --part fs --encoder bsdiff-lzma \
+                          --decoder bspatch-lzma \
+                          --lzma-block-size 48K $V;
+then
+    exit 1
+fi
+
+$BPAK show $IMG_P $V
@@ -0,0 +1,73 @@
+#!/bin/bash
+# Test: test_transport_merkle_reuse
+#
+# Description: Decode an update of a filesystem with a hash tree, where
+#   both versions use the same merkle salt
+#
+# Purpose: Test that the hash tree is built with the origin leaf hashes of
+#   unchanged blocks, and that the installed package matches the target
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_merkle_reuse
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+set -e
+
+IMG_A=${TEST_NAME}_origin.bpak
+IMG_B=${TEST_NAME}_target.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+FS_A=${TEST_NAME}_fs_a.bin
+FS_B=${TEST_NAME}_fs_b.bin
+SALT=${TEST_NAME}_salt.bin
+
+dd if=/dev/urandom of=$FS_A bs=4096 count=512 status=none
+dd if=/dev/urandom of=$SALT bs=32 count=1 status=none
+
+# A few changed blocks, one of them is not aligned
+cp $FS_A $FS_B
+dd if=/dev/urandom of=$FS_B bs=1 count=4096 seek=409600 \
+    conv=notrunc status=none
+dd if=/dev/urandom of=$FS_B bs=1 count=100 seek=1000000 \
+    conv=notrunc status=none
+
+create_package() {
+    $BPAK create $1 -Y $V
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+    $BPAK transport $1 --add --part fs --encoder bsdiff \
+                                       --decoder bspatch $V
+    $BPAK transport $1 --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+    $BPAK add $1 --meta merkle-salt --part-ref fs --from-file $SALT $V
+    $BPAK add $1 --part fs --from-file $2 --set-flag dont-hash \
+                 --encoder merkle $V
+    $BPAK set $1 --key-id pb-development --keystore-id pb-internal $V
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_A $FS_A
+create_package $IMG_B $FS_B
+
+$BPAK transport $IMG_B --encode --origin $IMG_A \
+                       --output ${TEST_NAME}_patch.bpak $V
+
+$BPAK transport ${TEST_NAME}_patch.bpak --decode --origin $IMG_A \
+                       --output ${TEST_NAME}_install.bpak $V \
+                       > ${TEST_NAME}_decode.log
+
+cat ${TEST_NAME}_decode.log
+grep -q "Reused .* origin merkle leaves" ${TEST_NAME}_decode.log
+
+if grep -q "regenerating the tree" ${TEST_NAME}_decode.log; then
+    echo "Reused hash tree did not match"
+    exit 1
+fi
+
+cmp $IMG_B ${TEST_NAME}_install.bpak
+$BPAK verify ${TEST_NAME}_install.bpak \
+             --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
@@ -0,0 +1,75 @@
+#!/bin/bash
+# Test: test_transport_origin_part
+#
+# Description: Transport encode a part against an origin part with
+#   another name
+#
+# Purpose: Test that a new part can be diffed against the data of an
+#   existing origin part, with serial and concurrent encode and decode
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_origin_part
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+set -e
+
+IMG_A=${TEST_NAME}_origin.bpak
+IMG_B=${TEST_NAME}_target.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+LIB_A=${TEST_NAME}_lib_a.bin
+LIB_B=${TEST_NAME}_lib_b.bin
+APP_B=${TEST_NAME}_app_b.bin
+
+dd if=/dev/urandom of=$LIB_A bs=4096 count=128 status=none
+cp $LIB_A $LIB_B
+dd if=/dev/urandom of=$LIB_B bs=1 count=100 seek=30000 \
+    conv=notrunc status=none
+cp $LIB_A $APP_B
+dd if=/dev/urandom of=$APP_B bs=1 count=100 seek=400000 \
+    conv=notrunc status=none
+
+# The origin only has the library
+$BPAK create $IMG_A -Y $V
+$BPAK add $IMG_A --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+$BPAK add $IMG_A --part lib --from-file $LIB_A $V
+$BPAK set $IMG_A --key-id pb-development --keystore-id pb-internal $V
+$BPAK sign $IMG_A --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+# The new application is diffed against the origin library
+$BPAK create $IMG_B -Y $V
+$BPAK add $IMG_B --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+$BPAK transport $IMG_B --add --part lib --encoder bsdiff \
+                       --decoder bspatch $V
+$BPAK transport $IMG_B --add --part app --encoder bsdiff-lzma \
+                       --decoder bspatch-lzma --origin-part lib $V
+$BPAK add $IMG_B --part lib --from-file $LIB_B $V
+$BPAK add $IMG_B --part app --from-file $APP_B $V
+$BPAK set $IMG_B --key-id pb-development --keystore-id pb-internal $V
+$BPAK sign $IMG_B --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+$BPAK transport $IMG_B --encode --origin $IMG_A \
+                       --output ${TEST_NAME}_patch.bpak $V
+
+# Both parts are patches, the package is much smaller than the target
+PATCH_SIZE=$(stat -c %s ${TEST_NAME}_patch.bpak)
+echo "Patch size $PATCH_SIZE"
+[ $PATCH_SIZE -lt 65536 ]
+
+$BPAK transport ${TEST_NAME}_patch.bpak --decode --origin $IMG_A \
+                       --output ${TEST_NAME}_install.bpak $V
+cmp $IMG_B ${TEST_NAME}_install.bpak
+
+$BPAK transport $IMG_B --encode --origin $IMG_A --encode-jobs 2 \
+                       --output ${TEST_NAME}_patch_jobs.bpak $V
+cmp ${TEST_NAME}_patch.bpak ${TEST_NAME}_patch_jobs.bpak
+
+$BPAK transport ${TEST_NAME}_patch.bpak --decode --origin $IMG_A \
+                       --jobs 2 \
+                       --output ${TEST_NAME}_install_jobs.bpak $V
+cmp $IMG_B ${TEST_NAME}_install_jobs.bpak
@@ -0,0 +1,68 @@
+#!/bin/bash
+# Test: test_transport_origin_parts
+#
+# Description: Transport encode a part against several origin parts
+#
+# Purpose: Test that data which moved from one origin part to another
+#   part is found when the diff runs against the origin parts
+#   concatenated, with serial and concurrent encode
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_origin_parts
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+set -e
+
+IMG_A=${TEST_NAME}_origin.bpak
+IMG_B=${TEST_NAME}_target.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+LIB_A=${TEST_NAME}_lib_a.bin
+APP_A=${TEST_NAME}_app_a.bin
+APP_B=${TEST_NAME}_app_b.bin
+
+dd if=/dev/urandom of=$LIB_A bs=4096 count=128 status=none
+dd if=/dev/urandom of=$APP_A bs=4096 count=64 status=none
+
+# The new application links in the library that used to be separate
+cat $APP_A $LIB_A > $APP_B
+dd if=/dev/urandom of=$APP_B bs=1 count=100 seek=600000 \
+    conv=notrunc status=none
+
+$BPAK create $IMG_A -Y $V
+$BPAK add $IMG_A --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+$BPAK add $IMG_A --part app --from-file $APP_A $V
+$BPAK add $IMG_A --part lib --from-file $LIB_A $V
+$BPAK set $IMG_A --key-id pb-development --keystore-id pb-internal $V
+$BPAK sign $IMG_A --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+$BPAK create $IMG_B -Y $V
+$BPAK add $IMG_B --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+$BPAK transport $IMG_B --add --part app --encoder bsdiff-lzma \
+                       --decoder bspatch-lzma --origin-part app \
+                       --origin-part lib $V
+$BPAK add $IMG_B --part app --from-file $APP_B $V
+$BPAK set $IMG_B --key-id pb-development --keystore-id pb-internal $V
+$BPAK sign $IMG_B --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+$BPAK show $IMG_B $V
+
+$BPAK transport $IMG_B --encode --origin $IMG_A \
+                       --output ${TEST_NAME}_patch.bpak $V
+
+# Both origin parts are reused, the package is much smaller than the target
+PATCH_SIZE=$(stat -c %s ${TEST_NAME}_patch.bpak)
+echo "Patch size $PATCH_SIZE"
+[ $PATCH_SIZE -lt 65536 ]
+
+$BPAK transport ${TEST_NAME}_patch.bpak --decode --origin $IMG_A \
+                       --output ${TEST_NAME}_install.bpak $V
+cmp $IMG_B ${TEST_NAME}_install.bpak
+
+$BPAK transport $IMG_B --encode --origin $IMG_A --encode-jobs 2 \
+                       --output ${TEST_NAME}_patch_jobs.bpak $V
+cmp ${TEST_NAME}_patch.bpak ${TEST_NAME}_patch_jobs.bpak
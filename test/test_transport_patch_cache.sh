@@ -0,0 +1,88 @@
+#!/bin/bash
+# Test: test_transport_patch_cache
+#
+# Description: Encode a target twice with a patch cache, then encode a
+#       target where only one part changed
+#
+# Purpose: To test that cached parts are copied into the output instead of
+#       being encoded again and that the patches are unchanged
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_patch_cache
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T1=${TEST_NAME}_target1.bpak
+IMG_T2=${TEST_NAME}_target2.bpak
+IMG_P1=${TEST_NAME}_patch1.bpak
+IMG_P2=${TEST_NAME}_patch2.bpak
+IMG_C1=${TEST_NAME}_cached1.bpak
+IMG_C2=${TEST_NAME}_cached2.bpak
+IMG_I=${TEST_NAME}_install.bpak
+CACHE=${TEST_NAME}_cache
+HIT="is in the patch cache"
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK transport $1 --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+    $BPAK add $1 --part p0 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part p1 --from-file $TEST_SRC_DIR/$3 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O diff2_origin.bin diff3_origin.bin
+create_package $IMG_T1 diff2_target.bin diff3_target.bin
+create_package $IMG_T2 diff2_target.bin diff2_target.bin
+
+rm -rf $CACHE
+mkdir $CACHE
+
+echo --- Transport encoding ---
+$BPAK transport $IMG_T1 --encode --origin $IMG_O --output $IMG_P1 $V
+$BPAK transport $IMG_T2 --encode --origin $IMG_O --output $IMG_P2 $V
+
+$BPAK transport $IMG_T1 --encode --origin $IMG_O --output $IMG_C1 \
+                        --patch-cache-dir $CACHE $V > ${TEST_NAME}_log1.txt
+test $(grep -c "$HIT" ${TEST_NAME}_log1.txt) -eq 0
+test $(ls $CACHE/*.patch | wc -l) -eq 2
+
+$BPAK transport $IMG_T1 --encode --origin $IMG_O --output $IMG_C1 \
+                        --patch-cache-dir $CACHE $V > ${TEST_NAME}_log2.txt
+test $(grep -c "$HIT" ${TEST_NAME}_log2.txt) -eq 2
+
+# Only p1 changed, p0 is taken from the cache
+$BPAK transport $IMG_T2 --encode --origin $IMG_O --output $IMG_C2 \
+                        --patch-cache-dir $CACHE $V > ${TEST_NAME}_log3.txt
+test $(grep -c "$HIT" ${TEST_NAME}_log3.txt) -eq 1
+test $(ls $CACHE/*.patch | wc -l) -eq 3
+
+cmp $IMG_P1 $IMG_C1
+cmp $IMG_P2 $IMG_C2
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_C2 --decode --origin $IMG_O --output $IMG_I $V
+cmp $IMG_T2 $IMG_I
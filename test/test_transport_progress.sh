@@ -0,0 +1,82 @@
+#!/bin/bash
+# Test: test_transport_progress
+#
+# Description: Transport encode and decode an archive with several diffed
+#       parts and a copied part with progress reporting
+#
+# Purpose: To test that every part is reported once it is done and that
+#       the progress callbacks don't change the patch or the result
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_progress
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex -o pipefail
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_PP=${TEST_NAME}_patch_progress.bpak
+IMG_I=${TEST_NAME}_install.bpak
+LOG_E=${TEST_NAME}_encode.log
+LOG_D=${TEST_NAME}_decode.log
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_copy 16
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK transport $1 --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+    $BPAK add $1 --part p0 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part copy --from-file ${TEST_NAME}_copy $V
+    $BPAK add $1 --part p1 --from-file $TEST_SRC_DIR/$3 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O diff2_origin.bin diff3_origin.bin
+create_package $IMG_T diff2_target.bin diff3_target.bin
+
+echo --- Transport encoding ---
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_P
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_PP \
+                       --progress 2> $LOG_E
+cat $LOG_E
+cmp $IMG_P $IMG_PP
+
+# Only the two diffed parts are encoded
+test $(grep -c "^Part 0x" $LOG_E) -eq 2
+test $(grep -c " 0 bytes out" $LOG_E) -eq 0
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_PP --decode --origin $IMG_O --output $IMG_I \
+                        --progress 2> $LOG_D
+cat $LOG_D
+
+# Every part is decoded, the copied part reads no origin data
+test $(grep -c "^Part 0x" $LOG_D) -eq 3
+test $(grep -c " 0 origin bytes" $LOG_D) -eq 1
+grep "16384 bytes in, 16384 bytes out, 0 origin bytes" $LOG_D
+
+$BPAK compare $IMG_T $IMG_I $V
+cmp $IMG_T $IMG_I
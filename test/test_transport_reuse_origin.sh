@@ -0,0 +1,76 @@
+#!/bin/bash
+# Test: test_transport_reuse_origin
+#
+# Description: Transport encode a package where one part did not change
+#
+# Purpose: Test that a part that is identical to its origin part is not
+#   diffed, no data is stored for it and the decoder copies the origin
+#   part, with serial and concurrent encode and decode
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_reuse_origin
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+set -e
+
+IMG_A=${TEST_NAME}_origin.bpak
+IMG_B=${TEST_NAME}_target.bpak
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+FS_A=${TEST_NAME}_fs_a.bin
+FS_B=${TEST_NAME}_fs_b.bin
+LIB=${TEST_NAME}_lib.bin
+
+dd if=/dev/urandom of=$FS_A bs=4096 count=256 status=none
+cp $FS_A $FS_B
+dd if=/dev/urandom of=$FS_B bs=1 count=100 seek=30000 \
+    conv=notrunc status=none
+dd if=/dev/urandom of=$LIB bs=4096 count=512 status=none
+
+$BPAK create $IMG_A -Y $V
+$BPAK add $IMG_A --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+$BPAK add $IMG_A --part fs --from-file $FS_A $V
+$BPAK add $IMG_A --part lib --from-file $LIB $V
+$BPAK set $IMG_A --key-id pb-development --keystore-id pb-internal $V
+$BPAK sign $IMG_A --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+$BPAK create $IMG_B -Y $V
+$BPAK add $IMG_B --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+$BPAK transport $IMG_B --add --part fs --encoder bsdiff \
+                       --decoder bspatch $V
+$BPAK transport $IMG_B --add --part lib --encoder bsdiff-lzma \
+                       --decoder bspatch-lzma $V
+$BPAK add $IMG_B --part fs --from-file $FS_B $V
+$BPAK add $IMG_B --part lib --from-file $LIB $V
+$BPAK set $IMG_B --key-id pb-development --keystore-id pb-internal $V
+$BPAK sign $IMG_B --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+$BPAK transport $IMG_B --encode --origin $IMG_A \
+                       --output ${TEST_NAME}_patch.bpak $V
+
+# The unchanged part is flagged and has no data
+$BPAK show ${TEST_NAME}_patch.bpak | grep -E "^ +[0-9a-f]{8} .* -T-R" \
+    > ${TEST_NAME}_reused.txt
+cat ${TEST_NAME}_reused.txt
+[ $(wc -l < ${TEST_NAME}_reused.txt) -eq 1 ]
+[ "$(awk '{print $5}' ${TEST_NAME}_reused.txt)" = "0" ]
+
+$BPAK transport ${TEST_NAME}_patch.bpak --decode --origin $IMG_A \
+                       --output ${TEST_NAME}_install.bpak $V
+cmp $IMG_B ${TEST_NAME}_install.bpak
+$BPAK verify ${TEST_NAME}_install.bpak \
+             --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+
+$BPAK transport $IMG_B --encode --origin $IMG_A --encode-jobs 2 \
+                       --output ${TEST_NAME}_patch_jobs.bpak $V
+cmp ${TEST_NAME}_patch.bpak ${TEST_NAME}_patch_jobs.bpak
+
+$BPAK transport ${TEST_NAME}_patch.bpak --decode --origin $IMG_A \
+                       --jobs 2 \
+                       --output ${TEST_NAME}_install_jobs.bpak $V
+cmp $IMG_B ${TEST_NAME}_install_jobs.bpak
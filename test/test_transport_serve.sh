@@ -0,0 +1,84 @@
+#!/bin/bash
+# Test: test_transport_serve
+#
+# Description: Encode two targets and a missing package against one origin
+#       through the requests of 'bpak transport --serve'
+#
+# Purpose: To test that the origin indexes of a serve session are reused and
+#       that the patches are the same as from separate encodes
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_serve
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T1=${TEST_NAME}_target1.bpak
+IMG_T2=${TEST_NAME}_target2.bpak
+IMG_P1=${TEST_NAME}_patch1.bpak
+IMG_P2=${TEST_NAME}_patch2.bpak
+IMG_S1=${TEST_NAME}_serve1.bpak
+IMG_S2=${TEST_NAME}_serve2.bpak
+IMG_I=${TEST_NAME}_install.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK transport $1 --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+    $BPAK add $1 --part p0 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part p1 --from-file $TEST_SRC_DIR/$3 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O diff2_origin.bin diff2_origin.bin
+create_package $IMG_T1 diff2_target.bin diff2_target.bin
+create_package $IMG_T2 diff2_target.bin diff2_origin.bin
+
+echo --- Transport encoding ---
+$BPAK transport $IMG_T1 --encode --origin $IMG_O --output $IMG_P1 $V
+$BPAK transport $IMG_T2 --encode --origin $IMG_O --output $IMG_P2 $V
+
+printf "%s %s\n\nmissing.bpak %s\n%s %s\n" $IMG_T1 $IMG_S1 \
+       ${TEST_NAME}_missing.bpak $IMG_T2 $IMG_S2 | \
+    $BPAK transport $IMG_O --serve $V \
+        > ${TEST_NAME}_replies.txt 2> ${TEST_NAME}_log.txt
+
+cat ${TEST_NAME}_replies.txt
+test $(wc -l < ${TEST_NAME}_replies.txt) -eq 3
+grep -q "^ok $IMG_S1$" ${TEST_NAME}_replies.txt
+grep -q "^error -[0-9]* ${TEST_NAME}_missing.bpak$" ${TEST_NAME}_replies.txt
+grep -q "^ok $IMG_S2$" ${TEST_NAME}_replies.txt
+
+# Both origin parts hold the same data, so only the first diff builds an
+# index. p1 of the second target equals its origin and is not diffed.
+test $(grep -c "Using the origin index of the encode session" \
+       ${TEST_NAME}_log.txt) -eq 2
+
+cmp $IMG_P1 $IMG_S1
+cmp $IMG_P2 $IMG_S2
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_S2 --decode --origin $IMG_O --output $IMG_I $V
+cmp $IMG_T2 $IMG_I
@@ -0,0 +1,79 @@
+#!/bin/bash
+# Test: test_transport_stream
+#
+# Description: Create archives with several diffed parts and a copied part
+#       and transport encode them to a pipe
+#
+# Purpose: To test that a streaming encode to stdout produces the same patch
+#       as an encode to a file
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_stream
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex -o pipefail
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_PS=${TEST_NAME}_patch_stream.bpak
+IMG_PJ=${TEST_NAME}_patch_jobs.bpak
+IMG_I=${TEST_NAME}_install.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_copy 16
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part p0 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK transport $1 --add --part p1 --encoder bsdiff \
+                                       --decoder bspatch $V
+
+    $BPAK transport $1 --add --part p2 --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK add $1 --part p0 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part copy --from-file ${TEST_NAME}_copy $V
+    $BPAK add $1 --part p1 --from-file $TEST_SRC_DIR/$2 $V
+    $BPAK add $1 --part p2 --from-file $TEST_SRC_DIR/$3 $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O diff2_origin.bin diff3_origin.bin
+create_package $IMG_T diff2_target.bin diff3_target.bin
+
+echo --- Transport encoding ---
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_P $V
+
+# The verbose output must not end up in the stream
+$BPAK transport $IMG_T --encode --origin $IMG_O --output - $V | cat > $IMG_PS
+
+$BPAK transport $IMG_T --encode --origin $IMG_O --output - \
+                       --encode-jobs 3 | cat > $IMG_PJ
+
+cmp $IMG_P $IMG_PS
+cmp $IMG_P $IMG_PJ
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_PS --decode --origin $IMG_O --output $IMG_I $V
+
+$BPAK compare $IMG_T $IMG_I $V
+cmp $IMG_T $IMG_I
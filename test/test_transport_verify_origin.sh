@@ -0,0 +1,105 @@
+#!/bin/bash
+# Test: test_transport_verify_origin
+#
+# Description: Decode a patch of a filesystem with a hash tree while the
+#       origin reads are checked against the origin tree, then again with
+#       one corrupt byte in the origin filesystem
+#
+# Purpose: To test that a valid origin decodes to the target, that a
+#       corrupt origin block is found by the decoder and that an origin
+#       without a hash tree is refused
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_transport_verify_origin
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -ex
+
+$BPAK --version
+
+IMG_O=${TEST_NAME}_origin.bpak
+IMG_C=${TEST_NAME}_corrupt.bpak
+IMG_T=${TEST_NAME}_target.bpak
+IMG_P=${TEST_NAME}_patch.bpak
+IMG_I=${TEST_NAME}_install.bpak
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_package()
+{
+    $BPAK create $1 -Y $V
+
+    $BPAK add $1 --meta bpak-package --from-string $PKG_UUID \
+                 --encoder uuid $V
+
+    $BPAK transport $1 --add --part fs --encoder bsdiff-lzma \
+                                       --decoder bspatch-lzma $V
+
+    $BPAK transport $1 --add --part fs-hash-tree \
+                       --encoder remove-data \
+                       --decoder merkle-generate $V
+
+    $BPAK add $1 --part fs --from-file $TEST_SRC_DIR/$2 \
+                 --set-flag dont-hash \
+                 --encoder merkle $V
+
+    $BPAK set $1 --key-id pb-development \
+                 --keystore-id pb-internal $V
+
+    $BPAK sign $1 --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+}
+
+create_package $IMG_O diff2_origin.bin
+create_package $IMG_T diff2_target.bin
+
+echo --- Transport encoding ---
+$BPAK transport $IMG_T --encode --origin $IMG_O --output $IMG_P $V
+
+echo --- Transport decoding ---
+$BPAK transport $IMG_P --decode --origin $IMG_O --output $IMG_I \
+                       --verify-origin $V
+cmp $IMG_T $IMG_I
+
+# The filesystem is the first part, its data follows the 4 KiB header
+cp $IMG_O $IMG_C
+printf 'X' | dd of=$IMG_C bs=1 seek=$(( 4096 + 1000 )) conv=notrunc
+
+rm -f $IMG_I
+if $BPAK transport $IMG_P --decode --origin $IMG_C --output $IMG_I \
+                          --verify-origin $V 2> ${TEST_NAME}_log.txt; then
+    exit 1
+fi
+
+cat ${TEST_NAME}_log.txt
+grep -q "Block 0 of the origin of part .* does not match its hash tree" \
+    ${TEST_NAME}_log.txt
+
+# An origin part without a hash tree can't be verified
+IMG_O2=${TEST_NAME}_origin2.bpak
+IMG_T2=${TEST_NAME}_target2.bpak
+IMG_P2=${TEST_NAME}_patch2.bpak
+
+for img in $IMG_O2 $IMG_T2; do
+    $BPAK create $img -Y $V
+    $BPAK add $img --meta bpak-package --from-string $PKG_UUID \
+                   --encoder uuid $V
+    $BPAK transport $img --add --part p0 --encoder bsdiff \
+                                         --decoder bspatch $V
+done
+
+$BPAK add $IMG_O2 --part p0 --from-file $TEST_SRC_DIR/diff2_origin.bin $V
+$BPAK add $IMG_T2 --part p0 --from-file $TEST_SRC_DIR/diff2_target.bin $V
+$BPAK transport $IMG_T2 --encode --origin $IMG_O2 --output $IMG_P2 $V
+
+rm -f $IMG_I
+if $BPAK transport $IMG_P2 --decode --origin $IMG_O2 --output $IMG_I \
+                           --verify-origin $V 2> ${TEST_NAME}_log.txt; then
+    exit 1
+fi
+
+cat ${TEST_NAME}_log.txt
+grep -q "has no hash tree to verify it with" ${TEST_NAME}_log.txt
@@ -0,0 +1,80 @@
+#!/bin/bash
+# Test: test_verify_batch
+#
+# Description: This test signs several archives with the same key and
+#  verifies them with one bpak verify call, sequentially and on several
+#  threads, with a key file and with a keystore.
+#
+# Purpose: To ensure that batch verification reports every archive and
+#  fails when one of the archives is corrupt.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_verify_batch
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-v
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -e
+
+$BPAK --version
+
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+KEYSTORE=${TEST_NAME}_keystore.bpak
+IMGS=""
+
+$BPAK create $KEYSTORE -Y
+$BPAK add $KEYSTORE --meta bpak-package --from-string $PKG_UUID \
+                    --encoder uuid $V
+$BPAK add $KEYSTORE --meta keystore-provider-id --from-string pb-internal \
+                    --encoder id $V
+$BPAK add $KEYSTORE --part pb-development \
+                    --from-file $TEST_SRC_DIR/secp256r1-pub-key.pem \
+                    --encoder key $V
+
+for n in 1 2 3 4 5; do
+    IMG=${TEST_NAME}_$n.bpak
+
+    create_data ${TEST_NAME}_data_$n.bin 32
+
+    $BPAK create $IMG -Y $V
+    $BPAK add $IMG --meta bpak-package --from-string $PKG_UUID \
+                   --encoder uuid $V
+    $BPAK add $IMG --part fs \
+                   --from-file ${TEST_NAME}_data_$n.bin \
+                   --encoder merkle $V
+    $BPAK set $IMG --key-id pb-development \
+                   --keystore-id pb-internal $V
+    $BPAK sign $IMG --key $TEST_SRC_DIR/secp256r1-key-pair.pem $V
+
+    IMGS="$IMGS $IMG"
+done
+
+echo VERIFY
+$BPAK verify $IMGS --key $TEST_SRC_DIR/secp256r1-pub-key.der $V
+$BPAK verify $IMGS --key $TEST_SRC_DIR/secp256r1-pub-key.der --jobs 3 $V
+$BPAK verify $IMGS --key $TEST_SRC_DIR/secp256r1-pub-key.der --jobs 0 $V
+$BPAK verify $IMGS --keystore $KEYSTORE --jobs 2 $V
+
+# Corrupt the data of the third archive, 4KiB header + 16KiB
+dd if=/dev/zero of=${TEST_NAME}_3.bpak bs=1 seek=20480 count=16 conv=notrunc
+
+set +e
+$BPAK verify $IMGS --key $TEST_SRC_DIR/secp256r1-pub-key.der --jobs 3 \
+    > ${TEST_NAME}_result.txt
+result_code=$?
+set -e
+
+cat ${TEST_NAME}_result.txt
+
+if [ $result_code -eq 0 ]; then
+    exit 1
+fi
+
+# The other archives are still reported as good
+if [ $(grep -c "Verification OK" ${TEST_NAME}_result.txt) -ne 4 ]; then
+    exit 1
+fi
+
+echo $TEST_NAME End
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bpak/bpak.h>
+#include <bpak/pkg.h>
+#include <bpak/id.h>
+#include <bpak/crypto.h>
+#include <bpak/verify_boot.h>
+#include "nala.h"
+
+static uint8_t data[70000];
+static uint8_t chunk[65536];
+static unsigned int read_calls;
+
+static ssize_t read_payload(off_t offset, uint8_t *buf, size_t size,
+                            void *user)
+{
+    struct bpak_package *pkg = (struct bpak_package *)user;
+
+    read_calls++;
+
+    if (bpak_pkg_read_at(pkg, offset, buf, size) != BPAK_OK)
+        return -BPAK_READ_ERROR;
+
+    return size;
+}
+
+static void create_package(const char *filename)
+{
+    int rc;
+    struct bpak_pkg_builder builder;
+    FILE *fp = fopen("test_verify_boot_data.bin", "wb");
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (i * 7) ^ (i >> 9);
+
+    fwrite(data, 1, sizeof(data), fp);
+    fclose(fp);
+
+    rc = bpak_pkg_builder_init(&builder,
+                               filename,
+                               BPAK_HASH_SHA256,
+                               BPAK_SIGN_PRIME256v1,
+                               false);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_add_file(&builder,
+                                   "test_verify_boot_data.bin",
+                                   "data",
+                                   0);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_builder_finish(&builder,
+                                 TEST_SRC_DIR "/secp256r1-key-pair.pem");
+    ASSERT_EQ(rc, BPAK_OK);
+    bpak_pkg_builder_free(&builder);
+}
+
+static int verify_boot(struct bpak_package *pkg, struct bpak_key *key,
+                       size_t chunk_size)
+{
+    struct bpak_verify_boot_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.chunk = chunk;
+    ctx.chunk_size = chunk_size;
+    read_calls = 0;
+
+    return bpak_verify_boot(&ctx,
+                            &pkg->header,
+                            key,
+                            read_payload,
+                            sizeof(struct bpak_header),
+                            pkg);
+}
+
+TEST(verify_boot_chunk_sizes)
+{
+    int rc;
+    struct bpak_package pkg;
+    struct bpak_key *key = NULL;
+    size_t chunk_sizes[] = {1, 100, 513, 4096, 65536};
+
+    create_package("test_verify_boot.bpak");
+
+    rc = bpak_crypto_load_public_key(TEST_SRC_DIR "/secp256r1-pub-key.der",
+                                     &key);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_open(&pkg, "test_verify_boot.bpak", "rb");
+    ASSERT_EQ(rc, BPAK_OK);
+
+    for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]);
+         i++) {
+        ASSERT_EQ(verify_boot(&pkg, key, chunk_sizes[i]), BPAK_OK);
+    }
+
+    /* The 70000 byte part is read in two chunks */
+    ASSERT_EQ(read_calls, 2);
+
+    ASSERT_EQ(verify_boot(&pkg, key, 0), -BPAK_BUFFER_TOO_SMALL);
+
+    free(key);
+    bpak_pkg_close(&pkg);
+}
+
+TEST(verify_boot_corrupt)
+{
+    int rc;
+    struct bpak_package pkg;
+    struct bpak_key *key = NULL;
+    uint8_t byte;
+
+    create_package("test_verify_boot2.bpak");
+
+    rc = bpak_crypto_load_public_key(TEST_SRC_DIR "/secp256r1-pub-key.der",
+                                     &key);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    rc = bpak_pkg_open(&pkg, "test_verify_boot2.bpak", "r+b");
+    ASSERT_EQ(rc, BPAK_OK);
+
+    /* Payload */
+    rc = bpak_pkg_read_at(&pkg, sizeof(struct bpak_header) + 1000, &byte, 1);
+    ASSERT_EQ(rc, BPAK_OK);
+    byte ^= 0x01;
+    rc = bpak_pkg_write_at(&pkg, sizeof(struct bpak_header) + 1000, &byte, 1);
+    ASSERT_EQ(rc, BPAK_OK);
+
+    ASSERT_EQ(verify_boot(&pkg, key, 4096), -BPAK_BAD_PAYLOAD_HASH);
+
+    /* Signed header */
+    pkg.header.payload_hash[0] ^= 0x01;
+    ASSERT_EQ(verify_boot(&pkg, key, 4096), -BPAK_VERIFY_FAIL);
+
+    free(key);
+    bpak_pkg_close(&pkg);
+}
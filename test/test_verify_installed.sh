@@ -0,0 +1,87 @@
+#!/bin/bash
+# Test: test_verify_installed
+#
+# Description: This test installs the parts of a signed archive in
+#  separate files and verifies them in place against the package header.
+#
+# Purpose: To ensure that installed parts are checked with their part
+#  digests and merkle trees, and that a corrupt slot is found.
+#
+
+BPAK=../src/bpak
+TEST_NAME=test_verify_installed
+TEST_SRC_DIR=$1/test
+source $TEST_SRC_DIR/common.sh
+V=-vvv
+echo $TEST_NAME Begin
+echo $TEST_SRC_DIR
+set -e
+
+$BPAK --version
+
+IMG=${TEST_NAME}.bpak
+PUB_KEY=$TEST_SRC_DIR/secp256r1-pub-key.der
+PKG_UUID=0888b0fa-9c48-4524-9845-06a641b61edd
+
+create_data ${TEST_NAME}_fs.bin 128
+create_data ${TEST_NAME}_data.bin 64
+
+echo $TEST_NAME Creating package
+$BPAK create $IMG -Y $V
+$BPAK add $IMG --meta bpak-package --from-string $PKG_UUID --encoder uuid $V
+$BPAK add $IMG --part fs \
+                 --from-file ${TEST_NAME}_fs.bin \
+                 --encoder merkle $V
+$BPAK add $IMG --part data \
+                 --from-file ${TEST_NAME}_data.bin $V
+$BPAK set $IMG --key-id pb-development \
+                 --keystore-id pb-internal $V
+$BPAK sign $IMG --key $TEST_SRC_DIR/secp256r1-key-pair.pem --part-digests $V
+
+# The hash tree goes to its own slot and 'data' to an offset of a slot
+$BPAK extract $IMG --part fs-hash-tree --output ${TEST_NAME}_tree.bin $V
+dd if=/dev/urandom of=${TEST_NAME}_slot.bin bs=4096 count=1
+cat ${TEST_NAME}_data.bin >> ${TEST_NAME}_slot.bin
+
+INSTALLED="--installed fs:${TEST_NAME}_fs.bin \
+           --installed fs-hash-tree:${TEST_NAME}_tree.bin \
+           --installed data:${TEST_NAME}_slot.bin:4096"
+
+echo VERIFY
+$BPAK verify $IMG --key $PUB_KEY $INSTALLED $V
+$BPAK verify $IMG --key $PUB_KEY $INSTALLED --jobs 0 $V
+
+# Without the hash tree slot 'fs' is only checked with its part digest
+$BPAK verify $IMG --key $PUB_KEY --installed fs:${TEST_NAME}_fs.bin $V
+
+# Corrupt 'offset' of 'file' and check that verification fails
+verify_corrupt() {
+    cp $1 ${TEST_NAME}_corrupt.bin
+    dd if=/dev/zero of=${TEST_NAME}_corrupt.bin bs=1 seek=$2 count=16 \
+        conv=notrunc
+
+    set +e
+    $BPAK verify $IMG --key $PUB_KEY \
+        --installed $3:${TEST_NAME}_corrupt.bin$4 $V
+    result_code=$?
+    set -e
+
+    if [ $result_code -eq 0 ]; then
+        exit 1
+    fi
+}
+
+verify_corrupt ${TEST_NAME}_fs.bin 70000 fs
+verify_corrupt ${TEST_NAME}_slot.bin 8192 data :4096
+
+# An unknown part is an error
+set +e
+$BPAK verify $IMG --key $PUB_KEY --installed kernel:${TEST_NAME}_fs.bin $V
+result_code=$?
+set -e
+
+if [ $result_code -eq 0 ]; then
+    exit 1
+fi
+
+echo $TEST_NAME End